@@ -0,0 +1,757 @@
+// oclgrind-bench.cpp (Oclgrind)
+// Copyright (c) 2013-2019, James Price and Simon McIntosh-Smith,
+// University of Bristol. All rights reserved.
+//
+// This program is provided under a three-clause BSD license. For full
+// license terms please see the LICENSE file distributed with this
+// source code.
+
+#include "config.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "core/common.h"
+#include "core/Context.h"
+#include "core/Kernel.h"
+#include "core/KernelInvocation.h"
+#include "core/Memory.h"
+#include "core/Plugin.h"
+#include "core/Program.h"
+
+using namespace oclgrind;
+using namespace std;
+
+// Kernel run by a benchmark, which is always called 'bench' and takes a
+// single buffer of 2*globalSize uints (the first half initialised to
+// 0,1,2,..., the second half left for the kernel to write results to)
+struct Benchmark
+{
+  const char* name;
+  const char* category;
+  const char* source;
+  size_t globalSize;
+  size_t localSize;
+  unsigned launches;
+};
+
+static const Benchmark benchmarks[] = {
+  {"int-arith", "dispatch",
+   "kernel void bench(global uint *data)                       \n"
+   "{                                                          \n"
+   "  uint i = get_global_id(0);                               \n"
+   "  uint x = data[i];                                        \n"
+   "  for (uint n = 0; n < 256; n++)                           \n"
+   "  {                                                        \n"
+   "    x = x * 1664525u + 1013904223u;                        \n"
+   "    x ^= x >> 13;                                          \n"
+   "    x += (x << 3) | n;                                     \n"
+   "  }                                                        \n"
+   "  data[get_global_size(0) + i] = x;                        \n"
+   "}                                                          \n",
+   4096, 64, 1},
+  {"float-arith", "dispatch",
+   "kernel void bench(global uint *data)                       \n"
+   "{                                                          \n"
+   "  uint i = get_global_id(0);                               \n"
+   "  float x = data[i];                                       \n"
+   "  float y = 1.0f;                                          \n"
+   "  for (uint n = 0; n < 256; n++)                           \n"
+   "  {                                                        \n"
+   "    y = y * 0.999f + x;                                    \n"
+   "    x = x / (y + 1.0f) - 0.5f;                             \n"
+   "  }                                                        \n"
+   "  data[get_global_size(0) + i] = as_uint(x + y);           \n"
+   "}                                                          \n",
+   4096, 64, 1},
+  {"global-memory", "dispatch",
+   "kernel void bench(global uint *data)                       \n"
+   "{                                                          \n"
+   "  uint i = get_global_id(0);                               \n"
+   "  uint n = get_global_size(0);                             \n"
+   "  uint sum = 0;                                            \n"
+   "  for (uint j = 0; j < 64; j++)                            \n"
+   "    sum += data[(i + j * 67) % n];                         \n"
+   "  data[n + i] = sum;                                       \n"
+   "}                                                          \n",
+   4096, 64, 1},
+  {"control-flow", "dispatch",
+   "kernel void bench(global uint *data)                       \n"
+   "{                                                          \n"
+   "  uint i = get_global_id(0);                               \n"
+   "  uint x = data[i];                                        \n"
+   "  for (uint n = 0; n < 256; n++)                           \n"
+   "  {                                                        \n"
+   "    switch (x & 3)                                         \n"
+   "    {                                                      \n"
+   "    case 0: x += 7; break;                                 \n"
+   "    case 1: x *= 3; break;                                 \n"
+   "    case 2: x ^= n; break;                                 \n"
+   "    default: x >>= 1;                                      \n"
+   "    }                                                      \n"
+   "    if (x > 1000000)                                       \n"
+   "      x -= 999999;                                         \n"
+   "  }                                                        \n"
+   "  data[get_global_size(0) + i] = x;                        \n"
+   "}                                                          \n",
+   4096, 64, 1},
+  // Kernels dominated by a single kind of instruction, to measure the
+  // dispatch of each (loop-carried dependencies keep them from being folded)
+  {"op-int-add", "dispatch",
+   "kernel void bench(global uint *data)                       \n"
+   "{                                                          \n"
+   "  uint i = get_global_id(0);                               \n"
+   "  uint x = data[i], y = x + 1;                             \n"
+   "  for (uint n = 0; n < 256; n++)                           \n"
+   "  {                                                        \n"
+   "    x = x + y;                                             \n"
+   "    y = y - x;                                             \n"
+   "    x = x + n;                                             \n"
+   "  }                                                        \n"
+   "  data[get_global_size(0) + i] = x + y;                    \n"
+   "}                                                          \n",
+   4096, 64, 1},
+  {"op-int-mul", "dispatch",
+   "kernel void bench(global uint *data)                       \n"
+   "{                                                          \n"
+   "  uint i = get_global_id(0);                               \n"
+   "  uint x = data[i] | 1, y = x + 2;                         \n"
+   "  for (uint n = 0; n < 256; n++)                           \n"
+   "  {                                                        \n"
+   "    x = x * y;                                             \n"
+   "    y = y * x;                                             \n"
+   "  }                                                        \n"
+   "  data[get_global_size(0) + i] = x ^ y;                    \n"
+   "}                                                          \n",
+   4096, 64, 1},
+  {"op-int-bitwise", "dispatch",
+   "kernel void bench(global uint *data)                       \n"
+   "{                                                          \n"
+   "  uint i = get_global_id(0);                               \n"
+   "  uint x = data[i], y = ~x;                                \n"
+   "  for (uint n = 0; n < 256; n++)                           \n"
+   "  {                                                        \n"
+   "    x = (x ^ y) | n;                                       \n"
+   "    y = (y & x) ^ n;                                       \n"
+   "  }                                                        \n"
+   "  data[get_global_size(0) + i] = x ^ y;                    \n"
+   "}                                                          \n",
+   4096, 64, 1},
+  {"op-int-shift", "dispatch",
+   "kernel void bench(global uint *data)                       \n"
+   "{                                                          \n"
+   "  uint i = get_global_id(0);                               \n"
+   "  uint x = data[i], y = x + 1;                             \n"
+   "  for (uint n = 0; n < 256; n++)                           \n"
+   "  {                                                        \n"
+   "    x = (x >> 1) ^ (y << 2);                               \n"
+   "    y = (y >> 3) ^ (x << 1);                               \n"
+   "  }                                                        \n"
+   "  data[get_global_size(0) + i] = x ^ y;                    \n"
+   "}                                                          \n",
+   4096, 64, 1},
+  {"op-int-compare", "dispatch",
+   "kernel void bench(global uint *data)                       \n"
+   "{                                                          \n"
+   "  uint i = get_global_id(0);                               \n"
+   "  uint x = data[i], y = 4096 - x;                          \n"
+   "  for (uint n = 0; n < 256; n++)                           \n"
+   "  {                                                        \n"
+   "    x = x > y ? x - y : y - x;                             \n"
+   "    y = y < n ? y + n : y - n;                             \n"
+   "  }                                                        \n"
+   "  data[get_global_size(0) + i] = x ^ y;                    \n"
+   "}                                                          \n",
+   4096, 64, 1},
+  {"op-float-add", "dispatch",
+   "kernel void bench(global uint *data)                       \n"
+   "{                                                          \n"
+   "  uint i = get_global_id(0);                               \n"
+   "  float x = data[i], y = 1.0f;                             \n"
+   "  for (uint n = 0; n < 256; n++)                           \n"
+   "  {                                                        \n"
+   "    x = x + y;                                             \n"
+   "    y = y - x;                                             \n"
+   "  }                                                        \n"
+   "  data[get_global_size(0) + i] = as_uint(x + y);           \n"
+   "}                                                          \n",
+   4096, 64, 1},
+  {"op-float-mul", "dispatch",
+   "kernel void bench(global uint *data)                       \n"
+   "{                                                          \n"
+   "  uint i = get_global_id(0);                               \n"
+   "  float x = data[i], y = 1.0f;                             \n"
+   "  for (uint n = 0; n < 256; n++)                           \n"
+   "  {                                                        \n"
+   "    x = x * 0.999f;                                        \n"
+   "    y = y * 1.001f;                                        \n"
+   "  }                                                        \n"
+   "  data[get_global_size(0) + i] = as_uint(x + y);           \n"
+   "}                                                          \n",
+   4096, 64, 1},
+  {"op-float-div", "dispatch",
+   "kernel void bench(global uint *data)                       \n"
+   "{                                                          \n"
+   "  uint i = get_global_id(0);                               \n"
+   "  float x = data[i], y = 1.0f;                             \n"
+   "  for (uint n = 0; n < 256; n++)                           \n"
+   "  {                                                        \n"
+   "    x = x / 1.001f;                                        \n"
+   "    y = y / 0.999f;                                        \n"
+   "  }                                                        \n"
+   "  data[get_global_size(0) + i] = as_uint(x + y);           \n"
+   "}                                                          \n",
+   4096, 64, 1},
+  {"op-float-compare", "dispatch",
+   "kernel void bench(global uint *data)                       \n"
+   "{                                                          \n"
+   "  uint i = get_global_id(0);                               \n"
+   "  float x = data[i], y = 2048.0f;                          \n"
+   "  for (uint n = 0; n < 256; n++)                           \n"
+   "  {                                                        \n"
+   "    x = x < y ? x + 1.5f : x - y;                          \n"
+   "    y = y >= x ? y - 0.5f : y + x;                         \n"
+   "  }                                                        \n"
+   "  data[get_global_size(0) + i] = as_uint(x + y);           \n"
+   "}                                                          \n",
+   4096, 64, 1},
+  {"op-convert", "dispatch",
+   "kernel void bench(global uint *data)                       \n"
+   "{                                                          \n"
+   "  uint i = get_global_id(0);                               \n"
+   "  uint x = data[i];                                        \n"
+   "  float f = 0.0f;                                          \n"
+   "  for (uint n = 0; n < 256; n++)                           \n"
+   "  {                                                        \n"
+   "    f = (float)x * 0.5f;                                   \n"
+   "    x = (uint)f + (uchar)x + (ushort)n;                    \n"
+   "  }                                                        \n"
+   "  data[get_global_size(0) + i] = x + as_uint(f);           \n"
+   "}                                                          \n",
+   4096, 64, 1},
+  {"op-vector", "dispatch",
+   "kernel void bench(global uint *data)                       \n"
+   "{                                                          \n"
+   "  uint i = get_global_id(0);                               \n"
+   "  uint4 x = (uint4)(data[i], 1, 2, 3), y = x + 1;          \n"
+   "  for (uint n = 0; n < 256; n++)                           \n"
+   "  {                                                        \n"
+   "    x = x * y + (x >> 3);                                  \n"
+   "    y = (y ^ x) | n;                                       \n"
+   "  }                                                        \n"
+   "  data[get_global_size(0) + i] = x.x ^ x.y ^ y.z ^ y.w;    \n"
+   "}                                                          \n",
+   4096, 64, 1},
+  {"math-builtins", "builtin",
+   "kernel void bench(global uint *data)                       \n"
+   "{                                                          \n"
+   "  uint i = get_global_id(0);                               \n"
+   "  float x = data[i] * 0.001f;                              \n"
+   "  for (uint n = 0; n < 32; n++)                            \n"
+   "  {                                                        \n"
+   "    x = sin(x) + sqrt(fabs(x)) + exp(-x * x);              \n"
+   "    x = clamp(mad(x, 0.5f, 0.25f), -4.0f, 4.0f);           \n"
+   "  }                                                        \n"
+   "  data[get_global_size(0) + i] = as_uint(x);               \n"
+   "}                                                          \n",
+   4096, 64, 1},
+  {"work-item-builtins", "builtin",
+   "kernel void bench(global uint *data)                       \n"
+   "{                                                          \n"
+   "  uint x = 0;                                              \n"
+   "  for (uint n = 0; n < 64; n++)                            \n"
+   "    x += get_global_id(0) + get_local_id(0) +              \n"
+   "         get_group_id(0) + get_local_size(0);              \n"
+   "  data[get_global_size(0) + get_global_id(0)] = x;         \n"
+   "}                                                          \n",
+   4096, 64, 1},
+  {"barrier", "barrier",
+   "kernel void bench(global uint *data)                       \n"
+   "{                                                          \n"
+   "  local uint scratch[64];                                  \n"
+   "  uint l = get_local_id(0);                                \n"
+   "  uint sum = 0;                                            \n"
+   "  for (uint r = 0; r < 16; r++)                            \n"
+   "  {                                                        \n"
+   "    scratch[l] = data[get_global_id(0)] + r;               \n"
+   "    for (uint s = 32; s > 0; s >>= 1)                      \n"
+   "    {                                                      \n"
+   "      barrier(CLK_LOCAL_MEM_FENCE);                        \n"
+   "      if (l < s)                                           \n"
+   "        scratch[l] += scratch[l + s];                      \n"
+   "    }                                                      \n"
+   "    barrier(CLK_LOCAL_MEM_FENCE);                          \n"
+   "    sum += scratch[0];                                     \n"
+   "    barrier(CLK_LOCAL_MEM_FENCE);                          \n"
+   "  }                                                        \n"
+   "  data[get_global_size(0) + get_global_id(0)] = sum;       \n"
+   "}                                                          \n",
+   4096, 64, 1},
+  {"atomics", "atomic",
+   "kernel void bench(global uint *data)                       \n"
+   "{                                                          \n"
+   "  for (uint n = 0; n < 16; n++)                            \n"
+   "    atomic_inc(data + get_global_size(0) + n % 4);         \n"
+   "}                                                          \n",
+   4096, 64, 1},
+  {"launch", "launch",
+   "kernel void bench(global uint *data)                       \n"
+   "{                                                          \n"
+   "  data[get_global_size(0) + get_global_id(0)] += 1;        \n"
+   "}                                                          \n",
+   1, 1, 200},
+};
+
+// Plugins that can be enabled for a kernel, measured against the baseline
+// of running it with only the default plugins
+struct PluginConfig
+{
+  const char* name;
+  const char* env;
+};
+
+static const PluginConfig plugins[] = {
+  {"cost-model", "OCLGRIND_COST_MODEL"},
+  {"data-races", "OCLGRIND_DATA_RACES"},
+  {"inst-counts", "OCLGRIND_INST_COUNTS"},
+  {"memory-model", "OCLGRIND_MEMORY_MODEL"},
+  {"performance-lint", "OCLGRIND_PERFORMANCE_LINT"},
+  {"uninitialized", "OCLGRIND_UNINITIALIZED"},
+  {"workload-characterisation", "OCLGRIND_WORKLOAD_CHARACTERISATION"},
+};
+
+// Benchmark whose kernel is run with each plugin, and whose source is built
+// to measure program build times
+static const string PLUGIN_BENCHMARK = "global-memory";
+static const string BUILD_BENCHMARK = "math-builtins";
+
+struct Result
+{
+  string name;
+  string category;
+  const char* plugin;
+  size_t workItems;
+  uint64_t instructions;
+  unsigned iterations;
+  double seconds;
+  double baseline;
+};
+
+// Counts the instructions executed by a kernel, for a separate run from the
+// timed ones (so that they can still run as native code)
+class InstructionCount : public Plugin
+{
+public:
+  InstructionCount(const Context* context) : Plugin(context), m_count(0) {}
+
+  virtual uint32_t getCallbacks() const override
+  {
+    return CALLBACK_BIT(CallbackInstructionsExecuted);
+  }
+  virtual void instructionsExecuted(const InstructionRecord* records,
+                                    size_t count) override
+  {
+    m_count += count;
+  }
+  virtual bool isThreadSafe() const override { return true; }
+
+  uint64_t getCount() const { return m_count; }
+
+private:
+  atomic<uint64_t> m_count;
+};
+
+static const char* filter = NULL;
+static const char* outputFile = NULL;
+static unsigned repeat = 3;
+
+static const Benchmark* findBenchmark(const string& name);
+static bool parseArguments(int argc, char* argv[]);
+static void printUsage();
+static bool runBenchmark(const Benchmark& benchmark,
+                         const PluginConfig* plugin, Result& result);
+static bool runBuild(const Benchmark& benchmark, bool pch, Result& result);
+static bool selected(const string& name);
+static void setEnvironment(const char* name, const char* value);
+static void writeResults(ostream& output, const vector<Result>& results);
+
+int main(int argc, char* argv[])
+{
+  // Parse arguments
+  if (!parseArguments(argc, argv))
+  {
+    return 1;
+  }
+
+  // Builds would otherwise be taken from the cache after the first one
+  setEnvironment("OCLGRIND_BUILD_CACHE", NULL);
+
+  // The plugin benchmarks are measured against the kernel without them
+  bool runPlugins = false;
+  for (const PluginConfig& plugin : plugins)
+    runPlugins |= selected(string("plugin-") + plugin.name);
+
+  vector<Result> results;
+  Result result;
+  double baseline = 0;
+  for (const Benchmark& benchmark : benchmarks)
+  {
+    bool isBaseline = runPlugins && benchmark.name == PLUGIN_BENCHMARK;
+    if (!selected(benchmark.name) && !isBaseline)
+      continue;
+    if (!runBenchmark(benchmark, NULL, result))
+      return 1;
+    if (isBaseline)
+      baseline = result.seconds;
+    if (selected(benchmark.name))
+      results.push_back(result);
+  }
+
+  for (const PluginConfig& plugin : plugins)
+  {
+    if (!selected(string("plugin-") + plugin.name))
+      continue;
+    if (!runBenchmark(*findBenchmark(PLUGIN_BENCHMARK), &plugin, result))
+      return 1;
+    result.baseline = baseline;
+    results.push_back(result);
+  }
+
+  // Measure program build times, with and without precompiled headers
+  for (bool pch : {true, false})
+  {
+    if (!selected(pch ? "build-pch" : "build-no-pch"))
+      continue;
+    if (!runBuild(*findBenchmark(BUILD_BENCHMARK), pch, result))
+      return 1;
+    results.push_back(result);
+  }
+
+  if (outputFile)
+  {
+    ofstream output(outputFile);
+    writeResults(output, results);
+    if (!output)
+    {
+      cerr << "Failed to write results to " << outputFile << endl;
+      return 1;
+    }
+  }
+  else
+  {
+    writeResults(cout, results);
+  }
+
+  return 0;
+}
+
+static const Benchmark* findBenchmark(const string& name)
+{
+  for (const Benchmark& benchmark : benchmarks)
+  {
+    if (benchmark.name == name)
+      return &benchmark;
+  }
+  return NULL;
+}
+
+static bool parseArguments(int argc, char* argv[])
+{
+  for (int i = 1; i < argc; i++)
+  {
+    if (!strcmp(argv[i], "--disable-jit"))
+    {
+      setEnvironment("OCLGRIND_DISABLE_JIT", "1");
+    }
+    else if (!strcmp(argv[i], "--filter"))
+    {
+      if (++i >= argc)
+      {
+        cerr << "Missing argument to --filter" << endl;
+        return false;
+      }
+      filter = argv[i];
+    }
+    else if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help"))
+    {
+      printUsage();
+      exit(0);
+    }
+    else if (!strcmp(argv[i], "--list"))
+    {
+      for (const Benchmark& benchmark : benchmarks)
+        cout << benchmark.name << endl;
+      for (const PluginConfig& plugin : plugins)
+        cout << "plugin-" << plugin.name << endl;
+      cout << "build-pch" << endl << "build-no-pch" << endl;
+      exit(0);
+    }
+    else if (!strcmp(argv[i], "--num-threads"))
+    {
+      if (++i >= argc)
+      {
+        cerr << "Missing argument to --num-threads" << endl;
+        return false;
+      }
+      setEnvironment("OCLGRIND_NUM_THREADS", argv[i]);
+    }
+    else if (!strcmp(argv[i], "--output"))
+    {
+      if (++i >= argc)
+      {
+        cerr << "Missing argument to --output" << endl;
+        return false;
+      }
+      outputFile = argv[i];
+    }
+    else if (!strcmp(argv[i], "--repeat"))
+    {
+      if (++i >= argc)
+      {
+        cerr << "Missing argument to --repeat" << endl;
+        return false;
+      }
+      char* next;
+      repeat = strtoul(argv[i], &next, 10);
+      if (strlen(next) || repeat == 0)
+      {
+        cerr << "Invalid value for --repeat" << endl;
+        return false;
+      }
+    }
+    else if (!strcmp(argv[i], "-v") || !strcmp(argv[i], "--version"))
+    {
+      cout << endl;
+      cout << "Oclgrind " PACKAGE_VERSION << endl;
+      cout << endl;
+      cout << "Copyright (c) 2013-2019" << endl;
+      cout << "James Price and Simon McIntosh-Smith, University of Bristol"
+           << endl;
+      cout << "https://github.com/jrprice/Oclgrind" << endl;
+      cout << endl;
+      exit(0);
+    }
+    else
+    {
+      cerr << "Unrecognised option '" << argv[i] << "'" << endl;
+      return false;
+    }
+  }
+
+  return true;
+}
+
+static void printUsage()
+{
+  cout << "Usage: oclgrind-bench [OPTIONS]" << endl
+       << "       oclgrind-bench [--help | --version]" << endl
+       << endl
+       << "Options:" << endl
+       << "  --disable-jit                "
+          "Always interpret kernels instead of compiling them"
+       << endl
+       << "  --filter            TEXT     "
+          "Only run benchmarks whose names contain TEXT"
+       << endl
+       << "  -h --help                    "
+          "Display usage information"
+       << endl
+       << "  --list                       "
+          "List the available benchmarks"
+       << endl
+       << "  --num-threads       N        "
+          "Change the number of worker threads"
+       << endl
+       << "  --output            FILE     "
+          "Write the results to FILE as JSON (default stdout)"
+       << endl
+       << "  --repeat            N        "
+          "Take the fastest of N timed runs (default 3)"
+       << endl
+       << "  -v --version                 "
+          "Display version information"
+       << endl
+       << endl
+       << "For more information, please visit the Oclgrind wiki page:" << endl
+       << "-> https://github.com/jrprice/Oclgrind/wiki" << endl
+       << endl;
+}
+
+static bool runBenchmark(const Benchmark& benchmark,
+                         const PluginConfig* plugin, Result& result)
+{
+  // Plugins are loaded when the context is created
+  if (plugin)
+    setEnvironment(plugin->env, "1");
+  Context* context = new Context();
+  if (plugin)
+    setEnvironment(plugin->env, NULL);
+
+  Program* program = new Program(context, benchmark.source);
+  if (!program->build(""))
+  {
+    cerr << "Failed to build " << benchmark.name << ":" << endl
+         << program->getBuildLog() << endl;
+    delete program;
+    delete context;
+    return false;
+  }
+  Kernel* kernel = program->createKernel("bench");
+
+  // Allocate the buffer, with the first half initialised
+  Memory* globalMemory = context->getGlobalMemory();
+  size_t size = 2 * benchmark.globalSize * sizeof(uint32_t);
+  size_t address = globalMemory->allocateBuffer(size);
+  vector<uint32_t> data(2 * benchmark.globalSize, 0);
+  for (size_t i = 0; i < benchmark.globalSize; i++)
+    data[i] = i;
+  globalMemory->store((const unsigned char*)data.data(), address, size);
+
+  TypedValue value;
+  value.size = kernel->getArgumentSize(0);
+  value.num = 1;
+  value.data = new unsigned char[value.size];
+  value.setPointer(address);
+  kernel->setArgument(0, value);
+  delete[] value.data;
+
+  Size3 offset(0, 0, 0);
+  Size3 globalSize(benchmark.globalSize, 1, 1);
+  Size3 localSize(benchmark.localSize, 1, 1);
+
+  // Count the instructions in one launch, which also serves as a warm-up
+  InstructionCount counter(context);
+  context->registerPlugin(&counter);
+  KernelInvocation::run(context, kernel, 1, offset, globalSize, localSize);
+  context->unregisterPlugin(&counter);
+
+  // Compile the kernel to native code (if enabled) before timing it
+  KernelInvocation::run(context, kernel, 1, offset, globalSize, localSize);
+
+  // Take the fastest of the timed runs
+  double best = 0;
+  for (unsigned r = 0; r < repeat; r++)
+  {
+    double start = now();
+    for (unsigned l = 0; l < benchmark.launches; l++)
+      KernelInvocation::run(context, kernel, 1, offset, globalSize, localSize);
+    double elapsed = (now() - start) * 1e-9;
+    if (r == 0 || elapsed < best)
+      best = elapsed;
+  }
+
+  result.name = benchmark.name;
+  result.category = benchmark.category;
+  result.plugin = NULL;
+  if (plugin)
+  {
+    result.name = string("plugin-") + plugin->name;
+    result.category = "plugin";
+    result.plugin = plugin->name;
+  }
+  result.workItems = benchmark.globalSize * benchmark.launches;
+  result.instructions = counter.getCount() * benchmark.launches;
+  result.iterations = benchmark.launches;
+  result.seconds = best;
+  result.baseline = 0;
+
+  delete kernel;
+  globalMemory->deallocateBuffer(address);
+  delete program;
+  delete context;
+  return true;
+}
+
+static bool runBuild(const Benchmark& benchmark, bool pch, Result& result)
+{
+  setEnvironment("OCLGRIND_DISABLE_PCH", pch ? NULL : "1");
+  Context* context = new Context();
+
+  double best = 0;
+  bool success = true;
+  for (unsigned r = 0; success && r < repeat; r++)
+  {
+    double start = now();
+    Program* program = new Program(context, benchmark.source);
+    success = program->build("");
+    double elapsed = (now() - start) * 1e-9;
+    if (!success)
+    {
+      cerr << "Failed to build " << benchmark.name << ":" << endl
+           << program->getBuildLog() << endl;
+    }
+    delete program;
+    if (r == 0 || elapsed < best)
+      best = elapsed;
+  }
+
+  delete context;
+  setEnvironment("OCLGRIND_DISABLE_PCH", NULL);
+
+  result.name = pch ? "build-pch" : "build-no-pch";
+  result.category = "build";
+  result.plugin = NULL;
+  result.workItems = 0;
+  result.instructions = 0;
+  result.iterations = 1;
+  result.seconds = best;
+  result.baseline = 0;
+  return success;
+}
+
+static bool selected(const string& name)
+{
+  return !filter || name.find(filter) != string::npos;
+}
+
+static void setEnvironment(const char* name, const char* value)
+{
+#if defined(_WIN32) && !defined(__MINGW32__)
+  _putenv_s(name, value ? value : "");
+#else
+  if (value)
+    setenv(name, value, 1);
+  else
+    unsetenv(name);
+#endif
+}
+
+static void writeResults(ostream& output, const vector<Result>& results)
+{
+  output << "{" << endl;
+  output << "  \"version\": \"" PACKAGE_VERSION "\"," << endl;
+  output << "  \"jit\": "
+         << (checkEnv("OCLGRIND_DISABLE_JIT") ? "false" : "true") << ","
+         << endl;
+  output << "  \"repeat\": " << repeat << "," << endl;
+  output << "  \"results\": [";
+  for (size_t i = 0; i < results.size(); i++)
+  {
+    const Result& result = results[i];
+    output << (i ? "," : "") << endl;
+    output << "    {\"name\": \"" << result.name << "\", \"category\": \""
+           << result.category << "\", ";
+    if (result.plugin)
+      output << "\"plugin\": \"" << result.plugin << "\", ";
+    output << "\"iterations\": " << result.iterations
+           << ", \"seconds\": " << result.seconds;
+    if (result.workItems)
+    {
+      output << ", \"work_items\": " << result.workItems
+             << ", \"instructions\": " << result.instructions
+             << ", \"work_items_per_sec\": "
+             << result.workItems / result.seconds
+             << ", \"instructions_per_sec\": "
+             << result.instructions / result.seconds;
+    }
+    if (result.baseline)
+      output << ", \"overhead\": " << result.seconds / result.baseline;
+    output << "}";
+  }
+  output << endl << "  ]" << endl << "}" << endl;
+}
@@ -16,7 +16,14 @@
 #include <dlfcn.h>
 #endif
 
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include <condition_variable>
 #include <mutex>
+#include <thread>
 
 #include "llvm/IR/DebugInfo.h"
 #include "llvm/IR/Instruction.h"
@@ -26,38 +33,198 @@
 #include "Kernel.h"
 #include "KernelInvocation.h"
 #include "Memory.h"
+#include "Profiler.h"
 #include "Program.h"
 #include "WorkGroup.h"
 #include "WorkItem.h"
 
+#include "plugins/CostModel.h"
 #include "plugins/InstructionCounter.h"
 #include "plugins/WorkloadCharacterisation.h"
 #include "plugins/InteractiveDebugger.h"
+#include "plugins/LiveMetrics.h"
 #include "plugins/Logger.h"
 #include "plugins/MemCheck.h"
+#include "plugins/MemoryModel.h"
+#include "plugins/MemoryTrace.h"
+#include "plugins/PerformanceLint.h"
 #include "plugins/RaceDetector.h"
 #include "plugins/Uninitialized.h"
 
 using namespace oclgrind;
 using namespace std;
 
+// Set on the thread that launches a kernel while it is running
+static THREAD_LOCAL bool launchingKernel = false;
+
+// Library whose plugins are being registered, to name them in profiles
+static THREAD_LOCAL const char* loadingPluginLibrary = NULL;
+
+#define INSTRUCTION_BATCH_SIZE 1024
+
+namespace
+{
+// Per-thread buffer of instruction records awaiting delivery to plugins
+struct InstructionBatch
+{
+  const Context* context;
+  size_t count;
+  InstructionRecord records[INSTRUCTION_BATCH_SIZE];
+};
+THREAD_LOCAL InstructionBatch instructionBatch;
+
+// Host transfer being collected on this thread
+struct HostTransferState
+{
+  const Context* context;
+  HostTransfer* transfer;
+};
+THREAD_LOCAL HostTransferState hostTransferState = {NULL, NULL};
+} // namespace
+
+THREAD_LOCAL const vector<Plugin*>* Context::m_activeSubscribers = NULL;
+THREAD_LOCAL bool Context::m_unsampled = false;
+
+struct Context::WorkerPool
+{
+  vector<thread> threads;
+  mutex lock;
+  mutex jobLock; // Held by the thread running the current job
+  condition_variable wake;
+  condition_variable done;
+
+  const function<void(unsigned)>* task;
+  unsigned numWorkers;
+  unsigned numRunning;
+  uint64_t job;
+  bool shutdown;
+  bool pinThreads;
+  unsigned firstCPU;
+  vector<unsigned> cpus; // CPUs this process may run on, for pinning
+};
+
 Context::Context()
 {
   m_llvmContext = new llvm::LLVMContext;
+  m_reportMemoryUsage = checkEnv("OCLGRIND_MEMORY_USAGE");
+  m_dedupErrors = checkEnv("OCLGRIND_DEDUP_ERRORS");
+  m_numDuplicateErrors = 0;
+  m_numLaunches = 0;
 
   m_globalMemory =
     new Memory(AddrSpaceGlobal, sizeof(size_t) == 8 ? 16 : 8, this);
   m_kernelInvocation = NULL;
 
+  // Placement policy for large global memory buffers
+  unsigned placement = 0;
+  const char* hugePages = getenv("OCLGRIND_HUGE_PAGES");
+  if (hugePages && !strcmp(hugePages, "explicit"))
+    placement |= Memory::PlaceExplicitHugePages;
+  else if (hugePages && strcmp(hugePages, "0"))
+    placement |= Memory::PlaceHugePages;
+  const char* numa = getenv("OCLGRIND_NUMA");
+  if (numa && !strcmp(numa, "interleave"))
+    placement |= Memory::PlaceInterleave;
+  else if (numa && strcmp(numa, "first-touch"))
+    cerr << "Oclgrind: Invalid value for OCLGRIND_NUMA" << endl;
+  m_globalMemory->setPlacement(placement);
+
+  m_workerPool = new WorkerPool;
+  m_workerPool->task = NULL;
+  m_workerPool->numWorkers = 0;
+  m_workerPool->numRunning = 0;
+  m_workerPool->job = 0;
+  m_workerPool->shutdown = false;
+  m_workerPool->pinThreads = checkEnv("OCLGRIND_PIN_THREADS");
+  m_workerPool->firstCPU = 0;
+#if defined(__linux__)
+  cpu_set_t allowed;
+  if (!sched_getaffinity(0, sizeof(allowed), &allowed))
+  {
+    for (unsigned cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+      if (CPU_ISSET(cpu, &allowed))
+        m_workerPool->cpus.push_back(cpu);
+    }
+  }
+#endif
+
+  // Each compute unit reported for the device is run by a worker thread
+  m_numWorkers = getEnvInt(
+    "OCLGRIND_NUM_THREADS",
+    getEnvInt("OCLGRIND_COMPUTE_UNITS", thread::hardware_concurrency(), false),
+    false);
+
+  // Profile phases and plugin callbacks, optionally writing a trace
+  m_profiler = NULL;
+  const char* profileTrace = getenv("OCLGRIND_PROFILE_TRACE");
+  if (checkEnv("OCLGRIND_PROFILE") || profileTrace)
+    m_profiler = new Profiler(profileTrace);
+
   loadPlugins();
 }
 
 Context::~Context()
 {
+  // Stop worker threads before unloading plugins they may reference
+  {
+    lock_guard<mutex> lock(m_workerPool->lock);
+    m_workerPool->shutdown = true;
+  }
+  m_workerPool->wake.notify_all();
+  for (auto itr = m_workerPool->threads.begin();
+       itr != m_workerPool->threads.end(); itr++)
+  {
+    itr->join();
+  }
+  delete m_workerPool;
+
   delete m_llvmContext;
   delete m_globalMemory;
 
   unloadPlugins();
+
+  delete m_profiler;
+}
+
+bool Context::deserializePlugins(const string& data) const
+{
+  size_t offset = 0;
+  uint32_t numPlugins;
+  if (!readBinary(data, offset, numPlugins) || numPlugins != m_plugins.size())
+    return false;
+
+  for (const PluginEntry& p : m_plugins)
+  {
+    string state;
+    if (!readBinary(data, offset, state) || !p.first->deserialize(state))
+      return false;
+  }
+  return offset == data.size();
+}
+
+bool Context::isDuplicateError(const char* errorClass,
+                               const llvm::Instruction* site) const
+{
+  if (!m_dedupErrors)
+    return false;
+
+  const KernelInvocation* kernelInvocation = getCurrentInvocation();
+  if (!site && kernelInvocation)
+  {
+    const WorkItem* workItem = kernelInvocation->getCurrentWorkItem();
+    const WorkGroup* workGroup = kernelInvocation->getCurrentWorkGroup();
+    if (workItem)
+      site = workItem->getCurrentInstruction();
+    else if (workGroup)
+      site = workGroup->getCurrentBarrier();
+  }
+
+  lock_guard<mutex> lock(m_errorSitesLock);
+  if (m_errorSites.insert({site, errorClass}).second)
+    return false;
+  m_numDuplicateErrors++;
+  return true;
 }
 
 bool Context::isThreadSafe() const
@@ -70,36 +237,213 @@ bool Context::isThreadSafe() const
   return true;
 }
 
+bool Context::supportsParallelWorkGroups() const
+{
+  for (const PluginEntry& p : m_plugins)
+  {
+    if (!p.first->supportsParallelWorkGroups())
+      return false;
+  }
+  return true;
+}
+
+void Context::runWorkers(unsigned numWorkers,
+                         const function<void(unsigned)>& task) const
+{
+  // Run inline when there is only one worker
+  if (numWorkers <= 1)
+  {
+    task(0);
+    return;
+  }
+
+  // Jobs submitted by concurrent commands take turns on the pool
+  lock_guard<mutex> job(m_workerPool->jobLock);
+
+  // Calling thread acts as worker 0, pool threads provide the rest
+  {
+    lock_guard<mutex> lock(m_workerPool->lock);
+    while (m_workerPool->threads.size() < numWorkers - 1)
+    {
+      unsigned id = m_workerPool->threads.size() + 1;
+      m_workerPool->threads.push_back(
+        thread(runPoolWorker, m_workerPool, id, m_workerPool->job));
+
+#if defined(__linux__)
+      // Pin pool thread N to CPU N of the context's range, counting only
+      // the CPUs this process may run on (the calling thread runs worker 0)
+      const vector<unsigned>& allowed = m_workerPool->cpus;
+      if (m_workerPool->pinThreads && !allowed.empty())
+      {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(allowed[(m_workerPool->firstCPU + id) % allowed.size()],
+                &cpus);
+        pthread_setaffinity_np(m_workerPool->threads.back().native_handle(),
+                               sizeof(cpus), &cpus);
+      }
+#endif
+    }
+
+    m_workerPool->task = &task;
+    m_workerPool->numWorkers = numWorkers;
+    m_workerPool->numRunning = numWorkers - 1;
+    m_workerPool->job++;
+  }
+  m_workerPool->wake.notify_all();
+
+  task(0);
+
+  // Wait for pool threads to complete
+  unique_lock<mutex> lock(m_workerPool->lock);
+  m_workerPool->done.wait(lock, [&] { return !m_workerPool->numRunning; });
+  m_workerPool->task = NULL;
+}
+
+void Context::runPoolWorker(WorkerPool* pool, unsigned id, uint64_t job)
+{
+  unique_lock<mutex> lock(pool->lock);
+  while (true)
+  {
+    pool->wake.wait(lock, [&] { return pool->shutdown || pool->job != job; });
+    if (pool->shutdown)
+      return;
+    job = pool->job;
+
+    // Threads beyond the number requested sit this job out
+    if (id >= pool->numWorkers)
+      continue;
+
+    const function<void(unsigned)>* task = pool->task;
+    lock.unlock();
+    (*task)(id);
+    lock.lock();
+
+    if (--pool->numRunning == 0)
+      pool->done.notify_all();
+  }
+}
+
+const KernelInvocation* Context::getCurrentInvocation() const
+{
+  // Only threads running the kernel take part in its invocation, so that
+  // commands running alongside it are treated as host activity
+  const KernelInvocation* invocation = m_kernelInvocation;
+  if (invocation && !launchingKernel && !invocation->getCurrentWorkGroup())
+    return NULL;
+  return invocation;
+}
+
+shared_timed_mutex& Context::getDeviceLock() const
+{
+  return m_deviceLock;
+}
+
 Memory* Context::getGlobalMemory() const
 {
   return m_globalMemory;
 }
 
+CostModel* Context::getCostModel() const
+{
+  return m_costModel;
+}
+
+mutex& Context::getKernelLock() const
+{
+  return m_kernelLock;
+}
+
 llvm::LLVMContext* Context::getLLVMContext() const
 {
   return m_llvmContext;
 }
 
+unsigned Context::getNumWorkers() const
+{
+  return m_numWorkers;
+}
+
+Profiler* Context::getProfiler() const
+{
+  return m_profiler;
+}
+
+mutex& Context::getLLVMContextLock() const
+{
+  return m_llvmContextLock;
+}
+
+MemoryUsage* Context::getMemoryUsage(const string& category) const
+{
+  lock_guard<mutex> lock(m_memoryUsageLock);
+  return &m_memoryUsage[category];
+}
+
+map<string, size_t> Context::getMemoryUsageTotals() const
+{
+  lock_guard<mutex> lock(m_memoryUsageLock);
+  map<string, size_t> totals;
+  for (auto& usage : m_memoryUsage)
+    totals[usage.first] = usage.second.getCurrent();
+  return totals;
+}
+
 void Context::loadPlugins()
 {
+  auto addPlugin = [this](Plugin* plugin, const char* name) {
+    m_plugins.push_back(make_pair(plugin, true));
+    if (m_profiler)
+      m_profiler->addPlugin(plugin, name);
+  };
+
   // Create core plugins
-  m_plugins.push_back(make_pair(new Logger(this), true));
-  m_plugins.push_back(make_pair(new MemCheck(this), true));
+  addPlugin(new Logger(this), "Logger");
+  addPlugin(new MemCheck(this), "MemCheck");
+
+  // Costs may be given in place of "1" to override the defaults
+  m_costModel = NULL;
+  const char* costModel = getenv("OCLGRIND_COST_MODEL");
+  if (costModel && strcmp(costModel, "0") && strcmp(costModel, ""))
+  {
+    m_costModel = new CostModel(this);
+    addPlugin(m_costModel, "CostModel");
+  }
 
   if (checkEnv("OCLGRIND_INST_COUNTS"))
-    m_plugins.push_back(make_pair(new InstructionCounter(this), true));
+    addPlugin(new InstructionCounter(this), "InstructionCounter");
 
   if (checkEnv("OCLGRIND_WORKLOAD_CHARACTERISATION"))
-    m_plugins.push_back(make_pair(new WorkloadCharacterisation(this), true));
+    addPlugin(new WorkloadCharacterisation(this), "WorkloadCharacterisation");
+
+  // Options may be given in place of "1" to override the defaults
+  const char* memoryModel = getenv("OCLGRIND_MEMORY_MODEL");
+  if (memoryModel && strcmp(memoryModel, "0") && strcmp(memoryModel, ""))
+    addPlugin(new MemoryModel(this), "MemoryModel");
+
+  const char* memoryTrace = getenv("OCLGRIND_MEMORY_TRACE");
+  if (memoryTrace && strcmp(memoryTrace, ""))
+    addPlugin(new MemoryTrace(this, memoryTrace), "MemoryTrace");
+
+  const char* performanceLint = getenv("OCLGRIND_PERFORMANCE_LINT");
+  if (performanceLint && strcmp(performanceLint, "0") &&
+      strcmp(performanceLint, ""))
+  {
+    addPlugin(new PerformanceLint(this), "PerformanceLint");
+  }
+
+  const char* metrics = getenv("OCLGRIND_METRICS");
+  if (metrics && strcmp(metrics, ""))
+    addPlugin(new LiveMetrics(this, metrics), "LiveMetrics");
 
   if (checkEnv("OCLGRIND_DATA_RACES"))
-    m_plugins.push_back(make_pair(new RaceDetector(this), true));
+    addPlugin(new RaceDetector(this), "RaceDetector");
 
   if (checkEnv("OCLGRIND_UNINITIALIZED"))
-    m_plugins.push_back(make_pair(new Uninitialized(this), true));
+    addPlugin(new Uninitialized(this), "Uninitialized");
 
   if (checkEnv("OCLGRIND_INTERACTIVE"))
-    m_plugins.push_back(make_pair(new InteractiveDebugger(this), true));
+    addPlugin(new InteractiveDebugger(this), "InteractiveDebugger");
 
   // Load dynamic plugins
   const char* dynamicPlugins = getenv("OCLGRIND_PLUGINS");
@@ -142,10 +486,32 @@ void Context::loadPlugins()
       }
 #endif
 
+      loadingPluginLibrary = libpath.c_str();
       ((void (*)(Context*))initialize)(this);
+      loadingPluginLibrary = NULL;
       m_pluginLibraries.push_back(library);
     }
   }
+
+  updateSubscribers();
+}
+
+void Context::reportMemoryUsage(const KernelInvocation* kernelInvocation) const
+{
+  lock_guard<mutex> lock(m_memoryUsageLock);
+
+  cout << "Memory usage for kernel '"
+       << kernelInvocation->getKernel()->getName() << "':" << endl;
+  cout << setw(16) << "current" << setw(16) << "peak" << endl;
+  for (auto& usage : m_memoryUsage)
+  {
+    cout << setw(16) << usage.second.getCurrent() << setw(16)
+         << usage.second.getPeak() << " - " << usage.first << endl;
+
+    // Report peaks per kernel
+    usage.second.resetPeak();
+  }
+  cout << endl;
 }
 
 void Context::unloadPlugins()
@@ -181,20 +547,105 @@ void Context::unloadPlugins()
   }
 
   m_plugins.clear();
+  updateSubscribers();
 }
 
 void Context::registerPlugin(Plugin* plugin)
 {
   m_plugins.push_back(make_pair(plugin, false));
+  updateSubscribers();
+
+  if (m_profiler)
+  {
+    m_profiler->addPlugin(plugin, loadingPluginLibrary ? loadingPluginLibrary
+                                                       : "registered plugin");
+  }
 }
 
 void Context::unregisterPlugin(Plugin* plugin)
 {
   m_plugins.remove(make_pair(plugin, false));
+  updateSubscribers();
+
+  if (m_profiler)
+    m_profiler->removePlugin(plugin);
+}
+
+void Context::buildSubscribers(uint64_t reduced,
+                               vector<Plugin*>* subscribers) const
+{
+  for (unsigned c = 0; c < NumPluginCallbacks; c++)
+  {
+    subscribers[c].clear();
+  }
+
+  unsigned index = 0;
+  for (const PluginEntry& p : m_plugins)
+  {
+    uint32_t callbacks = p.first->getCallbacks();
+    if (index < 64 && (reduced & (1ULL << index)))
+      callbacks &= p.first->getUnsampledCallbacks();
+    for (unsigned c = 0; c < NumPluginCallbacks; c++)
+    {
+      if (callbacks & CALLBACK_BIT(c))
+        subscribers[c].push_back(p.first);
+    }
+    index++;
+  }
+}
+
+void Context::selectSubscribers(const WorkGroup* workGroup, bool sampled) const
+{
+  m_unsampled = workGroup && !sampled;
+  m_activeSubscribers = NULL;
+  if (!workGroup)
+    return;
+
+  // Find plugins that only want their unsampled callbacks for this group
+  // (any beyond the first 64 are always fully notified)
+  uint64_t reduced = 0;
+  unsigned index = 0;
+  for (const PluginEntry& p : m_plugins)
+  {
+    if (index < 64 && (!sampled || !p.first->wantsWorkGroup(workGroup)))
+      reduced |= 1ULL << index;
+    index++;
+  }
+  if (!reduced)
+    return;
+
+  lock_guard<mutex> lock(m_reducedSubscribersLock);
+  auto itr = m_reducedSubscribers.find(reduced);
+  if (itr == m_reducedSubscribers.end())
+  {
+    itr = m_reducedSubscribers.insert(make_pair(reduced, SubscriberSet())).first;
+    buildSubscribers(reduced, itr->second.subscribers);
+  }
+  m_activeSubscribers = itr->second.subscribers;
+}
+
+void Context::setWorkers(unsigned firstCPU, unsigned numWorkers)
+{
+  lock_guard<mutex> lock(m_workerPool->lock);
+  assert(m_workerPool->threads.empty());
+  m_workerPool->pinThreads = true;
+  m_workerPool->firstCPU = firstCPU;
+  m_numWorkers = numWorkers;
+}
+
+void Context::updateSubscribers()
+{
+  buildSubscribers(0, m_subscribers);
+
+  lock_guard<mutex> lock(m_reducedSubscribersLock);
+  m_reducedSubscribers.clear();
 }
 
 void Context::logError(const char* error) const
 {
+  if (isDuplicateError(error))
+    return;
+
   Message msg(ERROR, this);
   msg << error << endl
       << msg.INDENT << "Kernel: " << msg.CURRENT_KERNEL << endl
@@ -203,91 +654,303 @@ void Context::logError(const char* error) const
   msg.send();
 }
 
-#define NOTIFY(function, ...)                                                  \
+bool Context::mergePluginResults(const string& data) const
+{
+  size_t offset = 0;
+  uint32_t numPlugins;
+  if (!readBinary(data, offset, numPlugins) || numPlugins != m_plugins.size())
+    return false;
+
+  for (const PluginEntry& p : m_plugins)
+  {
+    string results;
+    if (!readBinary(data, offset, results) || !p.first->mergeResults(results))
+      return false;
+  }
+  return offset == data.size();
+}
+
+bool Context::needsInstructionCallbacks() const
+{
+  const vector<Plugin*>* subscribers =
+    m_activeSubscribers ? m_activeSubscribers : m_subscribers;
+  for (PluginCallback callback :
+       {CallbackInstructionExecuted, CallbackInstructionsExecuted})
+  {
+    for (const Plugin* plugin : subscribers[callback])
+    {
+      if (plugin->needsInstructionCallbacks())
+        return true;
+    }
+  }
+  return false;
+}
+
+bool Context::needsInstructionExecutedCallbacks() const
+{
+  const vector<Plugin*>* subscribers =
+    m_activeSubscribers ? m_activeSubscribers : m_subscribers;
+  for (const Plugin* plugin : subscribers[CallbackInstructionExecuted])
+  {
+    if (plugin->needsInstructionCallbacks())
+      return true;
+  }
+  return false;
+}
+
+bool Context::needsUniformExecution() const
+{
+  const vector<Plugin*>* subscribers =
+    m_activeSubscribers ? m_activeSubscribers : m_subscribers;
+  for (PluginCallback callback :
+       {CallbackInstructionExecuted, CallbackInstructionsExecuted})
+  {
+    for (const Plugin* plugin : subscribers[callback])
+    {
+      if (plugin->needsUniformExecution())
+        return true;
+    }
+  }
+  return false;
+}
+
+uint64_t Context::nextLaunchIndex() const
+{
+  return m_numLaunches++;
+}
+
+bool Context::savePluginResults(string& data) const
+{
+  writeBinary(data, (uint32_t)m_plugins.size());
+  for (const PluginEntry& p : m_plugins)
+  {
+    string results;
+    if (!p.first->saveResults(results))
+      return false;
+    writeBinary(data, results);
+  }
+  return true;
+}
+
+bool Context::serializePlugins(string& data) const
+{
+  writeBinary(data, (uint32_t)m_plugins.size());
+  for (const PluginEntry& p : m_plugins)
+  {
+    string state;
+    if (!p.first->serialize(state))
+      return false;
+    writeBinary(data, state);
+  }
+  return true;
+}
+
+#define NOTIFY(callback, function, ...)                                        \
   {                                                                            \
-    PluginList::const_iterator pluginItr;                                      \
-    for (pluginItr = m_plugins.begin(); pluginItr != m_plugins.end();          \
+    const vector<Plugin*>& subscribers =                                       \
+      (m_activeSubscribers ? m_activeSubscribers : m_subscribers)[callback];   \
+    for (auto pluginItr = subscribers.begin(); pluginItr != subscribers.end(); \
          pluginItr++)                                                          \
     {                                                                          \
-      pluginItr->first->function(__VA_ARGS__);                                 \
+      if (m_profiler)                                                          \
+      {                                                                        \
+        uint64_t start = Profiler::readCycles();                               \
+        (*pluginItr)->function(__VA_ARGS__);                                   \
+        m_profiler->addPluginTime(*pluginItr,                                  \
+                                  Profiler::readCycles() - start);             \
+      }                                                                        \
+      else                                                                     \
+      {                                                                        \
+        (*pluginItr)->function(__VA_ARGS__);                                   \
+      }                                                                        \
     }                                                                          \
   }
 
+void Context::flushInstructionRecords() const
+{
+  InstructionBatch& batch = instructionBatch;
+  if (batch.count == 0 || batch.context != this)
+    return;
+
+  NOTIFY(CallbackInstructionsExecuted, instructionsExecuted, batch.records,
+         batch.count);
+  batch.count = 0;
+}
+
+void Context::recordInstructionExecuted(
+  const WorkItem* workItem, const llvm::Instruction* instruction) const
+{
+  InstructionBatch& batch = instructionBatch;
+  if (batch.context != this)
+  {
+    // Deliver anything left over from another context on this thread
+    if (batch.context)
+      batch.context->flushInstructionRecords();
+    batch.context = this;
+  }
+
+  InstructionRecord& record = batch.records[batch.count++];
+  record.workItem = workItem;
+  record.instruction = instruction;
+
+  if (batch.count == INSTRUCTION_BATCH_SIZE)
+    flushInstructionRecords();
+}
+
+void Context::beginHostTransfer(HostTransfer* transfer) const
+{
+  transfer->memory = NULL;
+  transfer->loads.clear();
+  transfer->stores.clear();
+  hostTransferState = {this, transfer};
+}
+
+void Context::endHostTransfer() const
+{
+  HostTransfer* transfer = hostTransferState.transfer;
+  hostTransferState = {NULL, NULL};
+  if (transfer->memory)
+    NOTIFY(CallbackHostMemoryTransfer, hostMemoryTransfer, *transfer);
+}
+
+void Context::recordHostAccess(const Memory* memory, size_t address,
+                               size_t size, bool store) const
+{
+  if (!hasSubscribers(CallbackHostMemoryTransfer))
+    return;
+
+  // Accesses made outside a transfer are notified on their own
+  HostTransfer single = {};
+  HostTransfer* transfer = &single;
+  if (hostTransferState.context == this)
+    transfer = hostTransferState.transfer;
+
+  // A transfer only covers one memory
+  if (transfer->memory && transfer->memory != memory)
+  {
+    NOTIFY(CallbackHostMemoryTransfer, hostMemoryTransfer, *transfer);
+    transfer->loads.clear();
+    transfer->stores.clear();
+  }
+  transfer->memory = memory;
+
+  vector<MemoryRegion>& regions = store ? transfer->stores : transfer->loads;
+  if (!regions.empty() &&
+      regions.back().address + regions.back().size == address)
+    regions.back().size += size;
+  else
+    regions.push_back({address, size});
+
+  if (transfer == &single)
+    NOTIFY(CallbackHostMemoryTransfer, hostMemoryTransfer, single);
+}
+
 void Context::notifyInstructionExecuted(const WorkItem* workItem,
                                         const llvm::Instruction* instruction,
                                         const TypedValue& result) const
 {
-  NOTIFY(instructionExecuted, workItem, instruction, result);
+  NOTIFY(CallbackInstructionExecuted, instructionExecuted, workItem,
+         instruction, result);
 }
 
 void Context::notifyKernelBegin(const KernelInvocation* kernelInvocation) const
 {
   assert(m_kernelInvocation == NULL);
   m_kernelInvocation = kernelInvocation;
+  launchingKernel = true;
+
+  if (m_profiler)
+    m_profiler->kernelBegin();
 
-  NOTIFY(kernelBegin, kernelInvocation);
+  NOTIFY(CallbackKernelBegin, kernelBegin, kernelInvocation);
 }
 
 void Context::notifyKernelEnd(const KernelInvocation* kernelInvocation) const
 {
-  NOTIFY(kernelEnd, kernelInvocation);
+  flushInstructionRecords();
+
+  if (m_numDuplicateErrors)
+  {
+    Message msg(INFO, this);
+    msg << "Oclgrind: " << m_numDuplicateErrors
+        << " duplicate errors suppressed in kernel " << msg.CURRENT_KERNEL;
+    msg.send();
+  }
+  m_errorSites.clear();
+  m_numDuplicateErrors = 0;
+
+  NOTIFY(CallbackKernelEnd, kernelEnd, kernelInvocation);
+
+  if (m_reportMemoryUsage)
+    reportMemoryUsage(kernelInvocation);
+
+  if (m_profiler)
+    m_profiler->kernelEnd(kernelInvocation->getKernel()->getName());
 
   assert(m_kernelInvocation == kernelInvocation);
   m_kernelInvocation = NULL;
+  launchingKernel = false;
 }
 
 void Context::notifyMemoryAllocated(const Memory* memory, size_t address,
                                     size_t size, cl_mem_flags flags,
                                     const uint8_t* initData) const
 {
-  NOTIFY(memoryAllocated, memory, address, size, flags, initData);
+  NOTIFY(CallbackMemoryAllocated, memoryAllocated, memory, address, size,
+         flags, initData);
 }
 
 void Context::notifyMemoryAtomicLoad(const Memory* memory, AtomicOp op,
                                      size_t address, size_t size) const
 {
-  if (m_kernelInvocation && m_kernelInvocation->getCurrentWorkItem())
+  const KernelInvocation* invocation = getCurrentInvocation();
+  if (invocation && invocation->getCurrentWorkItem())
   {
-    NOTIFY(memoryAtomicLoad, memory, m_kernelInvocation->getCurrentWorkItem(),
-           op, address, size);
+    NOTIFY(CallbackMemoryAtomicLoad, memoryAtomicLoad, memory,
+           invocation->getCurrentWorkItem(), op, address, size);
   }
 }
 
 void Context::notifyMemoryAtomicStore(const Memory* memory, AtomicOp op,
                                       size_t address, size_t size) const
 {
-  if (m_kernelInvocation && m_kernelInvocation->getCurrentWorkItem())
+  const KernelInvocation* invocation = getCurrentInvocation();
+  if (invocation && invocation->getCurrentWorkItem())
   {
-    NOTIFY(memoryAtomicStore, memory, m_kernelInvocation->getCurrentWorkItem(),
-           op, address, size);
+    NOTIFY(CallbackMemoryAtomicStore, memoryAtomicStore, memory,
+           invocation->getCurrentWorkItem(), op, address, size);
   }
 }
 
 void Context::notifyMemoryDeallocated(const Memory* memory,
                                       size_t address) const
 {
-  NOTIFY(memoryDeallocated, memory, address);
+  NOTIFY(CallbackMemoryDeallocated, memoryDeallocated, memory, address);
 }
 
 void Context::notifyMemoryLoad(const Memory* memory, size_t address,
                                size_t size) const
 {
-  if (m_kernelInvocation)
+  // Accesses from threads that aren't running a kernel are made by the host,
+  // including transfers that run concurrently with a kernel
+  const KernelInvocation* invocation = getCurrentInvocation();
+  if (invocation)
   {
-    if (m_kernelInvocation->getCurrentWorkItem())
+    if (invocation->getCurrentWorkItem())
     {
-      NOTIFY(memoryLoad, memory, m_kernelInvocation->getCurrentWorkItem(),
-             address, size);
+      NOTIFY(CallbackMemoryLoad, memoryLoad, memory,
+             invocation->getCurrentWorkItem(), address, size);
     }
-    else if (m_kernelInvocation->getCurrentWorkGroup())
+    else if (invocation->getCurrentWorkGroup())
     {
-      NOTIFY(memoryLoad, memory, m_kernelInvocation->getCurrentWorkGroup(),
-             address, size);
+      NOTIFY(CallbackMemoryLoad, memoryLoad, memory,
+             invocation->getCurrentWorkGroup(), address, size);
     }
   }
   else
   {
-    NOTIFY(hostMemoryLoad, memory, address, size);
+    NOTIFY(CallbackHostMemoryLoad, hostMemoryLoad, memory, address, size);
+    recordHostAccess(memory, address, size, false);
   }
 }
 
@@ -295,76 +958,81 @@ void Context::notifyMemoryMap(const Memory* memory, size_t address,
                               size_t offset, size_t size,
                               cl_mem_flags flags) const
 {
-  NOTIFY(memoryMap, memory, address, offset, size, flags);
+  NOTIFY(CallbackMemoryMap, memoryMap, memory, address, offset, size, flags);
 }
 
 void Context::notifyMemoryStore(const Memory* memory, size_t address,
                                 size_t size, const uint8_t* storeData) const
 {
-  if (m_kernelInvocation)
+  const KernelInvocation* invocation = getCurrentInvocation();
+  if (invocation)
   {
-    if (m_kernelInvocation->getCurrentWorkItem())
+    if (invocation->getCurrentWorkItem())
     {
-      NOTIFY(memoryStore, memory, m_kernelInvocation->getCurrentWorkItem(),
-             address, size, storeData);
+      NOTIFY(CallbackMemoryStore, memoryStore, memory,
+             invocation->getCurrentWorkItem(), address, size, storeData);
     }
-    else if (m_kernelInvocation->getCurrentWorkGroup())
+    else if (invocation->getCurrentWorkGroup())
     {
-      NOTIFY(memoryStore, memory, m_kernelInvocation->getCurrentWorkGroup(),
-             address, size, storeData);
+      NOTIFY(CallbackMemoryStore, memoryStore, memory,
+             invocation->getCurrentWorkGroup(), address, size, storeData);
     }
   }
   else
   {
-    NOTIFY(hostMemoryStore, memory, address, size, storeData);
+    NOTIFY(CallbackHostMemoryStore, hostMemoryStore, memory, address, size,
+           storeData);
+    recordHostAccess(memory, address, size, true);
   }
 }
 
 void Context::notifyMessage(MessageType type, const char* message) const
 {
-  NOTIFY(log, type, message);
+  NOTIFY(CallbackLog, log, type, message);
 }
 
 void Context::notifyMemoryUnmap(const Memory* memory, size_t address,
                                 const void* ptr) const
 {
-  NOTIFY(memoryUnmap, memory, address, ptr);
+  NOTIFY(CallbackMemoryUnmap, memoryUnmap, memory, address, ptr);
 }
 
 void Context::notifyWorkGroupBarrier(const WorkGroup* workGroup,
                                      uint32_t flags) const
 {
-  NOTIFY(workGroupBarrier, workGroup, flags);
+  NOTIFY(CallbackWorkGroupBarrier, workGroupBarrier, workGroup, flags);
 }
 
 void Context::notifyWorkGroupBegin(const WorkGroup* workGroup) const
 {
-  NOTIFY(workGroupBegin, workGroup);
+  NOTIFY(CallbackWorkGroupBegin, workGroupBegin, workGroup);
 }
 
 void Context::notifyWorkGroupComplete(const WorkGroup* workGroup) const
 {
-  NOTIFY(workGroupComplete, workGroup);
+  // Records must reach plugins while their work-items are still live
+  flushInstructionRecords();
+  NOTIFY(CallbackWorkGroupComplete, workGroupComplete, workGroup);
 }
 
 void Context::notifyWorkItemBegin(const WorkItem* workItem) const
 {
-  NOTIFY(workItemBegin, workItem);
+  NOTIFY(CallbackWorkItemBegin, workItemBegin, workItem);
 }
 
 void Context::notifyWorkItemComplete(const WorkItem* workItem) const
 {
-  NOTIFY(workItemComplete, workItem);
+  NOTIFY(CallbackWorkItemComplete, workItemComplete, workItem);
 }
 
 void Context::notifyWorkItemBarrier(const WorkItem *workItem) const
 {
-  NOTIFY(workItemBarrier, workItem);
+  NOTIFY(CallbackWorkItemBarrier, workItemBarrier, workItem);
 }
 
 void Context::notifyWorkItemClearBarrier(const WorkItem *workItem) const
 {
-  NOTIFY(workItemClearBarrier, workItem);
+  NOTIFY(CallbackWorkItemClearBarrier, workItemClearBarrier, workItem);
 }
 
 #undef NOTIFY
@@ -373,7 +1041,7 @@ Context::Message::Message(MessageType type, const Context* context)
 {
   m_type = type;
   m_context = context;
-  m_kernelInvocation = context->m_kernelInvocation;
+  m_kernelInvocation = context->getCurrentInvocation();
 }
 
 Context::Message& Context::Message::operator<<(const special& id)
@@ -482,25 +1150,21 @@ Context::Message::operator<<(const llvm::Instruction* instruction)
     *this << endl;
 
     // Output debug information
-    llvm::MDNode* md = instruction->getMetadata("dbg");
-    if (!md)
+    const Program* program = m_kernelInvocation->getKernel()->getProgram();
+    const Program::SourceLocation* loc =
+      program->getSourceLocation(instruction);
+    if (!loc)
     {
       *this << "Debugging information not available." << endl;
     }
     else
     {
-      llvm::DILocation* loc = (llvm::DILocation*)md;
-      unsigned lineNumber = loc->getLine();
-      unsigned columnNumber = loc->getColumn();
-      llvm::StringRef filename = loc->getFilename();
-
-      *this << "At line " << dec << lineNumber << " (column " << columnNumber
+      *this << "At line " << dec << loc->line << " (column " << loc->column
             << ")"
-            << " of " << filename.str() << ":" << endl;
+            << " of " << *loc->filename << ":" << endl;
 
       // Get source line
-      const Program* program = m_kernelInvocation->getKernel()->getProgram();
-      const char* line = program->getSourceLine(lineNumber);
+      const char* line = program->getSourceLine(loc->line);
       if (line)
       {
         while (isspace(line[0]))
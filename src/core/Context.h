@@ -8,6 +8,10 @@
 
 #include "common.h"
 
+#include <functional>
+#include <mutex>
+#include <shared_mutex>
+
 namespace llvm
 {
 class LLVMContext;
@@ -15,9 +19,12 @@ class LLVMContext;
 
 namespace oclgrind
 {
+class CostModel;
+struct HostTransfer;
 class KernelInvocation;
 class Memory;
 class Plugin;
+class Profiler;
 class WorkGroup;
 class WorkItem;
 
@@ -30,15 +37,91 @@ public:
   Context();
   virtual ~Context();
 
+  // Restore or save the checkpoint state of every plugin, returning false if
+  // a plugin doesn't support checkpoints or the state doesn't match
+  bool deserializePlugins(const std::string& data) const;
+  // Plugin that sets profiling times from a simulated cost, if enabled
+  CostModel* getCostModel() const;
+  // Lock shared by commands running on the device, and held exclusively by
+  // the host while it changes the buffers allocated in global memory
+  std::shared_timed_mutex& getDeviceLock() const;
   Memory* getGlobalMemory() const;
+  // Lock held while a kernel runs, or while any command runs when commands
+  // are serialized
+  std::mutex& getKernelLock() const;
   llvm::LLVMContext* getLLVMContext() const;
+  // Number of worker threads, one per compute unit, that run each kernel
+  unsigned getNumWorkers() const;
+  // Lock that must be held while using the shared LLVM context
+  std::mutex& getLLVMContextLock() const;
+  // Profiler for phases and plugin callbacks, if enabled (otherwise NULL)
+  Profiler* getProfiler() const;
+
+  // Get the usage counter for a named category of allocations, creating it
+  // if necessary (the returned pointer stays valid for the Context lifetime)
+  MemoryUsage* getMemoryUsage(const std::string& category) const;
+  // Current number of bytes held by each category of allocations
+  std::map<std::string, size_t> getMemoryUsageTotals() const;
+  bool hasSubscribers(PluginCallback callback) const
+  {
+    const std::vector<Plugin*>* subscribers =
+      m_activeSubscribers ? m_activeSubscribers : m_subscribers;
+    return !subscribers[callback].empty();
+  }
+  bool isSampled() const
+  {
+    return !m_unsampled;
+  }
+  // Whether duplicate errors are suppressed and an error of errorClass has
+  // already been reported at site (the current instruction by default)
+  // during this kernel, in which case the caller shouldn't report it
+  bool isDuplicateError(const char* errorClass,
+                        const llvm::Instruction* site = NULL) const;
   bool isThreadSafe() const;
+  bool supportsParallelWorkGroups() const;
   void logError(const char* error) const;
+  // Add or save the results every plugin has for the work-groups run by a
+  // worker process, returning false if a plugin doesn't support them
+  bool mergePluginResults(const std::string& data) const;
+  // Whether any plugin notified on this thread needs instruction callbacks
+  bool needsInstructionCallbacks() const;
+  // Whether any plugin notified on this thread needs a callback as each
+  // instruction executes, rather than just the batched records of them
+  bool needsInstructionExecutedCallbacks() const;
+  // Whether any plugin notified on this thread needs uniform instructions to
+  // be executed by every work-item
+  bool needsUniformExecution() const;
+  // Index of a new kernel launch among all launches in this context
+  uint64_t nextLaunchIndex() const;
+  bool savePluginResults(std::string& data) const;
+  bool serializePlugins(std::string& data) const;
+
+  // Select the plugins notified while workGroup runs on this thread
+  // (unsampled groups, and groups a plugin doesn't want, only notify that
+  // plugin's unsampled callbacks), or notify every plugin if workGroup is NULL
+  void selectSubscribers(const WorkGroup* workGroup, bool sampled) const;
+
+  // Run kernels on numWorkers threads pinned to consecutive CPUs from
+  // firstCPU, so that contexts given disjoint ranges don't share cores
+  void setWorkers(unsigned firstCPU, unsigned numWorkers);
+
+  // Run task(id) for each worker id in [0, numWorkers), using a pool of
+  // threads that persists across kernel invocations
+  void runWorkers(unsigned numWorkers,
+                  const std::function<void(unsigned)>& task) const;
+
+  // Collect the host accesses made on this thread until endHostTransfer()
+  // into one transfer, which plugins are then notified of
+  void beginHostTransfer(HostTransfer* transfer) const;
+  void endHostTransfer() const;
 
   // Simulation callbacks
   void notifyInstructionExecuted(const WorkItem* workItem,
                                  const llvm::Instruction* instruction,
                                  const TypedValue& result) const;
+  void flushInstructionRecords() const;
+  void recordInstructionExecuted(const WorkItem* workItem,
+                                 const llvm::Instruction* instruction) const;
   void notifyKernelBegin(const KernelInvocation* kernelInvocation) const;
   void notifyKernelEnd(const KernelInvocation* kernelInvocation) const;
   void notifyMemoryAllocated(const Memory* memory, size_t address, size_t size,
@@ -70,15 +153,58 @@ public:
   void unregisterPlugin(Plugin* plugin);
 
 private:
-  mutable const KernelInvocation* m_kernelInvocation;
+  // Kernel invocation being run, which other commands can run alongside
+  mutable std::atomic<const KernelInvocation*> m_kernelInvocation;
+  const KernelInvocation* getCurrentInvocation() const;
+  void recordHostAccess(const Memory* memory, size_t address, size_t size,
+                        bool store) const;
   Memory* m_globalMemory;
+  CostModel* m_costModel;
+  Profiler* m_profiler;
+  mutable std::shared_timed_mutex m_deviceLock;
+  mutable std::mutex m_kernelLock;
 
   PluginList m_plugins;
   std::list<void*> m_pluginLibraries;
   void loadPlugins();
   void unloadPlugins();
 
+  // Plugins subscribed to each callback
+  std::vector<Plugin*> m_subscribers[NumPluginCallbacks];
+  void updateSubscribers();
+  void buildSubscribers(uint64_t reduced,
+                        std::vector<Plugin*>* subscribers) const;
+
+  // Subscriber lists for work-groups where some plugins are reduced to their
+  // unsampled callbacks, keyed by a bitmask of those plugins
+  struct SubscriberSet
+  {
+    std::vector<Plugin*> subscribers[NumPluginCallbacks];
+  };
+  mutable std::map<uint64_t, SubscriberSet> m_reducedSubscribers;
+  mutable std::mutex m_reducedSubscribersLock;
+  static THREAD_LOCAL const std::vector<Plugin*>* m_activeSubscribers;
+  static THREAD_LOCAL bool m_unsampled;
+
   llvm::LLVMContext* m_llvmContext;
+  mutable std::mutex m_llvmContextLock;
+
+  mutable std::map<std::string, MemoryUsage> m_memoryUsage;
+  mutable std::mutex m_memoryUsageLock;
+  bool m_reportMemoryUsage;
+  void reportMemoryUsage(const KernelInvocation* kernelInvocation) const;
+
+  bool m_dedupErrors;
+  mutable std::set<std::pair<const llvm::Instruction*, std::string>>
+    m_errorSites;
+  mutable size_t m_numDuplicateErrors;
+  mutable std::mutex m_errorSitesLock;
+
+  struct WorkerPool;
+  WorkerPool* m_workerPool;
+  unsigned m_numWorkers;
+  mutable std::atomic<uint64_t> m_numLaunches;
+  static void runPoolWorker(WorkerPool* pool, unsigned id, uint64_t job);
 
 public:
   class Message
@@ -0,0 +1,1330 @@
+// JITKernel.cpp (Oclgrind)
+// Copyright (c) 2013-2019, James Price and Simon McIntosh-Smith,
+// University of Bristol. All rights reserved.
+//
+// This program is provided under a three-clause BSD license. For full
+// license terms please see the LICENSE file distributed with this
+// source code.
+
+#include "common.h"
+
+#include <csetjmp>
+#include <cstddef>
+#include <exception>
+#include <mutex>
+
+#if !defined(_WIN32)
+#include <sys/mman.h>
+#include <ucontext.h>
+#endif
+
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/IR/DebugInfo.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Transforms/IPO.h"
+#include "llvm/Transforms/IPO/PassManagerBuilder.h"
+
+#include "Context.h"
+#include "JITKernel.h"
+#include "KernelInvocation.h"
+#include "Memory.h"
+#include "Program.h"
+#include "WorkGroup.h"
+#include "WorkItem.h"
+
+#define ENTRY_NAME "__oclgrind_entry"
+#define FIBER_STACK_SIZE (512 * 1024)
+#define MAX_STACK_ALLOCATION (64 * 1024)
+
+using namespace oclgrind;
+using namespace std;
+
+typedef InterpreterCache::DecodedInstruction DecodedInstruction;
+
+struct JITKernel::Fiber
+{
+  State state;
+  const JITKernel* kernel;
+  std::vector<const unsigned char*> values;
+  std::vector<void*> pointers;
+
+  bool finished;
+  std::exception_ptr error;
+
+  // Fibers without a stack run on the worker's stack until they finish
+  unsigned char* stack;
+  jmp_buf jump;
+#if !defined(_WIN32)
+  ucontext_t context;
+#endif
+};
+
+struct JITKernel::Worker
+{
+  std::unordered_map<const WorkItem*, Fiber*> fibers;
+  std::vector<Fiber*> spare;
+  Fiber direct;
+#if !defined(_WIN32)
+  ucontext_t caller;
+#endif
+};
+
+THREAD_LOCAL JITKernel::Fiber* JITKernel::m_currentFiber = NULL;
+THREAD_LOCAL JITKernel::Worker* JITKernel::m_worker = NULL;
+
+namespace
+{
+// Work-item builtins that read a field of the state (indexed by dimension)
+const std::map<std::string, size_t> stateBuiltins = {
+  {"get_enqueued_local_size", offsetof(JITKernel::State, enqueuedLocalSize)},
+  {"get_global_id", offsetof(JITKernel::State, globalID)},
+  {"get_global_offset", offsetof(JITKernel::State, globalOffset)},
+  {"get_global_size", offsetof(JITKernel::State, globalSize)},
+  {"get_group_id", offsetof(JITKernel::State, groupID)},
+  {"get_local_id", offsetof(JITKernel::State, localID)},
+  {"get_local_size", offsetof(JITKernel::State, localSize)},
+  {"get_num_groups", offsetof(JITKernel::State, numGroups)},
+  {"get_work_dim", offsetof(JITKernel::State, workDim)},
+};
+
+bool hasHalf(const llvm::Type* type)
+{
+  return type->getScalarType()->isHalfTy();
+}
+
+bool isPrivatePointer(const llvm::Type* type)
+{
+  type = type->getScalarType();
+  return type->isPointerTy() &&
+         type->getPointerAddressSpace() == AddrSpacePrivate;
+}
+
+// Value slots hold vector elements unpacked and booleans as bytes, so only
+// types with the same layout natively can be copied to and from them
+bool isSlotType(const llvm::Type* type)
+{
+  if (type->isAggregateType())
+    return false;
+  if (type->isVectorTy() && type->getScalarType()->isIntegerTy(1))
+    return false;
+  return !isPrivatePointer(type);
+}
+
+bool referencesVariable(const llvm::Constant* constant)
+{
+  if (llvm::isa<llvm::GlobalVariable>(constant))
+    return true;
+  for (const llvm::Use& op : constant->operands())
+  {
+    if (referencesVariable(llvm::cast<llvm::Constant>(op.get())))
+      return true;
+  }
+  return false;
+}
+
+// Variables may only be referenced by expressions, which are rebuilt from
+// instructions that use their values
+bool isSupportedConstant(const llvm::Constant* constant)
+{
+  if (llvm::isa<llvm::GlobalValue>(constant))
+    return true;
+  if (llvm::isa<llvm::BlockAddress>(constant))
+    return false;
+
+  auto expr = llvm::dyn_cast<llvm::ConstantExpr>(constant);
+  if (expr)
+  {
+    switch (expr->getOpcode())
+    {
+    case llvm::Instruction::AddrSpaceCast:
+      return false;
+    case llvm::Instruction::PtrToInt:
+      if (isPrivatePointer(expr->getOperand(0)->getType()))
+        return false;
+      break;
+    case llvm::Instruction::IntToPtr:
+      if (isPrivatePointer(expr->getType()))
+        return false;
+      break;
+    }
+  }
+
+  for (const llvm::Use& op : constant->operands())
+  {
+    auto c = llvm::cast<llvm::Constant>(op.get());
+    if (!expr && referencesVariable(c))
+      return false;
+    if (!isSupportedConstant(c))
+      return false;
+  }
+  return true;
+}
+
+// Replace constant expressions that reference variables with instructions
+void expandConstantExprs(llvm::Instruction* instruction)
+{
+  for (unsigned i = 0; i < instruction->getNumOperands(); i++)
+  {
+    auto expr = llvm::dyn_cast<llvm::ConstantExpr>(instruction->getOperand(i));
+    if (!expr || !referencesVariable(expr))
+      continue;
+
+    llvm::Instruction* insertBefore = instruction;
+    if (auto phi = llvm::dyn_cast<llvm::PHINode>(instruction))
+      insertBefore = phi->getIncomingBlock(i)->getTerminator();
+
+    llvm::Instruction* expanded = expr->getAsInstruction();
+    expanded->insertBefore(insertBefore);
+    instruction->setOperand(i, expanded);
+    expandConstantExprs(expanded);
+  }
+}
+
+// Compute GEP addresses with the interpreter's type layout, which also
+// describes the contents of memory shared with the simulator
+void lowerGEP(llvm::GetElementPtrInst* gep)
+{
+  llvm::IRBuilder<> builder(gep);
+  llvm::Type* intptr = builder.getIntNTy(sizeof(size_t) * 8);
+
+  llvm::Value* address =
+    builder.CreatePtrToInt(gep->getPointerOperand(), intptr);
+  llvm::Type* type = gep->getPointerOperandType();
+  for (auto idx = gep->idx_begin(); idx != gep->idx_end(); idx++)
+  {
+    if (type->isStructTy())
+    {
+      unsigned index = llvm::cast<llvm::ConstantInt>(*idx)->getZExtValue();
+      size_t offset =
+        getStructMemberOffset((const llvm::StructType*)type, index);
+      address =
+        builder.CreateAdd(address, llvm::ConstantInt::get(intptr, offset));
+      type = type->getStructElementType(index);
+      continue;
+    }
+
+    if (type->isPointerTy())
+      type = type->getPointerElementType();
+    else if (type->isArrayTy())
+      type = type->getArrayElementType();
+    else
+      type = llvm::cast<llvm::FixedVectorType>(type)->getElementType();
+
+    llvm::Value* index = builder.CreateSExtOrTrunc(*idx, intptr);
+    llvm::Value* offset = builder.CreateMul(
+      index, llvm::ConstantInt::get(intptr, getTypeSize(type)));
+    address = builder.CreateAdd(address, offset);
+  }
+
+  gep->replaceAllUsesWith(builder.CreateIntToPtr(address, gep->getType()));
+  gep->eraseFromParent();
+}
+
+// Give integer division the interpreter's results where its result is
+// undefined (zero for a zero divisor, and signed overflow computed at 64
+// bits), instead of trapping
+void guardDivision(llvm::BinaryOperator* division)
+{
+  llvm::IRBuilder<> builder(division);
+  llvm::Value* a = division->getOperand(0);
+  llvm::Value* b = division->getOperand(1);
+  llvm::Type* type = division->getType();
+  llvm::Type* wide = type;
+
+  bool isSigned = division->getOpcode() == llvm::Instruction::SDiv ||
+                  division->getOpcode() == llvm::Instruction::SRem;
+  if (isSigned && type->getScalarSizeInBits() < 64)
+  {
+    // Signed overflow can't occur once extended to 64 bits
+    wide = llvm::isa<llvm::VectorType>(type)
+             ? (llvm::Type*)llvm::VectorType::get(
+                 builder.getInt64Ty(),
+                 llvm::cast<llvm::VectorType>(type)->getElementCount())
+             : builder.getInt64Ty();
+    a = builder.CreateSExt(a, wide);
+    b = builder.CreateSExt(b, wide);
+  }
+
+  llvm::Value* zero = llvm::Constant::getNullValue(wide);
+  llvm::Value* invalid = builder.CreateICmpEQ(b, zero);
+  if (isSigned && wide == type)
+  {
+    unsigned bits = type->getScalarSizeInBits();
+    llvm::Value* overflow = builder.CreateAnd(
+      builder.CreateICmpEQ(
+        a, llvm::ConstantInt::get(wide, llvm::APInt::getSignedMinValue(bits))),
+      builder.CreateICmpEQ(b, llvm::Constant::getAllOnesValue(wide)));
+    invalid = builder.CreateOr(invalid, overflow);
+  }
+
+  llvm::Value* divisor =
+    builder.CreateSelect(invalid, llvm::ConstantInt::get(wide, 1), b);
+  llvm::Value* result = builder.CreateSelect(
+    invalid, zero,
+    builder.CreateBinOp(division->getOpcode(), a, divisor));
+  if (wide != type)
+    result = builder.CreateTrunc(result, type);
+
+  division->replaceAllUsesWith(result);
+  division->eraseFromParent();
+}
+
+unsigned getAccessAlignment(unsigned alignment, const llvm::Type* type)
+{
+  return alignment ? alignment : getTypeAlignment(type);
+}
+
+llvm::Constant* getHook(llvm::LLVMContext& context, uintptr_t address,
+                        llvm::FunctionType* type)
+{
+  llvm::Constant* value =
+    llvm::ConstantInt::get(llvm::Type::getIntNTy(context, sizeof(void*) * 8),
+                           address);
+  return llvm::ConstantExpr::getIntToPtr(value, type->getPointerTo());
+}
+} // namespace
+
+JITKernel::JITKernel()
+{
+  m_entry = NULL;
+  m_cache = NULL;
+  m_hasBarriers = false;
+}
+
+JITKernel::~JITKernel() {}
+
+void JITKernel::call(State* state, const void* instruction,
+                     const unsigned char** args, unsigned char* result)
+{
+  WorkItem* workItem = state->workItem;
+  auto decoded = (const DecodedInstruction*)instruction;
+  workItem->setCurrentInstruction(decoded);
+
+  try
+  {
+    // Move arguments into the value slots that builtins read them from
+    auto callInst = (const llvm::CallInst*)decoded->instruction;
+    for (unsigned i = 0; i < callInst->arg_size(); i++)
+    {
+      const InterpreterCache::OperandSlot& slot = decoded->operands[i];
+      if (slot.constant)
+        continue;
+      TypedValue value = workItem->getSlot(slot.index);
+      ::memcpy(value.data, args[i], value.size * value.num);
+    }
+
+    TypedValue value = workItem->getSlot(decoded->result);
+    const InterpreterCache::Builtin* builtin = decoded->builtin;
+    builtin->function.func(workItem, callInst, builtin->name,
+                           builtin->overload, value, builtin->function.op);
+    if (result)
+      ::memcpy(result, value.data, value.size * value.num);
+  }
+  catch (...)
+  {
+    m_currentFiber->error = current_exception();
+  }
+  if (m_currentFiber->error)
+    unwind();
+
+  if (workItem->m_state == WorkItem::BARRIER)
+    suspend(state);
+}
+
+bool JITKernel::compile(const Program* program, const llvm::Function* kernel)
+{
+  // Find the functions reachable from the kernel
+  vector<const llvm::Function*> functions(1, kernel);
+  set<const llvm::Function*> reachable(functions.begin(), functions.end());
+  for (unsigned f = 0; f < functions.size(); f++)
+  {
+    for (auto I = inst_begin(functions[f]); I != inst_end(functions[f]); I++)
+    {
+      auto call = llvm::dyn_cast<llvm::CallInst>(&*I);
+      const llvm::Function* callee = call ? call->getCalledFunction() : NULL;
+      if (callee && !callee->isDeclaration() && reachable.insert(callee).second)
+        functions.push_back(callee);
+    }
+  }
+  for (const llvm::Function* function : functions)
+  {
+    if (!isSupported(function))
+      return false;
+  }
+
+  // Arguments and variables are read from their work-item value slots
+  const llvm::Module* original = kernel->getParent();
+  vector<int> argSlots, variableSlots;
+  auto addValue = [this](const llvm::Value* value) {
+    m_values.push_back(value);
+    m_privateValues.push_back(isPrivatePointer(value->getType()));
+    return m_values.size() - 1;
+  };
+  for (auto arg = kernel->arg_begin(); arg != kernel->arg_end(); arg++)
+  {
+    argSlots.push_back(m_cache->hasValue(&*arg) ? addValue(&*arg) : -1);
+  }
+  for (auto G = original->global_begin(); G != original->global_end(); G++)
+  {
+    // Only the kernel's own local variables are allocated for it
+    bool local = G->getType()->getPointerAddressSpace() == AddrSpaceLocal;
+    if (m_cache->hasValue(&*G) &&
+        (!local || G->getName().startswith(kernel->getName())))
+      variableSlots.push_back(addValue(&*G));
+    else
+      variableSlots.push_back(-1);
+  }
+
+  // Copy the module into a private context owned by the JIT
+  unique_ptr<llvm::LLVMContext> context(new llvm::LLVMContext);
+  string bitcode;
+  {
+    lock_guard<mutex> lock(program->getContext()->getLLVMContextLock());
+    llvm::raw_string_ostream stream(bitcode);
+    llvm::WriteBitcodeToFile(*original, stream);
+  }
+  llvm::Expected<unique_ptr<llvm::Module>> parsed =
+    llvm::parseBitcodeFile(llvm::MemoryBufferRef(bitcode, ""), *context);
+  if (!parsed)
+  {
+    llvm::consumeError(parsed.takeError());
+    return false;
+  }
+  unique_ptr<llvm::Module> module = move(*parsed);
+
+  // Match functions, variables and instructions with the originals by
+  // position, to find the interpreter's decoding of each instruction
+  map<const llvm::Function*, llvm::Function*> copies;
+  auto copy = module->begin();
+  for (auto F = original->begin(); F != original->end(); F++, copy++)
+  {
+    copies[&*F] = &*copy;
+  }
+  map<llvm::GlobalVariable*, int> variables;
+  auto variable = module->global_begin();
+  for (size_t g = 0; g < variableSlots.size(); g++, variable++)
+  {
+    variables[&*variable] = variableSlots[g];
+  }
+  vector<llvm::Function*> targets;
+  map<const llvm::Instruction*, const DecodedInstruction*> decoded;
+  for (const llvm::Function* function : functions)
+  {
+    llvm::Function* target = copies[function];
+    targets.push_back(target);
+
+    auto B = target->begin();
+    for (auto O = function->begin(); O != function->end(); O++, B++)
+    {
+      const DecodedInstruction* entry = m_cache->getBlockEntry(&*O);
+      for (auto I = B->begin(); I != B->end(); I++)
+        decoded[&*I] = entry++;
+    }
+  }
+  set<llvm::Function*> targetSet(targets.begin(), targets.end());
+  for (auto F = module->begin(); F != module->end(); F++)
+  {
+    if (!F->isDeclaration() && !targetSet.count(&*F))
+      F->deleteBody();
+  }
+  llvm::StripDebugInfo(*module);
+
+  vector<llvm::LoadInst*> loads;
+  vector<llvm::StoreInst*> stores;
+  vector<llvm::CallInst*> calls;
+  vector<llvm::BinaryOperator*> divisions;
+  for (llvm::Function* F : targets)
+  {
+    vector<llvm::Instruction*> instructions;
+    for (auto I = inst_begin(F); I != inst_end(F); I++)
+      instructions.push_back(&*I);
+    for (llvm::Instruction* I : instructions)
+    {
+      if (auto load = llvm::dyn_cast<llvm::LoadInst>(I))
+        loads.push_back(load);
+      else if (auto store = llvm::dyn_cast<llvm::StoreInst>(I))
+        stores.push_back(store);
+      else if (auto call = llvm::dyn_cast<llvm::CallInst>(I))
+        calls.push_back(call);
+      else if (I->getOpcode() == llvm::Instruction::SDiv ||
+               I->getOpcode() == llvm::Instruction::SRem ||
+               I->getOpcode() == llvm::Instruction::UDiv ||
+               I->getOpcode() == llvm::Instruction::URem)
+        divisions.push_back((llvm::BinaryOperator*)I);
+      expandConstantExprs(I);
+    }
+  }
+
+  // Types of values shared with the simulator
+  llvm::LLVMContext& ctx = *context;
+  llvm::Type* voidTy = llvm::Type::getVoidTy(ctx);
+  llvm::Type* i8 = llvm::Type::getInt8Ty(ctx);
+  llvm::Type* i32 = llvm::Type::getInt32Ty(ctx);
+  llvm::Type* i64 = llvm::Type::getInt64Ty(ctx);
+  llvm::Type* intptr = llvm::Type::getIntNTy(ctx, sizeof(size_t) * 8);
+  llvm::PointerType* i8Ptr = i8->getPointerTo();
+  llvm::PointerType* i8PtrPtr = i8Ptr->getPointerTo();
+
+  llvm::FunctionType* callType =
+    llvm::FunctionType::get(voidTy, {i8Ptr, i8Ptr, i8PtrPtr, i8Ptr}, false);
+  llvm::FunctionType* getStateType = llvm::FunctionType::get(i8Ptr, false);
+  llvm::FunctionType* accessType = llvm::FunctionType::get(
+    voidTy, {i8Ptr, i8Ptr, i32, intptr, intptr, i32, i8Ptr}, false);
+  llvm::FunctionType* memcpyType = llvm::FunctionType::get(
+    voidTy, {i8Ptr, i8Ptr, i32, intptr, i32, intptr, intptr}, false);
+  llvm::FunctionType* memsetType = llvm::FunctionType::get(
+    voidTy, {i8Ptr, i8Ptr, i32, intptr, i8, intptr}, false);
+
+  auto getInstruction = [&](const llvm::Instruction* instruction) {
+    llvm::Constant* address =
+      llvm::ConstantInt::get(intptr, (uintptr_t)decoded[instruction]);
+    return llvm::ConstantExpr::getIntToPtr(address, i8Ptr);
+  };
+
+  // Each function gets the state from the thread running it on entry
+  map<llvm::Function*, llvm::Instruction*> states;
+  auto getStateValue = [&](llvm::Function* F) {
+    llvm::Instruction*& state = states[F];
+    if (!state)
+    {
+      state = llvm::CallInst::Create(
+        getStateType,
+        getHook(ctx, reinterpret_cast<uintptr_t>(&JITKernel::getState),
+                getStateType),
+        "", &*F->getEntryBlock().getFirstInsertionPt());
+    }
+    return state;
+  };
+  auto createBuffer = [&](llvm::Function* F, llvm::Type* type) {
+    return new llvm::AllocaInst(type, 0, "",
+                                &*F->getEntryBlock().getFirstInsertionPt());
+  };
+  auto getField = [&](llvm::IRBuilder<>& builder, llvm::Value* state,
+                      size_t offset, llvm::Type* type) {
+    llvm::Value* field = builder.CreateConstGEP1_64(i8, state, offset);
+    return builder.CreateBitCast(field, type->getPointerTo());
+  };
+  auto loadSlot = [&](llvm::IRBuilder<>& builder, llvm::Value* state,
+                      int slot, llvm::Type* type) {
+    llvm::Value* values = builder.CreateLoad(
+      i8PtrPtr, getField(builder, state, offsetof(State, values), i8PtrPtr));
+    llvm::Value* data = builder.CreateLoad(
+      i8Ptr, builder.CreateConstGEP1_64(i8Ptr, values, slot));
+    return builder.CreateLoad(
+      type, builder.CreateBitCast(data, type->getPointerTo()));
+  };
+
+  // Replace variables with their work-item values
+  for (auto G = module->global_begin(); G != module->global_end(); G++)
+  {
+    map<llvm::Function*, vector<llvm::Use*>> uses;
+    for (llvm::Use& use : G->uses())
+    {
+      auto user = llvm::dyn_cast<llvm::Instruction>(use.getUser());
+      if (user && targetSet.count(user->getFunction()))
+        uses[user->getFunction()].push_back(&use);
+    }
+    if (uses.empty())
+      continue;
+    if (variables[&*G] < 0)
+      return false;
+
+    for (auto& entry : uses)
+    {
+      llvm::Instruction* state = getStateValue(entry.first);
+      llvm::IRBuilder<> builder(state->getNextNode());
+      llvm::Value* value =
+        loadSlot(builder, state, variables[&*G], G->getType());
+      for (llvm::Use* use : entry.second)
+        use->set(value);
+    }
+  }
+
+  // Pass copies of by-value arguments explicitly, and drop attributes that
+  // assume native alignment of private memory
+  for (llvm::CallInst* call : calls)
+  {
+    llvm::Function* callee = call->getCalledFunction();
+    for (unsigned i = 0; i < call->arg_size(); i++)
+    {
+      if (callee->isDeclaration() ||
+          !callee->hasParamAttribute(i, llvm::Attribute::ByVal))
+        continue;
+
+      llvm::Value* arg = call->getArgOperand(i);
+      llvm::Type* type = arg->getType()->getPointerElementType();
+      llvm::AllocaInst* byval = createBuffer(call->getFunction(), type);
+      llvm::IRBuilder<> builder(call);
+      builder.CreateMemCpy(byval, llvm::MaybeAlign(1), arg,
+                           llvm::MaybeAlign(1), getTypeSize(type));
+      call->setArgOperand(i, byval);
+    }
+    for (unsigned i = 0; i < call->arg_size(); i++)
+    {
+      call->removeParamAttr(i, llvm::Attribute::ByVal);
+      call->removeParamAttr(i, llvm::Attribute::Alignment);
+    }
+  }
+  for (llvm::Function* F : targets)
+  {
+    for (unsigned i = 0; i < F->arg_size(); i++)
+    {
+      F->removeParamAttr(i, llvm::Attribute::ByVal);
+      F->removeParamAttr(i, llvm::Attribute::Alignment);
+    }
+  }
+
+  // Lay out private allocations and addresses as the interpreter does
+  for (llvm::Function* F : targets)
+  {
+    vector<llvm::AllocaInst*> allocas;
+    vector<llvm::GetElementPtrInst*> geps;
+    for (auto I = inst_begin(F); I != inst_end(F); I++)
+    {
+      if (auto alloca = llvm::dyn_cast<llvm::AllocaInst>(&*I))
+        allocas.push_back(alloca);
+      else if (auto gep = llvm::dyn_cast<llvm::GetElementPtrInst>(&*I))
+        geps.push_back(gep);
+    }
+
+    for (llvm::AllocaInst* alloca : allocas)
+    {
+      llvm::Type* type = alloca->getAllocatedType();
+      uint64_t num =
+        llvm::cast<llvm::ConstantInt>(alloca->getArraySize())->getZExtValue();
+      uint64_t size = max<uint64_t>(getTypeSize(type) * num, 1);
+      unsigned alignment =
+        max<unsigned>(alloca->getAlignment(), getTypeAlignment(type));
+      auto bytes = new llvm::AllocaInst(llvm::ArrayType::get(i8, size), 0,
+                                        NULL, llvm::Align(alignment), "",
+                                        alloca);
+      alloca->replaceAllUsesWith(
+        new llvm::BitCastInst(bytes, alloca->getType(), "", alloca));
+      alloca->eraseFromParent();
+    }
+    for (llvm::GetElementPtrInst* gep : geps)
+      lowerGEP(gep);
+  }
+  for (llvm::BinaryOperator* division : divisions)
+    guardDivision(division);
+
+  // Access memory outside of the work-item through the simulator
+  for (llvm::LoadInst* load : loads)
+  {
+    unsigned addrSpace = load->getPointerAddressSpace();
+    if (addrSpace == AddrSpacePrivate)
+    {
+      load->setAlignment(llvm::Align(1));
+      continue;
+    }
+
+    auto originalInst = (const llvm::LoadInst*)decoded[load]->instruction;
+    pair<unsigned, unsigned> size = getValueSize(originalInst);
+    unsigned alignment =
+      getAccessAlignment(originalInst->getAlignment(), originalInst->getType());
+
+    llvm::Function* F = load->getFunction();
+    llvm::AllocaInst* buffer = createBuffer(F, load->getType());
+    llvm::IRBuilder<> builder(load);
+    builder.CreateCall(
+      accessType,
+      getHook(ctx, reinterpret_cast<uintptr_t>(&JITKernel::load), accessType),
+      {getStateValue(F), getInstruction(load),
+       builder.getInt32(addrSpace),
+       builder.CreatePtrToInt(load->getPointerOperand(), intptr),
+       llvm::ConstantInt::get(intptr, size.first * size.second),
+       builder.getInt32(alignment), builder.CreateBitCast(buffer, i8Ptr)});
+    load->replaceAllUsesWith(builder.CreateLoad(load->getType(), buffer));
+    load->eraseFromParent();
+  }
+  for (llvm::StoreInst* store : stores)
+  {
+    unsigned addrSpace = store->getPointerAddressSpace();
+    if (addrSpace == AddrSpacePrivate)
+    {
+      store->setAlignment(llvm::Align(1));
+      continue;
+    }
+
+    auto originalInst = (const llvm::StoreInst*)decoded[store]->instruction;
+    const llvm::Value* originalValue = originalInst->getValueOperand();
+    pair<unsigned, unsigned> size = getValueSize(originalValue);
+    unsigned alignment = getAccessAlignment(originalInst->getAlignment(),
+                                            originalValue->getType());
+
+    llvm::Function* F = store->getFunction();
+    llvm::Value* value = store->getValueOperand();
+    llvm::AllocaInst* buffer = createBuffer(F, value->getType());
+    llvm::IRBuilder<> builder(store);
+    builder.CreateStore(value, buffer);
+    builder.CreateCall(
+      accessType,
+      getHook(ctx, reinterpret_cast<uintptr_t>(&JITKernel::store), accessType),
+      {getStateValue(F), getInstruction(store),
+       builder.getInt32(addrSpace),
+       builder.CreatePtrToInt(store->getPointerOperand(), intptr),
+       llvm::ConstantInt::get(intptr, size.first * size.second),
+       builder.getInt32(alignment), builder.CreateBitCast(buffer, i8Ptr)});
+    store->eraseFromParent();
+  }
+
+  // Lower calls to builtins and memory intrinsics
+  for (llvm::CallInst* call : calls)
+  {
+    llvm::Function* callee = call->getCalledFunction();
+    if (!callee->isDeclaration())
+      continue;
+
+    llvm::Function* F = call->getFunction();
+    llvm::IRBuilder<> builder(call);
+    if (auto transfer = llvm::dyn_cast<llvm::MemTransferInst>(call))
+    {
+      unsigned destAddrSpace = transfer->getDestAddressSpace();
+      unsigned srcAddrSpace = transfer->getSourceAddressSpace();
+      if (destAddrSpace == AddrSpacePrivate &&
+          srcAddrSpace == AddrSpacePrivate)
+      {
+        transfer->setDestAlignment(llvm::MaybeAlign(1));
+        transfer->setSourceAlignment(llvm::MaybeAlign(1));
+        continue;
+      }
+
+      builder.CreateCall(
+        memcpyType,
+        getHook(ctx, reinterpret_cast<uintptr_t>(&JITKernel::memcpy),
+                memcpyType),
+        {getStateValue(F), getInstruction(call),
+         builder.getInt32(destAddrSpace),
+         builder.CreatePtrToInt(transfer->getRawDest(), intptr),
+         builder.getInt32(srcAddrSpace),
+         builder.CreatePtrToInt(transfer->getRawSource(), intptr),
+         builder.CreateZExtOrTrunc(transfer->getLength(), intptr)});
+      call->eraseFromParent();
+      continue;
+    }
+    if (auto set = llvm::dyn_cast<llvm::MemSetInst>(call))
+    {
+      unsigned addrSpace = set->getDestAddressSpace();
+      if (addrSpace == AddrSpacePrivate)
+      {
+        set->setDestAlignment(llvm::MaybeAlign(1));
+        continue;
+      }
+
+      builder.CreateCall(
+        memsetType,
+        getHook(ctx, reinterpret_cast<uintptr_t>(&JITKernel::memset),
+                memsetType),
+        {getStateValue(F), getInstruction(call),
+         builder.getInt32(addrSpace),
+         builder.CreatePtrToInt(set->getRawDest(), intptr), set->getValue(),
+         builder.CreateZExtOrTrunc(set->getLength(), intptr)});
+      call->eraseFromParent();
+      continue;
+    }
+    if (callee->isIntrinsic() &&
+        callee->getIntrinsicID() != llvm::Intrinsic::trap)
+      continue;
+
+    const string& name = decoded[call]->builtin->name;
+    auto field = stateBuiltins.find(name);
+    if (field != stateBuiltins.end())
+    {
+      llvm::Value* result;
+      llvm::Value* base =
+        getField(builder, getStateValue(F), field->second, i64);
+      if (call->arg_size())
+      {
+        llvm::Value* dim =
+          builder.CreateZExtOrTrunc(call->getArgOperand(0), i64);
+        llvm::Value* valid = builder.CreateICmpULT(dim, builder.getInt64(3));
+        llvm::Value* index =
+          builder.CreateSelect(valid, dim, builder.getInt64(0));
+        result = builder.CreateLoad(i64, builder.CreateGEP(i64, base, index));
+        result = builder.CreateSelect(valid, result, builder.getInt64(0));
+      }
+      else
+      {
+        result = builder.CreateLoad(i64, base);
+      }
+      call->replaceAllUsesWith(
+        builder.CreateZExtOrTrunc(result, call->getType()));
+      call->eraseFromParent();
+      continue;
+    }
+
+    // Call the interpreter's implementation, suspending at barriers
+    if (name == "barrier" || name == "work_group_barrier")
+      m_hasBarriers = true;
+
+    llvm::Value* args = llvm::ConstantPointerNull::get(i8PtrPtr);
+    if (call->arg_size())
+    {
+      llvm::ArrayType* arrayType =
+        llvm::ArrayType::get(i8Ptr, call->arg_size());
+      llvm::AllocaInst* array = createBuffer(F, arrayType);
+      for (unsigned i = 0; i < call->arg_size(); i++)
+      {
+        llvm::Value* arg = llvm::ConstantPointerNull::get(i8Ptr);
+        if (!decoded[call]->operands[i].constant)
+        {
+          llvm::Value* value = call->getArgOperand(i);
+          llvm::AllocaInst* buffer = createBuffer(F, value->getType());
+          builder.CreateStore(value, buffer);
+          arg = builder.CreateBitCast(buffer, i8Ptr);
+        }
+        builder.CreateStore(arg,
+                            builder.CreateConstGEP2_32(arrayType, array, 0, i));
+      }
+      args = builder.CreateBitCast(array, i8PtrPtr);
+    }
+
+    llvm::Value* result = llvm::ConstantPointerNull::get(i8Ptr);
+    llvm::AllocaInst* buffer = NULL;
+    if (!call->getType()->isVoidTy())
+    {
+      buffer = createBuffer(F, call->getType());
+      result = builder.CreateBitCast(buffer, i8Ptr);
+    }
+    builder.CreateCall(
+      callType,
+      getHook(ctx, reinterpret_cast<uintptr_t>(&JITKernel::call), callType),
+      {getStateValue(F), getInstruction(call), args, result});
+    if (buffer)
+      call->replaceAllUsesWith(builder.CreateLoad(call->getType(), buffer));
+    call->eraseFromParent();
+  }
+
+  // Create an entry point that reads the kernel arguments from the state
+  llvm::Function* kernelCopy = targets.front();
+  llvm::Function* entry = llvm::Function::Create(
+    llvm::FunctionType::get(voidTy, {i8Ptr}, false),
+    llvm::GlobalValue::ExternalLinkage, ENTRY_NAME, module.get());
+  {
+    llvm::IRBuilder<> builder(llvm::BasicBlock::Create(ctx, "", entry));
+    vector<llvm::Value*> args;
+    for (auto arg = kernelCopy->arg_begin(); arg != kernelCopy->arg_end();
+         arg++)
+    {
+      int slot = argSlots[arg->getArgNo()];
+      if (slot < 0)
+        args.push_back(llvm::UndefValue::get(arg->getType()));
+      else
+        args.push_back(
+          loadSlot(builder, &*entry->arg_begin(), slot, arg->getType()));
+    }
+    builder.CreateCall(kernelCopy, args);
+    builder.CreateRetVoid();
+  }
+
+  // Remove everything else that only the interpreter needs
+  for (auto F = module->begin(); F != module->end(); F++)
+  {
+    F->setCallingConv(llvm::CallingConv::C);
+    F->removeFnAttr(llvm::Attribute::OptimizeNone);
+    if (!F->isDeclaration() && &*F != entry)
+      F->setLinkage(llvm::GlobalValue::InternalLinkage);
+    for (auto I = inst_begin(&*F); I != inst_end(&*F); I++)
+    {
+      if (auto call = llvm::dyn_cast<llvm::CallInst>(&*I))
+        call->setCallingConv(llvm::CallingConv::C);
+    }
+  }
+  for (auto G = module->global_begin(); G != module->global_end();)
+  {
+    llvm::GlobalVariable* var = &*G++;
+    var->removeDeadConstantUsers();
+    if (!var->use_empty())
+      var->replaceAllUsesWith(llvm::UndefValue::get(var->getType()));
+    var->eraseFromParent();
+  }
+  for (auto F = module->begin(); F != module->end();)
+  {
+    llvm::Function* function = &*F++;
+    function->removeDeadConstantUsers();
+    if (function->isDeclaration() && function->use_empty())
+      function->eraseFromParent();
+  }
+  module->setTargetTriple(llvm::sys::getProcessTriple());
+  if (llvm::verifyModule(*module))
+    return false;
+
+  // Create JIT and optimize for its target
+  llvm::Expected<unique_ptr<llvm::orc::LLJIT>> jit =
+    llvm::orc::LLJITBuilder().create();
+  if (!jit)
+  {
+    llvm::consumeError(jit.takeError());
+    return false;
+  }
+  m_jit = move(*jit);
+  module->setDataLayout(m_jit->getDataLayout());
+
+  llvm::PassManagerBuilder builder;
+  builder.OptLevel = 2;
+  builder.Inliner = llvm::createFunctionInliningPass();
+  llvm::legacy::FunctionPassManager functionPasses(module.get());
+  llvm::legacy::PassManager modulePasses;
+  builder.populateFunctionPassManager(functionPasses);
+  builder.populateModulePassManager(modulePasses);
+  functionPasses.doInitialization();
+  for (auto F = module->begin(); F != module->end(); F++)
+    functionPasses.run(*F);
+  functionPasses.doFinalization();
+  modulePasses.run(*module);
+
+  // Resolve math library functions from the process
+  auto generator =
+    llvm::orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(
+      m_jit->getDataLayout().getGlobalPrefix());
+  if (!generator)
+  {
+    llvm::consumeError(generator.takeError());
+    return false;
+  }
+  m_jit->getMainJITDylib().addGenerator(move(*generator));
+
+  llvm::Error error = m_jit->addIRModule(
+    llvm::orc::ThreadSafeModule(move(module), move(context)));
+  if (error)
+  {
+    llvm::consumeError(move(error));
+    return false;
+  }
+
+  auto symbol = m_jit->lookup(ENTRY_NAME);
+  if (!symbol)
+  {
+    llvm::consumeError(symbol.takeError());
+    return false;
+  }
+#if LLVM_VERSION_MAJOR >= 15
+  m_entry = symbol->toPtr<void (*)(State*)>();
+#else
+  m_entry = (void (*)(State*))symbol->getAddress();
+#endif
+
+  return true;
+}
+
+JITKernel* JITKernel::create(const Program* program,
+                             const llvm::Function* kernel)
+{
+#if defined(_WIN32)
+  // Work-items run as POSIX fibers
+  return NULL;
+#endif
+
+  static once_flag initialized;
+  call_once(initialized, []() {
+    llvm::InitializeNativeTarget();
+    llvm::InitializeNativeTargetAsmPrinter();
+  });
+
+  JITKernel* jit = new JITKernel;
+  jit->m_cache = program->getInterpreterCache(kernel);
+  if (!jit->compile(program, kernel))
+  {
+    delete jit;
+    return NULL;
+  }
+  return jit;
+}
+
+void JITKernel::finish(Fiber* fiber) const
+{
+  WorkItem* workItem = fiber->state.workItem;
+  workItem->m_state = WorkItem::FINISHED;
+  workItem->m_workGroup->notifyFinished(workItem);
+  workItem->m_context->notifyWorkItemComplete(workItem);
+}
+
+JITKernel::State* JITKernel::getState()
+{
+  return &m_currentFiber->state;
+}
+
+void JITKernel::initState(Fiber* fiber, WorkItem* workItem) const
+{
+  const KernelInvocation* kernelInvocation = workItem->m_kernelInvocation;
+  const WorkGroup* workGroup = workItem->m_workGroup;
+
+  State& state = fiber->state;
+  state.workItem = workItem;
+  for (unsigned i = 0; i < 3; i++)
+  {
+    state.globalID[i] = workItem->m_globalID[i];
+    state.globalOffset[i] = kernelInvocation->getGlobalOffset()[i];
+    state.globalSize[i] = kernelInvocation->getGlobalSize()[i];
+    state.groupID[i] = workGroup->getGroupID()[i];
+    state.localID[i] = workItem->m_localID[i];
+    state.localSize[i] = workGroup->getGroupSize()[i];
+    state.enqueuedLocalSize[i] = kernelInvocation->getLocalSize()[i];
+    state.numGroups[i] = kernelInvocation->getNumGroups()[i];
+  }
+  state.workDim = kernelInvocation->getWorkDim();
+
+  fiber->kernel = this;
+  fiber->values.resize(m_values.size());
+  fiber->pointers.resize(m_values.size());
+  for (unsigned i = 0; i < m_values.size(); i++)
+  {
+    const unsigned char* data = workItem->getValueData(m_values[i]);
+    if (m_privateValues[i])
+    {
+      size_t address = *(const size_t*)data;
+      fiber->pointers[i] = workItem->m_privateMemory->getPointer(address);
+      data = (const unsigned char*)&fiber->pointers[i];
+    }
+    fiber->values[i] = data;
+  }
+  state.values = fiber->values.data();
+
+  fiber->finished = false;
+  fiber->error = nullptr;
+}
+
+bool JITKernel::isSupported(const llvm::Function* function) const
+{
+  if (function->isVarArg())
+    return false;
+
+  size_t stackAllocation = 0;
+  for (auto B = function->begin(); B != function->end(); B++)
+  {
+    const DecodedInstruction* decoded = m_cache->getBlockEntry(&*B);
+    for (auto I = B->begin(); I != B->end(); I++, decoded++)
+    {
+      if (WorkItem::getInstructionHandler(I->getOpcode()) ==
+            &WorkItem::unsupported ||
+          I->getOpcode() == llvm::Instruction::Unreachable)
+        return false;
+
+      if (hasHalf(I->getType()))
+        return false;
+      for (const llvm::Use& op : I->operands())
+      {
+        if (hasHalf(op->getType()))
+          return false;
+        auto constant = llvm::dyn_cast<llvm::Constant>(op.get());
+        if (constant && !isSupportedConstant(constant))
+          return false;
+      }
+
+      if (auto alloca = llvm::dyn_cast<llvm::AllocaInst>(&*I))
+      {
+        auto num = llvm::dyn_cast<llvm::ConstantInt>(alloca->getArraySize());
+        if (!num || alloca->getParent() != &function->getEntryBlock())
+          return false;
+        stackAllocation +=
+          getTypeSize(alloca->getAllocatedType()) * num->getZExtValue();
+      }
+      else if (llvm::isa<llvm::LoadInst>(&*I) ||
+               llvm::isa<llvm::StoreInst>(&*I))
+      {
+        auto load = llvm::dyn_cast<llvm::LoadInst>(&*I);
+        auto store = llvm::dyn_cast<llvm::StoreInst>(&*I);
+        const llvm::Type* type =
+          load ? load->getType() : store->getValueOperand()->getType();
+        unsigned addrSpace = load ? load->getPointerAddressSpace()
+                                  : store->getPointerAddressSpace();
+        if (type->isAggregateType() || addrSpace > AddrSpaceLocal)
+          return false;
+        if (addrSpace != AddrSpacePrivate && !isSlotType(type))
+          return false;
+      }
+      else if (auto gep = llvm::dyn_cast<llvm::GetElementPtrInst>(&*I))
+      {
+        if (gep->getType()->isVectorTy())
+          return false;
+      }
+      else if (I->getOpcode() == llvm::Instruction::PtrToInt)
+      {
+        if (isPrivatePointer(I->getOperand(0)->getType()))
+          return false;
+      }
+      else if (I->getOpcode() == llvm::Instruction::IntToPtr)
+      {
+        if (isPrivatePointer(I->getType()))
+          return false;
+      }
+      else if (auto call = llvm::dyn_cast<llvm::CallInst>(&*I))
+      {
+        const llvm::Function* callee = call->getCalledFunction();
+        if (!callee)
+          return false;
+        if (!callee->isDeclaration())
+          continue;
+
+        if (auto transfer = llvm::dyn_cast<llvm::MemTransferInst>(call))
+        {
+          if (transfer->getDestAddressSpace() > AddrSpaceLocal ||
+              transfer->getSourceAddressSpace() > AddrSpaceLocal)
+            return false;
+          continue;
+        }
+        if (auto set = llvm::dyn_cast<llvm::MemSetInst>(call))
+        {
+          if (set->getDestAddressSpace() > AddrSpaceLocal)
+            return false;
+          continue;
+        }
+        if (callee->isIntrinsic() &&
+            callee->getIntrinsicID() != llvm::Intrinsic::trap)
+        {
+          // Other intrinsics run natively
+          for (unsigned i = 0; i < call->arg_size(); i++)
+          {
+            const llvm::Type* type = call->getArgOperand(i)->getType();
+            if (type->isPointerTy() && !isPrivatePointer(type))
+              return false;
+          }
+          continue;
+        }
+
+        // Builtin arguments and results are passed through value slots
+        if (!decoded->builtin)
+          return false;
+        if (!call->getType()->isVoidTy() && !isSlotType(call->getType()))
+          return false;
+        for (unsigned i = 0; i < call->arg_size(); i++)
+        {
+          if (!isSlotType(call->getArgOperand(i)->getType()))
+            return false;
+        }
+      }
+    }
+  }
+
+  return stackAllocation <= MAX_STACK_ALLOCATION;
+}
+
+void JITKernel::load(State* state, const void* instruction,
+                     unsigned addrSpace, size_t address, size_t size,
+                     unsigned alignment, unsigned char* data)
+{
+  WorkItem* workItem = state->workItem;
+  workItem->setCurrentInstruction((const DecodedInstruction*)instruction);
+  try
+  {
+    workItem->loadMemory(addrSpace, address, size, alignment, data);
+  }
+  catch (...)
+  {
+    m_currentFiber->error = current_exception();
+  }
+  if (m_currentFiber->error)
+    unwind();
+}
+
+void JITKernel::memcpy(State* state, const void* instruction,
+                       unsigned destAddrSpace, size_t dest,
+                       unsigned srcAddrSpace, size_t src, size_t size)
+{
+  WorkItem* workItem = state->workItem;
+  workItem->setCurrentInstruction((const DecodedInstruction*)instruction);
+  try
+  {
+    // Private memory is addressed natively
+    unsigned char* buffer = workItem->m_pool->alloc(size);
+    if (srcAddrSpace == AddrSpacePrivate)
+      ::memcpy(buffer, (const void*)src, size);
+    else
+      workItem->getMemory(srcAddrSpace)->load(buffer, src, size);
+    if (destAddrSpace == AddrSpacePrivate)
+      ::memcpy((void*)dest, buffer, size);
+    else
+      workItem->getMemory(destAddrSpace)->store(buffer, dest, size);
+  }
+  catch (...)
+  {
+    m_currentFiber->error = current_exception();
+  }
+  if (m_currentFiber->error)
+    unwind();
+}
+
+void JITKernel::memset(State* state, const void* instruction,
+                       unsigned addrSpace, size_t dest, uint8_t value,
+                       size_t size)
+{
+  WorkItem* workItem = state->workItem;
+  workItem->setCurrentInstruction((const DecodedInstruction*)instruction);
+  try
+  {
+    unsigned char* buffer = workItem->m_pool->alloc(size);
+    ::memset(buffer, value, size);
+    workItem->getMemory(addrSpace)->store(buffer, dest, size);
+  }
+  catch (...)
+  {
+    m_currentFiber->error = current_exception();
+  }
+  if (m_currentFiber->error)
+    unwind();
+}
+
+void JITKernel::releaseWorker()
+{
+  if (!m_worker)
+    return;
+
+  for (auto& entry : m_worker->fibers)
+    m_worker->spare.push_back(entry.second);
+  for (Fiber* fiber : m_worker->spare)
+  {
+#if !defined(_WIN32)
+    munmap(fiber->stack, FIBER_STACK_SIZE);
+#endif
+    delete fiber;
+  }
+  delete m_worker;
+  m_worker = NULL;
+}
+
+void JITKernel::resume(Fiber* fiber) const
+{
+  m_currentFiber = fiber;
+  if (fiber->stack)
+  {
+#if !defined(_WIN32)
+    swapcontext(&m_worker->caller, &fiber->context);
+#endif
+  }
+  else if (!setjmp(fiber->jump))
+  {
+    m_entry(&fiber->state);
+    fiber->finished = true;
+  }
+  m_currentFiber = NULL;
+}
+
+void JITKernel::run(WorkItem* workItem) const
+{
+  if (!m_worker)
+    m_worker = new Worker;
+
+  Fiber* fiber = &m_worker->direct;
+  fiber->stack = NULL;
+  if (m_hasBarriers)
+  {
+    // Work-items that reach a barrier keep their fiber until they finish
+    Fiber*& entry = m_worker->fibers[workItem];
+    if (!entry)
+    {
+      if (m_worker->spare.empty())
+      {
+        entry = new Fiber;
+#if !defined(_WIN32)
+        void* stack = mmap(NULL, FIBER_STACK_SIZE, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (stack == MAP_FAILED)
+          FATAL_ERROR("Failed to allocate work-item stack");
+        entry->stack = (unsigned char*)stack;
+#endif
+      }
+      else
+      {
+        entry = m_worker->spare.back();
+        m_worker->spare.pop_back();
+      }
+    }
+    fiber = entry;
+  }
+
+  if (workItem->begin())
+  {
+    // Work-items reset after an error may still have a fiber, which is
+    // restarted from the beginning
+    initState(fiber, workItem);
+#if !defined(_WIN32)
+    if (fiber->stack)
+    {
+      getcontext(&fiber->context);
+      fiber->context.uc_stack.ss_sp = fiber->stack;
+      fiber->context.uc_stack.ss_size = FIBER_STACK_SIZE;
+      fiber->context.uc_link = &m_worker->caller;
+      makecontext(&fiber->context, &JITKernel::runFiber, 0);
+    }
+#endif
+  }
+
+  resume(fiber);
+
+  if (fiber->finished || fiber->error)
+  {
+    if (fiber->stack)
+    {
+      m_worker->fibers.erase(workItem);
+      m_worker->spare.push_back(fiber);
+    }
+    if (fiber->error)
+    {
+      exception_ptr error = fiber->error;
+      fiber->error = nullptr;
+      rethrow_exception(error);
+    }
+    finish(fiber);
+  }
+}
+
+void JITKernel::runFiber()
+{
+  Fiber* fiber = m_currentFiber;
+  fiber->kernel->m_entry(&fiber->state);
+  fiber->finished = true;
+}
+
+void JITKernel::store(State* state, const void* instruction,
+                      unsigned addrSpace, size_t address, size_t size,
+                      unsigned alignment, const unsigned char* data)
+{
+  WorkItem* workItem = state->workItem;
+  workItem->setCurrentInstruction((const DecodedInstruction*)instruction);
+  try
+  {
+    workItem->storeMemory(addrSpace, address, size, alignment, data);
+  }
+  catch (...)
+  {
+    m_currentFiber->error = current_exception();
+  }
+  if (m_currentFiber->error)
+    unwind();
+}
+
+void JITKernel::suspend(State* state)
+{
+  // Resumed by run() once the work-group has cleared the barrier
+  Fiber* fiber = m_currentFiber;
+#if !defined(_WIN32)
+  swapcontext(&fiber->context, &m_worker->caller);
+#endif
+}
+
+void JITKernel::unwind()
+{
+  // Return to run() without unwinding through generated code, which has no
+  // exception handling information
+  Fiber* fiber = m_currentFiber;
+  if (fiber->stack)
+  {
+#if !defined(_WIN32)
+    setcontext(&m_worker->caller);
+#endif
+  }
+  longjmp(fiber->jump, 1);
+}
@@ -0,0 +1,111 @@
+// JITKernel.h (Oclgrind)
+// Copyright (c) 2013-2019, James Price and Simon McIntosh-Smith,
+// University of Bristol. All rights reserved.
+//
+// This program is provided under a three-clause BSD license. For full
+// license terms please see the LICENSE file distributed with this
+// source code.
+
+#include "common.h"
+
+namespace llvm
+{
+class Function;
+namespace orc
+{
+class LLJIT;
+}
+} // namespace llvm
+
+namespace oclgrind
+{
+class InterpreterCache;
+class Program;
+class WorkItem;
+
+// Native code compiled from a kernel, which runs work-items without the
+// interpreter when no plugin needs per-instruction callbacks. Global, local
+// and constant memory accesses, builtin calls and barriers are lowered to
+// calls back into the simulator, while private memory is native.
+class JITKernel
+{
+public:
+  // Returns NULL if the kernel uses anything the JIT doesn't support
+  static JITKernel* create(const Program* program,
+                           const llvm::Function* kernel);
+  ~JITKernel();
+
+  // Run a work-item until it reaches a barrier or finishes
+  void run(WorkItem* workItem) const;
+
+  // Release execution state held by the calling worker thread
+  static void releaseWorker();
+
+  // Work-item state shared with generated code, which accesses its fields by
+  // offset (all fields below workItem are read-only to generated code)
+  struct State
+  {
+    WorkItem* workItem;
+    uint64_t globalID[3];
+    uint64_t globalOffset[3];
+    uint64_t globalSize[3];
+    uint64_t groupID[3];
+    uint64_t localID[3];
+    uint64_t localSize[3];
+    uint64_t enqueuedLocalSize[3];
+    uint64_t numGroups[3];
+    uint64_t workDim;
+
+    // Data of each argument and variable in m_values, with private memory
+    // pointers translated to host addresses
+    const unsigned char** values;
+  };
+
+private:
+  JITKernel();
+
+  struct Fiber;
+  struct Worker;
+
+  std::unique_ptr<llvm::orc::LLJIT> m_jit;
+  void (*m_entry)(State*);
+
+  const InterpreterCache* m_cache;
+  std::vector<const llvm::Value*> m_values;
+  std::vector<bool> m_privateValues;
+
+  // Work-items get their own stack when they may suspend at a barrier
+  bool m_hasBarriers;
+
+  // Fiber running on this thread, and this thread's suspended fibers
+  static THREAD_LOCAL Fiber* m_currentFiber;
+  static THREAD_LOCAL Worker* m_worker;
+
+  bool compile(const Program* program, const llvm::Function* kernel);
+  void finish(Fiber* fiber) const;
+  void initState(Fiber* fiber, WorkItem* workItem) const;
+  bool isSupported(const llvm::Function* function) const;
+  void resume(Fiber* fiber) const;
+  static void runFiber();
+  static void unwind();
+
+  // Callbacks from generated code, which passes the decoded interpreter
+  // instruction that each callback is made for as an opaque pointer
+  static void call(State* state, const void* instruction,
+                   const unsigned char** args, unsigned char* result);
+  static State* getState();
+  static void load(State* state, const void* instruction, unsigned addrSpace,
+                   size_t address, size_t size, unsigned alignment,
+                   unsigned char* data);
+  static void memcpy(State* state, const void* instruction,
+                     unsigned destAddrSpace, size_t dest,
+                     unsigned srcAddrSpace, size_t src, size_t size);
+  static void memset(State* state, const void* instruction,
+                     unsigned addrSpace, size_t dest, uint8_t value,
+                     size_t size);
+  static void store(State* state, const void* instruction, unsigned addrSpace,
+                    size_t address, size_t size, unsigned alignment,
+                    const unsigned char* data);
+  static void suspend(State* state);
+};
+} // namespace oclgrind
@@ -9,6 +9,7 @@
 #include "common.h"
 #include "config.h"
 
+#include <mutex>
 #include <sstream>
 
 #include "llvm/IR/Constants.h"
@@ -16,6 +17,7 @@
 #include "llvm/IR/Module.h"
 #include "llvm/Support/raw_os_ostream.h"
 
+#include "Context.h"
 #include "Kernel.h"
 #include "Program.h"
 
@@ -26,6 +28,8 @@ Kernel::Kernel(const Program* program, const llvm::Function* function,
                const llvm::Module* module)
     : m_program(program), m_function(function), m_name(function->getName())
 {
+  m_values = make_shared<Values>();
+
   // Set-up global variables
   llvm::Module::const_global_iterator itr;
   for (itr = module->global_begin(); itr != module->global_end(); itr++)
@@ -40,13 +44,13 @@ Kernel::Kernel(const Program* program, const llvm::Function* function,
       unsigned size = getTypeSize(init->getType());
       TypedValue value = {size, 1, new uint8_t[size]};
       getConstantData(value.data, init);
-      m_values[&*itr] = value;
+      m_values->map[&*itr] = value;
 
       break;
     }
     case AddrSpaceGlobal:
     case AddrSpaceConstant:
-      m_values[&*itr] = program->getProgramScopeVar(&*itr).clone();
+      m_values->map[&*itr] = program->getProgramScopeVar(&*itr).clone();
       break;
     case AddrSpaceLocal:
     {
@@ -57,7 +61,7 @@ Kernel::Kernel(const Program* program, const llvm::Function* function,
       // Get size of allocation
       TypedValue allocSize = {getTypeSize(itr->getInitializer()->getType()), 1,
                               NULL};
-      m_values[&*itr] = allocSize;
+      m_values->map[&*itr] = allocSize;
 
       break;
     }
@@ -111,16 +115,23 @@ Kernel::Kernel(const Kernel& kernel) : m_program(kernel.m_program)
   m_metadata = kernel.m_metadata;
   m_requiresUniformWorkGroups = kernel.m_requiresUniformWorkGroups;
 
-  for (auto itr = kernel.m_values.begin(); itr != kernel.m_values.end(); itr++)
+  // Share values until either kernel sets an argument
+  m_values = kernel.m_values;
+}
+
+Kernel::~Kernel() {}
+
+Kernel::Values::Values(const Values& values)
+{
+  for (auto itr = values.map.begin(); itr != values.map.end(); itr++)
   {
-    m_values[itr->first] = itr->second.clone();
+    map[itr->first] = itr->second.clone();
   }
 }
 
-Kernel::~Kernel()
+Kernel::Values::~Values()
 {
-  TypedValueMap::iterator itr;
-  for (itr = m_values.begin(); itr != m_values.end(); itr++)
+  for (auto itr = map.begin(); itr != map.end(); itr++)
   {
     delete[] itr->second.data;
   }
@@ -131,7 +142,7 @@ bool Kernel::allArgumentsSet() const
   llvm::Function::const_arg_iterator itr;
   for (itr = m_function->arg_begin(); itr != m_function->arg_end(); itr++)
   {
-    if (!m_values.count(&*itr))
+    if (!m_values->map.count(&*itr))
     {
       return false;
     }
@@ -375,7 +386,8 @@ const llvm::Function* Kernel::getFunction() const
 size_t Kernel::getLocalMemorySize() const
 {
   size_t sz = 0;
-  for (auto value = m_values.begin(); value != m_values.end(); value++)
+  for (auto value = m_values->map.begin(); value != m_values->map.end();
+       value++)
   {
     const llvm::Type* type = value->first->getType();
     if (type->isPointerTy() && type->getPointerAddressSpace() == AddrSpaceLocal)
@@ -423,15 +435,21 @@ void Kernel::setArgument(unsigned int index, TypedValue value)
 
   const llvm::Value* argument = getArgument(index);
 
+  // Copy values that are shared with another kernel before changing them
+  if (m_values.use_count() > 1)
+    m_values = make_shared<Values>(*m_values);
+  TypedValueMap& values = m_values->map;
+
   // Deallocate existing argument
-  if (m_values.count(argument))
+  if (values.count(argument))
   {
-    delete[] m_values[argument].data;
+    delete[] values[argument].data;
   }
 
   if (getArgumentTypeName(index).str() == "sampler_t")
   {
     // Get an llvm::ConstantInt that represents the sampler value
+    lock_guard<mutex> lock(m_program->getContext()->getLLVMContextLock());
     llvm::Type* i32 = llvm::Type::getInt32Ty(m_program->getLLVMContext());
     llvm::Constant* samplerValue = llvm::ConstantInt::get(i32, value.getSInt());
 
@@ -442,20 +460,20 @@ void Kernel::setArgument(unsigned int index, TypedValue value)
     sampler.data = new unsigned char[sizeof(size_t)];
     sampler.setPointer((size_t)samplerValue);
 
-    m_values[argument] = sampler;
+    values[argument] = sampler;
   }
   else
   {
-    m_values[argument] = value.clone();
+    values[argument] = value.clone();
   }
 }
 
 TypedValueMap::const_iterator Kernel::values_begin() const
 {
-  return m_values.begin();
+  return m_values->map.begin();
 }
 
 TypedValueMap::const_iterator Kernel::values_end() const
 {
-  return m_values.end();
+  return m_values->map.end();
 }
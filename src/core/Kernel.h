@@ -59,7 +59,17 @@ private:
   const llvm::MDNode* m_metadata;
   std::string m_name;
 
-  TypedValueMap m_values;
+  // Values of arguments and global variables, shared with copies of the
+  // kernel (such as those held by enqueued commands) until one of them sets
+  // an argument
+  struct Values
+  {
+    TypedValueMap map;
+    Values() {}
+    Values(const Values& values);
+    ~Values();
+  };
+  std::shared_ptr<Values> m_values;
 
   bool m_requiresUniformWorkGroups;
 
@@ -8,14 +8,25 @@
 
 #include "common.h"
 
-#include <atomic>
+#include <algorithm>
+#include <cerrno>
+#include <deque>
+#include <fstream>
+#include <mutex>
 #include <sstream>
 #include <thread>
 
+#if !defined(_WIN32)
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
 #include "Context.h"
+#include "JITKernel.h"
 #include "Kernel.h"
 #include "KernelInvocation.h"
 #include "Memory.h"
+#include "Profiler.h"
 #include "Program.h"
 #include "WorkGroup.h"
 #include "WorkItem.h"
@@ -23,14 +34,36 @@
 using namespace oclgrind;
 using namespace std;
 
+#define CHECKPOINT_MAGIC "OCLGRIND_CHECKPOINT"
+#define CHECKPOINT_VERSION 1
+
 struct
 {
   int id;
   WorkGroup* workGroup;
   WorkItem* workItem;
+  bool native;
 } static THREAD_LOCAL workerState;
 
-static atomic<unsigned> nextGroupIndex;
+// Pipe this process writes its results to, if it is a worker process
+static int workerProcessOutput = -1;
+
+// Held by a launch divided between worker processes, as only one at a time
+// can track the global memory it writes
+static mutex workerProcessLaunch;
+
+#if !defined(_WIN32)
+static bool readPipe(int fd, string& data);
+static bool writePipe(int fd, const string& data);
+#endif
+
+// Contiguous ranges [first, second) of indices into m_workGroups, owned by a
+// single worker and taken from the front, or stolen from the back by others
+struct KernelInvocation::WorkerQueue
+{
+  mutex lock;
+  deque<pair<size_t, size_t>> chunks;
+};
 
 KernelInvocation::KernelInvocation(const Context* context, const Kernel* kernel,
                                    unsigned int workDim, Size3 globalOffset,
@@ -52,12 +85,46 @@ KernelInvocation::KernelInvocation(const Context* context, const Kernel* kernel,
     m_numGroups.z += m_globalSize.z % m_localSize.z ? 1 : 0;
   }
 
-  // Check for user overriding number of threads
-  m_numWorkers =
-    getEnvInt("OCLGRIND_NUM_THREADS", thread::hardware_concurrency(), false);
-  if (!m_numWorkers || !m_context->isThreadSafe())
+  m_numWorkers = m_context->getNumWorkers();
+  if (!m_numWorkers || !m_context->supportsParallelWorkGroups())
+    m_numWorkers = 1;
+
+  // Deterministic mode executes work-groups in order on a single worker
+  if (checkEnv("OCLGRIND_DETERMINISTIC"))
     m_numWorkers = 1;
 
+  // Number of consecutive work-groups handed out or stolen at a time
+  m_chunkSize = getEnvInt("OCLGRIND_WG_CHUNK", 1, false);
+
+  // Number of processes to divide work-groups between
+  m_numProcesses = getEnvInt("OCLGRIND_PROCESSES", 1, false);
+
+  // Check for lockstep execution of work-items
+  m_lockstep = checkEnv("OCLGRIND_LOCKSTEP");
+  m_jit = NULL;
+
+  const InterpreterCache* cache =
+    m_kernel->getProgram()->getInterpreterCache(m_kernel->getFunction());
+  m_uniformValues =
+    cache->getNumUniformValues() ? new UniformValues(cache) : NULL;
+
+  // Check for periodic checkpoints (interval given in seconds)
+  m_launchIndex = m_context->nextLaunchIndex();
+  const char* checkpoint = getenv("OCLGRIND_CHECKPOINT");
+  if (checkpoint)
+    m_checkpointFile = checkpoint;
+  m_checkpointInterval = getEnvInt("OCLGRIND_CHECKPOINT_INTERVAL", 600) * 1e9;
+  m_checkpointPending = false;
+  m_numActiveWorkers = 0;
+  m_numPausedWorkers = 0;
+  m_numCheckpoints = 0;
+
+  // Check for sampling of work-groups by expensive plugins
+  m_sampleInterval = getEnvInt("OCLGRIND_SAMPLE", 1, false);
+  m_sampleSeed = getEnvInt("OCLGRIND_SAMPLE_SEED", 0);
+  m_sampleStrided = checkEnv("OCLGRIND_SAMPLE_STRIDED");
+  m_numSampledGroups = 0;
+
   // Check for quick-mode environment variable
   if (checkEnv("OCLGRIND_QUICK"))
   {
@@ -91,6 +158,40 @@ KernelInvocation::~KernelInvocation()
     delete m_runningGroups.front();
     m_runningGroups.pop_front();
   }
+
+  delete m_uniformValues;
+}
+
+void KernelInvocation::finishWorkerProcess()
+{
+#if !defined(_WIN32)
+  string results;
+  writeBinary(results, (uint64_t)m_numSampledGroups);
+
+  // Send the contents of every range of global memory written
+  Memory* memory = m_context->getGlobalMemory();
+  vector<pair<size_t, size_t>> ranges;
+  bool atomicWrites = memory->takeWrites(ranges);
+  writeBinary(results, (uint32_t)atomicWrites);
+  writeBinary(results, (uint64_t)ranges.size());
+  for (const pair<size_t, size_t>& range : ranges)
+  {
+    writeBinary(results, (uint64_t)range.first);
+    writeBinary(results, string((const char*)memory->getPointer(range.first),
+                                range.second));
+  }
+
+  string pluginResults;
+  m_context->savePluginResults(pluginResults);
+  writeBinary(results, pluginResults);
+
+  // Exit without destroying the context, which the coordinator still owns
+  cout.flush();
+  fflush(NULL);
+  bool sent = writePipe(workerProcessOutput, results);
+  close(workerProcessOutput);
+  _exit(sent ? 0 : 1);
+#endif
 }
 
 const Context* KernelInvocation::getContext() const
@@ -133,11 +234,272 @@ Size3 KernelInvocation::getNumGroups() const
   return m_numGroups;
 }
 
+size_t KernelInvocation::getNumSampledGroups() const
+{
+  return m_numSampledGroups;
+}
+
+double KernelInvocation::getSamplingFactor() const
+{
+  // Scale applied to sampled results to estimate the whole kernel
+  if (!m_numSampledGroups)
+    return 0.0;
+  return m_workGroups.size() / (double)m_numSampledGroups;
+}
+
+UniformValues* KernelInvocation::getUniformValues() const
+{
+  return m_uniformValues;
+}
+
 size_t KernelInvocation::getWorkDim() const
 {
   return m_workDim;
 }
 
+bool KernelInvocation::isSampled(Size3 group) const
+{
+  if (m_sampleInterval == 1)
+    return true;
+
+  size_t index =
+    group.x + (group.y + group.z * m_numGroups.y) * m_numGroups.x;
+  if (m_sampleStrided)
+    return index % m_sampleInterval == m_sampleSeed % m_sampleInterval;
+
+  // Mix the seed and group index (splitmix64 finalizer) for a random sample
+  // that doesn't depend on the order in which groups are executed
+  uint64_t hash = index + m_sampleSeed * 0x9E3779B97F4A7C15ULL;
+  hash = (hash ^ (hash >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  hash = (hash ^ (hash >> 27)) * 0x94D049BB133111EBULL;
+  hash = hash ^ (hash >> 31);
+  return hash % m_sampleInterval == 0;
+}
+
+bool KernelInvocation::isLockstep() const
+{
+  return m_lockstep;
+}
+
+bool KernelInvocation::isSampling() const
+{
+  return m_sampleInterval > 1;
+}
+
+bool KernelInvocation::isWorkerProcess()
+{
+  return workerProcessOutput >= 0;
+}
+
+bool KernelInvocation::loadCheckpoint()
+{
+  // Checkpoints need every plugin to save its state
+  string pluginState;
+  if (!m_context->serializePlugins(pluginState))
+  {
+    Context::Message msg(WARNING, m_context);
+    msg << "Checkpoints disabled for kernel '" << m_kernel->getName()
+        << "', as a plugin in use doesn't support them";
+    msg.send();
+    m_checkpointFile.clear();
+    return false;
+  }
+
+  ifstream input(m_checkpointFile.c_str(), ios::binary);
+  if (!input)
+    return false;
+
+  // Check the checkpoint was taken for this launch
+  uint64_t length;
+  string header, magic, kernelName, completed;
+  uint32_t version, workDim;
+  uint64_t launchIndex, numSampledGroups, sizes[9];
+  size_t offset = 0;
+  bool valid = input.read((char*)&length, sizeof(length)) &&
+               length <= (uint64_t)1 << 32;
+  if (valid)
+  {
+    header.resize(length);
+    valid = input.read(&header[0], length) &&
+            readBinary(header, offset, magic) && magic == CHECKPOINT_MAGIC &&
+            readBinary(header, offset, version) &&
+            version == CHECKPOINT_VERSION &&
+            readBinary(header, offset, launchIndex) &&
+            readBinary(header, offset, kernelName) &&
+            readBinary(header, offset, workDim);
+    for (unsigned i = 0; valid && i < 9; i++)
+      valid = readBinary(header, offset, sizes[i]);
+    valid = valid && readBinary(header, offset, completed) &&
+            readBinary(header, offset, numSampledGroups) &&
+            readBinary(header, offset, pluginState) && offset == length;
+  }
+  if (!valid)
+  {
+    Context::Message msg(WARNING, m_context);
+    msg << "Ignoring invalid checkpoint '" << m_checkpointFile << "'";
+    msg.send();
+    return false;
+  }
+
+  // Leave checkpoints of later launches in place while running up to them
+  if (launchIndex > m_launchIndex)
+  {
+    m_checkpointFile.clear();
+    return false;
+  }
+  if (launchIndex < m_launchIndex)
+    return false;
+
+  bool match = kernelName == m_kernel->getName() && workDim == m_workDim &&
+               completed.size() == m_workGroups.size();
+  for (unsigned i = 0; i < 3; i++)
+  {
+    match = match && sizes[i] == m_globalOffset[i] &&
+            sizes[3 + i] == m_globalSize[i] && sizes[6 + i] == m_localSize[i];
+  }
+  if (!match || !m_context->deserializePlugins(pluginState) ||
+      !m_context->getGlobalMemory()->deserialize(input))
+  {
+    Context::Message msg(WARNING, m_context);
+    msg << "Checkpoint '" << m_checkpointFile
+        << "' doesn't match the launch of kernel '" << m_kernel->getName()
+        << "', running it from the start";
+    msg.send();
+    return false;
+  }
+
+  // Skip the work-groups that had completed
+  size_t numCompleted = 0;
+  for (size_t i = 0; i < m_workGroups.size(); i++)
+  {
+    m_completedGroups[i] = completed[i] != 0;
+    numCompleted += m_completedGroups[i];
+  }
+  m_numSampledGroups = numSampledGroups;
+
+  Context::Message msg(INFO, m_context);
+  msg << "Resuming kernel '" << m_kernel->getName() << "' from checkpoint '"
+      << m_checkpointFile << "' (" << numCompleted << " of "
+      << m_workGroups.size() << " work-groups complete)";
+  msg.send();
+  return true;
+}
+
+void KernelInvocation::mergeWorkerProcesses()
+{
+#if !defined(_WIN32)
+  Memory* memory = m_context->getGlobalMemory();
+  vector<pair<size_t, size_t>> ranges;
+  bool atomicWrites = memory->takeWrites(ranges);
+  memory->trackWrites(false);
+
+  // Keep what this process wrote, for the last work-groups to write
+  // memory to win as if they had all run here
+  vector<pair<size_t, string>> written;
+  for (const pair<size_t, size_t>& range : ranges)
+  {
+    written.push_back(make_pair(
+      range.first,
+      string((const char*)memory->getPointer(range.first), range.second)));
+  }
+
+  // Copy the memory each worker process wrote, in the order of their
+  // work-groups, and add up their plugin results
+  for (const WorkerProcess& process : m_processes)
+  {
+    string results, data, pluginResults;
+    size_t offset = 0;
+    uint32_t processAtomics;
+    uint64_t numSampledGroups, numRanges, address;
+    bool valid = readPipe(process.output, results) &&
+                 readBinary(results, offset, numSampledGroups) &&
+                 readBinary(results, offset, processAtomics) &&
+                 readBinary(results, offset, numRanges);
+    for (uint64_t i = 0; valid && i < numRanges; i++)
+    {
+      valid = readBinary(results, offset, address) &&
+              readBinary(results, offset, data) &&
+              memory->isAddressValid(address, data.size());
+      if (valid)
+        memcpy(memory->getPointer(address), data.data(), data.size());
+    }
+    valid = valid && readBinary(results, offset, pluginResults) &&
+            offset == results.size() &&
+            m_context->mergePluginResults(pluginResults);
+    close(process.output);
+
+    int status;
+    valid = waitpid(process.pid, &status, 0) == process.pid && valid &&
+            WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    if (!valid)
+    {
+      Context::Message msg(ERROR, m_context);
+      msg << "Worker process running work-groups " << process.begin << " to "
+          << process.end - 1 << " of kernel '" << m_kernel->getName()
+          << "' failed, so their results are missing";
+      msg.send();
+      continue;
+    }
+    m_numSampledGroups += numSampledGroups;
+    atomicWrites |= processAtomics != 0;
+  }
+  m_processes.clear();
+  for (const pair<size_t, string>& range : written)
+  {
+    memcpy(memory->getPointer(range.first), range.second.data(),
+           range.second.size());
+  }
+
+  if (atomicWrites)
+  {
+    Context::Message msg(WARNING, m_context);
+    msg << "Kernel '" << m_kernel->getName()
+        << "' used global atomics, whose results aren't combined between "
+           "worker processes";
+    msg.send();
+  }
+#endif
+}
+
+void KernelInvocation::pauseForCheckpoint(bool exiting)
+{
+  // Checkpoints are due once the interval since the last one has passed
+  if (!exiting && !m_checkpointPending)
+  {
+    if (now() - m_lastCheckpoint < m_checkpointInterval)
+      return;
+    m_checkpointPending = true;
+  }
+
+  // Wait for the other workers to finish their work-groups, with the last
+  // one to do so taking the checkpoint
+  unique_lock<mutex> lock(m_checkpointLock);
+  if (exiting)
+    m_numActiveWorkers--;
+  else if (m_checkpointPending)
+    m_numPausedWorkers++;
+  if (!m_checkpointPending)
+    return;
+
+  if (m_numPausedWorkers == m_numActiveWorkers)
+  {
+    // No checkpoint is needed once every worker has finished
+    if (m_numActiveWorkers)
+      writeCheckpoint();
+    m_numPausedWorkers = 0;
+    m_lastCheckpoint = now();
+    m_checkpointPending = false;
+    m_numCheckpoints++;
+    m_checkpointTaken.notify_all();
+  }
+  else if (!exiting)
+  {
+    uint64_t numCheckpoints = m_numCheckpoints;
+    m_checkpointTaken.wait(
+      lock, [&] { return m_numCheckpoints != numCheckpoints; });
+  }
+}
+
 void KernelInvocation::run(const Context* context, Kernel* kernel,
                            unsigned int workDim, Size3 globalOffset,
                            Size3 globalSize, Size3 localSize)
@@ -149,28 +511,137 @@ void KernelInvocation::run(const Context* context, Kernel* kernel,
   // Run kernel
   context->notifyKernelBegin(ki);
   ki->run();
+  if (ki->isSampling())
+  {
+    Context::Message msg(INFO, context);
+    msg << "Analysed " << ki->getNumSampledGroups() << " of "
+        << ki->m_workGroups.size() << " work-groups for kernel '"
+        << kernel->getName() << "' (extrapolation factor "
+        << ki->getSamplingFactor() << ")";
+    msg.send();
+  }
   context->notifyKernelEnd(ki);
 
   delete ki;
 }
 
+bool KernelInvocation::getNextWorkGroup(int id, size_t& index)
+{
+  // Take next work-group from this worker's own queue
+  WorkerQueue* queue = m_workerQueues[id];
+  {
+    lock_guard<mutex> lock(queue->lock);
+    if (!queue->chunks.empty())
+    {
+      pair<size_t, size_t>& chunk = queue->chunks.front();
+      index = chunk.first++;
+      if (chunk.first == chunk.second)
+        queue->chunks.pop_front();
+      return true;
+    }
+  }
+
+  // Steal a chunk from the back of another worker's queue
+  for (unsigned i = 1; i < m_numWorkers; i++)
+  {
+    WorkerQueue* victim = m_workerQueues[(id + i) % m_numWorkers];
+    pair<size_t, size_t> chunk;
+    {
+      lock_guard<mutex> lock(victim->lock);
+      if (victim->chunks.empty())
+        continue;
+      chunk = victim->chunks.back();
+      victim->chunks.pop_back();
+    }
+
+    index = chunk.first++;
+    if (chunk.first != chunk.second)
+    {
+      lock_guard<mutex> lock(queue->lock);
+      queue->chunks.push_back(chunk);
+    }
+    return true;
+  }
+
+  // No more work to do
+  return false;
+}
+
 void KernelInvocation::run()
 {
-  nextGroupIndex = 0;
+  // Compile kernel to native code if some work-groups can run without
+  // instruction callbacks
+  if (!checkEnv("OCLGRIND_DISABLE_JIT") &&
+      (isSampling() || !m_context->needsInstructionCallbacks()))
+  {
+    m_jit = m_kernel->getProgram()->getJITKernel(m_kernel->getFunction());
+  }
 
-  // Create worker threads
-  // TODO: Run in main thread if only 1 worker
-  vector<thread> threads;
+  // Resume from a checkpoint of this launch, skipping completed work-groups
+  bool resumed = false;
+  if (!m_checkpointFile.empty())
+  {
+    m_completedGroups.assign(m_workGroups.size(), 0);
+    resumed = loadCheckpoint();
+    m_lastCheckpoint = now();
+    m_numActiveWorkers = m_numWorkers;
+  }
+  auto completed = [this](size_t index) {
+    return !m_completedGroups.empty() && m_completedGroups[index];
+  };
+
+  // Leave some of the work-groups to worker processes
+  m_groupsBegin = 0;
+  m_groupsEnd = m_workGroups.size();
+  unique_lock<mutex> processLaunch(workerProcessLaunch, defer_lock);
+  if (m_numProcesses > 1)
+  {
+    processLaunch.lock();
+    startWorkerProcesses();
+  }
+
+  // Divide work-groups into chunks, giving each worker a contiguous block
+  vector<pair<size_t, size_t>> chunks;
+  for (size_t begin = m_groupsBegin; begin < m_groupsEnd;)
+  {
+    if (completed(begin))
+    {
+      begin++;
+      continue;
+    }
+    size_t end = begin + 1;
+    while (end < m_groupsEnd && end - begin < m_chunkSize && !completed(end))
+      end++;
+    chunks.push_back(make_pair(begin, end));
+    begin = end;
+  }
   for (unsigned i = 0; i < m_numWorkers; i++)
   {
-    threads.push_back(thread(&KernelInvocation::runWorker, this, i));
+    m_workerQueues.push_back(new WorkerQueue);
+  }
+  for (size_t c = 0; c < chunks.size(); c++)
+  {
+    unsigned worker = (c * m_numWorkers) / chunks.size();
+    m_workerQueues[worker]->chunks.push_back(chunks[c]);
   }
 
-  // Wait for workers to complete
+  // Execute work-groups on the context's worker threads
+  m_context->runWorkers(m_numWorkers, [this](unsigned id) { runWorker(id); });
+
+  if (isWorkerProcess())
+    finishWorkerProcess();
+  if (!m_processes.empty())
+    mergeWorkerProcesses();
+
+  // Checkpoints are no longer needed once the kernel has finished
+  if (!m_checkpointFile.empty() && (resumed || m_numCheckpoints))
+    remove(m_checkpointFile.c_str());
+
   for (unsigned i = 0; i < m_numWorkers; i++)
   {
-    threads[i].join();
+    delete m_workerQueues[i];
   }
+  m_workerQueues.clear();
 }
 
 int KernelInvocation::getWorkerID() const
@@ -178,29 +649,100 @@ int KernelInvocation::getWorkerID() const
   return workerState.id;
 }
 
+void KernelInvocation::runLockstep()
+{
+  // Execute each instruction at once for every work-item in the current
+  // work-group that has reached it, until they are all at a barrier or
+  // complete. The earliest instruction in the kernel goes first, so that
+  // work-items on divergent paths wait for each other where they rejoin.
+  const vector<WorkItem*>& lanes = workerState.workGroup->getWorkItems();
+  vector<uint8_t> mask(lanes.size());
+
+  // Plugins that observe each instruction need every work-item stepped on
+  // its own, but can still be given the batched records of lane-wise steps
+  bool lanewise = !m_context->needsInstructionExecutedCallbacks();
+  while (true)
+  {
+    const InterpreterCache::DecodedInstruction* next = NULL;
+    for (const WorkItem* lane : lanes)
+    {
+      if (lane->getState() == WorkItem::READY &&
+          (!next || lane->getCurrentDecodedInstruction() < next))
+        next = lane->getCurrentDecodedInstruction();
+    }
+    if (!next)
+      break;
+
+    size_t numActive = 0;
+    for (size_t l = 0; l < lanes.size(); l++)
+    {
+      mask[l] = lanes[l]->getState() == WorkItem::READY &&
+                lanes[l]->getCurrentDecodedInstruction() == next;
+      numActive += mask[l];
+    }
+    if (lanewise && WorkItem::stepLanes(lanes.data(), lanes.size(),
+                                        mask.data(), numActive))
+      continue;
+
+    // Fall back to stepping each active work-item on its own
+    for (size_t l = 0; l < lanes.size(); l++)
+    {
+      if (!mask[l])
+        continue;
+
+      workerState.workItem = lanes[l];
+      lanes[l]->step();
+
+      // Respect the interactive debugger switching to another work-item
+      if (workerState.workItem != lanes[l])
+        return;
+    }
+  }
+
+  workerState.workItem = NULL;
+}
+
 void KernelInvocation::runWorker(int id)
 {
   workerState.workGroup = NULL;
   workerState.workItem = NULL;
   workerState.id = id;
+  workerState.native = false;
+  Profiler::Scope profile(m_context->getProfiler(), "kernel",
+                          m_kernel->getName());
+
+  // Finished work-group kept for reuse by next group of the same size
+  WorkGroup* spare = NULL;
+  size_t groupIndex = -1;
+
   try
   {
     while (true)
     {
       // Move to next work-group
-      if (!m_runningGroups.empty())
+      WorkGroup* running = NULL;
+      {
+        lock_guard<mutex> lock(m_runningGroupsLock);
+        if (!m_runningGroups.empty())
+        {
+          running = m_runningGroups.front();
+          m_runningGroups.pop_front();
+        }
+      }
+      if (running)
       {
         // Take next work-group from running pool
-        workerState.workGroup = m_runningGroups.front();
-        m_runningGroups.pop_front();
+        setCurrentWorkGroup(running);
+        groupIndex = -1;
       }
       else
       {
         // Take next work-group from pending pool
-        unsigned index = nextGroupIndex++;
-        if (index >= m_workGroups.size())
+        size_t index;
+        if (!getNextWorkGroup(id, index))
           // No more work to do
           break;
+        groupIndex = index;
 
         Size3 wgid = m_workGroups[index];
         Size3 wgsize = m_localSize;
@@ -212,39 +754,71 @@ void KernelInvocation::runWorker(int id)
             wgsize[i] = m_globalSize[i] % wgsize[i];
         }
 
-        workerState.workGroup = new WorkGroup(this, wgid, wgsize);
+        if (spare && spare->getGroupSize() == wgsize)
+        {
+          spare->reset(wgid);
+          setCurrentWorkGroup(spare);
+          spare = NULL;
+        }
+        else
+        {
+          delete spare;
+          spare = NULL;
+          setCurrentWorkGroup(new WorkGroup(this, wgid, wgsize));
+        }
+        if (isSampled(wgid))
+          m_numSampledGroups++;
         m_context->notifyWorkGroupBegin(workerState.workGroup);
       }
 
       // Execute work-group
-      workerState.workItem = workerState.workGroup->getNextWorkItem();
-      while (workerState.workItem)
+      if (m_lockstep && !workerState.native)
+        runLockstep();
+      else
+        workerState.workItem = workerState.workGroup->getNextWorkItem();
+      while (true)
       {
-        // Run work-item until complete or at barrier
-        while (workerState.workItem->getState() == WorkItem::READY)
+        while (workerState.workItem)
         {
-          workerState.workItem->step();
-        }
+          // Run work-item until complete or at barrier
+          while (workerState.workItem->getState() == WorkItem::READY)
+          {
+            if (workerState.native)
+              m_jit->run(workerState.workItem);
+            else
+              workerState.workItem->step();
+          }
 
-        // Move to next work-item
-        workerState.workItem = workerState.workGroup->getNextWorkItem();
-        if (workerState.workItem)
-          continue;
+          // Move to next work-item
+          workerState.workItem = workerState.workGroup->getNextWorkItem();
+        }
 
         // No more work-items in READY state
-        // Check if there are work-items at a barrier
-        if (workerState.workGroup->hasBarrier())
-        {
-          // Resume execution
-          workerState.workGroup->clearBarrier();
+        // Check if there are work-items at a barrier (which lockstep
+        // execution can leave every work-item waiting at)
+        if (!workerState.workGroup->hasBarrier())
+          break;
+
+        // Resume execution
+        workerState.workGroup->clearBarrier();
+        if (m_lockstep && !workerState.native)
+          runLockstep();
+        else
           workerState.workItem = workerState.workGroup->getNextWorkItem();
-        }
       }
 
       // Work-group has finished
       m_context->notifyWorkGroupComplete(workerState.workGroup);
-      delete workerState.workGroup;
+      delete spare;
+      spare = workerState.workGroup;
       workerState.workGroup = NULL;
+
+      if (!m_checkpointFile.empty())
+      {
+        if (groupIndex != (size_t)-1)
+          m_completedGroups[groupIndex] = 1;
+        pauseForCheckpoint(false);
+      }
     }
   }
   catch (FatalError& err)
@@ -258,12 +832,105 @@ void KernelInvocation::runWorker(int id)
     if (workerState.workGroup)
       delete workerState.workGroup;
   }
+
+  delete spare;
+  m_context->selectSubscribers(NULL, true);
+  JITKernel::releaseWorker();
+
+  if (!m_checkpointFile.empty())
+    pauseForCheckpoint(true);
 }
 
-bool KernelInvocation::switchWorkItem(const Size3 gid)
+void KernelInvocation::setCurrentWorkGroup(WorkGroup* workGroup)
 {
-  assert(m_numWorkers == 1);
+  workerState.workGroup = workGroup;
+  if (workGroup)
+  {
+    m_context->selectSubscribers(workGroup,
+                                 isSampled(workGroup->getGroupID()));
+    workerState.native = m_jit && !m_context->needsInstructionCallbacks();
+    workGroup->setUniformSharing(!m_context->needsUniformExecution());
+  }
+}
+
+void KernelInvocation::startWorkerProcesses()
+{
+  // Plugin results for work-groups run elsewhere must be added to the
+  // plugins in this process
+  const char* reason = NULL;
+  string pluginResults;
+#if defined(_WIN32)
+  reason = "they aren't supported on Windows";
+#else
+  if (!m_checkpointFile.empty())
+    reason = "checkpoints are enabled";
+  else if (!m_context->savePluginResults(pluginResults))
+    reason = "a plugin in use doesn't support them";
+#endif
+  if (reason)
+  {
+    Context::Message msg(WARNING, m_context);
+    msg << "Worker processes disabled for kernel '" << m_kernel->getName()
+        << "', as " << reason;
+    msg.send();
+    return;
+  }
+
+#if !defined(_WIN32)
+  // Each process runs its work-groups on a single thread, tracking the
+  // global memory they write
+  m_numWorkers = 1;
+  m_context->getGlobalMemory()->trackWrites(true);
 
+  // Output buffered before forking would be written by every process
+  cout.flush();
+  cerr.flush();
+  fflush(NULL);
+
+  // Worker processes take the first ranges of work-groups, leaving the
+  // last range (and any that couldn't be given out) to this process
+  size_t numGroups = m_workGroups.size();
+  size_t numProcesses = min<size_t>(m_numProcesses, numGroups);
+  for (size_t p = 0; p + 1 < numProcesses; p++)
+  {
+    WorkerProcess process;
+    process.begin = p * numGroups / numProcesses;
+    process.end = (p + 1) * numGroups / numProcesses;
+
+    int fds[2];
+    if (pipe(fds))
+      break;
+    process.pid = fork();
+    if (process.pid < 0)
+    {
+      close(fds[0]);
+      close(fds[1]);
+      break;
+    }
+    if (process.pid == 0)
+    {
+      // Run this range of work-groups and return the results
+      close(fds[0]);
+      for (const WorkerProcess& other : m_processes)
+        close(other.output);
+      m_processes.clear();
+      workerProcessOutput = fds[1];
+      m_groupsBegin = process.begin;
+      m_groupsEnd = process.end;
+      return;
+    }
+
+    close(fds[1]);
+    process.output = fds[0];
+    m_processes.push_back(process);
+  }
+  if (!m_processes.empty())
+    m_groupsBegin = m_processes.back().end;
+#endif
+}
+
+bool KernelInvocation::switchWorkItem(const Size3 gid)
+{
   // Compute work-group ID
   Size3 group(gid.x / m_localSize.x, gid.y / m_localSize.y,
               gid.z / m_localSize.z);
@@ -280,12 +947,13 @@ bool KernelInvocation::switchWorkItem(const Size3 gid)
   // Check if work-group is in running pool
   if (!found)
   {
+    lock_guard<mutex> lock(m_runningGroupsLock);
     std::list<WorkGroup*>::iterator rItr;
     for (rItr = m_runningGroups.begin(); rItr != m_runningGroups.end(); rItr++)
     {
       if (group == (*rItr)->getGroupID())
       {
-        workerState.workGroup = *rItr;
+        setCurrentWorkGroup(*rItr);
         m_runningGroups.erase(rItr);
         found = true;
         break;
@@ -293,29 +961,40 @@ bool KernelInvocation::switchWorkItem(const Size3 gid)
     }
   }
 
-  // Check if work-group is in pending pool
-  if (!found)
+  // Check if work-group is waiting in a worker's queue, and take it from the
+  // front of its chunk (work-groups that another worker has started can't be
+  // switched to)
+  bool pending = false;
+  for (unsigned w = 0; !found && !pending && w < m_numWorkers; w++)
   {
-    std::vector<Size3>::iterator pItr;
-    for (pItr = m_workGroups.begin() + nextGroupIndex;
-         pItr != m_workGroups.end(); pItr++)
+    WorkerQueue* queue = m_workerQueues[w];
+    lock_guard<mutex> lock(queue->lock);
+    auto chunk = queue->chunks.begin();
+    for (; !pending && chunk != queue->chunks.end(); chunk++)
     {
-      if (group == *pItr)
+      for (size_t i = chunk->first; i < chunk->second; i++)
       {
-        workerState.workGroup = new WorkGroup(this, group);
-        m_context->notifyWorkGroupBegin(workerState.workGroup);
-        found = true;
-
-        // Re-order list of groups accordingly
-        // Safe since this is not in a multi-threaded context
-        m_workGroups.erase(pItr);
-        m_workGroups.insert(m_workGroups.begin() + nextGroupIndex, group);
-        nextGroupIndex++;
-
-        break;
+        if (group == m_workGroups[i])
+        {
+          // Re-order list of groups accordingly
+          std::rotate(m_workGroups.begin() + chunk->first,
+                      m_workGroups.begin() + i, m_workGroups.begin() + i + 1);
+          if (++chunk->first == chunk->second)
+            queue->chunks.erase(chunk);
+          pending = true;
+          break;
+        }
       }
     }
   }
+  if (pending)
+  {
+    setCurrentWorkGroup(new WorkGroup(this, group));
+    if (isSampled(group))
+      m_numSampledGroups++;
+    m_context->notifyWorkGroupBegin(workerState.workGroup);
+    found = true;
+  }
 
   if (!found)
   {
@@ -324,6 +1003,7 @@ bool KernelInvocation::switchWorkItem(const Size3 gid)
 
   if (previousWorkGroup != workerState.workGroup)
   {
+    lock_guard<mutex> lock(m_runningGroupsLock);
     m_runningGroups.push_back(previousWorkGroup);
   }
 
@@ -334,3 +1014,71 @@ bool KernelInvocation::switchWorkItem(const Size3 gid)
 
   return true;
 }
+
+void KernelInvocation::writeCheckpoint()
+{
+  string header;
+  writeBinary(header, string(CHECKPOINT_MAGIC));
+  writeBinary(header, (uint32_t)CHECKPOINT_VERSION);
+  writeBinary(header, m_launchIndex);
+  writeBinary(header, m_kernel->getName());
+  writeBinary(header, (uint32_t)m_workDim);
+  for (Size3 sizes : {m_globalOffset, m_globalSize, m_localSize})
+  {
+    for (unsigned i = 0; i < 3; i++)
+      writeBinary(header, (uint64_t)sizes[i]);
+  }
+  writeBinary(header,
+              string(m_completedGroups.begin(), m_completedGroups.end()));
+  writeBinary(header, (uint64_t)m_numSampledGroups);
+  string pluginState;
+  m_context->serializePlugins(pluginState);
+  writeBinary(header, pluginState);
+
+  // Replace the previous checkpoint only once the new one is complete
+  string tmpFile = m_checkpointFile + ".tmp";
+  ofstream output(tmpFile.c_str(), ios::binary | ios::trunc);
+  uint64_t length = header.size();
+  output.write((const char*)&length, sizeof(length));
+  output.write(header.data(), header.size());
+  m_context->getGlobalMemory()->serialize(output);
+  output.close();
+  if (!output || rename(tmpFile.c_str(), m_checkpointFile.c_str()))
+  {
+    Context::Message msg(WARNING, m_context);
+    msg << "Failed to write checkpoint '" << m_checkpointFile << "'";
+    msg.send();
+    remove(tmpFile.c_str());
+  }
+}
+
+#if !defined(_WIN32)
+static bool readPipe(int fd, string& data)
+{
+  char buffer[65536];
+  while (true)
+  {
+    ssize_t n = read(fd, buffer, sizeof(buffer));
+    if (n == 0)
+      return true;
+    if (n < 0 && errno != EINTR)
+      return false;
+    if (n > 0)
+      data.append(buffer, n);
+  }
+}
+
+static bool writePipe(int fd, const string& data)
+{
+  size_t offset = 0;
+  while (offset < data.size())
+  {
+    ssize_t n = write(fd, data.data() + offset, data.size() - offset);
+    if (n < 0 && errno != EINTR)
+      return false;
+    if (n > 0)
+      offset += n;
+  }
+  return true;
+}
+#endif
@@ -8,10 +8,15 @@
 
 #include "common.h"
 
+#include <condition_variable>
+#include <mutex>
+
 namespace oclgrind
 {
 class Context;
+class JITKernel;
 class Kernel;
+class UniformValues;
 class WorkGroup;
 class WorkItem;
 
@@ -29,7 +34,14 @@ public:
   Size3 getLocalSize() const;
   const Kernel* getKernel() const;
   Size3 getNumGroups() const;
+  size_t getNumSampledGroups() const;
+  double getSamplingFactor() const;
+  UniformValues* getUniformValues() const;
   size_t getWorkDim() const;
+  bool isLockstep() const;
+  bool isSampling() const;
+  // Whether this process was forked to run some of a kernel's work-groups
+  static bool isWorkerProcess();
   bool switchWorkItem(const Size3 gid);
 
   int getWorkerID() const;
@@ -53,9 +65,68 @@ private:
   // Current execution state
   std::vector<Size3> m_workGroups;
   std::list<WorkGroup*> m_runningGroups;
+  std::mutex m_runningGroupsLock;
+
+  // Per-worker queues of pending work-group chunks
+  struct WorkerQueue;
+  std::vector<WorkerQueue*> m_workerQueues;
+  size_t m_chunkSize;
+  bool getNextWorkGroup(int id, size_t& index);
+
+  // Work-group sampling (one in m_sampleInterval groups is analysed)
+  unsigned m_sampleInterval;
+  unsigned m_sampleSeed;
+  bool m_sampleStrided;
+  std::atomic<size_t> m_numSampledGroups;
+  bool isSampled(Size3 group) const;
+  void setCurrentWorkGroup(WorkGroup* workGroup);
 
   // Worker threads
+  void runLockstep();
   void runWorker(int id);
   unsigned m_numWorkers;
+  bool m_lockstep;
+
+  // Native code for the kernel, used for work-groups that no plugin needs
+  // instruction callbacks for
+  const JITKernel* m_jit;
+
+  // Results of instructions that are uniform across the whole kernel,
+  // shared by the work-items of every work-group (NULL if there are none)
+  UniformValues* m_uniformValues;
+
+  // Checkpoints of the completed work-groups, global memory and plugin
+  // state, taken while every worker is between work-groups
+  uint64_t m_launchIndex;
+  std::string m_checkpointFile; // Empty if checkpoints are disabled
+  double m_checkpointInterval;
+  std::atomic<double> m_lastCheckpoint;
+  std::atomic<bool> m_checkpointPending;
+  std::vector<unsigned char> m_completedGroups; // Indexed like m_workGroups
+  unsigned m_numActiveWorkers;
+  unsigned m_numPausedWorkers;
+  uint64_t m_numCheckpoints;
+  std::mutex m_checkpointLock;
+  std::condition_variable m_checkpointTaken;
+  bool loadCheckpoint();
+  void pauseForCheckpoint(bool exiting);
+  void writeCheckpoint();
+
+  // Worker processes forked to run contiguous ranges of m_workGroups, which
+  // return the global memory they wrote and their plugin results when done
+  struct WorkerProcess
+  {
+    int pid;
+    int output; // Read end of the pipe the process writes its results to
+    size_t begin;
+    size_t end;
+  };
+  unsigned m_numProcesses;
+  std::vector<WorkerProcess> m_processes;
+  size_t m_groupsBegin; // Range of m_workGroups run by this process
+  size_t m_groupsEnd;
+  void finishWorkerProcess();
+  void mergeWorkerProcesses();
+  void startWorkerProcesses();
 };
 } // namespace oclgrind
@@ -8,10 +8,23 @@
 
 #include "common.h"
 
+#include <algorithm>
 #include <cassert>
+#include <cerrno>
 #include <cmath>
 #include <cstring>
+#include <fstream>
 #include <mutex>
+#include <thread>
+
+#if !defined(_WIN32)
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
 
 #include "Context.h"
 #include "Memory.h"
@@ -24,8 +37,110 @@ using namespace std;
 // Multiple mutexes to mitigate risk of unnecessary synchronisation in atomics
 #define NUM_ATOMIC_MUTEXES 64 // Must be power of two
 mutex atomicMutex[NUM_ATOMIC_MUTEXES];
-#define ATOMIC_MUTEX(offset)                                                   \
-  atomicMutex[(((offset) >> 2) & (NUM_ATOMIC_MUTEXES - 1))]
+#define ATOMIC_MUTEX(buffer, offset)                                           \
+  atomicMutex[((((offset) >> 2) ^ ((buffer)*31)) & (NUM_ATOMIC_MUTEXES - 1))]
+
+// Aligned atomics on global memory use native atomic operations on the
+// backing buffer where the compiler provides them
+#if defined(__GNUC__) || defined(__clang__)
+#define HAVE_NATIVE_ATOMICS 1
+#endif
+
+namespace
+{
+#if !defined(_WIN32)
+// Size of the default huge pages that explicit huge page mappings are made
+// of, from /proc/meminfo where available
+size_t getHugePageSize()
+{
+  static const size_t size = []() {
+    size_t kb = 2048;
+    ifstream meminfo("/proc/meminfo");
+    string line;
+    while (getline(meminfo, line))
+    {
+      if (sscanf(line.c_str(), "Hugepagesize: %zu kB", &kb) == 1)
+        break;
+    }
+    return kb << 10;
+  }();
+  return size;
+}
+
+size_t roundToHugePages(size_t size)
+{
+  size_t pageSize = getHugePageSize();
+  return (size + pageSize - 1) / pageSize * pageSize;
+}
+
+// Create an unlinked temporary file of the given size, returning its
+// descriptor or -1 on failure
+int createTempFile(const char* dir, size_t size)
+{
+  string path = string(dir) + "/oclgrind-XXXXXX";
+  int fd = mkstemp(&path[0]);
+  if (fd < 0)
+    return -1;
+
+  unlink(path.c_str());
+  if (ftruncate(fd, size) != 0)
+  {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+#endif
+
+#if HAVE_NATIVE_ATOMICS
+template <typename T> bool isNativeAtomic(const T* ptr)
+{
+  return __atomic_always_lock_free(sizeof(T), 0) &&
+         ((size_t)ptr & (sizeof(T) - 1)) == 0;
+}
+
+template <typename T> T nativeAtomic(AtomicOp op, T* ptr, T value)
+{
+  switch (op)
+  {
+  case AtomicAdd:
+    return __atomic_fetch_add(ptr, value, __ATOMIC_SEQ_CST);
+  case AtomicAnd:
+    return __atomic_fetch_and(ptr, value, __ATOMIC_SEQ_CST);
+  case AtomicDec:
+    return __atomic_fetch_sub(ptr, 1, __ATOMIC_SEQ_CST);
+  case AtomicInc:
+    return __atomic_fetch_add(ptr, 1, __ATOMIC_SEQ_CST);
+  case AtomicMax:
+  case AtomicMin:
+  {
+    T old = __atomic_load_n(ptr, __ATOMIC_SEQ_CST);
+    while ((op == AtomicMax ? value > old : value < old) &&
+           !__atomic_compare_exchange_n(ptr, &old, value, false,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+      ;
+    return old;
+  }
+  case AtomicOr:
+    return __atomic_fetch_or(ptr, value, __ATOMIC_SEQ_CST);
+  case AtomicSub:
+    return __atomic_fetch_sub(ptr, value, __ATOMIC_SEQ_CST);
+  case AtomicXchg:
+    return __atomic_exchange_n(ptr, value, __ATOMIC_SEQ_CST);
+  case AtomicXor:
+    return __atomic_fetch_xor(ptr, value, __ATOMIC_SEQ_CST);
+  default:
+    FATAL_ERROR("Unsupported native atomic operation");
+  }
+}
+#endif
+} // namespace
+
+// Buffers at least this large are backed by demand-zero memory mappings
+#define DEFAULT_MMAP_THRESHOLD_MB 64
+
+// Minimum size of each block in the private memory arena
+#define ARENA_BLOCK_SIZE 65536
 
 Memory::Memory(unsigned addrSpace, unsigned bufferBits, const Context* context)
 {
@@ -36,6 +151,14 @@ Memory::Memory(unsigned addrSpace, unsigned bufferBits, const Context* context)
   m_numBitsAddress = ((sizeof(size_t) << 3) - m_numBitsBuffer);
   m_maxNumBuffers = ((size_t)1 << m_numBitsBuffer) - 1; // 0 reserved for NULL
   m_maxBufferSize = ((size_t)1 << m_numBitsAddress);
+  m_generation = 0;
+  m_trackWrites = false;
+  m_atomicWrites = false;
+  m_arenaBlock = 0;
+  m_peakAllocated = 0;
+  m_placement = 0;
+  m_usage = context->getMemoryUsage(string(getAddressSpaceName(addrSpace)) +
+                                    " memory");
 
   clear();
 }
@@ -43,6 +166,29 @@ Memory::Memory(unsigned addrSpace, unsigned bufferBits, const Context* context)
 Memory::~Memory()
 {
   clear();
+
+  for (Buffer* buffer : m_spareBuffers)
+    delete buffer;
+  for (ArenaBlock& block : m_arena)
+    delete[] block.data;
+}
+
+Memory::Snapshot::~Snapshot()
+{
+  for (Entry& entry : m_buffers)
+  {
+    if (!entry.data)
+      continue;
+#if !defined(_WIN32)
+    if (entry.fd >= 0)
+    {
+      munmap(entry.data, entry.size);
+      close(entry.fd);
+      continue;
+    }
+#endif
+    delete[] entry.data;
+  }
 }
 
 size_t Memory::allocateBuffer(size_t size, cl_mem_flags flags,
@@ -62,10 +208,10 @@ size_t Memory::allocateBuffer(size_t size, cl_mem_flags flags,
   }
 
   // Create buffer
-  Buffer* buffer = new Buffer;
+  Buffer* buffer = newBuffer();
   buffer->size = size;
   buffer->flags = flags;
-  buffer->data = new unsigned char[size];
+  allocateStorage(buffer);
 
   if (b >= m_memory.size())
   {
@@ -77,11 +223,12 @@ size_t Memory::allocateBuffer(size_t size, cl_mem_flags flags,
   }
 
   m_totalAllocated += size;
+  trackUsage(buffer, true);
 
-  // Initialize contents of buffer
+  // Initialize contents of buffer (mapped buffers are already zero)
   if (initData)
     memcpy(buffer->data, initData, size);
-  else
+  else if (buffer->storage == StorageHeap)
     memset(buffer->data, 0, size);
 
   size_t address = ((size_t)b) << m_numBitsAddress;
@@ -91,6 +238,129 @@ size_t Memory::allocateBuffer(size_t size, cl_mem_flags flags,
   return address;
 }
 
+void Memory::allocateStorage(Buffer* buffer)
+{
+  if (m_addressSpace == AddrSpacePrivate)
+  {
+    // Bump-allocate from the current arena block, moving on to the next
+    // (and creating it if necessary) when it is full
+    size_t size = (buffer->size + 15) & ~(size_t)15;
+    while (m_arenaBlock < m_arena.size() &&
+           m_arena[m_arenaBlock].used + size > m_arena[m_arenaBlock].size)
+    {
+      if (m_arena[m_arenaBlock].used == 0)
+        break;
+      m_arenaBlock++;
+    }
+    if (m_arenaBlock < m_arena.size() &&
+        m_arena[m_arenaBlock].size < size)
+    {
+      // Empty block too small for this allocation, so replace it
+      delete[] m_arena[m_arenaBlock].data;
+      m_arena.erase(m_arena.begin() + m_arenaBlock);
+    }
+    if (m_arenaBlock == m_arena.size() ||
+        m_arena[m_arenaBlock].used + size > m_arena[m_arenaBlock].size)
+    {
+      ArenaBlock block;
+      block.size = max(size, (size_t)ARENA_BLOCK_SIZE);
+      block.data = new unsigned char[block.size];
+      block.used = 0;
+      m_arena.insert(m_arena.begin() + m_arenaBlock, block);
+    }
+
+    ArenaBlock& block = m_arena[m_arenaBlock];
+    buffer->storage = StorageArena;
+    buffer->data = block.data + block.used;
+    block.used += size;
+    return;
+  }
+
+  buffer->storage = StorageHeap;
+
+#if !defined(_WIN32)
+  static size_t threshold =
+    (size_t)getEnvInt("OCLGRIND_MMAP_THRESHOLD", DEFAULT_MMAP_THRESHOLD_MB) <<
+    20;
+  static const char* spillDir = getenv("OCLGRIND_SPILL_DIR");
+
+  if (threshold && buffer->size >= threshold)
+  {
+    int prot = PROT_READ | PROT_WRITE;
+    void* data = MAP_FAILED;
+
+    if (spillDir)
+    {
+      // Back buffer with a file that is removed as soon as it is mapped
+      int fd = createTempFile(spillDir, buffer->size);
+      if (fd >= 0)
+      {
+        data = mmap(NULL, buffer->size, prot, MAP_SHARED, fd, 0);
+        close(fd);
+      }
+      if (data != MAP_FAILED)
+      {
+        buffer->storage = StorageSpillFile;
+        buffer->data = (unsigned char*)data;
+        return;
+      }
+    }
+
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+#if defined(MAP_HUGETLB)
+    if (m_placement & PlaceExplicitHugePages)
+    {
+      // Reserve the huge pages up front (no MAP_NORESERVE), so that the
+      // mapping fails rather than faulting later if the pool is too small
+      data = mmap(NULL, roundToHugePages(buffer->size), prot,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+      if (data != MAP_FAILED)
+        buffer->storage = StorageHugePages;
+    }
+#endif
+    if (data == MAP_FAILED)
+    {
+      data = mmap(NULL, buffer->size, prot, flags, -1, 0);
+      if (data != MAP_FAILED)
+        buffer->storage = StorageMapped;
+    }
+
+    if (data != MAP_FAILED)
+    {
+      buffer->data = (unsigned char*)data;
+
+      // Apply placement policy before any page is touched
+#if defined(MADV_HUGEPAGE)
+      if ((m_placement & PlaceHugePages) && buffer->storage == StorageMapped)
+        madvise(data, buffer->size, MADV_HUGEPAGE);
+#endif
+#if defined(__linux__) && defined(SYS_mbind)
+      if (m_placement & PlaceInterleave)
+      {
+        // MPOL_INTERLEAVE over every node this process may use, leaving
+        // the default first-touch placement if that isn't possible
+        unsigned long nodes = ~0UL;
+        if (syscall(SYS_mbind, data, buffer->size, 3, &nodes,
+                    sizeof(nodes) * 8, 0))
+        {
+          static std::atomic<bool> warned(false);
+          if (!warned.exchange(true))
+          {
+            cerr << "Oclgrind: Unable to interleave buffers across NUMA "
+                    "nodes: "
+                 << strerror(errno) << endl;
+          }
+        }
+      }
+#endif
+      return;
+    }
+  }
+#endif
+
+  buffer->data = new unsigned char[buffer->size];
+}
+
 template uint64_t Memory::atomic(AtomicOp op, size_t address, uint64_t value);
 template int64_t Memory::atomic(AtomicOp op, size_t address, int64_t value);
 template uint32_t Memory::atomic(AtomicOp op, size_t address, uint32_t value);
@@ -107,13 +377,23 @@ template <typename T> T Memory::atomic(AtomicOp op, size_t address, T value)
     return 0;
   }
 
+  if (m_trackWrites)
+    trackWrite(address, sizeof(T), true);
+
   // Get buffer
+  size_t index = extractBuffer(address);
   size_t offset = extractOffset(address);
-  Buffer* buffer = m_memory[extractBuffer(address)];
+  Buffer* buffer = m_memory[index];
   T* ptr = (T*)(buffer->data + offset);
 
   if (m_addressSpace == AddrSpaceGlobal)
-    ATOMIC_MUTEX(offset).lock();
+  {
+#if HAVE_NATIVE_ATOMICS
+    if (op != AtomicCmpXchg && isNativeAtomic(ptr))
+      return nativeAtomic(op, ptr, value);
+#endif
+    ATOMIC_MUTEX(index, offset).lock();
+  }
 
   T old = *ptr;
   switch (op)
@@ -154,7 +434,7 @@ template <typename T> T Memory::atomic(AtomicOp op, size_t address, T value)
   }
 
   if (m_addressSpace == AddrSpaceGlobal)
-    ATOMIC_MUTEX(offset).unlock();
+    ATOMIC_MUTEX(index, offset).unlock();
 
   return old;
 }
@@ -174,13 +454,31 @@ template <typename T> T Memory::atomicCmpxchg(size_t address, T cmp, T value)
     return 0;
   }
 
+  if (m_trackWrites)
+    trackWrite(address, sizeof(T), true);
+
   // Get buffer
+  size_t index = extractBuffer(address);
   size_t offset = extractOffset(address);
-  Buffer* buffer = m_memory[extractBuffer(address)];
+  Buffer* buffer = m_memory[index];
   T* ptr = (T*)(buffer->data + offset);
 
+#if HAVE_NATIVE_ATOMICS
+  if (m_addressSpace == AddrSpaceGlobal && isNativeAtomic(ptr))
+  {
+    T old = cmp;
+    if (__atomic_compare_exchange_n(ptr, &old, value, false, __ATOMIC_SEQ_CST,
+                                    __ATOMIC_SEQ_CST))
+    {
+      m_context->notifyMemoryAtomicStore(this, AtomicCmpXchg, address,
+                                         sizeof(T));
+    }
+    return old;
+  }
+#endif
+
   if (m_addressSpace == AddrSpaceGlobal)
-    ATOMIC_MUTEX(offset).lock();
+    ATOMIC_MUTEX(index, offset).lock();
 
   // Perform cmpxchg
   T old = *ptr;
@@ -192,7 +490,7 @@ template <typename T> T Memory::atomicCmpxchg(size_t address, T cmp, T value)
   }
 
   if (m_addressSpace == AddrSpaceGlobal)
-    ATOMIC_MUTEX(offset).unlock();
+    ATOMIC_MUTEX(index, offset).unlock();
 
   return old;
 }
@@ -204,11 +502,9 @@ void Memory::clear()
   {
     if (*itr)
     {
-      if (!((*itr)->flags & CL_MEM_USE_HOST_PTR))
-      {
-        delete[](*itr)->data;
-      }
-      delete *itr;
+      trackUsage(*itr, false);
+      releaseStorage(*itr);
+      m_spareBuffers.push_back(*itr);
 
       size_t address = (itr - m_memory.begin()) << m_numBitsAddress;
       m_context->notifyMemoryDeallocated(this, address);
@@ -216,8 +512,107 @@ void Memory::clear()
   }
   m_memory.resize(1);
   m_memory[0] = NULL;
-  m_freeBuffers = queue<unsigned>();
+  m_freeBuffers.clear();
+  m_nextFree = 0;
   m_totalAllocated = 0;
+  m_generation++;
+
+  if (m_addressSpace == AddrSpacePrivate)
+    m_usage->observe(m_peakAllocated);
+  m_peakAllocated = 0;
+
+  for (ArenaBlock& block : m_arena)
+    block.used = 0;
+  m_arenaBlock = 0;
+}
+
+size_t Memory::createFileBuffer(size_t size, const char* filename,
+                                size_t offset, cl_mem_flags flags)
+{
+  // Check requested size doesn't exceed maximum
+  if (size == 0 || size > m_maxBufferSize)
+  {
+    return 0;
+  }
+
+  // Check file holds the requested range
+  FILE* file = fopen(filename, "rb");
+  if (!file)
+  {
+    return 0;
+  }
+  if (fseek(file, 0, SEEK_END) || ftell(file) < 0 ||
+      (size_t)ftell(file) < offset + size)
+  {
+    fclose(file);
+    return 0;
+  }
+
+  // Find first unallocated buffer slot
+  unsigned b = getNextBuffer();
+  if (b >= m_maxNumBuffers)
+  {
+    fclose(file);
+    return 0;
+  }
+
+  // Create buffer
+  Buffer* buffer = newBuffer();
+  buffer->size = size;
+  buffer->flags = flags;
+  buffer->data = NULL;
+
+#if !defined(_WIN32)
+  // Map page-aligned contents privately, so that pages are only read from
+  // the file when touched and writes never reach the file
+  if (offset % sysconf(_SC_PAGESIZE) == 0)
+  {
+    void* data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                      fileno(file), offset);
+    if (data != MAP_FAILED)
+    {
+      buffer->storage = StorageFile;
+      buffer->data = (unsigned char*)data;
+    }
+  }
+#endif
+
+  // Otherwise read contents into regular storage
+  if (!buffer->data)
+  {
+    allocateStorage(buffer);
+    if (fseek(file, offset, SEEK_SET) ||
+        fread(buffer->data, 1, size, file) != size)
+    {
+      releaseStorage(buffer);
+      m_spareBuffers.push_back(buffer);
+      if (b < m_memory.size())
+        m_freeBuffers.push_back(b);
+      fclose(file);
+      return 0;
+    }
+  }
+  fclose(file);
+
+  if (b >= m_memory.size())
+  {
+    m_memory.push_back(buffer);
+  }
+  else
+  {
+    m_memory[b] = buffer;
+  }
+
+  m_totalAllocated += size;
+  trackUsage(buffer, true);
+
+  size_t address = ((size_t)b) << m_numBitsAddress;
+
+  // File contents are seen by plugins as a host write to the new buffer
+  m_context->notifyMemoryAllocated(this, address, size, flags, buffer->data);
+  m_context->notifyMemoryStore(this, address, size, buffer->data);
+
+  return address;
 }
 
 size_t Memory::createHostBuffer(size_t size, void* ptr, cl_mem_flags flags)
@@ -236,10 +631,11 @@ size_t Memory::createHostBuffer(size_t size, void* ptr, cl_mem_flags flags)
   }
 
   // Create buffer
-  Buffer* buffer = new Buffer;
+  Buffer* buffer = newBuffer();
   buffer->size = size;
   buffer->flags = flags;
   buffer->data = (unsigned char*)ptr;
+  buffer->storage = StorageHost;
 
   if (b >= m_memory.size())
   {
@@ -259,6 +655,58 @@ size_t Memory::createHostBuffer(size_t size, void* ptr, cl_mem_flags flags)
   return address;
 }
 
+Memory::Snapshot* Memory::createSnapshot() const
+{
+  Snapshot* snapshot = new Snapshot;
+  snapshot->m_buffers.resize(m_memory.size());
+  for (unsigned b = 1; b < m_memory.size(); b++)
+  {
+    Snapshot::Entry& entry = snapshot->m_buffers[b];
+    entry.size = 0;
+    entry.data = NULL;
+    entry.fd = -1;
+
+    const Buffer* buffer = m_memory[b];
+    if (!buffer)
+      continue;
+    entry.size = buffer->size;
+
+#if !defined(_WIN32)
+    // Page-aligned mappings are saved to a file, so that restoring them is
+    // just a copy-on-write remapping of that file
+    if (buffer->storage == StorageFile ||
+        buffer->storage == StorageHugePages ||
+        buffer->storage == StorageMapped ||
+        buffer->storage == StorageSnapshot ||
+        buffer->storage == StorageSpillFile)
+    {
+      const char* dir = getenv("OCLGRIND_SPILL_DIR");
+      if (!dir)
+        dir = getenv("TMPDIR");
+      int fd = createTempFile(dir ? dir : "/tmp", buffer->size);
+      if (fd >= 0)
+      {
+        void* data =
+          mmap(NULL, buffer->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (data != MAP_FAILED)
+        {
+          memcpy(data, buffer->data, buffer->size);
+          mprotect(data, buffer->size, PROT_READ);
+          entry.data = (unsigned char*)data;
+          entry.fd = fd;
+          continue;
+        }
+        close(fd);
+      }
+    }
+#endif
+
+    entry.data = new unsigned char[buffer->size];
+    memcpy(entry.data, buffer->data, buffer->size);
+  }
+  return snapshot;
+}
+
 bool Memory::copy(size_t dst, size_t src, size_t size)
 {
   m_context->notifyMemoryLoad(this, src, size);
@@ -280,6 +728,8 @@ bool Memory::copy(size_t dst, size_t src, size_t size)
   }
   size_t dst_offset = extractOffset(dst);
   Buffer* dst_buffer = m_memory.at(extractBuffer(dst));
+  if (m_trackWrites)
+    trackWrite(dst, size);
 
   // Copy data
   memcpy(dst_buffer->data + dst_offset, src_buffer->data + src_offset, size);
@@ -292,21 +742,64 @@ void Memory::deallocateBuffer(size_t address)
   unsigned buffer = extractBuffer(address);
   assert(buffer < m_memory.size() && m_memory[buffer]);
 
-  if (!(m_memory[buffer]->flags & CL_MEM_USE_HOST_PTR))
-  {
-    delete[] m_memory[buffer]->data;
-  }
+  releaseStorage(m_memory[buffer]);
 
   m_totalAllocated -= m_memory[buffer]->size;
-  m_freeBuffers.push(buffer);
+  trackUsage(m_memory[buffer], false);
+  m_freeBuffers.push_back(buffer);
 
-  delete m_memory[buffer];
+  m_spareBuffers.push_back(m_memory[buffer]);
   m_memory[buffer] = NULL;
+  m_generation++;
 
   m_context->notifyMemoryDeallocated(this, address);
 }
 
-void Memory::dump() const
+bool Memory::deserialize(istream& input)
+{
+  // Check that the recorded buffers match the ones allocated now
+  uint64_t numBuffers;
+  if (!input.read((char*)&numBuffers, sizeof(numBuffers)))
+    return false;
+  vector<Buffer*> buffers;
+  uint64_t total = 0;
+  for (uint64_t i = 0; i < numBuffers; i++)
+  {
+    uint64_t address, size;
+    if (!input.read((char*)&address, sizeof(address)) ||
+        !input.read((char*)&size, sizeof(size)))
+      return false;
+
+    size_t b = extractBuffer(address);
+    if (extractOffset(address) || b == 0 || b >= m_memory.size() ||
+        !m_memory[b] || !m_memory[b]->data || m_memory[b]->size != size)
+      return false;
+    buffers.push_back(m_memory[b]);
+    total += size;
+  }
+  for (unsigned b = 1; b < m_memory.size(); b++)
+  {
+    if (m_memory[b] && m_memory[b]->data)
+      numBuffers--;
+  }
+  if (numBuffers)
+    return false;
+
+  // Check that all of the contents are present before overwriting anything
+  istream::pos_type start = input.tellg();
+  input.seekg(0, ios::end);
+  if (!input || (uint64_t)(input.tellg() - start) < total)
+    return false;
+  input.seekg(start);
+
+  for (Buffer* buffer : buffers)
+  {
+    input.read((char*)buffer->data, buffer->size);
+  }
+  return (bool)input;
+}
+
+void Memory::dump(ostream& output) const
 {
   for (unsigned b = 1; b < m_memory.size(); b++)
   {
@@ -319,15 +812,50 @@ void Memory::dump() const
     {
       if (i % 4 == 0)
       {
-        cout << endl
-             << hex << uppercase << setw(16) << setfill(' ') << right
-             << ((((size_t)b) << m_numBitsAddress) | i) << ":";
+        output << endl
+               << hex << uppercase << setw(16) << setfill(' ') << right
+               << ((((size_t)b) << m_numBitsAddress) | i) << ":";
       }
-      cout << " " << hex << uppercase << setw(2) << setfill('0')
-           << (int)m_memory[b]->data[i];
+      output << " " << hex << uppercase << setw(2) << setfill('0')
+             << (int)m_memory[b]->data[i];
+    }
+  }
+  output << endl;
+}
+
+void Memory::dumpBinary(ostream& output, ostream& binary) const
+{
+  for (unsigned b = 1; b < m_memory.size(); b++)
+  {
+    if (!m_memory[b] || !m_memory[b]->data)
+    {
+      continue;
     }
+
+    output << hex << uppercase << setw(16) << setfill(' ') << right
+           << (((size_t)b) << m_numBitsAddress) << ": " << dec
+           << m_memory[b]->size << " bytes at offset " << binary.tellp()
+           << endl;
+    binary.write((const char*)m_memory[b]->data, m_memory[b]->size);
+  }
+}
+
+void Memory::dumpDigest(ostream& output) const
+{
+  for (unsigned b = 1; b < m_memory.size(); b++)
+  {
+    if (!m_memory[b] || !m_memory[b]->data)
+    {
+      continue;
+    }
+
+    output << hex << uppercase << setw(16) << setfill(' ') << right
+           << (((size_t)b) << m_numBitsAddress) << ": " << dec
+           << m_memory[b]->size << " bytes, xxh64 " << hex << nouppercase
+           << setw(16) << setfill('0')
+           << computeDigest(m_memory[b]->data, m_memory[b]->size) << dec
+           << endl;
   }
-  cout << endl;
 }
 
 size_t Memory::extractBuffer(size_t address) const
@@ -348,7 +876,8 @@ unsigned int Memory::getAddressSpace() const
 const Memory::Buffer* Memory::getBuffer(size_t address) const
 {
   size_t buf = extractBuffer(address);
-  if (buf == 0 || buf >= m_memory.size() || !m_memory[buf]->data)
+  if (buf == 0 || buf >= m_memory.size() || !m_memory[buf] ||
+      !m_memory[buf]->data)
   {
     return NULL;
   }
@@ -361,16 +890,42 @@ size_t Memory::getMaxAllocSize()
   return m_maxBufferSize;
 }
 
+unsigned char* Memory::getBufferRange(size_t address, size_t* begin,
+                                      size_t* end) const
+{
+  const Buffer* buffer = getBuffer(address);
+  if (!buffer)
+    return NULL;
+
+  *begin = address - extractOffset(address);
+  *end = *begin + buffer->size;
+  return buffer->data;
+}
+
+Memory::Buffer* Memory::newBuffer()
+{
+  if (m_spareBuffers.empty())
+    return new Buffer;
+
+  Buffer* buffer = m_spareBuffers.back();
+  m_spareBuffers.pop_back();
+  return buffer;
+}
+
 unsigned Memory::getNextBuffer()
 {
-  if (m_freeBuffers.empty())
+  if (m_nextFree == m_freeBuffers.size())
   {
     return m_memory.size();
   }
   else
   {
-    unsigned b = m_freeBuffers.front();
-    m_freeBuffers.pop();
+    unsigned b = m_freeBuffers[m_nextFree++];
+    if (m_nextFree == m_freeBuffers.size())
+    {
+      m_freeBuffers.clear();
+      m_nextFree = 0;
+    }
     return b;
   }
 }
@@ -388,6 +943,11 @@ void* Memory::getPointer(size_t address) const
   return m_memory[buffer]->data + extractOffset(address);
 }
 
+size_t Memory::getPeakAllocated() const
+{
+  return m_peakAllocated;
+}
+
 size_t Memory::getTotalAllocated() const
 {
   return m_totalAllocated;
@@ -419,8 +979,10 @@ bool Memory::load(unsigned char* dest, size_t address, size_t size) const
   size_t offset = extractOffset(address);
   Buffer* src = m_memory[extractBuffer(address)];
 
-  // Load data
-  memcpy(dest, src->data + offset, size);
+  // Load data (reading a host pointer buffer back into its own host memory
+  // needs no copy)
+  if (dest != src->data + offset)
+    memcpy(dest, src->data + offset, size);
 
   return true;
 }
@@ -438,6 +1000,148 @@ void* Memory::mapBuffer(size_t address, size_t offset, size_t size)
   return m_memory[buffer]->data + offset + extractOffset(address);
 }
 
+void Memory::releaseStorage(Buffer* buffer)
+{
+  switch (buffer->storage)
+  {
+  case StorageArena:
+  {
+    // Unwind the arena if this was its most recent allocation
+    ArenaBlock& block = m_arena[m_arenaBlock];
+    size_t size = (buffer->size + 15) & ~(size_t)15;
+    if (buffer->data + size == block.data + block.used)
+    {
+      block.used -= size;
+      if (block.used == 0 && m_arenaBlock > 0)
+        m_arenaBlock--;
+    }
+    break;
+  }
+  case StorageHeap:
+    delete[] buffer->data;
+    break;
+  case StorageHost:
+    break;
+  case StorageHugePages:
+#if !defined(_WIN32)
+    munmap(buffer->data, roundToHugePages(buffer->size));
+#endif
+    break;
+  case StorageFile:
+  case StorageMapped:
+  case StorageSnapshot:
+  case StorageSpillFile:
+#if !defined(_WIN32)
+    munmap(buffer->data, buffer->size);
+#endif
+    break;
+  }
+}
+
+void Memory::reset()
+{
+  // Zero all buffers in place, notifying plugins as though each buffer had
+  // been released and allocated again at the same address
+  for (unsigned b = 1; b < m_memory.size(); b++)
+  {
+    Buffer* buffer = m_memory[b];
+    if (!buffer)
+      continue;
+
+    size_t address = ((size_t)b) << m_numBitsAddress;
+    m_context->notifyMemoryDeallocated(this, address);
+    switch (buffer->storage)
+    {
+    case StorageHost:
+      break;
+#if !defined(_WIN32)
+    case StorageMapped:
+      // Drop the pages so they are zeroed again on next touch
+      if (madvise(buffer->data, buffer->size, MADV_DONTNEED) == 0)
+        break;
+#endif
+    default:
+      memset(buffer->data, 0, buffer->size);
+      break;
+    }
+    m_context->notifyMemoryAllocated(this, address, buffer->size,
+                                     buffer->flags, NULL);
+  }
+}
+
+void Memory::restoreSnapshot(const Snapshot* snapshot)
+{
+  // Restore buffers that still exist with the size they had when the
+  // snapshot was taken, notifying plugins as though each buffer had been
+  // released and allocated again with the saved contents
+  unsigned count = min(m_memory.size(), snapshot->m_buffers.size());
+  for (unsigned b = 1; b < count; b++)
+  {
+    Buffer* buffer = m_memory[b];
+    const Snapshot::Entry& entry = snapshot->m_buffers[b];
+    if (!buffer || !entry.size || buffer->size != entry.size ||
+        buffer->storage == StorageHost)
+      continue;
+
+    size_t address = ((size_t)b) << m_numBitsAddress;
+    m_context->notifyMemoryDeallocated(this, address);
+
+    // Spill files and huge pages keep their backing, so are copied back
+    bool restored = false;
+#if !defined(_WIN32)
+    if (entry.fd >= 0 && (buffer->storage == StorageFile ||
+                          buffer->storage == StorageMapped ||
+                          buffer->storage == StorageSnapshot))
+    {
+      void* data = mmap(buffer->data, buffer->size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_FIXED, entry.fd, 0);
+      if (data != MAP_FAILED)
+      {
+        buffer->storage = StorageSnapshot;
+        restored = true;
+      }
+    }
+#endif
+    if (!restored)
+      memcpy(buffer->data, entry.data, buffer->size);
+
+    m_context->notifyMemoryAllocated(this, address, buffer->size,
+                                     buffer->flags, entry.data);
+  }
+}
+
+void Memory::serialize(ostream& output) const
+{
+  // Record the address and size of each buffer, followed by their contents
+  uint64_t numBuffers = 0;
+  for (unsigned b = 1; b < m_memory.size(); b++)
+  {
+    if (m_memory[b] && m_memory[b]->data)
+      numBuffers++;
+  }
+  output.write((const char*)&numBuffers, sizeof(numBuffers));
+  for (unsigned b = 1; b < m_memory.size(); b++)
+  {
+    if (m_memory[b] && m_memory[b]->data)
+    {
+      uint64_t address = ((size_t)b) << m_numBitsAddress;
+      uint64_t size = m_memory[b]->size;
+      output.write((const char*)&address, sizeof(address));
+      output.write((const char*)&size, sizeof(size));
+    }
+  }
+  for (unsigned b = 1; b < m_memory.size(); b++)
+  {
+    if (m_memory[b] && m_memory[b]->data)
+      output.write((const char*)m_memory[b]->data, m_memory[b]->size);
+  }
+}
+
+void Memory::setPlacement(unsigned placement)
+{
+  m_placement = placement;
+}
+
 bool Memory::store(const unsigned char* source, size_t address, size_t size)
 {
   m_context->notifyMemoryStore(this, address, size, source);
@@ -448,12 +1152,96 @@ bool Memory::store(const unsigned char* source, size_t address, size_t size)
     return false;
   }
 
+  if (m_trackWrites)
+    trackWrite(address, size);
+
   // Get buffer
   size_t offset = extractOffset(address);
   Buffer* dst = m_memory[extractBuffer(address)];
 
-  // Store data
-  memcpy(dst->data + offset, source, size);
+  // Store data (skipped when the source is the buffer's own host memory)
+  if (dst->data + offset != source)
+    memcpy(dst->data + offset, source, size);
 
   return true;
 }
+
+bool Memory::takeWrites(vector<pair<size_t, size_t>>& ranges)
+{
+  sort(m_writes.begin(), m_writes.end());
+  ranges.clear();
+  for (const pair<size_t, size_t>& write : m_writes)
+  {
+    if (!ranges.empty() &&
+        write.first <= ranges.back().first + ranges.back().second)
+    {
+      size_t end = max(ranges.back().first + ranges.back().second,
+                       write.first + write.second);
+      ranges.back().second = end - ranges.back().first;
+    }
+    else
+      ranges.push_back(write);
+  }
+  m_writes.clear();
+
+  bool atomicWrites = m_atomicWrites;
+  m_atomicWrites = false;
+  return atomicWrites;
+}
+
+void Memory::trackUsage(const Buffer* buffer, bool allocated)
+{
+  if (buffer->storage == StorageHost)
+    return;
+
+  if (m_addressSpace == AddrSpacePrivate)
+  {
+    // Private memory is per work-item, so avoid contending on the shared
+    // counter for every alloca
+    if (allocated)
+      m_peakAllocated = max(m_peakAllocated, m_totalAllocated);
+    return;
+  }
+
+  if (allocated)
+  {
+    m_usage->allocate(buffer->size);
+    m_peakAllocated = max(m_peakAllocated, m_totalAllocated);
+  }
+  else
+  {
+    m_usage->release(buffer->size);
+  }
+}
+
+void Memory::trackWrite(size_t address, size_t size, bool atomic)
+{
+  // Ignore host transfers made by other command queues meanwhile
+  if (this_thread::get_id() != m_trackingThread)
+    return;
+
+  m_atomicWrites |= atomic;
+
+  // Work-items mostly write consecutive addresses, so only the last range
+  // is checked before adding another
+  if (!m_writes.empty())
+  {
+    pair<size_t, size_t>& last = m_writes.back();
+    if (address == last.first + last.second)
+    {
+      last.second += size;
+      return;
+    }
+    if (address >= last.first && address + size <= last.first + last.second)
+      return;
+  }
+  m_writes.push_back(make_pair(address, size));
+}
+
+void Memory::trackWrites(bool enable)
+{
+  m_writes.clear();
+  m_atomicWrites = false;
+  m_trackingThread = this_thread::get_id();
+  m_trackWrites = enable;
+}
@@ -8,6 +8,8 @@
 
 #include "common.h"
 
+#include <thread>
+
 namespace oclgrind
 {
 class Context;
@@ -15,11 +17,49 @@ class Context;
 class Memory
 {
 public:
+  enum BufferStorage
+  {
+    StorageArena,     // Carved from the private memory stack arena
+    StorageFile,      // Copy-on-write mapping of an input file
+    StorageHeap,      // Allocated with new[]
+    StorageHost,      // Owned by the application (CL_MEM_USE_HOST_PTR)
+    StorageHugePages, // Explicit huge page mapping (MAP_HUGETLB)
+    StorageMapped,    // Anonymous demand-zero mapping
+    StorageSnapshot,  // Copy-on-write mapping of a snapshot file
+    StorageSpillFile, // Mapping of an unlinked file in OCLGRIND_SPILL_DIR
+  };
+
   struct Buffer
   {
     size_t size;
     cl_mem_flags flags;
     unsigned char* data;
+    BufferStorage storage;
+  };
+
+  // Saved contents of the buffers allocated when it was created
+  class Snapshot
+  {
+  public:
+    ~Snapshot();
+
+  private:
+    friend class Memory;
+    struct Entry
+    {
+      size_t size;
+      unsigned char* data; // Copy of the contents, or read-only file mapping
+      int fd;              // Snapshot file descriptor, or -1 for a copy
+    };
+    std::vector<Entry> m_buffers; // Indexed by buffer, size 0 if unallocated
+  };
+
+  // Placement policy flags for mapped buffers
+  enum Placement
+  {
+    PlaceHugePages = 1,         // Advise transparent huge pages
+    PlaceExplicitHugePages = 2, // Map from the huge page pool
+    PlaceInterleave = 4,        // Interleave pages across NUMA nodes
   };
 
 public:
@@ -31,18 +71,47 @@ public:
   template <typename T> T atomic(AtomicOp op, size_t address, T value = 0);
   template <typename T> T atomicCmpxchg(size_t address, T cmp, T value);
   void clear();
+  size_t createFileBuffer(size_t size, const char* filename, size_t offset,
+                          cl_mem_flags flags = 0);
   size_t createHostBuffer(size_t size, void* ptr, cl_mem_flags flags = 0);
+  Snapshot* createSnapshot() const;
   bool copy(size_t dest, size_t src, size_t size);
   void deallocateBuffer(size_t address);
-  void dump() const;
+  // Restore the contents of every buffer from a checkpoint written by
+  // serialize, returning false (leaving memory as it was) unless the same
+  // buffers are allocated
+  bool deserialize(std::istream& input);
+  void dump(std::ostream& output = std::cout) const;
+  // Write raw buffer contents to binary, listing where each one starts
+  void dumpBinary(std::ostream& output, std::ostream& binary) const;
+  void dumpDigest(std::ostream& output) const;
   unsigned int getAddressSpace() const;
   const Buffer* getBuffer(size_t address) const;
+  unsigned char* getBufferRange(size_t address, size_t* begin,
+                                size_t* end) const;
+  // Incremented whenever a buffer is released, invalidating cached ranges
+  uint64_t getGeneration() const { return m_generation; }
   void* getPointer(size_t address) const;
+  size_t getPeakAllocated() const;
   size_t getTotalAllocated() const;
   bool isAddressValid(size_t address, size_t size = 1) const;
+  bool isTrackingWrites() const { return m_trackWrites; }
   bool load(unsigned char* dst, size_t address, size_t size = 1) const;
   void* mapBuffer(size_t address, size_t offset, size_t size);
+  void reset();
+  // Put back the contents saved by createSnapshot, for buffers that still
+  // have the same size (large mappings only copy the pages written later)
+  void restoreSnapshot(const Snapshot* snapshot);
+  void serialize(std::ostream& output) const;
+  void setPlacement(unsigned placement);
   bool store(const unsigned char* source, size_t address, size_t size = 1);
+  // Take the ranges [first, first + second) written since tracking began,
+  // sorted and merged, returning whether any were written by atomics
+  bool takeWrites(std::vector<std::pair<size_t, size_t>>& ranges);
+  // Record the ranges written by stores, copies and atomics made by the
+  // calling thread, for a worker process to return to the process that
+  // forked it
+  void trackWrites(bool enable);
 
   size_t extractBuffer(size_t address) const;
   size_t extractOffset(size_t address) const;
@@ -51,16 +120,48 @@ public:
 
 private:
   const Context* m_context;
-  std::queue<unsigned> m_freeBuffers;
+  // Released buffer IDs, reused oldest first from m_nextFree
+  std::vector<unsigned> m_freeBuffers;
+  size_t m_nextFree;
   std::vector<Buffer*> m_memory;
   unsigned int m_addressSpace;
   size_t m_totalAllocated;
+  size_t m_peakAllocated;
+  unsigned m_placement;
+  uint64_t m_generation;
+
+  // Ranges written while tracking, each extending the last when adjacent
+  std::atomic<bool> m_trackWrites;
+  std::thread::id m_trackingThread;
+  bool m_atomicWrites;
+  std::vector<std::pair<size_t, size_t>> m_writes;
+  void trackWrite(size_t address, size_t size, bool atomic = false);
+
+  // Bytes of Oclgrind-owned storage, shared by all memories in this address
+  // space (private memories only publish their peak when cleared)
+  MemoryUsage* m_usage;
+  void trackUsage(const Buffer* buffer, bool allocated);
+
+  // Private memory buffers are bump-allocated from a stack of blocks that
+  // persist until the Memory is destroyed
+  struct ArenaBlock
+  {
+    unsigned char* data;
+    size_t size;
+    size_t used;
+  };
+  std::vector<ArenaBlock> m_arena;
+  unsigned m_arenaBlock;
+  std::vector<Buffer*> m_spareBuffers;
 
   unsigned m_numBitsBuffer;
   unsigned m_numBitsAddress;
   size_t m_maxNumBuffers;
   size_t m_maxBufferSize;
 
+  void allocateStorage(Buffer* buffer);
   unsigned getNextBuffer();
+  Buffer* newBuffer();
+  void releaseStorage(Buffer* buffer);
 };
 } // namespace oclgrind
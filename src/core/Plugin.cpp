@@ -14,7 +14,60 @@ Plugin::Plugin(const Context* context) : m_context(context) {}
 
 Plugin::~Plugin() {}
 
+bool Plugin::deserialize(const std::string& data)
+{
+  return false;
+}
+
+uint32_t Plugin::getCallbacks() const
+{
+  // Assume plugins handle every callback unless they say otherwise
+  // (batched instruction records are opt-in)
+  return (CALLBACK_BIT(NumPluginCallbacks) - 1) &
+         ~CALLBACK_BIT(CallbackInstructionsExecuted);
+}
+
+uint32_t Plugin::getUnsampledCallbacks() const
+{
+  return getCallbacks();
+}
+
 bool Plugin::isThreadSafe() const
 {
   return true;
 }
+
+bool Plugin::mergeResults(const std::string& data)
+{
+  return false;
+}
+
+bool Plugin::needsInstructionCallbacks() const
+{
+  return true;
+}
+
+bool Plugin::needsUniformExecution() const
+{
+  return false;
+}
+
+bool Plugin::saveResults(std::string& data) const
+{
+  return false;
+}
+
+bool Plugin::serialize(std::string& data) const
+{
+  return false;
+}
+
+bool Plugin::supportsParallelWorkGroups() const
+{
+  return isThreadSafe();
+}
+
+bool Plugin::wantsWorkGroup(const WorkGroup* workGroup) const
+{
+  return true;
+}
@@ -19,6 +19,28 @@ class Memory;
 class WorkGroup;
 class WorkItem;
 
+// Entry in a batch of executed instructions
+struct InstructionRecord
+{
+  const WorkItem* workItem;
+  const llvm::Instruction* instruction;
+};
+
+// Range of addresses in a memory
+struct MemoryRegion
+{
+  size_t address;
+  size_t size;
+};
+
+// Host accesses made by one command, with adjacent regions coalesced
+struct HostTransfer
+{
+  const Memory* memory;
+  std::vector<MemoryRegion> loads;
+  std::vector<MemoryRegion> stores;
+};
+
 class Plugin
 {
 public:
@@ -32,11 +54,18 @@ public:
                                size_t size, const uint8_t* storeData)
   {
   }
+  virtual void hostMemoryTransfer(const HostTransfer& transfer) {}
   virtual void instructionExecuted(const WorkItem* workItem,
                                    const llvm::Instruction* instruction,
                                    const TypedValue& result)
   {
   }
+  // Batched alternative to instructionExecuted(), delivered in blocks no
+  // later than the workGroupComplete() of the group that executed them
+  virtual void instructionsExecuted(const InstructionRecord* records,
+                                    size_t count)
+  {
+  }
   virtual void kernelBegin(const KernelInvocation* kernelInvocation) {}
   virtual void kernelEnd(const KernelInvocation* kernelInvocation) {}
   virtual void log(MessageType type, const char* message) {}
@@ -88,7 +117,38 @@ public:
   virtual void workItemBarrier(const WorkItem *workItem){}
   virtual void workItemClearBarrier(const WorkItem *workItem){}
 
+  // Bitmask of CALLBACK_BIT() values for the callbacks this plugin handles
+  virtual uint32_t getCallbacks() const;
+  // Callbacks still wanted in work-groups left out of a sampled run
+  // (expensive analyses return a subset of getCallbacks())
+  virtual uint32_t getUnsampledCallbacks() const;
   virtual bool isThreadSafe() const;
+  // Whether this plugin's instruction callbacks must be made for the current
+  // kernel (otherwise it may run as native code, without them)
+  virtual bool needsInstructionCallbacks() const;
+  // Whether instructions with results that are uniform across a work-group
+  // must still be executed by every work-item (otherwise the result the
+  // first computes is copied, with the same instruction callbacks made)
+  virtual bool needsUniformExecution() const;
+  // Save or restore the state built up while a kernel's work-groups run, for
+  // checkpoints of the kernel (only taken if every plugin supports them, by
+  // returning true), restored after kernelBegin when resuming the kernel
+  virtual bool deserialize(const std::string& data);
+  virtual bool serialize(std::string& data) const;
+  // Save the results of the work-groups run by a worker process, forked
+  // after kernelBegin, and add them to this plugin in the process that
+  // forked it (kernels only use worker processes if every plugin supports
+  // them, by returning true)
+  virtual bool mergeResults(const std::string& data);
+  virtual bool saveResults(std::string& data) const;
+  // Whether a kernel's work-groups may run on several worker threads at once
+  // (plugins that aren't thread-safe may still serialize their own callbacks
+  // within a kernel, while commands are kept serialized)
+  virtual bool supportsParallelWorkGroups() const;
+  // Whether this plugin wants every callback for a work-group (otherwise it
+  // only gets its unsampled callbacks while the group runs), queried on the
+  // worker thread each time the group starts or resumes
+  virtual bool wantsWorkGroup(const WorkGroup* workGroup) const;
 
 protected:
   const Context* m_context;
@@ -0,0 +1,254 @@
+// Profiler.cpp (Oclgrind)
+// Copyright (c) 2013-2019, James Price and Simon McIntosh-Smith,
+// University of Bristol. All rights reserved.
+//
+// This program is provided under a three-clause BSD license. For full
+// license terms please see the LICENSE file distributed with this
+// source code.
+
+#include "common.h"
+
+#include <fstream>
+#include <iomanip>
+#include <map>
+
+#include "Profiler.h"
+
+using namespace oclgrind;
+using namespace std;
+
+// Index of the current thread in traces, assigned on first use
+static THREAD_LOCAL unsigned traceThread = 0;
+static atomic<unsigned> numTraceThreads(0);
+
+static void printTable(const char* title, const char* countName,
+                       const map<string, pair<double, uint64_t>>& rows);
+static string quote(const string& str);
+
+Profiler::Scope::Scope(const Profiler* profiler, const char* category,
+                       const string& name)
+  : m_profiler(profiler), m_category(category)
+{
+  if (m_profiler)
+  {
+    m_name = name;
+    m_start = now();
+  }
+}
+
+Profiler::Scope::~Scope()
+{
+  end();
+}
+
+void Profiler::Scope::end()
+{
+  if (m_profiler)
+  {
+    m_profiler->addEvent(m_category, m_name, m_start, now());
+    m_profiler = NULL;
+  }
+}
+
+Profiler::Profiler(const char* traceFile)
+{
+  if (traceFile)
+    m_traceFile = traceFile;
+  m_startTime = now();
+  m_startCycles = readCycles();
+  m_kernelEvents = 0;
+  m_kernelStart = 0;
+}
+
+Profiler::~Profiler()
+{
+  // Summarize the whole run
+  map<string, pair<double, uint64_t>> phases;
+  summarizeEvents(0, phases);
+  double secondsPerCycle = getSecondsPerCycle();
+  map<string, pair<double, uint64_t>> plugins;
+  for (const PluginTime* plugin : m_plugins)
+  {
+    pair<double, uint64_t>& time = plugins[plugin->name];
+    time.first += plugin->cycles * secondsPerCycle;
+    time.second += plugin->calls;
+  }
+
+  cout << "Oclgrind profile:" << endl;
+  printTable("phase", "count", phases);
+  printTable("plugin", "calls", plugins);
+  cout << endl;
+
+  if (!m_traceFile.empty())
+    writeTrace();
+
+  for (PluginTime* plugin : m_plugins)
+    delete plugin;
+}
+
+void Profiler::addEvent(const char* category, const string& name,
+                        double start, double end) const
+{
+  if (!traceThread)
+    traceThread = ++numTraceThreads;
+
+  lock_guard<mutex> lock(m_lock);
+  m_events.push_back({category, name, traceThread, start, end});
+}
+
+void Profiler::addPlugin(const Plugin* plugin, const string& name)
+{
+  PluginTime* time = new PluginTime;
+  time->plugin = plugin;
+  time->name = name;
+  time->cycles = 0;
+  time->calls = 0;
+  time->kernelCycles = 0;
+  time->kernelCalls = 0;
+  m_plugins.push_back(time);
+}
+
+void Profiler::addPluginTime(const Plugin* plugin, uint64_t cycles) const
+{
+  for (PluginTime* time : m_plugins)
+  {
+    if (time->plugin == plugin)
+    {
+      time->cycles.fetch_add(cycles, memory_order_relaxed);
+      time->calls.fetch_add(1, memory_order_relaxed);
+      return;
+    }
+  }
+}
+
+double Profiler::getSecondsPerCycle() const
+{
+  double elapsed = (now() - m_startTime) * 1e-9;
+  uint64_t cycles = readCycles() - m_startCycles;
+  return cycles ? elapsed / cycles : 0;
+}
+
+void Profiler::kernelBegin() const
+{
+  lock_guard<mutex> lock(m_lock);
+  m_kernelEvents = m_events.size();
+  m_kernelStart = now();
+  for (PluginTime* plugin : m_plugins)
+  {
+    plugin->kernelCycles = plugin->cycles;
+    plugin->kernelCalls = plugin->calls;
+  }
+}
+
+void Profiler::kernelEnd(const string& name) const
+{
+  addEvent("launch", name, m_kernelStart, now());
+
+  lock_guard<mutex> lock(m_lock);
+
+  // Phases of the kernel include the time taken by each worker
+  map<string, pair<double, uint64_t>> phases;
+  summarizeEvents(m_kernelEvents, phases);
+
+  double secondsPerCycle = getSecondsPerCycle();
+  double time = (now() - m_startTime) * 1e-3;
+  map<string, pair<double, uint64_t>> plugins;
+  for (const PluginTime* plugin : m_plugins)
+  {
+    pair<double, uint64_t>& row = plugins[plugin->name];
+    row.first += (plugin->cycles - plugin->kernelCycles) * secondsPerCycle;
+    row.second += plugin->calls - plugin->kernelCalls;
+    m_counters.push_back(
+      {plugin->name, time, plugin->cycles * secondsPerCycle});
+  }
+
+  cout << "Profile for kernel '" << name << "':" << endl;
+  printTable("phase", "count", phases);
+  printTable("plugin", "calls", plugins);
+  cout << endl;
+}
+
+void Profiler::removePlugin(const Plugin* plugin)
+{
+  // Keep the time of plugins that have been removed for the summary
+  for (PluginTime* time : m_plugins)
+  {
+    if (time->plugin == plugin)
+      time->plugin = NULL;
+  }
+}
+
+void Profiler::summarizeEvents(
+  size_t first, map<string, pair<double, uint64_t>>& phases) const
+{
+  for (size_t i = first; i < m_events.size(); i++)
+  {
+    const Event& event = m_events[i];
+    pair<double, uint64_t>& phase =
+      phases[string(event.category) + " " + event.name];
+    phase.first += (event.end - event.start) * 1e-9;
+    phase.second++;
+  }
+}
+
+void Profiler::writeTrace() const
+{
+  ofstream trace(m_traceFile.c_str());
+  trace << "{\"traceEvents\": [";
+  trace << fixed << setprecision(3);
+  bool first = true;
+  for (const Event& event : m_events)
+  {
+    trace << (first ? "" : ",") << endl;
+    trace << "  {\"name\": " << quote(event.name) << ", \"cat\": \""
+          << event.category << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": "
+          << event.thread << ", \"ts\": " << (event.start - m_startTime) * 1e-3
+          << ", \"dur\": " << (event.end - event.start) * 1e-3 << "}";
+    first = false;
+  }
+
+  // Cumulative plugin callback time, sampled at the end of each kernel
+  for (const Counter& counter : m_counters)
+  {
+    trace << (first ? "" : ",") << endl;
+    trace << "  {\"name\": " << quote(counter.name)
+          << ", \"cat\": \"plugin\", \"ph\": \"C\", \"pid\": 1, \"ts\": "
+          << counter.time << ", \"args\": {\"seconds\": " << setprecision(9)
+          << counter.value << setprecision(3) << "}}";
+    first = false;
+  }
+  trace << endl << "], \"displayTimeUnit\": \"ms\"}" << endl;
+
+  if (!trace)
+    cerr << "Oclgrind: Failed to write profile trace to " << m_traceFile
+         << endl;
+}
+
+static void printTable(const char* title, const char* countName,
+                       const map<string, pair<double, uint64_t>>& rows)
+{
+  ios_base::fmtflags flags = cout.flags();
+  streamsize precision = cout.precision();
+  cout << setw(16) << "seconds" << setw(16) << countName << " - " << title
+       << endl;
+  cout << fixed << setprecision(6);
+  for (auto& row : rows)
+  {
+    cout << setw(16) << row.second.first << setw(16) << row.second.second
+         << " - " << row.first << endl;
+  }
+  cout.flags(flags);
+  cout.precision(precision);
+}
+
+static string quote(const string& str)
+{
+  string quoted = "\"";
+  for (char c : str)
+  {
+    if (c == '"' || c == '\\')
+      quoted += '\\';
+    quoted += c;
+  }
+  return quoted + "\"";
+}
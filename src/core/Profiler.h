@@ -0,0 +1,117 @@
+// Profiler.h (Oclgrind)
+// Copyright (c) 2013-2019, James Price and Simon McIntosh-Smith,
+// University of Bristol. All rights reserved.
+//
+// This program is provided under a three-clause BSD license. For full
+// license terms please see the LICENSE file distributed with this
+// source code.
+
+#pragma once
+
+#include "common.h"
+
+#include <map>
+#include <mutex>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+namespace oclgrind
+{
+class Plugin;
+
+// Records how long each phase of a run takes (building programs, running
+// kernels on each worker) and the time spent in each plugin's callbacks,
+// which are summarized when a kernel ends and when the profiler is destroyed
+class Profiler
+{
+public:
+  // Times a phase on the current thread until end() or destruction
+  class Scope
+  {
+  public:
+    Scope(const Profiler* profiler, const char* category,
+          const std::string& name);
+    ~Scope();
+
+    void end();
+
+  private:
+    const Profiler* m_profiler;
+    const char* m_category;
+    std::string m_name;
+    double m_start;
+  };
+
+  // Writes a trace of the phases in Chrome's trace event format to
+  // traceFile when destroyed, if given
+  Profiler(const char* traceFile);
+  virtual ~Profiler();
+
+  void addPlugin(const Plugin* plugin, const std::string& name);
+  void addPluginTime(const Plugin* plugin, uint64_t cycles) const;
+  void kernelBegin() const;
+  // Print the time taken by a kernel, and the plugin callbacks it made
+  void kernelEnd(const std::string& name) const;
+  void removePlugin(const Plugin* plugin);
+
+  // Cheap timestamp for plugin callbacks, in units converted to time by the
+  // rate measured over the run
+  static uint64_t readCycles()
+  {
+#if defined(_MSC_VER) || defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return (uint64_t)now();
+#endif
+  }
+
+private:
+  struct Event
+  {
+    const char* category;
+    std::string name;
+    unsigned thread;
+    double start;
+    double end;
+  };
+  struct Counter
+  {
+    std::string name;
+    double time;
+    double value;
+  };
+  struct PluginTime
+  {
+    const Plugin* plugin;
+    std::string name;
+    std::atomic<uint64_t> cycles;
+    std::atomic<uint64_t> calls;
+    uint64_t kernelCycles;
+    uint64_t kernelCalls;
+  };
+
+  std::string m_traceFile;
+  double m_startTime;
+  uint64_t m_startCycles;
+
+  mutable std::mutex m_lock;
+  mutable std::vector<Event> m_events;
+  mutable std::vector<Counter> m_counters;
+  mutable size_t m_kernelEvents;
+  mutable double m_kernelStart;
+  std::vector<PluginTime*> m_plugins;
+
+  void addEvent(const char* category, const std::string& name, double start,
+                double end) const;
+  double getSecondsPerCycle() const;
+  // Total the time and count of each phase, from the event at index first
+  void summarizeEvents(
+    size_t first,
+    std::map<std::string, std::pair<double, uint64_t>>& phases) const;
+  void writeTrace() const;
+};
+} // namespace oclgrind
@@ -10,6 +10,8 @@
 #include "config.h"
 
 #include <fstream>
+#include <functional>
+#include <mutex>
 
 #if defined(_WIN32) && !defined(__MINGW32__)
 #include <windows.h>
@@ -19,32 +21,57 @@
 
 #include "clang/CodeGen/CodeGenAction.h"
 #include "clang/Frontend/CompilerInstance.h"
+#include "clang/Frontend/FrontendActions.h"
 #include "clang/Frontend/TextDiagnosticPrinter.h"
+#include "clang/Frontend/Utils.h"
 #include "clang/Lex/PreprocessorOptions.h"
 #include "llvm/Bitcode/BitcodeReader.h"
 #include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/Config/llvm-config.h"
 #include "llvm/IR/AssemblyAnnotationWriter.h"
 #include "llvm/IR/Constants.h"
+#include "llvm/IR/DebugInfoMetadata.h"
 #include "llvm/IR/InstIterator.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/LegacyPassManager.h"
 #include "llvm/IR/Module.h"
 #include "llvm/Linker/Linker.h"
+#include "llvm/Pass.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/LockFileManager.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Transforms/IPO.h"
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
+#include "llvm/Transforms/InstCombine/InstCombine.h"
+#include "llvm/Transforms/Scalar.h"
+#include "llvm/Transforms/Scalar/GVN.h"
 #include "llvm/Transforms/Utils/Cloning.h"
 
 #include "Context.h"
+#include "JITKernel.h"
 #include "Kernel.h"
 #include "Memory.h"
+#include "Profiler.h"
 #include "Program.h"
 #include "WorkItem.h"
 
 #define ENV_DUMP_SPIR "OCLGRIND_DUMP_SPIR"
+#define ENV_OPTIMIZE "OCLGRIND_OPTIMIZE"
 #define CL_DUMP_NAME "/tmp/oclgrind_%lX.cl"
 #define IR_DUMP_NAME "/tmp/oclgrind_%lX.s"
 #define BC_DUMP_NAME "/tmp/oclgrind_%lX.bc"
 
+// Inlining threshold used when optimizing for the interpreter, where the
+// cost of setting up a call frame outweighs any growth in code size
+#define INTERPRETER_INLINE_THRESHOLD 1000
+
+// Program binaries wrap the bitcode to add serialized interpreter caches
+#define BINARY_MAGIC "OCLGRIND"
+#define BINARY_VERSION 1
+#define BINARY_PRODUCER "oclgrind " PACKAGE_VERSION " llvm " LLVM_VERSION_STRING
+
 #if defined(_WIN32)
 #define REMAP_DIR "Z:/remapped/"
 #else
@@ -67,6 +94,13 @@ const char* EXTENSIONS[] = {
   "cl_khr_byte_addressable_store",
 };
 
+// Intrinsics the interpreter handles (see WorkItemBuiltins.cpp) that the
+// interpreter optimization pipeline is allowed to introduce
+const char* INTERPRETER_INTRINSICS[] = {
+  "llvm.bswap.",  "llvm.fabs.f",   "llvm.fmuladd", "llvm.lifetime.",
+  "llvm.memcpy.", "llvm.memmove.", "llvm.memset.",
+};
+
 using namespace oclgrind;
 using namespace std;
 
@@ -78,6 +112,7 @@ Program::Program(const Context* context, llvm::Module* module)
   m_buildStatus = CL_BUILD_SUCCESS;
   m_uid = generateUID();
   m_totalProgramScopeVarSize = 0;
+  m_sourceLocationsBuilt = false;
 
   allocateProgramScopeVars();
 }
@@ -91,6 +126,7 @@ Program::Program(const Context* context, const string& source)
   m_buildStatus = CL_BUILD_NONE;
   m_uid = 0;
   m_totalProgramScopeVarSize = 0;
+  m_sourceLocationsBuilt = false;
 
   // Split source into individual lines
   m_sourceLines.clear();
@@ -109,11 +145,15 @@ Program::~Program()
 {
   clearInterpreterCache();
   deallocateProgramScopeVars();
+
+  lock_guard<mutex> lock(m_context->getLLVMContextLock());
+  m_module.reset();
 }
 
 void Program::allocateProgramScopeVars()
 {
   deallocateProgramScopeVars();
+  lock_guard<shared_timed_mutex> lock(m_context->getDeviceLock());
 
   Memory* globalMemory = m_context->getGlobalMemory();
 
@@ -222,6 +262,244 @@ void split_token(char* input, char** next)
   *output = '\0';
 }
 
+// Compile opencl-c.h into a precompiled header at path
+static bool generatePCH(vector<const char*> args, const string& path,
+                        llvm::raw_ostream& buildLog)
+{
+  // Write to a temporary file that is renamed into place once complete
+  llvm::SmallString<256> tmpPath;
+  if (llvm::sys::fs::createUniqueFile(path + ".%%%%%%%%.tmp", tmpPath))
+    return false;
+
+  args.push_back("-emit-pch");
+  args.push_back("-relocatable-pch");
+  args.push_back("-isysroot");
+  args.push_back(REMAP_DIR);
+  args.push_back("-o");
+  args.push_back(tmpPath.c_str());
+  args.push_back("-x");
+  args.push_back("cl");
+  args.push_back(OPENCL_C_H_PATH);
+
+  clang::DiagnosticOptions* diagOpts = new clang::DiagnosticOptions();
+  clang::TextDiagnosticPrinter* diagConsumer =
+    new clang::TextDiagnosticPrinter(buildLog, diagOpts);
+
+  clang::CompilerInstance compiler;
+  compiler.createDiagnostics(diagConsumer);
+
+  std::shared_ptr<clang::CompilerInvocation> invocation(
+    new clang::CompilerInvocation);
+  clang::CompilerInvocation::CreateFromArgs(*invocation, args,
+                                            compiler.getDiagnostics());
+  compiler.setInvocation(invocation);
+
+  std::unique_ptr<llvm::MemoryBuffer> buffer =
+    llvm::MemoryBuffer::getMemBuffer(OPENCL_C_H_DATA, "", false);
+  compiler.getPreprocessorOpts().addRemappedFile(OPENCL_C_H_PATH,
+                                                 buffer.release());
+
+  clang::GeneratePCHAction action;
+  if (!compiler.ExecuteAction(action) ||
+      llvm::sys::fs::rename(tmpPath, path))
+  {
+    llvm::sys::fs::remove(tmpPath);
+    return false;
+  }
+  return true;
+}
+
+// Get a precompiled header for opencl-c.h compiled with args, generating it
+// in the PCH cache directory if necessary (returns an empty string on error)
+static string getCachedPCH(const vector<const char*>& args, const char* clstd,
+                           llvm::raw_ostream& buildLog)
+{
+  llvm::SmallString<256> dir;
+  const char* dirOverride = getenv("OCLGRIND_PCH_CACHE");
+  if (dirOverride)
+    dir = dirOverride;
+  else if (llvm::sys::path::cache_directory(dir))
+    llvm::sys::path::append(dir, "oclgrind");
+  if (dir.empty() || llvm::sys::fs::create_directories(dir))
+    return "";
+
+  // Name the header after everything that affects its contents
+  static const string headerHash = [] {
+    llvm::MD5 hash;
+    hash.update(OPENCL_C_H_DATA);
+    llvm::MD5::MD5Result result;
+    hash.final(result);
+    llvm::SmallString<32> digest;
+    llvm::MD5::stringifyResult(result, digest);
+    return digest.str().str();
+  }();
+  llvm::MD5 hash;
+  hash.update("oclgrind " PACKAGE_VERSION " llvm " LLVM_VERSION_STRING);
+  hash.update(headerHash);
+  for (const char* arg : args)
+  {
+    hash.update(llvm::StringRef(arg, strlen(arg) + 1));
+  }
+  llvm::MD5::MD5Result result;
+  hash.final(result);
+  llvm::SmallString<32> digest;
+  llvm::MD5::stringifyResult(result, digest);
+
+  llvm::SmallString<256> path(dir);
+  llvm::sys::path::append(path, string("opencl-c-") + (clstd + 10) + "-" +
+                                  (sizeof(size_t) == 4 ? "32" : "64") + "-" +
+                                  digest.str().str() + ".pch");
+
+  // Threads in this process take turns, and a lock file makes other
+  // processes wait for a header that is already being generated
+  static mutex generateLock;
+  lock_guard<mutex> lock(generateLock);
+  while (!llvm::sys::fs::exists(path))
+  {
+    llvm::LockFileManager fileLock(path);
+    switch (fileLock.getState())
+    {
+    case llvm::LockFileManager::LFS_Error:
+      return "";
+    case llvm::LockFileManager::LFS_Owned:
+      if (!generatePCH(args, path.str().str(), buildLog))
+        return "";
+      break;
+    case llvm::LockFileManager::LFS_Shared:
+      if (fileLock.waitForUnlock() == llvm::LockFileManager::Res_Timeout)
+        return "";
+      break;
+    }
+  }
+
+  return path.str().str();
+}
+
+// Level of interpreter optimization requested: 0 for none, 1 for passes
+// that leave every memory access in place, or 2 for the full pipeline
+static int getInterpreterOptLevel()
+{
+  // Stepping through source in the debugger needs the unoptimized program
+  unsigned level = getEnvInt(ENV_OPTIMIZE, 0);
+  if (!level || checkEnv("OCLGRIND_INTERACTIVE"))
+    return 0;
+
+  // The full pipeline may delete accesses that MemCheck would report, so
+  // only use it when asked for explicitly, and never when detecting races
+  // and uninitialized values, which need to see every access
+  if (level < 2 || checkEnv("OCLGRIND_DATA_RACES") ||
+      checkEnv("OCLGRIND_UNINITIALIZED"))
+    return 1;
+
+  return 2;
+}
+
+// Construct the build cache path for a program, from a hash of everything
+// that affects the result of building it (without an extension)
+static string getBuildCachePath(const char* cacheDir,
+                                const vector<const char*>& args,
+                                const list<Program::Header>& headers,
+                                const char* pch, const string& source)
+{
+  llvm::MD5 hash;
+  auto update = [&](llvm::StringRef data) {
+    hash.update(data);
+    hash.update(llvm::StringRef("", 1));
+  };
+
+  update("oclgrind " PACKAGE_VERSION " llvm " LLVM_VERSION_STRING);
+  update(checkEnv("OCLGRIND_INTERACTIVE") ? "interactive" : "");
+  update(to_string(getInterpreterOptLevel()));
+  for (const char* arg : args)
+    update(arg);
+
+  // Identify the precompiled header by its size and modification time
+  llvm::sys::fs::file_status status;
+  if (pch && !llvm::sys::fs::status(pch, status))
+  {
+    update(
+      to_string(status.getSize()) + ":" +
+      to_string(status.getLastModificationTime().time_since_epoch().count()));
+  }
+
+  for (const Program::Header& header : headers)
+  {
+    update(header.first);
+    update(header.second->getSource());
+  }
+  update(source);
+
+  llvm::MD5::MD5Result result;
+  hash.final(result);
+  llvm::SmallString<32> digest;
+  llvm::MD5::stringifyResult(result, digest);
+
+  llvm::SmallString<256> path(cacheDir);
+  llvm::sys::path::append(path, digest.str());
+  return path.str().str();
+}
+
+// Hash the contents of a file included from disk, so that a cached build is
+// only reused while the file is unchanged
+static string hashIncludedFile(const string& filename)
+{
+  llvm::ErrorOr<unique_ptr<llvm::MemoryBuffer>> buffer =
+    llvm::MemoryBuffer::getFile(filename);
+  if (!buffer)
+    return "missing";
+
+  llvm::MD5 hash;
+  hash.update(buffer->get()->getBuffer());
+  llvm::MD5::MD5Result result;
+  hash.final(result);
+  llvm::SmallString<32> digest;
+  llvm::MD5::stringifyResult(result, digest);
+  return digest.str().str();
+}
+
+// Collects the files a build includes from disk rather than from remapped
+// headers, which the build cache key can't cover
+class IncludeCollector : public clang::DependencyCollector
+{
+public:
+  bool needSystemDependencies() override { return true; }
+  bool sawDependency(llvm::StringRef filename, bool fromModule, bool isSystem,
+                     bool isModuleFile, bool isMissing) override
+  {
+    // The precompiled header is already identified in the cache key
+    if (fromModule || isModuleFile)
+      return false;
+    if (filename.startswith(REMAP_DIR) || filename == REMAP_INPUT)
+      return false;
+    return DependencyCollector::sawDependency(filename, fromModule, isSystem,
+                                              isModuleFile, isMissing);
+  }
+};
+
+// Write a build cache file via a uniquely named temporary file that is then
+// renamed into place, so processes sharing the cache never see partial files
+static void writeBuildCacheFile(const string& filename,
+                                const function<void(llvm::raw_ostream&)>& write)
+{
+  int fd;
+  llvm::SmallString<256> tmpName;
+  if (llvm::sys::fs::createUniqueFile(filename + ".%%%%%%%%.tmp", fd, tmpName))
+    return;
+
+  llvm::raw_fd_ostream out(fd, true);
+  write(out);
+  out.close();
+  if (out.has_error())
+  {
+    out.clear_error();
+    llvm::sys::fs::remove(tmpName);
+    return;
+  }
+
+  if (llvm::sys::fs::rename(tmpName, filename))
+    llvm::sys::fs::remove(tmpName);
+}
+
 bool Program::build(const char* options, list<Header> headers)
 {
   m_buildStatus = CL_BUILD_IN_PROGRESS;
@@ -231,6 +509,9 @@ bool Program::build(const char* options, list<Header> headers)
   m_buildLog = "";
   llvm::raw_string_ostream buildLog(m_buildLog);
 
+  Profiler* profiler = m_context->getProfiler();
+  Profiler::Scope buildScope(profiler, "build", "total");
+
   // Do nothing if program was created with binary
   if (m_source.empty() && m_module)
   {
@@ -244,6 +525,8 @@ bool Program::build(const char* options, list<Header> headers)
   if (m_module)
   {
     clearInterpreterCache();
+
+    lock_guard<mutex> lock(m_context->getLLVMContextLock());
     m_module.reset();
   }
 
@@ -276,9 +559,11 @@ bool Program::build(const char* options, list<Header> headers)
     cl_ext += ",+" + std::string(EXTENSIONS[i]);
   }
   args.push_back(cl_ext.c_str());
+  size_t numBaseArgs = args.size();
 
   bool defaultOptimization = true;
   const char* clstd = NULL;
+  vector<const char*> pchOptions;
 
   // Add OpenCL build options
   const char* mainOptions = options;
@@ -300,38 +585,42 @@ bool Program::build(const char* options, list<Header> headers)
     if (!strlen(opt))
       break;
 
-    // Ignore options that break PCH
-    if (strcmp(opt, "-cl-fast-relaxed-math") != 0 &&
-        strcmp(opt, "-cl-finite-math-only") != 0 &&
-        strcmp(opt, "-cl-single-precision-constant") &&
-        strcmp(opt, "-cl-unsafe-math-optimizations") != 0)
+    // Options that change how opencl-c.h is compiled, which need a
+    // precompiled header generated with the same options
+    if (strcmp(opt, "-cl-fast-relaxed-math") == 0 ||
+        strcmp(opt, "-cl-finite-math-only") == 0 ||
+        strcmp(opt, "-cl-single-precision-constant") == 0 ||
+        strcmp(opt, "-cl-unsafe-math-optimizations") == 0)
     {
-      // Check for optimization flags
-      if (strncmp(opt, "-O", 2) == 0 || strcmp(opt, "-cl-opt-disable") == 0)
-      {
-        defaultOptimization = false;
-      }
+      pchOptions.push_back(opt);
+      continue;
+    }
 
-      // Clang no longer supports -cl-no-signed-zeros
-      if (strcmp(opt, "-cl-no-signed-zeros") == 0)
-        continue;
+    // Check for optimization flags
+    if (strncmp(opt, "-O", 2) == 0 || strcmp(opt, "-cl-opt-disable") == 0)
+    {
+      defaultOptimization = false;
+    }
 
-      // Handle -cl-denorms-are-zero
-      if (strcmp(opt, "-cl-denorms-are-zero") == 0)
-      {
-        args.push_back("-fdenormal-fp-math=preserve-sign");
-        continue;
-      }
+    // Clang no longer supports -cl-no-signed-zeros
+    if (strcmp(opt, "-cl-no-signed-zeros") == 0)
+      continue;
 
-      // Check for -cl-std flag
-      if (strncmp(opt, "-cl-std=", 8) == 0)
-      {
-        clstd = opt;
-        continue;
-      }
+    // Handle -cl-denorms-are-zero
+    if (strcmp(opt, "-cl-denorms-are-zero") == 0)
+    {
+      args.push_back("-fdenormal-fp-math=preserve-sign");
+      continue;
+    }
 
-      args.push_back(opt);
+    // Check for -cl-std flag
+    if (strncmp(opt, "-cl-std=", 8) == 0)
+    {
+      clstd = opt;
+      continue;
     }
+
+    args.push_back(opt);
   }
 
   if (defaultOptimization)
@@ -349,17 +638,21 @@ bool Program::build(const char* options, list<Header> headers)
     clstd = "-cl-std=CL1.2";
   }
   args.push_back(clstd);
+  args.insert(args.end(), pchOptions.begin(), pchOptions.end());
 
   // Pre-compiled header
+  Profiler::Scope pchScope(profiler, "build", "pch");
+  bool usePCH = !checkEnv("OCLGRIND_DISABLE_PCH");
   char* pchdir = NULL;
   char* pch = NULL;
-  if (!checkEnv("OCLGRIND_DISABLE_PCH") &&
+  if (usePCH && pchOptions.empty() &&
       (!strcmp(clstd, "-cl-std=CL1.2") || !strcmp(clstd, "-cl-std=CL2.0")))
   {
     const char* pchdirOverride = getenv("OCLGRIND_PCH_DIR");
     if (pchdirOverride)
     {
-      pchdir = strdup(pchdirOverride);
+      pchdir = new char[strlen(pchdirOverride) + 1];
+      strcpy(pchdir, pchdirOverride);
     }
     else
     {
@@ -407,19 +700,37 @@ bool Program::build(const char* options, list<Header> headers)
       ifstream pchfile(pch);
       if (!pchfile.good())
       {
-        buildLog << "WARNING: Unable to find precompiled header:\n"
-                 << pch << "\n";
         delete[] pch;
         pch = NULL;
       }
       pchfile.close();
     }
+  }
+
+  // Otherwise use a precompiled header generated for these options
+  if (usePCH && !pch)
+  {
+    vector<const char*> pchArgs(args.begin(), args.begin() + numBaseArgs);
+    pchArgs.push_back(clstd);
+    pchArgs.insert(pchArgs.end(), pchOptions.begin(), pchOptions.end());
+
+    string generated = getCachedPCH(pchArgs, clstd, buildLog);
+    if (!generated.empty())
+    {
+      delete[] pchdir;
+      pchdir = new char[strlen(REMAP_DIR) + 1];
+      strcpy(pchdir, REMAP_DIR);
+      pch = new char[generated.size() + 1];
+      strcpy(pch, generated.c_str());
+    }
     else
     {
-      buildLog << "WARNING: Unable to determine precompiled header path\n";
+      buildLog << "WARNING: Unable to find or generate precompiled header\n";
     }
   }
 
+  pchScope.end();
+
   if (pch)
   {
     args.push_back("-isysroot");
@@ -439,68 +750,125 @@ bool Program::build(const char* options, list<Header> headers)
   // Append input file to arguments (remapped later)
   args.push_back(REMAP_INPUT);
 
-  // Create diagnostics engine
-  clang::DiagnosticOptions* diagOpts = new clang::DiagnosticOptions();
-  llvm::IntrusiveRefCntPtr<clang::DiagnosticIDs> diagID(
-    new clang::DiagnosticIDs());
-  clang::TextDiagnosticPrinter* diagConsumer =
-    new clang::TextDiagnosticPrinter(buildLog, diagOpts);
-  clang::DiagnosticsEngine diags(diagID, diagOpts, diagConsumer);
-
-  // Create compiler instance
-  clang::CompilerInstance compiler;
-  compiler.createDiagnostics(diagConsumer, false);
-
-  // Create compiler invocation
-  std::shared_ptr<clang::CompilerInvocation> invocation(
-    new clang::CompilerInvocation);
-  clang::CompilerInvocation::CreateFromArgs(*invocation, args,
-                                            compiler.getDiagnostics());
-  compiler.setInvocation(invocation);
-
-  // Remap include files
-  std::unique_ptr<llvm::MemoryBuffer> buffer;
-  compiler.getHeaderSearchOpts().AddPath(REMAP_DIR, clang::frontend::Quoted,
-                                         false, true);
-  list<Header>::iterator itr;
-  for (itr = headers.begin(); itr != headers.end(); itr++)
+  // Look for a previous build of the same program in the build cache
+  string cachePath;
+  const char* cacheDir = getenv("OCLGRIND_BUILD_CACHE");
+  if (cacheDir && strlen(cacheDir))
   {
-    buffer = llvm::MemoryBuffer::getMemBuffer(itr->second->m_source, "", false);
-    compiler.getPreprocessorOpts().addRemappedFile(REMAP_DIR + itr->first,
-                                                   buffer.release());
+    cachePath = getBuildCachePath(cacheDir, args, headers, pch, m_source);
   }
 
-  // Remap opencl-c.h
-  buffer = llvm::MemoryBuffer::getMemBuffer(OPENCL_C_H_DATA, "", false);
-  compiler.getPreprocessorOpts().addRemappedFile(OPENCL_C_H_PATH,
-                                                 buffer.release());
+  size_t logStart = buildLog.str().size();
+  string cachedLog;
+  if (!cachePath.empty() && loadBuildCache(cachePath, cachedLog))
+  {
+    buildLog << cachedLog;
 
-  // Remap input file
-  buffer = llvm::MemoryBuffer::getMemBuffer(m_source, "", false);
-  compiler.getPreprocessorOpts().addRemappedFile(REMAP_INPUT, buffer.release());
+    allocateProgramScopeVars();
 
-  // Compile
-  clang::EmitLLVMOnlyAction action(m_context->getLLVMContext());
-  if (compiler.ExecuteAction(action))
+    m_buildStatus = CL_BUILD_SUCCESS;
+  }
+  else
   {
-    // Retrieve module
-    m_module = action.takeModule();
+    // Create diagnostics engine
+    clang::DiagnosticOptions* diagOpts = new clang::DiagnosticOptions();
+    llvm::IntrusiveRefCntPtr<clang::DiagnosticIDs> diagID(
+      new clang::DiagnosticIDs());
+    clang::TextDiagnosticPrinter* diagConsumer =
+      new clang::TextDiagnosticPrinter(buildLog, diagOpts);
+    clang::DiagnosticsEngine diags(diagID, diagOpts, diagConsumer);
+
+    // Create compiler instance
+    clang::CompilerInstance compiler;
+    compiler.createDiagnostics(diagConsumer, false);
+
+    // Create compiler invocation
+    std::shared_ptr<clang::CompilerInvocation> invocation(
+      new clang::CompilerInvocation);
+    clang::CompilerInvocation::CreateFromArgs(*invocation, args,
+                                              compiler.getDiagnostics());
+    compiler.setInvocation(invocation);
+
+    // Remap include files
+    std::unique_ptr<llvm::MemoryBuffer> buffer;
+    compiler.getHeaderSearchOpts().AddPath(REMAP_DIR, clang::frontend::Quoted,
+                                           false, true);
+    list<Header>::iterator itr;
+    for (itr = headers.begin(); itr != headers.end(); itr++)
+    {
+      buffer =
+        llvm::MemoryBuffer::getMemBuffer(itr->second->m_source, "", false);
+      compiler.getPreprocessorOpts().addRemappedFile(REMAP_DIR + itr->first,
+                                                     buffer.release());
+    }
+
+    // Remap opencl-c.h
+    buffer = llvm::MemoryBuffer::getMemBuffer(OPENCL_C_H_DATA, "", false);
+    compiler.getPreprocessorOpts().addRemappedFile(OPENCL_C_H_PATH,
+                                                   buffer.release());
+
+    // Remap input file
+    buffer = llvm::MemoryBuffer::getMemBuffer(m_source, "", false);
+    compiler.getPreprocessorOpts().addRemappedFile(REMAP_INPUT,
+                                                   buffer.release());
 
-    // Strip debug intrinsics if not in interactive mode
-    if (!checkEnv("OCLGRIND_INTERACTIVE"))
+    // Record files included from disk, which a cached build depends on too
+    shared_ptr<IncludeCollector> includes;
+    if (!cachePath.empty())
     {
-      stripDebugIntrinsics();
+      includes = make_shared<IncludeCollector>();
+      compiler.addDependencyCollector(includes);
     }
 
-    removeLValueLoads();
+    // Compile into a private LLVM context, so that distinct programs can be
+    // built concurrently
+    llvm::LLVMContext buildContext;
+    clang::EmitLLVMOnlyAction action(&buildContext);
+    Profiler::Scope parseScope(profiler, "build", "parse");
+    bool compiled = compiler.ExecuteAction(action);
+    parseScope.end();
+    if (compiled)
+    {
+      // Retrieve module
+      m_module = action.takeModule();
 
-    allocateProgramScopeVars();
+      // Strip debug intrinsics if not in interactive mode
+      if (!checkEnv("OCLGRIND_INTERACTIVE"))
+      {
+        stripDebugIntrinsics();
+      }
 
-    m_buildStatus = CL_BUILD_SUCCESS;
-  }
-  else
-  {
-    m_buildStatus = CL_BUILD_ERROR;
+      Profiler::Scope optimizeScope(profiler, "build", "optimize");
+      optimizeForInterpreter(buildLog);
+      optimizeScope.end();
+
+      Profiler::Scope lvalueScope(profiler, "build", "removeLValueLoads");
+      removeLValueLoads();
+      lvalueScope.end();
+
+      // Save the processed module for future builds
+      if (!cachePath.empty())
+      {
+        storeBuildCache(cachePath, buildLog.str().substr(logStart),
+                        includes->getDependencies().vec());
+      }
+
+      if (moveToSharedContext())
+      {
+        allocateProgramScopeVars();
+
+        m_buildStatus = CL_BUILD_SUCCESS;
+      }
+      else
+      {
+        buildLog << "ERROR: Failed to load compiled module\n";
+        m_buildStatus = CL_BUILD_ERROR;
+      }
+    }
+    else
+    {
+      m_buildStatus = CL_BUILD_ERROR;
+    }
   }
 
   // Dump temps if required
@@ -555,6 +923,29 @@ bool Program::build(const char* options, list<Header> headers)
   return m_buildStatus == CL_BUILD_SUCCESS;
 }
 
+void Program::buildSourceLocations()
+{
+  for (llvm::Function& function : *m_module)
+  {
+    for (auto I = llvm::inst_begin(function); I != llvm::inst_end(function);
+         I++)
+    {
+      const llvm::DILocation* loc = I->getDebugLoc().get();
+      if (!loc)
+        continue;
+
+      SourceLocation location;
+      location.line = loc->getLine();
+      location.column = loc->getColumn();
+      location.filename =
+        &*m_sourceFiles.insert(loc->getFilename().str()).first;
+      m_sourceLocations[&*I] = location;
+      m_lineInstructions[location.line].push_back(&*I);
+    }
+  }
+  m_sourceLocationsBuilt = true;
+}
+
 void Program::clearInterpreterCache()
 {
   InterpreterCacheMap::iterator itr;
@@ -563,11 +954,74 @@ void Program::clearInterpreterCache()
     delete itr->second;
   }
   m_interpreterCache.clear();
+  m_serializedCaches.clear();
+
+  m_sourceLocations.clear();
+  m_lineInstructions.clear();
+  m_sourceFiles.clear();
+  m_sourceLocationsBuilt = false;
+
+  for (auto jit = m_jitKernels.begin(); jit != m_jitKernels.end(); jit++)
+  {
+    delete jit->second;
+  }
+  m_jitKernels.clear();
+}
+
+// Extract the bitcode and serialized interpreter caches from a binary
+// produced by Program::getBinary
+static bool parseBinary(const string& binary, string& bitcode,
+                        map<string, string>& caches)
+{
+  size_t offset = strlen(BINARY_MAGIC);
+  uint32_t version, numCaches;
+  string producer;
+  if (!readBinary(binary, offset, version) || version != BINARY_VERSION ||
+      !readBinary(binary, offset, producer) ||
+      !readBinary(binary, offset, bitcode) ||
+      !readBinary(binary, offset, numCaches))
+  {
+    return false;
+  }
+
+  for (unsigned i = 0; i < numCaches; i++)
+  {
+    string kernel, cache;
+    if (!readBinary(binary, offset, kernel) ||
+        !readBinary(binary, offset, cache))
+    {
+      return false;
+    }
+    caches[kernel] = cache;
+  }
+
+  // Caches from a different build of Oclgrind may not match its builtins
+  if (producer != BINARY_PRODUCER)
+  {
+    caches.clear();
+  }
+
+  return offset == binary.size();
 }
 
 Program* Program::createFromBitcode(const Context* context,
                                     const unsigned char* bitcode, size_t length)
 {
+  // Unwrap program binaries that include serialized interpreter caches
+  string binary, unwrapped;
+  map<string, string> caches;
+  size_t magicLength = strlen(BINARY_MAGIC);
+  if (length >= magicLength && !memcmp(bitcode, BINARY_MAGIC, magicLength))
+  {
+    binary.assign((const char*)bitcode, length);
+    if (!parseBinary(binary, unwrapped, caches))
+    {
+      return NULL;
+    }
+    bitcode = (const unsigned char*)unwrapped.data();
+    length = unwrapped.size();
+  }
+
   // Load bitcode from file
   llvm::StringRef data((const char*)bitcode, length);
   unique_ptr<llvm::MemoryBuffer> buffer =
@@ -578,6 +1032,7 @@ Program* Program::createFromBitcode(const Context* context,
   }
 
   // Parse bitcode into IR module
+  lock_guard<mutex> lock(context->getLLVMContextLock());
   llvm::Expected<unique_ptr<llvm::Module>> module =
     parseBitcodeFile(buffer->getMemBufferRef(), *context->getLLVMContext());
   if (!module)
@@ -585,7 +1040,9 @@ Program* Program::createFromBitcode(const Context* context,
     return NULL;
   }
 
-  return new Program(context, module.get().release());
+  Program* program = new Program(context, module.get().release());
+  program->m_serializedCaches = caches;
+  return program;
 }
 
 Program* Program::createFromBitcodeFile(const Context* context,
@@ -600,6 +1057,7 @@ Program* Program::createFromBitcodeFile(const Context* context,
   }
 
   // Parse bitcode into IR module
+  lock_guard<mutex> lock(context->getLLVMContextLock());
   llvm::Expected<unique_ptr<llvm::Module>> module = parseBitcodeFile(
     buffer->get()->getMemBufferRef(), *context->getLLVMContext());
   if (!module)
@@ -613,55 +1071,159 @@ Program* Program::createFromBitcodeFile(const Context* context,
 Program* Program::createFromPrograms(const Context* context,
                                      list<const Program*> programs)
 {
+  unique_lock<mutex> lock(context->getLLVMContextLock());
+
+  // Find the definitions reachable from kernels, so that only those are
+  // cloned and linked rather than every function in each library
+  map<string, const llvm::GlobalValue*> definitions;
+  list<const llvm::GlobalValue*> worklist;
+  list<const Program*>::iterator itr;
+  for (itr = programs.begin(); itr != programs.end(); itr++)
+  {
+    for (const llvm::GlobalValue& global : (*itr)->m_module->global_values())
+    {
+      if (global.isDeclaration())
+        continue;
+      if (!global.hasLocalLinkage())
+        definitions.insert(make_pair(global.getName().str(), &global));
+
+      const llvm::Function* function = llvm::dyn_cast<llvm::Function>(&global);
+      if ((function &&
+           function->getCallingConv() == llvm::CallingConv::SPIR_KERNEL) ||
+          global.hasAppendingLinkage())
+        worklist.push_back(&global);
+    }
+  }
+
+  set<const llvm::GlobalValue*> needed;
+  while (!worklist.empty())
+  {
+    const llvm::GlobalValue* global = worklist.front();
+    worklist.pop_front();
+
+    // Resolve references to definitions in other modules
+    if (global->isDeclaration())
+    {
+      auto definition = definitions.find(global->getName().str());
+      if (definition == definitions.end())
+        continue;
+      global = definition->second;
+    }
+    if (!needed.insert(global).second)
+      continue;
+
+    // Queue globals referenced by instructions and initializers
+    list<const llvm::User*> users;
+    set<const llvm::Constant*> visited;
+    if (auto function = llvm::dyn_cast<llvm::Function>(global))
+    {
+      for (auto I = llvm::inst_begin(function), E = llvm::inst_end(function);
+           I != E; I++)
+        users.push_back(&*I);
+    }
+    else
+    {
+      users.push_back(global);
+    }
+    while (!users.empty())
+    {
+      const llvm::User* user = users.front();
+      users.pop_front();
+      for (const llvm::Value* operand : user->operand_values())
+      {
+        if (auto reference = llvm::dyn_cast<llvm::GlobalValue>(operand))
+          worklist.push_back(reference);
+        else if (auto constant = llvm::dyn_cast<llvm::Constant>(operand))
+        {
+          if (visited.insert(constant).second)
+            users.push_back(constant);
+        }
+      }
+    }
+  }
+
   llvm::Module* module =
     new llvm::Module("oclgrind_linked", *context->getLLVMContext());
   llvm::Linker linker(*module);
 
-  // Link modules
-  list<const Program*>::iterator itr;
+  // Link modules, cloning only the definitions that are needed (the others
+  // become declarations that are removed once everything is resolved)
   for (itr = programs.begin(); itr != programs.end(); itr++)
   {
-    unique_ptr<llvm::Module> m = llvm::CloneModule(*(*itr)->m_module);
+    llvm::ValueToValueMapTy vmap;
+    unique_ptr<llvm::Module> m =
+      llvm::CloneModule(*(*itr)->m_module, vmap,
+                        [&](const llvm::GlobalValue* global) {
+                          return needed.count(global) > 0;
+                        });
     if (linker.linkInModule(std::move(m)))
     {
+      delete module;
       return NULL;
     }
   }
 
+  for (auto F = module->begin(); F != module->end();)
+  {
+    llvm::Function* function = &*F++;
+    if (function->isDeclaration() && function->use_empty())
+      function->eraseFromParent();
+  }
+  for (auto G = module->global_begin(); G != module->global_end();)
+  {
+    llvm::GlobalVariable* variable = &*G++;
+    if (variable->isDeclaration() && variable->use_empty())
+      variable->eraseFromParent();
+  }
+
+  lock.unlock();
+
   return new Program(context, module);
 }
 
-Kernel* Program::createKernel(const string name)
+InterpreterCache*
+Program::createInterpreterCache(llvm::Function* kernel) const
 {
-  if (!m_module)
-    return NULL;
-
-  // Iterate over functions in module to find kernel
-  llvm::Function* function = NULL;
+  InterpreterCacheMap::iterator itr = m_interpreterCache.find(kernel);
+  if (itr != m_interpreterCache.end())
+  {
+    return itr->second;
+  }
 
-  for (auto F = m_module->begin(); F != m_module->end(); F++)
+  // Skip analysis where possible if the program was loaded from a binary
+  const string* serialized = NULL;
+  map<string, string>::const_iterator sItr =
+    m_serializedCaches.find(kernel->getName().str());
+  if (sItr != m_serializedCaches.end())
   {
-    if (F->getCallingConv() == llvm::CallingConv::SPIR_KERNEL &&
-        F->getName() == name)
-    {
-      function = &*F;
-      break;
-    }
+    serialized = &sItr->second;
   }
 
-  if (function == NULL)
+  Profiler::Scope scope(m_context->getProfiler(), "build", "interpreter cache");
+  InterpreterCache* cache = new InterpreterCache(kernel, serialized);
+  m_interpreterCache[kernel] = cache;
+  return cache;
+}
+
+Kernel* Program::createKernel(const string name)
+{
+  if (!m_module)
+    return NULL;
+
+  // Look up kernel in module symbol table
+  llvm::Function* function = m_module->getFunction(name);
+  if (function == NULL ||
+      function->getCallingConv() != llvm::CallingConv::SPIR_KERNEL)
   {
     return NULL;
   }
 
   try
   {
-    // Create cache if none already
-    InterpreterCacheMap::iterator itr = m_interpreterCache.find(function);
-    if (itr == m_interpreterCache.end())
-    {
-      m_interpreterCache[function] = new InterpreterCache(function);
-    }
+    // Create caches if none already
+    createInterpreterCache(function);
+    if (!m_sourceLocationsBuilt)
+      buildSourceLocations();
 
     return new Kernel(this, function, m_module.get());
   }
@@ -678,6 +1240,7 @@ Kernel* Program::createKernel(const string name)
 
 void Program::deallocateProgramScopeVars()
 {
+  lock_guard<shared_timed_mutex> lock(m_context->getDeviceLock());
   for (auto psv = m_programScopeVars.begin(); psv != m_programScopeVars.end();
        psv++)
   {
@@ -694,9 +1257,7 @@ void Program::getBinary(unsigned char* binary) const
     return;
 
   std::string str;
-  llvm::raw_string_ostream stream(str);
-  llvm::WriteBitcodeToFile(*m_module, stream);
-  stream.str();
+  serializeBinary(str);
 
   memcpy(binary, str.c_str(), str.length());
 }
@@ -709,9 +1270,7 @@ size_t Program::getBinarySize() const
   }
 
   std::string str;
-  llvm::raw_string_ostream stream(str);
-  llvm::WriteBitcodeToFile(*m_module, stream);
-  stream.str();
+  serializeBinary(str);
   return str.length();
 }
 
@@ -747,6 +1306,19 @@ Program::getInterpreterCache(const llvm::Function* kernel) const
   return m_interpreterCache[kernel];
 }
 
+const JITKernel* Program::getJITKernel(const llvm::Function* kernel) const
+{
+  JITKernelMap::iterator itr = m_jitKernels.find(kernel);
+  if (itr == m_jitKernels.end())
+  {
+    Profiler::Scope scope(m_context->getProfiler(), "build", "jit");
+    itr = m_jitKernels
+            .insert(make_pair(kernel, JITKernel::create(this, kernel)))
+            .first;
+  }
+  return itr->second;
+}
+
 list<string> Program::getKernelNames() const
 {
   list<string> names;
@@ -760,6 +1332,14 @@ list<string> Program::getKernelNames() const
   return names;
 }
 
+const vector<const llvm::Instruction*>&
+Program::getLineInstructions(size_t lineNumber) const
+{
+  static const vector<const llvm::Instruction*> none;
+  auto itr = m_lineInstructions.find(lineNumber);
+  return itr == m_lineInstructions.end() ? none : itr->second;
+}
+
 llvm::LLVMContext& Program::getLLVMContext() const
 {
   return m_module->getContext();
@@ -798,6 +1378,13 @@ const char* Program::getSourceLine(size_t lineNumber) const
   return m_sourceLines[lineNumber - 1].c_str();
 }
 
+const Program::SourceLocation*
+Program::getSourceLocation(const llvm::Instruction* instruction) const
+{
+  auto itr = m_sourceLocations.find(instruction);
+  return itr == m_sourceLocations.end() ? NULL : &itr->second;
+}
+
 size_t Program::getNumSourceLines() const
 {
   return m_sourceLines.size();
@@ -813,6 +1400,145 @@ unsigned long Program::getUID() const
   return m_uid;
 }
 
+bool Program::loadBuildCache(const string& path, string& log)
+{
+  // Check that files included from disk haven't changed since the build
+  llvm::ErrorOr<unique_ptr<llvm::MemoryBuffer>> includes =
+    llvm::MemoryBuffer::getFile(path + ".deps");
+  if (!includes)
+  {
+    return false;
+  }
+
+  llvm::SmallVector<llvm::StringRef, 8> lines;
+  includes->get()->getBuffer().split(lines, '\n', -1, false);
+  for (llvm::StringRef line : lines)
+  {
+    pair<llvm::StringRef, llvm::StringRef> entry = line.split(' ');
+    if (hashIncludedFile(entry.second.str()) != entry.first)
+    {
+      return false;
+    }
+  }
+
+  llvm::ErrorOr<unique_ptr<llvm::MemoryBuffer>> buffer =
+    llvm::MemoryBuffer::getFile(path + ".bc");
+  if (!buffer)
+  {
+    return false;
+  }
+
+  lock_guard<mutex> lock(m_context->getLLVMContextLock());
+  llvm::Expected<unique_ptr<llvm::Module>> module = parseBitcodeFile(
+    buffer->get()->getMemBufferRef(), *m_context->getLLVMContext());
+  if (!module)
+  {
+    // Fall back to building (and replacing) an unreadable entry
+    llvm::consumeError(module.takeError());
+    return false;
+  }
+  m_module = std::move(module.get());
+
+  // Replay diagnostics from the original build
+  llvm::ErrorOr<unique_ptr<llvm::MemoryBuffer>> logBuffer =
+    llvm::MemoryBuffer::getFile(path + ".log");
+  if (logBuffer)
+  {
+    log = logBuffer->get()->getBuffer().str();
+  }
+
+  return true;
+}
+
+bool Program::moveToSharedContext()
+{
+  // Round-trip the module through bitcode to move it between contexts
+  llvm::SmallVector<char, 0> bitcode;
+  llvm::raw_svector_ostream stream(bitcode);
+  llvm::WriteBitcodeToFile(*m_module, stream);
+  m_module.reset();
+
+  lock_guard<mutex> lock(m_context->getLLVMContextLock());
+  llvm::Expected<unique_ptr<llvm::Module>> module = parseBitcodeFile(
+    llvm::MemoryBufferRef(llvm::StringRef(bitcode.data(), bitcode.size()), ""),
+    *m_context->getLLVMContext());
+  if (!module)
+  {
+    llvm::consumeError(module.takeError());
+    return false;
+  }
+  m_module = std::move(module.get());
+  return true;
+}
+
+void Program::optimizeForInterpreter(llvm::raw_ostream& buildLog)
+{
+  int level = getInterpreterOptLevel();
+  if (!level)
+    return;
+
+  // Keep the original module in case the optimized one can't be simulated
+  unique_ptr<llvm::Module> original = llvm::CloneModule(*m_module);
+  set<string> intrinsics;
+  for (llvm::Function& function : *m_module)
+  {
+    if (function.isIntrinsic())
+      intrinsics.insert(function.getName().str());
+
+    // Size optimization attributes from -Oz would limit inlining/unrolling
+    function.removeFnAttr(llvm::Attribute::MinSize);
+    function.removeFnAttr(llvm::Attribute::OptimizeForSize);
+  }
+
+  // Inline helpers and fully unroll small constant loops, to avoid the cost
+  // of call frames and loop control in every work-item, and at the full level
+  // also eliminate redundant instructions and memory accesses
+  llvm::legacy::PassManager passes;
+  passes.add(llvm::createFunctionInliningPass(INTERPRETER_INLINE_THRESHOLD));
+  if (level > 1)
+  {
+    passes.add(llvm::createSROAPass());
+    passes.add(llvm::createEarlyCSEPass());
+    passes.add(llvm::createInstructionCombiningPass());
+  }
+  passes.add(llvm::createCFGSimplificationPass());
+  passes.add(llvm::createLoopRotatePass());
+  if (level > 1)
+    passes.add(llvm::createLICMPass());
+  passes.add(llvm::createLoopUnrollPass(3, false, false, -1, -1, 0, 0));
+  if (level > 1)
+  {
+    passes.add(llvm::createInstructionCombiningPass());
+    passes.add(llvm::createGVNPass());
+    passes.add(llvm::createDeadCodeEliminationPass());
+  }
+  passes.add(llvm::createCFGSimplificationPass());
+  passes.run(*m_module);
+
+  // Revert if the passes introduced intrinsics the interpreter can't handle
+  for (llvm::Function& function : *m_module)
+  {
+    if (!function.isIntrinsic() || function.use_empty() ||
+        intrinsics.count(function.getName().str()))
+      continue;
+
+    bool handled = false;
+    for (const char* prefix : INTERPRETER_INTRINSICS)
+    {
+      if (function.getName().startswith(prefix))
+        handled = true;
+    }
+    if (!handled)
+    {
+      buildLog << "WARNING: Skipping interpreter optimizations, which produced "
+                  "unsupported intrinsic "
+               << function.getName() << "\n";
+      m_module = std::move(original);
+      return;
+    }
+  }
+}
+
 void Program::pruneDeadCode(llvm::Instruction* instruction)
 {
   // Remove instructions that have no uses
@@ -863,6 +1589,12 @@ void Program::removeLValueLoads()
   }
 }
 
+void Program::resetProgramScopeVars()
+{
+  // Reallocating the variables also reinitializes them
+  allocateProgramScopeVars();
+}
+
 void Program::scalarizeAggregateStore(llvm::StoreInst* store)
 {
   llvm::IntegerType* gepIndexType =
@@ -1092,6 +1824,70 @@ void Program::scalarizeAggregateStore(llvm::StoreInst* store)
   }
 }
 
+void Program::serializeBinary(string& binary) const
+{
+  std::string bitcode;
+  llvm::raw_string_ostream stream(bitcode);
+  llvm::WriteBitcodeToFile(*m_module, stream);
+  stream.str();
+
+  binary = BINARY_MAGIC;
+  writeBinary(binary, (uint32_t)BINARY_VERSION);
+  writeBinary(binary, BINARY_PRODUCER);
+  writeBinary(binary, bitcode);
+
+  // Analyze any kernels that have not been used yet, so that the cost of
+  // doing so is not repeated whenever the binary is loaded
+  list<pair<string, string>> caches;
+  for (auto F = m_module->begin(); F != m_module->end(); F++)
+  {
+    if (F->getCallingConv() != llvm::CallingConv::SPIR_KERNEL)
+      continue;
+
+    try
+    {
+      string cache;
+      createInterpreterCache(&*F)->serialize(cache);
+      caches.push_back(make_pair(F->getName().str(), cache));
+    }
+    catch (FatalError&)
+    {
+      // Leave the error to be reported if the kernel is created
+    }
+  }
+
+  writeBinary(binary, (uint32_t)caches.size());
+  for (auto C = caches.begin(); C != caches.end(); C++)
+  {
+    writeBinary(binary, C->first);
+    writeBinary(binary, C->second);
+  }
+}
+
+void Program::storeBuildCache(const string& path, const string& log,
+                              const vector<string>& includes) const
+{
+  if (llvm::sys::fs::create_directories(llvm::sys::path::parent_path(path)))
+  {
+    return;
+  }
+
+  // Write the log and included files first, since the bitcode marks the
+  // entry as present
+  writeBuildCacheFile(path + ".deps", [&](llvm::raw_ostream& out) {
+    for (const string& include : includes)
+      out << hashIncludedFile(include) << " " << include << "\n";
+  });
+  if (!log.empty())
+  {
+    writeBuildCacheFile(path + ".log",
+                        [&](llvm::raw_ostream& out) { out << log; });
+  }
+  writeBuildCacheFile(path + ".bc", [&](llvm::raw_ostream& out) {
+    llvm::WriteBitcodeToFile(*m_module, out);
+  });
+}
+
 void Program::stripDebugIntrinsics()
 {
   // Get list of llvm.dbg intrinsics
@@ -14,12 +14,14 @@ class Function;
 class LLVMContext;
 class Module;
 class StoreInst;
+class raw_ostream;
 } // namespace llvm
 
 namespace oclgrind
 {
 class Context;
 class InterpreterCache;
+class JITKernel;
 class Kernel;
 
 class Program
@@ -27,6 +29,14 @@ class Program
 public:
   typedef std::pair<std::string, const Program*> Header;
 
+  // Source location of an instruction, taken from its debug information
+  struct SourceLocation
+  {
+    size_t line;
+    size_t column;
+    const std::string* filename;
+  };
+
 public:
   Program(const Context* context, const std::string& source);
   virtual ~Program();
@@ -50,15 +60,25 @@ public:
   const Context* getContext() const;
   const InterpreterCache*
   getInterpreterCache(const llvm::Function* kernel) const;
+  // Native code for a kernel, compiled on first use (NULL if unsupported)
+  const JITKernel* getJITKernel(const llvm::Function* kernel) const;
   std::list<std::string> getKernelNames() const;
   llvm::LLVMContext& getLLVMContext() const;
   unsigned int getNumKernels() const;
+  // Instructions at a line of the source, in program order
+  const std::vector<const llvm::Instruction*>&
+  getLineInstructions(size_t lineNumber) const;
   const std::string& getSource() const;
   const char* getSourceLine(size_t lineNumber) const;
+  // Source location of an instruction (NULL without debug information)
+  const SourceLocation*
+  getSourceLocation(const llvm::Instruction* instruction) const;
   size_t getNumSourceLines() const;
   const TypedValue& getProgramScopeVar(const llvm::Value* var) const;
   size_t getTotalProgramScopeVarSize() const;
   unsigned long getUID() const;
+  // Restore program scope variables to their initial values
+  void resetProgramScopeVars();
 
 private:
   Program(const Context* context, llvm::Module* module);
@@ -67,7 +87,7 @@ private:
   std::string m_source;
   std::string m_buildLog;
   std::string m_buildOptions;
-  unsigned int m_buildStatus;
+  std::atomic<unsigned int> m_buildStatus;
   const Context* m_context;
   std::vector<std::string> m_sourceLines;
 
@@ -78,15 +98,38 @@ private:
   unsigned long generateUID() const;
 
   void allocateProgramScopeVars();
+  InterpreterCache* createInterpreterCache(llvm::Function* kernel) const;
   void deallocateProgramScopeVars();
+  bool loadBuildCache(const std::string& path, std::string& log);
+  bool moveToSharedContext();
+  void storeBuildCache(const std::string& path, const std::string& log,
+                       const std::vector<std::string>& includes) const;
+  void optimizeForInterpreter(llvm::raw_ostream& buildLog);
   void pruneDeadCode(llvm::Instruction*);
   void removeLValueLoads();
   void scalarizeAggregateStore(llvm::StoreInst* store);
+  void serializeBinary(std::string& binary) const;
   void stripDebugIntrinsics();
 
   typedef std::map<const llvm::Function*, InterpreterCache*>
     InterpreterCacheMap;
   mutable InterpreterCacheMap m_interpreterCache;
   void clearInterpreterCache();
+
+  // Source locations of every instruction, and the instructions at each
+  // line, indexed once the module is final (when a kernel is first created)
+  bool m_sourceLocationsBuilt;
+  std::unordered_map<const llvm::Instruction*, SourceLocation>
+    m_sourceLocations;
+  std::unordered_map<size_t, std::vector<const llvm::Instruction*>>
+    m_lineInstructions;
+  std::set<std::string> m_sourceFiles;
+  void buildSourceLocations();
+
+  typedef std::map<const llvm::Function*, JITKernel*> JITKernelMap;
+  mutable JITKernelMap m_jitKernels;
+
+  // Serialized interpreter caches loaded from a binary, keyed by kernel name
+  std::map<std::string, std::string> m_serializedCaches;
 };
 } // namespace oclgrind
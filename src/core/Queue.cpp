@@ -10,27 +10,105 @@
 
 #include <algorithm>
 #include <cassert>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
 
 #include "Context.h"
 #include "KernelInvocation.h"
 #include "Memory.h"
+#include "Plugin.h"
 #include "Queue.h"
 
+#include "plugins/CostModel.h"
+
 using namespace oclgrind;
 using namespace std;
 
-Queue::Queue(const Context* context, bool out_of_order)
-    : m_context(context), m_out_of_order(out_of_order)
+// Host transfers of at least this many bytes are split across workers
+#define PARALLEL_TRANSFER_THRESHOLD (16 << 20)
+
+// Buffer fills store a block of repeated patterns of at most this many bytes
+// at a time
+#define FILL_BLOCK_SIZE (64 << 10)
+
+// Every queue, so that commands waiting for an event from another queue (or
+// a user event) are woken when it changes state, and a condition notified
+// for host threads waiting for events (never destroyed, since queue threads
+// can outlive static destructors when an application doesn't release its
+// queues)
+static mutex& queuesLock = *new mutex;
+static set<Queue*>& queues = *new set<Queue*>;
+static unsigned nextQueueID = 0;
+static mutex& eventLock = *new mutex;
+static condition_variable& eventChanged = *new condition_variable;
+
+// Check whether the rows of a rectangular region are packed back to back,
+// so that the whole region can be transferred as a single span
+static bool isContiguous(const size_t region[3], size_t rowPitch,
+                         size_t slicePitch)
 {
+  if (region[1] > 1 && rowPitch != region[0])
+    return false;
+  if (region[2] > 1 && slicePitch != region[0] * region[1])
+    return false;
+  return true;
 }
 
-Queue::~Queue() {}
+Queue::Queue(const Context* context, bool out_of_order,
+             const StateCallback& callback)
+    : m_context(context), m_out_of_order(out_of_order), m_callback(callback)
+{
+  m_shutdown = false;
+  m_submitting = 0;
+
+  // Out-of-order queues run up to OCLGRIND_MAX_COMMANDS commands at once
+  unsigned numThreads = 1;
+  if (m_out_of_order)
+    numThreads = getEnvInt("OCLGRIND_MAX_COMMANDS", 4, false);
+  {
+    lock_guard<mutex> lock(queuesLock);
+    m_id = nextQueueID++;
+    queues.insert(this);
+  }
+  for (unsigned i = 0; i < numThreads; i++)
+    m_threads.push_back(thread(&Queue::run, this));
+}
+
+Queue::~Queue()
+{
+  {
+    lock_guard<mutex> lock(m_lock);
+    m_shutdown = true;
+  }
+  m_changed.notify_all();
+  for (thread& t : m_threads)
+    t.join();
+
+  lock_guard<mutex> lock(queuesLock);
+  queues.erase(this);
+}
 
 Event::Event()
 {
   state = CL_QUEUED;
   queueTime = now();
-  startTime = endTime = 0;
+  submitTime = startTime = endTime = 0;
+}
+
+void Event::setState(int newState)
+{
+  state = newState;
+  Queue::notifyEventChanged();
+}
+
+void Event::wait() const
+{
+  unique_lock<mutex> lock(eventLock);
+  eventChanged.wait(lock,
+                    [this] { return state == CL_COMPLETE || state < 0; });
 }
 
 Event* Queue::enqueue(Command* cmd)
@@ -39,19 +117,35 @@ Event* Queue::enqueue(Command* cmd)
   cmd->event = event;
   event->command = cmd;
   event->queue = this;
-  m_queue.push_back(cmd);
+  {
+    lock_guard<mutex> lock(m_lock);
+    m_queue.push_back(cmd);
+  }
+  m_changed.notify_all();
   return event;
 }
 
 void Queue::executeCopyBuffer(CopyCommand* cmd)
 {
-  m_context->getGlobalMemory()->copy(cmd->dst, cmd->src, cmd->size);
+  Memory* memory = m_context->getGlobalMemory();
+  bool observed = m_context->hasSubscribers(CallbackMemoryLoad) ||
+                  m_context->hasSubscribers(CallbackMemoryStore);
+  splitTransfer(cmd->size, observed, [&](size_t offset, size_t size) {
+    memory->copy(cmd->dst + offset, cmd->src + offset, size);
+  });
 }
 
 void Queue::executeCopyBufferRect(CopyRectCommand* cmd)
 {
   // Perform copy
   Memory* memory = m_context->getGlobalMemory();
+  if (isContiguous(cmd->region, cmd->src_offset[1], cmd->src_offset[2]) &&
+      isContiguous(cmd->region, cmd->dst_offset[1], cmd->dst_offset[2]))
+  {
+    memory->copy(cmd->dst + cmd->dst_offset[0], cmd->src + cmd->src_offset[0],
+                 cmd->region[0] * cmd->region[1] * cmd->region[2]);
+    return;
+  }
   for (unsigned z = 0; z < cmd->region[2]; z++)
   {
     for (unsigned y = 0; y < cmd->region[1]; y++)
@@ -70,29 +164,55 @@ void Queue::executeCopyBufferRect(CopyRectCommand* cmd)
 
 void Queue::executeFillBuffer(FillBufferCommand* cmd)
 {
-  Memory* memory = m_context->getGlobalMemory();
-  for (unsigned i = 0; i < cmd->size / cmd->pattern_size; i++)
+  // Expand pattern into a block by repeatedly doubling the filled prefix
+  size_t size = (cmd->size / cmd->pattern_size) * cmd->pattern_size;
+  size_t blockSize = max(FILL_BLOCK_SIZE / cmd->pattern_size, (size_t)1) *
+                     cmd->pattern_size;
+  vector<unsigned char> block(min(size, blockSize));
+  size_t filled = min(block.size(), (size_t)cmd->pattern_size);
+  memcpy(block.data(), cmd->pattern, filled);
+  while (filled < block.size())
   {
-    memory->store(cmd->pattern, cmd->address + i * cmd->pattern_size,
-                  cmd->pattern_size);
+    size_t count = min(filled, block.size() - filled);
+    memcpy(block.data() + filled, block.data(), count);
+    filled += count;
   }
+
+  // Store the block repeatedly, starting each part of a split range at the
+  // matching offset within it
+  Memory* memory = m_context->getGlobalMemory();
+  bool observed = m_context->hasSubscribers(CallbackMemoryStore);
+  splitTransfer(size, observed, [&](size_t offset, size_t size) {
+    for (size_t end = offset + size; offset < end;)
+    {
+      size_t start = offset % block.size();
+      size_t count = min(block.size() - start, end - offset);
+      memory->store(block.data() + start, cmd->address + offset, count);
+      offset += count;
+    }
+  });
 }
 
 void Queue::executeFillImage(FillImageCommand* cmd)
 {
   Memory* memory = m_context->getGlobalMemory();
 
+  // Expand color across one row of the region
+  size_t rowSize = cmd->region[0] * cmd->pixelSize;
+  vector<unsigned char> row(rowSize);
+  for (size_t x = 0; x < cmd->region[0]; x++)
+  {
+    memcpy(row.data() + x * cmd->pixelSize, cmd->color, cmd->pixelSize);
+  }
+
   for (unsigned z = 0; z < cmd->region[2]; z++)
   {
     for (unsigned y = 0; y < cmd->region[1]; y++)
     {
-      for (unsigned x = 0; x < cmd->region[0]; x++)
-      {
-        size_t address = cmd->base + (cmd->origin[0] + x) * cmd->pixelSize +
-                         (cmd->origin[1] + y) * cmd->rowPitch +
-                         (cmd->origin[2] + z) * cmd->slicePitch;
-        memory->store(cmd->color, address, cmd->pixelSize);
-      }
+      size_t address = cmd->base + cmd->origin[0] * cmd->pixelSize +
+                       (cmd->origin[1] + y) * cmd->rowPitch +
+                       (cmd->origin[2] + z) * cmd->slicePitch;
+      memory->store(row.data(), address, rowSize);
     }
   }
 }
@@ -118,12 +238,24 @@ void Queue::executeNativeKernel(NativeKernelCommand* cmd)
 
 void Queue::executeReadBuffer(BufferCommand* cmd)
 {
-  m_context->getGlobalMemory()->load(cmd->ptr, cmd->address, cmd->size);
+  Memory* memory = m_context->getGlobalMemory();
+  bool observed = m_context->hasSubscribers(CallbackMemoryLoad);
+  splitTransfer(cmd->size, observed, [&](size_t offset, size_t size) {
+    memory->load(cmd->ptr + offset, cmd->address + offset, size);
+  });
 }
 
 void Queue::executeReadBufferRect(BufferRectCommand* cmd)
 {
   Memory* memory = m_context->getGlobalMemory();
+  if (isContiguous(cmd->region, cmd->host_offset[1], cmd->host_offset[2]) &&
+      isContiguous(cmd->region, cmd->buffer_offset[1], cmd->buffer_offset[2]))
+  {
+    memory->load(cmd->ptr + cmd->host_offset[0],
+                 cmd->address + cmd->buffer_offset[0],
+                 cmd->region[0] * cmd->region[1] * cmd->region[2]);
+    return;
+  }
   for (unsigned z = 0; z < cmd->region[2]; z++)
   {
     for (unsigned y = 0; y < cmd->region[1]; y++)
@@ -145,13 +277,25 @@ void Queue::executeUnmap(UnmapCommand* cmd)
 
 void Queue::executeWriteBuffer(BufferCommand* cmd)
 {
-  m_context->getGlobalMemory()->store(cmd->ptr, cmd->address, cmd->size);
+  Memory* memory = m_context->getGlobalMemory();
+  bool observed = m_context->hasSubscribers(CallbackMemoryStore);
+  splitTransfer(cmd->size, observed, [&](size_t offset, size_t size) {
+    memory->store(cmd->ptr + offset, cmd->address + offset, size);
+  });
 }
 
 void Queue::executeWriteBufferRect(BufferRectCommand* cmd)
 {
   // Perform write
   Memory* memory = m_context->getGlobalMemory();
+  if (isContiguous(cmd->region, cmd->host_offset[1], cmd->host_offset[2]) &&
+      isContiguous(cmd->region, cmd->buffer_offset[1], cmd->buffer_offset[2]))
+  {
+    memory->store(cmd->ptr + cmd->host_offset[0],
+                  cmd->address + cmd->buffer_offset[0],
+                  cmd->region[0] * cmd->region[1] * cmd->region[2]);
+    return;
+  }
   for (unsigned z = 0; z < cmd->region[2]; z++)
   {
     for (unsigned y = 0; y < cmd->region[1]; y++)
@@ -166,57 +310,88 @@ void Queue::executeWriteBufferRect(BufferRectCommand* cmd)
   }
 }
 
+void Queue::splitTransfer(size_t size, bool observed,
+                          const function<void(size_t, size_t)>& transfer)
+{
+  // Plugins expect a command's host accesses on the thread running it
+  observed = observed ||
+             m_context->hasSubscribers(CallbackHostMemoryLoad) ||
+             m_context->hasSubscribers(CallbackHostMemoryStore) ||
+             m_context->hasSubscribers(CallbackHostMemoryTransfer);
+
+  unsigned numWorkers = m_context->getNumWorkers();
+  if (observed || size < PARALLEL_TRANSFER_THRESHOLD || numWorkers < 2)
+  {
+    transfer(0, size);
+    return;
+  }
+
+  // Give each worker an equal share, rounded up to a multiple of 64 bytes
+  size_t chunk = ((size / numWorkers) + 63) & ~(size_t)63;
+  m_context->runWorkers(numWorkers, [&](unsigned id) {
+    size_t offset = id * chunk;
+    if (offset < size)
+      transfer(offset, min(chunk, size - offset));
+  });
+}
+
+map<unsigned, size_t> Queue::getQueueDepths(const Context* context)
+{
+  map<unsigned, size_t> depths;
+  lock_guard<mutex> lock(queuesLock);
+  for (Queue* queue : queues)
+  {
+    if (queue->m_context != context)
+      continue;
+    lock_guard<mutex> queueLock(queue->m_lock);
+    depths[queue->m_id] = queue->m_queue.size();
+  }
+  return depths;
+}
+
 bool Queue::isEmpty() const
 {
+  lock_guard<mutex> lock(m_lock);
   return m_queue.empty();
 }
 
-void Queue::execute(Command* command, bool flush)
+bool Queue::isSerialized() const
 {
-  // Find command in queue
-  auto it = std::find(m_queue.begin(), m_queue.end(), command);
+  if (!m_context->isThreadSafe())
+    return true;
+
+  // Plugins that observe host accesses expect them one at a time, and not
+  // alongside the accesses made by a kernel
+  return m_context->hasSubscribers(CallbackHostMemoryLoad) ||
+         m_context->hasSubscribers(CallbackHostMemoryStore) ||
+         m_context->hasSubscribers(CallbackHostMemoryTransfer);
+}
 
-  // If there is a previous (older) command in the queue AND either the queue
-  // is not out of order OR needs to be flushed, then add event associated with
-  // previous (older) command as a dependency
-  if (it != m_queue.begin() && (!m_out_of_order || flush))
+void Queue::execute(Command* command)
+{
+  // Native kernels are host code that may call back into the API, so they
+  // run without holding any device locks
+  if (command->type == Command::NATIVE_KERNEL)
   {
-    command->waitList.push_back((*std::prev(it))->event);
+    executeNativeKernel((NativeKernelCommand*)command);
+    if (m_context->getCostModel())
+      m_context->getCostModel()->commandExecuted(command, command->event);
+    return;
   }
 
-  // Make sure all events in the wait list are complete before executing
-  // current command
-  while (!command->waitList.empty())
-  {
-    Event* evt = command->waitList.front();
-    command->waitList.pop_front();
+  // Commands from every queue share the simulated device, while the host
+  // waits for them before changing the buffers allocated in global memory
+  shared_lock<shared_timed_mutex> deviceLock(m_context->getDeviceLock());
 
-    if (evt->state < 0)
-    {
-      command->event->state = evt->state;
-      m_queue.erase(it);
-      return;
-    }
-    else if (evt->state != CL_COMPLETE)
-    {
-      if (evt->command)
-      {
-        // If it's not a user event, execute the associated command
-        evt->queue->execute(evt->command, flush);
-        command->execBefore.push_front(evt->command);
-      }
-      else
-      {
-        // If it's a user event then place it back at the of the wait list, and
-        // check it later
-        command->waitList.push_back(evt);
-      }
-    }
-  }
+  // Kernel invocations are tracked per context, so only one kernel runs at
+  // a time (transfers run alongside it unless commands are serialized)
+  unique_lock<mutex> kernelLock(m_context->getKernelLock(), defer_lock);
+  if (command->type == Command::KERNEL || isSerialized())
+    kernelLock.lock();
 
-  // Dispatch command
-  command->event->startTime = now();
-  command->event->state = CL_RUNNING;
+  // Plugins see the host accesses made by the command as one transfer
+  HostTransfer transfer;
+  m_context->beginHostTransfer(&transfer);
 
   switch (command->type)
   {
@@ -246,9 +421,6 @@ void Queue::execute(Command* command, bool flush)
   case Command::MAP:
     executeMap((MapCommand*)command);
     break;
-  case Command::NATIVE_KERNEL:
-    executeNativeKernel((NativeKernelCommand*)command);
-    break;
   case Command::UNMAP:
     executeUnmap((UnmapCommand*)command);
     break;
@@ -261,25 +433,139 @@ void Queue::execute(Command* command, bool flush)
   default:
     assert(false && "Unhandled command type in queue.");
   }
+  m_context->endHostTransfer();
 
-  command->event->endTime = now();
-  command->event->state = CL_COMPLETE;
+  // Cost the command while no other kernel can run
+  if (m_context->getCostModel())
+    m_context->getCostModel()->commandExecuted(command, command->event);
+}
 
-  // Remove command from its queue
-  m_queue.erase(it);
+void Queue::finish()
+{
+  unique_lock<mutex> lock(m_lock);
+  m_changed.wait(lock, [this] { return m_queue.empty(); });
 }
 
-Command* Queue::finish()
+int Queue::getWaitState(const Command* command) const
 {
-  if (m_queue.empty())
+  // Returns CL_COMPLETE when every event in the wait list has completed, or
+  // the error state of an event that terminated abnormally
+  int state = CL_COMPLETE;
+  for (const Event* event : command->waitList)
   {
-    return NULL;
+    if (event->state < 0)
+      return event->state;
+    else if (event->state != CL_COMPLETE)
+      state = event->state;
   }
+  return state;
+}
 
-  // Get most recent command in queue and execute it, triggering the execution
-  // of all previous commands even if it's an out-of-order queue
-  Command* cmd = m_queue.back();
-  execute(cmd, true);
+void Queue::notifyEventChanged()
+{
+  {
+    lock_guard<mutex> lock(eventLock);
+  }
+  eventChanged.notify_all();
 
-  return cmd;
+  lock_guard<mutex> lock(queuesLock);
+  for (Queue* queue : queues)
+    queue->wake();
+}
+
+void Queue::run()
+{
+  unique_lock<mutex> lock(m_lock);
+  while (true)
+  {
+    // Submit newly enqueued commands to the device
+    list<Command*> submitted;
+    for (Command* command : m_queue)
+    {
+      if (command->event->state == CL_QUEUED)
+      {
+        command->event->submitTime = now();
+        command->event->state = CL_SUBMITTED;
+        submitted.push_back(command);
+      }
+    }
+    if (!submitted.empty())
+    {
+      m_submitting++;
+      lock.unlock();
+      for (Command* command : submitted)
+        m_callback(command, CL_SUBMITTED);
+      lock.lock();
+      m_submitting--;
+      m_changed.notify_all();
+    }
+
+    // Commands can't run until their submit callbacks have been made
+    if (m_submitting)
+    {
+      m_changed.wait(lock);
+      continue;
+    }
+
+    // Find the oldest command whose dependencies are satisfied, which must
+    // also be the oldest command overall for in-order queues (skipping any
+    // that other threads of an out-of-order queue have already taken)
+    auto it = m_queue.begin();
+    int state = CL_QUEUED;
+    for (; it != m_queue.end(); it++)
+    {
+      if ((*it)->event->state != CL_SUBMITTED)
+      {
+        state = CL_QUEUED;
+        if (!m_out_of_order)
+          break;
+        continue;
+      }
+      state = getWaitState(*it);
+      if (state <= CL_COMPLETE || !m_out_of_order)
+        break;
+    }
+    if (it == m_queue.end() || state > CL_COMPLETE)
+    {
+      if (m_shutdown && m_queue.empty())
+        break;
+      m_changed.wait(lock);
+      continue;
+    }
+
+    // Commands that depend on a failed event fail with the same state
+    Command* command = *it;
+    if (state == CL_COMPLETE)
+    {
+      command->event->startTime = now();
+      command->event->state = CL_RUNNING;
+      lock.unlock();
+      m_callback(command, CL_RUNNING);
+
+      execute(command);
+
+      lock.lock();
+      if (!m_context->getCostModel())
+        command->event->endTime = now();
+    }
+    command->event->state = state;
+    lock.unlock();
+    notifyEventChanged();
+
+    // Keep the command queued until its callback has been made, so that
+    // finish() waits for the command to be released
+    m_callback(command, state);
+    lock.lock();
+    m_queue.erase(it);
+    m_changed.notify_all();
+  }
+}
+
+void Queue::wake()
+{
+  // Taking the lock ensures that a thread about to wait sees the change
+  {
+    lock_guard<mutex> lock(m_lock);
+  }
+  m_changed.notify_all();
 }
@@ -9,6 +9,11 @@
 #pragma once
 #include "common.h"
 
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+
 namespace oclgrind
 {
 class Context;
@@ -18,11 +23,16 @@ struct Command;
 
 struct Event
 {
-  int state;
-  double queueTime, startTime, endTime;
+  std::atomic<int> state;
+  double queueTime, submitTime, startTime, endTime;
   Command* command;
   Queue* queue;
   Event();
+
+  // Change the state of a user event, waking any commands waiting for it
+  void setState(int newState);
+  // Block until the event has completed or terminated with an error
+  void wait() const;
 };
 
 struct Command
@@ -46,10 +56,22 @@ struct Command
 
   CommandType type;
   std::list<Event*> waitList;
-  std::list<Command*> execBefore;
+
+  // Objects retained by the runtime API until the command has finished
+  struct Retained
+  {
+    cl_event event;
+    cl_kernel kernel;
+    std::shared_ptr<const void> kernelMemArgs;
+    std::vector<cl_mem> memObjects;
+    std::vector<cl_event> waitList;
+  } retained;
+
   Command()
   {
     type = EMPTY;
+    retained.event = NULL;
+    retained.kernel = NULL;
   }
   virtual ~Command() {}
 
@@ -202,11 +224,16 @@ struct UnmapCommand : Command
 class Queue
 {
 public:
-  Queue(const Context* context, const bool out_of_order);
+  // Called from the queue's thread each time the event of a command changes
+  // state, after which the queue no longer uses a command that has completed
+  // or terminated with an error
+  typedef std::function<void(Command*, int)> StateCallback;
+
+  Queue(const Context* context, const bool out_of_order,
+        const StateCallback& callback);
   virtual ~Queue();
 
   Event* enqueue(Command* command);
-  void execute(Command* command, bool flush);
 
   void executeCopyBuffer(CopyCommand* cmd);
   void executeCopyBufferRect(CopyRectCommand* cmd);
@@ -221,12 +248,42 @@ public:
   void executeWriteBuffer(BufferCommand* cmd);
   void executeWriteBufferRect(BufferRectCommand* cmd);
 
+  // Number of commands enqueued and not yet released by each queue of a
+  // context, keyed by the order in which the queues were created
+  static std::map<unsigned, size_t> getQueueDepths(const Context* context);
   bool isEmpty() const;
-  Command* finish();
+  // Block until every enqueued command has completed or terminated
+  void finish();
 
 private:
   const Context* m_context;
   const bool m_out_of_order;
+  unsigned m_id;
   std::list<Command*> m_queue;
+  friend struct Event;
+
+  // Guards the commands of the queue, and is notified when they change or
+  // when any event changes state
+  mutable std::mutex m_lock;
+  std::condition_variable m_changed;
+  void wake();
+  static void notifyEventChanged();
+
+  // Commands run on threads owned by the queue as soon as their
+  // dependencies are satisfied (out-of-order queues have several threads,
+  // so that independent commands can run concurrently)
+  StateCallback m_callback;
+  std::vector<std::thread> m_threads;
+  bool m_shutdown;
+  unsigned m_submitting; // Threads making submit callbacks
+  void execute(Command* command);
+  int getWaitState(const Command* command) const;
+  bool isSerialized() const;
+  void run();
+
+  // Run transfer(offset, size) over [0, size), split across the worker
+  // pool when the range is large and no plugin observes the accesses
+  void splitTransfer(size_t size, bool observed,
+                     const std::function<void(size_t, size_t)>& transfer);
 };
 } // namespace oclgrind
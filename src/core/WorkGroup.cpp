@@ -9,6 +9,9 @@
 #include "common.h"
 
 #include <sstream>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
 
 #include "llvm/IR/Module.h"
 
@@ -16,12 +19,44 @@
 #include "Kernel.h"
 #include "KernelInvocation.h"
 #include "Memory.h"
+#include "Program.h"
 #include "WorkGroup.h"
 #include "WorkItem.h"
 
 using namespace oclgrind;
 using namespace std;
 
+// Get the index of the lowest set bit in a non-zero word
+static inline unsigned findFirstSet(uint64_t word)
+{
+#if defined(_MSC_VER)
+  unsigned long index;
+  _BitScanForward64(&index, word);
+  return index;
+#else
+  return __builtin_ctzll(word);
+#endif
+}
+
+// Copy data between memories, loading straight into the destination when it
+// is valid so that storing it only notifies plugins
+static void transfer(Memory* destMem, size_t dest, const Memory* srcMem,
+                     size_t src, size_t size, vector<unsigned char>& scratch)
+{
+  unsigned char* data;
+  if (destMem->isAddressValid(dest, size))
+  {
+    data = (unsigned char*)destMem->getPointer(dest);
+  }
+  else
+  {
+    scratch.resize(size);
+    data = scratch.data();
+  }
+  srcMem->load(data, src, size);
+  destMem->store(data, dest, size);
+}
+
 WorkGroup::WorkGroup(const KernelInvocation* kernelInvocation, Size3 wgid)
     : WorkGroup(kernelInvocation, wgid, kernelInvocation->getLocalSize())
 {
@@ -29,7 +64,8 @@ WorkGroup::WorkGroup(const KernelInvocation* kernelInvocation, Size3 wgid)
 
 WorkGroup::WorkGroup(const KernelInvocation* kernelInvocation, Size3 wgid,
                      Size3 size)
-    : m_context(kernelInvocation->getContext())
+    : m_context(kernelInvocation->getContext()),
+      m_kernelInvocation(kernelInvocation)
 {
   m_groupID = wgid;
   m_groupSize = size;
@@ -54,6 +90,14 @@ WorkGroup::WorkGroup(const KernelInvocation* kernelInvocation, Size3 wgid,
     }
   }
 
+  // Work-items executing in lockstep share a structure-of-arrays register
+  // file, with one lane for each of them
+  const InterpreterCache* cache =
+    kernel->getProgram()->getInterpreterCache(kernel->getFunction());
+  size_t numLanes = m_groupSize.x * m_groupSize.y * m_groupSize.z;
+  if (kernelInvocation->isLockstep() && numLanes > 1)
+    m_laneRegisters.resize(cache->getFrameSize() * numLanes);
+
   // Initialise work-items
   for (size_t k = 0; k < m_groupSize.z; k++)
   {
@@ -61,16 +105,32 @@ WorkGroup::WorkGroup(const KernelInvocation* kernelInvocation, Size3 wgid,
     {
       for (size_t i = 0; i < m_groupSize.x; i++)
       {
-        WorkItem* workItem =
-          new WorkItem(kernelInvocation, this, Size3(i, j, k));
+        WorkItem* workItem;
+        if (m_laneRegisters.empty())
+        {
+          workItem = new WorkItem(kernelInvocation, this, Size3(i, j, k));
+        }
+        else
+        {
+          workItem =
+            new WorkItem(kernelInvocation, this, Size3(i, j, k),
+                         m_laneRegisters.data(), m_workItems.size(), numLanes);
+        }
         m_workItems.push_back(workItem);
-        m_running.insert(workItem);
       }
     }
   }
+  m_numAsyncCopies.resize(m_workItems.size());
+  m_ready.resize((m_workItems.size() + 63) / 64);
+  m_atBarrier.resize(m_ready.size());
+  setAllReady();
 
   m_nextEvent = 1;
   m_barrier = NULL;
+
+  m_uniformValues =
+    cache->getNumUniformValues() ? new UniformValues(cache) : NULL;
+  m_shareUniforms = false;
 }
 
 WorkGroup::~WorkGroup()
@@ -82,6 +142,7 @@ WorkGroup::~WorkGroup()
   }
 
   delete m_localMemory;
+  delete m_uniformValues;
 }
 
 size_t WorkGroup::async_copy(const WorkItem* workItem,
@@ -90,28 +151,23 @@ size_t WorkGroup::async_copy(const WorkItem* workItem,
                              size_t size, size_t num, size_t srcStride,
                              size_t destStride, size_t event)
 {
-  AsyncCopy copy = {instruction, type, dest,      src,
-                    size,        num,  srcStride, destStride,
-
-                    event};
+  AsyncCopy copy = {instruction, type, dest,      src,   size,
+                    num,         srcStride, destStride, event, 1};
 
-  // Check if copy has already been registered by another work-item
-  list<pair<AsyncCopy, set<const WorkItem*>>>::iterator itr;
-  for (itr = m_asyncCopies.begin(); itr != m_asyncCopies.end(); itr++)
+  // Each work-item's n-th copy matches the n-th copy registered by the
+  // work-group, if another work-item has already registered it
+  size_t& registered = m_numAsyncCopies[getLocalIndex(workItem)];
+  if (registered < m_asyncCopies.size())
   {
-    if (itr->second.count(workItem))
-    {
-      continue;
-    }
+    AsyncCopy& previous = m_asyncCopies[registered++];
 
     // Check for divergence
-    if ((itr->first.instruction->getDebugLoc() !=
+    if ((previous.instruction->getDebugLoc() !=
          copy.instruction->getDebugLoc()) ||
-        (itr->first.type != copy.type) || (itr->first.dest != copy.dest) ||
-        (itr->first.src != copy.src) || (itr->first.size != copy.size) ||
-        (itr->first.num != copy.num) ||
-        (itr->first.srcStride != copy.srcStride) ||
-        (itr->first.destStride != copy.destStride))
+        (previous.type != copy.type) || (previous.dest != copy.dest) ||
+        (previous.src != copy.src) || (previous.size != copy.size) ||
+        (previous.num != copy.num) || (previous.srcStride != copy.srcStride) ||
+        (previous.destStride != copy.destStride))
     {
       Context::Message msg(ERROR, m_context);
       msg << "Work-group divergence detected (async copy)" << endl
@@ -128,19 +184,20 @@ size_t WorkGroup::async_copy(const WorkItem* workItem,
           << "dest_stride=" << dec << copy.destStride << endl
           << endl
           << "Previous work-items executed:" << endl
-          << itr->first.instruction << endl
-          << "dest=0x" << hex << itr->first.dest << ", "
-          << "src=0x" << hex << itr->first.src << endl
-          << "elem_size=" << dec << itr->first.size << ", "
-          << "num_elems=" << dec << itr->first.num << ", "
-          << "src_stride=" << dec << itr->first.srcStride << ", "
-          << "dest_stride=" << dec << itr->first.destStride << endl;
+          << previous.instruction << endl
+          << "dest=0x" << hex << previous.dest << ", "
+          << "src=0x" << hex << previous.src << endl
+          << "elem_size=" << dec << previous.size << ", "
+          << "num_elems=" << dec << previous.num << ", "
+          << "src_stride=" << dec << previous.srcStride << ", "
+          << "dest_stride=" << dec << previous.destStride << endl;
       msg.send();
     }
 
-    itr->second.insert(workItem);
-    return itr->first.event;
+    previous.numWorkItems++;
+    return previous.event;
   }
+  registered++;
 
   // Create new event if necessary
   if (copy.event == 0)
@@ -149,12 +206,7 @@ size_t WorkGroup::async_copy(const WorkItem* workItem,
   }
 
   // Register new copy and event
-  m_asyncCopies.push_back(make_pair(copy, set<const WorkItem*>()));
-  m_asyncCopies.back().second.insert(workItem);
-  if (!m_events.count(event))
-  {
-    m_events[copy.event] = list<AsyncCopy>();
-  }
+  m_asyncCopies.push_back(copy);
   m_events[copy.event].push_back(copy);
 
   return copy.event;
@@ -165,36 +217,44 @@ void WorkGroup::clearBarrier()
   assert(m_barrier);
 
   // Check for divergence
-  if (m_barrier->workItems.size() != m_workItems.size())
+  if (m_barrier->numWorkItems != m_workItems.size())
   {
     Context::Message msg(ERROR, m_context);
     msg << "Work-group divergence detected (barrier)" << endl
         << msg.INDENT << "Kernel:     " << msg.CURRENT_KERNEL << endl
         << "Work-group: " << msg.CURRENT_WORK_GROUP << endl
-        << "Only " << dec << m_barrier->workItems.size() << " out of "
+        << "Only " << dec << m_barrier->numWorkItems << " out of "
         << m_workItems.size() << " work-items executed barrier" << endl
         << m_barrier->instruction << endl;
     msg.send();
   }
 
   // Move work-items to running state
-  set<WorkItem*>::iterator itr;
-  for (itr = m_barrier->workItems.begin(); itr != m_barrier->workItems.end();
-       itr++)
+  m_firstReady = m_ready.size();
+  for (size_t w = 0; w < m_atBarrier.size(); w++)
   {
-    (*itr)->clearBarrier();
-    m_running.insert(*itr);
+    for (uint64_t bits = m_atBarrier[w]; bits; bits &= bits - 1)
+    {
+      m_workItems[w * 64 + findFirstSet(bits)]->clearBarrier();
+    }
+    m_ready[w] |= m_atBarrier[w];
+    m_atBarrier[w] = 0;
+    if (m_ready[w] && m_firstReady == m_ready.size())
+    {
+      m_firstReady = w;
+    }
   }
-  m_barrier->workItems.clear();
+  m_numReady += m_barrier->numWorkItems;
 
   // Deal with events
+  vector<unsigned char> scratch;
   while (!m_barrier->events.empty())
   {
     size_t event = m_barrier->events.front();
 
     // Perform copy
-    list<AsyncCopy> copies = m_events[event];
-    list<AsyncCopy>::iterator itr;
+    const list<AsyncCopy>& copies = m_events[event];
+    list<AsyncCopy>::const_iterator itr;
     for (itr = copies.begin(); itr != copies.end(); itr++)
     {
       Memory *destMem, *srcMem;
@@ -209,53 +269,56 @@ void WorkGroup::clearBarrier()
         srcMem = m_localMemory;
       }
 
+      // Contiguous copies are made as a single transfer when they are in
+      // bounds, and other copies transfer each element directly
+      size_t size = itr->size;
+      size_t num = itr->num;
+      if (itr->srcStride == 1 && itr->destStride == 1 &&
+          srcMem->isAddressValid(itr->src, size * num) &&
+          destMem->isAddressValid(itr->dest, size * num))
+      {
+        size *= num;
+        num = 1;
+      }
       size_t src = itr->src;
       size_t dest = itr->dest;
-      unsigned char* buffer = new unsigned char[itr->size];
-      for (unsigned i = 0; i < itr->num; i++)
+      for (size_t i = 0; i < num; i++)
       {
-        srcMem->load(buffer, src, itr->size);
-        destMem->store(buffer, dest, itr->size);
+        transfer(destMem, dest, srcMem, src, size, scratch);
         src += itr->srcStride * itr->size;
         dest += itr->destStride * itr->size;
       }
-      delete[] buffer;
     }
     m_events.erase(event);
 
-    // Remove copies from list for this event
-    list<pair<AsyncCopy, set<const WorkItem*>>>::iterator cItr;
-    for (cItr = m_asyncCopies.begin(); cItr != m_asyncCopies.end();)
+    // Check that all work-items registered the copies for this event
+    for (const AsyncCopy& copy : m_asyncCopies)
     {
-      if (cItr->first.event == event)
+      if (copy.event == event && copy.numWorkItems != m_workItems.size())
       {
-        // Check that all work-items registered the copy
-        if (cItr->second.size() != m_workItems.size())
-        {
-          Context::Message msg(ERROR, m_context);
-          msg << "Work-group divergence detected (async copy)" << endl
-              << msg.INDENT << "Kernel:     " << msg.CURRENT_KERNEL << endl
-              << "Work-group: " << msg.CURRENT_WORK_GROUP << endl
-              << "Only " << dec << cItr->second.size() << " out of "
-              << m_workItems.size() << " work-items executed copy" << endl
-              << cItr->first.instruction << endl;
-          msg.send();
-        }
-
-        cItr = m_asyncCopies.erase(cItr);
-      }
-      else
-      {
-        cItr++;
+        Context::Message msg(ERROR, m_context);
+        msg << "Work-group divergence detected (async copy)" << endl
+            << msg.INDENT << "Kernel:     " << msg.CURRENT_KERNEL << endl
+            << "Work-group: " << msg.CURRENT_WORK_GROUP << endl
+            << "Only " << dec << copy.numWorkItems << " out of "
+            << m_workItems.size() << " work-items executed copy" << endl
+            << copy.instruction << endl;
+        msg.send();
       }
     }
 
     m_barrier->events.remove(event);
   }
 
+  // Once every copy has completed, work-items start matching copies afresh
+  if (m_events.empty() && !m_asyncCopies.empty())
+  {
+    m_asyncCopies.clear();
+    m_numAsyncCopies.assign(m_workItems.size(), 0);
+  }
+
   m_context->notifyWorkGroupBarrier(this, m_barrier->fence);
 
-  delete m_barrier;
   m_barrier = NULL;
 }
 
@@ -284,6 +347,12 @@ Memory* WorkGroup::getLocalMemory() const
   return m_localMemory;
 }
 
+size_t WorkGroup::getLocalIndex(const WorkItem* workItem) const
+{
+  Size3 localID = workItem->getLocalID();
+  return localID.x + (localID.y + localID.z * m_groupSize.y) * m_groupSize.x;
+}
+
 size_t WorkGroup::getLocalMemoryAddress(const llvm::Value* value) const
 {
   return m_localAddresses.at(value);
@@ -291,11 +360,24 @@ size_t WorkGroup::getLocalMemoryAddress(const llvm::Value* value) const
 
 WorkItem* WorkGroup::getNextWorkItem() const
 {
-  if (m_running.empty())
+  if (!m_numReady)
   {
     return NULL;
   }
-  return *m_running.begin();
+  return m_workItems[m_firstReady * 64 + findFirstSet(m_ready[m_firstReady])];
+}
+
+MemoryPool* WorkGroup::getScratchPool()
+{
+  return &m_scratchPool;
+}
+
+UniformValues* WorkGroup::getUniformValues(bool kernelUniform) const
+{
+  if (!m_shareUniforms)
+    return NULL;
+  return kernelUniform ? m_kernelInvocation->getUniformValues()
+                       : m_uniformValues;
 }
 
 WorkItem* WorkGroup::getWorkItem(Size3 localID) const
@@ -304,26 +386,71 @@ WorkItem* WorkGroup::getWorkItem(Size3 localID) const
                      (localID.y + localID.z * m_groupSize.y) * m_groupSize.x];
 }
 
+const vector<WorkItem*>& WorkGroup::getWorkItems() const
+{
+  return m_workItems;
+}
+
 bool WorkGroup::hasBarrier() const
 {
   return m_barrier;
 }
 
+void WorkGroup::reset(Size3 wgid)
+{
+  assert(!m_numReady && !m_barrier);
+
+  m_groupID = wgid;
+  m_groupIndex =
+    (m_groupID.x +
+     (m_groupID.y + m_groupID.z * (m_kernelInvocation->getNumGroups().y) *
+                      m_kernelInvocation->getNumGroups().x));
+
+  // Reuse local memory allocations, which keep the same addresses
+  m_localMemory->reset();
+
+  m_nextEvent = 1;
+  m_asyncCopies.clear();
+  m_numAsyncCopies.assign(m_workItems.size(), 0);
+  m_events.clear();
+  m_scratchPool.clear();
+  if (m_uniformValues)
+    m_uniformValues->clear();
+
+  // Restart work-items for new work-group
+  for (auto itr = m_workItems.begin(); itr != m_workItems.end(); itr++)
+  {
+    (*itr)->reset();
+  }
+  setAllReady();
+}
+
 void WorkGroup::notifyBarrier(WorkItem* workItem,
                               const llvm::Instruction* instruction,
-                              uint64_t fence, list<size_t> events)
+                              uint64_t fence, const list<size_t>& events)
 {
+  // A lone work-item passes straight through barriers that don't wait for
+  // copies, unless a plugin observes them
+  if (m_workItems.size() == 1 && events.empty() && m_asyncCopies.empty() &&
+      !m_context->hasSubscribers(CallbackWorkGroupBarrier) &&
+      !m_context->hasSubscribers(CallbackWorkItemClearBarrier))
+  {
+    workItem->clearBarrier();
+    return;
+  }
+
   if (!m_barrier)
   {
     // Create new barrier
-    m_barrier = new Barrier;
+    m_barrier = &m_barrierStorage;
     m_barrier->instruction = instruction;
+    m_barrier->numWorkItems = 0;
     m_barrier->fence = fence;
 
     m_barrier->events = events;
 
     // Check for invalid events
-    list<size_t>::iterator itr;
+    list<size_t>::const_iterator itr;
     for (itr = events.begin(); itr != events.end(); itr++)
     {
       if (!m_events.count(*itr))
@@ -336,7 +463,8 @@ void WorkGroup::notifyBarrier(WorkItem* workItem,
   {
     // Check for divergence
     bool divergence = false;
-    if (instruction->getDebugLoc() != m_barrier->instruction->getDebugLoc() ||
+    if ((instruction != m_barrier->instruction &&
+         instruction->getDebugLoc() != m_barrier->instruction->getDebugLoc()) ||
         fence != m_barrier->fence || events.size() != m_barrier->events.size())
     {
       divergence = true;
@@ -349,7 +477,7 @@ void WorkGroup::notifyBarrier(WorkItem* workItem,
     if (!divergence)
     {
       int i = 0;
-      list<size_t>::iterator cItr = events.begin();
+      list<size_t>::const_iterator cItr = events.begin();
       list<size_t>::iterator pItr = m_barrier->events.begin();
       for (; cItr != events.end(); cItr++, pItr++, i++)
       {
@@ -396,33 +524,51 @@ void WorkGroup::notifyBarrier(WorkItem* workItem,
     }
   }
 
-  m_running.erase(workItem);
-  m_barrier->workItems.insert(workItem);
+  removeReady(workItem);
+  size_t index = getLocalIndex(workItem);
+  m_atBarrier[index / 64] |= (uint64_t)1 << (index % 64);
+  m_barrier->numWorkItems++;
 }
 
 void WorkGroup::notifyFinished(WorkItem* workItem)
 {
-  m_running.erase(workItem);
+  removeReady(workItem);
 
   // Check if work-group finished without waiting for all events
-  if (m_running.empty() && !m_barrier && !m_events.empty())
+  if (!m_numReady && !m_barrier && !m_events.empty())
   {
     m_context->logError("Work-item finished without waiting for events");
   }
 }
 
-bool WorkGroup::WorkItemCmp::operator()(const WorkItem* lhs,
-                                        const WorkItem* rhs) const
+void WorkGroup::removeReady(const WorkItem* workItem)
 {
-  Size3 lgid = lhs->getGlobalID();
-  Size3 rgid = rhs->getGlobalID();
-  if (lgid.z != rgid.z)
+  size_t index = getLocalIndex(workItem);
+  uint64_t bit = (uint64_t)1 << (index % 64);
+  assert(m_ready[index / 64] & bit);
+  m_ready[index / 64] &= ~bit;
+  m_numReady--;
+
+  // Work-items usually stop in ID order, so this advances past each word once
+  while (m_firstReady < m_ready.size() && !m_ready[m_firstReady])
   {
-    return lgid.z < rgid.z;
+    m_firstReady++;
   }
-  if (lgid.y != rgid.y)
+}
+
+void WorkGroup::setAllReady()
+{
+  size_t num = m_workItems.size();
+  for (size_t w = 0; w < m_ready.size(); w++)
   {
-    return lgid.y < rgid.y;
+    m_ready[w] = num - w * 64 >= 64 ? ~(uint64_t)0
+                                    : ((uint64_t)1 << (num - w * 64)) - 1;
   }
-  return lgid.x < rgid.x;
+  m_numReady = num;
+  m_firstReady = 0;
+}
+
+void WorkGroup::setUniformSharing(bool share)
+{
+  m_shareUniforms = share;
 }
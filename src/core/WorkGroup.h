@@ -17,6 +17,7 @@ class Context;
 class Memory;
 class Kernel;
 class KernelInvocation;
+class UniformValues;
 class WorkItem;
 
 class WorkGroup
@@ -29,13 +30,6 @@ public:
   };
 
 private:
-  // Comparator for ordering work-items
-  struct WorkItemCmp
-  {
-    bool operator()(const WorkItem* lhs, const WorkItem* rhs) const;
-  };
-  std::set<WorkItem*, WorkItemCmp> m_running;
-
   struct AsyncCopy
   {
     const llvm::Instruction* instruction;
@@ -48,12 +42,13 @@ private:
     size_t destStride;
 
     size_t event;
+    size_t numWorkItems; // Number of work-items that have registered it
   };
 
   struct Barrier
   {
     const llvm::Instruction* instruction;
-    std::set<WorkItem*, WorkItemCmp> workItems;
+    size_t numWorkItems;
 
     uint64_t fence;
     std::list<size_t> events;
@@ -76,27 +71,61 @@ public:
   Memory* getLocalMemory() const;
   size_t getLocalMemoryAddress(const llvm::Value* value) const;
   WorkItem* getNextWorkItem() const;
+  MemoryPool* getScratchPool();
+  UniformValues* getUniformValues(bool kernelUniform) const;
   WorkItem* getWorkItem(Size3 localID) const;
+  // Work-items in local linear ID order, which is also their lane order
+  const std::vector<WorkItem*>& getWorkItems() const;
   bool hasBarrier() const;
+  void reset(Size3 wgid);
   void notifyBarrier(WorkItem* workItem, const llvm::Instruction* instruction,
                      uint64_t fence,
-                     std::list<size_t> events = std::list<size_t>());
+                     const std::list<size_t>& events = std::list<size_t>());
   void notifyFinished(WorkItem* workItem);
+  void setUniformSharing(bool share);
 
 private:
   size_t m_groupIndex;
   Size3 m_groupID;
   Size3 m_groupSize;
   const Context* m_context;
+  const KernelInvocation* m_kernelInvocation;
 
   Memory* m_localMemory;
   std::map<const llvm::Value*, size_t> m_localAddresses;
 
   std::vector<WorkItem*> m_workItems;
 
-  Barrier* m_barrier;
+  // Register file shared by the work-items when they execute in lockstep
+  std::vector<unsigned char> m_laneRegisters;
+
+  // Temporary buffers for builtins, shared by the work-items as they all
+  // run on the same thread, and released when the work-group is reset
+  MemoryPool m_scratchPool;
+
+  // Results of instructions that are uniform across the work-group, which
+  // work-items copy instead of executing them when sharing is enabled
+  UniformValues* m_uniformValues;
+  bool m_shareUniforms;
+
+  // Work-items that are ready to run or waiting at the current barrier, as
+  // bitmaps indexed by local linear ID (work-items run in ID order)
+  std::vector<uint64_t> m_ready;
+  std::vector<uint64_t> m_atBarrier;
+  size_t m_numReady;
+  size_t m_firstReady; // Index of the first word that may have a ready bit
+
+  Barrier* m_barrier; // Points to m_barrierStorage while there is a barrier
+  Barrier m_barrierStorage;
   size_t m_nextEvent;
-  std::list<std::pair<AsyncCopy, std::set<const WorkItem*>>> m_asyncCopies;
+  // Copies registered since every copy last completed, and the number of
+  // them each work-item has registered (indexed by local linear ID)
+  std::vector<AsyncCopy> m_asyncCopies;
+  std::vector<size_t> m_numAsyncCopies;
   std::map<size_t, std::list<AsyncCopy>> m_events;
+
+  size_t getLocalIndex(const WorkItem* workItem) const;
+  void removeReady(const WorkItem* workItem);
+  void setAllReady();
 };
 } // namespace oclgrind
@@ -10,6 +10,7 @@
 #include "config.h"
 
 #include <math.h>
+#include <type_traits>
 
 #include "llvm/IR/DebugInfo.h"
 #include "llvm/IR/GlobalVariable.h"
@@ -31,54 +32,300 @@
 using namespace oclgrind;
 using namespace std;
 
-struct WorkItem::Position
+namespace
 {
-  bool hasBegun;
-  const llvm::BasicBlock* prevBlock;
-  const llvm::BasicBlock* currBlock;
-  const llvm::BasicBlock* nextBlock;
-  llvm::BasicBlock::const_iterator currInst;
-  std::stack<const llvm::Instruction*> callStack;
-  std::stack<std::list<size_t>> allocations;
+// Operations applied to each element by the specialized handlers
+struct Add
+{
+  template <typename T> T operator()(T a, T b) const { return a + b; }
+};
+struct AShr
+{
+  template <typename T> T operator()(T a, T b) const
+  {
+    typedef typename make_signed<T>::type S;
+    return (S)a >> (b & (sizeof(T) * 8 - 1));
+  }
+};
+struct BitAnd
+{
+  template <typename T> T operator()(T a, T b) const { return a & b; }
+};
+struct BitOr
+{
+  template <typename T> T operator()(T a, T b) const { return a | b; }
+};
+struct BitXor
+{
+  template <typename T> T operator()(T a, T b) const { return a ^ b; }
+};
+struct Div
+{
+  template <typename T> T operator()(T a, T b) const { return a / b; }
+};
+struct LShr
+{
+  template <typename T> T operator()(T a, T b) const
+  {
+    return a >> (b & (sizeof(T) * 8 - 1));
+  }
+};
+struct Mul
+{
+  template <typename T> T operator()(T a, T b) const { return a * b; }
+};
+struct Shl
+{
+  template <typename T> T operator()(T a, T b) const
+  {
+    return a << (b & (sizeof(T) * 8 - 1));
+  }
+};
+struct Sub
+{
+  template <typename T> T operator()(T a, T b) const { return a - b; }
 };
 
+// Compare two elements with the predicate of an icmp instruction
+template <unsigned P, typename T>
+typename enable_if<is_integral<T>::value, bool>::type
+compare(T a, T b)
+{
+  typedef typename make_signed<T>::type S;
+  switch (P)
+  {
+  case llvm::CmpInst::ICMP_EQ:
+    return a == b;
+  case llvm::CmpInst::ICMP_NE:
+    return a != b;
+  case llvm::CmpInst::ICMP_UGT:
+    return a > b;
+  case llvm::CmpInst::ICMP_UGE:
+    return a >= b;
+  case llvm::CmpInst::ICMP_ULT:
+    return a < b;
+  case llvm::CmpInst::ICMP_ULE:
+    return a <= b;
+  case llvm::CmpInst::ICMP_SGT:
+    return (S)a > (S)b;
+  case llvm::CmpInst::ICMP_SGE:
+    return (S)a >= (S)b;
+  case llvm::CmpInst::ICMP_SLT:
+    return (S)a < (S)b;
+  case llvm::CmpInst::ICMP_SLE:
+    return (S)a <= (S)b;
+  default:
+    return false;
+  }
+}
+
+// Compare two elements with the predicate of an fcmp instruction, other
+// than those that don't compare the values
+template <unsigned P, typename T>
+typename enable_if<is_floating_point<T>::value, bool>::type
+compare(T a, T b)
+{
+  // Only unordered predicates hold for NaN operands
+  if (std::isnan(a) || std::isnan(b))
+    return P > llvm::CmpInst::FCMP_ORD;
+
+  switch (P)
+  {
+  case llvm::CmpInst::FCMP_OEQ:
+  case llvm::CmpInst::FCMP_UEQ:
+    return a == b;
+  case llvm::CmpInst::FCMP_ONE:
+  case llvm::CmpInst::FCMP_UNE:
+    return a != b;
+  case llvm::CmpInst::FCMP_OGT:
+  case llvm::CmpInst::FCMP_UGT:
+    return a > b;
+  case llvm::CmpInst::FCMP_OGE:
+  case llvm::CmpInst::FCMP_UGE:
+    return a >= b;
+  case llvm::CmpInst::FCMP_OLT:
+  case llvm::CmpInst::FCMP_ULT:
+    return a < b;
+  case llvm::CmpInst::FCMP_OLE:
+  case llvm::CmpInst::FCMP_ULE:
+    return a <= b;
+  default:
+    return false;
+  }
+}
+
+// Lane-wise versions of the specialized handlers, which apply an operation
+// to every element of every lane as one flat loop when all lanes execute
+// and any constant operand is a scalar, and lane by lane otherwise
+
+// Index of element i of lane l of an operand
+inline size_t laneIndex(const LaneArguments& args, unsigned op, size_t l,
+                        unsigned i)
+{
+  return args.shared[op] ? i : l * args.num + i;
+}
+
+template <typename R, typename T, class F>
+void applyLanes(const LaneArguments& args, F f)
+{
+  const T* a = (const T*)args.operands[0];
+  const T* b = (const T*)args.operands[1];
+  R* r = (R*)args.result;
+  size_t n = args.numLanes * args.num;
+  if (!args.mask && !args.shared[0] && !args.shared[1])
+  {
+    for (size_t i = 0; i < n; i++)
+      r[i] = f(a[i], b[i]);
+  }
+  else if (!args.mask && args.num == 1 && !args.shared[0])
+  {
+    T c = b[0];
+    for (size_t i = 0; i < n; i++)
+      r[i] = f(a[i], c);
+  }
+  else if (!args.mask && args.num == 1 && !args.shared[1])
+  {
+    T c = a[0];
+    for (size_t i = 0; i < n; i++)
+      r[i] = f(c, b[i]);
+  }
+  else
+  {
+    for (size_t l = 0; l < args.numLanes; l++)
+    {
+      if (args.mask && !args.mask[l])
+        continue;
+      for (unsigned i = 0; i < args.num; i++)
+      {
+        r[l * args.num + i] =
+          f(a[laneIndex(args, 0, l, i)], b[laneIndex(args, 1, l, i)]);
+      }
+    }
+  }
+}
+
+template <typename T, class Op> void binaryLanes(const LaneArguments& args)
+{
+  applyLanes<T, T>(args, Op());
+}
+
+template <typename T, unsigned P> void compareLanes(const LaneArguments& args)
+{
+  uint8_t t = args.num > 1 ? -1 : 1;
+  applyLanes<uint8_t, T>(
+    args, [t](T a, T b) -> uint8_t { return compare<P>(a, b) ? t : 0; });
+}
+
+template <typename To, typename From>
+void convertLanes(const LaneArguments& args)
+{
+  const From* a = (const From*)args.operands[0];
+  To* r = (To*)args.result;
+  if (!args.mask && !args.shared[0])
+  {
+    for (size_t i = 0; i < args.numLanes * args.num; i++)
+      r[i] = a[i];
+    return;
+  }
+  for (size_t l = 0; l < args.numLanes; l++)
+  {
+    if (args.mask && !args.mask[l])
+      continue;
+    for (unsigned i = 0; i < args.num; i++)
+      r[l * args.num + i] = a[laneIndex(args, 0, l, i)];
+  }
+}
+
+template <typename T> void selectLanes(const LaneArguments& args)
+{
+  const uint8_t* c = args.operands[0];
+  const T* a = (const T*)args.operands[1];
+  const T* b = (const T*)args.operands[2];
+  T* r = (T*)args.result;
+  if (!args.mask && args.num == 1 && !args.shared[0] && !args.shared[1] &&
+      !args.shared[2])
+  {
+    for (size_t i = 0; i < args.numLanes; i++)
+      r[i] = c[i] ? a[i] : b[i];
+    return;
+  }
+  for (size_t l = 0; l < args.numLanes; l++)
+  {
+    if (args.mask && !args.mask[l])
+      continue;
+    bool condition = c[args.shared[0] ? 0 : l];
+    for (unsigned i = 0; i < args.num; i++)
+    {
+      r[l * args.num + i] = condition ? a[laneIndex(args, 1, l, i)]
+                                      : b[laneIndex(args, 2, l, i)];
+    }
+  }
+}
+} // namespace
+
 WorkItem::WorkItem(const KernelInvocation* kernelInvocation,
-                   WorkGroup* workGroup, Size3 lid)
+                   WorkGroup* workGroup, Size3 lid,
+                   unsigned char* laneRegisters, size_t lane, size_t numLanes)
     : m_context(kernelInvocation->getContext()),
-      m_kernelInvocation(kernelInvocation), m_workGroup(workGroup)
+      m_kernelInvocation(kernelInvocation), m_workGroup(workGroup),
+      m_pool(workGroup->getScratchPool()), m_debugState(NULL), m_lane(lane),
+      m_numLanes(numLanes)
 {
   m_localID = lid;
 
-  // Compute global ID
-  Size3 groupID = workGroup->getGroupID();
-  Size3 groupSize = kernelInvocation->getLocalSize();
-  Size3 globalOffset = kernelInvocation->getGlobalOffset();
-  m_globalID.x = lid.x + groupID.x * groupSize.x + globalOffset.x;
-  m_globalID.y = lid.y + groupID.y * groupSize.y + globalOffset.y;
-  m_globalID.z = lid.z + groupID.z * groupSize.z + globalOffset.z;
-
-  Size3 globalSize = kernelInvocation->getGlobalSize();
-  m_globalIndex = (m_globalID.x +
-                   (m_globalID.y + m_globalID.z * globalSize.y) * globalSize.x);
-
   const Kernel* kernel = kernelInvocation->getKernel();
 
   // Load interpreter cache
   m_cache = kernel->getProgram()->getInterpreterCache(kernel->getFunction());
 
-  // Set initial number of values to store based on cache
-  m_values.resize(m_cache->getNumValues());
+  // Values are found in the register frame through the kernel's layout
+  m_frameLayout = m_cache->getFrameLayout().data();
+  m_registers = laneRegisters ? laneRegisters
+                              : new unsigned char[m_cache->getFrameSize()];
 
   m_privateMemory =
     new Memory(AddrSpacePrivate, sizeof(size_t) == 8 ? 32 : 16, m_context);
 
+  reset();
+}
+
+WorkItem::~WorkItem()
+{
+  if (m_numLanes == 1)
+    delete[] m_registers;
+  delete m_privateMemory;
+  delete m_debugState;
+}
+
+void WorkItem::reset()
+{
+  // Compute global ID
+  Size3 groupID = m_workGroup->getGroupID();
+  Size3 groupSize = m_kernelInvocation->getLocalSize();
+  Size3 globalOffset = m_kernelInvocation->getGlobalOffset();
+  m_globalID.x = m_localID.x + groupID.x * groupSize.x + globalOffset.x;
+  m_globalID.y = m_localID.y + groupID.y * groupSize.y + globalOffset.y;
+  m_globalID.z = m_localID.z + groupID.z * groupSize.z + globalOffset.z;
+
+  Size3 globalSize = m_kernelInvocation->getGlobalSize();
+  m_globalIndex = (m_globalID.x +
+                   (m_globalID.y + m_globalID.z * globalSize.y) * globalSize.x);
+
+  // Release state left over from a previous work-group
+  m_privateMemory->clear();
+  for (MemoryTLBEntry& entry : m_tlb)
+    entry.memory = NULL;
+  m_frames.clear();
+  m_allocations.clear();
+  delete m_debugState;
+  m_debugState = NULL;
+
   // Initialise kernel arguments and global variables
+  const Kernel* kernel = m_kernelInvocation->getKernel();
   for (auto value = kernel->values_begin(); value != kernel->values_end();
        value++)
   {
-    pair<unsigned, unsigned> size = getValueSize(value->first);
-    TypedValue v = {size.first, size.second,
-                    m_pool.alloc(size.first * size.second)};
+    TypedValue v = getValue(value->first);
 
     const llvm::Type* type = value->first->getType();
     if (type->isPointerTy() &&
@@ -96,24 +343,36 @@ WorkItem::WorkItem(const KernelInvocation* kernelInvocation,
     {
       memcpy(v.data, value->second.data, v.size * v.num);
     }
+  }
 
-    setValue(value->first, v);
+  // Fold constant expressions into their value slots
+  const vector<InterpreterCache::DecodedInstruction>& constExprs =
+    m_cache->getConstantExpressions();
+  for (auto expr = constExprs.begin(); expr != constExprs.end(); expr++)
+  {
+    m_position.currInst = &*expr;
+    TypedValue result = getSlot(expr->result);
+    (this->*expr->handler)(expr->instruction, result);
   }
 
   // Initialize interpreter state
   m_state = READY;
-  m_position = new Position;
-  m_position->hasBegun = false;
-  m_position->prevBlock = NULL;
-  m_position->nextBlock = NULL;
-  m_position->currBlock = &*kernel->getFunction()->begin();
-  m_position->currInst = m_position->currBlock->begin();
+  m_position.hasBegun = false;
+  m_position.prevBlock = NULL;
+  m_position.nextBlock = NULL;
+  m_position.nextInst = NULL;
+  m_position.currBlock = &*kernel->getFunction()->begin();
+  m_position.currInst = m_cache->getBlockEntry(m_position.currBlock);
 }
 
-WorkItem::~WorkItem()
+bool WorkItem::begin()
 {
-  delete m_privateMemory;
-  delete m_position;
+  if (m_position.hasBegun)
+    return false;
+
+  m_position.hasBegun = true;
+  m_context->notifyWorkItemBegin(this);
+  return true;
 }
 
 void WorkItem::clearBarrier()
@@ -125,220 +384,372 @@ void WorkItem::clearBarrier()
   }
 }
 
-void WorkItem::dispatch(const llvm::Instruction* instruction,
-                        TypedValue& result)
+InstructionHandler WorkItem::getInstructionHandler(unsigned opcode)
 {
-  switch (instruction->getOpcode())
+  switch (opcode)
   {
   case llvm::Instruction::Add:
-    add(instruction, result);
-    break;
+    return &WorkItem::add;
   case llvm::Instruction::Alloca:
-    alloc(instruction, result);
-    break;
+    return &WorkItem::alloc;
   case llvm::Instruction::And:
-    bwand(instruction, result);
-    break;
+    return &WorkItem::bwand;
   case llvm::Instruction::AShr:
-    ashr(instruction, result);
-    break;
+    return &WorkItem::ashr;
   case llvm::Instruction::BitCast:
-    bitcast(instruction, result);
-    break;
+    return &WorkItem::bitcast;
   case llvm::Instruction::Br:
-    br(instruction, result);
-    break;
+    return &WorkItem::br;
   case llvm::Instruction::Call:
-    call(instruction, result);
-    break;
+    return &WorkItem::call;
   case llvm::Instruction::ExtractElement:
-    extractelem(instruction, result);
-    break;
+    return &WorkItem::extractelem;
   case llvm::Instruction::ExtractValue:
-    extractval(instruction, result);
-    break;
+    return &WorkItem::extractval;
   case llvm::Instruction::FAdd:
-    fadd(instruction, result);
-    break;
+    return &WorkItem::fadd;
   case llvm::Instruction::FCmp:
-    fcmp(instruction, result);
-    break;
+    return &WorkItem::fcmp;
   case llvm::Instruction::FDiv:
-    fdiv(instruction, result);
-    break;
+    return &WorkItem::fdiv;
   case llvm::Instruction::FMul:
-    fmul(instruction, result);
-    break;
+    return &WorkItem::fmul;
   case llvm::Instruction::FNeg:
-    fneg(instruction, result);
-    break;
+    return &WorkItem::fneg;
   case llvm::Instruction::FPExt:
-    fpext(instruction, result);
-    break;
+    return &WorkItem::fpext;
   case llvm::Instruction::FPToSI:
-    fptosi(instruction, result);
-    break;
+    return &WorkItem::fptosi;
   case llvm::Instruction::FPToUI:
-    fptoui(instruction, result);
-    break;
+    return &WorkItem::fptoui;
   case llvm::Instruction::FPTrunc:
-    fptrunc(instruction, result);
-    break;
+    return &WorkItem::fptrunc;
   case llvm::Instruction::FRem:
-    frem(instruction, result);
-    break;
+    return &WorkItem::frem;
   case llvm::Instruction::FSub:
-    fsub(instruction, result);
-    break;
+    return &WorkItem::fsub;
   case llvm::Instruction::GetElementPtr:
-    gep(instruction, result);
-    break;
+    return &WorkItem::gep;
   case llvm::Instruction::ICmp:
-    icmp(instruction, result);
-    break;
+    return &WorkItem::icmp;
   case llvm::Instruction::InsertElement:
-    insertelem(instruction, result);
-    break;
+    return &WorkItem::insertelem;
   case llvm::Instruction::InsertValue:
-    insertval(instruction, result);
-    break;
+    return &WorkItem::insertval;
   case llvm::Instruction::IntToPtr:
-    inttoptr(instruction, result);
-    break;
+    return &WorkItem::inttoptr;
   case llvm::Instruction::Load:
-    load(instruction, result);
-    break;
+    return &WorkItem::load;
   case llvm::Instruction::LShr:
-    lshr(instruction, result);
-    break;
+    return &WorkItem::lshr;
   case llvm::Instruction::Mul:
-    mul(instruction, result);
-    break;
+    return &WorkItem::mul;
   case llvm::Instruction::Or:
-    bwor(instruction, result);
-    break;
+    return &WorkItem::bwor;
   case llvm::Instruction::PHI:
-    phi(instruction, result);
-    break;
+    return &WorkItem::phi;
   case llvm::Instruction::PtrToInt:
-    ptrtoint(instruction, result);
-    break;
+    return &WorkItem::ptrtoint;
   case llvm::Instruction::Ret:
-    ret(instruction, result);
-    break;
+    return &WorkItem::ret;
   case llvm::Instruction::SDiv:
-    sdiv(instruction, result);
-    break;
+    return &WorkItem::sdiv;
   case llvm::Instruction::Select:
-    select(instruction, result);
-    break;
+    return &WorkItem::select;
   case llvm::Instruction::SExt:
-    sext(instruction, result);
-    break;
+    return &WorkItem::sext;
   case llvm::Instruction::Shl:
-    shl(instruction, result);
-    break;
+    return &WorkItem::shl;
   case llvm::Instruction::ShuffleVector:
-    shuffle(instruction, result);
-    break;
+    return &WorkItem::shuffle;
   case llvm::Instruction::SIToFP:
-    sitofp(instruction, result);
-    break;
+    return &WorkItem::sitofp;
   case llvm::Instruction::SRem:
-    srem(instruction, result);
-    break;
+    return &WorkItem::srem;
   case llvm::Instruction::Store:
-    store(instruction, result);
-    break;
+    return &WorkItem::store;
   case llvm::Instruction::Sub:
-    sub(instruction, result);
-    break;
+    return &WorkItem::sub;
   case llvm::Instruction::Switch:
-    swtch(instruction, result);
-    break;
+    return &WorkItem::swtch;
   case llvm::Instruction::Trunc:
-    itrunc(instruction, result);
-    break;
+    return &WorkItem::itrunc;
   case llvm::Instruction::UDiv:
-    udiv(instruction, result);
-    break;
+    return &WorkItem::udiv;
   case llvm::Instruction::UIToFP:
-    uitofp(instruction, result);
-    break;
+    return &WorkItem::uitofp;
   case llvm::Instruction::URem:
-    urem(instruction, result);
-    break;
+    return &WorkItem::urem;
   case llvm::Instruction::Unreachable:
-    FATAL_ERROR("Encountered unreachable instruction");
+    return &WorkItem::unreachable;
   case llvm::Instruction::Xor:
-    bwxor(instruction, result);
-    break;
+    return &WorkItem::bwxor;
   case llvm::Instruction::ZExt:
-    zext(instruction, result);
-    break;
+    return &WorkItem::zext;
   case llvm::Instruction::Freeze:
-    freeze(instruction, result);
-    break;
+    return &WorkItem::freeze;
   default:
-    FATAL_ERROR("Unsupported instruction: %s", instruction->getOpcodeName());
+    return &WorkItem::unsupported;
+  }
+}
+
+InstructionHandler
+WorkItem::getInstructionHandler(const llvm::Instruction* instruction,
+                                unsigned size, unsigned num,
+                                LaneHandler* laneHandler)
+{
+  if (laneHandler)
+    *laneHandler = NULL;
+  auto withLanes = [laneHandler](LaneHandler lanes,
+                                 InstructionHandler handler) {
+    if (laneHandler)
+      *laneHandler = lanes;
+    return handler;
+  };
+
+  // Operand elements may differ in size from the result for comparisons
+  // and casts
+  unsigned opSize = 0, opBits = 0, bits = 0;
+  if (instruction->getNumOperands())
+  {
+    opSize = getValueSize(instruction->getOperand(0)).first;
+    opBits = instruction->getOperand(0)->getType()->getScalarSizeInBits();
+  }
+  bits = instruction->getType()->getScalarSizeInBits();
+
+#define BINARY(T, Op)                                                          \
+  withLanes(&binaryLanes<T, Op>, num == 1   ? &WorkItem::binaryOp<T, 1, Op>    \
+                                 : num == 4 ? &WorkItem::binaryOp<T, 4, Op>    \
+                                            : &WorkItem::binaryOp<T, 0, Op>)
+#define INTEGER(Op)                                                            \
+  if (size == 4)                                                               \
+    return BINARY(uint32_t, Op);                                               \
+  if (size == 8)                                                               \
+    return BINARY(uint64_t, Op);                                               \
+  break
+#define FLOAT(Op)                                                              \
+  if (size == 4)                                                               \
+    return BINARY(float, Op);                                                  \
+  if (size == 8)                                                               \
+    return BINARY(double, Op);                                                 \
+  break
+#define COMPARE(T, P)                                                          \
+  withLanes(&compareLanes<T, llvm::CmpInst::P>,                                \
+            num == 1 ? &WorkItem::compareOp<T, 1, llvm::CmpInst::P>            \
+                     : &WorkItem::compareOp<T, 0, llvm::CmpInst::P>)
+#define ICMP(P)                                                                \
+  case llvm::CmpInst::P:                                                       \
+    return opSize == 4 ? COMPARE(uint32_t, P) : COMPARE(uint64_t, P)
+#define FCMP(P)                                                                \
+  case llvm::CmpInst::P:                                                       \
+    return opSize == 4 ? COMPARE(float, P) : COMPARE(double, P)
+#define CONVERT(To, From)                                                      \
+  withLanes(&convertLanes<To, From>,                                           \
+            num == 1 ? &WorkItem::convertOp<To, From, 1>                       \
+                     : &WorkItem::convertOp<To, From, 0>)
+#define SELECT(T)                                                              \
+  withLanes(&selectLanes<T>, num == 1 ? &WorkItem::selectOp<T, 1>              \
+                                      : &WorkItem::selectOp<T, 0>)
+
+  switch (instruction->getOpcode())
+  {
+  case llvm::Instruction::Add:
+    INTEGER(Add);
+  case llvm::Instruction::And:
+    INTEGER(BitAnd);
+  case llvm::Instruction::AShr:
+    INTEGER(AShr);
+  case llvm::Instruction::FAdd:
+    FLOAT(Add);
+  case llvm::Instruction::FCmp:
+    if (opSize != 4 && opSize != 8)
+      break;
+    switch (((const llvm::CmpInst*)instruction)->getPredicate())
+    {
+      FCMP(FCMP_OEQ);
+      FCMP(FCMP_OGT);
+      FCMP(FCMP_OGE);
+      FCMP(FCMP_OLT);
+      FCMP(FCMP_OLE);
+      FCMP(FCMP_ONE);
+      FCMP(FCMP_UEQ);
+      FCMP(FCMP_UGT);
+      FCMP(FCMP_UGE);
+      FCMP(FCMP_ULT);
+      FCMP(FCMP_ULE);
+      FCMP(FCMP_UNE);
+    default:
+      break;
+    }
+    break;
+  case llvm::Instruction::FDiv:
+    FLOAT(Div);
+  case llvm::Instruction::FMul:
+    FLOAT(Mul);
+  case llvm::Instruction::FSub:
+    FLOAT(Sub);
+  case llvm::Instruction::ICmp:
+    if (opSize != 4 && opSize != 8)
+      break;
+    switch (((const llvm::CmpInst*)instruction)->getPredicate())
+    {
+      ICMP(ICMP_EQ);
+      ICMP(ICMP_NE);
+      ICMP(ICMP_UGT);
+      ICMP(ICMP_UGE);
+      ICMP(ICMP_ULT);
+      ICMP(ICMP_ULE);
+      ICMP(ICMP_SGT);
+      ICMP(ICMP_SGE);
+      ICMP(ICMP_SLT);
+      ICMP(ICMP_SLE);
+    default:
+      break;
+    }
+    break;
+  case llvm::Instruction::LShr:
+    INTEGER(LShr);
+  case llvm::Instruction::Mul:
+    INTEGER(Mul);
+  case llvm::Instruction::Or:
+    INTEGER(BitOr);
+  case llvm::Instruction::Select:
+    // Only for a scalar condition
+    if (instruction->getOperand(0)->getType()->isVectorTy())
+      break;
+    if (size == 1)
+      return SELECT(uint8_t);
+    if (size == 2)
+      return SELECT(uint16_t);
+    if (size == 4)
+      return SELECT(uint32_t);
+    if (size == 8)
+      return SELECT(uint64_t);
+    break;
+  case llvm::Instruction::SExt:
+    // Booleans are stored as 0 or 1, rather than sign-extended
+    if (opBits == 1)
+      break;
+    if (size == 8 && opSize == 4)
+      return CONVERT(int64_t, int32_t);
+    if (size == 4 && opSize == 2)
+      return CONVERT(int32_t, int16_t);
+    if (size == 4 && opSize == 1)
+      return CONVERT(int32_t, int8_t);
+    break;
+  case llvm::Instruction::Shl:
+    INTEGER(Shl);
+  case llvm::Instruction::Sub:
+    INTEGER(Sub);
+  case llvm::Instruction::Trunc:
+    if (bits == 1)
+      break;
+    if (size == 4 && opSize == 8)
+      return CONVERT(uint32_t, uint64_t);
+    if (size == 2 && opSize == 4)
+      return CONVERT(uint16_t, uint32_t);
+    if (size == 1 && opSize == 4)
+      return CONVERT(uint8_t, uint32_t);
+    break;
+  case llvm::Instruction::Xor:
+    INTEGER(BitXor);
+  case llvm::Instruction::ZExt:
+    if (size == 8 && opSize == 4)
+      return CONVERT(uint64_t, uint32_t);
+    if (size == 4 && opSize == 2)
+      return CONVERT(uint32_t, uint16_t);
+    if (size == 4 && opSize == 1)
+      return CONVERT(uint32_t, uint8_t);
+    break;
   }
+
+#undef BINARY
+#undef INTEGER
+#undef FLOAT
+#undef COMPARE
+#undef ICMP
+#undef FCMP
+#undef CONVERT
+#undef SELECT
+
+  return getInstructionHandler(instruction->getOpcode());
 }
 
-void WorkItem::execute(const llvm::Instruction* instruction)
+void WorkItem::execute(const InterpreterCache::DecodedInstruction* instruction)
 {
-  // Prepare private variable for instruction result
-  pair<unsigned, unsigned> resultSize = getValueSize(instruction);
+  // Results are written directly to their register slot
+  TypedValue result = getSlot(instruction->result);
 
-  // Prepare result
-  TypedValue result = {resultSize.first, resultSize.second, NULL};
-  if (result.size)
+  // Copy a uniform result if another work-item has already computed it
+  UniformValues* uniform = NULL;
+  const unsigned char* shared = NULL;
+  if (instruction->uniformity != InterpreterCache::Varying)
   {
-    result.data = m_pool.alloc(result.size * result.num);
+    uniform = m_workGroup->getUniformValues(instruction->uniformity ==
+                                            InterpreterCache::KernelUniform);
+    shared = uniform ? uniform->get(instruction) : NULL;
   }
 
-  if (instruction->getOpcode() != llvm::Instruction::PHI &&
-      m_phiTemps.size() > 0)
+  if (shared)
   {
-    TypedValueMap::iterator itr;
-    for (itr = m_phiTemps.begin(); itr != m_phiTemps.end(); itr++)
-    {
-      setValue(itr->first, itr->second);
-    }
-    m_phiTemps.clear();
+    memcpy(result.data, shared, result.size * result.num);
+  }
+  else
+  {
+    // Execute instruction
+    (this->*instruction->handler)(instruction->instruction, result);
+    if (uniform)
+      uniform->set(instruction, result.data);
   }
 
-  // Execute instruction
-  dispatch(instruction, result);
-
-  // Store result
-  if (result.size)
+  if (m_context->hasSubscribers(CallbackInstructionExecuted))
   {
-    if (instruction->getOpcode() != llvm::Instruction::PHI)
-    {
-      setValue(instruction, result);
-    }
-    else
-    {
-      m_phiTemps[instruction] = result;
-    }
+    m_context->notifyInstructionExecuted(this, instruction->instruction,
+                                         result);
+  }
+  if (m_context->hasSubscribers(CallbackInstructionsExecuted))
+  {
+    m_context->recordInstructionExecuted(this, instruction->instruction);
   }
+}
 
-  m_context->notifyInstructionExecuted(this, instruction, result);
+TypedValue WorkItem::getCallArgument(unsigned index) const
+{
+  // The current instruction is the call while a builtin is executing
+  return getOperand(m_position.currInst->operands[index]);
 }
 
 const stack<const llvm::Instruction*>& WorkItem::getCallStack() const
 {
-  return m_position->callStack;
+  // Materialize the calls of the active frames
+  stack<const llvm::Instruction*>& callStack = getDebugState()->callStack;
+  callStack = stack<const llvm::Instruction*>();
+  for (const Frame& frame : m_frames)
+    callStack.push(frame.call->instruction);
+  return callStack;
 }
 
 const llvm::BasicBlock* WorkItem::getCurrentBlock() const
 {
-  return m_position->currBlock;
+  return m_position.currBlock;
+}
+
+const InterpreterCache::DecodedInstruction*
+WorkItem::getCurrentDecodedInstruction() const
+{
+  return m_position.currInst;
 }
 
 const llvm::Instruction* WorkItem::getCurrentInstruction() const
 {
-  return &*m_position->currInst;
+  return m_position.currInst->instruction;
+}
+
+WorkItem::DebugState* WorkItem::getDebugState() const
+{
+  if (!m_debugState)
+    m_debugState = new DebugState;
+  return m_debugState;
 }
 
 Size3 WorkItem::getGlobalID() const
@@ -356,6 +767,39 @@ Size3 WorkItem::getLocalID() const
   return m_localID;
 }
 
+void WorkItem::followEdge(const InterpreterCache::Edge& edge)
+{
+  m_position.nextInst = edge.target;
+
+  // Move incoming values into phi nodes of the target block
+  const vector<InterpreterCache::PhiMove>& moves = edge.phiMoves;
+  if (edge.parallel)
+  {
+    for (auto move = moves.begin(); move != moves.end(); move++)
+    {
+      const InterpreterCache::FrameSlot& dest = m_frameLayout[move->dest];
+      size_t size = dest.size * dest.num;
+      memcpy(getFrameData(move->scratch, size), getOperand(move->source).data,
+             size);
+    }
+    for (auto move = moves.begin(); move != moves.end(); move++)
+    {
+      const InterpreterCache::FrameSlot& dest = m_frameLayout[move->dest];
+      size_t size = dest.size * dest.num;
+      memcpy(getFrameData(dest.offset, size),
+             getFrameData(move->scratch, size), size);
+    }
+  }
+  else
+  {
+    for (auto move = moves.begin(); move != moves.end(); move++)
+    {
+      TypedValue dest = getSlot(move->dest);
+      memcpy(dest.data, getOperand(move->source).data, dest.size * dest.num);
+    }
+  }
+}
+
 Memory* WorkItem::getMemory(unsigned int addrSpace) const
 {
   switch (addrSpace)
@@ -374,79 +818,12 @@ Memory* WorkItem::getMemory(unsigned int addrSpace) const
 
 TypedValue WorkItem::getOperand(const llvm::Value* operand) const
 {
-  unsigned valID = operand->getValueID();
-  if (valID == llvm::Value::ArgumentVal ||
-      valID == llvm::Value::GlobalVariableVal ||
-      valID >= llvm::Value::InstructionVal)
-  {
-    return getValue(operand);
-  }
-  // else if (valID == llvm::Value::BasicBlockVal)
-  //{
-  //}
-  // else if (valID == llvm::Value::FunctionVal)
-  //{
-  //}
-  // else if (valID == llvm::Value::GlobalAliasVal)
-  //{
-  //}
-  // else if (valID == llvm::Value::BlockAddressVal)
-  //{
-  //}
-  else if (valID == llvm::Value::ConstantExprVal)
-  {
-    pair<unsigned, unsigned> size = getValueSize(operand);
-    TypedValue result;
-    result.size = size.first;
-    result.num = size.second;
-    result.data = m_pool.alloc(getTypeSize(operand->getType()));
-
-    // Use of const_cast here is ugly, but ConstExpr instructions
-    // shouldn't actually modify WorkItem state anyway
-    const_cast<WorkItem*>(this)->dispatch(m_cache->getConstantExpr(operand),
-                                          result);
-    return result;
-  }
-  else if (valID == llvm::Value::UndefValueVal ||
-           valID == llvm::Value::ConstantAggregateZeroVal ||
-           valID == llvm::Value::ConstantDataArrayVal ||
-           valID == llvm::Value::ConstantDataVectorVal ||
-           valID == llvm::Value::ConstantIntVal ||
-           valID == llvm::Value::ConstantFPVal ||
-           valID == llvm::Value::ConstantArrayVal ||
-           valID == llvm::Value::ConstantStructVal ||
-           valID == llvm::Value::ConstantVectorVal ||
-           valID == llvm::Value::ConstantPointerNullVal)
-  {
-    return m_cache->getConstant(operand);
-  }
-  // else if (valID == llvm::Value::MDNodeVal)
-  //{
-  //}
-  // else if (valID == llvm::Value::MDStringVal)
-  //{
-  //}
-  // else if (valID == llvm::Value::InlineAsmVal)
-  //{
-  //}
-  // else if (valID == llvm::Value::PseudoSourceValueVal)
-  //{
-  //}
-  // else if (valID == llvm::Value::FixedStackPseudoSourceValueVal)
-  //{
-  //}
-  else
-  {
-    FATAL_ERROR("Unhandled operand type: %d", valID);
-  }
-
-  // Unreachable
-  assert(false);
+  return getOperand(m_cache->getOperandSlot(operand));
 }
 
 const llvm::BasicBlock* WorkItem::getPreviousBlock() const
 {
-  return m_position->prevBlock;
+  return m_position.prevBlock;
 }
 
 Memory* WorkItem::getPrivateMemory() const
@@ -461,7 +838,7 @@ WorkItem::State WorkItem::getState() const
 
 TypedValue WorkItem::getValue(const llvm::Value* key) const
 {
-  return m_values[m_cache->getValueID(key)];
+  return getSlot(m_cache->getValueID(key));
 }
 
 const unsigned char* WorkItem::getValueData(const llvm::Value* value) const
@@ -483,6 +860,28 @@ bool WorkItem::hasValue(const llvm::Value* key) const
   return m_cache->hasValue(key);
 }
 
+void WorkItem::loadMemory(unsigned addrSpace, size_t address, size_t size,
+                          unsigned alignment, unsigned char* data)
+{
+  // Check address is correctly aligned
+  if (address & (alignment - 1))
+  {
+    m_context->logError("Invalid memory load - source pointer is "
+                        "not aligned to the pointed type");
+  }
+
+  if (!m_context->hasSubscribers(CallbackMemoryLoad))
+  {
+    unsigned char* source = translateAddress(addrSpace, address, size);
+    if (source)
+    {
+      memcpy(data, source, size);
+      return;
+    }
+  }
+  getMemory(addrSpace)->load(data, address, size);
+}
+
 void WorkItem::printExpression(string expr) const
 {
   // Split base variable name from rest of expression
@@ -503,16 +902,18 @@ void WorkItem::printExpression(string expr) const
   const llvm::DIVariable* divar = NULL;
 
   // Check private variables
-  VariableMap::const_iterator itr;
-  itr = m_variables.find(basename);
-  if (itr != m_variables.end())
+  if (m_debugState)
   {
-    baseValue = itr->second.first;
-    divar = itr->second.second;
+    auto itr = m_debugState->variables.find(basename);
+    if (itr != m_debugState->variables.end())
+    {
+      baseValue = itr->second.first;
+      divar = itr->second.second;
+    }
   }
 
   // Check global variables
-  string globalName = m_position->currBlock->getParent()->getName().str();
+  string globalName = m_position.currBlock->getParent()->getName().str();
   globalName += ".";
   globalName += basename;
   const llvm::Module* module =
@@ -711,36 +1112,39 @@ bool WorkItem::printValue(const llvm::Value* value) const
   return true;
 }
 
-void WorkItem::setValue(const llvm::Value* key, TypedValue value)
+void WorkItem::setCurrentInstruction(
+  const InterpreterCache::DecodedInstruction* instruction)
 {
-  m_values[m_cache->getValueID(key)] = value;
+  m_position.currInst = instruction;
+}
+
+void WorkItem::setValue(const llvm::Value* key, TypedValue value)
+{
+  TypedValue slot = getSlot(m_cache->getValueID(key));
+  memcpy(slot.data, value.data, slot.size * slot.num);
 }
 
 WorkItem::State WorkItem::step()
 {
   assert(m_state == READY);
 
-  if (!m_position->hasBegun)
-  {
-    m_position->hasBegun = true;
-    m_context->notifyWorkItemBegin(this);
-  }
+  begin();
 
   // Execute the next instruction
-  execute(&*m_position->currInst);
+  execute(m_position.currInst);
 
-  // Check if we've reached the end of the block
-  if (++m_position->currInst == m_position->currBlock->end() ||
-      m_position->nextBlock)
+  if (m_position.nextBlock)
   {
-    if (m_position->nextBlock)
-    {
-      // Move to next basic block
-      m_position->prevBlock = m_position->currBlock;
-      m_position->currBlock = m_position->nextBlock;
-      m_position->nextBlock = NULL;
-      m_position->currInst = m_position->currBlock->begin();
-    }
+    // Move to next basic block
+    m_position.prevBlock = m_position.currBlock;
+    m_position.currBlock = m_position.nextBlock;
+    m_position.nextBlock = NULL;
+    m_position.currInst = m_position.nextInst;
+  }
+  else
+  {
+    // Instructions within a block are contiguous in the decoded stream
+    m_position.currInst++;
   }
 
   if (m_state == FINISHED)
@@ -749,6 +1153,112 @@ WorkItem::State WorkItem::step()
   return m_state;
 }
 
+bool WorkItem::stepLanes(WorkItem* const* lanes, size_t numLanes,
+                         const uint8_t* mask, size_t numActive)
+{
+  size_t first = 0;
+  while (!mask[first])
+    first++;
+  const WorkItem* lead = lanes[first];
+  const InterpreterCache::DecodedInstruction* instruction =
+    lead->m_position.currInst;
+  if (!instruction->laneHandler || lead->m_numLanes != numLanes)
+    return false;
+
+  // Every lane of a value follows the first one in the register file
+  LaneArguments args;
+  const InterpreterCache::FrameSlot* layout = lead->m_frameLayout;
+  args.result =
+    lead->m_registers + layout[instruction->result].offset * numLanes;
+  assert(instruction->operands.size() <= 3);
+  for (unsigned i = 0; i < instruction->operands.size(); i++)
+  {
+    const InterpreterCache::OperandSlot& slot = instruction->operands[i];
+    args.shared[i] = slot.constant;
+    args.operands[i] =
+      slot.constant ? lead->m_cache->getConstant(slot.index).data
+                    : lead->m_registers + layout[slot.index].offset * numLanes;
+  }
+  args.num = instruction->num;
+  args.numLanes = numLanes;
+  args.mask = numActive < numLanes ? mask : NULL;
+
+  for (size_t l = first; l < numLanes; l++)
+  {
+    if (mask[l])
+      lanes[l]->begin();
+  }
+
+  instruction->laneHandler(args);
+
+  bool record = lead->m_context->hasSubscribers(CallbackInstructionsExecuted);
+  for (size_t l = first; l < numLanes; l++)
+  {
+    if (!mask[l])
+      continue;
+    if (record)
+      lanes[l]->m_context->recordInstructionExecuted(lanes[l],
+                                                     instruction->instruction);
+
+    // Lane-wise handlers are never used for terminators
+    lanes[l]->m_position.currInst++;
+  }
+  return true;
+}
+
+void WorkItem::storeMemory(unsigned addrSpace, size_t address, size_t size,
+                           unsigned alignment, const unsigned char* data)
+{
+  // Check address is correctly aligned
+  if (address & (alignment - 1))
+  {
+    m_context->logError("Invalid memory store - source pointer is "
+                        "not aligned to the pointed type");
+  }
+
+  // Stores are made directly unless plugins or a worker process need to
+  // know about them
+  if (!m_context->hasSubscribers(CallbackMemoryStore) &&
+      (addrSpace != AddrSpaceGlobal ||
+       !m_context->getGlobalMemory()->isTrackingWrites()))
+  {
+    unsigned char* dest = translateAddress(addrSpace, address, size);
+    if (dest)
+    {
+      memcpy(dest, data, size);
+      return;
+    }
+  }
+  getMemory(addrSpace)->store(data, address, size);
+}
+
+unsigned char* WorkItem::translateAddress(unsigned addrSpace, size_t address,
+                                          size_t size)
+{
+  if (addrSpace > AddrSpaceLocal)
+    return NULL;
+
+  const Memory* memory = getMemory(addrSpace);
+  MemoryTLBEntry& entry = m_tlb[addrSpace];
+  if (entry.memory != memory || entry.generation != memory->getGeneration() ||
+      address < entry.begin || address + size > entry.end)
+  {
+    // Miss: look up the buffer containing address
+    unsigned char* data =
+      memory->getBufferRange(address, &entry.begin, &entry.end);
+    if (!data || address + size > entry.end)
+    {
+      entry.memory = NULL;
+      return NULL;
+    }
+    entry.memory = memory;
+    entry.generation = memory->getGeneration();
+    entry.data = data;
+  }
+
+  return entry.data + (address - entry.begin);
+}
+
 ///////////////////////////////
 //// Instruction execution ////
 ///////////////////////////////
@@ -756,10 +1266,13 @@ WorkItem::State WorkItem::step()
 #define INSTRUCTION(name)                                                      \
   void WorkItem::name(const llvm::Instruction* instruction, TypedValue& result)
 
+// Resolve operand of the current instruction via its pre-computed slot
+#define OPERAND(i) getOperand(m_position.currInst->operands[i])
+
 INSTRUCTION(add)
 {
-  TypedValue opA = getOperand(instruction->getOperand(0));
-  TypedValue opB = getOperand(instruction->getOperand(1));
+  TypedValue opA = OPERAND(0);
+  TypedValue opB = OPERAND(1);
   for (unsigned i = 0; i < result.num; i++)
   {
     result.setUInt(opA.getUInt(i) + opB.getUInt(i), i);
@@ -781,14 +1294,14 @@ INSTRUCTION(alloc)
   result.setPointer(address);
 
   // Track allocation in stack frame
-  if (!m_position->allocations.empty())
-    m_position->allocations.top().push_back(address);
+  if (!m_frames.empty())
+    m_allocations.push_back(address);
 }
 
 INSTRUCTION(ashr)
 {
-  TypedValue opA = getOperand(instruction->getOperand(0));
-  TypedValue opB = getOperand(instruction->getOperand(1));
+  TypedValue opA = OPERAND(0);
+  TypedValue opB = OPERAND(1);
   uint64_t shiftMask =
     (result.num > 1 ? result.size
                     : max((size_t)result.size, sizeof(uint32_t))) *
@@ -802,7 +1315,7 @@ INSTRUCTION(ashr)
 
 INSTRUCTION(bitcast)
 {
-  TypedValue operand = getOperand(instruction->getOperand(0));
+  TypedValue operand = OPERAND(0);
   memcpy(result.data, operand.data, result.size * result.num);
 }
 
@@ -811,22 +1324,24 @@ INSTRUCTION(br)
   if (instruction->getNumOperands() == 1)
   {
     // Unconditional branch
-    m_position->nextBlock = (const llvm::BasicBlock*)instruction->getOperand(0);
+    m_position.nextBlock = (const llvm::BasicBlock*)instruction->getOperand(0);
+    followEdge(m_position.currInst->successors[0]);
   }
   else
   {
     // Conditional branch
-    bool pred = getOperand(instruction->getOperand(0)).getUInt();
+    bool pred = OPERAND(0).getUInt();
     const llvm::Value* iftrue = instruction->getOperand(2);
     const llvm::Value* iffalse = instruction->getOperand(1);
-    m_position->nextBlock = (const llvm::BasicBlock*)(pred ? iftrue : iffalse);
+    m_position.nextBlock = (const llvm::BasicBlock*)(pred ? iftrue : iffalse);
+    followEdge(m_position.currInst->successors[pred ? 0 : 1]);
   }
 }
 
 INSTRUCTION(bwand)
 {
-  TypedValue opA = getOperand(instruction->getOperand(0));
-  TypedValue opB = getOperand(instruction->getOperand(1));
+  TypedValue opA = OPERAND(0);
+  TypedValue opB = OPERAND(1);
   for (unsigned i = 0; i < result.num; i++)
   {
     result.setUInt(opA.getUInt(i) & opB.getUInt(i), i);
@@ -835,8 +1350,8 @@ INSTRUCTION(bwand)
 
 INSTRUCTION(bwor)
 {
-  TypedValue opA = getOperand(instruction->getOperand(0));
-  TypedValue opB = getOperand(instruction->getOperand(1));
+  TypedValue opA = OPERAND(0);
+  TypedValue opB = OPERAND(1);
   for (unsigned i = 0; i < result.num; i++)
   {
     result.setUInt(opA.getUInt(i) | opB.getUInt(i), i);
@@ -845,8 +1360,8 @@ INSTRUCTION(bwor)
 
 INSTRUCTION(bwxor)
 {
-  TypedValue opA = getOperand(instruction->getOperand(0));
-  TypedValue opB = getOperand(instruction->getOperand(1));
+  TypedValue opA = OPERAND(0);
+  TypedValue opB = OPERAND(1);
   for (unsigned i = 0; i < result.num; i++)
   {
     result.setUInt(opA.getUInt(i) ^ opB.getUInt(i), i);
@@ -870,17 +1385,16 @@ INSTRUCTION(call)
   // Check if function has definition
   if (!function->isDeclaration())
   {
-    m_position->callStack.push(&*m_position->currInst);
-    m_position->allocations.push(list<size_t>());
-    m_position->nextBlock = &*function->begin();
+    m_frames.push_back({m_position.currInst, m_allocations.size()});
+    m_position.nextBlock = &*function->begin();
+    followEdge(m_position.currInst->successors[0]);
 
     // Set function arguments
     llvm::Function::const_arg_iterator argItr;
     for (argItr = function->arg_begin(); argItr != function->arg_end();
          argItr++)
     {
-      const llvm::Value* arg = callInst->getArgOperand(argItr->getArgNo());
-      TypedValue value = getOperand(arg);
+      TypedValue value = OPERAND(argItr->getArgNo());
 
       if (argItr->hasByValAttr())
       {
@@ -888,34 +1402,34 @@ INSTRUCTION(call)
         void* data = m_privateMemory->getPointer(value.getPointer());
         size_t size = getTypeSize(argItr->getType()->getPointerElementType());
         size_t ptr = m_privateMemory->allocateBuffer(size, 0, (uint8_t*)data);
-        m_position->allocations.top().push_back(ptr);
+        m_allocations.push_back(ptr);
 
         // Pass new allocation to function
-        TypedValue address = {sizeof(size_t), 1, m_pool.alloc(sizeof(size_t))};
-        address.setPointer(ptr);
-        setValue(&*argItr, address);
+        getValue(&*argItr).setPointer(ptr);
       }
       else
       {
-        setValue(&*argItr, m_pool.clone(value));
+        setValue(&*argItr, value);
       }
     }
 
     return;
   }
 
-  // Call builtin function
-  InterpreterCache::Builtin builtin = m_cache->getBuiltin(function);
-  builtin.function.func(this, callInst, builtin.name, builtin.overload, result,
-                        builtin.function.op);
+  // Call builtin function, using the binding made when decoding the call
+  const InterpreterCache::Builtin* builtin = m_position.currInst->builtin;
+  if (!builtin)
+  {
+    builtin = &m_cache->getBuiltin(function);
+  }
+  builtin->function.func(this, callInst, builtin->name, builtin->overload,
+                         result, builtin->function.op);
 }
 
 INSTRUCTION(extractelem)
 {
-  const llvm::ExtractElementInst* extract =
-    (const llvm::ExtractElementInst*)instruction;
-  unsigned index = getOperand(extract->getIndexOperand()).getUInt();
-  TypedValue operand = getOperand(extract->getVectorOperand());
+  unsigned index = OPERAND(1).getUInt();
+  TypedValue operand = OPERAND(0);
   memcpy(result.data, operand.data + result.size * index, result.size);
 }
 
@@ -949,13 +1463,13 @@ INSTRUCTION(extractval)
   }
 
   // Copy target value to result
-  memcpy(result.data, getOperand(agg).data + offset, getTypeSize(type));
+  memcpy(result.data, OPERAND(0).data + offset, getTypeSize(type));
 }
 
 INSTRUCTION(fadd)
 {
-  TypedValue opA = getOperand(instruction->getOperand(0));
-  TypedValue opB = getOperand(instruction->getOperand(1));
+  TypedValue opA = OPERAND(0);
+  TypedValue opB = OPERAND(1);
   for (unsigned i = 0; i < result.num; i++)
   {
     result.setFloat(opA.getFloat(i) + opB.getFloat(i), i);
@@ -967,8 +1481,8 @@ INSTRUCTION(fcmp)
   const llvm::CmpInst* cmpInst = (const llvm::CmpInst*)instruction;
   llvm::CmpInst::Predicate pred = cmpInst->getPredicate();
 
-  TypedValue opA = getOperand(instruction->getOperand(0));
-  TypedValue opB = getOperand(instruction->getOperand(1));
+  TypedValue opA = OPERAND(0);
+  TypedValue opB = OPERAND(1);
 
   uint64_t t = result.num > 1 ? -1 : 1;
   for (unsigned i = 0; i < result.num; i++)
@@ -1027,8 +1541,8 @@ INSTRUCTION(fcmp)
 
 INSTRUCTION(fdiv)
 {
-  TypedValue opA = getOperand(instruction->getOperand(0));
-  TypedValue opB = getOperand(instruction->getOperand(1));
+  TypedValue opA = OPERAND(0);
+  TypedValue opB = OPERAND(1);
   for (unsigned i = 0; i < result.num; i++)
   {
     result.setFloat(opA.getFloat(i) / opB.getFloat(i), i);
@@ -1037,8 +1551,8 @@ INSTRUCTION(fdiv)
 
 INSTRUCTION(fmul)
 {
-  TypedValue opA = getOperand(instruction->getOperand(0));
-  TypedValue opB = getOperand(instruction->getOperand(1));
+  TypedValue opA = OPERAND(0);
+  TypedValue opB = OPERAND(1);
   for (unsigned i = 0; i < result.num; i++)
   {
     result.setFloat(opA.getFloat(i) * opB.getFloat(i), i);
@@ -1047,7 +1561,7 @@ INSTRUCTION(fmul)
 
 INSTRUCTION(fneg)
 {
-  TypedValue op = getOperand(instruction->getOperand(0));
+  TypedValue op = OPERAND(0);
   for (unsigned i = 0; i < result.num; i++)
   {
     result.setFloat(-op.getFloat(i), i);
@@ -1056,7 +1570,7 @@ INSTRUCTION(fneg)
 
 INSTRUCTION(fpext)
 {
-  TypedValue op = getOperand(instruction->getOperand(0));
+  TypedValue op = OPERAND(0);
   for (unsigned i = 0; i < result.num; i++)
   {
     result.setFloat(op.getFloat(i), i);
@@ -1065,7 +1579,7 @@ INSTRUCTION(fpext)
 
 INSTRUCTION(fptosi)
 {
-  TypedValue op = getOperand(instruction->getOperand(0));
+  TypedValue op = OPERAND(0);
   for (unsigned i = 0; i < result.num; i++)
   {
     result.setSInt((int64_t)op.getFloat(i), i);
@@ -1074,7 +1588,7 @@ INSTRUCTION(fptosi)
 
 INSTRUCTION(fptoui)
 {
-  TypedValue op = getOperand(instruction->getOperand(0));
+  TypedValue op = OPERAND(0);
   for (unsigned i = 0; i < result.num; i++)
   {
     result.setUInt((uint64_t)op.getFloat(i), i);
@@ -1083,8 +1597,8 @@ INSTRUCTION(fptoui)
 
 INSTRUCTION(frem)
 {
-  TypedValue opA = getOperand(instruction->getOperand(0));
-  TypedValue opB = getOperand(instruction->getOperand(1));
+  TypedValue opA = OPERAND(0);
+  TypedValue opB = OPERAND(1);
   for (unsigned i = 0; i < result.num; i++)
   {
     result.setFloat(fmod(opA.getFloat(i), opB.getFloat(i)), i);
@@ -1093,7 +1607,7 @@ INSTRUCTION(frem)
 
 INSTRUCTION(fptrunc)
 {
-  TypedValue op = getOperand(instruction->getOperand(0));
+  TypedValue op = OPERAND(0);
   for (unsigned i = 0; i < result.num; i++)
   {
     result.setFloat(op.getFloat(i), i);
@@ -1102,8 +1616,8 @@ INSTRUCTION(fptrunc)
 
 INSTRUCTION(fsub)
 {
-  TypedValue opA = getOperand(instruction->getOperand(0));
-  TypedValue opB = getOperand(instruction->getOperand(1));
+  TypedValue opA = OPERAND(0);
+  TypedValue opB = OPERAND(1);
   for (unsigned i = 0; i < result.num; i++)
   {
     result.setFloat(opA.getFloat(i) - opB.getFloat(i), i);
@@ -1116,15 +1630,14 @@ INSTRUCTION(gep)
     (const llvm::GetElementPtrInst*)instruction;
 
   // Get base address
-  size_t base = getOperand(gepInst->getPointerOperand()).getPointer();
+  size_t base = OPERAND(0).getPointer();
   const llvm::Type* ptrType = gepInst->getPointerOperandType();
 
   // Get indices
   std::vector<int64_t> offsets;
-  llvm::User::const_op_iterator opItr;
-  for (opItr = gepInst->idx_begin(); opItr != gepInst->idx_end(); opItr++)
+  for (unsigned i = 1; i < gepInst->getNumOperands(); i++)
   {
-    offsets.push_back(getOperand(opItr->get()).getSInt());
+    offsets.push_back(OPERAND(i).getSInt());
   }
 
   result.setPointer(resolveGEP(base, ptrType, offsets));
@@ -1135,8 +1648,8 @@ INSTRUCTION(icmp)
   const llvm::CmpInst* cmpInst = (const llvm::CmpInst*)instruction;
   llvm::CmpInst::Predicate pred = cmpInst->getPredicate();
 
-  TypedValue opA = getOperand(instruction->getOperand(0));
-  TypedValue opB = getOperand(instruction->getOperand(1));
+  TypedValue opA = OPERAND(0);
+  TypedValue opB = OPERAND(1);
 
   uint64_t t = result.num > 1 ? -1 : 1;
   for (unsigned i = 0; i < result.num; i++)
@@ -1190,9 +1703,9 @@ INSTRUCTION(icmp)
 
 INSTRUCTION(insertelem)
 {
-  TypedValue vector = getOperand(instruction->getOperand(0));
-  TypedValue element = getOperand(instruction->getOperand(1));
-  unsigned index = getOperand(instruction->getOperand(2)).getUInt();
+  TypedValue vector = OPERAND(0);
+  TypedValue element = OPERAND(1);
+  unsigned index = OPERAND(2).getUInt();
   memcpy(result.data, vector.data, result.size * result.num);
   memcpy(result.data + index * result.size, element.data, result.size);
 }
@@ -1204,7 +1717,7 @@ INSTRUCTION(insertval)
 
   // Load original aggregate data
   const llvm::Value* agg = insert->getAggregateOperand();
-  memcpy(result.data, getOperand(agg).data, result.size * result.num);
+  memcpy(result.data, OPERAND(0).data, result.size * result.num);
 
   // Compute offset for inserted value
   int offset = 0;
@@ -1231,13 +1744,13 @@ INSTRUCTION(insertval)
 
   // Copy inserted value into result
   const llvm::Value* value = insert->getInsertedValueOperand();
-  memcpy(result.data + offset, getOperand(value).data,
+  memcpy(result.data + offset, OPERAND(1).data,
          getTypeSize(value->getType()));
 }
 
 INSTRUCTION(inttoptr)
 {
-  TypedValue op = getOperand(instruction->getOperand(0));
+  TypedValue op = OPERAND(0);
   for (unsigned i = 0; i < result.num; i++)
   {
     result.setPointer(op.getUInt(i), i);
@@ -1246,7 +1759,7 @@ INSTRUCTION(inttoptr)
 
 INSTRUCTION(itrunc)
 {
-  TypedValue op = getOperand(instruction->getOperand(0));
+  TypedValue op = OPERAND(0);
   for (unsigned i = 0; i < result.num; i++)
   {
     result.setUInt(op.getUInt(i), i);
@@ -1256,28 +1769,20 @@ INSTRUCTION(itrunc)
 INSTRUCTION(load)
 {
   const llvm::LoadInst* loadInst = (const llvm::LoadInst*)instruction;
-  unsigned addressSpace = loadInst->getPointerAddressSpace();
   const llvm::Value* opPtr = loadInst->getPointerOperand();
-  size_t address = getOperand(opPtr).getPointer();
 
-  // Check address is correctly aligned
   unsigned alignment = loadInst->getAlignment();
   if (!alignment)
     alignment = getTypeAlignment(opPtr->getType()->getPointerElementType());
-  if (address & (alignment - 1))
-  {
-    m_context->logError("Invalid memory load - source pointer is "
-                        "not aligned to the pointed type");
-  }
 
-  // Load data
-  getMemory(addressSpace)->load(result.data, address, result.size * result.num);
+  loadMemory(loadInst->getPointerAddressSpace(), OPERAND(0).getPointer(),
+             result.size * result.num, alignment, result.data);
 }
 
 INSTRUCTION(lshr)
 {
-  TypedValue opA = getOperand(instruction->getOperand(0));
-  TypedValue opB = getOperand(instruction->getOperand(1));
+  TypedValue opA = OPERAND(0);
+  TypedValue opB = OPERAND(1);
   uint64_t shiftMask =
     (result.num > 1 ? result.size
                     : max((size_t)result.size, sizeof(uint32_t))) *
@@ -1291,8 +1796,8 @@ INSTRUCTION(lshr)
 
 INSTRUCTION(mul)
 {
-  TypedValue opA = getOperand(instruction->getOperand(0));
-  TypedValue opB = getOperand(instruction->getOperand(1));
+  TypedValue opA = OPERAND(0);
+  TypedValue opB = OPERAND(1);
   for (unsigned i = 0; i < result.num; i++)
   {
     result.setUInt(opA.getUInt(i) * opB.getUInt(i), i);
@@ -1301,15 +1806,12 @@ INSTRUCTION(mul)
 
 INSTRUCTION(phi)
 {
-  const llvm::PHINode* phiNode = (const llvm::PHINode*)instruction;
-  const llvm::Value* value = phiNode->getIncomingValueForBlock(
-    (const llvm::BasicBlock*)m_position->prevBlock);
-  memcpy(result.data, getOperand(value).data, result.size * result.num);
+  // Incoming value was moved into place when the edge was followed
 }
 
 INSTRUCTION(ptrtoint)
 {
-  TypedValue op = getOperand(instruction->getOperand(0));
+  TypedValue op = OPERAND(0);
   for (unsigned i = 0; i < result.num; i++)
   {
     result.setUInt(op.getPointer(i), i);
@@ -1320,32 +1822,38 @@ INSTRUCTION(ret)
 {
   const llvm::ReturnInst* retInst = (const llvm::ReturnInst*)instruction;
 
-  if (!m_position->callStack.empty())
+  if (!m_frames.empty())
   {
-    m_position->currInst =
-      llvm::BasicBlock::const_iterator(m_position->callStack.top());
-    m_position->currBlock = m_position->currInst->getParent();
-    m_position->callStack.pop();
+    // Resolve return value before leaving the callee
+    TypedValue returnValue = {0, 0, NULL};
+    if (retInst->getReturnValue())
+    {
+      returnValue = OPERAND(0);
+    }
+
+    const Frame& frame = m_frames.back();
+    m_position.currInst = frame.call;
+    m_position.currBlock = frame.call->instruction->getParent();
 
     // Set return value
-    const llvm::Value* returnVal = retInst->getReturnValue();
-    if (returnVal)
+    if (returnValue.data)
     {
-      setValue(&*m_position->currInst, m_pool.clone(getOperand(returnVal)));
+      TypedValue slot = getSlot(m_position.currInst->result);
+      memcpy(slot.data, returnValue.data, slot.size * slot.num);
     }
 
-    // Clear stack allocations
-    list<size_t>& allocs = m_position->allocations.top();
-    list<size_t>::iterator itr;
-    for (itr = allocs.begin(); itr != allocs.end(); itr++)
+    // Clear stack allocations, newest first so that the private memory
+    // arena can unwind
+    while (m_allocations.size() > frame.allocations)
     {
-      m_privateMemory->deallocateBuffer(*itr);
+      m_privateMemory->deallocateBuffer(m_allocations.back());
+      m_allocations.pop_back();
     }
-    m_position->allocations.pop();
+    m_frames.pop_back();
   }
   else
   {
-    m_position->nextBlock = NULL;
+    m_position.nextBlock = NULL;
     m_state = FINISHED;
     m_workGroup->notifyFinished(this);
   }
@@ -1353,8 +1861,8 @@ INSTRUCTION(ret)
 
 INSTRUCTION(sdiv)
 {
-  TypedValue opA = getOperand(instruction->getOperand(0));
-  TypedValue opB = getOperand(instruction->getOperand(1));
+  TypedValue opA = OPERAND(0);
+  TypedValue opB = OPERAND(1);
   for (unsigned i = 0; i < result.num; i++)
   {
     int64_t a = opA.getSInt(i);
@@ -1371,15 +1879,14 @@ INSTRUCTION(sdiv)
 INSTRUCTION(select)
 {
   const llvm::SelectInst* selectInst = (const llvm::SelectInst*)instruction;
-  TypedValue opCondition = getOperand(selectInst->getCondition());
+  TypedValue opCondition = OPERAND(0);
   for (unsigned i = 0; i < result.num; i++)
   {
     const bool cond = selectInst->getCondition()->getType()->isVectorTy()
                         ? opCondition.getUInt(i)
                         : opCondition.getUInt();
-    const llvm::Value* op =
-      cond ? selectInst->getTrueValue() : selectInst->getFalseValue();
-    memcpy(result.data + i * result.size, getOperand(op).data + i * result.size,
+    TypedValue op = cond ? OPERAND(1) : OPERAND(2);
+    memcpy(result.data + i * result.size, op.data + i * result.size,
            result.size);
   }
 }
@@ -1387,7 +1894,7 @@ INSTRUCTION(select)
 INSTRUCTION(sext)
 {
   const llvm::Value* operand = instruction->getOperand(0);
-  TypedValue value = getOperand(operand);
+  TypedValue value = OPERAND(0);
   for (unsigned i = 0; i < result.num; i++)
   {
     int64_t val = value.getSInt(i);
@@ -1401,8 +1908,8 @@ INSTRUCTION(sext)
 
 INSTRUCTION(shl)
 {
-  TypedValue opA = getOperand(instruction->getOperand(0));
-  TypedValue opB = getOperand(instruction->getOperand(1));
+  TypedValue opA = OPERAND(0);
+  TypedValue opB = OPERAND(1);
   uint64_t shiftMask =
     (result.num > 1 ? result.size
                     : max((size_t)result.size, sizeof(uint32_t))) *
@@ -1420,13 +1927,12 @@ INSTRUCTION(shuffle)
     (const llvm::ShuffleVectorInst*)instruction;
 
   const llvm::Value* v1 = shuffle->getOperand(0);
-  const llvm::Value* v2 = shuffle->getOperand(1);
 
   unsigned num =
     llvm::cast<llvm::FixedVectorType>(v1->getType())->getNumElements();
   for (unsigned i = 0; i < result.num; i++)
   {
-    const llvm::Value* src = v1;
+    unsigned src = 0;
     int index = shuffle->getMaskValue(i);
     if (index == llvm::UndefMaskElem)
     {
@@ -1437,16 +1943,16 @@ INSTRUCTION(shuffle)
     if (index >= num)
     {
       index -= num;
-      src = v2;
+      src = 1;
     }
     memcpy(result.data + i * result.size,
-           getOperand(src).data + index * result.size, result.size);
+           OPERAND(src).data + index * result.size, result.size);
   }
 }
 
 INSTRUCTION(sitofp)
 {
-  TypedValue op = getOperand(instruction->getOperand(0));
+  TypedValue op = OPERAND(0);
   for (unsigned i = 0; i < result.num; i++)
   {
     result.setFloat(op.getSInt(i), i);
@@ -1455,8 +1961,8 @@ INSTRUCTION(sitofp)
 
 INSTRUCTION(srem)
 {
-  TypedValue opA = getOperand(instruction->getOperand(0));
-  TypedValue opB = getOperand(instruction->getOperand(1));
+  TypedValue opA = OPERAND(0);
+  TypedValue opB = OPERAND(1);
   for (unsigned i = 0; i < result.num; i++)
   {
     int64_t a = opA.getSInt(i);
@@ -1473,30 +1979,21 @@ INSTRUCTION(srem)
 INSTRUCTION(store)
 {
   const llvm::StoreInst* storeInst = (const llvm::StoreInst*)instruction;
-  unsigned addressSpace = storeInst->getPointerAddressSpace();
   const llvm::Value* opPtr = storeInst->getPointerOperand();
-  size_t address = getOperand(opPtr).getPointer();
 
-  // Check address is correctly aligned
   unsigned alignment = storeInst->getAlignment();
   if (!alignment)
     alignment = getTypeAlignment(opPtr->getType()->getPointerElementType());
-  if (address & (alignment - 1))
-  {
-    m_context->logError("Invalid memory store - source pointer is "
-                        "not aligned to the pointed type");
-  }
 
-  // Store data
-  TypedValue operand = getOperand(storeInst->getValueOperand());
-  getMemory(addressSpace)
-    ->store(operand.data, address, operand.size * operand.num);
+  TypedValue operand = OPERAND(0);
+  storeMemory(storeInst->getPointerAddressSpace(), OPERAND(1).getPointer(),
+              operand.size * operand.num, alignment, operand.data);
 }
 
 INSTRUCTION(sub)
 {
-  TypedValue opA = getOperand(instruction->getOperand(0));
-  TypedValue opB = getOperand(instruction->getOperand(1));
+  TypedValue opA = OPERAND(0);
+  TypedValue opB = OPERAND(1);
   for (unsigned i = 0; i < result.num; i++)
   {
     result.setUInt(opA.getUInt(i) - opB.getUInt(i), i);
@@ -1506,27 +2003,28 @@ INSTRUCTION(sub)
 INSTRUCTION(swtch)
 {
   const llvm::SwitchInst* swtch = (const llvm::SwitchInst*)instruction;
-  const llvm::Value* cond = swtch->getCondition();
-  uint64_t val = getOperand(cond).getUInt();
+  uint64_t val = OPERAND(0).getUInt();
 
   // Look for case matching condition value
   for (auto C : swtch->cases())
   {
     if (C.getCaseValue()->getZExtValue() == val)
     {
-      m_position->nextBlock = C.getCaseSuccessor();
+      m_position.nextBlock = C.getCaseSuccessor();
+      followEdge(m_position.currInst->successors[C.getSuccessorIndex()]);
       return;
     }
   }
 
   // No matching cases - use default
-  m_position->nextBlock = swtch->getDefaultDest();
+  m_position.nextBlock = swtch->getDefaultDest();
+  followEdge(m_position.currInst->successors[0]);
 }
 
 INSTRUCTION(udiv)
 {
-  TypedValue opA = getOperand(instruction->getOperand(0));
-  TypedValue opB = getOperand(instruction->getOperand(1));
+  TypedValue opA = OPERAND(0);
+  TypedValue opB = OPERAND(1);
   for (unsigned i = 0; i < result.num; i++)
   {
     uint64_t a = opA.getUInt(i);
@@ -1537,7 +2035,7 @@ INSTRUCTION(udiv)
 
 INSTRUCTION(uitofp)
 {
-  TypedValue op = getOperand(instruction->getOperand(0));
+  TypedValue op = OPERAND(0);
   for (unsigned i = 0; i < result.num; i++)
   {
     uint64_t in = op.getUInt(i);
@@ -1550,8 +2048,8 @@ INSTRUCTION(uitofp)
 
 INSTRUCTION(urem)
 {
-  TypedValue opA = getOperand(instruction->getOperand(0));
-  TypedValue opB = getOperand(instruction->getOperand(1));
+  TypedValue opA = OPERAND(0);
+  TypedValue opB = OPERAND(1);
   for (unsigned i = 0; i < result.num; i++)
   {
     uint64_t a = opA.getUInt(i);
@@ -1562,7 +2060,7 @@ INSTRUCTION(urem)
 
 INSTRUCTION(zext)
 {
-  TypedValue operand = getOperand(instruction->getOperand(0));
+  TypedValue operand = OPERAND(0);
   for (unsigned i = 0; i < result.num; i++)
   {
     result.setUInt(operand.getUInt(i), i);
@@ -1571,20 +2069,254 @@ INSTRUCTION(zext)
 
 INSTRUCTION(freeze)
 {
-  TypedValue operand = getOperand(instruction->getOperand(0));
+  TypedValue operand = OPERAND(0);
   memcpy(result.data, operand.data, result.size * result.num);
 }
 
+INSTRUCTION(unreachable)
+{
+  FATAL_ERROR("Encountered unreachable instruction");
+}
+
+INSTRUCTION(unsupported)
+{
+  FATAL_ERROR("Unsupported instruction: %s", instruction->getOpcodeName());
+}
+
+template <typename T, unsigned N, class Op> INSTRUCTION(binaryOp)
+{
+  const T* a = (const T*)OPERAND(0).data;
+  const T* b = (const T*)OPERAND(1).data;
+  T* r = (T*)result.data;
+  for (unsigned i = 0; i < (N ? N : result.num); i++)
+  {
+    r[i] = Op()(a[i], b[i]);
+  }
+}
+
+template <typename T, unsigned N, unsigned P> INSTRUCTION(compareOp)
+{
+  const T* a = (const T*)OPERAND(0).data;
+  const T* b = (const T*)OPERAND(1).data;
+  uint8_t t = result.num > 1 ? -1 : 1;
+  for (unsigned i = 0; i < (N ? N : result.num); i++)
+  {
+    result.data[i] = compare<P>(a[i], b[i]) ? t : 0;
+  }
+}
+
+template <typename To, typename From, unsigned N> INSTRUCTION(convertOp)
+{
+  const From* a = (const From*)OPERAND(0).data;
+  To* r = (To*)result.data;
+  for (unsigned i = 0; i < (N ? N : result.num); i++)
+  {
+    r[i] = a[i];
+  }
+}
+
+template <typename T, unsigned N> INSTRUCTION(selectOp)
+{
+  const T* a = (const T*)(*OPERAND(0).data ? OPERAND(1) : OPERAND(2)).data;
+  T* r = (T*)result.data;
+  for (unsigned i = 0; i < (N ? N : result.num); i++)
+  {
+    r[i] = a[i];
+  }
+}
+
 #undef INSTRUCTION
+#undef OPERAND
 
 ////////////////////////////////
 // WorkItem::InterpreterCache //
 ////////////////////////////////
 
-InterpreterCache::InterpreterCache(llvm::Function* kernel)
+// Check whether a constant expression can be evaluated ahead of time
+static bool isFoldable(const llvm::Constant* constant)
+{
+  if (constant->getValueID() == llvm::Value::FunctionVal)
+  {
+    return false;
+  }
+  else if (constant->getValueID() == llvm::Value::ConstantExprVal)
+  {
+    for (auto O = constant->op_begin(); O != constant->op_end(); O++)
+    {
+      if (!isFoldable((const llvm::Constant*)O->get()))
+      {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// Find how widely a value that isn't an instruction is shared between
+// work-items, which for pointers depends on the memory they point to
+static InterpreterCache::Uniformity
+getValueUniformity(const llvm::Value* value)
+{
+  if (value->getType()->isPointerTy() &&
+      (llvm::isa<llvm::Argument>(value) ||
+       llvm::isa<llvm::GlobalVariable>(value)))
+  {
+    // Each work-item has its own private copy of the pointee
+    switch (value->getType()->getPointerAddressSpace())
+    {
+    case AddrSpacePrivate:
+      return InterpreterCache::Varying;
+    case AddrSpaceLocal:
+      return InterpreterCache::GroupUniform;
+    default:
+      return InterpreterCache::KernelUniform;
+    }
+  }
+  else if (llvm::isa<llvm::Argument>(value))
+  {
+    return InterpreterCache::KernelUniform;
+  }
+  else if (llvm::isa<llvm::Constant>(value) &&
+           !llvm::isa<llvm::GlobalValue>(value))
+  {
+    // Constants may contain the addresses of variables
+    const llvm::Constant* constant = (const llvm::Constant*)value;
+    if (value->getValueID() == llvm::Value::ConstantExprVal &&
+        !isFoldable(constant))
+      return InterpreterCache::Varying;
+
+    InterpreterCache::Uniformity uniformity = InterpreterCache::KernelUniform;
+    for (auto O = constant->op_begin(); O != constant->op_end(); O++)
+      uniformity = min(uniformity, getValueUniformity(O->get()));
+    return uniformity;
+  }
+  return InterpreterCache::Varying;
+}
+
+// Version of the format written by InterpreterCache::serialize()
+#define SERIALIZED_CACHE_VERSION 1
+
+// Analysis results for a kernel, in a form that does not depend on the
+// addresses of IR objects
+struct InterpreterCache::SerializedState
+{
+  struct Constant
+  {
+    uint32_t size, num;
+    std::string data;
+  };
+
+  // How a builtin call was resolved, keyed by callee name
+  struct Builtin
+  {
+    std::string name, overload;
+    uint32_t prefix;
+    std::string key;
+  };
+
+  std::vector<std::pair<uint32_t, uint32_t>> values;
+  std::vector<Constant> constants;
+  std::unordered_map<std::string, Builtin> builtins;
+
+  bool parse(const std::string& data);
+};
+
+bool InterpreterCache::SerializedState::parse(const string& data)
+{
+  size_t offset = 0;
+  uint32_t version, count;
+  if (!readBinary(data, offset, version) ||
+      version != SERIALIZED_CACHE_VERSION)
+  {
+    return false;
+  }
+
+  // Each entry takes at least one byte, so larger counts are malformed
+  if (!readBinary(data, offset, count) || count > data.size())
+  {
+    return false;
+  }
+  values.resize(count);
+  for (unsigned i = 0; i < count; i++)
+  {
+    if (!readBinary(data, offset, values[i].first) ||
+        !readBinary(data, offset, values[i].second))
+    {
+      return false;
+    }
+  }
+
+  if (!readBinary(data, offset, count) || count > data.size())
+  {
+    return false;
+  }
+  constants.resize(count);
+  for (unsigned i = 0; i < count; i++)
+  {
+    if (!readBinary(data, offset, constants[i].size) ||
+        !readBinary(data, offset, constants[i].num) ||
+        !readBinary(data, offset, constants[i].data))
+    {
+      return false;
+    }
+  }
+
+  if (!readBinary(data, offset, count) || count > data.size())
+  {
+    return false;
+  }
+  for (unsigned i = 0; i < count; i++)
+  {
+    string callee;
+    Builtin builtin;
+    if (!readBinary(data, offset, callee) ||
+        !readBinary(data, offset, builtin.name) ||
+        !readBinary(data, offset, builtin.overload) ||
+        !readBinary(data, offset, builtin.prefix) ||
+        !readBinary(data, offset, builtin.key))
+    {
+      return false;
+    }
+    builtins[callee] = builtin;
+  }
+
+  return offset == data.size();
+}
+
+InterpreterCache::InterpreterCache(llvm::Function* kernel,
+                                   const string* serialized)
+{
+  m_numUniformValues = 0;
+  m_restore = NULL;
+  m_restoreFailed = false;
+
+  // Reuse serialized results if they match this kernel, otherwise discard
+  // whatever was restored and analyze the kernel from scratch
+  SerializedState state;
+  if (serialized && state.parse(*serialized))
+  {
+    m_restore = &state;
+    analyze(kernel);
+    m_restore = NULL;
+    if (!m_restoreFailed)
+    {
+      return;
+    }
+    clear();
+  }
+
+  analyze(kernel);
+}
+
+InterpreterCache::~InterpreterCache()
+{
+  clear();
+}
+
+void InterpreterCache::analyze(llvm::Function* kernel)
 {
   // TODO: Determine this number dynamically?
-  m_valueIDs.reserve(1024);
+  m_valueIDs.reserve(m_restore ? m_restore->values.size() : 1024);
 
   // Add global variables to cache
   // TODO: Only add variables that are used?
@@ -1595,17 +2327,15 @@ InterpreterCache::InterpreterCache(llvm::Function* kernel)
     addValueID(&*G);
   }
 
-  set<llvm::Function*> processed;
-  set<llvm::Function*> pending;
-
-  pending.insert(kernel);
+  // Process functions in the order they are first called, so that value IDs
+  // and constants are assigned in the same order for the same module
+  vector<llvm::Function*> functions(1, kernel);
+  set<llvm::Function*> queued;
+  queued.insert(kernel);
 
-  while (!pending.empty())
+  for (unsigned f = 0; f < functions.size(); f++)
   {
-    // Get next function to process
-    llvm::Function* function = *pending.begin();
-    processed.insert(function);
-    pending.erase(function);
+    llvm::Function* function = functions[f];
 
     // Iterate through the function arguments
     llvm::Function::arg_iterator A;
@@ -1631,10 +2361,10 @@ InterpreterCache::InterpreterCache(llvm::Function* kernel)
           // Resolve builtin function calls
           addBuiltin(callee);
         }
-        else if (!processed.count(callee))
+        else if (queued.insert(callee).second)
         {
           // Process called function
-          pending.insert(callee);
+          functions.push_back(callee);
         }
       }
 
@@ -1646,15 +2376,223 @@ InterpreterCache::InterpreterCache(llvm::Function* kernel)
       }
     }
   }
+
+  // Check that restored results cover exactly the values, constants and
+  // builtins found in this kernel
+  if (m_restore && (m_restore->values.size() != m_valueIDs.size() ||
+                    m_restore->constants.size() != m_constantPool.size() ||
+                    m_restore->builtins.size() != m_builtins.size()))
+  {
+    m_restore = NULL;
+    m_restoreFailed = true;
+  }
+
+  // Bind builtins to versions specialized for their argument types
+  for (auto B = m_builtins.begin(); B != m_builtins.end(); B++)
+  {
+    B->second.function =
+      specializeBuiltin(B->second.function, B->second.overload, B->first);
+  }
+
+  // Lay out register frame in value ID order, so that values from the same
+  // function end up close together
+  vector<const llvm::Value*> values(m_valueIDs.size());
+  for (auto V = m_valueIDs.begin(); V != m_valueIDs.end(); V++)
+  {
+    values[V->second] = V->first;
+  }
+  m_frameSize = 0;
+  m_frameLayout.resize(values.size());
+  for (unsigned i = 0; i < values.size(); i++)
+  {
+    pair<unsigned, unsigned> size =
+      m_restore ? m_restore->values[i] : getValueSize(values[i]);
+    m_frameLayout[i].size = size.first;
+    m_frameLayout[i].num = size.second;
+    m_frameLayout[i].offset = allocateFrameSlot(size.first, size.second);
+  }
+
+  // Build decoded instruction stream
+  for (auto F = functions.begin(); F != functions.end(); F++)
+  {
+    decodeFunction(*F);
+  }
+
+  // Resolve branch targets, function entry points and operand slots
+  for (auto I = m_instructions.begin(); I != m_instructions.end(); I++)
+  {
+    const llvm::Instruction* instruction = I->instruction;
+    decodeOperands(*I, instruction);
+    if (instruction->isTerminator())
+    {
+      for (unsigned s = 0; s < instruction->getNumSuccessors(); s++)
+      {
+        Edge edge = {getBlockEntry(instruction->getSuccessor(s))};
+        I->successors.push_back(edge);
+      }
+    }
+    else if (instruction->getOpcode() == llvm::Instruction::Call)
+    {
+      const llvm::CallInst* call = (const llvm::CallInst*)instruction;
+      const llvm::Function* callee = (const llvm::Function*)call
+                                       ->getCalledOperand()
+                                       ->stripPointerCasts();
+      if (!callee->isDeclaration())
+      {
+        Edge edge = {getBlockEntry(&*callee->begin())};
+        I->successors.push_back(edge);
+      }
+      else
+      {
+        I->builtin = &getBuiltin(callee);
+      }
+    }
+  }
+
+  // Build phi move lists for each control flow edge
+  for (auto I = m_instructions.begin(); I != m_instructions.end(); I++)
+  {
+    const llvm::Instruction* instruction = I->instruction;
+    if (instruction->isTerminator())
+    {
+      for (unsigned s = 0; s < instruction->getNumSuccessors(); s++)
+      {
+        addPhiMoves(I->successors[s], instruction->getParent(),
+                    instruction->getSuccessor(s));
+      }
+    }
+  }
+
+  analyzeUniformity(kernel);
 }
 
-InterpreterCache::~InterpreterCache()
+void InterpreterCache::analyzeUniformity(const llvm::Function* kernel)
+{
+  // Work-item functions with results shared by a work-group or kernel
+  static const unordered_map<string, Uniformity> workItemFunctions = {
+    {"get_enqueued_local_size", KernelUniform},
+    {"get_global_offset", KernelUniform},
+    {"get_global_size", KernelUniform},
+    {"get_group_id", GroupUniform},
+    {"get_local_size", GroupUniform},
+    {"get_num_groups", KernelUniform},
+    {"get_work_dim", KernelUniform},
+  };
+
+  // Phi nodes are treated as varying, as they can depend on control flow,
+  // so the remaining instructions compute the same result each time they
+  // run if their operands are uniform (which takes a pass per level of
+  // instructions that use the results of later blocks)
+  unordered_map<const llvm::Value*, Uniformity> uniform;
+  bool changed = true;
+  while (changed)
+  {
+    changed = false;
+    for (auto I = inst_begin(kernel); I != inst_end(kernel); I++)
+    {
+      const llvm::Instruction* instruction = &*I;
+      if (uniform.count(instruction) || instruction->getType()->isVoidTy())
+        continue;
+
+      Uniformity uniformity = KernelUniform;
+      unsigned numOperands = instruction->getNumOperands();
+      switch (instruction->getOpcode())
+      {
+      case llvm::Instruction::Call:
+      {
+        // Builtins must have no side effects, or be work-item functions
+        const llvm::CallInst* call = (const llvm::CallInst*)instruction;
+        const llvm::Function* callee =
+          (const llvm::Function*)call->getCalledOperand()->stripPointerCasts();
+        if (!callee->isDeclaration())
+        {
+          uniformity = Varying;
+          break;
+        }
+        const Builtin& builtin = getBuiltin(callee);
+        auto query = workItemFunctions.find(builtin.name);
+        if (query != workItemFunctions.end())
+          uniformity = query->second;
+        else if (!builtin.function.pure)
+          uniformity = Varying;
+
+        // Skip the callee, and reject arguments that results are written to
+        numOperands = call->arg_size();
+        for (unsigned i = 0; i < numOperands; i++)
+        {
+          if (call->getArgOperand(i)->getType()->isPointerTy())
+            uniformity = Varying;
+        }
+        break;
+      }
+      case llvm::Instruction::Alloca:
+      case llvm::Instruction::Load:
+      case llvm::Instruction::PHI:
+      case llvm::Instruction::AtomicCmpXchg:
+      case llvm::Instruction::AtomicRMW:
+        uniformity = Varying;
+        break;
+      default:
+        break;
+      }
+
+      for (unsigned i = 0; i < numOperands && uniformity != Varying; i++)
+      {
+        const llvm::Value* operand = instruction->getOperand(i);
+        Uniformity operandUniformity;
+        if (llvm::isa<llvm::Instruction>(operand))
+        {
+          auto itr = uniform.find(operand);
+          operandUniformity = itr == uniform.end() ? Varying : itr->second;
+        }
+        else
+        {
+          operandUniformity = getValueUniformity(operand);
+        }
+        uniformity = min(uniformity, operandUniformity);
+      }
+
+      if (uniformity != Varying)
+      {
+        uniform[instruction] = uniformity;
+        changed = true;
+      }
+    }
+  }
+
+  // Share the results of uniform instructions that cost more to execute
+  // than to copy
+  for (auto I = m_instructions.begin(); I != m_instructions.end(); I++)
+  {
+    auto itr = uniform.find(I->instruction);
+    if (itr == uniform.end())
+      continue;
+
+    switch (I->instruction->getOpcode())
+    {
+    case llvm::Instruction::Call:
+    case llvm::Instruction::FDiv:
+    case llvm::Instruction::FRem:
+    case llvm::Instruction::GetElementPtr:
+    case llvm::Instruction::SDiv:
+    case llvm::Instruction::SRem:
+    case llvm::Instruction::UDiv:
+    case llvm::Instruction::URem:
+      I->uniformity = itr->second;
+      I->uniformIndex = m_numUniformValues++;
+      break;
+    default:
+      break;
+    }
+  }
+}
+
+void InterpreterCache::clear()
 {
-  ConstantMap::iterator constItr;
-  for (constItr = m_constants.begin(); constItr != m_constants.end();
-       constItr++)
+  for (auto constItr = m_constantPool.begin();
+       constItr != m_constantPool.end(); constItr++)
   {
-    delete[] constItr->second.data;
+    delete[] constItr->data;
   }
 
   ConstExprMap::iterator constExprItr;
@@ -1663,6 +2601,18 @@ InterpreterCache::~InterpreterCache()
   {
     constExprItr->second->deleteValue();
   }
+
+  m_instructions.clear();
+  m_constExprInstructions.clear();
+  m_constantPool.clear();
+  m_blockEntries.clear();
+  m_builtins.clear();
+  m_constants.clear();
+  m_constExpressions.clear();
+  m_valueIDs.clear();
+  m_frameLayout.clear();
+  m_frameSize = 0;
+  m_numUniformValues = 0;
 }
 
 void InterpreterCache::addBuiltin(const llvm::Function* function)
@@ -1674,6 +2624,45 @@ void InterpreterCache::addBuiltin(const llvm::Function* function)
     return;
   }
 
+  if (m_restore)
+  {
+    // Look up builtin using the resolution from a previous analysis
+    auto rItr = m_restore->builtins.find(function->getName().str());
+    if (rItr != m_restore->builtins.end())
+    {
+      const SerializedState::Builtin& record = rItr->second;
+      if (!record.prefix)
+      {
+        BuiltinFunctionMap::iterator bItr = workItemBuiltins.find(record.key);
+        if (bItr != workItemBuiltins.end())
+        {
+          const InterpreterCache::Builtin builtin = {
+            bItr->second, record.name, record.overload};
+          m_builtins[function] = builtin;
+          return;
+        }
+      }
+      else
+      {
+        BuiltinFunctionPrefixList::iterator pItr;
+        for (pItr = workItemPrefixBuiltins.begin();
+             pItr != workItemPrefixBuiltins.end(); pItr++)
+        {
+          if (pItr->first == record.key)
+          {
+            const InterpreterCache::Builtin builtin = {
+              pItr->second, record.name, record.overload};
+            m_builtins[function] = builtin;
+            return;
+          }
+        }
+      }
+    }
+
+    m_restore = NULL;
+    m_restoreFailed = true;
+  }
+
   // Extract unmangled name and overload
   string name, overload;
   const string fullname = function->getName().str();
@@ -1718,12 +2707,66 @@ void InterpreterCache::addBuiltin(const llvm::Function* function)
   FATAL_ERROR("Undefined external function: %s", name.c_str());
 }
 
-InterpreterCache::Builtin
+const InterpreterCache::Builtin&
 InterpreterCache::getBuiltin(const llvm::Function* function) const
 {
   return m_builtins.at(function);
 }
 
+const InterpreterCache::DecodedInstruction*
+InterpreterCache::getBlockEntry(const llvm::BasicBlock* block) const
+{
+  BlockMap::const_iterator itr = m_blockEntries.find(block);
+  if (itr == m_blockEntries.end())
+  {
+    FATAL_ERROR("Basic block not found in cache");
+  }
+  return &m_instructions[itr->second];
+}
+
+void InterpreterCache::decodeFunction(const llvm::Function* function)
+{
+  // Specialized handlers can be disabled, to check them against the generic
+  // ones for each opcode
+  bool specialize = !checkEnv("OCLGRIND_DISABLE_SPECIALIZATION");
+  for (auto B = function->begin(); B != function->end(); B++)
+  {
+    m_blockEntries[&*B] = m_instructions.size();
+    for (auto I = B->begin(); I != B->end(); I++)
+    {
+      DecodedInstruction decoded;
+      decoded.instruction = &*I;
+      decoded.result = getValueID(&*I);
+      decoded.size = m_frameLayout[decoded.result].size;
+      decoded.num = m_frameLayout[decoded.result].num;
+      if (specialize)
+      {
+        decoded.handler = WorkItem::getInstructionHandler(
+          &*I, decoded.size, decoded.num, &decoded.laneHandler);
+      }
+      else
+      {
+        decoded.handler = WorkItem::getInstructionHandler(I->getOpcode());
+        decoded.laneHandler = NULL;
+      }
+      decoded.builtin = NULL;
+      decoded.uniformity = Varying;
+      decoded.uniformIndex = 0;
+      m_instructions.push_back(decoded);
+    }
+  }
+}
+
+void InterpreterCache::decodeOperands(DecodedInstruction& decoded,
+                                      const llvm::User* user)
+{
+  decoded.operands.clear();
+  for (unsigned i = 0; i < user->getNumOperands(); i++)
+  {
+    decoded.operands.push_back(getOperandSlot(user->getOperand(i)));
+  }
+}
+
 void InterpreterCache::addConstant(const llvm::Value* value)
 {
   // Check if constant already in cache
@@ -1733,35 +2776,61 @@ void InterpreterCache::addConstant(const llvm::Value* value)
   }
 
   // Create constant and add to cache
-  pair<unsigned, unsigned> size = getValueSize(value);
   TypedValue constant;
-  constant.size = size.first;
-  constant.num = size.second;
-  constant.data = new unsigned char[getTypeSize(value->getType())];
-  getConstantData(constant.data, (const llvm::Constant*)value);
+  unsigned bytes = getTypeSize(value->getType());
+  constant.data = new unsigned char[bytes];
+  if (m_restore && m_constantPool.size() < m_restore->constants.size() &&
+      m_restore->constants[m_constantPool.size()].data.size() == bytes)
+  {
+    // Constants are restored in the order they were originally added
+    const SerializedState::Constant& restored =
+      m_restore->constants[m_constantPool.size()];
+    constant.size = restored.size;
+    constant.num = restored.num;
+    memcpy(constant.data, restored.data.data(), bytes);
+  }
+  else
+  {
+    if (m_restore)
+    {
+      m_restore = NULL;
+      m_restoreFailed = true;
+    }
+
+    pair<unsigned, unsigned> size = getValueSize(value);
+    constant.size = size.first;
+    constant.num = size.second;
+    getConstantData(constant.data, (const llvm::Constant*)value);
+  }
 
-  m_constants[value] = constant;
+  m_constants[value] = m_constantPool.size();
+  m_constantPool.push_back(constant);
 }
 
-TypedValue InterpreterCache::getConstant(const llvm::Value* operand) const
+const vector<InterpreterCache::DecodedInstruction>&
+InterpreterCache::getConstantExpressions() const
 {
-  ConstantMap::const_iterator itr = m_constants.find(operand);
-  if (itr == m_constants.end())
-  {
-    FATAL_ERROR("Constant not found in cache (ID %d)", operand->getValueID());
-  }
-  return itr->second;
+  return m_constExprInstructions;
 }
 
-const llvm::Instruction*
-InterpreterCache::getConstantExpr(const llvm::Value* expr) const
+InterpreterCache::OperandSlot
+InterpreterCache::getOperandSlot(const llvm::Value* operand) const
 {
-  ConstExprMap::const_iterator itr = m_constExpressions.find(expr);
-  if (itr == m_constExpressions.end())
+  ConstantMap::const_iterator constItr = m_constants.find(operand);
+  if (constItr != m_constants.end())
   {
-    FATAL_ERROR("Constant expression not found in cache");
+    OperandSlot slot = {true, constItr->second};
+    return slot;
   }
-  return itr->second;
+
+  ValueMap::const_iterator valueItr = m_valueIDs.find(operand);
+  if (valueItr != m_valueIDs.end())
+  {
+    OperandSlot slot = {false, valueItr->second};
+    return slot;
+  }
+
+  FATAL_ERROR("Unhandled operand type: %d", operand->getValueID());
 }
 
 unsigned InterpreterCache::addValueID(const llvm::Value* value)
@@ -1791,6 +2860,67 @@ unsigned InterpreterCache::getNumValues() const
   return m_valueIDs.size();
 }
 
+size_t InterpreterCache::allocateFrameSlot(unsigned size, unsigned num)
+{
+  // Align vector-sized slots to 16 bytes, everything else to 8 bytes
+  size_t bytes = size * num;
+  size_t alignment = bytes >= 16 ? 16 : 8;
+  m_frameSize = (m_frameSize + alignment - 1) & ~(alignment - 1);
+
+  size_t offset = m_frameSize;
+  m_frameSize += bytes;
+  return offset;
+}
+
+void InterpreterCache::addPhiMoves(Edge& edge, const llvm::BasicBlock* pred,
+                                   const llvm::BasicBlock* succ)
+{
+  set<unsigned> dests;
+  for (auto phi = succ->phis().begin(); phi != succ->phis().end(); phi++)
+  {
+    const llvm::Value* incoming = phi->getIncomingValueForBlock(pred);
+    PhiMove move = {getOperandSlot(incoming), getValueID(&*phi), 0};
+    edge.phiMoves.push_back(move);
+    dests.insert(move.dest);
+  }
+
+  // Moves need staging through scratch slots if any of them read a phi
+  // that is written by another move on the same edge
+  edge.parallel = false;
+  for (auto move = edge.phiMoves.begin(); move != edge.phiMoves.end(); move++)
+  {
+    if (!move->source.constant && dests.count(move->source.index))
+    {
+      edge.parallel = true;
+    }
+  }
+  if (edge.parallel)
+  {
+    for (auto move = edge.phiMoves.begin(); move != edge.phiMoves.end();
+         move++)
+    {
+      const FrameSlot& slot = m_frameLayout[move->dest];
+      move->scratch = allocateFrameSlot(slot.size, slot.num);
+    }
+  }
+}
+
+const vector<InterpreterCache::FrameSlot>&
+InterpreterCache::getFrameLayout() const
+{
+  return m_frameLayout;
+}
+
+size_t InterpreterCache::getFrameSize() const
+{
+  return m_frameSize;
+}
+
+unsigned InterpreterCache::getNumUniformValues() const
+{
+  return m_numUniformValues;
+}
+
 bool InterpreterCache::hasValue(const llvm::Value* value) const
 {
   return m_valueIDs.count(value);
@@ -1822,8 +2952,31 @@ void InterpreterCache::addOperand(const llvm::Value* operand)
       {
         addOperand(*O);
       }
-      m_constExpressions[expr] = getConstExprAsInstruction(expr);
-      // TODO: Resolve actual value?
+      llvm::Instruction* instruction = getConstExprAsInstruction(expr);
+      m_constExpressions[expr] = instruction;
+
+      // Queue expression to be folded once per work-item
+      unsigned id = addValueID(expr);
+      if (isFoldable(expr))
+      {
+        pair<unsigned, unsigned> size =
+          m_restore && id < m_restore->values.size() ? m_restore->values[id]
+                                                     : getValueSize(expr);
+
+        DecodedInstruction decoded;
+        decoded.instruction = instruction;
+        decoded.handler =
+          WorkItem::getInstructionHandler(instruction->getOpcode());
+        decoded.laneHandler = NULL;
+        decoded.result = id;
+        decoded.size = size.first;
+        decoded.num = size.second;
+        decoded.builtin = NULL;
+        decoded.uniformity = Varying;
+        decoded.uniformIndex = 0;
+        decodeOperands(decoded, instruction);
+        m_constExprInstructions.push_back(decoded);
+      }
     }
   }
   else
@@ -1831,3 +2984,94 @@ void InterpreterCache::addOperand(const llvm::Value* operand)
     addValueID(operand);
   }
 }
+
+void InterpreterCache::serialize(string& data) const
+{
+  data.clear();
+  writeBinary(data, (uint32_t)SERIALIZED_CACHE_VERSION);
+
+  writeBinary(data, (uint32_t)m_frameLayout.size());
+  for (auto slot = m_frameLayout.begin(); slot != m_frameLayout.end(); slot++)
+  {
+    writeBinary(data, slot->size);
+    writeBinary(data, slot->num);
+  }
+
+  // Write constants in pool order, including any padding in their storage
+  vector<const llvm::Value*> constants(m_constantPool.size());
+  for (auto C = m_constants.begin(); C != m_constants.end(); C++)
+  {
+    constants[C->second] = C->first;
+  }
+  writeBinary(data, (uint32_t)m_constantPool.size());
+  for (unsigned i = 0; i < m_constantPool.size(); i++)
+  {
+    const TypedValue& constant = m_constantPool[i];
+    writeBinary(data, constant.size);
+    writeBinary(data, constant.num);
+    writeBinary(data, string((const char*)constant.data,
+                             getTypeSize(constants[i]->getType())));
+  }
+
+  // Record whether each builtin matched by name or by prefix
+  writeBinary(data, (uint32_t)m_builtins.size());
+  for (auto B = m_builtins.begin(); B != m_builtins.end(); B++)
+  {
+    const Builtin& builtin = B->second;
+    uint32_t prefix = !workItemBuiltins.count(builtin.name);
+    string key = builtin.name;
+    if (prefix)
+    {
+      BuiltinFunctionPrefixList::iterator pItr;
+      for (pItr = workItemPrefixBuiltins.begin();
+           pItr != workItemPrefixBuiltins.end(); pItr++)
+      {
+        if (builtin.name.compare(0, pItr->first.length(), pItr->first) == 0)
+        {
+          key = pItr->first;
+          break;
+        }
+      }
+    }
+
+    writeBinary(data, B->first->getName().str());
+    writeBinary(data, builtin.name);
+    writeBinary(data, builtin.overload);
+    writeBinary(data, prefix);
+    writeBinary(data, key);
+  }
+}
+
+///////////////////
+// UniformValues //
+///////////////////
+
+UniformValues::UniformValues(const InterpreterCache* cache)
+    : m_frameLayout(cache->getFrameLayout().data()),
+      m_data(cache->getFrameSize()),
+      m_states(new atomic<uint8_t>[cache->getNumUniformValues()]),
+      m_numValues(cache->getNumUniformValues())
+{
+  clear();
+}
+
+void UniformValues::clear()
+{
+  for (unsigned i = 0; i < m_numValues; i++)
+    m_states[i].store(Empty, memory_order_relaxed);
+}
+
+void UniformValues::set(const InterpreterCache::DecodedInstruction* instruction,
+                        const unsigned char* data)
+{
+  // Work-items on other threads that find a result being written compute
+  // it themselves instead of waiting
+  uint8_t state = Empty;
+  if (!m_states[instruction->uniformIndex].compare_exchange_strong(state,
+                                                                   Writing))
+    return;
+
+  const InterpreterCache::FrameSlot& slot = m_frameLayout[instruction->result];
+  memcpy(m_data.data() + slot.offset, data, slot.size * slot.num);
+  m_states[instruction->uniformIndex].store(Ready, memory_order_release);
+}
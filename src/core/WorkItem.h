@@ -16,6 +16,7 @@ class ConstExpr;
 class DILocalVariable;
 class Function;
 class Module;
+class User;
 } // namespace llvm
 
 namespace oclgrind
@@ -34,12 +35,13 @@ struct BuiltinFunction
   void (*func)(WorkItem*, const llvm::CallInst*, const std::string&,
                const std::string&, TypedValue&, void*);
   void* op;
+  bool pure; // Result depends only on the arguments, with no side effects
   BuiltinFunction(){};
   BuiltinFunction(void (*f)(WorkItem*, const llvm::CallInst*,
                             const std::string&, const std::string&, TypedValue&,
                             void*),
-                  void* o)
-      : func(f), op(o){};
+                  void* o, bool p = false)
+      : func(f), op(o), pure(p){};
 };
 typedef std::unordered_map<std::string, BuiltinFunction> BuiltinFunctionMap;
 typedef std::list<std::pair<std::string, BuiltinFunction>>
@@ -48,6 +50,31 @@ typedef std::list<std::pair<std::string, BuiltinFunction>>
 extern BuiltinFunctionMap workItemBuiltins;
 extern BuiltinFunctionPrefixList workItemPrefixBuiltins;
 
+// Replace a generic builtin with a version specialized for the argument
+// types of a particular declaration, if one is available
+BuiltinFunction specializeBuiltin(const BuiltinFunction& builtin,
+                                  const std::string& overload,
+                                  const llvm::Function* function);
+
+// Member function that implements an instruction
+typedef void (WorkItem::*InstructionHandler)(const llvm::Instruction*,
+                                             TypedValue&);
+
+// Operands and result of an instruction for every work-item of a
+// work-group executing in lockstep, with the values of each lane contiguous
+struct LaneArguments
+{
+  unsigned char* result;
+  const unsigned char* operands[3];
+  bool shared[3]; // Constant operand, with one value used by every lane
+  unsigned num;   // Elements per lane
+  size_t numLanes;
+  const uint8_t* mask; // Lanes to execute, or NULL for all of them
+};
+
+// Function that implements an instruction for several work-items at once
+typedef void (*LaneHandler)(const LaneArguments& args);
+
 // Per-kernel cache for various interpreter state information
 class InterpreterCache
 {
@@ -58,38 +85,176 @@ public:
     std::string name, overload;
   };
 
-  InterpreterCache(llvm::Function* kernel);
+  // Operand resolved to either a value slot or an entry in the constant pool
+  struct OperandSlot
+  {
+    bool constant;
+    unsigned index;
+  };
+
+  // Location of a value within a work-item's register frame
+  struct FrameSlot
+  {
+    unsigned size, num;
+    size_t offset;
+  };
+
+  // Copy of an incoming value into a phi node's slot
+  struct PhiMove
+  {
+    OperandSlot source;
+    unsigned dest;
+    size_t scratch; // Frame offset used when moves must happen in parallel
+  };
+
+  struct DecodedInstruction;
+
+  // How widely the result of an instruction can be shared, because its
+  // operands are the same for every work-item in a work-group, or in the
+  // whole kernel
+  enum Uniformity
+  {
+    Varying,
+    GroupUniform,
+    KernelUniform
+  };
+
+  // Control flow edge, with the phi moves required to follow it
+  struct Edge
+  {
+    const DecodedInstruction* target;
+    std::vector<PhiMove> phiMoves;
+    bool parallel; // Some moves read phis written by other moves
+  };
+
+  // Pre-decoded instruction, laid out in a flat array per kernel
+  struct DecodedInstruction
+  {
+    const llvm::Instruction* instruction;
+    InstructionHandler handler;
+    LaneHandler laneHandler; // NULL if there is no lane-wise version
+    unsigned result;
+    unsigned size, num;
+    std::vector<OperandSlot> operands;
+
+    // Builtin bound to calls to external functions
+    const Builtin* builtin;
+
+    // Edges to successor blocks (or called function)
+    std::vector<Edge> successors;
+
+    // Uniform instructions costly enough to compute once and share, with
+    // the index of their entry in a UniformValues table
+    Uniformity uniformity;
+    unsigned uniformIndex;
+  };
+
+  // Optionally reuse the results of a previous analysis of the same module,
+  // as produced by serialize()
+  InterpreterCache(llvm::Function* kernel,
+                   const std::string* serialized = NULL);
   ~InterpreterCache();
 
   void addBuiltin(const llvm::Function* function);
-  Builtin getBuiltin(const llvm::Function* function) const;
+  const Builtin& getBuiltin(const llvm::Function* function) const;
+
+  const DecodedInstruction* getBlockEntry(const llvm::BasicBlock* block) const;
 
   void addConstant(const llvm::Value* constant);
-  TypedValue getConstant(const llvm::Value* operand) const;
-  const llvm::Instruction* getConstantExpr(const llvm::Value* expr) const;
+  const TypedValue& getConstant(unsigned index) const
+  {
+    return m_constantPool[index];
+  }
+  const std::vector<DecodedInstruction>& getConstantExpressions() const;
+  OperandSlot getOperandSlot(const llvm::Value* operand) const;
 
   unsigned addValueID(const llvm::Value* value);
   unsigned getValueID(const llvm::Value* value) const;
   unsigned getNumValues() const;
   bool hasValue(const llvm::Value* value) const;
 
+  const std::vector<FrameSlot>& getFrameLayout() const;
+  size_t getFrameSize() const;
+  unsigned getNumUniformValues() const;
+
+  void serialize(std::string& data) const;
+
 private:
+  struct SerializedState;
+
   typedef std::unordered_map<const llvm::Value*, unsigned> ValueMap;
   typedef std::unordered_map<const llvm::Function*, Builtin> BuiltinMap;
-  typedef std::unordered_map<const llvm::Value*, TypedValue> ConstantMap;
+  typedef std::unordered_map<const llvm::Value*, unsigned> ConstantMap;
   typedef std::unordered_map<const llvm::Value*, llvm::Instruction*>
     ConstExprMap;
+  typedef std::unordered_map<const llvm::BasicBlock*, size_t> BlockMap;
 
+  std::vector<DecodedInstruction> m_instructions;
+  std::vector<DecodedInstruction> m_constExprInstructions;
+  std::vector<TypedValue> m_constantPool;
+  BlockMap m_blockEntries;
   BuiltinMap m_builtins;
   ConstantMap m_constants;
   ConstExprMap m_constExpressions;
   ValueMap m_valueIDs;
+  std::vector<FrameSlot> m_frameLayout;
+  size_t m_frameSize;
+  unsigned m_numUniformValues;
+
+  // Serialized results being restored, and whether they failed to match
+  const SerializedState* m_restore;
+  bool m_restoreFailed;
 
   void addOperand(const llvm::Value* value);
+  size_t allocateFrameSlot(unsigned size, unsigned num);
+  void addPhiMoves(Edge& edge, const llvm::BasicBlock* pred,
+                   const llvm::BasicBlock* succ);
+  void analyze(llvm::Function* kernel);
+  void analyzeUniformity(const llvm::Function* kernel);
+  void clear();
+  void decodeFunction(const llvm::Function* function);
+  void decodeOperands(DecodedInstruction& decoded, const llvm::User* user);
+};
+
+// Results of uniform instructions, computed by the first work-item to
+// execute each one and copied by the others (shared by the work-items of a
+// work-group, or by every worker thread for kernel-uniform results)
+class UniformValues
+{
+public:
+  UniformValues(const InterpreterCache* cache);
+
+  void clear();
+  // Get the shared result of an instruction, or NULL if not yet computed
+  const unsigned char*
+  get(const InterpreterCache::DecodedInstruction* instruction) const
+  {
+    if (m_states[instruction->uniformIndex].load(std::memory_order_acquire) !=
+        Ready)
+      return NULL;
+    return m_data.data() + m_frameLayout[instruction->result].offset;
+  }
+  // Share a result, unless another work-item is already doing so
+  void set(const InterpreterCache::DecodedInstruction* instruction,
+           const unsigned char* data);
+
+private:
+  enum State : uint8_t
+  {
+    Empty,
+    Writing,
+    Ready
+  };
+  const InterpreterCache::FrameSlot* m_frameLayout;
+  std::vector<unsigned char> m_data; // Laid out like a register frame
+  std::unique_ptr<std::atomic<uint8_t>[]> m_states;
+  unsigned m_numValues;
 };
 
 class WorkItem
 {
+  friend class InterpreterCache;
+  friend class JITKernel;
   friend class WorkItemBuiltins;
 
 public:
@@ -101,20 +266,35 @@ public:
   };
 
 public:
+  // Work-items given a lane of a structure-of-arrays register file share
+  // it with the rest of their work-group, instead of having their own frame
   WorkItem(const KernelInvocation* kernelInvocation, WorkGroup* workGroup,
-           Size3 lid);
+           Size3 lid, unsigned char* laneRegisters = NULL, size_t lane = 0,
+           size_t numLanes = 1);
   virtual ~WorkItem();
 
   void clearBarrier();
-  void dispatch(const llvm::Instruction* instruction, TypedValue& result);
-  void execute(const llvm::Instruction* instruction);
+  void reset();
+  void execute(const InterpreterCache::DecodedInstruction* instruction);
   const std::stack<const llvm::Instruction*>& getCallStack() const;
+  TypedValue getCallArgument(unsigned index) const;
   const llvm::BasicBlock* getCurrentBlock() const;
   const llvm::Instruction* getCurrentInstruction() const;
+  const InterpreterCache::DecodedInstruction*
+  getCurrentDecodedInstruction() const;
   Size3 getGlobalID() const;
   size_t getGlobalIndex() const;
   Size3 getLocalID() const;
   TypedValue getOperand(const llvm::Value* operand) const;
+  TypedValue getOperand(const InterpreterCache::OperandSlot& slot) const
+  {
+    if (slot.constant)
+    {
+      const TypedValue& constant = m_cache->getConstant(slot.index);
+      return TypedValue(constant.size, constant.num, constant.data);
+    }
+    return getSlot(slot.index);
+  }
   const llvm::BasicBlock* getPreviousBlock() const;
   Memory* getPrivateMemory() const;
   State getState() const;
@@ -123,6 +303,12 @@ public:
   void printExpression(std::string expr) const;
   bool printValue(const llvm::Value* value) const;
   State step();
+  // Execute the current instruction of the lanes set in a mask, which must
+  // all be at the same instruction, with a single lane-wise handler call.
+  // Returns false if there is no lane-wise handler, in which case the lanes
+  // must be stepped one at a time instead.
+  static bool stepLanes(WorkItem* const* lanes, size_t numLanes,
+                        const uint8_t* mask, size_t numActive);
 
   // SPIR instructions
 private:
@@ -177,8 +363,25 @@ private:
   INSTRUCTION(urem);
   INSTRUCTION(zext);
   INSTRUCTION(freeze);
+  INSTRUCTION(unreachable);
+  INSTRUCTION(unsupported);
+
+  // Handlers specialized for the element type T and width N (or any width,
+  // for N == 0) of their operands, with Op or predicate P applied to each
+  template <typename T, unsigned N, class Op> INSTRUCTION(binaryOp);
+  template <typename T, unsigned N, unsigned P> INSTRUCTION(compareOp);
+  template <typename To, typename From, unsigned N> INSTRUCTION(convertOp);
+  template <typename T, unsigned N> INSTRUCTION(selectOp);
 #undef INSTRUCTION
 
+  static InstructionHandler getInstructionHandler(unsigned opcode);
+  // Handler for an instruction whose result has the given element size and
+  // width, specialized for them where possible, along with the lane-wise
+  // version of the specialized handler if there is one
+  static InstructionHandler
+  getInstructionHandler(const llvm::Instruction* instruction, unsigned size,
+                        unsigned num, LaneHandler* laneHandler = NULL);
+
 private:
   typedef std::map<std::string,
                    std::pair<const llvm::Value*, const llvm::DILocalVariable*>>
@@ -187,22 +390,90 @@ private:
   size_t m_globalIndex;
   Size3 m_globalID;
   Size3 m_localID;
-  TypedValueMap m_phiTemps;
-  VariableMap m_variables;
   const Context* m_context;
   const KernelInvocation* m_kernelInvocation;
   Memory* m_privateMemory;
   WorkGroup* m_workGroup;
-  mutable MemoryPool m_pool;
+  MemoryPool* m_pool; // Scratch space shared by the work-group
 
   State m_state;
-  struct Position;
-  Position* m_position;
+  struct Position
+  {
+    bool hasBegun;
+    const llvm::BasicBlock* prevBlock;
+    const llvm::BasicBlock* currBlock;
+    const llvm::BasicBlock* nextBlock;
+    const InterpreterCache::DecodedInstruction* currInst;
+    const InterpreterCache::DecodedInstruction* nextInst;
+  };
+  Position m_position;
+
+  // Call that entered each active function, and how many private
+  // allocations were live when it was made (those made since are released
+  // when the function returns)
+  struct Frame
+  {
+    const InterpreterCache::DecodedInstruction* call;
+    size_t allocations;
+  };
+  std::vector<Frame> m_frames;
+  std::vector<size_t> m_allocations;
 
+  // State only needed by the debugger, created when first used
+  struct DebugState
+  {
+    VariableMap variables;
+    std::stack<const llvm::Instruction*> callStack;
+  };
+  mutable DebugState* m_debugState;
+  DebugState* getDebugState() const;
+
+  // Notify plugins when the work-item first executes, returning false if
+  // it has already begun
+  bool begin();
+  void followEdge(const InterpreterCache::Edge& edge);
   Memory* getMemory(unsigned int addrSpace) const;
 
-  // Store for instruction results and other operand values
-  std::vector<TypedValue> m_values;
+  // Last buffer accessed in each address space, letting repeated loads and
+  // stores skip buffer lookup and validation when no plugin observes them
+  struct MemoryTLBEntry
+  {
+    const Memory* memory;
+    uint64_t generation;
+    size_t begin;
+    size_t end;
+    unsigned char* data;
+  };
+  MemoryTLBEntry m_tlb[AddrSpaceLocal + 1];
+  unsigned char* translateAddress(unsigned addrSpace, size_t address,
+                                  size_t size);
+
+  // Access memory for the current instruction, checking address alignment
+  void loadMemory(unsigned addrSpace, size_t address, size_t size,
+                  unsigned alignment, unsigned char* data);
+  void setCurrentInstruction(
+    const InterpreterCache::DecodedInstruction* instruction);
+  void storeMemory(unsigned addrSpace, size_t address, size_t size,
+                   unsigned alignment, const unsigned char* data);
+
+  // Store for instruction results and other operand values, each of which
+  // is at a fixed slot in the register frame, laid out by the kernel's
+  // interpreter cache. Work-items executing in lockstep share one frame
+  // scaled by the number of lanes, holding every lane of a value in turn.
+  const InterpreterCache::FrameSlot* m_frameLayout;
+  unsigned char* m_registers;
+  size_t m_lane;
+  size_t m_numLanes;
+  unsigned char* getFrameData(size_t offset, size_t size) const
+  {
+    return m_registers + offset * m_numLanes + m_lane * size;
+  }
+  TypedValue getSlot(unsigned index) const
+  {
+    const InterpreterCache::FrameSlot& slot = m_frameLayout[index];
+    return TypedValue(slot.size, slot.num,
+                      getFrameData(slot.offset, slot.size * slot.num));
+  }
   TypedValue getValue(const llvm::Value* key) const;
   bool hasValue(const llvm::Value* key) const;
   void setValue(const llvm::Value* key, TypedValue value);
@@ -13,7 +13,9 @@
 #include <fenv.h>
 #include <float.h>
 #include <math.h>
+#include <limits>
 #include <mutex>
+#include <type_traits>
 
 #include "llvm/IR/DebugInfoMetadata.h"
 #include "llvm/IR/Instructions.h"
@@ -163,6 +165,247 @@ class WorkItemBuiltins
     }
   }
 
+  typedef decltype(BuiltinFunction::func) Callback;
+
+  // Builtin being specialized, with the shape of its call
+  struct Specialization
+  {
+    Callback generic;
+    unsigned arity;
+    bool scalarLast; // Last argument is a scalar applied to every element
+  };
+
+  // Versions of the generic builtins above specialized for an element type
+  // and vector width, which read their arguments through the decoded operand
+  // slots of the call
+  template <typename T, unsigned N> struct Typed
+  {
+    // Type that the generic builtin computes results in
+    typedef typename std::conditional<
+      std::is_floating_point<T>::value, double,
+      typename std::conditional<std::is_signed<T>::value, int64_t,
+                                uint64_t>::type>::type R;
+
+    static void arg1(WorkItem* workItem, const llvm::CallInst* callInst,
+                     const string& name, const string& overload,
+                     TypedValue& result, R (*func)(R))
+    {
+      const T* a = (const T*)workItem->getCallArgument(0).data;
+      T* r = (T*)result.data;
+      for (unsigned i = 0; i < N; i++)
+      {
+        r[i] = func(a[i]);
+      }
+    }
+    static void arg2(WorkItem* workItem, const llvm::CallInst* callInst,
+                     const string& name, const string& overload,
+                     TypedValue& result, R (*func)(R, R))
+    {
+      const T* a = (const T*)workItem->getCallArgument(0).data;
+      const T* b = (const T*)workItem->getCallArgument(1).data;
+      T* r = (T*)result.data;
+      for (unsigned i = 0; i < N; i++)
+      {
+        r[i] = func(a[i], b[i]);
+      }
+    }
+    static void arg3(WorkItem* workItem, const llvm::CallInst* callInst,
+                     const string& name, const string& overload,
+                     TypedValue& result, R (*func)(R, R, R))
+    {
+      const T* a = (const T*)workItem->getCallArgument(0).data;
+      const T* b = (const T*)workItem->getCallArgument(1).data;
+      const T* c = (const T*)workItem->getCallArgument(2).data;
+      T* r = (T*)result.data;
+      for (unsigned i = 0; i < N; i++)
+      {
+        r[i] = func(a[i], b[i], c[i]);
+      }
+    }
+
+    static Callback select(const Specialization& s)
+    {
+      switch (s.arity)
+      {
+      case 1:
+        return (Callback)arg1;
+      case 2:
+        return (Callback)arg2;
+      case 3:
+        return (Callback)arg3;
+      default:
+        return NULL;
+      }
+    }
+  };
+
+  // Typed versions of floating point builtins that are not element-wise
+  // applications of a single operation, computing exactly as the generic
+  // versions do
+  template <typename T, unsigned N> struct TypedFloat
+  {
+    template <bool S>
+    static void mix(WorkItem* workItem, const llvm::CallInst* callInst,
+                    const string& name, const string& overload,
+                    TypedValue& result, void*)
+    {
+      const T* x = (const T*)workItem->getCallArgument(0).data;
+      const T* y = (const T*)workItem->getCallArgument(1).data;
+      const T* a = (const T*)workItem->getCallArgument(2).data;
+      T* r = (T*)result.data;
+      for (unsigned i = 0; i < N; i++)
+      {
+        double _x = x[i];
+        r[i] = _x + ((double)y[i] - _x) * (double)a[S ? 0 : i];
+      }
+    }
+
+    static void dot(WorkItem* workItem, const llvm::CallInst* callInst,
+                    const string& name, const string& overload,
+                    TypedValue& result, void*)
+    {
+      const T* a = (const T*)workItem->getCallArgument(0).data;
+      const T* b = (const T*)workItem->getCallArgument(1).data;
+      double r = 0.0;
+      for (unsigned i = 0; i < N; i++)
+      {
+        r += (double)a[i] * (double)b[i];
+      }
+      *(T*)result.data = r;
+    }
+
+    static void fma(WorkItem* workItem, const llvm::CallInst* callInst,
+                    const string& name, const string& overload,
+                    TypedValue& result, void*)
+    {
+      const T* a = (const T*)workItem->getCallArgument(0).data;
+      const T* b = (const T*)workItem->getCallArgument(1).data;
+      const T* c = (const T*)workItem->getCallArgument(2).data;
+      T* r = (T*)result.data;
+      for (unsigned i = 0; i < N; i++)
+      {
+        r[i] = std::fma(a[i], b[i], c[i]);
+      }
+    }
+
+    template <bool S>
+    static void fmax(WorkItem* workItem, const llvm::CallInst* callInst,
+                     const string& name, const string& overload,
+                     TypedValue& result, void*)
+    {
+      const T* a = (const T*)workItem->getCallArgument(0).data;
+      const T* b = (const T*)workItem->getCallArgument(1).data;
+      T* r = (T*)result.data;
+      for (unsigned i = 0; i < N; i++)
+      {
+        r[i] = std::fmax(a[i], b[S ? 0 : i]);
+      }
+    }
+
+    template <bool S>
+    static void fmin(WorkItem* workItem, const llvm::CallInst* callInst,
+                     const string& name, const string& overload,
+                     TypedValue& result, void*)
+    {
+      const T* a = (const T*)workItem->getCallArgument(0).data;
+      const T* b = (const T*)workItem->getCallArgument(1).data;
+      T* r = (T*)result.data;
+      for (unsigned i = 0; i < N; i++)
+      {
+        r[i] = std::fmin(a[i], b[S ? 0 : i]);
+      }
+    }
+
+    static Callback select(const Specialization& s)
+    {
+      if (s.generic == (Callback)WorkItemBuiltins::mix)
+        return s.scalarLast ? (Callback)mix<true> : (Callback)mix<false>;
+      if (s.generic == (Callback)WorkItemBuiltins::dot && !s.scalarLast)
+        return (Callback)dot;
+      if (s.generic == (Callback)fma_builtin && !s.scalarLast)
+        return (Callback)fma;
+      if (s.generic == (Callback)fmax_builtin)
+        return s.scalarLast ? (Callback)fmax<true> : (Callback)fmax<false>;
+      if (s.generic == (Callback)fmin_builtin)
+        return s.scalarLast ? (Callback)fmin<true> : (Callback)fmin<false>;
+      return NULL;
+    }
+  };
+
+  // Typed versions of integer builtins, computing exactly as the generic
+  // versions do
+  template <typename T, unsigned N> struct TypedInteger
+  {
+    typedef typename std::make_unsigned<T>::type U;
+
+    static void clz(WorkItem* workItem, const llvm::CallInst* callInst,
+                    const string& name, const string& overload,
+                    TypedValue& result, void*)
+    {
+      const U* a = (const U*)workItem->getCallArgument(0).data;
+      U* r = (U*)result.data;
+      for (unsigned i = 0; i < N; i++)
+      {
+        U x = a[i];
+        unsigned nz = 0;
+        while (x)
+        {
+          x >>= 1;
+          nz++;
+        }
+        r[i] = sizeof(T) * 8 - nz;
+      }
+    }
+
+    static void rotate(WorkItem* workItem, const llvm::CallInst* callInst,
+                       const string& name, const string& overload,
+                       TypedValue& result, void*)
+    {
+      const U* a = (const U*)workItem->getCallArgument(0).data;
+      const U* b = (const U*)workItem->getCallArgument(1).data;
+      U* r = (U*)result.data;
+      for (unsigned i = 0; i < N; i++)
+      {
+        uint64_t width = sizeof(T) * 8;
+        uint64_t v = a[i];
+        uint64_t ls = b[i] % width;
+        r[i] = ls ? (v << ls) | (v >> (width - ls)) : v;
+      }
+    }
+
+    // Only used for types narrower than 64 bits, where the result cannot
+    // overflow before it is saturated
+    static void mad_sat(WorkItem* workItem, const llvm::CallInst* callInst,
+                        const string& name, const string& overload,
+                        TypedValue& result, void*)
+    {
+      typedef typename Typed<T, N>::R R;
+      const T* a = (const T*)workItem->getCallArgument(0).data;
+      const T* b = (const T*)workItem->getCallArgument(1).data;
+      const T* c = (const T*)workItem->getCallArgument(2).data;
+      T* r = (T*)result.data;
+      for (unsigned i = 0; i < N; i++)
+      {
+        R x = (R)a[i] * (R)b[i] + (R)c[i];
+        r[i] = _clamp_<R>(x, std::numeric_limits<T>::min(),
+                          std::numeric_limits<T>::max());
+      }
+    }
+
+    static Callback select(const Specialization& s)
+    {
+      if (s.scalarLast)
+        return NULL;
+      if (s.generic == (Callback)WorkItemBuiltins::clz)
+        return (Callback)clz;
+      if (s.generic == (Callback)WorkItemBuiltins::rotate)
+        return (Callback)rotate;
+      if (s.generic == (Callback)WorkItemBuiltins::mad_sat && sizeof(T) < 8)
+        return (Callback)mad_sat;
+      return NULL;
+    }
+  };
+
   // Extract the (first) argument type from an overload string
   static char getOverloadArgType(const string& overload)
   {
@@ -1002,201 +1245,240 @@ class WorkItemBuiltins
     return input;
   }
 
-  static inline float readNormalizedColor(const Image* image,
-                                          WorkItem* workItem, int i, int j,
-                                          int k, int layer, int c)
+  // Decoded layout of an image format, resolved once per image access
+  // rather than once for every channel of every texel that is read
+  struct PixelFormat
   {
-    // Check for out-of-range coordinages
-    if (i < 0 || i >= image->desc.image_width || j < 0 ||
-        j >= image->desc.image_height || k < 0 || k >= image->desc.image_depth)
-    {
-      // Return border color
-      if (c == 3 && !hasZeroAlphaBorder(image->format))
-      {
-        return 1.f;
-      }
-      return 0.f;
-    }
+    size_t channelSize;
+    size_t pixelSize;
+    int channels[4];
+    float defaults[4];
+    float borderAlpha;
+  };
 
-    // Remap channels
-    float ret = 0.f;
-    int channel = getInputChannel(image->format, c, &ret);
-    if (channel < 0)
+  static inline PixelFormat getPixelFormat(const cl_image_format& format)
+  {
+    PixelFormat pixel;
+    pixel.channelSize = getChannelSize(format);
+    pixel.pixelSize = pixel.channelSize * getNumChannels(format);
+    for (int c = 0; c < 4; c++)
     {
-      return ret;
+      pixel.defaults[c] = 0.f;
+      pixel.channels[c] = getInputChannel(format, c, &pixel.defaults[c]);
     }
+    pixel.borderAlpha = hasZeroAlphaBorder(format) ? 0.f : 1.f;
+    return pixel;
+  }
 
+  static inline bool isBorderPixel(const Image* image, int i, int j, int k)
+  {
+    return i < 0 || i >= image->desc.image_width || j < 0 ||
+           j >= image->desc.image_height || k < 0 ||
+           k >= image->desc.image_depth;
+  }
+
+  static inline const unsigned char* loadPixel(const Image* image,
+                                               const PixelFormat& pixel,
+                                               WorkItem* workItem, int i,
+                                               int j, int k, int layer)
+  {
     // Calculate pixel address
-    size_t channelSize = getChannelSize(image->format);
-    size_t numChannels = getNumChannels(image->format);
-    size_t pixelSize = channelSize * numChannels;
     size_t address = image->address +
                      (i + (j + (k + layer * image->desc.image_depth) *
                                  image->desc.image_height) *
                             image->desc.image_width) *
-                       pixelSize +
-                     channel * channelSize;
-
-    // Load channel data
-    unsigned char* data = workItem->m_pool.alloc(channelSize);
-    if (!workItem->getMemory(AddrSpaceGlobal)->load(data, address, channelSize))
-    {
-      return 0.f;
-    }
+                       pixel.pixelSize;
 
-    // Compute normalized color value
-    float color;
-    switch (image->format.image_channel_data_type)
+    // Load all channels with a single access
+    unsigned char* data = workItem->m_pool->alloc(pixel.pixelSize);
+    if (!workItem->getMemory(AddrSpaceGlobal)
+           ->load(data, address, pixel.pixelSize))
     {
-    case CL_SNORM_INT8:
-      color = _clamp_(*(int8_t*)data / 127.f, -1.f, 1.f);
-      break;
-    case CL_UNORM_INT8:
-      color = _clamp_(*(uint8_t*)data / 255.f, 0.f, 1.f);
-      break;
-    case CL_SNORM_INT16:
-      color = _clamp_(*(int16_t*)data / 32767.f, -1.f, 1.f);
-      break;
-    case CL_UNORM_INT16:
-      color = _clamp_(*(uint16_t*)data / 65535.f, 0.f, 1.f);
-      break;
-    case CL_FLOAT:
-      color = *(float*)data;
-      break;
-    case CL_HALF_FLOAT:
-      color = halfToFloat(*(uint16_t*)data);
-      break;
-    default:
-      FATAL_ERROR("Unsupported image channel data type: %X",
-                  image->format.image_channel_data_type);
+      return NULL;
     }
-
-    return color;
+    return data;
   }
 
-  static inline int32_t readSignedColor(const Image* image, WorkItem* workItem,
-                                        int i, int j, int k, int layer, int c)
+  static inline void readNormalizedPixel(const Image* image,
+                                         const PixelFormat& pixel,
+                                         WorkItem* workItem, int i, int j,
+                                         int k, int layer, float* values)
   {
     // Check for out-of-range coordinages
-    if (i < 0 || i >= image->desc.image_width || j < 0 ||
-        j >= image->desc.image_height || k < 0 || k >= image->desc.image_depth)
+    if (isBorderPixel(image, i, j, k))
     {
       // Return border color
-      if (c == 3 && !hasZeroAlphaBorder(image->format))
-      {
-        return 1.f;
-      }
-      return 0.f;
+      values[0] = values[1] = values[2] = 0.f;
+      values[3] = pixel.borderAlpha;
+      return;
     }
 
-    // Remap channels
-    float ret = 0.f;
-    int channel = getInputChannel(image->format, c, &ret);
-    if (channel < 0)
+    const unsigned char* data =
+      loadPixel(image, pixel, workItem, i, j, k, layer);
+
+    // Fast paths for the most common formats
+    if (data && image->format.image_channel_data_type == CL_UNORM_INT8 &&
+        image->format.image_channel_order == CL_RGBA)
     {
-      return ret;
+      for (int c = 0; c < 4; c++)
+      {
+        values[c] = _clamp_(data[c] / 255.f, 0.f, 1.f);
+      }
+      return;
     }
-
-    // Calculate pixel address
-    size_t channelSize = getChannelSize(image->format);
-    size_t numChannels = getNumChannels(image->format);
-    size_t pixelSize = channelSize * numChannels;
-    size_t address = image->address +
-                     (i + (j + (k + layer * image->desc.image_depth) *
-                                 image->desc.image_height) *
-                            image->desc.image_width) *
-                       pixelSize +
-                     channel * channelSize;
-
-    // Load channel data
-    unsigned char* data = workItem->m_pool.alloc(channelSize);
-    if (!workItem->getMemory(AddrSpaceGlobal)->load(data, address, channelSize))
+    if (data && image->format.image_channel_data_type == CL_FLOAT &&
+        image->format.image_channel_order == CL_R)
     {
-      return 0;
+      values[0] = *(const float*)data;
+      values[1] = values[2] = 0.f;
+      values[3] = 1.f;
+      return;
     }
 
-    // Compute unnormalized color value
-    int32_t color;
-    switch (image->format.image_channel_data_type)
+    for (int c = 0; c < 4; c++)
     {
-    case CL_SIGNED_INT8:
-      color = *(int8_t*)data;
-      break;
-    case CL_SIGNED_INT16:
-      color = *(int16_t*)data;
-      break;
-    case CL_SIGNED_INT32:
-      color = *(int32_t*)data;
-      break;
-    default:
-      FATAL_ERROR("Unsupported image channel data type: %X",
-                  image->format.image_channel_data_type);
-    }
+      // Remap channels
+      if (pixel.channels[c] < 0)
+      {
+        values[c] = pixel.defaults[c];
+        continue;
+      }
+      if (!data)
+      {
+        values[c] = 0.f;
+        continue;
+      }
 
-    return color;
+      // Compute normalized color value
+      const unsigned char* channel =
+        data + pixel.channels[c] * pixel.channelSize;
+      switch (image->format.image_channel_data_type)
+      {
+      case CL_SNORM_INT8:
+        values[c] = _clamp_(*(const int8_t*)channel / 127.f, -1.f, 1.f);
+        break;
+      case CL_UNORM_INT8:
+        values[c] = _clamp_(*(const uint8_t*)channel / 255.f, 0.f, 1.f);
+        break;
+      case CL_SNORM_INT16:
+        values[c] = _clamp_(*(const int16_t*)channel / 32767.f, -1.f, 1.f);
+        break;
+      case CL_UNORM_INT16:
+        values[c] = _clamp_(*(const uint16_t*)channel / 65535.f, 0.f, 1.f);
+        break;
+      case CL_FLOAT:
+        values[c] = *(const float*)channel;
+        break;
+      case CL_HALF_FLOAT:
+        values[c] = halfToFloat(*(const uint16_t*)channel);
+        break;
+      default:
+        FATAL_ERROR("Unsupported image channel data type: %X",
+                    image->format.image_channel_data_type);
+      }
+    }
   }
 
-  static inline uint32_t readUnsignedColor(const Image* image,
-                                           WorkItem* workItem, int i, int j,
-                                           int k, int layer, int c)
+  static inline void readSignedPixel(const Image* image,
+                                     const PixelFormat& pixel,
+                                     WorkItem* workItem, int i, int j, int k,
+                                     int layer, int32_t* values)
   {
     // Check for out-of-range coordinages
-    if (i < 0 || i >= image->desc.image_width || j < 0 ||
-        j >= image->desc.image_height || k < 0 || k >= image->desc.image_depth)
+    if (isBorderPixel(image, i, j, k))
     {
       // Return border color
-      if (c == 3 && !hasZeroAlphaBorder(image->format))
-      {
-        return 1.f;
-      }
-      return 0.f;
+      values[0] = values[1] = values[2] = 0;
+      values[3] = pixel.borderAlpha;
+      return;
     }
 
-    // Remap channels
-    float ret = 0.f;
-    int channel = getInputChannel(image->format, c, &ret);
-    if (channel < 0)
+    const unsigned char* data =
+      loadPixel(image, pixel, workItem, i, j, k, layer);
+    for (int c = 0; c < 4; c++)
     {
-      return ret;
-    }
+      // Remap channels
+      if (pixel.channels[c] < 0)
+      {
+        values[c] = pixel.defaults[c];
+        continue;
+      }
+      if (!data)
+      {
+        values[c] = 0;
+        continue;
+      }
 
-    // Calculate pixel address
-    size_t channelSize = getChannelSize(image->format);
-    size_t numChannels = getNumChannels(image->format);
-    size_t pixelSize = channelSize * numChannels;
-    size_t address = image->address +
-                     (i + (j + (k + layer * image->desc.image_depth) *
-                                 image->desc.image_height) *
-                            image->desc.image_width) *
-                       pixelSize +
-                     channel * channelSize;
+      // Compute unnormalized color value
+      const unsigned char* channel =
+        data + pixel.channels[c] * pixel.channelSize;
+      switch (image->format.image_channel_data_type)
+      {
+      case CL_SIGNED_INT8:
+        values[c] = *(const int8_t*)channel;
+        break;
+      case CL_SIGNED_INT16:
+        values[c] = *(const int16_t*)channel;
+        break;
+      case CL_SIGNED_INT32:
+        values[c] = *(const int32_t*)channel;
+        break;
+      default:
+        FATAL_ERROR("Unsupported image channel data type: %X",
+                    image->format.image_channel_data_type);
+      }
+    }
+  }
 
-    // Load channel data
-    unsigned char* data = workItem->m_pool.alloc(channelSize);
-    if (!workItem->getMemory(AddrSpaceGlobal)->load(data, address, channelSize))
+  static inline void readUnsignedPixel(const Image* image,
+                                       const PixelFormat& pixel,
+                                       WorkItem* workItem, int i, int j, int k,
+                                       int layer, uint32_t* values)
+  {
+    // Check for out-of-range coordinages
+    if (isBorderPixel(image, i, j, k))
     {
-      return 0;
+      // Return border color
+      values[0] = values[1] = values[2] = 0;
+      values[3] = pixel.borderAlpha;
+      return;
     }
 
-    // Load color value
-    uint32_t color;
-    switch (image->format.image_channel_data_type)
+    const unsigned char* data =
+      loadPixel(image, pixel, workItem, i, j, k, layer);
+    for (int c = 0; c < 4; c++)
     {
-    case CL_UNSIGNED_INT8:
-      color = *(uint8_t*)data;
-      break;
-    case CL_UNSIGNED_INT16:
-      color = *(uint16_t*)data;
-      break;
-    case CL_UNSIGNED_INT32:
-      color = *(uint32_t*)data;
-      break;
-    default:
-      FATAL_ERROR("Unsupported image channel data type: %X",
-                  image->format.image_channel_data_type);
-    }
+      // Remap channels
+      if (pixel.channels[c] < 0)
+      {
+        values[c] = pixel.defaults[c];
+        continue;
+      }
+      if (!data)
+      {
+        values[c] = 0;
+        continue;
+      }
 
-    return color;
+      // Load color value
+      const unsigned char* channel =
+        data + pixel.channels[c] * pixel.channelSize;
+      switch (image->format.image_channel_data_type)
+      {
+      case CL_UNSIGNED_INT8:
+        values[c] = *(const uint8_t*)channel;
+        break;
+      case CL_UNSIGNED_INT16:
+        values[c] = *(const uint16_t*)channel;
+        break;
+      case CL_UNSIGNED_INT32:
+        values[c] = *(const uint32_t*)channel;
+        break;
+      default:
+        FATAL_ERROR("Unsupported image channel data type: %X",
+                    image->format.image_channel_data_type);
+      }
+    }
   }
 
   static inline float frac(float x)
@@ -1224,6 +1506,7 @@ class WorkItemBuiltins
   DEFINE_BUILTIN(read_imagef)
   {
     const Image* image = *(Image**)(workItem->getValue(ARG(0)).data);
+    PixelFormat pixel = getPixelFormat(image->format);
 
     uint32_t sampler = CLK_ADDRESS_NONE | CLK_FILTER_NEAREST;
     int coordIndex = 1;
@@ -1306,17 +1589,42 @@ class WorkItemBuiltins
       float a = frac(u - 0.5f);
       float b = frac(v - 0.5f);
       float c = frac(w - 0.5f);
+      float texels[8][4];
+      readNormalizedPixel(image, pixel, workItem, i0, j0, k0, layer,
+                          texels[0]);
+      readNormalizedPixel(image, pixel, workItem, i1, j0, k0, layer,
+                          texels[2]);
+      if (j1 != j0)
+      {
+        readNormalizedPixel(image, pixel, workItem, i0, j1, k0, layer,
+                            texels[1]);
+        readNormalizedPixel(image, pixel, workItem, i1, j1, k0, layer,
+                            texels[3]);
+      }
+      else
+      {
+        memcpy(texels[1], texels[0], sizeof(texels[0]));
+        memcpy(texels[3], texels[2], sizeof(texels[2]));
+      }
+      if (k1 != k0)
+      {
+        for (int n = 0; n < 4; n++)
+        {
+          readNormalizedPixel(image, pixel, workItem, n & 2 ? i1 : i0,
+                              n & 1 ? j1 : j0, k1, layer, texels[4 + n]);
+        }
+      }
+      else
+      {
+        memcpy(texels[4], texels[0], 4 * sizeof(texels[0]));
+      }
+
       for (int i = 0; i < 4; i++)
       {
-        values[i] = interpolate(
-          readNormalizedColor(image, workItem, i0, j0, k0, layer, i),
-          readNormalizedColor(image, workItem, i0, j1, k0, layer, i),
-          readNormalizedColor(image, workItem, i1, j0, k0, layer, i),
-          readNormalizedColor(image, workItem, i1, j1, k0, layer, i),
-          readNormalizedColor(image, workItem, i0, j0, k1, layer, i),
-          readNormalizedColor(image, workItem, i0, j1, k1, layer, i),
-          readNormalizedColor(image, workItem, i1, j0, k1, layer, i),
-          readNormalizedColor(image, workItem, i1, j1, k1, layer, i), a, b, c);
+        values[i] =
+          interpolate(texels[0][i], texels[1][i], texels[2][i], texels[3][i],
+                      texels[4][i], texels[5][i], texels[6][i], texels[7][i],
+                      a, b, c);
       }
     }
     else
@@ -1325,10 +1633,7 @@ class WorkItemBuiltins
       int i = getNearestCoordinate(sampler, s, u, image->desc.image_width);
       int j = getNearestCoordinate(sampler, t, v, image->desc.image_height);
       int k = getNearestCoordinate(sampler, r, w, image->desc.image_depth);
-      values[0] = readNormalizedColor(image, workItem, i, j, k, layer, 0);
-      values[1] = readNormalizedColor(image, workItem, i, j, k, layer, 1);
-      values[2] = readNormalizedColor(image, workItem, i, j, k, layer, 2);
-      values[3] = readNormalizedColor(image, workItem, i, j, k, layer, 3);
+      readNormalizedPixel(image, pixel, workItem, i, j, k, layer, values);
     }
 
     // Store values in result
@@ -1341,6 +1646,7 @@ class WorkItemBuiltins
   DEFINE_BUILTIN(read_imagei)
   {
     const Image* image = *(Image**)(workItem->getValue(ARG(0)).data);
+    PixelFormat pixel = getPixelFormat(image->format);
 
     uint32_t sampler = CLK_ADDRESS_NONE | CLK_FILTER_NEAREST;
     int coordIndex = 1;
@@ -1399,10 +1705,7 @@ class WorkItemBuiltins
     int i = getNearestCoordinate(sampler, s, u, image->desc.image_width);
     int j = getNearestCoordinate(sampler, t, v, image->desc.image_height);
     int k = getNearestCoordinate(sampler, r, w, image->desc.image_depth);
-    values[0] = readSignedColor(image, workItem, i, j, k, layer, 0);
-    values[1] = readSignedColor(image, workItem, i, j, k, layer, 1);
-    values[2] = readSignedColor(image, workItem, i, j, k, layer, 2);
-    values[3] = readSignedColor(image, workItem, i, j, k, layer, 3);
+    readSignedPixel(image, pixel, workItem, i, j, k, layer, values);
 
     // Store values in result
     for (int i = 0; i < 4; i++)
@@ -1414,6 +1717,7 @@ class WorkItemBuiltins
   DEFINE_BUILTIN(read_imageui)
   {
     const Image* image = *(Image**)(workItem->getValue(ARG(0)).data);
+    PixelFormat pixel = getPixelFormat(image->format);
 
     uint32_t sampler = CLK_ADDRESS_NONE | CLK_FILTER_NEAREST;
     int coordIndex = 1;
@@ -1472,10 +1776,7 @@ class WorkItemBuiltins
     int i = getNearestCoordinate(sampler, s, u, image->desc.image_width);
     int j = getNearestCoordinate(sampler, t, v, image->desc.image_height);
     int k = getNearestCoordinate(sampler, r, w, image->desc.image_depth);
-    values[0] = readUnsignedColor(image, workItem, i, j, k, layer, 0);
-    values[1] = readUnsignedColor(image, workItem, i, j, k, layer, 1);
-    values[2] = readUnsignedColor(image, workItem, i, j, k, layer, 2);
-    values[3] = readUnsignedColor(image, workItem, i, j, k, layer, 3);
+    readUnsignedPixel(image, pixel, workItem, i, j, k, layer, values);
 
     // Store values in result
     for (int i = 0; i < 4; i++)
@@ -1550,7 +1851,7 @@ class WorkItemBuiltins
 
     // Generate channel values
     Memory* memory = workItem->getMemory(AddrSpaceGlobal);
-    unsigned char* data = workItem->m_pool.alloc(channelSize * numChannels);
+    unsigned char* data = workItem->m_pool->alloc(channelSize * numChannels);
     for (unsigned i = 0; i < numChannels; i++)
     {
       switch (image->format.image_channel_data_type)
@@ -1650,7 +1951,7 @@ class WorkItemBuiltins
 
     // Generate channel values
     Memory* memory = workItem->getMemory(AddrSpaceGlobal);
-    unsigned char* data = workItem->m_pool.alloc(channelSize * numChannels);
+    unsigned char* data = workItem->m_pool->alloc(channelSize * numChannels);
     for (unsigned i = 0; i < numChannels; i++)
     {
       switch (image->format.image_channel_data_type)
@@ -1740,7 +2041,7 @@ class WorkItemBuiltins
 
     // Generate channel values
     Memory* memory = workItem->getMemory(AddrSpaceGlobal);
-    unsigned char* data = workItem->m_pool.alloc(channelSize * numChannels);
+    unsigned char* data = workItem->m_pool->alloc(channelSize * numChannels);
     for (unsigned i = 0; i < numChannels; i++)
     {
       switch (image->format.image_channel_data_type)
@@ -2897,15 +3198,12 @@ class WorkItemBuiltins
       address = base + offset * sizeof(cl_half) * result.num;
     }
     size_t size = sizeof(cl_half) * result.num;
-    uint16_t* halfData = (uint16_t*)workItem->m_pool.alloc(2 * result.num);
+    uint16_t* halfData = (uint16_t*)workItem->m_pool->alloc(2 * result.num);
     workItem->getMemory(addressSpace)
       ->load((unsigned char*)halfData, address, size);
 
     // Convert to floats
-    for (unsigned i = 0; i < result.num; i++)
-    {
-      ((float*)result.data)[i] = halfToFloat(halfData[i]);
-    }
+    halfToFloat(halfData, (float*)result.data, result.num);
   }
 
   DEFINE_BUILTIN(vstore_half)
@@ -2927,7 +3225,7 @@ class WorkItemBuiltins
     TypedValue op = workItem->getOperand(value);
     unsigned char* data = op.data;
     size = op.num * sizeof(cl_half);
-    uint16_t* halfData = (uint16_t*)workItem->m_pool.alloc(2 * op.num);
+    uint16_t* halfData = (uint16_t*)workItem->m_pool->alloc(2 * op.num);
 
     // Parse rounding mode (RTE is the default)
     HalfRoundMode rmode = Half_RTE;
@@ -2938,11 +3236,13 @@ class WorkItemBuiltins
     else if (fnName.find("_rtp") != std::string::npos)
       rmode = Half_RTP;
 
-    for (unsigned i = 0; i < op.num; i++)
+    if (op.size == 4)
     {
-      if (op.size == 4)
-        halfData[i] = floatToHalf(((float*)data)[i], rmode);
-      else
+      floatToHalf((float*)data, halfData, op.num, rmode);
+    }
+    else
+    {
+      for (unsigned i = 0; i < op.num; i++)
         halfData[i] = doubleToHalf(((double*)data)[i], rmode);
     }
 
@@ -3495,7 +3795,7 @@ class WorkItemBuiltins
     const llvm::Value* addr = dbgInst->getAddress();
 
     const llvm::DILocalVariable* var = dbgInst->getVariable();
-    workItem->m_variables[var->getName().str()] = {addr, var};
+    workItem->getDebugState()->variables[var->getName().str()] = {addr, var};
   }
 
   DEFINE_BUILTIN(llvm_dbg_value)
@@ -3507,7 +3807,7 @@ class WorkItemBuiltins
     // uint64_t offset = dbgInst->getOffset();
 
     const llvm::DILocalVariable* var = dbgInst->getVariable();
-    workItem->m_variables[var->getName().str()] = {value, var};
+    workItem->getDebugState()->variables[var->getName().str()] = {value, var};
   }
 
   DEFINE_BUILTIN(llvm_lifetime_start)
@@ -3529,7 +3829,7 @@ class WorkItemBuiltins
     unsigned destAddrSpace = memcpyInst->getDestAddressSpace();
     unsigned srcAddrSpace = memcpyInst->getSourceAddressSpace();
 
-    unsigned char* buffer = workItem->m_pool.alloc(size);
+    unsigned char* buffer = workItem->m_pool->alloc(size);
     workItem->getMemory(srcAddrSpace)->load(buffer, src, size);
     workItem->getMemory(destAddrSpace)->store(buffer, dest, size);
   }
@@ -3541,7 +3841,7 @@ class WorkItemBuiltins
     size_t size = workItem->getOperand(memsetInst->getLength()).getUInt();
     unsigned addressSpace = memsetInst->getDestAddressSpace();
 
-    unsigned char* buffer = workItem->m_pool.alloc(size);
+    unsigned char* buffer = workItem->m_pool->alloc(size);
     unsigned char value = UARG(1);
     memset(buffer, value, size);
     workItem->getMemory(addressSpace)->store(buffer, dest, size);
@@ -3552,10 +3852,205 @@ class WorkItemBuiltins
     FATAL_ERROR("Encountered trap instruction");
   }
 
+  template <template <typename, unsigned> class Impl, typename T>
+  static Callback selectWidth(const Specialization& s, unsigned width)
+  {
+    switch (width)
+    {
+    case 1:
+      return Impl<T, 1>::select(s);
+    case 2:
+      return Impl<T, 2>::select(s);
+    case 3:
+      return Impl<T, 3>::select(s);
+    case 4:
+      return Impl<T, 4>::select(s);
+    case 8:
+      return Impl<T, 8>::select(s);
+    case 16:
+      return Impl<T, 16>::select(s);
+    default:
+      return NULL;
+    }
+  }
+
+  template <template <typename, unsigned> class Impl>
+  static Callback selectFloat(const Specialization& s, const llvm::Type* type,
+                              unsigned width)
+  {
+    if (type->isFloatTy())
+      return selectWidth<Impl, float>(s, width);
+    if (type->isDoubleTy())
+      return selectWidth<Impl, double>(s, width);
+    return NULL;
+  }
+
+  template <template <typename, unsigned> class Impl>
+  static Callback selectInteger(const Specialization& s,
+                                const llvm::Type* type, unsigned width,
+                                bool isSigned)
+  {
+    if (!type->isIntegerTy())
+      return NULL;
+
+    switch (type->getIntegerBitWidth())
+    {
+    case 8:
+      return isSigned ? selectWidth<Impl, int8_t>(s, width)
+                      : selectWidth<Impl, uint8_t>(s, width);
+    case 16:
+      return isSigned ? selectWidth<Impl, int16_t>(s, width)
+                      : selectWidth<Impl, uint16_t>(s, width);
+    case 32:
+      return isSigned ? selectWidth<Impl, int32_t>(s, width)
+                      : selectWidth<Impl, uint32_t>(s, width);
+    case 64:
+      return isSigned ? selectWidth<Impl, int64_t>(s, width)
+                      : selectWidth<Impl, uint64_t>(s, width);
+    default:
+      return NULL;
+    }
+  }
+
 public:
   static BuiltinFunctionMap initBuiltins();
+
+  static BuiltinFunction specialize(const BuiltinFunction& builtin,
+                                    const string& overload,
+                                    const llvm::Function* function)
+  {
+    const llvm::FunctionType* fnType = function->getFunctionType();
+    Specialization s = {builtin.func, fnType->getNumParams(), false};
+    if (!s.arity)
+    {
+      return builtin;
+    }
+
+    // All arguments must match the first, except that the last may be a
+    // scalar applied to every element
+    const llvm::Type* type = fnType->getParamType(0);
+    const llvm::Type* elemType = type;
+    unsigned width = 1;
+    if (auto vecType = llvm::dyn_cast<llvm::FixedVectorType>(type))
+    {
+      width = vecType->getNumElements();
+      elemType = vecType->getElementType();
+    }
+    for (unsigned i = 1; i < s.arity; i++)
+    {
+      const llvm::Type* argType = fnType->getParamType(i);
+      if (argType == elemType && width > 1 && i == s.arity - 1)
+      {
+        s.scalarLast = true;
+      }
+      else if (argType != type)
+      {
+        return builtin;
+      }
+    }
+
+    // Results match the arguments, except for dot products
+    const llvm::Type* resultType =
+      builtin.func == (Callback)dot ? elemType : type;
+    if (function->getReturnType() != resultType)
+    {
+      return builtin;
+    }
+
+    // Signedness of integer arguments is only known from the overload
+    char argType = overload.empty() ? 0 : getOverloadArgType(overload);
+    bool isSigned = argType && strchr("csil", argType);
+
+    // Find the arity, element-wise operation and signedness of the builtin
+    static const struct
+    {
+      Callback func;
+      char kind;
+      unsigned arity;
+    } generics[] = {
+      {(Callback)f1arg, 'f', 1}, {(Callback)f2arg, 'f', 2},
+      {(Callback)f3arg, 'f', 3}, {(Callback)u1arg, 'u', 1},
+      {(Callback)u2arg, 'u', 2}, {(Callback)u3arg, 'u', 3},
+      {(Callback)s1arg, 's', 1}, {(Callback)s2arg, 's', 2},
+      {(Callback)s3arg, 's', 3},
+    };
+    void* op = builtin.op;
+    char kind = 0;
+    for (unsigned i = 0; i < sizeof(generics) / sizeof(generics[0]); i++)
+    {
+      if (builtin.func == generics[i].func)
+      {
+        if (generics[i].arity != s.arity)
+        {
+          return builtin;
+        }
+        kind = generics[i].kind;
+      }
+    }
+
+    if (builtin.func == (Callback)clamp || builtin.func == (Callback)max ||
+        builtin.func == (Callback)min)
+    {
+      // These select an operation from the overload on every call
+      if (argType == 'f' || argType == 'd')
+        kind = 'f';
+      else if (argType && strchr("htjm", argType))
+        kind = 'u';
+      else if (isSigned)
+        kind = 's';
+      else
+        return builtin;
+
+      // Floating point max and min use fmax/fmin for vector arguments
+      typedef double (*F2)(double, double);
+      typedef uint64_t (*U2)(uint64_t, uint64_t);
+      typedef int64_t (*S2)(int64_t, int64_t);
+      bool vector = width > 1;
+      if (builtin.func == (Callback)clamp && kind == 'f')
+        op = (void*)(double (*)(double, double, double))_clamp_;
+      else if (builtin.func == (Callback)clamp && kind == 'u')
+        op = (void*)(uint64_t(*)(uint64_t, uint64_t, uint64_t))_clamp_;
+      else if (builtin.func == (Callback)clamp)
+        op = (void*)(int64_t(*)(int64_t, int64_t, int64_t))_clamp_;
+      else if (builtin.func == (Callback)max && kind == 'f')
+        op = vector ? (void*)(F2)::fmax : (void*)(F2)_max_;
+      else if (builtin.func == (Callback)max && kind == 'u')
+        op = (void*)(U2)_max_;
+      else if (builtin.func == (Callback)max)
+        op = (void*)(S2)_max_;
+      else if (kind == 'f')
+        op = vector ? (void*)(F2)::fmin : (void*)(F2)_min_;
+      else if (kind == 'u')
+        op = (void*)(U2)_min_;
+      else
+        op = (void*)(S2)_min_;
+    }
+
+    Callback func = NULL;
+    if (kind && !s.scalarLast)
+    {
+      func = kind == 'f' ? selectFloat<Typed>(s, elemType, width)
+                         : selectInteger<Typed>(s, elemType, width,
+                                                kind == 's');
+    }
+    else if (!kind)
+    {
+      func = elemType->isIntegerTy()
+               ? selectInteger<TypedInteger>(s, elemType, width, isSigned)
+               : selectFloat<TypedFloat>(s, elemType, width);
+    }
+
+    return func ? BuiltinFunction(func, op, builtin.pure) : builtin;
+  }
 };
 
+BuiltinFunction specializeBuiltin(const BuiltinFunction& builtin,
+                                  const string& overload,
+                                  const llvm::Function* function)
+{
+  return WorkItemBuiltins::specialize(builtin, overload, function);
+}
+
 // Utility macros for generating builtin function map
 #define CAST                                                                   \
   void (*)(WorkItem*, const llvm::CallInst*, const std::string&,               \
@@ -3564,10 +4059,10 @@ public:
 #define F2ARG(name) (double (*)(double, double)) name
 #define F3ARG(name) (double (*)(double, double, double)) name
 #define ADD_BUILTIN(name, func, op)                                            \
-  builtins[name] = BuiltinFunction((CAST)func, (void*)op);
+  builtins[name] = BuiltinFunction((CAST)func, (void*)op, pure);
 #define ADD_PREFIX_BUILTIN(name, func, op)                                     \
   workItemPrefixBuiltins.push_back(                                            \
-    make_pair(name, BuiltinFunction((CAST)func, (void*)op)));
+    make_pair(name, BuiltinFunction((CAST)func, (void*)op, pure)));
 
 // Generate builtin function map
 BuiltinFunctionPrefixList workItemPrefixBuiltins;
@@ -3576,6 +4071,10 @@ BuiltinFunctionMap WorkItemBuiltins::initBuiltins()
 {
   BuiltinFunctionMap builtins;
 
+  // Whether the functions added next compute their results only from their
+  // arguments, so work-items with the same arguments may share them
+  bool pure = false;
+
   // Async Copy and Prefetch Functions
   ADD_BUILTIN("async_work_group_copy", async_work_group_copy, NULL);
   ADD_BUILTIN("async_work_group_strided_copy", async_work_group_copy, NULL);
@@ -3607,6 +4106,7 @@ BuiltinFunctionMap WorkItemBuiltins::initBuiltins()
   ADD_BUILTIN("atomic_xor", atomic_op, NULL);
 
   // Common Functions
+  pure = true;
   ADD_BUILTIN("clamp", clamp, NULL);
   ADD_BUILTIN("degrees", f1arg, _degrees_);
   ADD_BUILTIN("max", max, NULL);
@@ -3628,6 +4128,7 @@ BuiltinFunctionMap WorkItemBuiltins::initBuiltins()
   ADD_BUILTIN("fast_normalize", normalize, NULL);
 
   // Image Functions
+  pure = false;
   ADD_BUILTIN("get_image_array_size", get_image_array_size, NULL);
   ADD_BUILTIN("get_image_channel_data_type", get_image_channel_data_type, NULL);
   ADD_BUILTIN("get_image_channel_order", get_image_channel_order, NULL);
@@ -3645,6 +4146,7 @@ BuiltinFunctionMap WorkItemBuiltins::initBuiltins()
               NULL);
 
   // Integer Functions
+  pure = true;
   ADD_BUILTIN("abs", abs_builtin, NULL);
   ADD_BUILTIN("abs_diff", abs_diff, NULL);
   ADD_BUILTIN("add_sat", add_sat, NULL);
@@ -3786,6 +4288,7 @@ BuiltinFunctionMap WorkItemBuiltins::initBuiltins()
   ADD_BUILTIN("signbit", rel1arg, _signbit_);
 
   // Synchronization Functions
+  pure = false;
   ADD_BUILTIN("barrier", work_group_barrier, NULL);
   ADD_BUILTIN("work_group_barrier", work_group_barrier, NULL);
   ADD_BUILTIN("mem_fence", mem_fence, NULL);
@@ -3814,25 +4317,29 @@ BuiltinFunctionMap WorkItemBuiltins::initBuiltins()
   ADD_BUILTIN("get_enqueued_local_size", get_enqueued_local_size, NULL);
 
   // Other Functions
+  pure = true;
   ADD_PREFIX_BUILTIN("as_", astype, NULL);
   ADD_PREFIX_BUILTIN("convert_half", convert_half, NULL);
   ADD_PREFIX_BUILTIN("convert_float", convert_float, NULL);
   ADD_PREFIX_BUILTIN("convert_double", convert_float, NULL);
   ADD_PREFIX_BUILTIN("convert_u", convert_uint, NULL);
   ADD_PREFIX_BUILTIN("convert_", convert_sint, NULL);
+  pure = false;
   ADD_BUILTIN("printf", printf_builtin, NULL);
 
   // LLVM Intrinsics
+  pure = true;
   ADD_PREFIX_BUILTIN("llvm.bswap.", llvm_bswap, NULL);
+  ADD_PREFIX_BUILTIN("llvm.fabs.f", f1arg, F1ARG(fabs));
+  ADD_PREFIX_BUILTIN("llvm.fmuladd", fma_builtin, NULL);
+  pure = false;
   ADD_BUILTIN("llvm.dbg.declare", llvm_dbg_declare, NULL);
   ADD_BUILTIN("llvm.dbg.value", llvm_dbg_value, NULL);
-  ADD_PREFIX_BUILTIN("llvm.fabs.f", f1arg, F1ARG(fabs));
   ADD_PREFIX_BUILTIN("llvm.lifetime.start", llvm_lifetime_start, NULL);
   ADD_PREFIX_BUILTIN("llvm.lifetime.end", llvm_lifetime_end, NULL);
   ADD_PREFIX_BUILTIN("llvm.memcpy", llvm_memcpy, NULL);
   ADD_PREFIX_BUILTIN("llvm.memmove", llvm_memcpy, NULL);
   ADD_PREFIX_BUILTIN("llvm.memset", llvm_memset, NULL);
-  ADD_PREFIX_BUILTIN("llvm.fmuladd", fma_builtin, NULL);
   ADD_BUILTIN("llvm.trap", llvm_trap, NULL);
 
   return builtins;
@@ -302,6 +302,80 @@ unsigned getEnvInt(const char* var, int def, bool allowZero)
   return result;
 }
 
+#define XXH_PRIME1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME3 0x165667B19E3779F9ULL
+#define XXH_PRIME4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME5 0x27D4EB2F165667C5ULL
+
+static uint64_t rotl64(uint64_t x, unsigned r)
+{
+  return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t xxhRound(uint64_t acc, uint64_t input)
+{
+  return rotl64(acc + input * XXH_PRIME2, 31) * XXH_PRIME1;
+}
+
+static uint64_t xxhMerge(uint64_t acc, uint64_t value)
+{
+  return (acc ^ xxhRound(0, value)) * XXH_PRIME1 + XXH_PRIME4;
+}
+
+uint64_t computeDigest(const void* data, size_t size)
+{
+  // Data is read as little-endian words, which matches the host byte order
+  // on every platform Oclgrind supports
+  const unsigned char* p = (const unsigned char*)data;
+  const unsigned char* end = p + size;
+  uint64_t h, word64;
+  uint32_t word32;
+
+  if (size >= 32)
+  {
+    uint64_t v[4] = {XXH_PRIME1 + XXH_PRIME2, XXH_PRIME2, 0, -XXH_PRIME1};
+    for (; p + 32 <= end; p += 32)
+    {
+      for (unsigned i = 0; i < 4; i++)
+      {
+        memcpy(&word64, p + i * 8, 8);
+        v[i] = xxhRound(v[i], word64);
+      }
+    }
+    h = rotl64(v[0], 1) + rotl64(v[1], 7) + rotl64(v[2], 12) +
+        rotl64(v[3], 18);
+    for (unsigned i = 0; i < 4; i++)
+      h = xxhMerge(h, v[i]);
+  }
+  else
+  {
+    h = XXH_PRIME5;
+  }
+  h += size;
+
+  for (; p + 8 <= end; p += 8)
+  {
+    memcpy(&word64, p, 8);
+    h = rotl64(h ^ xxhRound(0, word64), 27) * XXH_PRIME1 + XXH_PRIME4;
+  }
+  if (p + 4 <= end)
+  {
+    memcpy(&word32, p, 4);
+    h = rotl64(h ^ (word32 * XXH_PRIME1), 23) * XXH_PRIME2 + XXH_PRIME3;
+    p += 4;
+  }
+  for (; p < end; p++)
+    h = rotl64(h ^ (*p * XXH_PRIME5), 11) * XXH_PRIME1;
+
+  h ^= h >> 33;
+  h *= XXH_PRIME2;
+  h ^= h >> 29;
+  h *= XXH_PRIME3;
+  h ^= h >> 32;
+  return h;
+}
+
 void dumpInstruction(ostream& out, const llvm::Instruction* instruction)
 {
   llvm::raw_os_ostream stream(out);
@@ -775,6 +849,40 @@ void printTypedData(const llvm::Type* type, const unsigned char* data)
   }
 }
 
+bool readBinary(const string& data, size_t& offset, uint32_t& value)
+{
+  if (data.size() < sizeof(value) || offset > data.size() - sizeof(value))
+  {
+    return false;
+  }
+  memcpy(&value, data.data() + offset, sizeof(value));
+  offset += sizeof(value);
+  return true;
+}
+
+bool readBinary(const string& data, size_t& offset, uint64_t& value)
+{
+  if (data.size() < sizeof(value) || offset > data.size() - sizeof(value))
+  {
+    return false;
+  }
+  memcpy(&value, data.data() + offset, sizeof(value));
+  offset += sizeof(value);
+  return true;
+}
+
+bool readBinary(const string& data, size_t& offset, string& value)
+{
+  uint32_t length;
+  if (!readBinary(data, offset, length) || length > data.size() - offset)
+  {
+    return false;
+  }
+  value = data.substr(offset, length);
+  offset += length;
+  return true;
+}
+
 size_t resolveConstantPointer(const llvm::Value* ptr, TypedValueMap& values)
 {
   if (values.count(ptr))
@@ -863,6 +971,22 @@ size_t resolveGEP(size_t base, const llvm::Type* ptrType,
   return address;
 }
 
+void writeBinary(string& data, uint32_t value)
+{
+  data.append((const char*)&value, sizeof(value));
+}
+
+void writeBinary(string& data, uint64_t value)
+{
+  data.append((const char*)&value, sizeof(value));
+}
+
+void writeBinary(string& data, const string& value)
+{
+  writeBinary(data, (uint32_t)value.size());
+  data.append(value);
+}
+
 FatalError::FatalError(const string& msg, const string& file, size_t line)
     : std::runtime_error(msg)
 {
@@ -943,12 +1067,29 @@ uint8_t* MemoryPool::alloc(size_t size)
   return buffer;
 }
 
+TypedValue MemoryPool::allocValue(unsigned size, unsigned num)
+{
+  TypedValue value(size, num, NULL);
+  if (!value.allocInline())
+    value.data = alloc(size * num);
+  return value;
+}
+
+void MemoryPool::clear()
+{
+  for (auto itr = m_blocks.begin(); itr != m_blocks.end(); itr++)
+  {
+    delete[] * itr;
+  }
+  m_blocks.clear();
+
+  // Force next allocation to create new block
+  m_offset = m_blockSize;
+}
+
 TypedValue MemoryPool::clone(const TypedValue& source)
 {
-  TypedValue dest;
-  dest.size = source.size;
-  dest.num = source.num;
-  dest.data = alloc(dest.size * dest.num);
+  TypedValue dest = allocValue(source.size, source.num);
   memcpy(dest.data, source.data, dest.size * dest.num);
   return dest;
 }
@@ -12,6 +12,7 @@
 #define CL_TARGET_OPENCL_VERSION 300
 #include "CL/cl.h"
 
+#include <atomic>
 #include <cassert>
 #include <cstdio>
 #include <cstdlib>
@@ -106,6 +107,36 @@ enum MessageType
   ERROR,
 };
 
+// Plugin callbacks, used by plugins to declare which events they handle
+enum PluginCallback
+{
+  CallbackHostMemoryLoad,
+  CallbackHostMemoryStore,
+  CallbackHostMemoryTransfer,
+  CallbackInstructionExecuted,
+  CallbackInstructionsExecuted,
+  CallbackKernelBegin,
+  CallbackKernelEnd,
+  CallbackLog,
+  CallbackMemoryAllocated,
+  CallbackMemoryAtomicLoad,
+  CallbackMemoryAtomicStore,
+  CallbackMemoryDeallocated,
+  CallbackMemoryLoad,
+  CallbackMemoryMap,
+  CallbackMemoryStore,
+  CallbackMemoryUnmap,
+  CallbackWorkGroupBarrier,
+  CallbackWorkGroupBegin,
+  CallbackWorkGroupComplete,
+  CallbackWorkItemBegin,
+  CallbackWorkItemComplete,
+  CallbackWorkItemBarrier,
+  CallbackWorkItemClearBarrier,
+  NumPluginCallbacks
+};
+#define CALLBACK_BIT(callback) (1u << (callback))
+
 // 3-dimensional size
 struct Size3
 {
@@ -120,13 +151,51 @@ struct Size3
   friend std::ostream& operator<<(std::ostream& stream, const Size3& sz);
 };
 
-// Structure for a value with a size/type
+// Structure for a value with a size/type, whose data is held elsewhere or,
+// for small values allocated inline, within the structure itself
 struct TypedValue
 {
+  // Largest value that can be held inside the structure
+  static const unsigned INLINE_SIZE = 16;
+
   unsigned size;
   unsigned num;
   unsigned char* data;
 
+  TypedValue() : size(0), num(0), data(NULL) {}
+  TypedValue(unsigned size, unsigned num, unsigned char* data)
+    : size(size), num(num), data(data)
+  {
+  }
+  TypedValue(const TypedValue& value) { *this = value; }
+  // Values held inline are copied, others still share their data
+  TypedValue& operator=(const TypedValue& value)
+  {
+    size = value.size;
+    num = value.num;
+    if (value.isInline())
+    {
+      if (&value != this)
+        memcpy(m_inline, value.m_inline, INLINE_SIZE);
+      data = m_inline;
+    }
+    else
+    {
+      data = value.data;
+    }
+    return *this;
+  }
+
+  // Point data at the structure's own storage, if the value fits
+  bool allocInline()
+  {
+    if (size * num > INLINE_SIZE)
+      return false;
+    data = m_inline;
+    return true;
+  }
+  bool isInline() const { return data == m_inline; }
+
   bool operator==(const TypedValue& rhs) const;
   bool operator!=(const TypedValue& rhs) const;
 
@@ -142,6 +211,32 @@ struct TypedValue
   void setPointer(size_t value, unsigned index = 0);
   void setSInt(int64_t value, unsigned index = 0);
   void setUInt(uint64_t value, unsigned index = 0);
+
+private:
+  unsigned char m_inline[INLINE_SIZE];
+};
+
+// Current and peak number of bytes held by one category of allocations
+class MemoryUsage
+{
+public:
+  MemoryUsage() : m_current(0), m_peak(0) {}
+
+  void allocate(size_t bytes) { observe(m_current += bytes); }
+  size_t getCurrent() const { return m_current; }
+  size_t getPeak() const { return m_peak; }
+  void observe(size_t bytes)
+  {
+    size_t peak = m_peak;
+    while (bytes > peak && !m_peak.compare_exchange_weak(peak, bytes))
+      ;
+  }
+  void release(size_t bytes) { m_current -= bytes; }
+  void resetPeak() { m_peak = m_current.load(); }
+
+private:
+  std::atomic<size_t> m_current;
+  std::atomic<size_t> m_peak;
 };
 
 // Private memory map type
@@ -161,6 +256,9 @@ bool checkEnv(const char* var);
 // Get an environment variable as an integer
 unsigned getEnvInt(const char* var, int def = 0, bool allowZero = true);
 
+// Compute the 64-bit xxHash (XXH64, seed 0) of some data
+uint64_t computeDigest(const void* data, size_t size);
+
 // Output an instruction in human-readable format
 void dumpInstruction(std::ostream& out, const llvm::Instruction* instruction);
 
@@ -200,6 +298,12 @@ double now();
 // Print data in a human readable format (according to its type)
 void printTypedData(const llvm::Type* type, const unsigned char* data);
 
+// Read a value from a binary record, advancing the offset
+// Returns false if the record is too short
+bool readBinary(const std::string& data, size_t& offset, uint32_t& value);
+bool readBinary(const std::string& data, size_t& offset, uint64_t& value);
+bool readBinary(const std::string& data, size_t& offset, std::string& value);
+
 // Resolve a constant pointer, using a set of known constant values
 size_t resolveConstantPointer(const llvm::Value* ptr, TypedValueMap& values);
 
@@ -207,6 +311,11 @@ size_t resolveConstantPointer(const llvm::Value* ptr, TypedValueMap& values);
 size_t resolveGEP(size_t base, const llvm::Type* ptrType,
                   std::vector<int64_t>& offsets);
 
+// Append a value to a binary record (in host byte order)
+void writeBinary(std::string& data, uint32_t value);
+void writeBinary(std::string& data, uint64_t value);
+void writeBinary(std::string& data, const std::string& value);
+
 // Exception class for raising fatal errors
 class FatalError : std::runtime_error
 {
@@ -239,6 +348,9 @@ public:
   MemoryPool(size_t blockSize = 1024);
   ~MemoryPool();
   uint8_t* alloc(size_t size);
+  // Allocate a value, held inline if small enough
+  TypedValue allocValue(unsigned size, unsigned num);
+  void clear();
   TypedValue clone(const TypedValue& source);
 
 private:
@@ -8,9 +8,88 @@
 
 #include "half.h"
 
+#if (defined(__GNUC__) || defined(__clang__)) &&                             \
+  (defined(__x86_64__) || defined(__i386__))
+#include <cpuid.h>
+#include <immintrin.h>
+#define HAVE_F16C 1
+#endif
+
 namespace oclgrind
 {
+static float convertHalfToFloat(uint16_t half);
+static uint16_t convertFloatToHalf(float sp, HalfRoundMode round);
+
+// Whether a float is converted to a normalized half (possibly rounding up
+// to infinity), which hardware conversions round the same way as
+// floatToHalf(), unlike zeros, denormals, overflows and NaNs
+static bool isNormalHalf(float sp)
+{
+  uint32_t f;
+  memcpy(&f, &sp, sizeof(f));
+  int e = (int)((f >> 23) & 0xFF) - 127 + 15;
+  return e > 0 && e < 0x1F;
+}
+
+#if HAVE_F16C
+static bool hasF16C()
+{
+  // The conversions are VEX encoded, so need the OS to save AVX state
+  unsigned eax, ebx, ecx, edx;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+    return false;
+  if (!(ecx & bit_OSXSAVE) || !(ecx & bit_AVX) || !(ecx & bit_F16C))
+    return false;
+  unsigned xcr0, xcr0High;
+  __asm__("xgetbv" : "=a"(xcr0), "=d"(xcr0High) : "c"(0));
+  return (xcr0 & 0x6) == 0x6;
+}
+static const bool useF16C = hasF16C();
+
+__attribute__((target("f16c"))) static __m128i cvtps_ph(__m128 sp,
+                                                         HalfRoundMode round)
+{
+  switch (round)
+  {
+  case Half_RTN:
+    return _mm_cvtps_ph(sp, _MM_FROUND_TO_NEG_INF);
+  case Half_RTZ:
+    return _mm_cvtps_ph(sp, _MM_FROUND_TO_ZERO);
+  case Half_RTP:
+    return _mm_cvtps_ph(sp, _MM_FROUND_TO_POS_INF);
+  default:
+    return _mm_cvtps_ph(sp, _MM_FROUND_TO_NEAREST_INT);
+  }
+}
+#endif
+
+void halfToFloat(const uint16_t* half, float* sp, size_t n)
+{
+  for (size_t i = 0; i < n; i++)
+  {
+    sp[i] = halfToFloat(half[i]);
+  }
+}
+
 float halfToFloat(uint16_t half)
+{
+  // Every half is converted once, keeping the bits of NaNs
+  static const uint32_t* table = []() {
+    uint32_t* table = new uint32_t[0x10000];
+    for (uint32_t h = 0; h < 0x10000; h++)
+    {
+      float f = convertHalfToFloat(h);
+      memcpy(table + h, &f, sizeof(f));
+    }
+    return table;
+  }();
+
+  float f;
+  memcpy(&f, table + half, sizeof(f));
+  return f;
+}
+
+static float convertHalfToFloat(uint16_t half)
 {
   uint16_t h_sign, h_exponent, h_mantissa;
   uint32_t f_sign, f_exponent, f_mantissa;
@@ -60,7 +139,56 @@ float halfToFloat(uint16_t half)
   return *(float*)&result;
 }
 
+void floatToHalf(const float* sp, uint16_t* half, size_t n,
+                 HalfRoundMode round)
+{
+  size_t i = 0;
+#if HAVE_F16C
+  // Convert four values at a time if they are all normalized halfs
+  if (useF16C)
+  {
+    for (; i + 4 <= n; i += 4)
+    {
+      if (isNormalHalf(sp[i]) && isNormalHalf(sp[i + 1]) &&
+          isNormalHalf(sp[i + 2]) && isNormalHalf(sp[i + 3]))
+      {
+        _mm_storel_epi64((__m128i*)(half + i),
+                         cvtps_ph(_mm_loadu_ps(sp + i), round));
+      }
+      else
+      {
+        for (size_t j = i; j < i + 4; j++)
+          half[j] = floatToHalf(sp[j], round);
+      }
+    }
+  }
+#endif
+  for (; i < n; i++)
+  {
+    half[i] = floatToHalf(sp[i], round);
+  }
+}
+
 uint16_t floatToHalf(float sp, HalfRoundMode round)
+{
+#if HAVE_F16C
+  if (useF16C && isNormalHalf(sp))
+    return _mm_extract_epi16(cvtps_ph(_mm_set_ss(sp), round), 0);
+#elif defined(__aarch64__)
+  // Conversions use the rounding mode of the FPCR, which is left to nearest
+  if (round == Half_RTE && isNormalHalf(sp))
+  {
+    __fp16 h = sp;
+    uint16_t bits;
+    memcpy(&bits, &h, sizeof(bits));
+    return bits;
+  }
+#endif
+
+  return convertFloatToHalf(sp, round);
+}
+
+static uint16_t convertFloatToHalf(float sp, HalfRoundMode round)
 {
   uint16_t h_sign, h_exponent, h_mantissa;
   uint32_t f_sign, f_exponent, f_mantissa;
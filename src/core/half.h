@@ -23,7 +23,10 @@ enum HalfRoundMode
 };
 
 float halfToFloat(uint16_t half);
+void halfToFloat(const uint16_t* half, float* sp, size_t n);
 
 uint16_t floatToHalf(float sp, HalfRoundMode round = Half_RTZ);
+void floatToHalf(const float* sp, uint16_t* half, size_t n,
+                 HalfRoundMode round = Half_RTZ);
 uint16_t doubleToHalf(double dp, HalfRoundMode round = Half_RTZ);
 } // namespace oclgrind
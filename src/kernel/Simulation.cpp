@@ -6,9 +6,11 @@
 // license terms please see the LICENSE file distributed with this
 // source code.
 
+#include <algorithm>
 #include <cassert>
 #include <cmath>
 #include <iostream>
+#include <limits>
 #include <sstream>
 
 #include "core/Context.h"
@@ -31,6 +33,16 @@ using namespace std;
     throw "Invalid char value";                                                \
   }
 
+// Buffer contents in converted binary files start on a boundary that allows
+// them to be mapped directly
+#define BINARY_ALIGNMENT 4096
+
+// Header tokens for each argument data type
+static const char* const TYPE_NAMES[] = {
+  NULL,   "char", "uchar", "short", "ushort", "int",
+  "uint", "long", "ulong", "float", "double",
+};
+
 // Utility to read a typed value from a stream
 template <typename T> T readValue(istream& stream);
 
@@ -39,16 +51,138 @@ Simulation::Simulation()
   m_context = new Context();
   m_kernel = NULL;
   m_program = NULL;
+  m_programs = NULL;
+  m_dumpFormat = DUMP_TEXT;
+}
+
+Simulation::Simulation(Context* context, ProgramCache* programs)
+{
+  m_context = context;
+  m_kernel = NULL;
+  m_program = NULL;
+  m_programs = programs;
+  m_dumpFormat = DUMP_TEXT;
 }
 
 Simulation::~Simulation()
 {
   delete m_kernel;
-  delete m_program;
-  delete m_context;
+
+  if (!m_programs)
+  {
+    delete m_program;
+    delete m_context;
+    return;
+  }
+
+  // Leave the context and its programs for the next simulation
+  auto cached = m_programs->find(m_programFile);
+  if (cached == m_programs->end() || cached->second != m_program)
+    delete m_program;
+  for (size_t address : m_buffers)
+    m_context->getGlobalMemory()->deallocateBuffer(address);
+}
+
+void Simulation::convertArgument(unsigned int addrSpace, size_t size,
+                                 cl_mem_flags flags, ArgDataType type,
+                                 bool null, bool noinit, bool dump, bool hex,
+                                 const unsigned char* data,
+                                 const string& file, size_t offset)
+{
+  if (addrSpace == CL_KERNEL_ARG_ADDRESS_LOCAL)
+  {
+    m_convertSim << "<size=" << size << ">" << endl;
+    return;
+  }
+  if (null)
+  {
+    m_convertSim << "<null>" << endl;
+    return;
+  }
+
+  m_convertSim << "<size=" << size << " " << TYPE_NAMES[type];
+
+  // Scalar values stay in the simulator file, written in decimal
+  if (addrSpace == CL_KERNEL_ARG_ADDRESS_PRIVATE)
+  {
+    m_convertSim << ">";
+
+#define CONVERT_TYPE(type, T)                                                  \
+  case type:                                                                   \
+    convertValues<T>(data, size);                                              \
+    break;
+
+    switch (type)
+    {
+      CONVERT_TYPE(TYPE_CHAR, int8_t);
+      CONVERT_TYPE(TYPE_UCHAR, uint8_t);
+      CONVERT_TYPE(TYPE_SHORT, int16_t);
+      CONVERT_TYPE(TYPE_USHORT, uint16_t);
+      CONVERT_TYPE(TYPE_INT, int32_t);
+      CONVERT_TYPE(TYPE_UINT, uint32_t);
+      CONVERT_TYPE(TYPE_LONG, int64_t);
+      CONVERT_TYPE(TYPE_ULONG, uint64_t);
+      CONVERT_TYPE(TYPE_FLOAT, float);
+      CONVERT_TYPE(TYPE_DOUBLE, double);
+    default:
+      throw "Invalid argument data type";
+    }
+    m_convertSim << endl;
+    return;
+  }
+
+  if (dump)
+    m_convertSim << " dump";
+  if (hex)
+    m_convertSim << " hex";
+  if (flags & CL_MEM_READ_ONLY)
+    m_convertSim << " ro";
+  if (flags & CL_MEM_WRITE_ONLY)
+    m_convertSim << " wo";
+
+  if (!file.empty())
+  {
+    m_convertSim << " file=" << file << " offset=" << offset;
+  }
+  else if (noinit || size == 0)
+  {
+    m_convertSim << " noinit";
+  }
+  else
+  {
+    // Append buffer contents to the binary file
+    size_t position = m_convertData.tellp();
+    size_t aligned =
+      (position + BINARY_ALIGNMENT - 1) & ~(size_t)(BINARY_ALIGNMENT - 1);
+    for (; position < aligned; position++)
+      m_convertData.put(0);
+    m_convertData.write((const char*)data, size);
+    if (m_convertData.fail())
+    {
+      throw "Failed to write binary file";
+    }
+    m_convertSim << " file=" << m_convertDataName << " offset=" << aligned;
+  }
+  m_convertSim << ">" << endl;
 }
 
-template <typename T> void Simulation::dumpArgument(DumpArg& arg)
+template <typename T>
+void Simulation::convertValues(const unsigned char* data, size_t size)
+{
+  // Write enough digits for floating point values to be read back exactly
+  m_convertSim.precision(numeric_limits<T>::max_digits10);
+  for (size_t i = 0; i < size / sizeof(T); i++)
+  {
+    T value = ((const T*)data)[i];
+    if (sizeof(T) == 1)
+      m_convertSim << " " << (int)value;
+    else
+      m_convertSim << " " << value;
+  }
+}
+
+template <typename T>
+void Simulation::dumpArgument(DumpArg& arg, ostream& output)
 {
   size_t num = arg.size / sizeof(T);
   T* data = new T[num];
@@ -56,17 +190,17 @@ template <typename T> void Simulation::dumpArgument(DumpArg& arg)
 
   for (size_t i = 0; i < num; i++)
   {
-    cout << "  " << arg.name << "[" << i << "] = ";
+    output << "  " << arg.name << "[" << i << "] = ";
     if (arg.hex)
-      cout << "0x" << setfill('0') << setw(sizeof(T) * 2) << hex;
+      output << "0x" << setfill('0') << setw(sizeof(T) * 2) << hex;
     if (sizeof(T) == 1)
-      cout << (int)data[i];
+      output << (int)data[i];
     else
-      cout << data[i];
-    cout << dec;
-    cout << endl;
+      output << data[i];
+    output << dec;
+    output << endl;
   }
-  cout << endl;
+  output << endl;
 
   delete[] data;
 }
@@ -116,7 +250,39 @@ template <typename T> void Simulation::get(T& result)
   throw m_simfile.eof() ? ifstream::eofbit : ifstream::failbit;
 }
 
-bool Simulation::load(const char* filename)
+void Simulation::getDefaultType(size_t index, ArgDataType& type,
+                                size_t& typeSize)
+{
+  const llvm::StringRef argType = m_kernel->getArgumentTypeName(index);
+
+#define MATCH_TYPE_PREFIX(str, value, sz)                                      \
+  else if (argType.startswith(str))                                            \
+  {                                                                            \
+    type = value;                                                              \
+    typeSize = sz;                                                             \
+  }
+
+  // Set default type using kernel introspection
+  if (false)
+    ;
+  MATCH_TYPE_PREFIX("char", TYPE_CHAR, 1)
+  MATCH_TYPE_PREFIX("uchar", TYPE_UCHAR, 1)
+  MATCH_TYPE_PREFIX("short", TYPE_SHORT, 2)
+  MATCH_TYPE_PREFIX("ushort", TYPE_USHORT, 2)
+  MATCH_TYPE_PREFIX("int", TYPE_INT, 4)
+  MATCH_TYPE_PREFIX("uint", TYPE_UINT, 4)
+  MATCH_TYPE_PREFIX("long", TYPE_LONG, 8)
+  MATCH_TYPE_PREFIX("ulong", TYPE_ULONG, 8)
+  MATCH_TYPE_PREFIX("float", TYPE_FLOAT, 4)
+  MATCH_TYPE_PREFIX("double", TYPE_DOUBLE, 8)
+  MATCH_TYPE_PREFIX("void*", TYPE_UCHAR, 1)
+  else
+  {
+    throw "Invalid default kernel argument type";
+  }
+}
+
+bool Simulation::load(const char* filename, const char* convertFile)
 {
   // Open simulator file
   m_lineNumber = 0;
@@ -146,50 +312,32 @@ bool Simulation::load(const char* filename)
     get(m_wgsize.y);
     get(m_wgsize.z);
 
-    // Open program file
-    ifstream progFile;
-    progFile.open(progFileName.c_str(), ios_base::in | ios_base::binary);
-    if (!progFile.good())
-    {
-      cerr << "Unable to open " << progFileName << endl;
-      return false;
-    }
-
-    // Check for LLVM bitcode magic numbers
-    char magic[2] = {0, 0};
-    progFile.read(magic, 2);
-    if (magic[0] == 0x42 && magic[1] == 0x43)
+    // Open converted simulator and binary files
+    if (convertFile)
     {
-      // Load bitcode
-      progFile.close();
-      m_program = Program::createFromBitcodeFile(m_context, progFileName);
-      if (!m_program)
+      m_convertDataName = convertFile;
+      m_convertDataName += ".bin";
+      m_convertSim.open(convertFile);
+      m_convertData.open(m_convertDataName.c_str(),
+                         ios_base::out | ios_base::binary);
+      if (m_convertSim.fail() || m_convertData.fail())
       {
-        cerr << "Failed to load bitcode from " << progFileName << endl;
+        cerr << "Unable to open " << convertFile << " for writing" << endl;
         return false;
       }
+      m_convertSim << progFileName << endl
+                   << kernelName << endl
+                   << m_ndrange.x << " " << m_ndrange.y << " " << m_ndrange.z
+                   << endl
+                   << m_wgsize.x << " " << m_wgsize.y << " " << m_wgsize.z
+                   << endl
+                   << endl;
     }
-    else
+
+    // Load program, reusing it if already built on this context
+    if (!loadProgram(progFileName))
     {
-      // Get size of file
-      progFile.seekg(0, ios_base::end);
-      size_t sz = progFile.tellg();
-      progFile.seekg(0, ios_base::beg);
-
-      // Load source
-      char* data = new char[sz + 1];
-      progFile.read(data, sz + 1);
-      progFile.close();
-      data[sz] = '\0';
-      m_program = new Program(m_context, data);
-      delete[] data;
-
-      // Build program
-      if (!m_program->build(""))
-      {
-        cerr << "Build failure:" << endl << m_program->getBuildLog() << endl;
-        return false;
-      }
+      return false;
     }
 
     // Get kernel
@@ -224,6 +372,17 @@ bool Simulation::load(const char* filename)
       cerr << "Unexpected token '" << next << "' (expected EOF)" << endl;
       return false;
     }
+
+    if (convertFile)
+    {
+      m_convertSim.close();
+      m_convertData.close();
+      if (m_convertSim.fail() || m_convertData.fail())
+      {
+        cerr << "Failed to write " << convertFile << endl;
+        return false;
+      }
+    }
   }
   catch (const char* err)
   {
@@ -253,6 +412,72 @@ bool Simulation::load(const char* filename)
   return true;
 }
 
+bool Simulation::loadProgram(const string& filename)
+{
+  m_programFile = filename;
+  if (m_programs)
+  {
+    auto cached = m_programs->find(filename);
+    if (cached != m_programs->end())
+    {
+      m_program = cached->second;
+      m_program->resetProgramScopeVars();
+      return true;
+    }
+  }
+
+  // Open program file
+  ifstream progFile;
+  progFile.open(filename.c_str(), ios_base::in | ios_base::binary);
+  if (!progFile.good())
+  {
+    cerr << "Unable to open " << filename << endl;
+    return false;
+  }
+
+  // Check for LLVM bitcode magic numbers
+  char magic[2] = {0, 0};
+  progFile.read(magic, 2);
+  if (magic[0] == 0x42 && magic[1] == 0x43)
+  {
+    // Load bitcode
+    progFile.close();
+    m_program = Program::createFromBitcodeFile(m_context, filename);
+    if (!m_program)
+    {
+      cerr << "Failed to load bitcode from " << filename << endl;
+      return false;
+    }
+  }
+  else
+  {
+    // Get size of file
+    progFile.seekg(0, ios_base::end);
+    size_t sz = progFile.tellg();
+    progFile.seekg(0, ios_base::beg);
+
+    // Load source
+    char* data = new char[sz + 1];
+    progFile.read(data, sz + 1);
+    progFile.close();
+    data[sz] = '\0';
+    m_program = new Program(m_context, data);
+    delete[] data;
+
+    // Build program
+    if (!m_program->build(""))
+    {
+      cerr << "Build failure:" << endl << m_program->getBuildLog() << endl;
+      return false;
+    }
+  }
+
+  if (m_programs)
+    (*m_programs)[filename] = m_program;
+
+  return true;
+}
+
 void Simulation::parseArgument(size_t index)
 {
   // Argument parsing parameters
@@ -266,6 +491,8 @@ void Simulation::parseArgument(size_t index)
   bool noinit = false;
   string fill = "";
   string range = "";
+  string file = "";
+  size_t offset = -1;
   string name = m_kernel->getArgumentName(index).str();
 
   // Set meaningful parsing status for error messages
@@ -277,7 +504,6 @@ void Simulation::parseArgument(size_t index)
   // Get argument info
   size_t argSize = m_kernel->getArgumentSize(index);
   unsigned int addrSpace = m_kernel->getArgumentAddressQualifier(index);
-  const llvm::StringRef argType = m_kernel->getArgumentTypeName(index);
 
   // Ensure we have an argument header
   char c;
@@ -345,6 +571,19 @@ void Simulation::parseArgument(size_t index)
     {
       dump = true;
     }
+    else if (token.compare(0, 4, "file") == 0)
+    {
+      if (token.size() < 6 || token[4] != '=')
+      {
+        throw "Expected =PATH after 'file'";
+      }
+      if (addrSpace != CL_KERNEL_ARG_ADDRESS_GLOBAL &&
+          addrSpace != CL_KERNEL_ARG_ADDRESS_CONSTANT)
+      {
+        throw "'file' only valid for buffer arguments";
+      }
+      file = token.substr(5);
+    }
     else if (token.compare(0, 4, "fill") == 0)
     {
       if (token.size() < 6 || token[4] != '=')
@@ -377,6 +616,22 @@ void Simulation::parseArgument(size_t index)
       }
       null = true;
     }
+    else if (token.compare(0, 6, "offset") == 0)
+    {
+      istringstream value(token.substr(6));
+      char equals = 0;
+      value >> equals;
+      if (equals != '=')
+      {
+        throw "Expected = after 'offset'";
+      }
+
+      value >> dec >> offset;
+      if (value.fail() || !value.eof())
+      {
+        throw "Invalid value for 'offset'";
+      }
+    }
     else if (token.compare(0, 5, "range") == 0)
     {
       if (token.size() < 7 || token[5] != '=')
@@ -437,44 +692,44 @@ void Simulation::parseArgument(size_t index)
   // Ensure size given
   if (null)
   {
-    if (size != -1 || !fill.empty() || !range.empty() || noinit || dump)
+    if (size != (size_t)-1 || !fill.empty() || !range.empty() || noinit ||
+        dump || !file.empty())
     {
       throw "'null' not valid with other argument descriptors";
     }
     size = 0;
   }
-  else if (size == -1)
+  else if (!file.empty())
+  {
+    // Check file holds the argument, which defaults to the rest of the file
+    ifstream input(file.c_str(), ios_base::in | ios_base::binary);
+    input.seekg(0, ios_base::end);
+    if (!input.good())
+    {
+      throw "Unable to open 'file'";
+    }
+    size_t fileSize = input.tellg();
+    if (offset == (size_t)-1)
+      offset = 0;
+    if (offset > fileSize || (size != (size_t)-1 && size > fileSize - offset))
+    {
+      throw "File too small for argument size";
+    }
+    if (size == (size_t)-1)
+      size = fileSize - offset;
+  }
+  else if (offset != (size_t)-1)
+  {
+    throw "'offset' only valid with 'file'";
+  }
+  else if (size == (size_t)-1)
   {
     throw "size required";
   }
 
   if (type == TYPE_NONE)
   {
-#define MATCH_TYPE_PREFIX(str, value, sz)                                      \
-  else if (argType.startswith(str))                                            \
-  {                                                                            \
-    type = value;                                                              \
-    typeSize = sz;                                                             \
-  }
-
-    // Set default type using kernel introspection
-    if (false)
-      ;
-    MATCH_TYPE_PREFIX("char", TYPE_CHAR, 1)
-    MATCH_TYPE_PREFIX("uchar", TYPE_UCHAR, 1)
-    MATCH_TYPE_PREFIX("short", TYPE_SHORT, 2)
-    MATCH_TYPE_PREFIX("ushort", TYPE_USHORT, 2)
-    MATCH_TYPE_PREFIX("int", TYPE_INT, 4)
-    MATCH_TYPE_PREFIX("uint", TYPE_UINT, 4)
-    MATCH_TYPE_PREFIX("long", TYPE_LONG, 8)
-    MATCH_TYPE_PREFIX("ulong", TYPE_ULONG, 8)
-    MATCH_TYPE_PREFIX("float", TYPE_FLOAT, 4)
-    MATCH_TYPE_PREFIX("double", TYPE_DOUBLE, 8)
-    MATCH_TYPE_PREFIX("void*", TYPE_UCHAR, 1)
-    else
-    {
-      throw "Invalid default kernel argument type";
-    }
+    getDefaultType(index, type, typeSize);
   }
 
   // Ensure argument data size is a multiple of format type size
@@ -501,12 +756,15 @@ void Simulation::parseArgument(size_t index)
     numInitializers++;
   if (!range.empty())
     numInitializers++;
+  if (!file.empty())
+    numInitializers++;
   if (numInitializers > 1)
   {
     throw "Multiple initializers present";
   }
 
   // Generate argument data
+  unsigned char* data = NULL;
   TypedValue value;
   value.size = argSize;
   value.num = 1;
@@ -522,9 +780,10 @@ void Simulation::parseArgument(size_t index)
   }
   else
   {
-    // Parse argument data
-    unsigned char* data = new unsigned char[size];
-    if (noinit)
+    // Parse argument data, unless it is loaded from a file
+    if (file.empty())
+      data = new unsigned char[size];
+    if (noinit || !data)
     {
     }
     else if (!fill.empty())
@@ -603,22 +862,39 @@ void Simulation::parseArgument(size_t index)
       }
     }
 
-    if (addrSpace == CL_KERNEL_ARG_ADDRESS_PRIVATE)
+    if (m_convertSim.is_open())
+    {
+      // Argument is only rewritten when converting
+    }
+    else if (addrSpace == CL_KERNEL_ARG_ADDRESS_PRIVATE)
     {
       value.data = data;
+      data = NULL;
+      m_scalarArguments[index].assign(value.data, value.data + value.size);
     }
     else
     {
       // Allocate buffer and store content
       Memory* globalMemory = m_context->getGlobalMemory();
-      size_t address = globalMemory->allocateBuffer(size, flags);
-      if (!address)
-        throw "Failed to allocate global memory";
-      if (!noinit)
-        globalMemory->store((unsigned char*)&data[0], address, size);
+      size_t address;
+      if (!file.empty())
+      {
+        address = globalMemory->createFileBuffer(size, file.c_str(), offset,
+                                                 flags);
+        if (!address)
+          throw "Failed to load buffer from 'file'";
+      }
+      else
+      {
+        address = globalMemory->allocateBuffer(size, flags);
+        if (!address)
+          throw "Failed to allocate global memory";
+        if (!noinit)
+          globalMemory->store((unsigned char*)&data[0], address, size);
+      }
+      m_buffers.push_back(address);
       value.data = new unsigned char[value.size];
       value.setPointer(address);
-      delete[] data;
 
       if (dump)
       {
@@ -628,12 +904,21 @@ void Simulation::parseArgument(size_t index)
     }
   }
 
-  // Set argument value
-  m_kernel->setArgument(index, value);
+  // Set argument value, or write it to the converted file
+  if (m_convertSim.is_open())
+  {
+    convertArgument(addrSpace, size, flags, type, null, noinit, dump, hex,
+                    data, file, offset);
+  }
+  else
+  {
+    m_kernel->setArgument(index, value);
+  }
   if (value.data)
   {
     delete[] value.data;
   }
+  delete[] data;
 
   // Reset parsing format
   m_lineBuffer.flags(previousFormat);
@@ -717,7 +1002,7 @@ void Simulation::parseRange(unsigned char* result, size_t size,
   }
 }
 
-void Simulation::run(bool dumpGlobalMemory)
+void Simulation::execute(bool dumpGlobalMemory, ostream& output)
 {
   assert(m_kernel && m_program);
   assert(m_kernel->allArgumentsSet());
@@ -726,16 +1011,31 @@ void Simulation::run(bool dumpGlobalMemory)
   KernelInvocation::run(m_context, m_kernel, 3, offset, m_ndrange, m_wgsize);
 
   // Dump individual arguments
-  cout << dec;
+  output << dec;
   list<DumpArg>::iterator itr;
   for (itr = m_dumpArguments.begin(); itr != m_dumpArguments.end(); itr++)
   {
-    cout << endl
-         << "Argument '" << itr->name << "': " << itr->size << " bytes" << endl;
+    output << endl
+           << "Argument '" << itr->name << "': " << itr->size << " bytes";
+
+    const void* data = m_context->getGlobalMemory()->getPointer(itr->address);
+    if (m_dumpFormat == DUMP_BINARY)
+    {
+      output << " at offset " << m_dumpBinary.tellp() << endl;
+      m_dumpBinary.write((const char*)data, itr->size);
+      continue;
+    }
+    else if (m_dumpFormat == DUMP_DIGEST)
+    {
+      output << ", xxh64 " << hex << setw(16) << setfill('0')
+             << computeDigest(data, itr->size) << dec << endl;
+      continue;
+    }
+    output << endl;
 
 #define DUMP_TYPE(type, T)                                                     \
   case type:                                                                   \
-    dumpArgument<T>(*itr);                                                     \
+    dumpArgument<T>(*itr, output);                                             \
     break;
 
     switch (itr->type)
@@ -758,9 +1058,186 @@ void Simulation::run(bool dumpGlobalMemory)
   // Dump global memory if required
   if (dumpGlobalMemory)
   {
-    cout << endl << "Global Memory:" << endl;
-    m_context->getGlobalMemory()->dump();
+    output << endl << "Global Memory:" << endl;
+    if (m_dumpFormat == DUMP_BINARY)
+      m_context->getGlobalMemory()->dumpBinary(output, m_dumpBinary);
+    else if (m_dumpFormat == DUMP_DIGEST)
+      m_context->getGlobalMemory()->dumpDigest(output);
+    else
+      m_context->getGlobalMemory()->dump(output);
+  }
+}
+
+void Simulation::finishDump()
+{
+  if (m_dumpBinary.is_open())
+  {
+    m_dumpBinary.close();
+    if (m_dumpBinary.fail())
+      cerr << "Failed to write binary dump" << endl;
+  }
+}
+
+void Simulation::parseReplay(const string& assignment)
+{
+  size_t equals = assignment.find('=');
+  if (equals == string::npos)
+  {
+    throw "Expected NAME=VALUE";
+  }
+  string name = assignment.substr(0, equals);
+
+  unsigned index = 0;
+  while (index < m_kernel->getNumArguments() &&
+         m_kernel->getArgumentName(index) != name)
+  {
+    index++;
+  }
+  if (index == m_kernel->getNumArguments())
+  {
+    throw "Unknown argument name";
+  }
+  if (!m_scalarArguments.count(index))
+  {
+    throw "Only scalar arguments can be replayed";
+  }
+
+  // Vector arguments take a comma separated value for each element
+  ArgDataType type = TYPE_NONE;
+  size_t typeSize = 0;
+  getDefaultType(index, type, typeSize);
+  size_t argSize = m_kernel->getArgumentSize(index);
+  string list = assignment.substr(equals + 1);
+  replace(list.begin(), list.end(), ',', ' ');
+  istringstream values(list);
+  vector<unsigned char> data(argSize);
+
+#define REPLAY_TYPE(type, T)                                                   \
+  case type:                                                                   \
+    parseScalarValues<T>(data.data(), argSize / typeSize, values);             \
+    break;
+
+  switch (type)
+  {
+    REPLAY_TYPE(TYPE_CHAR, int8_t);
+    REPLAY_TYPE(TYPE_UCHAR, uint8_t);
+    REPLAY_TYPE(TYPE_SHORT, int16_t);
+    REPLAY_TYPE(TYPE_USHORT, uint16_t);
+    REPLAY_TYPE(TYPE_INT, int32_t);
+    REPLAY_TYPE(TYPE_UINT, uint32_t);
+    REPLAY_TYPE(TYPE_LONG, int64_t);
+    REPLAY_TYPE(TYPE_ULONG, uint64_t);
+    REPLAY_TYPE(TYPE_FLOAT, float);
+    REPLAY_TYPE(TYPE_DOUBLE, double);
+  default:
+    throw "Invalid argument data type";
   }
+
+  TypedValue value = {(unsigned)argSize, 1, data.data()};
+  m_kernel->setArgument(index, value);
+}
+
+template <typename T>
+void Simulation::parseScalarValues(unsigned char* result, size_t num,
+                                   istringstream& values)
+{
+  for (size_t i = 0; i < num; i++)
+  {
+    ((T*)result)[i] = readValue<T>(values);
+    if (values.fail())
+    {
+      throw "Invalid or missing value";
+    }
+  }
+
+  string extra;
+  if (values >> extra)
+  {
+    throw "Too many values";
+  }
+}
+
+bool Simulation::replay(const char* replayFile, bool dumpGlobalMemory,
+                        ostream& output)
+{
+  ifstream replays(replayFile);
+  if (!replays.good())
+  {
+    cerr << "Unable to open replay file " << replayFile << endl;
+    return false;
+  }
+
+  // Save the loaded buffer contents, which each replay starts from
+  Memory* globalMemory = m_context->getGlobalMemory();
+  Memory::Snapshot* snapshot = globalMemory->createSnapshot();
+
+  execute(dumpGlobalMemory, output);
+
+  bool success = true;
+  string line;
+  for (unsigned lineNumber = 1; getline(replays, line); lineNumber++)
+  {
+    // Each line holds NAME=VALUE[,VALUE...] assignments to scalar arguments
+    line = line.substr(0, line.find_first_of('#'));
+    istringstream assignments(line);
+    string assignment;
+    if (!(assignments >> assignment))
+      continue;
+
+    // Reset the arguments changed by previous replays
+    for (auto& arg : m_scalarArguments)
+    {
+      TypedValue value = {(unsigned)arg.second.size(), 1, arg.second.data()};
+      m_kernel->setArgument(arg.first, value);
+    }
+
+    ostringstream header;
+    try
+    {
+      do
+      {
+        PARSING(assignment.c_str());
+        parseReplay(assignment);
+        header << " " << assignment;
+      } while (assignments >> assignment);
+    }
+    catch (const char* err)
+    {
+      cerr << replayFile << " line " << lineNumber << ": " << err << " ("
+           << m_parsing << ")" << endl;
+      success = false;
+      break;
+    }
+
+    globalMemory->restoreSnapshot(snapshot);
+    output << endl << "Replay:" << header.str() << endl;
+    execute(dumpGlobalMemory, output);
+  }
+  delete snapshot;
+
+  finishDump();
+  return success;
+}
+
+void Simulation::run(bool dumpGlobalMemory, ostream& output)
+{
+  execute(dumpGlobalMemory, output);
+  finishDump();
+}
+
+bool Simulation::setDumpFormat(DumpFormat format, const char* binaryFile)
+{
+  m_dumpFormat = format;
+  if (format == DUMP_BINARY)
+  {
+    m_dumpBinary.open(binaryFile, ios_base::out | ios_base::binary);
+    if (m_dumpBinary.fail())
+    {
+      cerr << "Unable to open " << binaryFile << " for writing" << endl;
+      return false;
+    }
+  }
+  return true;
 }
 
 template <typename T> T readValue(istream& stream)
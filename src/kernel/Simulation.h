@@ -10,8 +10,10 @@
 
 #include <fstream>
 #include <list>
+#include <map>
 #include <sstream>
 #include <string>
+#include <vector>
 
 namespace oclgrind
 {
@@ -38,16 +40,41 @@ class Simulation
   };
 
 public:
+  enum DumpFormat
+  {
+    DUMP_TEXT,   // Print each element
+    DUMP_BINARY, // Write raw bytes to a file, printing an index
+    DUMP_DIGEST, // Print an XXH64 digest of the contents
+  };
+
+  // Programs already built on a context, keyed by program file name
+  typedef std::map<std::string, oclgrind::Program*> ProgramCache;
+
   Simulation();
+  // Simulate on an existing context, reusing and adding to its programs
+  Simulation(oclgrind::Context* context, ProgramCache* programs);
   virtual ~Simulation();
 
-  bool load(const char* filename);
-  void run(bool dumpGlobalMemory = false);
+  // Load a simulator file, or convert it to one that loads buffer contents
+  // from a binary file alongside it (CONVERTFILE.bin) if convertFile is set
+  bool load(const char* filename, const char* convertFile = NULL);
+  // Run once with the loaded arguments, then again for each line of
+  // replayFile with the scalar arguments it names changed, restoring global
+  // memory to its loaded contents before each replay
+  bool replay(const char* replayFile, bool dumpGlobalMemory = false,
+              std::ostream& output = std::cout);
+  void run(bool dumpGlobalMemory = false, std::ostream& output = std::cout);
+  bool setDumpFormat(DumpFormat format, const char* binaryFile = NULL);
 
 private:
   oclgrind::Context* m_context;
   oclgrind::Kernel* m_kernel;
   oclgrind::Program* m_program;
+  std::string m_programFile;
+  ProgramCache* m_programs;
+
+  // Buffers to release from a shared context
+  std::list<size_t> m_buffers;
 
   oclgrind::Size3 m_ndrange;
   oclgrind::Size3 m_wgsize;
@@ -66,9 +93,29 @@ private:
     bool hex;
   };
   std::list<DumpArg> m_dumpArguments;
+  // Loaded values of scalar arguments, to reset them between replays
+  std::map<unsigned, std::vector<unsigned char>> m_scalarArguments;
+  DumpFormat m_dumpFormat;
+  std::ofstream m_dumpBinary;
+
+  std::ofstream m_convertSim;
+  std::ofstream m_convertData;
+  std::string m_convertDataName;
 
-  template <typename T> void dumpArgument(DumpArg& arg);
+  void convertArgument(unsigned int addrSpace, size_t size,
+                       cl_mem_flags flags, ArgDataType type, bool null,
+                       bool noinit, bool dump, bool hex,
+                       const unsigned char* data, const std::string& file,
+                       size_t offset);
+  template <typename T> void convertValues(const unsigned char* data,
+                                           size_t size);
+  template <typename T>
+  void dumpArgument(DumpArg& arg, std::ostream& output);
+  void execute(bool dumpGlobalMemory, std::ostream& output);
+  void finishDump();
   template <typename T> void get(T& result);
+  void getDefaultType(size_t index, ArgDataType& type, size_t& typeSize);
+  bool loadProgram(const std::string& filename);
   void parseArgument(size_t index);
   template <typename T>
   void parseArgumentData(unsigned char* result, size_t size);
@@ -77,4 +124,8 @@ private:
   template <typename T>
   void parseRange(unsigned char* result, size_t size,
                   std::istringstream& range);
+  void parseReplay(const std::string& assignment);
+  template <typename T>
+  void parseScalarValues(unsigned char* result, size_t num,
+                         std::istringstream& values);
 };
@@ -8,21 +8,34 @@
 
 #include "config.h"
 
+#include <atomic>
 #include <cstdlib>
 #include <cstring>
+#include <fstream>
 #include <iostream>
+#include <sstream>
 #include <string>
+#include <thread>
+#include <vector>
 
+#include "core/Context.h"
+#include "core/Program.h"
 #include "kernel/Simulation.h"
 
 using namespace oclgrind;
 using namespace std;
 
+static const char* batchFile = NULL;
+static unsigned batchJobs = 1;
+static const char* convertFile = NULL;
+static Simulation::DumpFormat dumpFormat = Simulation::DUMP_TEXT;
 static bool outputGlobalMemory = false;
+static const char* replayFile = NULL;
 static const char* simfile = NULL;
 
 static bool parseArguments(int argc, char* argv[]);
 static void printUsage();
+static int runBatch();
 static void setEnvironment(const char* name, const char* value);
 
 int main(int argc, char* argv[])
@@ -33,14 +46,32 @@ int main(int argc, char* argv[])
     return 1;
   }
 
+  if (batchFile)
+  {
+    return runBatch();
+  }
+
   // Initialise simulation
   Simulation simulation;
-  if (!simulation.load(simfile))
+  if (!simulation.load(simfile, convertFile))
+  {
+    return 1;
+  }
+  if (convertFile)
+  {
+    return 0;
+  }
+  string dumpFile = string(simfile) + ".dump";
+  if (!simulation.setDumpFormat(dumpFormat, dumpFile.c_str()))
   {
     return 1;
   }
 
   // Run simulation
+  if (replayFile)
+  {
+    return simulation.replay(replayFile, outputGlobalMemory) ? 0 : 1;
+  }
   simulation.run(outputGlobalMemory);
 }
 
@@ -48,7 +79,40 @@ static bool parseArguments(int argc, char* argv[])
 {
   for (int i = 1; i < argc; i++)
   {
-    if (!strcmp(argv[i], "--build-options"))
+    if (!strcmp(argv[i], "--batch"))
+    {
+      if (++i >= argc)
+      {
+        cerr << "Missing argument to --batch" << endl;
+        return false;
+      }
+      batchFile = argv[i];
+    }
+    else if (!strcmp(argv[i], "--batch-jobs"))
+    {
+      if (++i >= argc)
+      {
+        cerr << "Missing argument to --batch-jobs" << endl;
+        return false;
+      }
+      char* next;
+      batchJobs = strtoul(argv[i], &next, 10);
+      if (strlen(next) || batchJobs == 0)
+      {
+        cerr << "Invalid value for --batch-jobs" << endl;
+        return false;
+      }
+    }
+    else if (!strcmp(argv[i], "--build-cache"))
+    {
+      if (++i >= argc)
+      {
+        cerr << "Missing argument to --build-cache" << endl;
+        return false;
+      }
+      setEnvironment("OCLGRIND_BUILD_CACHE", argv[i]);
+    }
+    else if (!strcmp(argv[i], "--build-options"))
     {
       if (++i >= argc)
       {
@@ -57,6 +121,24 @@ static bool parseArguments(int argc, char* argv[])
       }
       setEnvironment("OCLGRIND_BUILD_OPTIONS", argv[i]);
     }
+    else if (!strcmp(argv[i], "--checkpoint"))
+    {
+      if (++i >= argc)
+      {
+        cerr << "Missing argument to --checkpoint" << endl;
+        return false;
+      }
+      setEnvironment("OCLGRIND_CHECKPOINT", argv[i]);
+    }
+    else if (!strcmp(argv[i], "--checkpoint-interval"))
+    {
+      if (++i >= argc)
+      {
+        cerr << "Missing argument to --checkpoint-interval" << endl;
+        return false;
+      }
+      setEnvironment("OCLGRIND_CHECKPOINT_INTERVAL", argv[i]);
+    }
     else if (!strcmp(argv[i], "--compute-units"))
     {
       if (++i >= argc)
@@ -75,14 +157,39 @@ static bool parseArguments(int argc, char* argv[])
       }
       setEnvironment("OCLGRIND_CONSTANT_MEM_SIZE", argv[i]);
     }
+    else if (!strcmp(argv[i], "--convert"))
+    {
+      if (++i >= argc)
+      {
+        cerr << "Missing argument to --convert" << endl;
+        return false;
+      }
+      convertFile = argv[i];
+    }
     else if (!strcmp(argv[i], "--data-races"))
     {
       setEnvironment("OCLGRIND_DATA_RACES", "1");
     }
+    else if (!strcmp(argv[i], "--dedup-errors"))
+    {
+      setEnvironment("OCLGRIND_DEDUP_ERRORS", "1");
+    }
+    else if (!strcmp(argv[i], "--disable-jit"))
+    {
+      setEnvironment("OCLGRIND_DISABLE_JIT", "1");
+    }
     else if (!strcmp(argv[i], "--disable-pch"))
     {
       setEnvironment("OCLGRIND_DISABLE_PCH", "1");
     }
+    else if (!strcmp(argv[i], "--dump-binary"))
+    {
+      dumpFormat = Simulation::DUMP_BINARY;
+    }
+    else if (!strcmp(argv[i], "--dump-digest"))
+    {
+      dumpFormat = Simulation::DUMP_DIGEST;
+    }
     else if (!strcmp(argv[i], "--dump-spir"))
     {
       setEnvironment("OCLGRIND_DUMP_SPIR", "1");
@@ -135,6 +242,10 @@ static bool parseArguments(int argc, char* argv[])
       }
       setEnvironment("OCLGRIND_LOG", argv[i]);
     }
+    else if (!strcmp(argv[i], "--lockstep"))
+    {
+      setEnvironment("OCLGRIND_LOCKSTEP", "1");
+    }
     else if (!strcmp(argv[i], "--max-errors"))
     {
       if (++i >= argc)
@@ -153,6 +264,37 @@ static bool parseArguments(int argc, char* argv[])
       }
       setEnvironment("OCLGRIND_MAX_WGSIZE", argv[i]);
     }
+    else if (!strcmp(argv[i], "--memory-model"))
+    {
+      if (++i >= argc)
+      {
+        cerr << "Missing argument to --memory-model" << endl;
+        return false;
+      }
+      setEnvironment("OCLGRIND_MEMORY_MODEL", argv[i]);
+    }
+    else if (!strcmp(argv[i], "--memory-trace"))
+    {
+      if (++i >= argc)
+      {
+        cerr << "Missing argument to --memory-trace" << endl;
+        return false;
+      }
+      setEnvironment("OCLGRIND_MEMORY_TRACE", argv[i]);
+    }
+    else if (!strcmp(argv[i], "--memory-usage"))
+    {
+      setEnvironment("OCLGRIND_MEMORY_USAGE", "1");
+    }
+    else if (!strcmp(argv[i], "--metrics"))
+    {
+      if (++i >= argc)
+      {
+        cerr << "Missing argument to --metrics" << endl;
+        return false;
+      }
+      setEnvironment("OCLGRIND_METRICS", argv[i]);
+    }
     else if (!strcmp(argv[i], "--num-threads"))
     {
       if (++i >= argc)
@@ -162,6 +304,14 @@ static bool parseArguments(int argc, char* argv[])
       }
       setEnvironment("OCLGRIND_NUM_THREADS", argv[i]);
     }
+    else if (!strcmp(argv[i], "--optimize"))
+    {
+      setEnvironment("OCLGRIND_OPTIMIZE", "1");
+    }
+    else if (!strcmp(argv[i], "--optimize-full"))
+    {
+      setEnvironment("OCLGRIND_OPTIMIZE", "2");
+    }
     else if (!strcmp(argv[i], "--pch-dir"))
     {
       if (++i >= argc)
@@ -171,6 +321,15 @@ static bool parseArguments(int argc, char* argv[])
       }
       setEnvironment("OCLGRIND_PCH_DIR", argv[i]);
     }
+    else if (!strcmp(argv[i], "--performance-lint"))
+    {
+      if (++i >= argc)
+      {
+        cerr << "Missing argument to --performance-lint" << endl;
+        return false;
+      }
+      setEnvironment("OCLGRIND_PERFORMANCE_LINT", argv[i]);
+    }
     else if (!strcmp(argv[i], "--plugins"))
     {
       if (++i >= argc)
@@ -180,10 +339,63 @@ static bool parseArguments(int argc, char* argv[])
       }
       setEnvironment("OCLGRIND_PLUGINS", argv[i]);
     }
+    else if (!strcmp(argv[i], "--processes"))
+    {
+      if (++i >= argc)
+      {
+        cerr << "Missing argument to --processes" << endl;
+        return false;
+      }
+      setEnvironment("OCLGRIND_PROCESSES", argv[i]);
+    }
+    else if (!strcmp(argv[i], "--profile"))
+    {
+      setEnvironment("OCLGRIND_PROFILE", "1");
+    }
+    else if (!strcmp(argv[i], "--profile-trace"))
+    {
+      if (++i >= argc)
+      {
+        cerr << "Missing argument to --profile-trace" << endl;
+        return false;
+      }
+      setEnvironment("OCLGRIND_PROFILE_TRACE", argv[i]);
+    }
     else if (!strcmp(argv[i], "-q") || !strcmp(argv[i], "--quick"))
     {
       setEnvironment("OCLGRIND_QUICK", "1");
     }
+    else if (!strcmp(argv[i], "--replay"))
+    {
+      if (++i >= argc)
+      {
+        cerr << "Missing argument to --replay" << endl;
+        return false;
+      }
+      replayFile = argv[i];
+    }
+    else if (!strcmp(argv[i], "--sample"))
+    {
+      if (++i >= argc)
+      {
+        cerr << "Missing argument to --sample" << endl;
+        return false;
+      }
+      setEnvironment("OCLGRIND_SAMPLE", argv[i]);
+    }
+    else if (!strcmp(argv[i], "--sample-seed"))
+    {
+      if (++i >= argc)
+      {
+        cerr << "Missing argument to --sample-seed" << endl;
+        return false;
+      }
+      setEnvironment("OCLGRIND_SAMPLE_SEED", argv[i]);
+    }
+    else if (!strcmp(argv[i], "--sample-strided"))
+    {
+      setEnvironment("OCLGRIND_SAMPLE_STRIDED", "1");
+    }
     else if (!strcmp(argv[i], "--uniform-writes"))
     {
       setEnvironment("OCLGRIND_UNIFORM_WRITES", "1");
@@ -223,7 +435,17 @@ static bool parseArguments(int argc, char* argv[])
     }
   }
 
-  if (simfile == NULL)
+  if (batchFile && (simfile || convertFile))
+  {
+    cerr << "--batch cannot be used with a simfile or --convert" << endl;
+    return false;
+  }
+  if (replayFile && (batchFile || convertFile))
+  {
+    cerr << "--replay cannot be used with --batch or --convert" << endl;
+    return false;
+  }
+  if (simfile == NULL && batchFile == NULL)
   {
     printUsage();
     return false;
@@ -235,24 +457,55 @@ static bool parseArguments(int argc, char* argv[])
 static void printUsage()
 {
   cout << "Usage: oclgrind-kernel [OPTIONS] simfile" << endl
+       << "       oclgrind-kernel [OPTIONS] --batch MANIFEST" << endl
        << "       oclgrind-kernel [--help | --version]" << endl
        << endl
        << "Options:" << endl
+       << "  --batch             MANIFEST "
+          "Run each simfile listed in MANIFEST in one process"
+       << endl
+       << "  --batch-jobs        NUM      "
+          "Number of batch simulations to run concurrently"
+       << endl
+       << "  --build-cache       DIR      "
+          "Reuse compiled programs cached in DIR"
+       << endl
        << "  --build-options     OPTIONS  "
           "Additional options to pass to the OpenCL compiler"
        << endl
+       << "  --checkpoint        FILE     "
+          "Resume kernels from checkpoints saved to FILE"
+       << endl
+       << "  --checkpoint-interval SECS   "
+          "Change the time between checkpoints (default 600)"
+       << endl
        << "  --compute-units     UNITS    "
-          "Change the number of compute units reported"
+          "Change the number of compute units (and worker threads)"
        << endl
        << "  --constant-mem-size BYTES    "
           "Change the constant memory size of the device"
        << endl
+       << "  --convert           SIMFILE  "
+          "Convert to SIMFILE with buffer contents in SIMFILE.bin"
+       << endl
        << "  --data-races                 "
           "Enable data-race detection"
        << endl
+       << "  --dedup-errors               "
+          "Only report the first error of each kind per instruction"
+       << endl
+       << "  --disable-jit                "
+          "Always interpret kernels instead of compiling them"
+       << endl
        << "  --disable-pch                "
           "Don't use precompiled headers"
        << endl
+       << "  --dump-binary                "
+          "Write dumped memory as raw bytes to SIMFILE.dump"
+       << endl
+       << "  --dump-digest                "
+          "Output digests of dumped memory instead of contents"
+       << endl
        << "  --dump-spir                  "
           "Dump SPIR to /tmp/oclgrind_*.{ll,bc}"
        << endl
@@ -274,6 +527,9 @@ static void printUsage()
        << "  --local-mem-size    BYTES    "
           "Change the local memory size of the device"
        << endl
+       << "  --lockstep                   "
+          "Execute work-items within a work-group in lockstep"
+       << endl
        << "  --log               LOGFILE  "
           "Redirect log/error messages to a file"
        << endl
@@ -283,18 +539,60 @@ static void printUsage()
        << "  --max-wgsize        WGSIZE   "
           "Change the maximum work-group size of the device"
        << endl
+       << "  --memory-model      OPTIONS  "
+          "Model GPU memory coalescing, bank conflicts and caches"
+       << endl
+       << "  --memory-trace      FILE     "
+          "Write a trace of kernel memory accesses to FILE"
+       << endl
+       << "  --memory-usage               "
+          "Output current and peak memory usage after each kernel"
+       << endl
+       << "  --metrics           FILE     "
+          "Periodically write live progress metrics to FILE"
+       << endl
        << "  --num-threads       NUM      "
           "Set the number of worker threads to use"
        << endl
+       << "  --optimize                   "
+          "Optimize programs to reduce simulation time"
+       << endl
+       << "  --optimize-full              "
+          "Also use optimizations that may hide memory errors"
+       << endl
        << "  --pch-dir           DIR      "
           "Override directory containing precompiled headers"
        << endl
+       << "  --performance-lint  OPTIONS  "
+          "Report code likely to perform poorly on GPUs"
+       << endl
        << "  --plugins           PLUGINS  "
           "Load colon separated list of plugin libraries"
        << endl
+       << "  --processes         NUM      "
+          "Divide the work-groups of kernels between NUM processes"
+       << endl
+       << "  --profile                    "
+          "Report the time taken by each phase and plugin"
+       << endl
+       << "  --profile-trace     FILE     "
+          "Also write a Chrome trace of the phases to FILE"
+       << endl
        << "  --quick [-q]                 "
           "Only run first and last work-group"
        << endl
+       << "  --replay            FILE     "
+          "Rerun with the scalar arguments changed on each line of FILE"
+       << endl
+       << "  --sample            N        "
+          "Only analyse one in N work-groups with plugins"
+       << endl
+       << "  --sample-seed       SEED     "
+          "Seed used to select sampled work-groups"
+       << endl
+       << "  --sample-strided             "
+          "Sample every Nth work-group instead of randomly"
+       << endl
        << "  --uniform-writes             "
           "Don't suppress uniform write-write data-races"
        << endl
@@ -310,6 +608,74 @@ static void printUsage()
        << endl;
 }
 
+static int runBatch()
+{
+  // Each manifest line names a simfile, optionally followed by the file to
+  // write its output to (SIMFILE.out by default, with binary dumps written
+  // to OUTPUT.dump)
+  ifstream manifest(batchFile);
+  if (!manifest.good())
+  {
+    cerr << "Unable to open batch manifest " << batchFile << endl;
+    return 1;
+  }
+  vector<pair<string, string>> runs;
+  string line;
+  while (getline(manifest, line))
+  {
+    line = line.substr(0, line.find_first_of('#'));
+    istringstream entry(line);
+    string sim, output;
+    if (!(entry >> sim))
+      continue;
+    if (!(entry >> output))
+      output = sim + ".out";
+    runs.push_back({sim, output});
+  }
+
+  // Each job simulates on its own context, so that plugins are loaded and
+  // programs are built once per job rather than once per simulation
+  atomic<size_t> nextRun(0);
+  atomic<unsigned> numFailed(0);
+  auto job = [&]() {
+    Context* context = new Context();
+    Simulation::ProgramCache programs;
+    for (size_t i; (i = nextRun++) < runs.size();)
+    {
+      ofstream output(runs[i].second.c_str());
+      if (!output.good())
+      {
+        cerr << "Unable to open " << runs[i].second << endl;
+        numFailed++;
+        continue;
+      }
+
+      Simulation simulation(context, &programs);
+      string dumpFile = runs[i].second + ".dump";
+      if (!simulation.load(runs[i].first.c_str()) ||
+          !simulation.setDumpFormat(dumpFormat, dumpFile.c_str()))
+      {
+        cerr << "Failed to load " << runs[i].first << endl;
+        numFailed++;
+        continue;
+      }
+      simulation.run(outputGlobalMemory, output);
+    }
+    for (auto& program : programs)
+      delete program.second;
+    delete context;
+  };
+
+  vector<thread> jobs;
+  for (unsigned j = 1; j < batchJobs && j < runs.size(); j++)
+    jobs.push_back(thread(job));
+  job();
+  for (thread& t : jobs)
+    t.join();
+
+  return numFailed ? 1 : 0;
+}
+
 static void setEnvironment(const char* name, const char* value)
 {
 #if defined(_WIN32) && !defined(__MINGW32__)
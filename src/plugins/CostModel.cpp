@@ -0,0 +1,284 @@
+// CostModel.cpp (Oclgrind)
+// Copyright (c) 2013-2019, James Price and Simon McIntosh-Smith,
+// University of Bristol. All rights reserved.
+//
+// This program is provided under a three-clause BSD license. For full
+// license terms please see the LICENSE file distributed with this
+// source code.
+
+#include "core/common.h"
+
+#include <cmath>
+#include <sstream>
+
+#include "llvm/IR/Function.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/Instruction.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Type.h"
+
+#include "CostModel.h"
+
+#include "core/Kernel.h"
+#include "core/KernelInvocation.h"
+#include "core/Queue.h"
+
+using namespace oclgrind;
+using namespace std;
+
+// Convert a cost in nanoseconds to picoseconds
+static uint64_t toPicoseconds(double ns)
+{
+  return (uint64_t)llround(ns * 1000);
+}
+
+CostModel::CostModel(const Context* context) : Plugin(context)
+{
+  m_instCost = toPicoseconds(1);
+  m_byteCosts[AddrSpacePrivate] = 0;
+  m_byteCosts[AddrSpaceGlobal] = toPicoseconds(1);
+  m_byteCosts[AddrSpaceConstant] = toPicoseconds(0.5);
+  m_byteCosts[AddrSpaceLocal] = toPicoseconds(0.25);
+  m_barrierCost = toPicoseconds(100);
+  m_launchCost = toPicoseconds(5000);
+  m_transferCost = toPicoseconds(0.1);
+  m_workGroupCost = toPicoseconds(100);
+
+  m_kernelCost = 0;
+  m_clock = 0;
+
+  const char* costs = getenv("OCLGRIND_COST_MODEL");
+  if (costs && strcmp(costs, "1"))
+    parseCosts(costs);
+}
+
+void CostModel::commandExecuted(const Command* command, Event* event)
+{
+  // Kernels have been costed as they ran, and other commands cost the
+  // number of bytes they transfer
+  uint64_t cost = m_launchCost;
+  size_t bytes = 0;
+  switch (command->type)
+  {
+  case Command::COPY:
+    bytes = ((const CopyCommand*)command)->size;
+    break;
+  case Command::COPY_RECT:
+  {
+    const size_t* region = ((const CopyRectCommand*)command)->region;
+    bytes = region[0] * region[1] * region[2];
+    break;
+  }
+  case Command::EMPTY:
+    cost = 0;
+    break;
+  case Command::FILL_BUFFER:
+    bytes = ((const FillBufferCommand*)command)->size;
+    break;
+  case Command::FILL_IMAGE:
+  {
+    const FillImageCommand* fill = (const FillImageCommand*)command;
+    bytes = fill->region[0] * fill->region[1] * fill->region[2] *
+            fill->pixelSize;
+    break;
+  }
+  case Command::KERNEL:
+    cost += m_kernelCost;
+    break;
+  case Command::READ:
+  case Command::WRITE:
+    bytes = ((const BufferCommand*)command)->size;
+    break;
+  case Command::READ_RECT:
+  case Command::WRITE_RECT:
+  {
+    const size_t* region = ((const BufferRectCommand*)command)->region;
+    bytes = region[0] * region[1] * region[2];
+    break;
+  }
+  default:
+    break;
+  }
+  cost += bytes * m_transferCost;
+
+  // Commands run back-to-back on the simulated device, so the times reported
+  // only depend on the commands that have run before
+  lock_guard<mutex> lock(m_clockLock);
+  event->queueTime = event->submitTime = event->startTime = m_clock / 1000.0;
+  m_clock += cost;
+  event->endTime = m_clock / 1000.0;
+}
+
+bool CostModel::deserialize(const string& data)
+{
+  size_t offset = 0;
+  uint64_t kernelCost;
+  if (!readBinary(data, offset, kernelCost) || offset != data.size())
+    return false;
+  m_kernelCost = kernelCost;
+  return true;
+}
+
+uint32_t CostModel::getCallbacks() const
+{
+  return CALLBACK_BIT(CallbackInstructionsExecuted) |
+         CALLBACK_BIT(CallbackKernelBegin) |
+         CALLBACK_BIT(CallbackWorkGroupBarrier) |
+         CALLBACK_BIT(CallbackWorkGroupBegin);
+}
+
+void CostModel::instructionsExecuted(const InstructionRecord* records,
+                                     size_t count)
+{
+  uint64_t cost = 0;
+  for (size_t i = 0; i < count; i++)
+  {
+    auto itr = m_costs.find(records[i].instruction);
+    assert(itr != m_costs.end());
+    cost += itr->second;
+  }
+  m_kernelCost += cost;
+}
+
+void CostModel::kernelBegin(const KernelInvocation* kernelInvocation)
+{
+  m_kernelCost = 0;
+
+  // Cost every instruction in the kernel and its callees, with loads and
+  // stores also costing the bytes they transfer in their address space
+  m_costs.clear();
+  set<const llvm::Function*> visited;
+  list<const llvm::Function*> pending(
+    1, kernelInvocation->getKernel()->getFunction());
+  while (!pending.empty())
+  {
+    const llvm::Function* function = pending.front();
+    pending.pop_front();
+    if (!visited.insert(function).second)
+    {
+      continue;
+    }
+
+    for (auto I = llvm::inst_begin(function); I != llvm::inst_end(function);
+         I++)
+    {
+      unsigned opcode = I->getOpcode();
+      auto op = m_opcodeCosts.find(opcode);
+      uint64_t cost = op == m_opcodeCosts.end() ? m_instCost : op->second;
+
+      if (opcode == llvm::Instruction::Load ||
+          opcode == llvm::Instruction::Store)
+      {
+        bool load = (opcode == llvm::Instruction::Load);
+        const llvm::Type* type = I->getOperand(load ? 0 : 1)->getType();
+        unsigned addrSpace = type->getPointerAddressSpace();
+        if (addrSpace < 4)
+        {
+          cost += getTypeSize(type->getPointerElementType()) *
+                  m_byteCosts[addrSpace];
+        }
+      }
+      m_costs[&*I] = cost;
+
+      auto call = llvm::dyn_cast<llvm::CallInst>(&*I);
+      if (call && call->getCalledFunction() &&
+          !call->getCalledFunction()->isDeclaration())
+      {
+        pending.push_back(call->getCalledFunction());
+      }
+    }
+  }
+}
+
+bool CostModel::mergeResults(const string& data)
+{
+  size_t offset = 0;
+  uint64_t kernelCost;
+  if (!readBinary(data, offset, kernelCost) || offset != data.size())
+    return false;
+  m_kernelCost += kernelCost;
+  return true;
+}
+
+void CostModel::parseCosts(const char* costs)
+{
+  // Costs are given in nanoseconds as a comma-separated list of NAME=COST,
+  // where NAME is an address space (cost per byte), an LLVM opcode, or one
+  // of the other costs below
+  istringstream list(costs);
+  string entry;
+  while (getline(list, entry, ','))
+  {
+    size_t equals = entry.find('=');
+    string name = entry.substr(0, equals);
+    char* end = NULL;
+    double value = 0;
+    if (equals != string::npos)
+      value = strtod(entry.c_str() + equals + 1, &end);
+    if (!end || *end || end == entry.c_str() + equals + 1 || value < 0)
+    {
+      cerr << endl << "Oclgrind: Invalid value for OCLGRIND_COST_MODEL" << endl;
+      abort();
+    }
+
+    uint64_t cost = toPicoseconds(value);
+    if (name == "barrier")
+      m_barrierCost = cost;
+    else if (name == "constant")
+      m_byteCosts[AddrSpaceConstant] = cost;
+    else if (name == "global")
+      m_byteCosts[AddrSpaceGlobal] = cost;
+    else if (name == "inst")
+      m_instCost = cost;
+    else if (name == "launch")
+      m_launchCost = cost;
+    else if (name == "local")
+      m_byteCosts[AddrSpaceLocal] = cost;
+    else if (name == "private")
+      m_byteCosts[AddrSpacePrivate] = cost;
+    else if (name == "transfer")
+      m_transferCost = cost;
+    else if (name == "workgroup")
+      m_workGroupCost = cost;
+    else
+    {
+      unsigned opcode = 1;
+      for (; opcode < llvm::Instruction::OtherOpsEnd; opcode++)
+      {
+        if (name == llvm::Instruction::getOpcodeName(opcode))
+          break;
+      }
+      if (opcode == llvm::Instruction::OtherOpsEnd)
+      {
+        cerr << endl
+             << "Oclgrind: Unknown cost '" << name
+             << "' in OCLGRIND_COST_MODEL" << endl;
+        abort();
+      }
+      m_opcodeCosts[opcode] = cost;
+    }
+  }
+}
+
+bool CostModel::saveResults(string& data) const
+{
+  // Worker processes start costing the kernel from zero
+  writeBinary(data, (uint64_t)m_kernelCost);
+  return true;
+}
+
+bool CostModel::serialize(string& data) const
+{
+  writeBinary(data, (uint64_t)m_kernelCost);
+  return true;
+}
+
+void CostModel::workGroupBarrier(const WorkGroup* workGroup, uint32_t flags)
+{
+  m_kernelCost += m_barrierCost;
+}
+
+void CostModel::workGroupBegin(const WorkGroup* workGroup)
+{
+  m_kernelCost += m_workGroupCost;
+}
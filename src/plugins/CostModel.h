@@ -0,0 +1,59 @@
+// CostModel.h (Oclgrind)
+// Copyright (c) 2013-2019, James Price and Simon McIntosh-Smith,
+// University of Bristol. All rights reserved.
+//
+// This program is provided under a three-clause BSD license. For full
+// license terms please see the LICENSE file distributed with this
+// source code.
+
+#include "core/Plugin.h"
+
+#include <mutex>
+
+namespace oclgrind
+{
+struct Command;
+struct Event;
+
+class CostModel : public Plugin
+{
+public:
+  CostModel(const Context* context);
+
+  virtual bool deserialize(const std::string& data) override;
+  virtual uint32_t getCallbacks() const override;
+  virtual void instructionsExecuted(const InstructionRecord* records,
+                                    size_t count) override;
+  virtual void kernelBegin(const KernelInvocation* kernelInvocation) override;
+  virtual bool mergeResults(const std::string& data) override;
+  virtual bool saveResults(std::string& data) const override;
+  virtual bool serialize(std::string& data) const override;
+  virtual void workGroupBarrier(const WorkGroup* workGroup,
+                                uint32_t flags) override;
+  virtual void workGroupBegin(const WorkGroup* workGroup) override;
+
+  // Advance the simulated device clock by the cost of a command that has
+  // just run, and set the profiling times of its event from that clock
+  void commandExecuted(const Command* command, Event* event);
+
+private:
+  // Costs are held in picoseconds, so that totals are exact regardless of
+  // the order in which worker threads add to them
+  uint64_t m_instCost;
+  std::unordered_map<unsigned, uint64_t> m_opcodeCosts;
+  uint64_t m_byteCosts[4];
+  uint64_t m_barrierCost;
+  uint64_t m_launchCost;
+  uint64_t m_transferCost;
+  uint64_t m_workGroupCost;
+
+  // Cost of each instruction in the current kernel and its callees
+  std::unordered_map<const llvm::Instruction*, uint64_t> m_costs;
+  std::atomic<uint64_t> m_kernelCost;
+
+  std::mutex m_clockLock;
+  uint64_t m_clock;
+
+  void parseCosts(const char* costs);
+};
+} // namespace oclgrind
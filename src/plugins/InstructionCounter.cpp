@@ -11,6 +11,7 @@
 #include <sstream>
 
 #include "llvm/IR/Function.h"
+#include "llvm/IR/InstIterator.h"
 #include "llvm/IR/Instruction.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/Type.h"
@@ -28,7 +29,8 @@ using namespace std;
 #define COUNTED_CALL_BASE (COUNTED_STORE_BASE + 8)
 
 THREAD_LOCAL InstructionCounter::WorkerState InstructionCounter::m_state = {
-  NULL};
+  0, NULL, NULL};
+atomic<unsigned long> InstructionCounter::m_numKernels(0);
 
 static bool compareNamedCount(pair<string, size_t> a, pair<string, size_t> b)
 {
@@ -40,6 +42,13 @@ static bool compareNamedCount(pair<string, size_t> a, pair<string, size_t> b)
     return a.first < b.first;
 }
 
+uint32_t InstructionCounter::getCallbacks() const
+{
+  return CALLBACK_BIT(CallbackInstructionsExecuted) |
+         CALLBACK_BIT(CallbackKernelBegin) |
+         CALLBACK_BIT(CallbackKernelEnd);
+}
+
 string InstructionCounter::getOpcodeName(unsigned opcode) const
 {
   if (opcode >= COUNTED_CALL_BASE)
@@ -83,26 +92,22 @@ string InstructionCounter::getOpcodeName(unsigned opcode) const
   return llvm::Instruction::getOpcodeName(opcode);
 }
 
-void InstructionCounter::instructionExecuted(
-  const WorkItem* workItem, const llvm::Instruction* instruction,
-  const TypedValue& result)
+void InstructionCounter::addCounter(const llvm::Instruction* instruction)
 {
-  unsigned opcode = instruction->getOpcode();
+  Counter counter = {instruction->getOpcode(), 0};
 
   // Check for loads and stores
-  if (opcode == llvm::Instruction::Load || opcode == llvm::Instruction::Store)
+  if (counter.index == llvm::Instruction::Load ||
+      counter.index == llvm::Instruction::Store)
   {
     // Track operations in separate address spaces
-    bool load = (opcode == llvm::Instruction::Load);
+    bool load = (counter.index == llvm::Instruction::Load);
     const llvm::Type* type = instruction->getOperand(load ? 0 : 1)->getType();
     unsigned addrSpace = type->getPointerAddressSpace();
-    opcode = (load ? COUNTED_LOAD_BASE : COUNTED_STORE_BASE) + addrSpace;
-
-    // Count total number of bytes loaded/stored
-    unsigned bytes = getTypeSize(type->getPointerElementType());
-    (*m_state.memopBytes)[opcode - COUNTED_LOAD_BASE] += bytes;
+    counter.index = (load ? COUNTED_LOAD_BASE : COUNTED_STORE_BASE) + addrSpace;
+    counter.bytes = getTypeSize(type->getPointerElementType());
   }
-  else if (opcode == llvm::Instruction::Call)
+  else if (counter.index == llvm::Instruction::Call)
   {
     // Track distinct function calls
     const llvm::CallInst* callInst = (const llvm::CallInst*)instruction;
@@ -110,24 +115,57 @@ void InstructionCounter::instructionExecuted(
     if (function)
     {
       vector<const llvm::Function*>::iterator itr =
-        find(m_state.functions->begin(), m_state.functions->end(), function);
-      if (itr == m_state.functions->end())
+        find(m_functions.begin(), m_functions.end(), function);
+      if (itr == m_functions.end())
       {
-        opcode = COUNTED_CALL_BASE + m_state.functions->size();
-        m_state.functions->push_back(function);
+        counter.index = COUNTED_CALL_BASE + m_functions.size();
+        m_functions.push_back(function);
       }
       else
       {
-        opcode = COUNTED_CALL_BASE + (itr - m_state.functions->begin());
+        counter.index = COUNTED_CALL_BASE + (itr - m_functions.begin());
       }
     }
   }
 
-  if (opcode >= m_state.instCounts->size())
+  m_counters[instruction] = counter;
+  m_numCounters = max(m_numCounters, counter.index + 1);
+}
+
+void InstructionCounter::instructionsExecuted(const InstructionRecord* records,
+                                              size_t count)
+{
+  WorkerState& state = m_state;
+
+  // Register this thread's counts the first time it runs this kernel
+  if (state.kernel != m_kernel)
   {
-    m_state.instCounts->resize(opcode + 1);
+    if (!state.instCounts)
+    {
+      state.instCounts = new vector<size_t>;
+      state.memopBytes = new vector<size_t>;
+    }
+    state.instCounts->assign(m_numCounters, 0);
+    state.memopBytes->assign(16, 0);
+    state.kernel = m_kernel;
+
+    lock_guard<mutex> lock(m_mtx);
+    m_workers.push_back(state);
+  }
+
+  size_t* instCounts = state.instCounts->data();
+  size_t* memopBytes = state.memopBytes->data();
+  for (size_t i = 0; i < count; i++)
+  {
+    auto itr = m_counters.find(records[i].instruction);
+    assert(itr != m_counters.end());
+    const Counter& counter = itr->second;
+    instCounts[counter.index]++;
+    if (counter.bytes)
+    {
+      memopBytes[counter.index - COUNTED_LOAD_BASE] += counter.bytes;
+    }
   }
-  (*m_state.instCounts)[opcode]++;
 }
 
 void InstructionCounter::kernelBegin(const KernelInvocation* kernelInvocation)
@@ -138,6 +176,37 @@ void InstructionCounter::kernelBegin(const KernelInvocation* kernelInvocation)
   m_memopBytes.resize(16);
 
   m_functions.clear();
+  m_workers.clear();
+  m_kernel = ++m_numKernels;
+
+  // Assign a counter to every instruction in the kernel and its callees
+  m_counters.clear();
+  m_numCounters = COUNTED_CALL_BASE;
+  set<const llvm::Function*> visited;
+  list<const llvm::Function*> pending(
+    1, kernelInvocation->getKernel()->getFunction());
+  while (!pending.empty())
+  {
+    const llvm::Function* function = pending.front();
+    pending.pop_front();
+    if (!visited.insert(function).second)
+    {
+      continue;
+    }
+
+    for (auto I = llvm::inst_begin(function); I != llvm::inst_end(function);
+         I++)
+    {
+      addCounter(&*I);
+
+      auto call = llvm::dyn_cast<llvm::CallInst>(&*I);
+      if (call && call->getCalledFunction() &&
+          !call->getCalledFunction()->isDeclaration())
+      {
+        pending.push_back(call->getCalledFunction());
+      }
+    }
+  }
 }
 
 void InstructionCounter::kernelEnd(const KernelInvocation* kernelInvocation)
@@ -147,6 +216,16 @@ void InstructionCounter::kernelEnd(const KernelInvocation* kernelInvocation)
   locale defaultLocale("");
   cout.imbue(defaultLocale);
 
+  // Merge counts from each worker thread (and any from worker processes)
+  m_instructionCounts.resize(m_numCounters, 0);
+  for (const WorkerState& worker : m_workers)
+  {
+    for (unsigned i = 0; i < m_numCounters; i++)
+      m_instructionCounts[i] += worker.instCounts->at(i);
+    for (unsigned i = 0; i < m_memopBytes.size(); i++)
+      m_memopBytes[i] += worker.memopBytes->at(i);
+  }
+
   cout << "Instructions executed for kernel '"
        << kernelInvocation->getKernel()->getName() << "':";
   cout << endl;
@@ -185,60 +264,47 @@ void InstructionCounter::kernelEnd(const KernelInvocation* kernelInvocation)
   cout.imbue(previousLocale);
 }
 
-void InstructionCounter::workGroupBegin(const WorkGroup* workGroup)
+bool InstructionCounter::mergeResults(const string& data)
 {
-  // Create worker state if haven't already
-  if (!m_state.instCounts)
+  // Worker processes have the same counters, as they were forked after
+  // kernelBegin
+  size_t offset = 0;
+  string instCounts, memopBytes;
+  if (!readBinary(data, offset, instCounts) ||
+      !readBinary(data, offset, memopBytes) || offset != data.size() ||
+      instCounts.size() != m_numCounters * sizeof(uint64_t) ||
+      memopBytes.size() != m_memopBytes.size() * sizeof(uint64_t))
+    return false;
+
+  uint64_t value;
+  m_instructionCounts.resize(m_numCounters, 0);
+  for (unsigned i = 0; i < m_numCounters; i++)
   {
-    m_state.instCounts = new vector<size_t>;
-    m_state.memopBytes = new vector<size_t>;
-    m_state.functions = new vector<const llvm::Function*>;
+    memcpy(&value, instCounts.data() + i * sizeof(value), sizeof(value));
+    m_instructionCounts[i] += value;
   }
-
-  m_state.instCounts->clear();
-  m_state.instCounts->resize(COUNTED_CALL_BASE);
-
-  m_state.memopBytes->clear();
-  m_state.memopBytes->resize(16);
-
-  m_state.functions->clear();
+  for (unsigned i = 0; i < m_memopBytes.size(); i++)
+  {
+    memcpy(&value, memopBytes.data() + i * sizeof(value), sizeof(value));
+    m_memopBytes[i] += value;
+  }
+  return true;
 }
 
-void InstructionCounter::workGroupComplete(const WorkGroup* workGroup)
+bool InstructionCounter::saveResults(string& data) const
 {
-  lock_guard<mutex> lock(m_mtx);
-
-  if (m_state.instCounts->size() > m_instructionCounts.size())
-    m_instructionCounts.resize(m_state.instCounts->size());
-
-  // Merge instruction counts into global list
-  for (unsigned i = 0; i < m_state.instCounts->size(); i++)
+  vector<uint64_t> instCounts(m_numCounters, 0);
+  vector<uint64_t> memopBytes(m_memopBytes.size(), 0);
+  for (const WorkerState& worker : m_workers)
   {
-    if (m_state.instCounts->at(i) == 0)
-      continue;
-
-    // Merge functions into global list
-    unsigned opcode = i;
-    if (i >= COUNTED_CALL_BASE)
-    {
-      const llvm::Function* func = m_state.functions->at(i - COUNTED_CALL_BASE);
-      vector<const llvm::Function*>::iterator itr =
-        find(m_functions.begin(), m_functions.end(), func);
-      if (itr == m_functions.end())
-      {
-        opcode = COUNTED_CALL_BASE + m_functions.size();
-        m_functions.push_back(func);
-      }
-      else
-      {
-        opcode = COUNTED_CALL_BASE + (itr - m_functions.begin());
-      }
-    }
-
-    m_instructionCounts[opcode] += m_state.instCounts->at(i);
+    for (unsigned i = 0; i < m_numCounters; i++)
+      instCounts[i] += worker.instCounts->at(i);
+    for (unsigned i = 0; i < memopBytes.size(); i++)
+      memopBytes[i] += worker.memopBytes->at(i);
   }
-
-  // Merge memory transfer sizes into global list
-  for (unsigned i = 0; i < m_state.memopBytes->size(); i++)
-    m_memopBytes[i] += m_state.memopBytes->at(i);
+  writeBinary(data, string((const char*)instCounts.data(),
+                           instCounts.size() * sizeof(uint64_t)));
+  writeBinary(data, string((const char*)memopBytes.data(),
+                           memopBytes.size() * sizeof(uint64_t)));
+  return true;
 }
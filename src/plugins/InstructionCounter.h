@@ -20,31 +20,46 @@ namespace oclgrind
 class InstructionCounter : public Plugin
 {
 public:
-  InstructionCounter(const Context* context) : Plugin(context){};
+  InstructionCounter(const Context* context)
+      : Plugin(context), m_numCounters(0), m_kernel(0){};
 
-  virtual void instructionExecuted(const WorkItem* workItem,
-                                   const llvm::Instruction* instruction,
-                                   const TypedValue& result) override;
+  virtual uint32_t getCallbacks() const override;
+  virtual void instructionsExecuted(const InstructionRecord* records,
+                                    size_t count) override;
   virtual void kernelBegin(const KernelInvocation* kernelInvocation) override;
   virtual void kernelEnd(const KernelInvocation* kernelInvocation) override;
-  virtual void workGroupBegin(const WorkGroup* workGroup) override;
-  virtual void workGroupComplete(const WorkGroup* workGroup) override;
+  virtual bool mergeResults(const std::string& data) override;
+  virtual bool saveResults(std::string& data) const override;
 
 private:
+  // Counter slot and bytes transferred for an instruction
+  struct Counter
+  {
+    unsigned index;
+    unsigned bytes;
+  };
+  std::unordered_map<const llvm::Instruction*, Counter> m_counters;
+  unsigned m_numCounters;
+
   std::vector<size_t> m_instructionCounts;
   std::vector<size_t> m_memopBytes;
   std::vector<const llvm::Function*> m_functions;
 
+  // Counts for one worker thread, merged when the kernel ends
   struct WorkerState
   {
+    unsigned long kernel;
     std::vector<size_t>* instCounts;
     std::vector<size_t>* memopBytes;
-    std::vector<const llvm::Function*>* functions;
   };
   static THREAD_LOCAL WorkerState m_state;
+  static std::atomic<unsigned long> m_numKernels;
+  unsigned long m_kernel;
 
   std::mutex m_mtx;
+  std::vector<WorkerState> m_workers;
 
+  void addCounter(const llvm::Instruction* instruction);
   std::string getOpcodeName(unsigned opcode) const;
 };
 } // namespace oclgrind
@@ -55,14 +55,23 @@ void handleSignal(int s)
 }
 #endif
 
+// Breaks requested by errors, and the line of the breakpoint last hit (which
+// isn't hit again until the work-item leaves that line), for each worker
+static THREAD_LOCAL bool forceBreak = false;
+static THREAD_LOCAL size_t lastBreakKernel = 0;
+static THREAD_LOCAL size_t lastBreakLine = 0;
+
 InteractiveDebugger::InteractiveDebugger(const Context* context)
     : Plugin(context)
 {
+  m_continue = false;
   m_running = true;
-  m_forceBreak = false;
   m_nextBreakpoint = 1;
   m_program = NULL;
   m_kernelInvocation = NULL;
+  m_numKernels = 0;
+  m_owner = -1;
+  m_waitForFirstGroup = false;
 
   // Set-up commands
 #define ADD_CMD(name, sname, func)                                             \
@@ -85,19 +94,45 @@ InteractiveDebugger::InteractiveDebugger(const Context* context)
   ADD_CMD("workitem", "wi", workitem);
 }
 
+uint32_t InteractiveDebugger::getCallbacks() const
+{
+  return CALLBACK_BIT(CallbackInstructionExecuted) |
+         CALLBACK_BIT(CallbackKernelBegin) |
+         CALLBACK_BIT(CallbackKernelEnd) |
+         CALLBACK_BIT(CallbackLog) |
+         CALLBACK_BIT(CallbackWorkGroupComplete);
+}
+
 void InteractiveDebugger::instructionExecuted(
   const WorkItem* workItem, const llvm::Instruction* instruction,
   const TypedValue& result)
 {
+  if (!m_running)
+    return;
+
+  // Work-items run freely on every worker while continuing, until one of
+  // them needs to stop, after which only that worker runs until continued
+  if (m_owner != m_kernelInvocation->getWorkerID())
+  {
+    if (m_continue && !forceBreak && !sigintBreak && !isAtBreakpoint(workItem))
+      return;
+    if (!acquireWorker(workItem))
+      return;
+  }
+
   if (!shouldShowPrompt(workItem))
+  {
+    if (m_continue)
+      releaseWorker();
     return;
+  }
 
 #if !defined(_WIN32) || defined(__MINGW32__)
   // Restore old signal handler
   sigaction(SIGINT, &m_oldSignalHandler, NULL);
 #endif
 
-  m_forceBreak = false;
+  forceBreak = false;
   sigintBreak = false;
 
   // Print function if changed
@@ -149,7 +184,7 @@ void InteractiveDebugger::instructionExecuted(
       if (interactive)
         cout << "(quit)" << endl;
       quit(vector<string>());
-      return;
+      break;
     }
 
     // Split command into tokens
@@ -181,6 +216,10 @@ void InteractiveDebugger::instructionExecuted(
       cout << "Unrecognized command '" << tokens[0] << "'" << endl;
     }
   }
+
+  // Let the other workers run again
+  if (m_continue || !m_running)
+    releaseWorker();
 }
 
 bool InteractiveDebugger::isThreadSafe() const
@@ -191,7 +230,6 @@ bool InteractiveDebugger::isThreadSafe() const
 void InteractiveDebugger::kernelBegin(const KernelInvocation* kernelInvocation)
 {
   m_continue = false;
-  m_lastBreakLine = 0;
   m_listPosition = 0;
   m_next = false;
   m_previousDepth = 0;
@@ -199,6 +237,14 @@ void InteractiveDebugger::kernelBegin(const KernelInvocation* kernelInvocation)
 
   m_kernelInvocation = kernelInvocation;
   m_program = kernelInvocation->getKernel()->getProgram();
+  m_numKernels++;
+
+  m_breakLines = vector<atomic<bool>>(m_program->getNumSourceLines() + 2);
+  updateBreakLines();
+
+  // Start by stepping through the first work-group
+  m_owner = -1;
+  m_waitForFirstGroup = true;
 }
 
 void InteractiveDebugger::kernelEnd(const KernelInvocation* kernelInvocation)
@@ -214,13 +260,50 @@ void InteractiveDebugger::kernelEnd(const KernelInvocation* kernelInvocation)
 void InteractiveDebugger::log(MessageType type, const char* message)
 {
   if (type == ERROR)
-    m_forceBreak = true;
+    forceBreak = true;
+}
+
+bool InteractiveDebugger::needsInstructionCallbacks() const
+{
+  // Kernels run without the debugger once it has quit
+  return m_running;
+}
+
+bool InteractiveDebugger::supportsParallelWorkGroups() const
+{
+  return true;
+}
+
+void InteractiveDebugger::workGroupComplete(const WorkGroup* workGroup)
+{
+  // Let another worker's work-group be stepped through next
+  if (m_owner == m_kernelInvocation->getWorkerID())
+    releaseWorker();
 }
 
 ///////////////////////////
 //// Utility Functions ////
 ///////////////////////////
 
+bool InteractiveDebugger::acquireWorker(const WorkItem* workItem)
+{
+  // Wait for any other worker being debugged to continue, or to finish its
+  // work-group (the kernel's first work-group is always stepped through
+  // first, as when running on a single worker)
+  bool first = workItem->getWorkGroup()->getGroupID() == Size3(0, 0, 0);
+  unique_lock<mutex> lock(m_ownerLock);
+  m_ownerReleased.wait(lock, [&] {
+    return !m_running || (m_owner < 0 && (first || !m_waitForFirstGroup));
+  });
+  if (!m_running)
+    return false;
+
+  m_owner = m_kernelInvocation->getWorkerID();
+  if (first)
+    m_waitForFirstGroup = false;
+  return true;
+}
+
 size_t InteractiveDebugger::getCurrentLineNumber() const
 {
   const WorkItem* workItem = m_kernelInvocation->getCurrentWorkItem();
@@ -235,30 +318,16 @@ size_t InteractiveDebugger::getCurrentLineNumber() const
 size_t
 InteractiveDebugger::getLineNumber(const llvm::Instruction* instruction) const
 {
-  llvm::MDNode* md = instruction->getMetadata("dbg");
-  if (md)
-  {
-    return ((llvm::DILocation*)md)->getLine();
-  }
-  return 0;
+  const Program::SourceLocation* loc = m_program->getSourceLocation(instruction);
+  return loc ? loc->line : 0;
 }
 
 bool InteractiveDebugger::hasHitBreakpoint()
 {
-  if (m_breakpoints.empty())
+  if (!isAtBreakpoint(m_kernelInvocation->getCurrentWorkItem()))
     return false;
 
-  // Check if we have passed over the previous breakpoint
-  if (m_lastBreakLine)
-  {
-    if (getCurrentLineNumber() != m_lastBreakLine)
-      m_lastBreakLine = 0;
-    else
-      return false;
-    ;
-  }
-
-  // Check if we're at a breakpoint
+  // Find the breakpoint we're at
   size_t line = getCurrentLineNumber();
   map<size_t, size_t>::iterator itr;
   for (itr = m_breakpoints[m_program].begin();
@@ -269,7 +338,8 @@ bool InteractiveDebugger::hasHitBreakpoint()
       cout << "Breakpoint " << itr->first << " hit at line " << itr->second
            << " by work-item "
            << m_kernelInvocation->getCurrentWorkItem()->getGlobalID() << endl;
-      m_lastBreakLine = line;
+      lastBreakKernel = m_numKernels;
+      lastBreakLine = line;
       m_listPosition = 0;
       return true;
     }
@@ -277,6 +347,25 @@ bool InteractiveDebugger::hasHitBreakpoint()
   return false;
 }
 
+bool InteractiveDebugger::isAtBreakpoint(const WorkItem* workItem) const
+{
+  if (workItem->getState() == WorkItem::FINISHED)
+    return false;
+
+  const llvm::DebugLoc& loc = workItem->getCurrentInstruction()->getDebugLoc();
+  size_t line = loc ? loc.getLine() : 0;
+
+  // Check if we have passed over the previous breakpoint
+  if (lastBreakKernel == m_numKernels && lastBreakLine)
+  {
+    if (line == lastBreakLine)
+      return false;
+    lastBreakLine = 0;
+  }
+
+  return line < m_breakLines.size() && m_breakLines[line];
+}
+
 void InteractiveDebugger::printCurrentLine() const
 {
   const WorkItem* workItem = m_kernelInvocation->getCurrentWorkItem();
@@ -333,12 +422,20 @@ void InteractiveDebugger::printSourceLine(size_t lineNum) const
   }
 }
 
+void InteractiveDebugger::releaseWorker()
+{
+  lock_guard<mutex> lock(m_ownerLock);
+  m_owner = -1;
+  m_waitForFirstGroup = false;
+  m_ownerReleased.notify_all();
+}
+
 bool InteractiveDebugger::shouldShowPrompt(const WorkItem* workItem)
 {
   if (!m_running)
     return false;
 
-  if (m_forceBreak || sigintBreak)
+  if (forceBreak || sigintBreak)
     return true;
 
   if (hasHitBreakpoint())
@@ -364,6 +461,20 @@ bool InteractiveDebugger::shouldShowPrompt(const WorkItem* workItem)
   return true;
 }
 
+void InteractiveDebugger::updateBreakLines()
+{
+  for (size_t line = 0; line < m_breakLines.size(); line++)
+    m_breakLines[line] = false;
+
+  map<size_t, size_t>::iterator itr;
+  for (itr = m_breakpoints[m_program].begin();
+       itr != m_breakpoints[m_program].end(); itr++)
+  {
+    if (itr->second < m_breakLines.size())
+      m_breakLines[itr->second] = true;
+  }
+}
+
 //////////////////////////////
 //// Interactive Commands ////
 //////////////////////////////
@@ -414,9 +525,28 @@ bool InteractiveDebugger::brk(vector<string> args)
     }
   }
 
+  // Move breakpoints on lines without code to the next line that has some
+  size_t codeLine = lineNum;
+  size_t lastLine = m_program->getNumSourceLines() + 1;
+  while (lineNum && codeLine <= lastLine &&
+         m_program->getLineInstructions(codeLine).empty())
+    codeLine++;
+  if (lineNum && codeLine > lastLine)
+  {
+    cout << "No code at or after line " << lineNum << "." << endl;
+    return false;
+  }
+  if (codeLine != lineNum)
+  {
+    cout << "No code at line " << lineNum << ", breakpoint set at line "
+         << codeLine << "." << endl;
+    lineNum = codeLine;
+  }
+
   if (lineNum)
   {
     m_breakpoints[m_program][m_nextBreakpoint++] = lineNum;
+    updateBreakLines();
   }
   else
   {
@@ -462,6 +592,7 @@ bool InteractiveDebugger::del(vector<string> args)
       return false;
     }
     m_breakpoints[m_program].erase(bpNum);
+    updateBreakLines();
   }
   else
   {
@@ -473,6 +604,7 @@ bool InteractiveDebugger::del(vector<string> args)
     if (confirm == "y")
     {
       m_breakpoints.clear();
+      updateBreakLines();
     }
   }
 
@@ -910,7 +1042,8 @@ bool InteractiveDebugger::workitem(vector<string> args)
   // passive.
   if (!const_cast<KernelInvocation*>(m_kernelInvocation)->switchWorkItem(gid))
   {
-    cout << "Work-item has already finished, unable to load state." << endl;
+    cout << "Work-item has already finished or is running on another "
+         << "worker, unable to load state." << endl;
     return false;
   }
 
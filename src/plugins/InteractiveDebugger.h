@@ -8,6 +8,9 @@
 
 #include "core/Plugin.h"
 
+#include <condition_variable>
+#include <mutex>
+
 namespace oclgrind
 {
 class Program;
@@ -17,32 +20,49 @@ class InteractiveDebugger : public Plugin
 public:
   InteractiveDebugger(const Context* context);
 
+  virtual uint32_t getCallbacks() const override;
   virtual void instructionExecuted(const WorkItem* workItem,
                                    const llvm::Instruction* instruction,
                                    const TypedValue& result) override;
   virtual void kernelBegin(const KernelInvocation* kernelInvocation) override;
   virtual void kernelEnd(const KernelInvocation* kernelInvocation) override;
   virtual void log(MessageType type, const char* message) override;
+  virtual void workGroupComplete(const WorkGroup* workGroup) override;
 
   virtual bool isThreadSafe() const override;
+  virtual bool needsInstructionCallbacks() const override;
+  virtual bool supportsParallelWorkGroups() const override;
 
 private:
-  bool m_continue;
-  bool m_running;
-  bool m_forceBreak;
+  std::atomic<bool> m_continue;
+  std::atomic<bool> m_running;
   size_t m_listPosition;
   bool m_next;
-  size_t m_lastBreakLine;
   size_t m_nextBreakpoint;
   size_t m_previousDepth;
   size_t m_previousLine;
   std::map<const Program*, std::map<size_t, size_t>> m_breakpoints;
   const Program* m_program;
   const KernelInvocation* m_kernelInvocation;
+  size_t m_numKernels;
+
+  // Source lines of the current program with breakpoints, checked by every
+  // worker after each instruction while work-items run freely
+  std::vector<std::atomic<bool>> m_breakLines;
+  void updateBreakLines();
+
+  // Worker being debugged (or -1), the only one that runs while stepping
+  std::atomic<int> m_owner;
+  bool m_waitForFirstGroup;
+  std::mutex m_ownerLock;
+  std::condition_variable m_ownerReleased;
+  bool acquireWorker(const WorkItem* workItem);
+  void releaseWorker();
 
   size_t getCurrentLineNumber() const;
   size_t getLineNumber(const llvm::Instruction* instruction) const;
   bool hasHitBreakpoint();
+  bool isAtBreakpoint(const WorkItem* workItem) const;
   void printCurrentLine() const;
   void printFunction(const llvm::Instruction* instruction) const;
   void printSourceLine(size_t lineNum) const;
@@ -0,0 +1,401 @@
+// LiveMetrics.cpp (Oclgrind)
+// Copyright (c) 2013-2019, James Price and Simon McIntosh-Smith,
+// University of Bristol. All rights reserved.
+//
+// This program is provided under a three-clause BSD license. For full
+// license terms please see the LICENSE file distributed with this
+// source code.
+
+#include "core/common.h"
+
+#include <cstdio>
+#include <fstream>
+
+#include "LiveMetrics.h"
+
+#include "core/Context.h"
+#include "core/Kernel.h"
+#include "core/KernelInvocation.h"
+#include "core/Queue.h"
+
+using namespace oclgrind;
+using namespace std;
+
+#define DEFAULT_INTERVAL 1
+
+THREAD_LOCAL LiveMetrics::WorkerState LiveMetrics::m_state = {0, NULL};
+atomic<unsigned long> LiveMetrics::m_numInstances(0);
+
+namespace
+{
+// Increment a counter that only the calling thread writes, without the cost
+// of an atomic read-modify-write
+void increment(atomic<uint64_t>& counter, uint64_t value)
+{
+  counter.store(counter.load(memory_order_relaxed) + value,
+                memory_order_relaxed);
+}
+
+string escapeLabel(const string& value)
+{
+  string escaped;
+  for (char c : value)
+  {
+    if (c == '\\' || c == '"')
+      escaped += '\\';
+    if (c == '\n')
+      escaped += "\\n";
+    else
+      escaped += c;
+  }
+  return escaped;
+}
+
+void writeMetric(ostream& output, const char* name, const char* type,
+                 const char* help)
+{
+  output << "# HELP " << name << " " << help << endl;
+  output << "# TYPE " << name << " " << type << endl;
+}
+} // namespace
+
+LiveMetrics::LiveMetrics(const Context* context, const char* filename)
+  : Plugin(context), m_instance(++m_numInstances), m_filename(filename)
+{
+  m_interval = getEnvInt("OCLGRIND_METRICS_INTERVAL", DEFAULT_INTERVAL, false);
+
+  m_kernelStart = 0;
+  m_kernelGroups = 0;
+  m_startGroups = 0;
+  m_extraGroups = 0;
+  m_numKernels = 0;
+  m_processGroups = 0;
+  m_numErrors = 0;
+  m_numWarnings = 0;
+
+  m_exiting = false;
+  m_updatePending = true;
+  m_lastTime = now();
+  m_writer = thread(&LiveMetrics::runWriter, this);
+}
+
+LiveMetrics::~LiveMetrics()
+{
+  {
+    lock_guard<mutex> lock(m_lock);
+    m_exiting = true;
+  }
+  m_update.notify_one();
+  m_writer.join();
+
+  for (WorkerCounters* counters : m_workers)
+    delete counters;
+}
+
+bool LiveMetrics::deserialize(const string& data)
+{
+  // Work-groups completed before the checkpoint aren't run again
+  size_t offset = 0;
+  uint64_t numGroups;
+  if (!readBinary(data, offset, numGroups) || offset != data.size())
+    return false;
+
+  lock_guard<mutex> lock(m_lock);
+  m_extraGroups += numGroups;
+  return true;
+}
+
+uint32_t LiveMetrics::getCallbacks() const
+{
+  return CALLBACK_BIT(CallbackInstructionsExecuted) |
+         CALLBACK_BIT(CallbackKernelBegin) | CALLBACK_BIT(CallbackKernelEnd) |
+         CALLBACK_BIT(CallbackLog) | CALLBACK_BIT(CallbackWorkGroupComplete) |
+         CALLBACK_BIT(CallbackWorkItemComplete);
+}
+
+uint64_t LiveMetrics::getCompletedGroups() const
+{
+  uint64_t numGroups = m_extraGroups;
+  for (const WorkerCounters* counters : m_workers)
+    numGroups += counters->workGroups;
+  return numGroups - m_startGroups;
+}
+
+LiveMetrics::WorkerCounters* LiveMetrics::getCounters()
+{
+  if (m_state.instance != m_instance)
+  {
+    WorkerCounters* counters = new WorkerCounters;
+    counters->workGroups = 0;
+    counters->workItems = 0;
+    counters->instructions = 0;
+
+    lock_guard<mutex> lock(m_lock);
+    m_workers.push_back(counters);
+    m_state.instance = m_instance;
+    m_state.counters = counters;
+  }
+  return m_state.counters;
+}
+
+void LiveMetrics::instructionsExecuted(const InstructionRecord* records,
+                                       size_t count)
+{
+  if (!KernelInvocation::isWorkerProcess())
+    increment(getCounters()->instructions, count);
+}
+
+void LiveMetrics::kernelBegin(const KernelInvocation* kernelInvocation)
+{
+  {
+    lock_guard<mutex> lock(m_lock);
+    Size3 numGroups = kernelInvocation->getNumGroups();
+    m_kernelName = kernelInvocation->getKernel()->getName();
+    m_kernelStart = now();
+    m_kernelGroups = numGroups.x * numGroups.y * numGroups.z;
+    m_startGroups = 0;
+    for (const WorkerCounters* counters : m_workers)
+      m_startGroups += counters->workGroups;
+    m_extraGroups = 0;
+  }
+  requestUpdate();
+}
+
+void LiveMetrics::kernelEnd(const KernelInvocation* kernelInvocation)
+{
+  {
+    lock_guard<mutex> lock(m_lock);
+    m_kernelName.clear();
+    m_numKernels++;
+  }
+  requestUpdate();
+}
+
+void LiveMetrics::log(MessageType type, const char* message)
+{
+  if (type == ERROR)
+    m_numErrors++;
+  else if (type == WARNING)
+    m_numWarnings++;
+}
+
+bool LiveMetrics::mergeResults(const string& data)
+{
+  size_t offset = 0;
+  uint64_t numGroups;
+  if (!readBinary(data, offset, numGroups) || offset != data.size())
+    return false;
+
+  {
+    lock_guard<mutex> lock(m_lock);
+    m_extraGroups += numGroups;
+  }
+  requestUpdate();
+  return true;
+}
+
+bool LiveMetrics::needsInstructionCallbacks() const
+{
+  // Instructions are only counted when something else needs them
+  // interpreted, so kernels may still run as native code
+  return false;
+}
+
+void LiveMetrics::requestUpdate()
+{
+  {
+    lock_guard<mutex> lock(m_lock);
+    m_updatePending = true;
+  }
+  m_update.notify_one();
+}
+
+void LiveMetrics::runWriter()
+{
+  unique_lock<mutex> lock(m_lock);
+  while (true)
+  {
+    m_update.wait_for(lock, chrono::duration<double>(m_interval),
+                      [&] { return m_updatePending || m_exiting; });
+    m_updatePending = false;
+    bool exiting = m_exiting;
+
+    lock.unlock();
+    writeMetrics();
+    lock.lock();
+
+    if (exiting)
+      break;
+  }
+}
+
+bool LiveMetrics::saveResults(string& data) const
+{
+  // Only the progress of a worker process is passed back
+  writeBinary(data, (uint64_t)m_processGroups);
+  return true;
+}
+
+bool LiveMetrics::serialize(string& data) const
+{
+  lock_guard<mutex> lock(m_lock);
+  writeBinary(data, getCompletedGroups());
+  return true;
+}
+
+void LiveMetrics::workGroupComplete(const WorkGroup* workGroup)
+{
+  if (KernelInvocation::isWorkerProcess())
+    m_processGroups++;
+  else
+    increment(getCounters()->workGroups, 1);
+}
+
+void LiveMetrics::workItemComplete(const WorkItem* workItem)
+{
+  if (!KernelInvocation::isWorkerProcess())
+    increment(getCounters()->workItems, 1);
+}
+
+void LiveMetrics::writeMetrics()
+{
+  // Take a snapshot of the counters
+  double time = now();
+  string kernelName;
+  double kernelStart;
+  uint64_t kernelGroups, completedGroups, numKernels;
+  vector<uint64_t> workGroups, workItems, instructions;
+  {
+    lock_guard<mutex> lock(m_lock);
+    kernelName = m_kernelName;
+    kernelStart = m_kernelStart;
+    kernelGroups = m_kernelGroups;
+    completedGroups = getCompletedGroups();
+    numKernels = m_numKernels;
+    for (const WorkerCounters* counters : m_workers)
+    {
+      workGroups.push_back(counters->workGroups);
+      workItems.push_back(counters->workItems);
+      instructions.push_back(counters->instructions);
+    }
+  }
+  map<unsigned, size_t> queueDepths = Queue::getQueueDepths(m_context);
+  map<string, size_t> memoryUsage = m_context->getMemoryUsageTotals();
+
+  ostringstream output;
+  writeMetric(output, "oclgrind_update_timestamp_seconds", "gauge",
+              "Time these metrics were written.");
+  output << "oclgrind_update_timestamp_seconds " << fixed << setprecision(3)
+         << time * 1e-9 << defaultfloat << endl;
+  writeMetric(output, "oclgrind_kernels_completed_total", "counter",
+              "Kernels that have finished running.");
+  output << "oclgrind_kernels_completed_total " << numKernels << endl;
+
+  if (!kernelName.empty())
+  {
+    string label = "{kernel=\"" + escapeLabel(kernelName) + "\"}";
+    double elapsed = (time - kernelStart) * 1e-9;
+    writeMetric(output, "oclgrind_kernel_running", "gauge",
+                "Kernel that is currently running.");
+    output << "oclgrind_kernel_running" << label << " 1" << endl;
+    writeMetric(output, "oclgrind_kernel_elapsed_seconds", "gauge",
+                "Time the current kernel has been running for.");
+    output << "oclgrind_kernel_elapsed_seconds" << label << " " << fixed
+           << setprecision(3) << elapsed << defaultfloat << endl;
+    writeMetric(output, "oclgrind_kernel_work_groups", "gauge",
+                "Work-groups in the current kernel.");
+    output << "oclgrind_kernel_work_groups" << label << " " << kernelGroups
+           << endl;
+    writeMetric(output, "oclgrind_kernel_work_groups_completed", "gauge",
+                "Work-groups of the current kernel that have completed.");
+    output << "oclgrind_kernel_work_groups_completed" << label << " "
+           << completedGroups << endl;
+    if (completedGroups)
+    {
+      // Assume the remaining work-groups take as long as those so far
+      writeMetric(output, "oclgrind_kernel_remaining_seconds", "gauge",
+                  "Estimated time until the current kernel completes.");
+      output << "oclgrind_kernel_remaining_seconds" << label << " " << fixed
+             << setprecision(3)
+             << elapsed * (kernelGroups - completedGroups) / completedGroups
+             << defaultfloat << endl;
+    }
+  }
+
+  double interval = (time - m_lastTime) * 1e-9;
+  m_lastInstructions.resize(instructions.size(), 0);
+  writeMetric(output, "oclgrind_worker_work_groups_total", "counter",
+              "Work-groups completed by each worker thread.");
+  for (size_t i = 0; i < workGroups.size(); i++)
+  {
+    output << "oclgrind_worker_work_groups_total{worker=\"" << i << "\"} "
+           << workGroups[i] << endl;
+  }
+  writeMetric(output, "oclgrind_worker_work_items_total", "counter",
+              "Work-items completed by each worker thread.");
+  for (size_t i = 0; i < workItems.size(); i++)
+  {
+    output << "oclgrind_worker_work_items_total{worker=\"" << i << "\"} "
+           << workItems[i] << endl;
+  }
+  writeMetric(output, "oclgrind_worker_instructions_total", "counter",
+              "Instructions interpreted by each worker thread.");
+  for (size_t i = 0; i < instructions.size(); i++)
+  {
+    output << "oclgrind_worker_instructions_total{worker=\"" << i << "\"} "
+           << instructions[i] << endl;
+  }
+  writeMetric(output, "oclgrind_worker_instructions_per_second", "gauge",
+              "Instructions interpreted by each worker thread per second "
+              "since the previous update.");
+  for (size_t i = 0; i < instructions.size(); i++)
+  {
+    double rate = interval > 0
+                    ? (instructions[i] - m_lastInstructions[i]) / interval
+                    : 0;
+    output << "oclgrind_worker_instructions_per_second{worker=\"" << i
+           << "\"} " << fixed << setprecision(1) << rate << defaultfloat
+           << endl;
+  }
+  m_lastInstructions = instructions;
+  m_lastTime = time;
+
+  writeMetric(output, "oclgrind_queue_depth", "gauge",
+              "Commands enqueued and not yet complete in each queue.");
+  for (auto& depth : queueDepths)
+  {
+    output << "oclgrind_queue_depth{queue=\"" << depth.first << "\"} "
+           << depth.second << endl;
+  }
+  writeMetric(output, "oclgrind_memory_bytes", "gauge",
+              "Bytes currently held by each category of allocations.");
+  for (auto& usage : memoryUsage)
+  {
+    output << "oclgrind_memory_bytes{category=\"" << escapeLabel(usage.first)
+           << "\"} " << usage.second << endl;
+  }
+  writeMetric(output, "oclgrind_messages_total", "counter",
+              "Errors and warnings reported.");
+  output << "oclgrind_messages_total{type=\"error\"} " << m_numErrors << endl;
+  output << "oclgrind_messages_total{type=\"warning\"} " << m_numWarnings
+         << endl;
+
+  // Replace the file in one step, so readers never see a partial update
+  string temporary = m_filename + ".tmp";
+  ofstream file(temporary);
+  file << output.str();
+  file.close();
+#if defined(_WIN32)
+  remove(m_filename.c_str());
+#endif
+  if (!file || rename(temporary.c_str(), m_filename.c_str()))
+  {
+    static bool warned = false;
+    if (!warned)
+    {
+      cerr << "Oclgrind: Unable to write metrics to '" << m_filename << "'"
+           << endl;
+      warned = true;
+    }
+  }
+}
@@ -0,0 +1,91 @@
+// LiveMetrics.h (Oclgrind)
+// Copyright (c) 2013-2019, James Price and Simon McIntosh-Smith,
+// University of Bristol. All rights reserved.
+//
+// This program is provided under a three-clause BSD license. For full
+// license terms please see the LICENSE file distributed with this
+// source code.
+
+#include "core/Plugin.h"
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+namespace oclgrind
+{
+// Exposes the progress of a run while it executes, by periodically
+// replacing a file (e.g. in /dev/shm) with counters in the Prometheus text
+// format - the current kernel and its completed work-groups, the work done
+// by each worker thread, queue depths, memory usage and messages logged
+class LiveMetrics : public Plugin
+{
+public:
+  LiveMetrics(const Context* context, const char* filename);
+  virtual ~LiveMetrics();
+
+  virtual bool deserialize(const std::string& data) override;
+  virtual uint32_t getCallbacks() const override;
+  virtual void instructionsExecuted(const InstructionRecord* records,
+                                    size_t count) override;
+  virtual void kernelBegin(const KernelInvocation* kernelInvocation) override;
+  virtual void kernelEnd(const KernelInvocation* kernelInvocation) override;
+  virtual void log(MessageType type, const char* message) override;
+  virtual bool mergeResults(const std::string& data) override;
+  virtual bool needsInstructionCallbacks() const override;
+  virtual bool saveResults(std::string& data) const override;
+  virtual bool serialize(std::string& data) const override;
+  virtual void workGroupComplete(const WorkGroup* workGroup) override;
+  virtual void workItemComplete(const WorkItem* workItem) override;
+
+private:
+  // Totals of one worker thread, only written by that thread
+  struct WorkerCounters
+  {
+    std::atomic<uint64_t> workGroups;
+    std::atomic<uint64_t> workItems;
+    std::atomic<uint64_t> instructions; // Only counted when interpreted
+  };
+  struct WorkerState
+  {
+    unsigned long instance;
+    WorkerCounters* counters;
+  };
+  static THREAD_LOCAL WorkerState m_state;
+  static std::atomic<unsigned long> m_numInstances;
+  unsigned long m_instance;
+
+  std::string m_filename;
+  double m_interval;
+
+  // Guards the worker list and the current kernel
+  mutable std::mutex m_lock;
+  std::vector<WorkerCounters*> m_workers;
+  std::string m_kernelName; // Empty between kernels
+  double m_kernelStart;
+  uint64_t m_kernelGroups;
+  uint64_t m_startGroups;  // Work-groups completed before the kernel began
+  uint64_t m_extraGroups;  // Completed by worker processes or checkpoints
+  uint64_t m_numKernels;
+  // Worker processes are forked without the writer thread, and may have
+  // been forked while it held m_lock, so they only count their work-groups
+  std::atomic<uint64_t> m_processGroups;
+  std::atomic<uint64_t> m_numErrors;
+  std::atomic<uint64_t> m_numWarnings;
+
+  // Writer thread, which also keeps the previous instruction counts of the
+  // workers to measure their rates
+  bool m_exiting;
+  bool m_updatePending;
+  std::condition_variable m_update;
+  std::thread m_writer;
+  std::vector<uint64_t> m_lastInstructions;
+  double m_lastTime;
+
+  WorkerCounters* getCounters();
+  uint64_t getCompletedGroups() const;
+  void requestUpdate();
+  void runWriter();
+  void writeMetrics();
+};
+} // namespace oclgrind
@@ -13,15 +13,20 @@
 
 #include "Logger.h"
 
+#include "core/KernelInvocation.h"
+
 using namespace oclgrind;
 using namespace std;
 
 #define DEFAULT_MAX_ERRORS 1000
 
-unsigned Logger::m_numErrors = 0;
+atomic<unsigned> Logger::m_numErrors(0);
 
 static mutex logMutex;
 
+// Identifies each logger to the threads caching their buffers for it
+static atomic<uint64_t> nextLoggerId(1);
+
 Logger::Logger(const Context* context) : Plugin(context)
 {
   m_log = &cerr;
@@ -38,10 +43,26 @@ Logger::Logger(const Context* context) : Plugin(context)
   }
 
   m_maxErrors = getEnvInt("OCLGRIND_MAX_ERRORS", DEFAULT_MAX_ERRORS);
+
+  m_id = nextLoggerId++;
+  m_numRunningKernels = 0;
+  m_numPending = 0;
+  m_writing = false;
+  m_exiting = false;
 }
 
 Logger::~Logger()
 {
+  if (m_writer.joinable())
+  {
+    {
+      lock_guard<mutex> lock(m_pendingLock);
+      m_exiting = true;
+    }
+    m_pendingReady.notify_one();
+    m_writer.join();
+  }
+
   if (m_log != &cerr)
   {
     ((ofstream*)m_log)->close();
@@ -49,23 +70,186 @@ Logger::~Logger()
   }
 }
 
+bool Logger::deserialize(const string& data)
+{
+  // Errors reported before the checkpoint count towards the limit
+  size_t offset = 0;
+  uint32_t numErrors;
+  if (!readBinary(data, offset, numErrors) || offset != data.size())
+    return false;
+  m_numErrors = numErrors;
+  return true;
+}
+
+void Logger::flush()
+{
+  unique_lock<mutex> lock(m_pendingLock);
+  m_pendingWritten.wait(lock, [&] { return !m_numPending && !m_writing; });
+}
+
+uint32_t Logger::getCallbacks() const
+{
+  return CALLBACK_BIT(CallbackKernelBegin) | CALLBACK_BIT(CallbackKernelEnd) |
+         CALLBACK_BIT(CallbackLog);
+}
+
+Logger::ThreadBuffer* Logger::getThreadBuffer()
+{
+  // Each thread caches its buffer for the logger it last logged to
+  static THREAD_LOCAL uint64_t cachedLogger = 0;
+  static THREAD_LOCAL ThreadBuffer* cachedBuffer = NULL;
+  if (cachedLogger != m_id)
+  {
+    lock_guard<mutex> lock(m_buffersLock);
+    unique_ptr<ThreadBuffer>& buffer = m_buffers[this_thread::get_id()];
+    if (!buffer)
+      buffer.reset(new ThreadBuffer);
+    cachedLogger = m_id;
+    cachedBuffer = buffer.get();
+  }
+  return cachedBuffer;
+}
+
+void Logger::kernelBegin(const KernelInvocation* kernelInvocation)
+{
+  m_numRunningKernels++;
+}
+
+void Logger::kernelEnd(const KernelInvocation* kernelInvocation)
+{
+  // Messages from a kernel are all written by the time it completes
+  m_numRunningKernels--;
+  flush();
+}
+
 void Logger::log(MessageType type, const char* message)
 {
-  lock_guard<mutex> lock(logMutex);
+  if (KernelInvocation::isWorkerProcess())
+  {
+    m_workerMessages.push_back(make_pair(type, string(message)));
+    return;
+  }
+
+  string text;
 
   // Limit number of errors/warning printed
   if (type == ERROR || type == WARNING)
   {
-    if (m_numErrors == m_maxErrors)
+    unsigned numErrors = m_numErrors++;
+    if (numErrors == m_maxErrors)
+    {
+      ostringstream suppressed;
+      suppressed << endl
+                 << "Oclgrind: " << numErrors
+                 << " errors generated - suppressing further errors" << endl
+                 << endl;
+      text = suppressed.str();
+    }
+    if (numErrors >= m_maxErrors)
     {
-      *m_log << endl
-             << "Oclgrind: " << m_numErrors
-             << " errors generated - suppressing further errors" << endl
-             << endl;
+      if (text.empty())
+        return;
+      message = NULL;
     }
-    if (m_numErrors++ >= m_maxErrors)
-      return;
   }
 
-  *m_log << endl << message << endl;
+  if (message)
+  {
+    text += '\n';
+    text += message;
+    text += '\n';
+  }
+
+  if (m_numRunningKernels)
+  {
+    ThreadBuffer* buffer = getThreadBuffer();
+    {
+      lock_guard<mutex> lock(buffer->lock);
+      buffer->text += text;
+    }
+
+    // The writer only waits once it has taken every counted message, so
+    // take its lock for the first new one to make sure it is woken
+    if (m_numPending++ == 0)
+    {
+      lock_guard<mutex> lock(m_pendingLock);
+      if (!m_writer.joinable())
+        m_writer = thread(&Logger::runWriter, this);
+    }
+    m_pendingReady.notify_one();
+    return;
+  }
+
+  // Keep messages in order with any still being written
+  flush();
+  lock_guard<mutex> lock(logMutex);
+  *m_log << text << std::flush;
+}
+
+bool Logger::mergeResults(const string& data)
+{
+  size_t offset = 0;
+  uint32_t numMessages;
+  if (!readBinary(data, offset, numMessages))
+    return false;
+  for (uint32_t i = 0; i < numMessages; i++)
+  {
+    uint32_t type;
+    string message;
+    if (!readBinary(data, offset, type) || !readBinary(data, offset, message))
+      return false;
+    log((MessageType)type, message.c_str());
+  }
+  return offset == data.size();
+}
+
+bool Logger::saveResults(string& data) const
+{
+  writeBinary(data, (uint32_t)m_workerMessages.size());
+  for (auto& message : m_workerMessages)
+  {
+    writeBinary(data, (uint32_t)message.first);
+    writeBinary(data, message.second);
+  }
+  return true;
+}
+
+bool Logger::serialize(string& data) const
+{
+  writeBinary(data, (uint32_t)m_numErrors);
+  return true;
+}
+
+void Logger::runWriter()
+{
+  unique_lock<mutex> lock(m_pendingLock);
+  while (true)
+  {
+    m_pendingReady.wait(lock, [&] { return m_numPending || m_exiting; });
+    if (!m_numPending)
+      break;
+
+    // Write everything logged so far without holding up new messages, which
+    // are counted again for the next pass
+    m_numPending = 0;
+    m_writing = true;
+    lock.unlock();
+    string text;
+    {
+      lock_guard<mutex> buffersLock(m_buffersLock);
+      for (auto& buffer : m_buffers)
+      {
+        lock_guard<mutex> bufferLock(buffer.second->lock);
+        text += buffer.second->text;
+        buffer.second->text.clear();
+      }
+    }
+    {
+      lock_guard<mutex> logLock(logMutex);
+      *m_log << text << std::flush;
+    }
+    lock.lock();
+    m_writing = false;
+    m_pendingWritten.notify_all();
+  }
 }
@@ -8,6 +8,10 @@
 
 #include "core/Plugin.h"
 
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
 namespace oclgrind
 {
 class Logger : public Plugin
@@ -16,12 +20,47 @@ public:
   Logger(const Context* context);
   virtual ~Logger();
 
+  virtual bool deserialize(const std::string& data) override;
+  virtual uint32_t getCallbacks() const override;
+  virtual void kernelBegin(const KernelInvocation* kernelInvocation) override;
+  virtual void kernelEnd(const KernelInvocation* kernelInvocation) override;
   virtual void log(MessageType type, const char* message) override;
+  virtual bool mergeResults(const std::string& data) override;
+  virtual bool saveResults(std::string& data) const override;
+  virtual bool serialize(std::string& data) const override;
 
 private:
   std::ostream* m_log;
 
   unsigned m_maxErrors;
-  static unsigned m_numErrors;
+  static std::atomic<unsigned> m_numErrors;
+
+  // Messages logged while kernels run are added to a buffer for each thread
+  // and written by a background thread, so that workers reporting errors
+  // don't wait for the output stream or for each other
+  struct ThreadBuffer
+  {
+    std::mutex lock;
+    std::string text;
+  };
+  uint64_t m_id;
+  std::atomic<unsigned> m_numRunningKernels;
+  std::map<std::thread::id, std::unique_ptr<ThreadBuffer>> m_buffers;
+  std::mutex m_buffersLock;
+  std::atomic<size_t> m_numPending;
+  bool m_writing;
+  bool m_exiting;
+  std::mutex m_pendingLock;
+  std::condition_variable m_pendingReady;
+  std::condition_variable m_pendingWritten;
+  std::thread m_writer;
+
+  // Messages from a worker process, which are logged by the process that
+  // forked it
+  std::vector<std::pair<MessageType, std::string>> m_workerMessages;
+
+  void flush();
+  ThreadBuffer* getThreadBuffer();
+  void runWriter();
 };
 } // namespace oclgrind
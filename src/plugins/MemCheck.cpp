@@ -9,9 +9,14 @@
 #include "core/common.h"
 
 #include "core/Context.h"
+#include "core/Kernel.h"
+#include "core/KernelInvocation.h"
 #include "core/Memory.h"
+#include "core/Program.h"
 #include "core/WorkItem.h"
 
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/InstIterator.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/Type.h"
 
@@ -20,38 +25,72 @@
 using namespace oclgrind;
 using namespace std;
 
-MemCheck::MemCheck(const Context* context) : Plugin(context) {}
+MemCheck::MemCheck(const Context* context)
+    : Plugin(context), m_arrayChecks(NULL)
+{
+}
+
+bool MemCheck::deserialize(const string& data)
+{
+  // Checks don't depend on the work-groups that have run
+  return data.empty();
+}
+
+uint32_t MemCheck::getCallbacks() const
+{
+  return CALLBACK_BIT(CallbackInstructionExecuted) |
+         CALLBACK_BIT(CallbackKernelBegin) |
+         CALLBACK_BIT(CallbackMemoryAtomicLoad) |
+         CALLBACK_BIT(CallbackMemoryAtomicStore) |
+         CALLBACK_BIT(CallbackMemoryLoad) |
+         CALLBACK_BIT(CallbackMemoryMap) |
+         CALLBACK_BIT(CallbackMemoryStore) |
+         CALLBACK_BIT(CallbackMemoryUnmap);
+}
 
 void MemCheck::instructionExecuted(const WorkItem* workItem,
                                    const llvm::Instruction* instruction,
                                    const TypedValue& result)
 {
   // Check static array bounds if load or store is executed
-  const llvm::Value* PtrOp = nullptr;
-
-  if (auto LI = llvm::dyn_cast<llvm::LoadInst>(instruction))
-  {
-    PtrOp = LI->getPointerOperand();
-  }
-  else if (auto SI = llvm::dyn_cast<llvm::StoreInst>(instruction))
-  {
-    PtrOp = SI->getPointerOperand();
-  }
-  else
+  auto itr = m_arrayChecks->find(instruction);
+  if (itr == m_arrayChecks->end())
   {
     return;
   }
 
-  // Walk up chain of GEP instructions leading to this access
-  while (auto GEPI =
-           llvm::dyn_cast<llvm::GetElementPtrInst>(PtrOp->stripPointerCasts()))
+  for (const ArrayCheck& check : itr->second)
   {
-    checkArrayAccess(workItem, GEPI);
+    int64_t index = workItem->getOperand(check.index).getSInt();
 
-    PtrOp = GEPI->getPointerOperand();
+    // Check index doesn't exceed size of array
+    if ((uint64_t)index >= check.size)
+    {
+      ostringstream info;
+      info << "Index (" << index << ") exceeds static array size ("
+           << check.size << ")";
+      m_context->logError(info.str().c_str());
+    }
   }
 }
 
+void MemCheck::kernelBegin(const KernelInvocation* kernelInvocation)
+{
+  const Kernel* kernel = kernelInvocation->getKernel();
+  const InterpreterCache* cache =
+    kernel->getProgram()->getInterpreterCache(kernel->getFunction());
+
+  // Rebuild if the function belongs to a different program
+  KernelChecks& kernelChecks = m_kernelChecks[kernel->getFunction()];
+  if (kernelChecks.cache != cache)
+  {
+    kernelChecks.cache = cache;
+    kernelChecks.checks.clear();
+    buildArrayChecks(kernel->getFunction(), kernelChecks.checks);
+  }
+  m_arrayChecks = &kernelChecks.checks;
+}
+
 void MemCheck::memoryAtomicLoad(const Memory* memory, const WorkItem* workItem,
                                 AtomicOp op, size_t address, size_t size)
 {
@@ -112,42 +151,118 @@ void MemCheck::memoryUnmap(const Memory* memory, size_t address,
   }
 }
 
-void MemCheck::checkArrayAccess(const WorkItem* workItem,
-                                const llvm::GetElementPtrInst* GEPI) const
+bool MemCheck::mergeResults(const string& data)
 {
-  // Iterate through GEPI indices
-  const llvm::Type* ptrType = GEPI->getPointerOperandType();
+  // Invalid accesses are reported as they happen
+  return data.empty();
+}
 
-  for (auto opIndex = GEPI->idx_begin(); opIndex != GEPI->idx_end(); opIndex++)
+bool MemCheck::needsInstructionCallbacks() const
+{
+  // Instructions are only checked against static array bounds
+  return !m_arrayChecks || !m_arrayChecks->empty();
+}
+
+bool MemCheck::saveResults(string& data) const
+{
+  return true;
+}
+
+bool MemCheck::serialize(string& data) const
+{
+  return true;
+}
+
+void MemCheck::addArrayChecks(const llvm::Value* pointer,
+                              vector<ArrayCheck>& checks) const
+{
+  // Walk up chain of GEP instructions leading to this access
+  while (auto GEPI = llvm::dyn_cast<llvm::GetElementPtrInst>(
+           pointer->stripPointerCasts()))
   {
-    int64_t index = workItem->getOperand(opIndex->get()).getSInt();
+    // Iterate through GEPI indices
+    const llvm::Type* ptrType = GEPI->getPointerOperandType();
 
-    if (ptrType->isArrayTy())
+    for (auto opIndex = GEPI->idx_begin(); opIndex != GEPI->idx_end();
+         opIndex++)
     {
-      // Check index doesn't exceed size of array
-      uint64_t size = ptrType->getArrayNumElements();
+      const llvm::ConstantInt* constant =
+        llvm::dyn_cast<llvm::ConstantInt>(opIndex->get());
 
-      if ((uint64_t)index >= size)
+      if (ptrType->isArrayTy())
       {
-        ostringstream info;
-        info << "Index (" << index << ") exceeds static array size (" << size
-             << ")";
-        m_context->logError(info.str().c_str());
+        // Constant indices within the array never need checking
+        uint64_t size = ptrType->getArrayNumElements();
+        if (!constant || constant->getZExtValue() >= size)
+        {
+          ArrayCheck check = {opIndex->get(), size};
+          checks.push_back(check);
+        }
+
+        ptrType = ptrType->getArrayElementType();
+      }
+      else if (ptrType->isPointerTy())
+      {
+        ptrType = ptrType->getPointerElementType();
+      }
+      else if (ptrType->isVectorTy())
+      {
+        ptrType = llvm::cast<llvm::FixedVectorType>(ptrType)->getElementType();
+      }
+      else if (ptrType->isStructTy())
+      {
+        // Struct indices are constant, but may be vectors (splats) that
+        // leave the member type unknown, so stop checking this GEP there
+        if (!constant)
+          break;
+        ptrType = ptrType->getStructElementType(constant->getZExtValue());
       }
-
-      ptrType = ptrType->getArrayElementType();
-    }
-    else if (ptrType->isPointerTy())
-    {
-      ptrType = ptrType->getPointerElementType();
     }
-    else if (ptrType->isVectorTy())
+
+    pointer = GEPI->getPointerOperand();
+  }
+}
+
+void MemCheck::buildArrayChecks(const llvm::Function* kernel,
+                                ArrayCheckMap& checks)
+{
+  // Visit the kernel and every function it calls
+  set<const llvm::Function*> visited;
+  list<const llvm::Function*> pending(1, kernel);
+  while (!pending.empty())
+  {
+    const llvm::Function* function = pending.front();
+    pending.pop_front();
+    if (!visited.insert(function).second)
     {
-      ptrType = llvm::cast<llvm::FixedVectorType>(ptrType)->getElementType();
+      continue;
     }
-    else if (ptrType->isStructTy())
+
+    for (auto I = llvm::inst_begin(function); I != llvm::inst_end(function);
+         I++)
     {
-      ptrType = ptrType->getStructElementType(index);
+      vector<ArrayCheck> instChecks;
+      if (auto LI = llvm::dyn_cast<llvm::LoadInst>(&*I))
+      {
+        addArrayChecks(LI->getPointerOperand(), instChecks);
+      }
+      else if (auto SI = llvm::dyn_cast<llvm::StoreInst>(&*I))
+      {
+        addArrayChecks(SI->getPointerOperand(), instChecks);
+      }
+      else if (auto CI = llvm::dyn_cast<llvm::CallInst>(&*I))
+      {
+        const llvm::Function* callee = CI->getCalledFunction();
+        if (callee && !callee->isDeclaration())
+        {
+          pending.push_back(callee);
+        }
+      }
+
+      if (!instChecks.empty())
+      {
+        checks[&*I] = instChecks;
+      }
     }
   }
 }
@@ -216,6 +331,9 @@ void MemCheck::checkStore(const Memory* memory, size_t address,
 void MemCheck::logInvalidAccess(bool read, unsigned addrSpace, size_t address,
                                 size_t size) const
 {
+  if (m_context->isDuplicateError(read ? "invalid read" : "invalid write"))
+    return;
+
   Context::Message msg(ERROR, m_context);
   msg << "Invalid " << (read ? "read" : "write") << " of size " << size
       << " at " << getAddressSpaceName(addrSpace) << " memory address 0x" << hex
@@ -10,19 +10,24 @@
 
 namespace llvm
 {
-class GetElementPtrInst;
+class Function;
 }
 
 namespace oclgrind
 {
+class InterpreterCache;
+
 class MemCheck : public Plugin
 {
 public:
   MemCheck(const Context* context);
 
+  virtual bool deserialize(const std::string& data) override;
+  virtual uint32_t getCallbacks() const override;
   virtual void instructionExecuted(const WorkItem* workItem,
                                    const llvm::Instruction* instruction,
                                    const TypedValue& result) override;
+  virtual void kernelBegin(const KernelInvocation* kernelInvocation) override;
   virtual void memoryAtomicLoad(const Memory* memory, const WorkItem* workItem,
                                 AtomicOp op, size_t address,
                                 size_t size) override;
@@ -43,10 +48,33 @@ public:
                            const uint8_t* storeData) override;
   virtual void memoryUnmap(const Memory* memory, size_t address,
                            const void* ptr) override;
+  virtual bool mergeResults(const std::string& data) override;
+  virtual bool needsInstructionCallbacks() const override;
+  virtual bool saveResults(std::string& data) const override;
+  virtual bool serialize(std::string& data) const override;
 
 private:
-  void checkArrayAccess(const WorkItem* workItem,
-                        const llvm::GetElementPtrInst* GEPI) const;
+  // Static array index used to form the address of a load or store
+  struct ArrayCheck
+  {
+    const llvm::Value* index;
+    uint64_t size;
+  };
+  typedef std::unordered_map<const llvm::Instruction*, std::vector<ArrayCheck>>
+    ArrayCheckMap;
+
+  // Array checks for each kernel, built when first launched
+  struct KernelChecks
+  {
+    const InterpreterCache* cache;
+    ArrayCheckMap checks;
+  };
+  std::unordered_map<const llvm::Function*, KernelChecks> m_kernelChecks;
+  const ArrayCheckMap* m_arrayChecks;
+
+  void addArrayChecks(const llvm::Value* pointer,
+                      std::vector<ArrayCheck>& checks) const;
+  void buildArrayChecks(const llvm::Function* kernel, ArrayCheckMap& checks);
   void checkLoad(const Memory* memory, size_t address, size_t size) const;
   void checkStore(const Memory* memory, size_t address, size_t size) const;
   void logInvalidAccess(bool read, unsigned addrSpace, size_t address,
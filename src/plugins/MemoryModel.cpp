@@ -0,0 +1,502 @@
+// MemoryModel.cpp (Oclgrind)
+// Copyright (c) 2013-2019, James Price and Simon McIntosh-Smith,
+// University of Bristol. All rights reserved.
+//
+// This program is provided under a three-clause BSD license. For full
+// license terms please see the LICENSE file distributed with this
+// source code.
+
+#include "core/common.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <set>
+#include <sstream>
+
+#include "llvm/IR/DebugInfoMetadata.h"
+#include "llvm/IR/Instruction.h"
+
+#include "MemoryModel.h"
+
+#include "core/Kernel.h"
+#include "core/KernelInvocation.h"
+#include "core/Memory.h"
+#include "core/WorkGroup.h"
+#include "core/WorkItem.h"
+
+using namespace oclgrind;
+using namespace std;
+
+THREAD_LOCAL MemoryModel::WorkerState MemoryModel::m_state = {NULL};
+
+MemoryModel::MemoryModel(const Context* context) : Plugin(context)
+{
+  m_warpSize = 32;
+  m_segmentSize = 128;
+  m_numBanks = 32;
+  m_bankWidth = 4;
+  m_l1Config = {0, 128, 4};
+  m_l2Config = {0, 128, 16};
+
+  const char* config = getenv("OCLGRIND_MEMORY_MODEL");
+  if (config && strcmp(config, "1"))
+    parseConfig(config);
+}
+
+void MemoryModel::Cache::init(const CacheConfig& config)
+{
+  this->config = config;
+  numSets = config.size / (config.lineSize * config.ways);
+  tags.assign(numSets * config.ways, UINT64_MAX);
+  lastUse.assign(numSets * config.ways, 0);
+  clock = 0;
+}
+
+bool MemoryModel::Cache::access(uint64_t line)
+{
+  // Hit if a way of the line's set holds it, otherwise replace the least
+  // recently used way
+  size_t set = (line % numSets) * config.ways;
+  size_t victim = set;
+  for (size_t way = set; way < set + config.ways; way++)
+  {
+    if (tags[way] == line)
+    {
+      lastUse[way] = ++clock;
+      return true;
+    }
+    if (lastUse[way] < lastUse[victim])
+      victim = way;
+  }
+  tags[victim] = line;
+  lastUse[victim] = ++clock;
+  return false;
+}
+
+void MemoryModel::Stats::add(const Stats& other)
+{
+  requests += other.requests;
+  transactions += other.transactions;
+  bytes += other.bytes;
+  localRequests += other.localRequests;
+  localWavefronts += other.localWavefronts;
+  l1Hits += other.l1Hits;
+  l1Misses += other.l1Misses;
+  l2Hits += other.l2Hits;
+  l2Misses += other.l2Misses;
+}
+
+bool MemoryModel::RequestKey::operator<(const RequestKey& other) const
+{
+  if (instruction != other.instruction)
+    return instruction < other.instruction;
+  if (warp != other.warp)
+    return warp < other.warp;
+  return occurrence < other.occurrence;
+}
+
+void MemoryModel::addAccess(const Memory* memory, const WorkItem* workItem,
+                            size_t address, size_t size)
+{
+  unsigned addrSpace = memory->getAddressSpace();
+  if (addrSpace == AddrSpacePrivate || addrSpace > AddrSpaceLocal)
+    return;
+
+  const WorkGroup* workGroup = workItem->getWorkGroup();
+  WorkGroupState& state = getState(workGroup);
+  Size3 groupSize = workGroup->getGroupSize();
+  Size3 localID = workItem->getLocalID();
+  size_t localIndex =
+    localID.x + (localID.y + localID.z * groupSize.y) * groupSize.x;
+
+  // The n-th access of each work-item in a warp with an instruction belong
+  // to the same request
+  const llvm::Instruction* instruction = workItem->getCurrentInstruction();
+  RequestKey key = {instruction, localIndex / m_warpSize,
+                    state.occurrences[localIndex][instruction]++};
+  auto itr = state.requests.find(key);
+  if (itr == state.requests.end())
+  {
+    Request request = {state.sequence++, addrSpace, {}};
+    itr = state.requests.insert(make_pair(key, move(request))).first;
+  }
+  itr->second.accesses.push_back(make_pair(address, size));
+}
+
+void MemoryModel::flushRequests(WorkGroupState& state)
+{
+  // Serve requests in the order the warps would issue them
+  vector<pair<const RequestKey*, const Request*>> requests;
+  for (auto& request : state.requests)
+    requests.push_back(make_pair(&request.first, &request.second));
+  sort(requests.begin(), requests.end(),
+       [](const pair<const RequestKey*, const Request*>& a,
+          const pair<const RequestKey*, const Request*>& b) {
+         return a.second->sequence < b.second->sequence;
+       });
+
+  vector<pair<const llvm::Instruction*, uint64_t>> l2Accesses;
+  for (auto& entry : requests)
+  {
+    const Request& request = *entry.second;
+    Stats& stats = state.stats[entry.first->instruction];
+
+    if (request.addrSpace == AddrSpaceLocal)
+    {
+      // Each bank serves one word at a time, broadcasting it to every
+      // work-item that reads it
+      map<size_t, set<size_t>> banks;
+      for (auto& access : request.accesses)
+      {
+        for (size_t word = access.first / m_bankWidth;
+             word <= (access.first + access.second - 1) / m_bankWidth; word++)
+        {
+          banks[word % m_numBanks].insert(word);
+        }
+      }
+      size_t degree = 1;
+      for (auto& bank : banks)
+        degree = max(degree, bank.second.size());
+      stats.localRequests++;
+      stats.localWavefronts += degree;
+      continue;
+    }
+
+    // Global and constant requests need a transaction per segment touched
+    set<size_t> segments, lines;
+    for (auto& access : request.accesses)
+    {
+      size_t end = access.first + access.second - 1;
+      for (size_t s = access.first / m_segmentSize; s <= end / m_segmentSize;
+           s++)
+      {
+        segments.insert(s);
+      }
+      if (m_l1Config.size)
+      {
+        for (size_t l = access.first / m_l1Config.lineSize;
+             l <= end / m_l1Config.lineSize; l++)
+        {
+          lines.insert(l);
+        }
+      }
+      stats.bytes += access.second;
+    }
+    stats.requests++;
+    stats.transactions += segments.size();
+
+    // Lines that miss the L1 (or every segment, without one) go to the L2
+    if (m_l1Config.size)
+    {
+      for (size_t line : lines)
+      {
+        if (state.l1.access(line))
+        {
+          stats.l1Hits++;
+        }
+        else
+        {
+          stats.l1Misses++;
+          l2Accesses.push_back(make_pair(entry.first->instruction,
+                                         line * m_l1Config.lineSize));
+        }
+      }
+    }
+    else
+    {
+      for (size_t segment : segments)
+      {
+        l2Accesses.push_back(
+          make_pair(entry.first->instruction, segment * m_segmentSize));
+      }
+    }
+  }
+  state.requests.clear();
+  for (auto& occurrences : state.occurrences)
+    occurrences.clear();
+
+  // The L2 is shared by every work-group
+  if (m_l2Config.size && !l2Accesses.empty())
+  {
+    lock_guard<mutex> lock(m_lock);
+    for (auto& access : l2Accesses)
+    {
+      Stats& stats = state.stats[access.first];
+      if (m_l2.access(access.second / m_l2Config.lineSize))
+        stats.l2Hits++;
+      else
+        stats.l2Misses++;
+    }
+  }
+}
+
+uint32_t MemoryModel::getCallbacks() const
+{
+  return CALLBACK_BIT(CallbackKernelBegin) | CALLBACK_BIT(CallbackKernelEnd) |
+         CALLBACK_BIT(CallbackMemoryAtomicLoad) |
+         CALLBACK_BIT(CallbackMemoryLoad) | CALLBACK_BIT(CallbackMemoryStore) |
+         CALLBACK_BIT(CallbackWorkGroupBarrier) |
+         CALLBACK_BIT(CallbackWorkGroupComplete);
+}
+
+MemoryModel::WorkGroupState& MemoryModel::getState(const WorkGroup* workGroup)
+{
+  if (!m_state.groups)
+  {
+    m_state.groups = new unordered_map<const WorkGroup*, WorkGroupState>;
+  }
+
+  auto itr = m_state.groups->find(workGroup);
+  if (itr == m_state.groups->end())
+  {
+    Size3 groupSize = workGroup->getGroupSize();
+    WorkGroupState& state = (*m_state.groups)[workGroup];
+    state.occurrences.resize(groupSize.x * groupSize.y * groupSize.z);
+    state.sequence = 0;
+    if (m_l1Config.size)
+      state.l1.init(m_l1Config);
+    return state;
+  }
+  return itr->second;
+}
+
+uint32_t MemoryModel::getUnsampledCallbacks() const
+{
+  return CALLBACK_BIT(CallbackKernelBegin) | CALLBACK_BIT(CallbackKernelEnd);
+}
+
+void MemoryModel::kernelBegin(const KernelInvocation* kernelInvocation)
+{
+  m_stats.clear();
+  if (m_l2Config.size)
+    m_l2.init(m_l2Config);
+}
+
+void MemoryModel::kernelEnd(const KernelInvocation* kernelInvocation)
+{
+  // Combine the instructions of each source line, listing those without
+  // debug information by themselves
+  map<pair<unsigned, string>, Stats> locations;
+  for (auto& entry : m_stats)
+  {
+    pair<unsigned, string> location(0, "");
+    const llvm::DILocation* loc = entry.first->getDebugLoc().get();
+    if (loc && loc->getLine())
+    {
+      location.first = loc->getLine();
+    }
+    else
+    {
+      ostringstream text;
+      dumpInstruction(text, entry.first);
+      location.second = text.str();
+      location.second.erase(0, location.second.find_first_not_of(' '));
+    }
+
+    auto itr = locations.find(location);
+    if (itr == locations.end())
+      locations[location] = entry.second;
+    else
+      itr->second.add(entry.second);
+  }
+
+  auto printLocation = [](const pair<unsigned, string>& location) {
+    if (location.first)
+      cout << "line " << location.first << endl;
+    else
+      cout << location.second << endl;
+  };
+
+  ios_base::fmtflags flags = cout.flags();
+  streamsize precision = cout.precision();
+  cout << fixed << setprecision(2);
+
+  cout << "Memory model for kernel '"
+       << kernelInvocation->getKernel()->getName() << "':" << endl;
+
+  cout << "Global and constant memory (warps of " << m_warpSize << ", "
+       << m_segmentSize << "-byte segments):" << endl;
+  cout << setw(16) << "requests" << setw(16) << "transactions" << setw(16)
+       << "efficiency" << " - location" << endl;
+  for (auto& location : locations)
+  {
+    const Stats& stats = location.second;
+    if (!stats.requests)
+      continue;
+    cout << setw(16) << stats.requests << setw(16) << stats.transactions
+         << setw(15) << 100.0 * stats.bytes /
+                          (stats.transactions * m_segmentSize)
+         << "% - ";
+    printLocation(location.first);
+  }
+
+  cout << "Local memory (" << m_numBanks << " banks of " << m_bankWidth
+       << " bytes):" << endl;
+  cout << setw(16) << "requests" << setw(16) << "wavefronts" << setw(16)
+       << "conflict degree" << " - location" << endl;
+  for (auto& location : locations)
+  {
+    const Stats& stats = location.second;
+    if (!stats.localRequests)
+      continue;
+    cout << setw(16) << stats.localRequests << setw(16)
+         << stats.localWavefronts << setw(16)
+         << (double)stats.localWavefronts / stats.localRequests << " - ";
+    printLocation(location.first);
+  }
+
+  for (unsigned level = 1; level <= 2; level++)
+  {
+    const CacheConfig& config = level == 1 ? m_l1Config : m_l2Config;
+    if (!config.size)
+      continue;
+
+    cout << "L" << level << " cache (" << config.size << " bytes, "
+         << config.lineSize << "-byte lines, " << config.ways
+         << "-way):" << endl;
+    cout << setw(16) << "hits" << setw(16) << "misses" << setw(16)
+         << "hit rate" << " - location" << endl;
+    for (auto& location : locations)
+    {
+      const Stats& stats = location.second;
+      uint64_t hits = level == 1 ? stats.l1Hits : stats.l2Hits;
+      uint64_t misses = level == 1 ? stats.l1Misses : stats.l2Misses;
+      if (!hits && !misses)
+        continue;
+      cout << setw(16) << hits << setw(16) << misses << setw(15)
+           << 100.0 * hits / (hits + misses) << "% - ";
+      printLocation(location.first);
+    }
+  }
+  cout << endl;
+
+  cout.flags(flags);
+  cout.precision(precision);
+}
+
+void MemoryModel::memoryAtomicLoad(const Memory* memory,
+                                   const WorkItem* workItem, AtomicOp op,
+                                   size_t address, size_t size)
+{
+  // The store of an atomic is part of the same access
+  addAccess(memory, workItem, address, size);
+}
+
+void MemoryModel::memoryLoad(const Memory* memory, const WorkItem* workItem,
+                             size_t address, size_t size)
+{
+  addAccess(memory, workItem, address, size);
+}
+
+void MemoryModel::memoryStore(const Memory* memory, const WorkItem* workItem,
+                              size_t address, size_t size,
+                              const uint8_t* storeData)
+{
+  addAccess(memory, workItem, address, size);
+}
+
+void MemoryModel::parseConfig(const char* config)
+{
+  // Options are given as a comma-separated list of NAME=VALUE, with caches
+  // given as SIZE[:LINE[:WAYS]] in bytes
+  istringstream list(config);
+  string entry;
+  while (getline(list, entry, ','))
+  {
+    size_t equals = entry.find('=');
+    string name = entry.substr(0, equals);
+    vector<size_t> values;
+    bool valid = equals != string::npos;
+    if (valid)
+    {
+      istringstream fields(entry.substr(equals + 1));
+      string field;
+      while (getline(fields, field, ':'))
+      {
+        char* end = NULL;
+        unsigned long long value = strtoull(field.c_str(), &end, 10);
+        if (field.empty() || *end || field[0] == '-')
+          valid = false;
+        values.push_back(value);
+      }
+    }
+    bool cache = name == "l1" || name == "l2";
+    if (!valid || values.empty() || values.size() > (cache ? 3 : 1) ||
+        (!cache && !values[0]) || (values.size() > 1 && !values[1]) ||
+        (values.size() > 2 && !values[2]))
+    {
+      cerr << endl
+           << "Oclgrind: Invalid value for '" << name
+           << "' in OCLGRIND_MEMORY_MODEL" << endl;
+      abort();
+    }
+
+    if (name == "bank-width")
+      m_bankWidth = values[0];
+    else if (name == "banks")
+      m_numBanks = values[0];
+    else if (name == "segment")
+      m_segmentSize = values[0];
+    else if (name == "warp")
+      m_warpSize = values[0];
+    else if (cache)
+    {
+      CacheConfig& cacheConfig = name == "l1" ? m_l1Config : m_l2Config;
+      cacheConfig.size = values[0];
+      if (values.size() > 1)
+        cacheConfig.lineSize = values[1];
+      if (values.size() > 2)
+        cacheConfig.ways = values[2];
+      if (cacheConfig.size &&
+          cacheConfig.size % (cacheConfig.lineSize * cacheConfig.ways))
+      {
+        cerr << endl
+             << "Oclgrind: Size of " << name
+             << " cache must be a multiple of its line size and ways in "
+                "OCLGRIND_MEMORY_MODEL"
+             << endl;
+        abort();
+      }
+    }
+    else
+    {
+      cerr << endl
+           << "Oclgrind: Unknown option '" << name
+           << "' in OCLGRIND_MEMORY_MODEL" << endl;
+      abort();
+    }
+  }
+}
+
+void MemoryModel::workGroupBarrier(const WorkGroup* workGroup, uint32_t flags)
+{
+  // Every work-item has made its accesses before the barrier
+  flushRequests(getState(workGroup));
+}
+
+void MemoryModel::workGroupComplete(const WorkGroup* workGroup)
+{
+  if (!m_state.groups || !m_state.groups->count(workGroup))
+    return;
+
+  WorkGroupState& state = m_state.groups->at(workGroup);
+  flushRequests(state);
+  {
+    lock_guard<mutex> lock(m_lock);
+    for (auto& stats : state.stats)
+    {
+      auto itr = m_stats.find(stats.first);
+      if (itr == m_stats.end())
+        m_stats[stats.first] = stats.second;
+      else
+        itr->second.add(stats.second);
+    }
+  }
+
+  m_state.groups->erase(workGroup);
+  if (m_state.groups->empty())
+  {
+    delete m_state.groups;
+    m_state.groups = NULL;
+  }
+}
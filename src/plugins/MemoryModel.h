@@ -0,0 +1,125 @@
+// MemoryModel.h (Oclgrind)
+// Copyright (c) 2013-2019, James Price and Simon McIntosh-Smith,
+// University of Bristol. All rights reserved.
+//
+// This program is provided under a three-clause BSD license. For full
+// license terms please see the LICENSE file distributed with this
+// source code.
+
+#include "core/Plugin.h"
+
+#include <map>
+#include <mutex>
+
+namespace oclgrind
+{
+// Models how a GPU's memory hierarchy would serve a kernel's accesses, by
+// grouping the accesses that each warp of work-items makes with the same
+// instruction into requests, and reporting per source line the transactions
+// needed for global requests, the bank conflicts of local requests, and the
+// hit rates of optional L1 (per work-group) and L2 caches
+class MemoryModel : public Plugin
+{
+public:
+  MemoryModel(const Context* context);
+
+  virtual uint32_t getCallbacks() const override;
+  virtual uint32_t getUnsampledCallbacks() const override;
+  virtual void kernelBegin(const KernelInvocation* kernelInvocation) override;
+  virtual void kernelEnd(const KernelInvocation* kernelInvocation) override;
+  virtual void memoryAtomicLoad(const Memory* memory, const WorkItem* workItem,
+                                AtomicOp op, size_t address,
+                                size_t size) override;
+  virtual void memoryLoad(const Memory* memory, const WorkItem* workItem,
+                          size_t address, size_t size) override;
+  virtual void memoryStore(const Memory* memory, const WorkItem* workItem,
+                           size_t address, size_t size,
+                           const uint8_t* storeData) override;
+  virtual void workGroupBarrier(const WorkGroup* workGroup,
+                                uint32_t flags) override;
+  virtual void workGroupComplete(const WorkGroup* workGroup) override;
+
+private:
+  struct CacheConfig
+  {
+    size_t size; // 0 if disabled
+    size_t lineSize;
+    size_t ways;
+  };
+
+  // Set-associative cache with LRU replacement
+  struct Cache
+  {
+    CacheConfig config;
+    size_t numSets;
+    std::vector<uint64_t> tags;
+    std::vector<uint64_t> lastUse;
+    uint64_t clock;
+
+    void init(const CacheConfig& config);
+    bool access(uint64_t line);
+  };
+
+  struct Stats
+  {
+    uint64_t requests;
+    uint64_t transactions;
+    uint64_t bytes;
+    uint64_t localRequests;
+    uint64_t localWavefronts; // Sum of the conflict degrees of requests
+    uint64_t l1Hits, l1Misses;
+    uint64_t l2Hits, l2Misses;
+
+    void add(const Stats& other);
+  };
+
+  // Accesses of a warp made by the same dynamic instance of an instruction
+  struct Request
+  {
+    uint64_t sequence;
+    unsigned addrSpace;
+    std::vector<std::pair<size_t, size_t>> accesses;
+  };
+  struct RequestKey
+  {
+    const llvm::Instruction* instruction;
+    size_t warp;
+    unsigned occurrence;
+    bool operator<(const RequestKey& other) const;
+  };
+
+  struct WorkGroupState
+  {
+    // Times each work-item (by local index) has run each instruction since
+    // the last barrier, identifying its requests
+    std::vector<std::unordered_map<const llvm::Instruction*, unsigned>>
+      occurrences;
+    std::map<RequestKey, Request> requests;
+    uint64_t sequence;
+    Cache l1;
+    std::unordered_map<const llvm::Instruction*, Stats> stats;
+  };
+  struct WorkerState
+  {
+    std::unordered_map<const WorkGroup*, WorkGroupState>* groups;
+  };
+  static THREAD_LOCAL WorkerState m_state;
+
+  size_t m_warpSize;
+  size_t m_segmentSize;
+  size_t m_numBanks;
+  size_t m_bankWidth;
+  CacheConfig m_l1Config;
+  CacheConfig m_l2Config;
+
+  std::mutex m_lock;
+  Cache m_l2;
+  std::unordered_map<const llvm::Instruction*, Stats> m_stats;
+
+  void addAccess(const Memory* memory, const WorkItem* workItem,
+                 size_t address, size_t size);
+  void flushRequests(WorkGroupState& state);
+  WorkGroupState& getState(const WorkGroup* workGroup);
+  void parseConfig(const char* config);
+};
+} // namespace oclgrind
@@ -0,0 +1,357 @@
+// MemoryTrace.cpp (Oclgrind)
+// Copyright (c) 2013-2019, James Price and Simon McIntosh-Smith,
+// University of Bristol. All rights reserved.
+//
+// This program is provided under a three-clause BSD license. For full
+// license terms please see the LICENSE file distributed with this
+// source code.
+
+#include "core/common.h"
+
+#include <algorithm>
+#include <list>
+#include <set>
+#include <sstream>
+
+#include "llvm/IR/DebugInfoMetadata.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/Instructions.h"
+
+#include "MemoryTrace.h"
+
+#include "core/Kernel.h"
+#include "core/KernelInvocation.h"
+#include "core/Memory.h"
+#include "core/WorkGroup.h"
+#include "core/WorkItem.h"
+
+using namespace oclgrind;
+using namespace std;
+
+// Size at which a worker's buffer is handed to the writer
+#define BUFFER_SIZE (1 << 20)
+// Number of buffers waiting to be written before workers wait for them
+#define MAX_PENDING_BUFFERS 16
+
+THREAD_LOCAL MemoryTrace::WorkerState MemoryTrace::m_state = {0, NULL};
+atomic<unsigned long> MemoryTrace::m_numKernels(0);
+
+static void writeLE32(ostream& out, uint32_t value)
+{
+  char bytes[4] = {(char)value, (char)(value >> 8), (char)(value >> 16),
+                   (char)(value >> 24)};
+  out.write(bytes, sizeof(bytes));
+}
+
+MemoryTrace::MemoryTrace(const Context* context, const char* filename)
+  : Plugin(context), m_kernel(0), m_timestep(0),
+    m_file(filename, ios::binary), m_filename(filename), m_finished(false)
+{
+  m_file.write(TRACE_MAGIC, sizeof(TRACE_MAGIC));
+  writeLE32(m_file, TRACE_VERSION);
+
+  m_writer = thread(&MemoryTrace::writeChunks, this);
+}
+
+MemoryTrace::~MemoryTrace()
+{
+  {
+    lock_guard<mutex> lock(m_lock);
+    for (Buffer* buffer : m_active)
+    {
+      if (buffer->count)
+        m_pending.push_back(buffer);
+      else
+        delete buffer;
+    }
+    m_active.clear();
+    m_finished = true;
+  }
+  m_pendingReady.notify_one();
+  m_writer.join();
+
+  for (Buffer* buffer : m_free)
+    delete buffer;
+
+  m_file.flush();
+  if (!m_file)
+    cerr << "Oclgrind: Failed to write memory trace to " << m_filename
+         << endl;
+}
+
+MemoryTrace::Buffer* MemoryTrace::allocBuffer(uint8_t type)
+{
+  Buffer* buffer;
+  if (m_free.empty())
+  {
+    buffer = new Buffer;
+    buffer->data.reserve(BUFFER_SIZE + 64);
+  }
+  else
+  {
+    buffer = m_free.back();
+    m_free.pop_back();
+  }
+
+  // Start from the state the reader assumes for each chunk
+  buffer->type = type;
+  buffer->data.clear();
+  buffer->count = 0;
+  buffer->addresses.assign(m_instructions.size() + 1, 0);
+  buffer->timestep = 0;
+  buffer->workGroup = 0;
+  buffer->workItem = UINT64_MAX;
+  buffer->instruction = UINT64_MAX;
+  buffer->size = 0;
+  return buffer;
+}
+
+uint32_t MemoryTrace::getCallbacks() const
+{
+  return CALLBACK_BIT(CallbackKernelBegin) | CALLBACK_BIT(CallbackKernelEnd) |
+         CALLBACK_BIT(CallbackMemoryAtomicLoad) |
+         CALLBACK_BIT(CallbackMemoryAtomicStore) |
+         CALLBACK_BIT(CallbackMemoryLoad) | CALLBACK_BIT(CallbackMemoryStore);
+}
+
+void MemoryTrace::kernelBegin(const KernelInvocation* kernelInvocation)
+{
+  m_kernel = ++m_numKernels;
+  m_timestep = 0;
+
+  // Number the instructions that access memory in the kernel and its callees
+  m_instructions.clear();
+  vector<const llvm::Instruction*> instructions;
+  set<const llvm::Function*> visited;
+  list<const llvm::Function*> pending(
+    1, kernelInvocation->getKernel()->getFunction());
+  while (!pending.empty())
+  {
+    const llvm::Function* function = pending.front();
+    pending.pop_front();
+    if (!visited.insert(function).second)
+    {
+      continue;
+    }
+
+    for (auto I = llvm::inst_begin(function); I != llvm::inst_end(function);
+         I++)
+    {
+      if (!I->mayReadOrWriteMemory())
+        continue;
+
+      m_instructions[&*I] = instructions.size();
+      instructions.push_back(&*I);
+
+      auto call = llvm::dyn_cast<llvm::CallInst>(&*I);
+      if (call && call->getCalledFunction() &&
+          !call->getCalledFunction()->isDeclaration())
+      {
+        pending.push_back(call->getCalledFunction());
+      }
+    }
+  }
+
+  // Start the kernel in the trace
+  unique_lock<mutex> lock(m_lock);
+  Buffer* buffer = allocBuffer(TraceChunkKernel);
+  lock.unlock();
+
+  string& data = buffer->data;
+  const string& name = kernelInvocation->getKernel()->getName();
+  writeTraceVarint(data, name.size());
+  data += name;
+  Size3 globalSize = kernelInvocation->getGlobalSize();
+  Size3 localSize = kernelInvocation->getLocalSize();
+  for (unsigned i = 0; i < 3; i++)
+    writeTraceVarint(data, globalSize[i]);
+  for (unsigned i = 0; i < 3; i++)
+    writeTraceVarint(data, localSize[i]);
+
+  writeTraceVarint(data, instructions.size());
+  for (const llvm::Instruction* instruction : instructions)
+  {
+    ostringstream text;
+    dumpInstruction(text, instruction);
+    string str = text.str();
+    str.erase(0, str.find_first_not_of(' '));
+    writeTraceVarint(data, str.size());
+    data += str;
+
+    const llvm::DILocation* loc = instruction->getDebugLoc().get();
+    writeTraceVarint(data, loc ? loc->getLine() : 0);
+  }
+
+  lock.lock();
+  submitBuffer(buffer);
+}
+
+void MemoryTrace::kernelEnd(const KernelInvocation* kernelInvocation)
+{
+  // Write out what the workers have left, and wait for the trace to be
+  // complete so that it can be read while the program continues
+  unique_lock<mutex> lock(m_lock);
+  for (Buffer* buffer : m_active)
+  {
+    if (buffer->count)
+      submitBuffer(buffer);
+    else
+      m_free.push_back(buffer);
+  }
+  m_active.clear();
+  m_pendingWritten.wait(lock, [this] { return m_pending.empty(); });
+  m_file.flush();
+}
+
+void MemoryTrace::memoryAtomicLoad(const Memory* memory,
+                                   const WorkItem* workItem, AtomicOp op,
+                                   size_t address, size_t size)
+{
+  record(TraceAtomicLoad, memory, workItem->getWorkGroup(), workItem,
+         address, size);
+}
+
+void MemoryTrace::memoryAtomicStore(const Memory* memory,
+                                    const WorkItem* workItem, AtomicOp op,
+                                    size_t address, size_t size)
+{
+  record(TraceAtomicStore, memory, workItem->getWorkGroup(), workItem,
+         address, size);
+}
+
+void MemoryTrace::memoryLoad(const Memory* memory, const WorkItem* workItem,
+                             size_t address, size_t size)
+{
+  record(TraceLoad, memory, workItem->getWorkGroup(), workItem, address,
+         size);
+}
+
+void MemoryTrace::memoryLoad(const Memory* memory, const WorkGroup* workGroup,
+                             size_t address, size_t size)
+{
+  record(TraceLoad, memory, workGroup, NULL, address, size);
+}
+
+void MemoryTrace::memoryStore(const Memory* memory, const WorkItem* workItem,
+                              size_t address, size_t size,
+                              const uint8_t* storeData)
+{
+  record(TraceStore, memory, workItem->getWorkGroup(), workItem, address,
+         size);
+}
+
+void MemoryTrace::memoryStore(const Memory* memory,
+                              const WorkGroup* workGroup, size_t address,
+                              size_t size, const uint8_t* storeData)
+{
+  record(TraceStore, memory, workGroup, NULL, address, size);
+}
+
+void MemoryTrace::record(TraceRecordKind kind, const Memory* memory,
+                         const WorkGroup* workGroup, const WorkItem* workItem,
+                         size_t address, size_t size)
+{
+  unsigned addrSpace = memory->getAddressSpace();
+  if (addrSpace == AddrSpacePrivate || addrSpace > AddrSpaceLocal)
+    return;
+
+  // Take a buffer the first time this thread accesses memory in the kernel
+  WorkerState& state = m_state;
+  if (state.kernel != m_kernel)
+  {
+    lock_guard<mutex> lock(m_lock);
+    state.kernel = m_kernel;
+    state.buffer = allocBuffer(TraceChunkRecords);
+    m_active.push_back(state.buffer);
+  }
+  Buffer* buffer = state.buffer;
+
+  uint64_t timestep = m_timestep.fetch_add(1, memory_order_relaxed);
+  uint64_t group = workGroup->getGroupIndex();
+  uint64_t item = workItem ? workItem->getGlobalIndex() : UINT64_MAX;
+  uint64_t instruction = UINT64_MAX;
+  if (workItem)
+  {
+    auto itr = m_instructions.find(workItem->getCurrentInstruction());
+    if (itr != m_instructions.end())
+      instruction = itr->second;
+  }
+
+  uint8_t flags = kind | (addrSpace << 2);
+  if (group != buffer->workGroup || item != buffer->workItem)
+    flags |= TRACE_NEW_WORKER;
+  if (size != buffer->size)
+    flags |= TRACE_NEW_SIZE;
+  if (instruction != buffer->instruction)
+    flags |= TRACE_NEW_INSTRUCTION;
+
+  string& data = buffer->data;
+  data += (char)flags;
+  uint64_t& previous = buffer->addresses[instruction + 1];
+  writeTraceSignedVarint(data, address - previous);
+  writeTraceVarint(data, timestep - buffer->timestep);
+  if (flags & TRACE_NEW_WORKER)
+  {
+    writeTraceSignedVarint(data, group - buffer->workGroup);
+    writeTraceSignedVarint(data, item - buffer->workItem);
+  }
+  if (flags & TRACE_NEW_SIZE)
+    writeTraceVarint(data, size);
+  if (flags & TRACE_NEW_INSTRUCTION)
+    writeTraceVarint(data, instruction + 1);
+
+  buffer->count++;
+  previous = address;
+  buffer->timestep = timestep;
+  buffer->workGroup = group;
+  buffer->workItem = item;
+  buffer->instruction = instruction;
+  buffer->size = size;
+
+  if (data.size() >= BUFFER_SIZE)
+  {
+    unique_lock<mutex> lock(m_lock);
+    submitBuffer(buffer);
+    m_pendingWritten.wait(
+      lock, [this] { return m_pending.size() < MAX_PENDING_BUFFERS; });
+    state.buffer = allocBuffer(TraceChunkRecords);
+    *find(m_active.begin(), m_active.end(), buffer) = state.buffer;
+  }
+}
+
+void MemoryTrace::submitBuffer(Buffer* buffer)
+{
+  m_pending.push_back(buffer);
+  m_pendingReady.notify_one();
+}
+
+void MemoryTrace::writeChunks()
+{
+  unique_lock<mutex> lock(m_lock);
+  while (true)
+  {
+    m_pendingReady.wait(lock,
+                        [this] { return !m_pending.empty() || m_finished; });
+    if (m_pending.empty())
+      break;
+
+    Buffer* buffer = m_pending.front();
+    lock.unlock();
+
+    string count;
+    if (buffer->type == TraceChunkRecords)
+      writeTraceVarint(count, buffer->count);
+    m_file.put(buffer->type);
+    writeLE32(m_file, count.size() + buffer->data.size());
+    m_file.write(count.data(), count.size());
+    m_file.write(buffer->data.data(), buffer->data.size());
+
+    // Only remove the buffer once written, so that no pending buffers means
+    // the trace is complete
+    lock.lock();
+    m_pending.pop_front();
+    m_free.push_back(buffer);
+    m_pendingWritten.notify_all();
+  }
+}
@@ -0,0 +1,101 @@
+// MemoryTrace.h (Oclgrind)
+// Copyright (c) 2013-2019, James Price and Simon McIntosh-Smith,
+// University of Bristol. All rights reserved.
+//
+// This program is provided under a three-clause BSD license. For full
+// license terms please see the LICENSE file distributed with this
+// source code.
+
+#include "core/Plugin.h"
+#include "trace/MemoryTraceFormat.h"
+
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <thread>
+
+namespace oclgrind
+{
+// Streams every load, store and atomic made by kernels outside of private
+// memory to a trace file (see trace/MemoryTraceFormat.h), encoding records
+// into a buffer per worker thread that a background thread writes out
+class MemoryTrace : public Plugin
+{
+public:
+  MemoryTrace(const Context* context, const char* filename);
+  virtual ~MemoryTrace();
+
+  virtual uint32_t getCallbacks() const override;
+  virtual void kernelBegin(const KernelInvocation* kernelInvocation) override;
+  virtual void kernelEnd(const KernelInvocation* kernelInvocation) override;
+  virtual void memoryAtomicLoad(const Memory* memory, const WorkItem* workItem,
+                                AtomicOp op, size_t address,
+                                size_t size) override;
+  virtual void memoryAtomicStore(const Memory* memory,
+                                 const WorkItem* workItem, AtomicOp op,
+                                 size_t address, size_t size) override;
+  virtual void memoryLoad(const Memory* memory, const WorkItem* workItem,
+                          size_t address, size_t size) override;
+  virtual void memoryLoad(const Memory* memory, const WorkGroup* workGroup,
+                          size_t address, size_t size) override;
+  virtual void memoryStore(const Memory* memory, const WorkItem* workItem,
+                           size_t address, size_t size,
+                           const uint8_t* storeData) override;
+  virtual void memoryStore(const Memory* memory, const WorkGroup* workGroup,
+                           size_t address, size_t size,
+                           const uint8_t* storeData) override;
+
+private:
+  // Chunk of the trace, encoded relative to its previous record
+  struct Buffer
+  {
+    uint8_t type;
+    std::string data;
+    uint64_t count;
+    // Previous address of each instruction ID + 1
+    std::vector<uint64_t> addresses;
+    uint64_t timestep;
+    uint64_t workGroup;
+    uint64_t workItem;
+    uint64_t instruction;
+    uint64_t size;
+  };
+
+  // Buffer of one worker thread for the current kernel
+  struct WorkerState
+  {
+    unsigned long kernel;
+    Buffer* buffer;
+  };
+  static THREAD_LOCAL WorkerState m_state;
+  static std::atomic<unsigned long> m_numKernels;
+  unsigned long m_kernel;
+
+  // IDs of the instructions in the current kernel and its callees
+  std::unordered_map<const llvm::Instruction*, uint64_t> m_instructions;
+  std::atomic<uint64_t> m_timestep;
+
+  std::ofstream m_file;
+  std::string m_filename;
+  std::thread m_writer;
+  bool m_finished;
+
+  // Buffers are recycled once written, and workers wait for the writer if
+  // too many are pending, so memory use doesn't grow with the kernel
+  std::mutex m_lock;
+  std::condition_variable m_pendingReady;
+  std::condition_variable m_pendingWritten;
+  std::deque<Buffer*> m_pending;
+  std::vector<Buffer*> m_free;
+  std::vector<Buffer*> m_active;
+
+  Buffer* allocBuffer(uint8_t type);
+  void record(TraceRecordKind kind, const Memory* memory,
+              const WorkGroup* workGroup, const WorkItem* workItem,
+              size_t address, size_t size);
+  // Queue a buffer for the writer, with m_lock held
+  void submitBuffer(Buffer* buffer);
+  void writeChunks();
+};
+} // namespace oclgrind
@@ -0,0 +1,574 @@
+// PerformanceLint.cpp (Oclgrind)
+// Copyright (c) 2013-2019, James Price and Simon McIntosh-Smith,
+// University of Bristol. All rights reserved.
+//
+// This program is provided under a three-clause BSD license. For full
+// license terms please see the LICENSE file distributed with this
+// source code.
+
+#include "core/common.h"
+
+#include <iomanip>
+#include <list>
+#include <set>
+#include <sstream>
+
+#include "llvm/IR/DebugInfoMetadata.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+
+#include "PerformanceLint.h"
+
+#include "core/Kernel.h"
+#include "core/KernelInvocation.h"
+#include "core/Memory.h"
+#include "core/WorkGroup.h"
+#include "core/WorkItem.h"
+
+using namespace oclgrind;
+using namespace std;
+
+THREAD_LOCAL PerformanceLint::WorkerState PerformanceLint::m_state = {NULL};
+
+namespace
+{
+// Source line of an instruction, or its text if it has no debug information
+typedef pair<unsigned, string> Location;
+
+Location getLocation(const llvm::Instruction* instruction)
+{
+  Location location(0, "");
+  const llvm::DILocation* loc = instruction->getDebugLoc().get();
+  if (loc && loc->getLine())
+  {
+    location.first = loc->getLine();
+  }
+  else
+  {
+    ostringstream text;
+    dumpInstruction(text, instruction);
+    location.second = text.str();
+    location.second.erase(0, location.second.find_first_not_of(' '));
+  }
+  return location;
+}
+
+string quote(const string& text)
+{
+  ostringstream out;
+  out << '"';
+  for (char c : text)
+  {
+    if (c == '"' || c == '\\')
+      out << '\\' << c;
+    else if ((unsigned char)c < 0x20)
+      out << "\\u" << hex << setw(4) << setfill('0') << (int)c << dec;
+    else
+      out << c;
+  }
+  out << '"';
+  return out.str();
+}
+
+// A diagnostic, as the members of its JSON object after the kernel name
+struct Diagnostic
+{
+  string check;
+  Location location;
+  string fields;
+};
+} // namespace
+
+PerformanceLint::PerformanceLint(const Context* context) : Plugin(context)
+{
+  m_subgroupSize = 32;
+  m_atomicThreshold = 32;
+  m_privateThreshold = 256;
+
+  const char* config = getenv("OCLGRIND_PERFORMANCE_LINT");
+  if (config && strcmp(config, "1"))
+    parseConfig(config);
+}
+
+bool PerformanceLint::BranchKey::operator<(const BranchKey& other) const
+{
+  if (instruction != other.instruction)
+    return instruction < other.instruction;
+  if (subgroup != other.subgroup)
+    return subgroup < other.subgroup;
+  return occurrence < other.occurrence;
+}
+
+void PerformanceLint::addTraffic(const Memory* memory, WorkGroupState& state)
+{
+  switch (memory->getAddressSpace())
+  {
+  case AddrSpaceGlobal:
+    state.globalTraffic = true;
+    break;
+  case AddrSpaceLocal:
+    state.localTraffic = true;
+    break;
+  }
+}
+
+void PerformanceLint::endBarrierInterval(WorkGroupState& state)
+{
+  // A barrier only orders accesses if there are some for a fence it has on
+  // both sides of it
+  if (state.barrier)
+  {
+    bool local = (state.barrierFlags & CLK_LOCAL_MEM_FENCE) &&
+                 state.barrierLocal && state.localTraffic;
+    bool global = (state.barrierFlags & CLK_GLOBAL_MEM_FENCE) &&
+                  state.barrierGlobal && state.globalTraffic;
+    Count& count = state.barriers[state.barrier];
+    count.total++;
+    if (!local && !global)
+      count.bad++;
+  }
+  state.localTraffic = false;
+  state.globalTraffic = false;
+  state.barrier = NULL;
+}
+
+void PerformanceLint::flushBranches(WorkGroupState& state)
+{
+  for (auto& branch : state.branches)
+  {
+    Count& count = state.divergence[branch.first.instruction];
+    count.total++;
+    if (branch.second.diverged)
+      count.bad++;
+  }
+  state.branches.clear();
+  for (auto& occurrences : state.occurrences)
+    occurrences.clear();
+}
+
+uint32_t PerformanceLint::getCallbacks() const
+{
+  return CALLBACK_BIT(CallbackInstructionExecuted) |
+         CALLBACK_BIT(CallbackKernelBegin) | CALLBACK_BIT(CallbackKernelEnd) |
+         CALLBACK_BIT(CallbackMemoryAtomicLoad) |
+         CALLBACK_BIT(CallbackMemoryLoad) | CALLBACK_BIT(CallbackMemoryStore) |
+         CALLBACK_BIT(CallbackWorkGroupBarrier) |
+         CALLBACK_BIT(CallbackWorkGroupComplete);
+}
+
+PerformanceLint::WorkGroupState&
+PerformanceLint::getState(const WorkGroup* workGroup)
+{
+  if (!m_state.groups)
+  {
+    m_state.groups = new unordered_map<const WorkGroup*, WorkGroupState>;
+  }
+
+  auto itr = m_state.groups->find(workGroup);
+  if (itr == m_state.groups->end())
+  {
+    Size3 groupSize = workGroup->getGroupSize();
+    WorkGroupState& state = (*m_state.groups)[workGroup];
+    state.occurrences.resize(groupSize.x * groupSize.y * groupSize.z);
+    state.localTraffic = false;
+    state.globalTraffic = false;
+    state.barrier = NULL;
+    return state;
+  }
+  return itr->second;
+}
+
+uint32_t PerformanceLint::getUnsampledCallbacks() const
+{
+  return CALLBACK_BIT(CallbackKernelBegin) | CALLBACK_BIT(CallbackKernelEnd);
+}
+
+void PerformanceLint::instructionExecuted(const WorkItem* workItem,
+                                          const llvm::Instruction* instruction,
+                                          const TypedValue& result)
+{
+  // Find the successor taken by conditional branches and switches
+  unsigned successor;
+  if (auto branch = llvm::dyn_cast<llvm::BranchInst>(instruction))
+  {
+    if (branch->isUnconditional())
+      return;
+    successor = workItem->getOperand(branch->getCondition()).getUInt() ? 0 : 1;
+  }
+  else if (auto switchInst = llvm::dyn_cast<llvm::SwitchInst>(instruction))
+  {
+    uint64_t value = workItem->getOperand(switchInst->getCondition()).getUInt();
+    successor = 0;
+    for (auto c : switchInst->cases())
+    {
+      if (c.getCaseValue()->getZExtValue() == value)
+      {
+        successor = c.getCaseIndex() + 1;
+        break;
+      }
+    }
+  }
+  else
+  {
+    return;
+  }
+
+  const WorkGroup* workGroup = workItem->getWorkGroup();
+  WorkGroupState& state = getState(workGroup);
+  Size3 groupSize = workGroup->getGroupSize();
+  Size3 localID = workItem->getLocalID();
+  size_t localIndex =
+    localID.x + (localID.y + localID.z * groupSize.y) * groupSize.x;
+
+  // The n-th executions of a branch by the work-items of a subgroup would
+  // run together, diverging if they take different successors
+  BranchKey key = {instruction, localIndex / m_subgroupSize,
+                   state.occurrences[localIndex][instruction]++};
+  auto itr = state.branches.find(key);
+  if (itr == state.branches.end())
+    state.branches[key] = {successor, false};
+  else if (itr->second.successor != successor)
+    itr->second.diverged = true;
+}
+
+void PerformanceLint::kernelBegin(const KernelInvocation* kernelInvocation)
+{
+  m_divergence.clear();
+  m_barriers.clear();
+  m_atomics.clear();
+}
+
+void PerformanceLint::kernelEnd(const KernelInvocation* kernelInvocation)
+{
+  list<Diagnostic> diagnostics;
+
+  // Combine the counts of each location before reporting them
+  map<Location, Count> divergence;
+  for (auto& entry : m_divergence)
+  {
+    Count& count = divergence[getLocation(entry.first)];
+    count.bad += entry.second.bad;
+    count.total += entry.second.total;
+  }
+  for (auto& entry : divergence)
+  {
+    if (!entry.second.bad)
+      continue;
+    ostringstream fields;
+    fields << "\"count\":" << entry.second.bad
+           << ",\"executions\":" << entry.second.total << ",\"message\":"
+           << quote("Branch diverged in " + to_string(entry.second.bad) +
+                    " of " + to_string(entry.second.total) +
+                    " subgroup executions");
+    diagnostics.push_back({"divergent-branch", entry.first, fields.str()});
+  }
+
+  map<pair<Location, size_t>, uint64_t> atomics;
+  for (auto& entry : m_atomics)
+    atomics[make_pair(getLocation(entry.first.first), entry.first.second)] +=
+      entry.second;
+  map<Location, pair<size_t, Count>> contention;
+  for (auto& entry : atomics)
+  {
+    // Report the most contended address of each location
+    pair<size_t, Count>& worst = contention[entry.first.first];
+    if (entry.second > worst.second.bad)
+    {
+      worst.first = entry.first.second;
+      worst.second.bad = entry.second;
+    }
+    worst.second.total += entry.second;
+  }
+  for (auto& entry : contention)
+  {
+    const Count& count = entry.second.second;
+    if (count.bad < m_atomicThreshold)
+      continue;
+    ostringstream address;
+    address << "0x" << hex << entry.second.first;
+    ostringstream fields;
+    fields << "\"count\":" << count.bad << ",\"executions\":" << count.total
+           << ",\"address\":" << quote(address.str()) << ",\"message\":"
+           << quote(to_string(count.bad) +
+                    " atomic operations on the same global address");
+    diagnostics.push_back({"atomic-contention", entry.first, fields.str()});
+  }
+
+  map<Location, Count> barriers;
+  for (auto& entry : m_barriers)
+  {
+    Count& count = barriers[getLocation(entry.first)];
+    count.bad += entry.second.bad;
+    count.total += entry.second.total;
+  }
+  for (auto& entry : barriers)
+  {
+    if (!entry.second.bad)
+      continue;
+    ostringstream fields;
+    fields << "\"count\":" << entry.second.bad
+           << ",\"executions\":" << entry.second.total << ",\"message\":"
+           << quote("Barrier ordered no memory accesses in " +
+                    to_string(entry.second.bad) + " of " +
+                    to_string(entry.second.total) + " executions");
+    diagnostics.push_back({"redundant-barrier", entry.first, fields.str()});
+  }
+
+  // Remainder groups of non-uniform work-group sizes
+  Size3 globalSize = kernelInvocation->getGlobalSize();
+  Size3 localSize = kernelInvocation->getLocalSize();
+  Size3 numGroups = kernelInvocation->getNumGroups();
+  size_t groups = numGroups.x * numGroups.y * numGroups.z;
+  size_t fullGroups = 1, smallest = 1;
+  for (unsigned d = 0; d < 3; d++)
+  {
+    fullGroups *= globalSize[d] / localSize[d];
+    smallest *= globalSize[d] % localSize[d] ? globalSize[d] % localSize[d]
+                                              : localSize[d];
+  }
+  if (fullGroups < groups)
+  {
+    size_t groupSize = localSize.x * localSize.y * localSize.z;
+    ostringstream fields;
+    fields << "\"count\":" << groups - fullGroups << ",\"groups\":" << groups
+           << ",\"message\":"
+           << quote(to_string(groups - fullGroups) + " of " +
+                    to_string(groups) + " work-groups are partial, with as "
+                    "few as " + to_string(smallest) + " of " +
+                    to_string(groupSize) + " work-items");
+    diagnostics.push_back({"partial-work-group", Location(0, ""),
+                           fields.str()});
+  }
+
+  // Private memory allocated by the kernel and the functions it calls
+  size_t privateSize = 0;
+  const llvm::AllocaInst* largest = NULL;
+  size_t largestSize = 0;
+  map<const llvm::Value*, const llvm::DILocalVariable*> variables;
+  set<const llvm::Function*> visited;
+  list<const llvm::Function*> pending(
+    1, kernelInvocation->getKernel()->getFunction());
+  while (!pending.empty())
+  {
+    const llvm::Function* function = pending.front();
+    pending.pop_front();
+    if (!visited.insert(function).second)
+    {
+      continue;
+    }
+
+    for (auto I = llvm::inst_begin(function); I != llvm::inst_end(function);
+         I++)
+    {
+      if (auto alloca = llvm::dyn_cast<llvm::AllocaInst>(&*I))
+      {
+        auto num = llvm::dyn_cast<llvm::ConstantInt>(alloca->getArraySize());
+        if (!num)
+          continue;
+        size_t size =
+          getTypeSize(alloca->getAllocatedType()) * num->getZExtValue();
+        privateSize += size;
+        if (size > largestSize)
+        {
+          largest = alloca;
+          largestSize = size;
+        }
+      }
+      else if (auto declare = llvm::dyn_cast<llvm::DbgDeclareInst>(&*I))
+      {
+        variables[declare->getAddress()] = declare->getVariable();
+      }
+
+      auto call = llvm::dyn_cast<llvm::CallInst>(&*I);
+      if (call && call->getCalledFunction() &&
+          !call->getCalledFunction()->isDeclaration())
+      {
+        pending.push_back(call->getCalledFunction());
+      }
+    }
+  }
+  if (privateSize > m_privateThreshold)
+  {
+    // Name the largest allocation by its variable if it has one
+    Location location(0, "");
+    string name;
+    auto variable = variables.find(largest);
+    if (variable != variables.end() && variable->second->getLine())
+    {
+      location.first = variable->second->getLine();
+      name = "'" + variable->second->getName().str() + "'";
+    }
+    else
+    {
+      location = getLocation(largest);
+      name = "an allocation";
+    }
+    ostringstream fields;
+    fields << "\"count\":" << privateSize
+           << ",\"threshold\":" << m_privateThreshold << ",\"message\":"
+           << quote("Work-items use " + to_string(privateSize) +
+                    " bytes of private memory, the largest being " + name +
+                    " with " + to_string(largestSize) + " bytes");
+    diagnostics.push_back({"private-footprint", location, fields.str()});
+  }
+
+  ostream& out = m_output.is_open() ? m_output : cout;
+  string kernel = quote(kernelInvocation->getKernel()->getName());
+  for (const Diagnostic& diagnostic : diagnostics)
+  {
+    out << "{\"kernel\":" << kernel
+        << ",\"check\":" << quote(diagnostic.check)
+        << ",\"line\":" << diagnostic.location.first;
+    if (!diagnostic.location.second.empty())
+      out << ",\"instruction\":" << quote(diagnostic.location.second);
+    out << "," << diagnostic.fields << "}" << endl;
+  }
+}
+
+void PerformanceLint::memoryAtomicLoad(const Memory* memory,
+                                       const WorkItem* workItem, AtomicOp op,
+                                       size_t address, size_t size)
+{
+  // The store of an atomic is part of the same operation
+  WorkGroupState& state = getState(workItem->getWorkGroup());
+  addTraffic(memory, state);
+  if (memory->getAddressSpace() == AddrSpaceGlobal)
+    state.atomics[make_pair(workItem->getCurrentInstruction(), address)]++;
+}
+
+void PerformanceLint::memoryLoad(const Memory* memory, const WorkItem* workItem,
+                                 size_t address, size_t size)
+{
+  addTraffic(memory, getState(workItem->getWorkGroup()));
+}
+
+void PerformanceLint::memoryLoad(const Memory* memory,
+                                 const WorkGroup* workGroup, size_t address,
+                                 size_t size)
+{
+  addTraffic(memory, getState(workGroup));
+}
+
+void PerformanceLint::memoryStore(const Memory* memory,
+                                  const WorkItem* workItem, size_t address,
+                                  size_t size, const uint8_t* storeData)
+{
+  addTraffic(memory, getState(workItem->getWorkGroup()));
+}
+
+void PerformanceLint::memoryStore(const Memory* memory,
+                                  const WorkGroup* workGroup, size_t address,
+                                  size_t size, const uint8_t* storeData)
+{
+  addTraffic(memory, getState(workGroup));
+}
+
+void PerformanceLint::parseConfig(const char* config)
+{
+  // Options are given as a comma-separated list of NAME=VALUE
+  istringstream list(config);
+  string entry;
+  while (getline(list, entry, ','))
+  {
+    size_t equals = entry.find('=');
+    string name = entry.substr(0, equals);
+    string value = equals == string::npos ? "" : entry.substr(equals + 1);
+    if (name == "output" && !value.empty())
+    {
+      m_output.open(value);
+      if (!m_output)
+      {
+        cerr << endl
+             << "Oclgrind: Unable to open '" << value
+             << "' for performance lint output" << endl;
+        abort();
+      }
+      continue;
+    }
+
+    char* end = NULL;
+    unsigned long long number = strtoull(value.c_str(), &end, 10);
+    if (value.empty() || *end || value[0] == '-' ||
+        (!number && name == "subgroup"))
+    {
+      cerr << endl
+           << "Oclgrind: Invalid value for '" << name
+           << "' in OCLGRIND_PERFORMANCE_LINT" << endl;
+      abort();
+    }
+
+    if (name == "atomics")
+      m_atomicThreshold = number;
+    else if (name == "private")
+      m_privateThreshold = number;
+    else if (name == "subgroup")
+      m_subgroupSize = number;
+    else
+    {
+      cerr << endl
+           << "Oclgrind: Unknown option '" << name
+           << "' in OCLGRIND_PERFORMANCE_LINT" << endl;
+      abort();
+    }
+  }
+}
+
+void PerformanceLint::workGroupBarrier(const WorkGroup* workGroup,
+                                       uint32_t flags)
+{
+  WorkGroupState& state = getState(workGroup);
+  flushBranches(state);
+
+  bool local = state.localTraffic, global = state.globalTraffic;
+  endBarrierInterval(state);
+
+  // Waiting for async copies synchronizes the work-group too, but is needed
+  // for the copies themselves
+  auto call = llvm::dyn_cast_or_null<llvm::CallInst>(
+    workGroup->getCurrentBarrier());
+  if (call && call->getCalledFunction() &&
+      call->getCalledFunction()->getName().contains("wait_group_events"))
+  {
+    return;
+  }
+  state.barrier = workGroup->getCurrentBarrier();
+  state.barrierFlags = flags;
+  state.barrierLocal = local;
+  state.barrierGlobal = global;
+}
+
+void PerformanceLint::workGroupComplete(const WorkGroup* workGroup)
+{
+  if (!m_state.groups || !m_state.groups->count(workGroup))
+    return;
+
+  WorkGroupState& state = m_state.groups->at(workGroup);
+  flushBranches(state);
+  endBarrierInterval(state);
+  {
+    lock_guard<mutex> lock(m_lock);
+    for (auto& count : state.divergence)
+    {
+      Count& total = m_divergence[count.first];
+      total.bad += count.second.bad;
+      total.total += count.second.total;
+    }
+    for (auto& count : state.barriers)
+    {
+      Count& total = m_barriers[count.first];
+      total.bad += count.second.bad;
+      total.total += count.second.total;
+    }
+    for (auto& count : state.atomics)
+      m_atomics[count.first] += count.second;
+  }
+
+  m_state.groups->erase(workGroup);
+  if (m_state.groups->empty())
+  {
+    delete m_state.groups;
+    m_state.groups = NULL;
+  }
+}
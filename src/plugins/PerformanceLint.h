@@ -0,0 +1,112 @@
+// PerformanceLint.h (Oclgrind)
+// Copyright (c) 2013-2019, James Price and Simon McIntosh-Smith,
+// University of Bristol. All rights reserved.
+//
+// This program is provided under a three-clause BSD license. For full
+// license terms please see the LICENSE file distributed with this
+// source code.
+
+#include "core/Plugin.h"
+
+#include <fstream>
+#include <map>
+#include <mutex>
+
+namespace oclgrind
+{
+// Flags code that would perform poorly on a GPU - branches that diverge
+// within subgroups, contended global atomics, barriers that order no
+// memory accesses, partial work-groups and large private footprints -
+// writing a JSON object per diagnostic and line after each kernel
+class PerformanceLint : public Plugin
+{
+public:
+  PerformanceLint(const Context* context);
+
+  virtual uint32_t getCallbacks() const override;
+  virtual uint32_t getUnsampledCallbacks() const override;
+  virtual void instructionExecuted(const WorkItem* workItem,
+                                   const llvm::Instruction* instruction,
+                                   const TypedValue& result) override;
+  virtual void kernelBegin(const KernelInvocation* kernelInvocation) override;
+  virtual void kernelEnd(const KernelInvocation* kernelInvocation) override;
+  virtual void memoryAtomicLoad(const Memory* memory, const WorkItem* workItem,
+                                AtomicOp op, size_t address,
+                                size_t size) override;
+  virtual void memoryLoad(const Memory* memory, const WorkItem* workItem,
+                          size_t address, size_t size) override;
+  virtual void memoryLoad(const Memory* memory, const WorkGroup* workGroup,
+                          size_t address, size_t size) override;
+  virtual void memoryStore(const Memory* memory, const WorkItem* workItem,
+                           size_t address, size_t size,
+                           const uint8_t* storeData) override;
+  virtual void memoryStore(const Memory* memory, const WorkGroup* workGroup,
+                           size_t address, size_t size,
+                           const uint8_t* storeData) override;
+  virtual void workGroupBarrier(const WorkGroup* workGroup,
+                                uint32_t flags) override;
+  virtual void workGroupComplete(const WorkGroup* workGroup) override;
+
+private:
+  // Number of dynamic executions of an instruction, and how many were bad
+  struct Count
+  {
+    uint64_t bad;
+    uint64_t total;
+  };
+
+  // Successor taken by the n-th execution of a branch in a subgroup
+  struct BranchKey
+  {
+    const llvm::Instruction* instruction;
+    size_t subgroup;
+    unsigned occurrence;
+    bool operator<(const BranchKey& other) const;
+  };
+  struct BranchState
+  {
+    unsigned successor;
+    bool diverged;
+  };
+
+  struct WorkGroupState
+  {
+    // Times each work-item (by local index) has run each branch since the
+    // last barrier, identifying its subgroup's executions of it
+    std::vector<std::unordered_map<const llvm::Instruction*, unsigned>>
+      occurrences;
+    std::map<BranchKey, BranchState> branches;
+
+    // Memory traffic since the last barrier, and the barrier before it
+    bool localTraffic, globalTraffic;
+    const llvm::Instruction* barrier;
+    uint32_t barrierFlags;
+    bool barrierLocal, barrierGlobal;
+
+    std::unordered_map<const llvm::Instruction*, Count> divergence;
+    std::unordered_map<const llvm::Instruction*, Count> barriers;
+    std::map<std::pair<const llvm::Instruction*, size_t>, uint64_t> atomics;
+  };
+  struct WorkerState
+  {
+    std::unordered_map<const WorkGroup*, WorkGroupState>* groups;
+  };
+  static THREAD_LOCAL WorkerState m_state;
+
+  size_t m_subgroupSize;
+  size_t m_atomicThreshold;
+  size_t m_privateThreshold;
+  std::ofstream m_output;
+
+  std::mutex m_lock;
+  std::unordered_map<const llvm::Instruction*, Count> m_divergence;
+  std::unordered_map<const llvm::Instruction*, Count> m_barriers;
+  std::map<std::pair<const llvm::Instruction*, size_t>, uint64_t> m_atomics;
+
+  void addTraffic(const Memory* memory, WorkGroupState& state);
+  void endBarrierInterval(WorkGroupState& state);
+  void flushBranches(WorkGroupState& state);
+  WorkGroupState& getState(const WorkGroup* workGroup);
+  void parseConfig(const char* config);
+};
+} // namespace oclgrind
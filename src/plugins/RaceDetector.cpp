@@ -8,6 +8,8 @@
 
 #include "core/common.h"
 
+#include <algorithm>
+
 #include "core/Context.h"
 #include "core/KernelInvocation.h"
 #include "core/Memory.h"
@@ -23,16 +25,41 @@ THREAD_LOCAL RaceDetector::WorkerState RaceDetector::m_state = {NULL};
 
 #define STATE(workgroup) (m_state.groups->at(workgroup))
 
-// Use a bank of mutexes to reduce unnecessary synchronisation
-#define NUM_GLOBAL_MUTEXES 4096 // Must be power of two
-#define GLOBAL_MUTEX(buffer, offset)                                           \
-  m_globalMutexes[buffer][offset & (NUM_GLOBAL_MUTEXES - 1)]
+// Layout of packed memory accesses
+#define PACKED_ENTITY_BITS 36
+#define PACKED_INSTRUCTION_BITS 16
+#define PACKED_INFO_SHIFT (PACKED_ENTITY_BITS + PACKED_INSTRUCTION_BITS)
+#define MAX_INSTRUCTION_ID ((1u << PACKED_INSTRUCTION_BITS) - 1)
 
 RaceDetector::RaceDetector(const Context* context) : Plugin(context)
 {
   m_kernelInvocation = NULL;
 
   m_allowUniformWrites = !checkEnv("OCLGRIND_UNIFORM_WRITES");
+  m_usage = context->getMemoryUsage("RaceDetector access records");
+}
+
+uint32_t RaceDetector::getCallbacks() const
+{
+  return CALLBACK_BIT(CallbackKernelBegin) |
+         CALLBACK_BIT(CallbackKernelEnd) |
+         CALLBACK_BIT(CallbackMemoryAllocated) |
+         CALLBACK_BIT(CallbackMemoryAtomicLoad) |
+         CALLBACK_BIT(CallbackMemoryAtomicStore) |
+         CALLBACK_BIT(CallbackMemoryDeallocated) |
+         CALLBACK_BIT(CallbackMemoryLoad) |
+         CALLBACK_BIT(CallbackMemoryStore) |
+         CALLBACK_BIT(CallbackWorkGroupBarrier) |
+         CALLBACK_BIT(CallbackWorkGroupBegin) |
+         CALLBACK_BIT(CallbackWorkGroupComplete);
+}
+
+uint32_t RaceDetector::getUnsampledCallbacks() const
+{
+  // Keep shadow memory allocated for buffers even if no groups use them
+  return CALLBACK_BIT(CallbackKernelBegin) | CALLBACK_BIT(CallbackKernelEnd) |
+         CALLBACK_BIT(CallbackMemoryAllocated) |
+         CALLBACK_BIT(CallbackMemoryDeallocated);
 }
 
 void RaceDetector::kernelBegin(const KernelInvocation* kernelInvocation)
@@ -50,9 +77,9 @@ void RaceDetector::kernelEnd(const KernelInvocation* kernelInvocation)
   // Clear all global memory accesses
   for (auto& buffer : m_globalAccesses)
   {
-    size_t sz = buffer.second.size();
-    buffer.second.clear();
-    buffer.second.resize(sz);
+    GlobalShadow& shadow = buffer.second;
+    for (size_t i = 0; i < shadow.size * 2; i++)
+      shadow.words[i].store(0, memory_order_relaxed);
   }
 
   m_kernelInvocation = NULL;
@@ -65,8 +92,13 @@ void RaceDetector::memoryAllocated(const Memory* memory, size_t address,
   size_t buffer = memory->extractBuffer(address);
   if (memory->getAddressSpace() == AddrSpaceGlobal)
   {
-    m_globalAccesses[buffer].resize(size);
-    m_globalMutexes[buffer] = new mutex[NUM_GLOBAL_MUTEXES];
+    GlobalShadow& shadow = m_globalAccesses[buffer];
+    shadow.address = address;
+    shadow.size = size;
+    shadow.words.reset(new atomic<uint64_t>[size * 2]);
+    for (size_t i = 0; i < size * 2; i++)
+      shadow.words[i].store(0, memory_order_relaxed);
+    m_usage->allocate(size * 2 * sizeof(uint64_t));
   }
 }
 
@@ -91,10 +123,8 @@ void RaceDetector::memoryDeallocated(const Memory* memory, size_t address)
   size_t buffer = memory->extractBuffer(address);
   if (memory->getAddressSpace() == AddrSpaceGlobal)
   {
+    m_usage->release(m_globalAccesses.at(buffer).size * 2 * sizeof(uint64_t));
     m_globalAccesses.erase(buffer);
-
-    delete[] m_globalMutexes.at(buffer);
-    m_globalMutexes.erase(buffer);
   }
 }
 
@@ -126,6 +156,90 @@ void RaceDetector::memoryStore(const Memory* memory, const WorkGroup* workGroup,
   registerAccess(memory, workGroup, NULL, address, size, false, storeData);
 }
 
+bool RaceDetector::mergeResults(const string& data)
+{
+  // Races found by the worker process between its own work-groups
+  size_t offset = 0;
+  uint64_t numRaces;
+  if (!readBinary(data, offset, numRaces))
+    return false;
+  for (uint64_t i = 0; i < numRaces; i++)
+  {
+    uint32_t addrspace;
+    uint64_t address, words[2], instructions[2];
+    if (!readBinary(data, offset, addrspace) ||
+        !readBinary(data, offset, address) ||
+        !readBinary(data, offset, words[0]) ||
+        !readBinary(data, offset, instructions[0]) ||
+        !readBinary(data, offset, words[1]) ||
+        !readBinary(data, offset, instructions[1]))
+      return false;
+    auto a = (const llvm::Instruction*)instructions[0];
+    auto b = (const llvm::Instruction*)instructions[1];
+    insertKernelRace({addrspace, address, MemoryAccess::unpack(words[0], a),
+                      MemoryAccess::unpack(words[1], b)});
+  }
+
+  // Its global accesses, which may race with those of other processes
+  uint64_t numAccesses;
+  if (!readBinary(data, offset, numAccesses))
+    return false;
+  const Memory* memory = m_context->getGlobalMemory();
+  for (uint64_t i = 0; i < numAccesses; i++)
+  {
+    uint64_t address, word, instruction;
+    if (!readBinary(data, offset, address) ||
+        !readBinary(data, offset, word) ||
+        !readBinary(data, offset, instruction) ||
+        !m_globalAccesses.count(memory->extractBuffer(address)))
+      return false;
+    MemoryAccess access =
+      MemoryAccess::unpack(word, (const llvm::Instruction*)instruction);
+    insertGlobalAccess(address, access,
+                       getInstructionID(access.getInstruction()),
+                       getAccessWorkGroup(access));
+  }
+  return offset == data.size();
+}
+
+bool RaceDetector::saveResults(string& data) const
+{
+  // Instructions are saved as their addresses, which are the same in the
+  // process that forked this one
+  writeBinary(data, (uint64_t)kernelRaces.size());
+  for (const Race& race : kernelRaces)
+  {
+    writeBinary(data, (uint32_t)race.addrspace);
+    writeBinary(data, (uint64_t)race.address);
+    for (const MemoryAccess* access : {&race.a, &race.b})
+    {
+      writeBinary(data, access->pack(0));
+      writeBinary(data, (uint64_t)(uintptr_t)access->getInstruction());
+    }
+  }
+
+  string accesses;
+  uint64_t numAccesses = 0;
+  for (auto& buffer : m_globalAccesses)
+  {
+    const GlobalShadow& shadow = buffer.second;
+    for (size_t i = 0; i < shadow.size * 2; i++)
+    {
+      uint64_t word = shadow.words[i].load(memory_order_relaxed);
+      if (!word)
+        continue;
+      uint32_t id = MemoryAccess::unpackInstructionID(word);
+      writeBinary(accesses, (uint64_t)(shadow.address + i / 2));
+      writeBinary(accesses, MemoryAccess::unpack(word).pack(0));
+      writeBinary(accesses, (uint64_t)(uintptr_t)getInstruction(id));
+      numAccesses++;
+    }
+  }
+  writeBinary(data, numAccesses);
+  data += accesses;
+  return true;
+}
+
 void RaceDetector::workGroupBarrier(const WorkGroup* workGroup, uint32_t flags)
 {
   if (flags & CLK_LOCAL_MEM_FENCE)
@@ -169,30 +283,23 @@ void RaceDetector::workGroupComplete(const WorkGroup* workGroup)
 
   // Merge global accesses across kernel invocation
   size_t group = workGroup->getGroupIndex();
+  const llvm::Instruction* lastInstruction = NULL;
+  uint32_t lastID = 0;
+  auto getID = [&](const MemoryAccess& access) {
+    if (access.getInstruction() != lastInstruction)
+    {
+      lastInstruction = access.getInstruction();
+      lastID = getInstructionID(lastInstruction);
+    }
+    return lastID;
+  };
   for (auto& record : state.wgGlobal)
   {
-    size_t address = record.first;
-    size_t buffer = m_context->getGlobalMemory()->extractBuffer(address);
-    size_t offset = m_context->getGlobalMemory()->extractOffset(address);
-
-    lock_guard<mutex> lock(GLOBAL_MUTEX(buffer, offset));
-
     AccessRecord& a = record.second;
-    AccessRecord& b = m_globalAccesses.at(buffer)[offset];
-
-    // Check for races with previous accesses
-    if (check(a.load, b.store) && getAccessWorkGroup(b.store) != group)
-      insertKernelRace({AddrSpaceGlobal, address, a.load, b.store});
-    if (check(a.store, b.load) && getAccessWorkGroup(b.load) != group)
-      insertKernelRace({AddrSpaceGlobal, address, a.store, b.load});
-    if (check(a.store, b.store) && getAccessWorkGroup(b.store) != group)
-      insertKernelRace({AddrSpaceGlobal, address, a.store, b.store});
-
-    // Insert accesses
     if (a.load.isSet())
-      insert(b, a.load);
+      insertGlobalAccess(record.first, a.load, getID(a.load), group);
     if (a.store.isSet())
-      insert(b, a.store);
+      insertGlobalAccess(record.first, a.store, getID(a.store), group);
   }
   state.wgGlobal.clear();
 
@@ -245,6 +352,33 @@ size_t RaceDetector::getAccessWorkGroup(const MemoryAccess& access) const
     return access.getEntity();
 }
 
+const llvm::Instruction* RaceDetector::getInstruction(uint32_t id) const
+{
+  lock_guard<mutex> lock(m_instructionsMutex);
+  return id ? m_instructions[id - 1] : NULL;
+}
+
+uint32_t RaceDetector::getInstructionID(const llvm::Instruction* instruction)
+{
+  if (!instruction)
+    return 0;
+
+  lock_guard<mutex> lock(m_instructionsMutex);
+  auto itr = m_instructionIDs.find(instruction);
+  if (itr != m_instructionIDs.end())
+    return itr->second;
+
+  // Accesses from instructions beyond the table size are reported without
+  // their instruction
+  if (m_instructions.size() >= MAX_INSTRUCTION_ID)
+    return 0;
+
+  m_instructions.push_back(instruction);
+  uint32_t id = m_instructions.size();
+  m_instructionIDs[instruction] = id;
+  return id;
+}
+
 void RaceDetector::insert(AccessRecord& record,
                           const MemoryAccess& access) const
 {
@@ -260,6 +394,61 @@ void RaceDetector::insert(AccessRecord& record,
   }
 }
 
+uint64_t RaceDetector::insert(atomic<uint64_t>& word,
+                              const MemoryAccess& access,
+                              uint32_t instructionID) const
+{
+  // Same policy as for unpacked records, returning the access replaced
+  uint64_t packed = access.pack(instructionID);
+  uint64_t old = word.load();
+  while (true)
+  {
+    MemoryAccess previous = MemoryAccess::unpack(old);
+    if (previous.isSet() && !previous.isAtomic())
+      return old;
+    if (word.compare_exchange_weak(old, packed))
+      return old;
+  }
+}
+
+void RaceDetector::insertGlobalAccess(size_t address,
+                                      const MemoryAccess& access,
+                                      uint32_t instructionID, size_t group)
+{
+  const Memory* memory = m_context->getGlobalMemory();
+  GlobalShadow& shadow = m_globalAccesses.at(memory->extractBuffer(address));
+  size_t offset = memory->extractOffset(address);
+  atomic<uint64_t>& load = shadow.words[offset * 2];
+  atomic<uint64_t>& store = shadow.words[offset * 2 + 1];
+  auto resolve = [&](uint64_t word) {
+    return MemoryAccess::unpack(
+      word, getInstruction(MemoryAccess::unpackInstructionID(word)));
+  };
+
+  // Insert the access, checking it against the access of the same kind it
+  // was merged with and against the current access of the other kind
+  if (access.isLoad())
+  {
+    insert(load, access, instructionID);
+    uint64_t current = store.load();
+    MemoryAccess b = MemoryAccess::unpack(current);
+    if (check(access, b) && getAccessWorkGroup(b) != group)
+      insertKernelRace({AddrSpaceGlobal, address, access, resolve(current)});
+  }
+  else
+  {
+    uint64_t previous = insert(store, access, instructionID);
+    MemoryAccess b = MemoryAccess::unpack(previous);
+    if (check(access, b) && getAccessWorkGroup(b) != group)
+      insertKernelRace({AddrSpaceGlobal, address, access, resolve(previous)});
+
+    uint64_t current = load.load();
+    b = MemoryAccess::unpack(current);
+    if (check(access, b) && getAccessWorkGroup(b) != group)
+      insertKernelRace({AddrSpaceGlobal, address, access, resolve(current)});
+  }
+}
+
 void RaceDetector::insertKernelRace(const Race& race)
 {
   lock_guard<mutex> lock(kernelRacesMutex);
@@ -298,6 +487,9 @@ void RaceDetector::logRace(const Race& race) const
   else
     raceType = "Write-write";
 
+  if (m_context->isDuplicateError(raceType, race.a.getInstruction()))
+    return;
+
   Context::Message msg(ERROR, m_context);
   msg << raceType << " data race at " << getAddressSpaceName(race.addrspace)
       << " memory address 0x" << hex << race.address << endl
@@ -382,55 +574,94 @@ void RaceDetector::registerAccess(const Memory* memory,
 void RaceDetector::syncWorkItems(const Memory* memory, WorkGroupState& state,
                                  vector<AccessMap>& accesses)
 {
-  AccessMap wgAccesses(0, AccessMap::hasher(), AccessMap::key_equal(),
-                       state.wgGlobal.get_allocator());
+  unsigned addrSpace = memory->getAddressSpace();
 
+  // Account for the records held by this work-group while they are merged
+  size_t records = state.wgGlobal.size();
+  for (size_t i = 0; i < state.numWorkItems + 1; i++)
+    records += accesses[i].size();
+  size_t bytes = records * (sizeof(AccessMap::value_type) + sizeof(void*)) +
+                 state.log.capacity() * sizeof(LogEntry);
+  m_usage->allocate(bytes);
+
+  // Sort all accesses by address, and by work-item within each address, so
+  // that conflicts can be found with a single linear pass
+  vector<LogEntry>& log = state.log;
+  log.clear();
   for (size_t i = 0; i < state.numWorkItems + 1; i++)
   {
-    RaceList races;
     for (auto& record : accesses[i])
+      log.push_back({record.first, i, &record.second});
+  }
+  sort(log.begin(), log.end());
+
+  RaceList races;
+  for (size_t begin = 0, end; begin < log.size(); begin = end)
+  {
+    size_t address = log[begin].address;
+    for (end = begin + 1; end < log.size() && log[end].address == address;
+         end++)
+      ;
+
+    // Addresses touched by a single work-item cannot race here
+    if (end - begin == 1)
     {
-      size_t address = record.first;
+      const AccessRecord& a = *log[begin].record;
+      if (addrSpace == AddrSpaceGlobal)
+      {
+        if (a.load.isSet())
+          insert(state.wgGlobal[address], a.load);
+        if (a.store.isSet())
+          insert(state.wgGlobal[address], a.store);
+      }
+      continue;
+    }
 
-      AccessRecord& a = record.second;
-      AccessRecord& b = wgAccesses[address];
+    // Check each work-item against the accesses of those before it
+    AccessRecord b;
+    for (size_t e = begin; e < end; e++)
+    {
+      const AccessRecord& a = *log[e].record;
 
       if (check(a.load, b.store))
-        insertRace(races,
-                   {memory->getAddressSpace(), address, a.load, b.store});
+        insertRace(races, {addrSpace, address, a.load, b.store});
       if (check(a.store, b.load))
-        insertRace(races,
-                   {memory->getAddressSpace(), address, a.store, b.load});
+        insertRace(races, {addrSpace, address, a.store, b.load});
       if (check(a.store, b.store))
-        insertRace(races,
-                   {memory->getAddressSpace(), address, a.store, b.store});
+        insertRace(races, {addrSpace, address, a.store, b.store});
 
       if (a.load.isSet())
       {
         insert(b, a.load);
-        if (memory->getAddressSpace() == AddrSpaceGlobal)
+        if (addrSpace == AddrSpaceGlobal)
           insert(state.wgGlobal[address], a.load);
       }
       if (a.store.isSet())
       {
         insert(b, a.store);
-        if (memory->getAddressSpace() == AddrSpaceGlobal)
+        if (addrSpace == AddrSpaceGlobal)
           insert(state.wgGlobal[address], a.store);
       }
     }
+  }
+  log.clear();
 
+  for (size_t i = 0; i < state.numWorkItems + 1; i++)
     accesses[i].clear();
 
-    // Log races
-    for (auto race : races)
-      logRace(race);
-  }
+  // Log races
+  for (auto race : races)
+    logRace(race);
+
+  m_usage->release(bytes);
 }
 
 RaceDetector::MemoryAccess::MemoryAccess()
 {
+  this->entity = 0;
   this->info = 0;
   this->instruction = NULL;
+  this->storeData = 0;
 }
 
 RaceDetector::MemoryAccess::MemoryAccess(const WorkGroup* workGroup,
@@ -438,6 +669,7 @@ RaceDetector::MemoryAccess::MemoryAccess(const WorkGroup* workGroup,
                                          bool atomic)
 {
   this->info = 0;
+  this->storeData = 0;
 
   this->info |= 1 << SET_BIT;
   this->info |= store << STORE_BIT;
@@ -512,6 +744,32 @@ void RaceDetector::MemoryAccess::setStoreData(uint8_t data)
   this->storeData = data;
 }
 
+uint64_t RaceDetector::MemoryAccess::pack(uint32_t instructionID) const
+{
+  uint64_t word = this->entity & ((1ull << PACKED_ENTITY_BITS) - 1);
+  word |= (uint64_t)instructionID << PACKED_ENTITY_BITS;
+  word |= (uint64_t)(this->info & 0xF) << PACKED_INFO_SHIFT;
+  word |= (uint64_t)this->storeData << (PACKED_INFO_SHIFT + 4);
+  return word;
+}
+
+RaceDetector::MemoryAccess
+RaceDetector::MemoryAccess::unpack(uint64_t word,
+                                   const llvm::Instruction* instruction)
+{
+  MemoryAccess access;
+  access.entity = word & ((1ull << PACKED_ENTITY_BITS) - 1);
+  access.instruction = instruction;
+  access.info = (word >> PACKED_INFO_SHIFT) & 0xF;
+  access.storeData = word >> (PACKED_INFO_SHIFT + 4);
+  return access;
+}
+
+uint32_t RaceDetector::MemoryAccess::unpackInstructionID(uint64_t word)
+{
+  return (word >> PACKED_ENTITY_BITS) & MAX_INSTRUCTION_ID;
+}
+
 bool RaceDetector::MemoryAccess::operator==(
   const RaceDetector::MemoryAccess& other) const
 {
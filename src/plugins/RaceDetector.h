@@ -8,6 +8,7 @@
 
 #include "core/Plugin.h"
 
+#include <atomic>
 #include <mutex>
 
 namespace oclgrind
@@ -17,6 +18,8 @@ class RaceDetector : public Plugin
 public:
   RaceDetector(const Context* context);
 
+  virtual uint32_t getCallbacks() const override;
+  virtual uint32_t getUnsampledCallbacks() const override;
   virtual void kernelBegin(const KernelInvocation* kernelInvocation) override;
   virtual void kernelEnd(const KernelInvocation* kernelInvocation) override;
   virtual void memoryAllocated(const Memory* memory, size_t address,
@@ -39,6 +42,8 @@ public:
   virtual void memoryStore(const Memory* memory, const WorkGroup* workGroup,
                            size_t address, size_t size,
                            const uint8_t* storeData) override;
+  virtual bool mergeResults(const std::string& data) override;
+  virtual bool saveResults(std::string& data) const override;
   virtual void workGroupBarrier(const WorkGroup* workGroup,
                                 uint32_t flags) override;
   virtual void workGroupBegin(const WorkGroup* workGroup) override;
@@ -75,6 +80,13 @@ private:
     uint8_t getStoreData() const;
     void setStoreData(uint8_t);
 
+    // Single-word encoding used by the global memory shadow, with the
+    // instruction replaced by an index into the instruction table
+    uint64_t pack(uint32_t instructionID) const;
+    static MemoryAccess unpack(uint64_t word,
+                               const llvm::Instruction* instruction = NULL);
+    static uint32_t unpackInstructionID(uint64_t word);
+
     MemoryAccess();
     MemoryAccess(const WorkGroup* workGroup, const WorkItem* workItem,
                  bool store, bool atomic);
@@ -92,8 +104,33 @@ private:
     PoolAllocator<std::pair<const size_t, AccessRecord>, 8192>>
     AccessMap;
 
-  std::unordered_map<size_t, std::vector<AccessRecord>> m_globalAccesses;
-  std::map<size_t, std::mutex*> m_globalMutexes;
+  // Shadow of each global buffer, holding a packed load and store access
+  // per byte that work-groups merge into with compare-and-swap
+  struct GlobalShadow
+  {
+    size_t address;
+    size_t size;
+    std::unique_ptr<std::atomic<uint64_t>[]> words;
+  };
+  std::unordered_map<size_t, GlobalShadow> m_globalAccesses;
+
+  // Instructions referenced by packed accesses (ID 0 is reserved)
+  mutable std::mutex m_instructionsMutex;
+  std::vector<const llvm::Instruction*> m_instructions;
+  std::unordered_map<const llvm::Instruction*, uint32_t> m_instructionIDs;
+
+  // Access made by one work-item since the last barrier
+  struct LogEntry
+  {
+    size_t address;
+    size_t workItem;
+    const AccessRecord* record;
+    bool operator<(const LogEntry& other) const
+    {
+      return address < other.address ||
+             (address == other.address && workItem < other.workItem);
+    }
+  };
 
   struct WorkGroupState
   {
@@ -101,6 +138,7 @@ private:
     std::vector<AccessMap> wiLocal;
     std::vector<AccessMap> wiGlobal;
     AccessMap wgGlobal;
+    std::vector<LogEntry> log; // Reused by each barrier
   };
   struct WorkerState
   {
@@ -118,14 +156,22 @@ private:
 
   bool m_allowUniformWrites;
   const KernelInvocation* m_kernelInvocation;
+  MemoryUsage* m_usage;
 
   std::mutex kernelRacesMutex;
   RaceList kernelRaces;
 
   size_t getAccessWorkGroup(const MemoryAccess& access) const;
+  const llvm::Instruction* getInstruction(uint32_t id) const;
+  uint32_t getInstructionID(const llvm::Instruction* instruction);
 
   bool check(const MemoryAccess& a, const MemoryAccess& b) const;
   void insert(AccessRecord& record, const MemoryAccess& access) const;
+  uint64_t insert(std::atomic<uint64_t>& word, const MemoryAccess& access,
+                  uint32_t instructionID) const;
+  // Merge an access made by group into the global memory shadow
+  void insertGlobalAccess(size_t address, const MemoryAccess& access,
+                          uint32_t instructionID, size_t group);
   void insertKernelRace(const Race& race);
   void insertRace(RaceList& races, const Race& race) const;
   void logRace(const Race& race) const;
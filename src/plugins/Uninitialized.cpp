@@ -13,11 +13,13 @@
 #include "core/Kernel.h"
 #include "core/KernelInvocation.h"
 #include "core/Memory.h"
+#include "core/Program.h"
 #include "core/WorkGroup.h"
 #include "core/WorkItem.h"
 
 #include "llvm/IR/Argument.h"
 #include "llvm/IR/Constants.h"
+#include "llvm/IR/InstIterator.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/Type.h"
 
@@ -45,8 +47,12 @@ THREAD_LOCAL ShadowContext::WorkSpace ShadowContext::m_workSpace = {NULL, NULL,
                                                                     NULL, 0};
 
 Uninitialized::Uninitialized(const Context* context)
-    : Plugin(context), shadowContext(sizeof(size_t) == 8 ? 32 : 16)
+    : Plugin(context),
+      shadowContext(sizeof(size_t) == 8 ? 32 : 16,
+                    context->getMemoryUsage("Uninitialized shadow memory"))
 {
+  m_sampling = getEnvInt("OCLGRIND_SAMPLE", 1, false) > 1;
+
   shadowContext.createMemoryPool();
 }
 
@@ -72,6 +78,153 @@ void Uninitialized::allocAndStoreShadowMemory(unsigned addrSpace,
   storeShadowMemory(addrSpace, address, SM, workItem, workGroup, unchecked);
 }
 
+static bool isCleanConstant(const llvm::Constant* C)
+{
+  if (llvm::isa<llvm::UndefValue>(C))
+  {
+    return false;
+  }
+  if (llvm::isa<llvm::GlobalValue>(C))
+  {
+    return true;
+  }
+  for (auto O = C->op_begin(); O != C->op_end(); O++)
+  {
+    if (!isCleanConstant(llvm::cast<llvm::Constant>(O->get())))
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Instructions whose shadow is clean whenever all of their operands are
+static bool propagatesCleanShadow(const llvm::Instruction* I)
+{
+  if (I->isBinaryOp() || I->isCast())
+  {
+    return true;
+  }
+
+  switch (I->getOpcode())
+  {
+  case llvm::Instruction::Br:
+  case llvm::Instruction::ExtractElement:
+  case llvm::Instruction::ExtractValue:
+  case llvm::Instruction::FCmp:
+  case llvm::Instruction::FNeg:
+  case llvm::Instruction::GetElementPtr:
+  case llvm::Instruction::ICmp:
+  case llvm::Instruction::InsertElement:
+  case llvm::Instruction::InsertValue:
+  case llvm::Instruction::PHI:
+  case llvm::Instruction::Select:
+  case llvm::Instruction::Switch:
+    return true;
+  default:
+    return false;
+  }
+}
+
+const std::vector<bool>*
+Uninitialized::analyseKernel(const llvm::Function* kernel,
+                             const InterpreterCache* cache)
+{
+  auto itr = m_staticAnalyses.find(kernel);
+  if (itr != m_staticAnalyses.end() && itr->second.cache == cache &&
+      itr->second.clean.size() == cache->getNumValues())
+  {
+    return &itr->second.clean;
+  }
+
+  StaticAnalysis& analysis = m_staticAnalyses[kernel];
+  analysis.cache = cache;
+  analysis.clean.assign(cache->getNumValues(), false);
+
+  // Kernel arguments are always initialized by the host
+  for (auto A = kernel->arg_begin(); A != kernel->arg_end(); A++)
+  {
+    analysis.clean[cache->getValueID(&*A)] = true;
+  }
+
+  // Optimistically assume every candidate instruction in the kernel and its
+  // callees is clean (this lets loop-carried phis be proven clean)
+  std::vector<const llvm::Instruction*> candidates;
+  std::set<const llvm::Function*> visited;
+  std::list<const llvm::Function*> pending(1, kernel);
+  while (!pending.empty())
+  {
+    const llvm::Function* function = pending.front();
+    pending.pop_front();
+    if (!visited.insert(function).second)
+    {
+      continue;
+    }
+
+    for (auto I = llvm::inst_begin(function); I != llvm::inst_end(function);
+         I++)
+    {
+      if (propagatesCleanShadow(&*I))
+      {
+        analysis.clean[cache->getValueID(&*I)] = true;
+        candidates.push_back(&*I);
+      }
+      else if (const llvm::CallInst* call = llvm::dyn_cast<llvm::CallInst>(&*I))
+      {
+        const llvm::Function* callee = call->getCalledFunction();
+        if (callee && !callee->isDeclaration())
+        {
+          pending.push_back(callee);
+        }
+      }
+    }
+  }
+
+  // Remove candidates with a possibly uninitialized operand until stable
+  bool changed = true;
+  while (changed)
+  {
+    changed = false;
+    for (const llvm::Instruction* I : candidates)
+    {
+      unsigned id = cache->getValueID(I);
+      if (!analysis.clean[id])
+      {
+        continue;
+      }
+
+      for (auto O = I->op_begin(); O != I->op_end(); O++)
+      {
+        const llvm::Value* operand = O->get();
+        bool clean;
+        if (llvm::isa<llvm::BasicBlock>(operand))
+        {
+          clean = true;
+        }
+        else if (const llvm::Constant* C =
+                   llvm::dyn_cast<llvm::Constant>(operand))
+        {
+          clean = isCleanConstant(C);
+        }
+        else
+        {
+          clean = cache->hasValue(operand) &&
+                  analysis.clean[cache->getValueID(operand)];
+        }
+
+        if (!clean)
+        {
+          analysis.clean[id] = false;
+          changed = true;
+          break;
+        }
+      }
+    }
+  }
+
+  return &analysis.clean;
+}
+
 bool Uninitialized::checkAllOperandsDefined(const WorkItem* workItem,
                                             const llvm::Instruction* I)
 {
@@ -181,6 +334,28 @@ std::string Uninitialized::extractUnmangledName(const std::string fullname)
   }
 }
 
+uint32_t Uninitialized::getCallbacks() const
+{
+  uint32_t callbacks = CALLBACK_BIT(CallbackHostMemoryTransfer) |
+                       CALLBACK_BIT(CallbackInstructionExecuted) |
+                       CALLBACK_BIT(CallbackKernelBegin) |
+                       CALLBACK_BIT(CallbackKernelEnd) |
+                       CALLBACK_BIT(CallbackMemoryMap) |
+                       CALLBACK_BIT(CallbackWorkItemBegin) |
+                       CALLBACK_BIT(CallbackWorkItemComplete) |
+                       CALLBACK_BIT(CallbackWorkGroupBegin) |
+                       CALLBACK_BIT(CallbackWorkGroupComplete);
+
+  // Stores are only needed for work-groups that aren't sampled, so don't
+  // pay for a notification on every store unless sampling is enabled
+  if (m_sampling)
+  {
+    callbacks |= CALLBACK_BIT(CallbackMemoryAtomicStore) |
+                 CALLBACK_BIT(CallbackMemoryStore);
+  }
+  return callbacks;
+}
+
 ShadowMemory* Uninitialized::getShadowMemory(unsigned addrSpace,
                                              const WorkItem* workItem,
                                              const WorkGroup* workGroup) const
@@ -219,6 +394,16 @@ ShadowMemory* Uninitialized::getShadowMemory(unsigned addrSpace,
   }
 }
 
+uint32_t Uninitialized::getUnsampledCallbacks() const
+{
+  // Work-groups that are not sampled aren't tracked, but must still mark the
+  // global memory they write as initialized to avoid false positives later
+  return CALLBACK_BIT(CallbackHostMemoryTransfer) |
+         CALLBACK_BIT(CallbackKernelBegin) | CALLBACK_BIT(CallbackKernelEnd) |
+         CALLBACK_BIT(CallbackMemoryAtomicStore) |
+         CALLBACK_BIT(CallbackMemoryMap) | CALLBACK_BIT(CallbackMemoryStore);
+}
+
 bool Uninitialized::handleBuiltinFunction(const WorkItem* workItem, string name,
                                           const llvm::CallInst* CI,
                                           const TypedValue result)
@@ -359,7 +544,7 @@ bool Uninitialized::handleBuiltinFunction(const WorkItem* workItem, string name,
         shadowContext.getValue(workItem, CI->getArgOperand(2));
       TypedValue cmpShadow =
         shadowContext.getValue(workItem, CI->getArgOperand(1));
-      TypedValue oldShadow = {4, 1, shadowContext.getMemoryPool()->alloc(4)};
+      TypedValue oldShadow = shadowContext.getMemoryPool()->allocValue(4, 1);
 
       // Check shadow of the condition
       if (!ShadowContext::isCleanValue(cmpShadow))
@@ -669,9 +854,8 @@ bool Uninitialized::handleBuiltinFunction(const WorkItem* workItem, string name,
       address = base + offset * sizeof(cl_half) * result.num;
     }
 
-    TypedValue halfShadow = {
-      sizeof(cl_half), result.num,
-      shadowContext.getMemoryPool()->alloc(2 * result.num)};
+    TypedValue halfShadow = shadowContext.getMemoryPool()->allocValue(
+      sizeof(cl_half), result.num);
     TypedValue newShadow = shadowContext.getMemoryPool()->clone(result);
 
     loadShadowMemory(addressSpace, address, halfShadow, workItem);
@@ -729,8 +913,8 @@ bool Uninitialized::handleBuiltinFunction(const WorkItem* workItem, string name,
     TypedValue shadow = shadowContext.getValue(workItem, value);
     unsigned num = size / sizeof(float);
     size = num * sizeof(cl_half);
-    TypedValue halfShadow = {sizeof(cl_half), num,
-                             shadowContext.getMemoryPool()->alloc(2 * num)};
+    TypedValue halfShadow =
+      shadowContext.getMemoryPool()->allocValue(sizeof(cl_half), num);
 
     TypedValue pv = ShadowContext::getPoisonedValue(halfShadow.size);
     TypedValue cv = ShadowContext::getCleanValue(halfShadow.size);
@@ -890,9 +1074,8 @@ bool Uninitialized::handleBuiltinFunction(const WorkItem* workItem, string name,
   {
     TypedValue shadowImage =
       shadowContext.getValue(workItem, CI->getArgOperand(0));
-    TypedValue newShadow = {
-      result.size, result.num,
-      shadowContext.getMemoryPool()->alloc(result.size * result.num)};
+    TypedValue newShadow =
+      shadowContext.getMemoryPool()->allocValue(result.size, result.num);
 
     if (name == "get_image_array_size")
     {
@@ -1038,13 +1221,19 @@ void Uninitialized::handleIntrinsicInstruction(const WorkItem* workItem,
   }
 }
 
-void Uninitialized::hostMemoryStore(const Memory* memory, size_t address,
-                                    size_t size, const uint8_t* storeData)
+void Uninitialized::hostMemoryTransfer(const HostTransfer& transfer)
 {
-  if (memory->getAddressSpace() == AddrSpaceGlobal)
+  if (transfer.memory->getAddressSpace() == AddrSpaceGlobal &&
+      !transfer.stores.empty())
   {
-    TypedValue v = ShadowContext::getCleanValue(size);
-    allocAndStoreShadowMemory(AddrSpaceGlobal, address, v);
+    // Host accesses are made from queue threads, which need their own pool
+    shadowContext.createMemoryPool();
+    for (const MemoryRegion& region : transfer.stores)
+    {
+      TypedValue v = ShadowContext::getCleanValue(region.size);
+      allocAndStoreShadowMemory(AddrSpaceGlobal, region.address, v);
+    }
+    shadowContext.destroyMemoryPool();
   }
 }
 
@@ -1057,6 +1246,12 @@ void Uninitialized::instructionExecuted(const WorkItem* workItem,
   instruction->dump();
 #endif
 
+  // Nothing to propagate or check if operands can never be uninitialized
+  if (shadowContext.isStaticallyClean(instruction))
+  {
+    return;
+  }
+
   ShadowWorkItem* shadowWorkItem = shadowContext.getShadowWorkItem(workItem);
   ShadowValues* shadowValues = shadowWorkItem->getValues();
 
@@ -1211,13 +1406,11 @@ void Uninitialized::instructionExecuted(const WorkItem* workItem,
         size_t origShadowAddress = workItem->getOperand(Val).getPointer();
         size_t newShadowAddress = workItem->getOperand(&*argItr).getPointer();
         ShadowMemory* mem = shadowWorkItem->getPrivateMemory();
-        unsigned char* origShadowData =
-          (unsigned char*)mem->getPointer(origShadowAddress);
         size_t size = getTypeSize(argItr->getType()->getPointerElementType());
 
         // Set new shadow memory
         TypedValue v = ShadowContext::getCleanValue(size);
-        memcpy(v.data, origShadowData, size);
+        mem->load(v.data, origShadowAddress, size);
         allocAndStoreShadowMemory(AddrSpacePrivate, newShadowAddress, v,
                                   workItem);
         values->setValue(&*argItr, ShadowContext::getCleanValue(&*argItr));
@@ -1810,8 +2003,13 @@ void Uninitialized::instructionExecuted(const WorkItem* workItem,
 void Uninitialized::kernelBegin(const KernelInvocation* kernelInvocation)
 {
   const Kernel* kernel = kernelInvocation->getKernel();
+  const InterpreterCache* cache =
+    kernel->getProgram()->getInterpreterCache(kernel->getFunction());
+  shadowContext.setInterpreterCache(cache,
+                                    analyseKernel(kernel->getFunction(), cache));
 
   // Initialise kernel arguments and global variables
+  shadowContext.createMemoryPool();
   for (auto value = kernel->values_begin(); value != kernel->values_end();
        value++)
   {
@@ -1917,6 +2115,7 @@ void Uninitialized::kernelBegin(const KernelInvocation* kernelInvocation)
       m_deferredInit.push_back(*value);
     }
   }
+  shadowContext.destroyMemoryPool();
 }
 
 void Uninitialized::kernelEnd(const KernelInvocation* kernelInvocation)
@@ -1949,6 +2148,10 @@ void Uninitialized::loadShadowMemory(unsigned addrSpace, size_t address,
 void Uninitialized::logUninitializedAddress(unsigned int addrSpace,
                                             size_t address, bool write) const
 {
+  if (m_context->isDuplicateError(write ? "uninitialized write address"
+                                        : "uninitialized read address"))
+    return;
+
   Context::Message msg(WARNING, m_context);
   msg << "Uninitialized address used to "
       << (write ? "write to " : "read from ") << getAddressSpaceName(addrSpace)
@@ -1961,6 +2164,9 @@ void Uninitialized::logUninitializedAddress(unsigned int addrSpace,
 
 void Uninitialized::logUninitializedCF() const
 {
+  if (m_context->isDuplicateError("uninitialized controlflow"))
+    return;
+
   Context::Message msg(WARNING, m_context);
   msg << "Controlflow depends on uninitialized value" << endl
       << msg.INDENT << "Kernel: " << msg.CURRENT_KERNEL << endl
@@ -1971,6 +2177,9 @@ void Uninitialized::logUninitializedCF() const
 
 void Uninitialized::logUninitializedIndex() const
 {
+  if (m_context->isDuplicateError("uninitialized index"))
+    return;
+
   Context::Message msg(WARNING, m_context);
   msg << "Instruction depends on an uninitialized index value" << endl
       << msg.INDENT << "Kernel: " << msg.CURRENT_KERNEL << endl
@@ -1982,6 +2191,9 @@ void Uninitialized::logUninitializedIndex() const
 void Uninitialized::logUninitializedWrite(unsigned int addrSpace,
                                           size_t address) const
 {
+  if (m_context->isDuplicateError("uninitialized write"))
+    return;
+
   Context::Message msg(WARNING, m_context);
   msg << "Uninitialized value written to " << getAddressSpaceName(addrSpace)
       << " memory address 0x" << hex << address << endl
@@ -1991,16 +2203,42 @@ void Uninitialized::logUninitializedWrite(unsigned int addrSpace,
   msg.send();
 }
 
+void Uninitialized::memoryAtomicStore(const Memory* memory,
+                                      const WorkItem* workItem, AtomicOp op,
+                                      size_t address, size_t size)
+{
+  // Atomics from sampled work-groups are tracked by handleBuiltinFunction
+  if (m_context->isSampled() || memory->getAddressSpace() != AddrSpaceGlobal)
+    return;
+
+  allocAndStoreShadowMemory(AddrSpaceGlobal, address,
+                            ShadowContext::getCleanValue(size));
+}
+
 void Uninitialized::memoryMap(const Memory* memory, size_t address,
                               size_t offset, size_t size, cl_map_flags flags)
 {
   if (!(flags & CL_MAP_READ))
   {
+    shadowContext.createMemoryPool();
     allocAndStoreShadowMemory(memory->getAddressSpace(), address + offset,
                               ShadowContext::getCleanValue(size));
+    shadowContext.destroyMemoryPool();
   }
 }
 
+void Uninitialized::memoryStore(const Memory* memory, const WorkItem* workItem,
+                                size_t address, size_t size,
+                                const uint8_t* storeData)
+{
+  // Stores from sampled work-groups are tracked by instructionExecuted
+  if (m_context->isSampled() || memory->getAddressSpace() != AddrSpaceGlobal)
+    return;
+
+  allocAndStoreShadowMemory(AddrSpaceGlobal, address,
+                            ShadowContext::getCleanValue(size));
+}
+
 void Uninitialized::VectorOr(const WorkItem* workItem,
                              const llvm::Instruction* I)
 {
@@ -2048,7 +2286,7 @@ void Uninitialized::SimpleOrAtomic(const WorkItem* workItem,
   unsigned addrSpace = Addr->getType()->getPointerAddressSpace();
   size_t address = workItem->getOperand(Addr).getPointer();
 
-  TypedValue oldShadow = {4, 1, shadowContext.getMemoryPool()->alloc(4)};
+  TypedValue oldShadow = shadowContext.getMemoryPool()->allocValue(4, 1);
 
   TypedValue newShadow = ShadowContext::getCleanValue(4);
 
@@ -2242,7 +2480,8 @@ void Uninitialized::workGroupComplete(const WorkGroup* workGroup)
   shadowContext.destroyMemoryPool();
 }
 
-ShadowFrame::ShadowFrame() : m_values(new UnorderedTypedValueMap())
+ShadowFrame::ShadowFrame(const InterpreterCache* cache)
+    : m_call(NULL), m_cache(cache), m_values(cache->getNumValues())
 {
 #ifdef DUMP_SHADOW
   m_valuesList = new ValuesList();
@@ -2251,7 +2490,6 @@ ShadowFrame::ShadowFrame() : m_values(new UnorderedTypedValueMap())
 
 ShadowFrame::~ShadowFrame()
 {
-  delete m_values;
 #ifdef DUMP_SHADOW
   delete m_valuesList;
 #endif
@@ -2269,12 +2507,12 @@ void ShadowFrame::dump() const
   {
     if ((*itr)->hasName())
     {
-      cout << "%" << (*itr)->getName().str() << ": " << m_values->at(*itr)
+      cout << "%" << (*itr)->getName().str() << ": " << getValue(*itr)
            << endl;
     }
     else
     {
-      cout << "%" << dec << num++ << ": " << m_values->at(*itr) << endl;
+      cout << "%" << dec << num++ << ": " << getValue(*itr) << endl;
     }
   }
 #else
@@ -2288,9 +2526,10 @@ TypedValue ShadowFrame::getValue(const llvm::Value* V) const
 {
   if (llvm::isa<llvm::Instruction>(V))
   {
-    // For instructions the shadow is already stored in the map.
-    assert(m_values->count(V) && "No shadow for instruction value");
-    return m_values->at(V);
+    // For instructions the shadow is already stored in the frame.
+    const TypedValue& shadow = m_values[m_cache->getValueID(V)];
+    assert(shadow.data && "No shadow for instruction value");
+    return shadow;
   }
   else if (llvm::isa<llvm::UndefValue>(V))
   {
@@ -2298,9 +2537,10 @@ TypedValue ShadowFrame::getValue(const llvm::Value* V) const
   }
   else if (llvm::isa<llvm::Argument>(V))
   {
-    // For arguments the shadow is already stored in the map.
-    assert(m_values->count(V) && "No shadow for argument value");
-    return m_values->at(V);
+    // For arguments the shadow is already stored in the frame.
+    const TypedValue& shadow = m_values[m_cache->getValueID(V)];
+    assert(shadow.data && "No shadow for argument value");
+    return shadow;
   }
   else if (const llvm::ConstantVector* VC =
              llvm::dyn_cast<llvm::ConstantVector>(V))
@@ -2324,10 +2564,39 @@ TypedValue ShadowFrame::getValue(const llvm::Value* V) const
   }
 }
 
+bool ShadowFrame::hasValue(const llvm::Value* V) const
+{
+  if (llvm::isa<llvm::Constant>(V))
+  {
+    return true;
+  }
+  if (!m_cache->hasValue(V))
+  {
+    return false;
+  }
+  return m_values[m_cache->getValueID(V)].data != NULL;
+}
+
+void ShadowFrame::reset()
+{
+  // Only clear the slots that were written, so that recycling a frame does
+  // not cost a pass over every value in the kernel
+  for (unsigned id : m_valueIDs)
+  {
+    m_values[id].data = NULL;
+  }
+  m_valueIDs.clear();
+  m_call = NULL;
+#ifdef DUMP_SHADOW
+  m_valuesList->clear();
+#endif
+}
+
 void ShadowFrame::setValue(const llvm::Value* V, TypedValue SV)
 {
+  TypedValue& shadow = m_values[m_cache->getValueID(V)];
 #ifdef DUMP_SHADOW
-  if (!m_values->count(V))
+  if (!shadow.data)
   {
     m_valuesList->push_back(V);
   }
@@ -2336,10 +2605,15 @@ void ShadowFrame::setValue(const llvm::Value* V, TypedValue SV)
     cout << "Shadow for value " << V->getName().str() << " reset!" << endl;
   }
 #endif
-  (*m_values)[V] = SV;
+  if (!shadow.data)
+  {
+    m_valueIDs.push_back(m_cache->getValueID(V));
+  }
+  shadow = SV;
 }
 
-ShadowValues::ShadowValues() : m_stack(new ShadowValuesStack())
+ShadowValues::ShadowValues(const InterpreterCache* cache)
+    : m_cache(cache), m_stack(new ShadowValuesStack())
 {
   pushFrame(createCleanShadowFrame());
 }
@@ -2351,17 +2625,29 @@ ShadowValues::~ShadowValues()
     popFrame();
   }
 
+  for (ShadowFrame* frame : m_spareFrames)
+  {
+    delete frame;
+  }
+
   delete m_stack;
 }
 
 ShadowFrame* ShadowValues::createCleanShadowFrame()
 {
-  return new ShadowFrame();
+  if (!m_spareFrames.empty())
+  {
+    ShadowFrame* frame = m_spareFrames.back();
+    m_spareFrames.pop_back();
+    return frame;
+  }
+  return new ShadowFrame(m_cache);
 }
 
-ShadowWorkItem::ShadowWorkItem(unsigned bufferBits)
-    : m_memory(new ShadowMemory(AddrSpacePrivate, bufferBits)),
-      m_values(new ShadowValues())
+ShadowWorkItem::ShadowWorkItem(unsigned bufferBits, MemoryUsage* usage,
+                               const InterpreterCache* cache)
+    : m_memory(new ShadowMemory(AddrSpacePrivate, bufferBits, usage)),
+      m_values(new ShadowValues(cache))
 {
 }
 
@@ -2371,9 +2657,10 @@ ShadowWorkItem::~ShadowWorkItem()
   delete m_values;
 }
 
-ShadowWorkGroup::ShadowWorkGroup(unsigned bufferBits)
+ShadowWorkGroup::ShadowWorkGroup(unsigned bufferBits, MemoryUsage* usage)
     : // FIXME: Hard coded values
-      m_memory(new ShadowMemory(AddrSpaceLocal, sizeof(size_t) == 8 ? 16 : 8))
+      m_memory(
+        new ShadowMemory(AddrSpaceLocal, sizeof(size_t) == 8 ? 16 : 8, usage))
 {
 }
 
@@ -2382,8 +2669,12 @@ ShadowWorkGroup::~ShadowWorkGroup()
   delete m_memory;
 }
 
-ShadowMemory::ShadowMemory(AddressSpace addrSpace, unsigned bufferBits)
-    : m_addrSpace(addrSpace), m_map(),
+// Number of bytes covered by each word of a packed shadow
+#define SHADOW_WORD_BYTES 64
+
+ShadowMemory::ShadowMemory(AddressSpace addrSpace, unsigned bufferBits,
+                           MemoryUsage* usage)
+    : m_addrSpace(addrSpace), m_buffers(), m_usage(usage),
       m_numBitsAddress((sizeof(size_t) << 3) - bufferBits),
       m_numBitsBuffer(bufferBits)
 {
@@ -2398,38 +2689,55 @@ void ShadowMemory::allocate(size_t address, size_t size)
 {
   size_t index = extractBuffer(address);
 
-  if (m_map.count(index))
+  if (getBuffer(index))
   {
     deallocate(address);
   }
+  if (index >= m_buffers.size())
+  {
+    m_buffers.resize(index + 1, NULL);
+  }
 
+  size_t numWords = (size + SHADOW_WORD_BYTES - 1) / SHADOW_WORD_BYTES;
   Buffer* buffer = new Buffer();
   buffer->size = size;
   buffer->flags = 0;
-  buffer->data = new unsigned char[size];
+  buffer->bits.reset(new atomic<uint64_t>[numWords]);
+  buffer->numPartial = 0;
+  for (size_t i = 0; i < numWords; i++)
+  {
+    buffer->bits[i].store(0, memory_order_relaxed);
+  }
+  m_usage->allocate(numWords * sizeof(uint64_t));
 
-  m_map[index] = buffer;
+  m_buffers[index] = buffer;
 }
 
 void ShadowMemory::clear()
 {
-  MemoryMap::iterator mItr;
-  for (mItr = m_map.begin(); mItr != m_map.end(); ++mItr)
+  for (Buffer* buffer : m_buffers)
   {
-    delete[] mItr->second->data;
-    delete mItr->second;
+    if (!buffer)
+      continue;
+    size_t numWords =
+      (buffer->size + SHADOW_WORD_BYTES - 1) / SHADOW_WORD_BYTES;
+    m_usage->release(numWords * sizeof(uint64_t));
+    delete buffer;
   }
+  m_buffers.clear();
 }
 
 void ShadowMemory::deallocate(size_t address)
 {
   size_t index = extractBuffer(address);
+  Buffer* buffer = getBuffer(index);
 
-  assert(m_map.count(index) && "Cannot deallocate non existing memory!");
+  assert(buffer && "Cannot deallocate non existing memory!");
 
-  delete[] m_map.at(index)->data;
-  delete m_map.at(index);
-  m_map.at(index) = NULL;
+  size_t numWords = (buffer->size + SHADOW_WORD_BYTES - 1) / SHADOW_WORD_BYTES;
+  m_usage->release(numWords * sizeof(uint64_t));
+  delete buffer;
+  m_buffers[index] = NULL;
 }
 
 void ShadowMemory::dump() const
@@ -2437,27 +2745,28 @@ void ShadowMemory::dump() const
   cout << "====== ShadowMem (" << getAddressSpaceName(m_addrSpace)
        << ") ======";
 
-  for (unsigned b = 0, o = 1; b < m_map.size(); o++)
+  for (size_t b = 0; b < m_buffers.size(); b++)
   {
-    if (!m_map.count(b + o))
+    if (!m_buffers[b])
     {
       continue;
     }
 
-    for (unsigned i = 0; i < m_map.at(b + o)->size; i++)
+    for (size_t i = 0; i < m_buffers[b]->size; i++)
     {
+      size_t address = (b << m_numBitsAddress) | i;
+      unsigned char shadow;
+      load(&shadow, address);
+
       if (i % 4 == 0)
       {
         cout << endl
              << hex << uppercase << setw(16) << setfill(' ') << right
-             << ((((size_t)b + o) << m_numBitsAddress) | i) << ":";
+             << address << ":";
       }
       cout << " " << hex << uppercase << setw(2) << setfill('0')
-           << (int)m_map.at(b + o)->data[i];
+           << (int)shadow;
     }
-
-    ++b;
-    o = 0;
   }
   cout << endl;
 
@@ -2474,37 +2783,74 @@ size_t ShadowMemory::extractOffset(size_t address) const
   return (address & (((size_t)-1) >> m_numBitsBuffer));
 }
 
-void* ShadowMemory::getPointer(size_t address) const
+ShadowMemory::Buffer* ShadowMemory::getBuffer(size_t index) const
 {
-  size_t index = extractBuffer(address);
-  size_t offset = extractOffset(address);
-
-  assert(m_map.count(index) && "No shadow memory found!");
-
-  return m_map.at(index)->data + offset;
+  return index < m_buffers.size() ? m_buffers[index] : NULL;
 }
 
 bool ShadowMemory::isAddressValid(size_t address, size_t size) const
 {
-  size_t index = extractBuffer(address);
-  size_t offset = extractOffset(address);
-  return m_map.count(index) && (offset + size <= m_map.at(index)->size);
+  Buffer* buffer = getBuffer(extractBuffer(address));
+  return buffer && (extractOffset(address) + size <= buffer->size);
 }
 
 void ShadowMemory::load(unsigned char* dst, size_t address, size_t size) const
 {
-  size_t index = extractBuffer(address);
-  size_t offset = extractOffset(address);
-
-  if (isAddressValid(address, size))
-  {
-    assert(m_map.count(index) && "No shadow memory found!");
-    memcpy(dst, m_map.at(index)->data + offset, size);
-  }
-  else
+  if (!isAddressValid(address, size))
   {
     TypedValue v = ShadowContext::getPoisonedValue(size);
     memcpy(dst, v.data, size);
+    return;
+  }
+
+  Buffer* buffer = getBuffer(extractBuffer(address));
+  size_t offset = extractOffset(address);
+  bool partial = buffer->numPartial.load(memory_order_acquire);
+
+  size_t i = 0;
+  while (i < size)
+  {
+    // Expand the bits covered by this word in one go
+    size_t byte = offset + i;
+    size_t shift = byte % SHADOW_WORD_BYTES;
+    size_t n = min(size - i, SHADOW_WORD_BYTES - shift);
+    uint64_t mask = n < 64 ? ((1ULL << n) - 1) : ~0ULL;
+    uint64_t bits =
+      (buffer->bits[byte / SHADOW_WORD_BYTES].load(memory_order_relaxed) >>
+       shift) &
+      mask;
+
+    if (bits == 0)
+    {
+      memset(dst + i, 0, n);
+    }
+    else if (bits == mask && !partial)
+    {
+      memset(dst + i, 0xFF, n);
+    }
+    else
+    {
+      for (size_t j = 0; j < n; j++)
+      {
+        dst[i + j] = ((bits >> j) & 1) ? 0xFF : 0;
+      }
+      if (partial)
+      {
+        lock_guard<mutex> lock(buffer->partialMutex);
+        for (size_t j = 0; j < n; j++)
+        {
+          if ((bits >> j) & 1)
+          {
+            auto itr = buffer->partial.find(byte + j);
+            if (itr != buffer->partial.end())
+            {
+              dst[i + j] = itr->second;
+            }
+          }
+        }
+      }
+    }
+    i += n;
   }
 }
 
@@ -2516,13 +2862,66 @@ void ShadowMemory::lock(size_t address) const
 
 void ShadowMemory::store(const unsigned char* src, size_t address, size_t size)
 {
-  size_t index = extractBuffer(address);
+  if (!isAddressValid(address, size))
+  {
+    return;
+  }
+
+  Buffer* buffer = getBuffer(extractBuffer(address));
   size_t offset = extractOffset(address);
 
-  if (isAddressValid(address, size))
+  size_t i = 0;
+  while (i < size)
   {
-    assert(m_map.count(index) && "Cannot store to unallocated memory!");
-    memcpy(m_map.at(index)->data + offset, src, size);
+    size_t byte = offset + i;
+    size_t shift = byte % SHADOW_WORD_BYTES;
+    size_t n = min(size - i, SHADOW_WORD_BYTES - shift);
+    uint64_t mask = n < 64 ? ((1ULL << n) - 1) : ~0ULL;
+
+    // Build the packed bits for this word, noting any partial bytes
+    uint64_t bits = 0;
+    bool partial = false;
+    for (size_t j = 0; j < n; j++)
+    {
+      if (src[i + j])
+      {
+        bits |= 1ULL << j;
+        partial |= (src[i + j] != 0xFF);
+      }
+    }
+
+    if (partial || buffer->numPartial.load(memory_order_acquire))
+    {
+      // Record partial bytes before publishing their bits
+      lock_guard<mutex> lock(buffer->partialMutex);
+      for (size_t j = 0; j < n; j++)
+      {
+        if (src[i + j] && src[i + j] != 0xFF)
+        {
+          buffer->partial[byte + j] = src[i + j];
+        }
+        else
+        {
+          buffer->partial.erase(byte + j);
+        }
+      }
+      buffer->numPartial.store(buffer->partial.size(), memory_order_release);
+    }
+
+    atomic<uint64_t>& word = buffer->bits[byte / SHADOW_WORD_BYTES];
+    if (n == SHADOW_WORD_BYTES)
+    {
+      word.store(bits, memory_order_relaxed);
+    }
+    else
+    {
+      // Other bytes in this word may be stored to concurrently
+      if (bits)
+        word.fetch_or(bits << shift, memory_order_relaxed);
+      if (bits != mask)
+        word.fetch_and(~((mask & ~bits) << shift), memory_order_relaxed);
+    }
+    i += n;
   }
 }
 
@@ -2532,9 +2931,10 @@ void ShadowMemory::unlock(size_t address) const
   ATOMIC_MUTEX(offset).unlock();
 }
 
-ShadowContext::ShadowContext(unsigned bufferBits)
-    : m_globalMemory(new ShadowMemory(AddrSpaceGlobal, bufferBits)),
-      m_globalValues(), m_numBitsBuffer(bufferBits)
+ShadowContext::ShadowContext(unsigned bufferBits, MemoryUsage* usage)
+    : m_globalMemory(new ShadowMemory(AddrSpaceGlobal, bufferBits, usage)),
+      m_globalValues(), m_numBitsBuffer(bufferBits), m_usage(usage),
+      m_cache(NULL), m_cleanValues(NULL)
 {
 }
 
@@ -2578,7 +2978,8 @@ ShadowWorkItem* ShadowContext::createShadowWorkItem(const WorkItem* workItem)
 {
   assert(!m_workSpace.workItems->count(workItem) &&
          "Workitems may only have one shadow");
-  ShadowWorkItem* sWI = new ShadowWorkItem(m_numBitsBuffer);
+  ShadowWorkItem* sWI =
+    new ShadowWorkItem(m_numBitsBuffer, m_usage, m_cache);
   (*m_workSpace.workItems)[workItem] = sWI;
   return sWI;
 }
@@ -2588,7 +2989,7 @@ ShadowContext::createShadowWorkGroup(const WorkGroup* workGroup)
 {
   assert(!m_workSpace.workGroups->count(workGroup) &&
          "Workgroups may only have one shadow");
-  ShadowWorkGroup* sWG = new ShadowWorkGroup(m_numBitsBuffer);
+  ShadowWorkGroup* sWG = new ShadowWorkGroup(m_numBitsBuffer, m_usage);
   (*m_workSpace.workGroups)[workGroup] = sWG;
   return sWG;
 }
@@ -2689,7 +3090,7 @@ void ShadowContext::freeWorkGroups()
 
 TypedValue ShadowContext::getCleanValue(unsigned size)
 {
-  TypedValue v = {size, 1, m_workSpace.memoryPool->alloc(size)};
+  TypedValue v = m_workSpace.memoryPool->allocValue(size, 1);
 
   memset(v.data, 0, size);
 
@@ -2698,7 +3099,7 @@ TypedValue ShadowContext::getCleanValue(unsigned size)
 
 TypedValue ShadowContext::getCleanValue(TypedValue v)
 {
-  TypedValue c = {v.size, v.num, m_workSpace.memoryPool->alloc(v.size * v.num)};
+  TypedValue c = m_workSpace.memoryPool->allocValue(v.size, v.num);
 
   memset(c.data, 0, v.size * v.num);
 
@@ -2708,8 +3109,8 @@ TypedValue ShadowContext::getCleanValue(TypedValue v)
 TypedValue ShadowContext::getCleanValue(const llvm::Value* V)
 {
   pair<unsigned, unsigned> size = getValueSize(V);
-  TypedValue v = {size.first, size.second,
-                  m_workSpace.memoryPool->alloc(size.first * size.second)};
+  TypedValue v =
+    m_workSpace.memoryPool->allocValue(size.first, size.second);
 
   memset(v.data, 0, v.size * v.num);
 
@@ -2719,7 +3120,7 @@ TypedValue ShadowContext::getCleanValue(const llvm::Value* V)
 TypedValue ShadowContext::getCleanValue(const llvm::Type* Ty)
 {
   unsigned size = getTypeSize(Ty);
-  TypedValue v = {size, 1, m_workSpace.memoryPool->alloc(size)};
+  TypedValue v = m_workSpace.memoryPool->allocValue(size, 1);
 
   memset(v.data, 0, v.size);
 
@@ -2728,7 +3129,7 @@ TypedValue ShadowContext::getCleanValue(const llvm::Type* Ty)
 
 TypedValue ShadowContext::getPoisonedValue(unsigned size)
 {
-  TypedValue v = {size, 1, m_workSpace.memoryPool->alloc(size)};
+  TypedValue v = m_workSpace.memoryPool->allocValue(size, 1);
 
   memset(v.data, -1, size);
 
@@ -2737,7 +3138,7 @@ TypedValue ShadowContext::getPoisonedValue(unsigned size)
 
 TypedValue ShadowContext::getPoisonedValue(TypedValue v)
 {
-  TypedValue p = {v.size, v.num, m_workSpace.memoryPool->alloc(v.size * v.num)};
+  TypedValue p = m_workSpace.memoryPool->allocValue(v.size, v.num);
 
   memset(p.data, -1, v.size * v.num);
 
@@ -2747,8 +3148,8 @@ TypedValue ShadowContext::getPoisonedValue(TypedValue v)
 TypedValue ShadowContext::getPoisonedValue(const llvm::Value* V)
 {
   pair<unsigned, unsigned> size = getValueSize(V);
-  TypedValue v = {size.first, size.second,
-                  m_workSpace.memoryPool->alloc(size.first * size.second)};
+  TypedValue v =
+    m_workSpace.memoryPool->allocValue(size.first, size.second);
 
   memset(v.data, -1, v.size * v.num);
 
@@ -2758,7 +3159,7 @@ TypedValue ShadowContext::getPoisonedValue(const llvm::Value* V)
 TypedValue ShadowContext::getPoisonedValue(const llvm::Type* Ty)
 {
   unsigned size = getTypeSize(Ty);
-  TypedValue v = {size, 1, m_workSpace.memoryPool->alloc(size)};
+  TypedValue v = m_workSpace.memoryPool->allocValue(size, 1);
 
   memset(v.data, -1, v.size);
 
@@ -2772,6 +3173,10 @@ TypedValue ShadowContext::getValue(const WorkItem* workItem,
   {
     return m_globalValues.at(V);
   }
+  else if (llvm::isa<llvm::Instruction>(V) && isStaticallyClean(V))
+  {
+    return getCleanValue(V);
+  }
   else
   {
     ShadowValues* shadowValues = getShadowWorkItem(workItem)->getValues();
@@ -2823,7 +3228,7 @@ bool ShadowContext::isCleanStruct(ShadowMemory* shadowMemory, size_t address,
   if (structTy->isPacked())
   {
     unsigned size = getTypeSize(structTy);
-    TypedValue v = {size, 1, m_workSpace.memoryPool->alloc(size)};
+    TypedValue v = m_workSpace.memoryPool->allocValue(size, 1);
 
     shadowMemory->load(v.data, address, size);
 
@@ -2846,7 +3251,7 @@ bool ShadowContext::isCleanStruct(ShadowMemory* shadowMemory, size_t address,
       }
       else
       {
-        TypedValue v = {size, 1, m_workSpace.memoryPool->alloc(size)};
+        TypedValue v = m_workSpace.memoryPool->allocValue(size, 1);
 
         shadowMemory->load(v.data, address + offset, size);
 
@@ -2877,13 +3282,19 @@ bool ShadowContext::isCleanValue(TypedValue v, unsigned offset)
   return !memcmp(v.data + offset * v.size, c.data, v.size);
 }
 
+bool ShadowContext::isStaticallyClean(const llvm::Value* V) const
+{
+  return m_cleanValues && llvm::isa<llvm::Instruction>(V) &&
+         (*m_cleanValues)[m_cache->getValueID(V)];
+}
+
 void ShadowContext::setGlobalValue(const llvm::Value* V, TypedValue SV)
 {
   assert(!m_globalValues.count(V) && "Values may only have one shadow");
   m_globalValues[V] = SV;
 }
 
-void ShadowContext::shadowOr(TypedValue v1, TypedValue v2)
+void ShadowContext::shadowOr(TypedValue& v1, TypedValue v2)
 {
   assert(v1.num == v2.num &&
          "Cannot create shadow for vectors of different lengths!");
@@ -10,6 +10,8 @@
 #include "llvm/IR/Function.h"
 #include "llvm/IR/IntrinsicInst.h"
 
+#include <mutex>
+
 //#define DUMP_SHADOW
 //#define PARANOID_CHECK(W, I) assert(checkAllOperandsDefined(W, I) && "Not all
 // operands defined") #define PARANOID_CHECK(W, I) checkAllOperandsDefined(W, I)
@@ -17,13 +19,15 @@
 
 namespace oclgrind
 {
+class InterpreterCache;
+
 typedef std::unordered_map<const llvm::Value*, TypedValue>
   UnorderedTypedValueMap;
 
 class ShadowFrame
 {
 public:
-  ShadowFrame();
+  ShadowFrame(const InterpreterCache* cache);
   virtual ~ShadowFrame();
 
   void dump() const;
@@ -32,10 +36,8 @@ public:
     return m_call;
   }
   TypedValue getValue(const llvm::Value* V) const;
-  inline bool hasValue(const llvm::Value* V) const
-  {
-    return llvm::isa<llvm::Constant>(V) || m_values->count(V);
-  }
+  bool hasValue(const llvm::Value* V) const;
+  void reset();
   inline void setCall(const llvm::CallInst* CI)
   {
     m_call = CI;
@@ -46,7 +48,11 @@ private:
   typedef std::list<const llvm::Value*> ValuesList;
 
   const llvm::CallInst* m_call;
-  UnorderedTypedValueMap* m_values;
+  const InterpreterCache* m_cache;
+
+  // Shadows indexed by interpreter value ID (data is NULL if not set)
+  std::vector<TypedValue> m_values;
+  std::vector<unsigned> m_valueIDs;
 #ifdef DUMP_SHADOW
   ValuesList* m_valuesList;
 #endif
@@ -55,7 +61,7 @@ private:
 class ShadowValues
 {
 public:
-  ShadowValues();
+  ShadowValues(const InterpreterCache* cache);
   virtual ~ShadowValues();
 
   ShadowFrame* createCleanShadowFrame();
@@ -79,7 +85,8 @@ public:
   {
     ShadowFrame* frame = m_stack->top();
     m_stack->pop();
-    delete frame;
+    frame->reset();
+    m_spareFrames.push_back(frame);
   }
   inline void pushFrame(ShadowFrame* frame)
   {
@@ -97,25 +104,33 @@ public:
 private:
   typedef std::stack<ShadowFrame*> ShadowValuesStack;
 
+  const InterpreterCache* m_cache;
   ShadowValuesStack* m_stack;
+  std::vector<ShadowFrame*> m_spareFrames;
 };
 
 class ShadowMemory
 {
 public:
+  // Shadow is packed to one bit per byte, which is set if any bit of the
+  // byte is uninitialized. Partially initialized bytes are rare, and are
+  // kept in a side table instead.
   struct Buffer
   {
     size_t size;
     cl_mem_flags flags;
-    unsigned char* data;
+    std::unique_ptr<std::atomic<uint64_t>[]> bits;
+    std::atomic<size_t> numPartial;
+    std::mutex partialMutex;
+    std::unordered_map<size_t, unsigned char> partial;
   };
 
-  ShadowMemory(AddressSpace addrSpace, unsigned bufferBits);
+  ShadowMemory(AddressSpace addrSpace, unsigned bufferBits,
+               MemoryUsage* usage);
   virtual ~ShadowMemory();
 
   void allocate(size_t address, size_t size);
   void dump() const;
-  void* getPointer(size_t address) const;
   bool isAddressValid(size_t address, size_t size = 1) const;
   void load(unsigned char* dst, size_t address, size_t size = 1) const;
   void lock(size_t address) const;
@@ -123,10 +138,9 @@ public:
   void unlock(size_t address) const;
 
 private:
-  typedef std::unordered_map<size_t, Buffer*> MemoryMap;
-
   AddressSpace m_addrSpace;
-  MemoryMap m_map;
+  std::vector<Buffer*> m_buffers;
+  MemoryUsage* m_usage;
   unsigned m_numBitsAddress;
   unsigned m_numBitsBuffer;
 
@@ -134,12 +148,14 @@ private:
   void deallocate(size_t address);
   size_t extractBuffer(size_t address) const;
   size_t extractOffset(size_t address) const;
+  Buffer* getBuffer(size_t index) const;
 };
 
 class ShadowWorkItem
 {
 public:
-  ShadowWorkItem(unsigned bufferBits);
+  ShadowWorkItem(unsigned bufferBits, MemoryUsage* usage,
+                 const InterpreterCache* cache);
   virtual ~ShadowWorkItem();
 
   inline void dump() const
@@ -164,7 +180,7 @@ private:
 class ShadowWorkGroup
 {
 public:
-  ShadowWorkGroup(unsigned bufferBits);
+  ShadowWorkGroup(unsigned bufferBits, MemoryUsage* usage);
   virtual ~ShadowWorkGroup();
 
   inline void dump() const
@@ -183,7 +199,7 @@ private:
 class ShadowContext
 {
 public:
-  ShadowContext(unsigned bufferBits);
+  ShadowContext(unsigned bufferBits, MemoryUsage* usage);
   virtual ~ShadowContext();
 
   void allocateWorkItems();
@@ -228,6 +244,7 @@ public:
   inline bool hasValue(const WorkItem* workItem, const llvm::Value* V) const
   {
     return llvm::isa<llvm::Constant>(V) || m_globalValues.count(V) ||
+           isStaticallyClean(V) ||
            m_workSpace.workItems->at(workItem)->getValues()->hasValue(V);
   }
   static bool isCleanImage(const TypedValue shadowImage);
@@ -239,13 +256,23 @@ public:
   static bool isCleanValue(unsigned long v);
   static bool isCleanValue(TypedValue v);
   static bool isCleanValue(TypedValue v, unsigned offset);
+  bool isStaticallyClean(const llvm::Value* V) const;
   void setGlobalValue(const llvm::Value* V, TypedValue SV);
-  static void shadowOr(TypedValue v1, TypedValue v2);
+  inline void setInterpreterCache(const InterpreterCache* cache,
+                                  const std::vector<bool>* cleanValues)
+  {
+    m_cache = cache;
+    m_cleanValues = cleanValues;
+  }
+  static void shadowOr(TypedValue& v1, TypedValue v2);
 
 private:
   ShadowMemory* m_globalMemory;
   UnorderedTypedValueMap m_globalValues;
   unsigned m_numBitsBuffer;
+  MemoryUsage* m_usage;
+  const InterpreterCache* m_cache;
+  const std::vector<bool>* m_cleanValues;
   typedef std::map<const WorkItem*, ShadowWorkItem*> ShadowItemMap;
   typedef std::map<const WorkGroup*, ShadowWorkGroup*> ShadowGroupMap;
   struct WorkSpace
@@ -264,15 +291,22 @@ public:
   Uninitialized(const Context* context);
   virtual ~Uninitialized();
 
-  virtual void hostMemoryStore(const Memory* memory, size_t address,
-                               size_t size, const uint8_t* storeData) override;
+  virtual uint32_t getCallbacks() const override;
+  virtual uint32_t getUnsampledCallbacks() const override;
+  virtual void hostMemoryTransfer(const HostTransfer& transfer) override;
   virtual void instructionExecuted(const WorkItem* workItem,
                                    const llvm::Instruction* instruction,
                                    const TypedValue& result) override;
   virtual void kernelBegin(const KernelInvocation* kernelInvocation) override;
   virtual void kernelEnd(const KernelInvocation* kernelInvocation) override;
+  virtual void memoryAtomicStore(const Memory* memory, const WorkItem* workItem,
+                                 AtomicOp op, size_t address,
+                                 size_t size) override;
   virtual void memoryMap(const Memory* memory, size_t address, size_t offset,
                          size_t size, cl_map_flags flags) override;
+  virtual void memoryStore(const Memory* memory, const WorkItem* workItem,
+                           size_t address, size_t size,
+                           const uint8_t* storeData) override;
   virtual void workItemBegin(const WorkItem* workItem) override;
   virtual void workItemComplete(const WorkItem* workItem) override;
   virtual void workGroupBegin(const WorkGroup* workGroup) override;
@@ -286,10 +320,24 @@ private:
   ShadowContext shadowContext;
   MemoryPool m_pool;
 
+  // Whether some work-groups may go unsampled, in which case their global
+  // stores are needed to keep the shadow memory up to date
+  bool m_sampling;
+
+  // Values that can never be uninitialized, indexed by value ID
+  struct StaticAnalysis
+  {
+    const InterpreterCache* cache;
+    std::vector<bool> clean;
+  };
+  std::unordered_map<const llvm::Function*, StaticAnalysis> m_staticAnalyses;
+
   void allocAndStoreShadowMemory(unsigned addrSpace, size_t address,
                                  TypedValue SM, const WorkItem* workItem = NULL,
                                  const WorkGroup* workGroup = NULL,
                                  bool unchecked = false);
+  const std::vector<bool>* analyseKernel(const llvm::Function* kernel,
+                                        const InterpreterCache* cache);
   bool checkAllOperandsDefined(const WorkItem* workItem,
                                const llvm::Instruction* I);
   void checkStructMemcpy(const WorkItem* workItem, const llvm::Value* src);
@@ -21,6 +21,7 @@
 #include <math.h>
 #include <numeric>
 #include <sstream>
+#include <thread>
 
 #include "llvm/IR/DebugLoc.h"
 #include "llvm/IR/Function.h"
@@ -39,12 +40,24 @@ using namespace std;
 THREAD_LOCAL WorkloadCharacterisation::WorkerState
     WorkloadCharacterisation::m_state = {NULL};
 
+// Report for the previous kernel, written in the background
+static std::mutex reportMutex;
+static std::thread reportThread;
+
+static void waitForReport() {
+  lock_guard<mutex> lock(reportMutex);
+  if (reportThread.joinable())
+    reportThread.join();
+}
+
 WorkloadCharacterisation::WorkloadCharacterisation(const Context *context) : WorkloadCharacterisation::Plugin(context) {
   m_numberOfHostToDeviceCopiesBeforeKernelNamed = 0;
   m_last_kernel_name = "";
 }
 
 WorkloadCharacterisation::~WorkloadCharacterisation() {
+  waitForReport();
+
   locale previousLocale = cout.getloc();
   locale defaultLocale("");
   cout.imbue(defaultLocale);
@@ -53,24 +66,19 @@ WorkloadCharacterisation::~WorkloadCharacterisation() {
   cout << "+-------------------------------------------------------------------------------------------------------+" << endl;
   cout << "|Memory Transfers -- statistics around host to device and device to host memory transfers               |" << endl;
   cout << "+=======================================================================================================+" << endl;
-  // I can't imagine a scenario where data are copied from the device before a kernel is executed. So I use the deviceToHostCopy kernel names for the final statistics -- these names for the m_hostToDeviceCopy's are updated when the kernel is enqueued.
-  std::vector<std::string> x = m_deviceToHostCopy;
-  std::vector<std::string>::iterator unique_x = std::unique(x.begin(), x.end());
-  x.resize(std::distance(x.begin(), unique_x));
-  std::vector<std::string> unique_kernels_involved_with_device_to_host_copies = x;
-
-  x = m_hostToDeviceCopy;
-  unique_x = std::unique(x.begin(), x.end());
-  x.resize(std::distance(x.begin(), unique_x));
-  std::vector<std::string> unique_kernels_involved_with_host_to_device_copies = x;
+  // Copies to the device made after the last kernel are counted against it
+  if (m_numberOfHostToDeviceCopiesBeforeKernelNamed) {
+    m_hostToDeviceCopies[m_last_kernel_name] += m_numberOfHostToDeviceCopiesBeforeKernelNamed;
+    m_numberOfHostToDeviceCopiesBeforeKernelNamed = 0;
+  }
 
   cout << "Total Host To Device Transfers (#) for kernel:" << endl;
-  for (auto const &item : unique_kernels_involved_with_host_to_device_copies) {
-    cout << "\t" << item << ": " << std::count(m_hostToDeviceCopy.begin(), m_hostToDeviceCopy.end(), item) << endl;
+  for (auto const &item : m_hostToDeviceCopies) {
+    cout << "\t" << item.first << ": " << item.second << endl;
   }
   cout << "Total Device To Host Transfers (#) for kernel:" << endl;
-  for (auto const &item : unique_kernels_involved_with_device_to_host_copies) {
-    cout << "\t" << item << ": " << std::count(m_deviceToHostCopy.begin(), m_deviceToHostCopy.end(), item) << endl;
+  for (auto const &item : m_deviceToHostCopies) {
+    cout << "\t" << item.first << ": " << item.second << endl;
   }
 
   //write it out to special .csv file
@@ -85,11 +93,11 @@ WorkloadCharacterisation::~WorkloadCharacterisation() {
   assert(logfile);
   logfile << "metric,kernel,count\n";
 
-  for (auto const &item : unique_kernels_involved_with_host_to_device_copies) {
-    logfile << "transfer: host to device," << item << "," << std::count(m_hostToDeviceCopy.begin(), m_hostToDeviceCopy.end(), item) << "\n";
+  for (auto const &item : m_hostToDeviceCopies) {
+    logfile << "transfer: host to device," << item.first << "," << item.second << "\n";
   }
-  for (auto const &item : unique_kernels_involved_with_device_to_host_copies) {
-    logfile << "transfer: device to host," << item << "," << std::count(m_deviceToHostCopy.begin(), m_deviceToHostCopy.end(), item) << "\n";
+  for (auto const &item : m_deviceToHostCopies) {
+    logfile << "transfer: device to host," << item.first << "," << item.second << "\n";
   }
   logfile.close();
 
@@ -97,25 +105,63 @@ WorkloadCharacterisation::~WorkloadCharacterisation() {
   cout.imbue(previousLocale);
 }
 
-void WorkloadCharacterisation::hostMemoryLoad(const Memory *memory, size_t address, size_t size) {
-  //device to host copy -- synchronization
-  m_deviceToHostCopy.push_back(m_last_kernel_name);
+uint32_t WorkloadCharacterisation::getCallbacks() const {
+  return CALLBACK_BIT(CallbackHostMemoryTransfer) |
+         CALLBACK_BIT(CallbackInstructionExecuted) |
+         CALLBACK_BIT(CallbackMemoryLoad) |
+         CALLBACK_BIT(CallbackMemoryStore) |
+         CALLBACK_BIT(CallbackMemoryAtomicLoad) |
+         CALLBACK_BIT(CallbackMemoryAtomicStore) |
+         CALLBACK_BIT(CallbackKernelBegin) |
+         CALLBACK_BIT(CallbackKernelEnd) |
+         CALLBACK_BIT(CallbackWorkGroupBegin) |
+         CALLBACK_BIT(CallbackWorkGroupComplete) |
+         CALLBACK_BIT(CallbackWorkGroupBarrier) |
+         CALLBACK_BIT(CallbackWorkItemBegin) |
+         CALLBACK_BIT(CallbackWorkItemComplete) |
+         CALLBACK_BIT(CallbackWorkItemBarrier) |
+         CALLBACK_BIT(CallbackWorkItemClearBarrier);
+}
+
+uint32_t WorkloadCharacterisation::getUnsampledCallbacks() const {
+  return CALLBACK_BIT(CallbackHostMemoryTransfer) |
+         CALLBACK_BIT(CallbackKernelBegin) |
+         CALLBACK_BIT(CallbackKernelEnd);
 }
 
-void WorkloadCharacterisation::hostMemoryStore(const Memory *memory, size_t address, size_t size, const uint8_t *storeData) {
-  //host to device copy -- synchronization
-  m_hostToDeviceCopy.push_back(m_last_kernel_name);
-  m_numberOfHostToDeviceCopiesBeforeKernelNamed++;
+void WorkloadCharacterisation::hostMemoryTransfer(const HostTransfer &transfer) {
+  //device to host copy -- synchronization
+  if (!transfer.loads.empty())
+    m_deviceToHostCopies[m_last_kernel_name]++;
+
+  //host to device copy -- counted once the next kernel is known
+  if (!transfer.stores.empty())
+    m_numberOfHostToDeviceCopiesBeforeKernelNamed++;
 }
 
+#define PSL_MAX_TIMESTEPS 256
+
 void WorkloadCharacterisation::threadMemoryLedger(size_t address, uint32_t timestep, Size3 localID) {
-  WorkloadCharacterisation::ledgerElement le;
-  le.address = address;
-  le.timestep = timestep;
-  (m_state.ledger)//[groupID.x * m_group_num.x + groupID.y * m_group_num.y 
-        // + groupID.z * m_group_num.z]
-        [localID.x * m_local_num.y * m_local_num.z + localID.y * m_local_num.z 
-         + localID.z].push_back(le);
+  LocalitySketch &sketch = m_state.locality;
+  uint32_t &count = sketch.accessCounts[localID.x * m_local_num.y * m_local_num.z + localID.y * m_local_num.z 
+         + localID.z];
+  timestep = count++;
+  sketch.maxLength = count > sketch.maxLength ? count : sketch.maxLength;
+  if (timestep % sketch.stride)
+    return;
+
+  sketch.histograms[timestep][address]++;
+  if (sketch.histograms.size() > PSL_MAX_TIMESTEPS) {
+    // sampled timesteps are a subset of those already tracked, so every
+    // remaining histogram stays complete
+    sketch.stride *= 2;
+    for (auto it = sketch.histograms.begin(); it != sketch.histograms.end();) {
+      if (it->first % sketch.stride)
+        it = sketch.histograms.erase(it);
+      else
+        it++;
+    }
+  }
 }
 
 void WorkloadCharacterisation::memoryLoad(const Memory *memory, const WorkItem *workItem, size_t address, size_t size) {
@@ -230,7 +276,7 @@ void WorkloadCharacterisation::instructionExecuted(
       OS.flush();
       m_state.target2 = Str;
       llvm::DebugLoc loc = instruction->getDebugLoc();
-      m_state.branch_loc = loc.getLine();
+      m_state.branch_loc = loc ? loc.getLine() : 0;
     }
   }
 
@@ -250,16 +296,10 @@ void WorkloadCharacterisation::workItemBarrier(const WorkItem *workItem) {
   m_state.instruction_count = 0;
 }
 
-vector<double> parallelSpatialLocality(vector < vector < WorkloadCharacterisation::ledgerElement> > hist);
-
 void WorkloadCharacterisation::workGroupBarrier(const WorkGroup *workGroup, uint32_t flags) {
-  vector<double> psl = parallelSpatialLocality(m_state.ledger);
-  size_t maxLength = 0;
-  for (size_t i = 0; i < m_state.ledger.size(); i++) {
-    maxLength = m_state.ledger[i].size() > maxLength ? m_state.ledger[i].size() : maxLength;
-    m_state.ledger[i].clear();
-  }
-  m_state.psl_per_barrier->push_back(std::make_pair(psl, maxLength));
+  vector<double> psl = parallelSpatialLocality(m_state.locality);
+  m_state.psl_per_barrier->push_back(std::make_pair(psl, m_state.locality.maxLength));
+  resetLocality(m_state.locality, m_state.locality.accessCounts.size());
 }
 
 void WorkloadCharacterisation::workItemClearBarrier(const WorkItem *workItem) {
@@ -286,11 +326,10 @@ void WorkloadCharacterisation::kernelBegin(const KernelInvocation *kernelInvocat
   //update the list of memory copies from host to device; since the only reason to write to the device is before an execution.
   m_last_kernel_name = kernelInvocation->getKernel()->getName();
 
-  int end_of_list = m_hostToDeviceCopy.size() - 1;
-  for (int i = 0; i < m_numberOfHostToDeviceCopiesBeforeKernelNamed; i++) {
-    m_hostToDeviceCopy[end_of_list - i] = m_last_kernel_name;
+  if (m_numberOfHostToDeviceCopiesBeforeKernelNamed) {
+    m_hostToDeviceCopies[m_last_kernel_name] += m_numberOfHostToDeviceCopiesBeforeKernelNamed;
+    m_numberOfHostToDeviceCopiesBeforeKernelNamed = 0;
   }
-  m_numberOfHostToDeviceCopiesBeforeKernelNamed = 0;
 
   //m_memoryOps.clear();
   m_storeOps.clear();
@@ -313,10 +352,11 @@ void WorkloadCharacterisation::kernelBegin(const KernelInvocation *kernelInvocat
   m_group_num = kernelInvocation->getNumGroups();
   m_local_num = kernelInvocation->getLocalSize();
   m_psl_per_group = vector<vector<double>>();
+  m_groupResults.clear();
 }
 
 
-vector<double> entropy(unordered_map<size_t, uint32_t> histogram) {
+vector<double> entropy(const unordered_map<size_t, uint32_t> &histogram) {
   std::vector<std::unordered_map<size_t, uint32_t>> local_address_count(11, unordered_map<size_t, uint32_t>());
   local_address_count[0] = histogram;
   uint64_t total_access_count = 0;
@@ -347,45 +387,114 @@ vector<double> entropy(unordered_map<size_t, uint32_t> histogram) {
   return loc_entropy;
 }
 
-vector<double> parallelSpatialLocality(vector < vector < WorkloadCharacterisation::ledgerElement> > hist) {
-  size_t maxLength = 0;
-  for (size_t i = 0; i < hist.size(); i++)
-    maxLength = hist[i].size() > maxLength ? hist[i].size() : maxLength;
-  
-  unordered_map <size_t, uint32_t> histogram;
-  vector<vector<double>> entropies = vector<vector<double>>(maxLength);
-
-  for (size_t i = 0; i < maxLength; i++) { // for each timestep
-    histogram.clear();
-    for (size_t j = 0; j < hist.size(); j++) {
-      if (i >= hist[j].size())
-        continue;
-      WorkloadCharacterisation::ledgerElement current = hist[j][i];
-      histogram[current.address] = histogram[current.address] + 1;
-    }
-
-    entropies[i] = entropy(histogram);
-  }
-
+vector<double> WorkloadCharacterisation::parallelSpatialLocality(const LocalitySketch &sketch) {
+  // sum entropies of the sampled timesteps, then scale up to the number of
+  // timesteps actually seen (exact when nothing was dropped)
   vector<double> psl = vector<double>(11, 0.0);
-  for (uint32_t i = 0; i < 11; i++) {
-    for (size_t j = 0; j < entropies.size(); j++) 
-      psl[i] += entropies[j][i];
-    psl[i] = psl[i] * 1.0/ ((double)entropies.size() + 1);
+  for (const auto &timestep : sketch.histograms) {
+    vector<double> e = entropy(timestep.second);
+    for (uint32_t i = 0; i < 11; i++)
+      psl[i] += e[i];
   }
+
+  if (sketch.histograms.empty())
+    return psl;
+
+  double scale = (double)sketch.maxLength / sketch.histograms.size();
+  for (uint32_t i = 0; i < 11; i++)
+    psl[i] = psl[i] * scale / ((double)sketch.maxLength + 1);
   return psl;
 }
 
+void WorkloadCharacterisation::resetLocality(LocalitySketch &sketch, size_t numWorkItems) {
+  sketch.accessCounts.assign(numWorkItems, 0);
+  sketch.histograms.clear();
+  sketch.stride = 1;
+  sketch.maxLength = 0;
+}
+
 void WorkloadCharacterisation::kernelEnd(const KernelInvocation *kernelInvocation) {
+  std::string kernel_name = kernelInvocation->getKernel()->getName();
+
+  const char *format = getenv("OCLGRIND_WORKLOAD_CHARACTERISATION_FORMAT");
+  bool binary = format && !strcmp(format, "binary");
+
+  std::string logfile_name;
+  const char *result_path = getenv("OCLGRIND_WORKLOAD_CHARACTERISATION_OUTPUT_PATH");
+  if (result_path != NULL){
+    logfile_name = std::string(result_path);
+  }else{
+    // only probe for a free file name the first time each kernel is seen
+    const char *extension = binary ? ".aiwc" : ".csv";
+    auto count = m_logfileCounts.find(kernel_name);
+    if (count == m_logfileCounts.end()) {
+      int logfile_count = 0;
+      while (std::ifstream("aiwc_" + kernel_name + "_" + std::to_string(logfile_count) + extension))
+        logfile_count++;
+      count = m_logfileCounts.insert(std::make_pair(kernel_name, logfile_count)).first;
+    }
+    logfile_name = "aiwc_" + kernel_name + "_" + std::to_string(count->second++) + extension;
+  }
+
+  // Combine the lists of each work-group in group order
+  for (auto &group : m_groupResults) {
+    GroupResults &results = group.second;
+    m_instructionsToBarrier.insert(m_instructionsToBarrier.end(), results.instructionsToBarrier.begin(), results.instructionsToBarrier.end());
+    m_instructionsPerWorkitem.insert(m_instructionsPerWorkitem.end(), results.instructionsPerWorkitem.begin(), results.instructionsPerWorkitem.end());
+    m_instructionsBetweenLoadOrStore.insert(m_instructionsBetweenLoadOrStore.end(), results.instructionsBetweenLoadOrStore.begin(), results.instructionsBetweenLoadOrStore.end());
+    m_psl_per_group.push_back(std::move(results.psl));
+  }
+  m_groupResults.clear();
+
+  // Hand the counters over to a report, leaving this kernel's state empty
+  KernelReport *report = new KernelReport;
+  report->m_kernelName = kernel_name;
+  report->m_logfileName = logfile_name;
+  report->m_binary = binary;
+  report->m_computeOps.swap(m_computeOps);
+  report->m_storeOps.swap(m_storeOps);
+  report->m_loadOps.swap(m_loadOps);
+  report->m_branchPatterns.swap(m_branchPatterns);
+  report->m_branchCounts.swap(m_branchCounts);
+  report->m_instructionsToBarrier.swap(m_instructionsToBarrier);
+  report->m_instructionWidth.swap(m_instructionWidth);
+  report->m_instructionsPerWorkitem.swap(m_instructionsPerWorkitem);
+  report->m_instructionsBetweenLoadOrStore.swap(m_instructionsBetweenLoadOrStore);
+  report->m_loadInstructionLabels.swap(m_loadInstructionLabels);
+  report->m_storeInstructionLabels.swap(m_storeInstructionLabels);
+  report->m_psl_per_group.swap(m_psl_per_group);
+  report->m_threads_invoked = m_threads_invoked;
+  report->m_barriers_hit = m_barriers_hit;
+  report->m_global_memory_access = m_global_memory_access;
+  report->m_constant_memory_access = m_constant_memory_access;
+  report->m_local_memory_access = m_local_memory_access;
+  report->m_group_num = m_group_num;
+  report->m_local_num = m_local_num;
+  report->m_sampling_factor = kernelInvocation->isSampling() ? kernelInvocation->getSamplingFactor() : 1.0;
+  m_threads_invoked = 0;
+
+  // Generate the report while the application carries on, making sure any
+  // pending report is finished before the process exits
+  static std::once_flag registered;
+  std::call_once(registered, []() { atexit(waitForReport); });
+  waitForReport();
+  lock_guard<mutex> lock(reportMutex);
+  reportThread = std::thread([report]() {
+    report->write();
+    delete report;
+  });
+}
+
+void WorkloadCharacterisation::KernelReport::write() {
   // Load default locale
-  locale previousLocale = cout.getloc();
+  std::ostringstream out;
   locale defaultLocale("");
-  cout.imbue(defaultLocale);
+  out.imbue(defaultLocale);
 
-  cout << endl
-       << "# Architecture-Independent Workload Characterization of kernel: " << kernelInvocation->getKernel()->getName() << endl;
+  out << endl
+       << "# Architecture-Independent Workload Characterization of kernel: " << m_kernelName << endl;
 
-  cout << endl
+  out << endl
        << "## Compute" << endl
        << endl;
 
@@ -394,13 +503,13 @@ void WorkloadCharacterisation::kernelEnd(const KernelInvocation *kernelInvocatio
     return (left.second > right.second);
   });
 
-  cout << "|" << setw(20) << left << "Opcode"
+  out << "|" << setw(20) << left << "Opcode"
        << "|" << setw(12) << right << "count"
        << "|" << endl;
-  cout << "|--------------------|-----------:|" << endl;
+  out << "|--------------------|-----------:|" << endl;
   for (auto const &item : sorted_ops)
-    cout << "|" << setw(20) << left << item.first << "|" << setw(12) << right << item.second << "|" << endl;
-  cout << endl;
+    out << "|" << setw(20) << left << item.first << "|" << setw(12) << right << item.second << "|" << endl;
+  out << endl;
 
   size_t operation_count = 0;
   for (auto const &item : sorted_ops)
@@ -410,31 +519,31 @@ void WorkloadCharacterisation::kernelEnd(const KernelInvocation *kernelInvocatio
   size_t total_instruction_count = operation_count;
   operation_count = 0;
 
-  cout << "unique opcodes required to cover 90\% of dynamic instructions: ";
+  out << "unique opcodes required to cover 90\% of dynamic instructions: ";
   while (operation_count < significant_operation_count) {
     if (major_operations > 0)
-      cout << ", ";
+      out << ", ";
     operation_count += sorted_ops[major_operations].second;
-    cout << sorted_ops[major_operations].first;
+    out << sorted_ops[major_operations].first;
     major_operations++;
   }
-  cout << endl
+  out << endl
        << endl;
 
-  cout << "num unique opcodes required to cover 90\% of dynamic instructions: " << major_operations << endl
+  out << "num unique opcodes required to cover 90\% of dynamic instructions: " << major_operations << endl
        << endl;
-  cout << "Total Instruction Count: " << total_instruction_count << endl;
+  out << "Total Instruction Count: " << total_instruction_count << endl;
 
-  cout << endl
+  out << endl
        << "## Parallelism" << endl;
 
-  cout << endl
+  out << endl
        << "### Utilization" << endl
        << endl;
 
   double freedom_to_reorder = std::accumulate(m_instructionsBetweenLoadOrStore.begin(), m_instructionsBetweenLoadOrStore.end(), 0.0);
   freedom_to_reorder = freedom_to_reorder / m_instructionsBetweenLoadOrStore.size();
-  cout << "Freedom to Reorder: " << setprecision(2) << freedom_to_reorder << endl
+  out << "Freedom to Reorder: " << setprecision(2) << freedom_to_reorder << endl
        << endl;
 
   double resource_pressure = 0;
@@ -443,21 +552,26 @@ void WorkloadCharacterisation::kernelEnd(const KernelInvocation *kernelInvocatio
   for (auto const &item : m_loadInstructionLabels)
     resource_pressure += item.second;
   resource_pressure = resource_pressure / m_threads_invoked;
-  cout << "Resource Pressure: " << setprecision(2) << resource_pressure << endl;
+  out << "Resource Pressure: " << setprecision(2) << resource_pressure << endl;
 
-  cout << endl
+  out << endl
        << "### Thread-Level Parallelism" << endl
        << endl;
 
-  cout << "Work-items: " << m_threads_invoked << endl
+  out << "Work-items: " << m_threads_invoked << endl
        << endl;
+  if (m_sampling_factor != 1.0) {
+    // counts below cover only the sampled work-groups
+    out << "Sampling Factor: " << m_sampling_factor << endl
+         << endl;
+  }
   double granularity = 1.0 / static_cast<double>(m_threads_invoked);
-  cout << "Granularity: " << granularity << endl
+  out << "Granularity: " << granularity << endl
        << endl;
 
-  cout << "Total Barriers Hit: " << m_barriers_hit << endl
+  out << "Total Barriers Hit: " << m_barriers_hit << endl
        << endl;
-  //cout << "num barriers hit per thread: " << m_instructionsToBarrier.size()/m_threads_invoked << endl;
+  //out << "num barriers hit per thread: " << m_instructionsToBarrier.size()/m_threads_invoked << endl;
   uint32_t itb_min = *std::min_element(m_instructionsToBarrier.begin(), m_instructionsToBarrier.end());
   uint32_t itb_max = *std::max_element(m_instructionsToBarrier.begin(), m_instructionsToBarrier.end());
 
@@ -472,13 +586,13 @@ void WorkloadCharacterisation::kernelEnd(const KernelInvocation *kernelInvocatio
     itb_median = itb[size / 2];
   }
 
-  cout << "Instructions to Barrier (min/max/median): " << itb_min << "/" << itb_max << "/" << itb_median << endl
+  out << "Instructions to Barrier (min/max/median): " << itb_min << "/" << itb_max << "/" << itb_median << endl
        << endl;
   double barriers_per_instruction = static_cast<double>(m_barriers_hit + m_threads_invoked) / static_cast<double>(total_instruction_count);
-  cout << "Barriers per Instruction: " << barriers_per_instruction << endl
+  out << "Barriers per Instruction: " << barriers_per_instruction << endl
        << endl;
 
-  cout << "### Work Distribution" << endl
+  out << "### Work Distribution" << endl
        << endl;
 
   uint32_t ipt_min = *std::min_element(m_instructionsPerWorkitem.begin(), m_instructionsPerWorkitem.end());
@@ -494,10 +608,10 @@ void WorkloadCharacterisation::kernelEnd(const KernelInvocation *kernelInvocatio
   } else {
     ipt_median = ipt[size / 2];
   }
-  cout << "Instructions per Thread (min/max/median): " << ipt_min << "/" << ipt_max << "/" << ipt_median << endl
+  out << "Instructions per Thread (min/max/median): " << ipt_min << "/" << ipt_max << "/" << ipt_median << endl
        << endl;
 
-  cout << "### Data Parallelism" << endl
+  out << "### Data Parallelism" << endl
        << endl;
 
   using pair_type = decltype(m_instructionWidth)::value_type;
@@ -516,46 +630,41 @@ void WorkloadCharacterisation::kernelEnd(const KernelInvocation *kernelInvocatio
   std::transform(m_instructionWidth.begin(), m_instructionWidth.end(), diff.begin(), [simd_mean](const pair_type &x) { return (x.first - simd_mean) * (x.first - simd_mean) * x.second; });
   double simd_sq_sum = std::accumulate(diff.begin(), diff.end(), 0.0);
   double simd_stdev = std::sqrt(simd_sq_sum / (double)simd_num);
-  cout << "SIMD Width (min/max/mean/stdev): " << simd_min << "/" << simd_max << "/" << simd_mean << "/" << simd_stdev << endl
+  out << "SIMD Width (min/max/mean/stdev): " << simd_min << "/" << simd_max << "/" << simd_mean << "/" << simd_stdev << endl
        << endl;
 
   double instructions_per_operand = static_cast<double>(total_instruction_count) / simd_sum;
-  cout << "Instructions per Operand: " << instructions_per_operand << endl
+  out << "Instructions per Operand: " << instructions_per_operand << endl
        << endl;
 
-  cout << "## Memory" << endl
+  out << "## Memory" << endl
        << endl;
 
-  cout << "### Memory Footprint" << endl
+  out << "### Memory Footprint" << endl
        << endl;
 
   // count accesses to memory addresses with different numbers of retained
-  // significant bits
+  // significant bits, one thread per number of bits skipped
   std::vector<std::unordered_map<size_t, uint32_t>> local_address_count(11);
-  // for (const auto &m : m_memoryOps) {
-  //   for (int nskip = 0; nskip <= 10; nskip++) {
-  //     size_t local_addr = m.first >> nskip;
-  //     local_address_count[nskip][local_addr] += m.second;
-  //   }
-  // }
+  std::vector<std::thread> counters;
+  for (int nskip = 0; nskip <= 10; nskip++) {
+    counters.push_back(std::thread([this, nskip, &local_address_count]() {
+      std::unordered_map<size_t, uint32_t> &count = local_address_count[nskip];
+      for (const auto &m : m_storeOps)
+        count[m.first >> nskip] += m.second;
+      for (const auto &m : m_loadOps)
+        count[m.first >> nskip] += m.second;
+    }));
+  }
+  for (auto &counter : counters)
+    counter.join();
+
   size_t load_count = 0;
   size_t store_count = 0;
-
-  for (const auto &m : m_storeOps) {
-    for (int nskip = 0; nskip <= 10; nskip++) {
-      size_t local_addr = m.first >> nskip;
-      local_address_count[nskip][local_addr] += m.second;
-    }
+  for (const auto &m : m_storeOps)
     store_count += m.second;
-  }
-
-  for (const auto &m : m_loadOps) {
-    for (int nskip = 0; nskip <= 10; nskip++) {
-      size_t local_addr = m.first >> nskip;
-      local_address_count[nskip][local_addr] += m.second;
-    }
+  for (const auto &m : m_loadOps)
     load_count += m.second;
-  }
 
   std::vector<std::pair<size_t, uint32_t>> sorted_count(local_address_count[0].size());
   std::partial_sort_copy(local_address_count[0].begin(), local_address_count[0].end(), sorted_count.begin(), sorted_count.end(), [](const std::pair<size_t, uint32_t> &left, const std::pair<size_t, uint32_t> &right) {
@@ -565,24 +674,24 @@ void WorkloadCharacterisation::kernelEnd(const KernelInvocation *kernelInvocatio
   size_t memory_access_count = 0;
   for (auto const &e : sorted_count) {
     memory_access_count += e.second;
-    //cout << "address: "<< e.first << " accessed: " << e.second << " times!" << endl;
+    //out << "address: "<< e.first << " accessed: " << e.second << " times!" << endl;
   }
 
-  cout << "num memory accesses: " << memory_access_count << endl
+  out << "num memory accesses: " << memory_access_count << endl
        << endl;
-  cout << "Total Memory Footprint -- num unique memory addresses accessed: " << local_address_count[0].size() << endl;
-  cout << "                          num unique memory addresses read:     " << m_storeOps.size() << endl;
-  cout << "                          num unique memory addresses written:  " << m_loadOps.size()  << endl;
-  cout << "                          unique read/write ratio:              " 
+  out << "Total Memory Footprint -- num unique memory addresses accessed: " << local_address_count[0].size() << endl;
+  out << "                          num unique memory addresses read:     " << m_storeOps.size() << endl;
+  out << "                          num unique memory addresses written:  " << m_loadOps.size()  << endl;
+  out << "                          unique read/write ratio:              " 
        << setprecision(4) << (float) (((double)m_loadOps.size()) / ((double)m_storeOps.size()))  << endl;
-  cout << "                          total reads:                          " << load_count    << endl;
-  cout << "                          total writes:                         " << store_count    << endl;
-  cout << "                          re-reads:                             " << setprecision(4)
+  out << "                          total reads:                          " << load_count    << endl;
+  out << "                          total writes:                         " << store_count    << endl;
+  out << "                          re-reads:                             " << setprecision(4)
        << (float)((double)load_count / (double)m_loadOps.size()) << endl;
-  cout << "                          re-writes:                            " << setprecision(4)
+  out << "                          re-writes:                            " << setprecision(4)
        << (float)((double)store_count / (double)m_storeOps.size()) << endl << endl;
   size_t significant_memory_access_count = (size_t)ceil(memory_access_count * 0.9);
-  cout << "90\% of memory accesses: " << significant_memory_access_count << endl
+  out << "90\% of memory accesses: " << significant_memory_access_count << endl
        << endl;
 
   size_t unique_memory_addresses = 0;
@@ -591,14 +700,14 @@ void WorkloadCharacterisation::kernelEnd(const KernelInvocation *kernelInvocatio
     access_count += sorted_count[unique_memory_addresses].second;
     unique_memory_addresses++;
   }
-  cout << "90% Memory Footprint -- num unique memory addresses that cover 90\% of memory accesses: " << unique_memory_addresses << endl
+  out << "90% Memory Footprint -- num unique memory addresses that cover 90\% of memory accesses: " << unique_memory_addresses << endl
        << endl;
-  //cout << "the top 10:" << endl;
+  //out << "the top 10:" << endl;
   //for (int i = 0; i < 10; i++){
-  //    cout << "address: " << sorted_count[i].first << " contributed: " << sorted_count[i].second << " accesses!" << endl;
+  //    out << "address: " << sorted_count[i].first << " contributed: " << sorted_count[i].second << " accesses!" << endl;
   //}
 
-  cout << "### Memory Entropy" << endl
+  out << "### Memory Entropy" << endl
        << endl;
 
   double mem_entropy = 0.0;
@@ -607,16 +716,16 @@ void WorkloadCharacterisation::kernelEnd(const KernelInvocation *kernelInvocatio
     double prob = (double)value * 1.0 / (double)memory_access_count;
     mem_entropy = mem_entropy - prob * std::log2(prob);
   }
-  cout << "Global Memory Address Entropy -- measure of the randomness of memory addresses: " << (float)mem_entropy << endl
+  out << "Global Memory Address Entropy -- measure of the randomness of memory addresses: " << (float)mem_entropy << endl
        << endl;
 
-  cout << "Local Memory Address Entropy -- measure of the spatial locality of memory addresses" << endl
+  out << "Local Memory Address Entropy -- measure of the spatial locality of memory addresses" << endl
        << endl;
 
-  cout << "|" << setw(12) << right << "LSBs skipped"
+  out << "|" << setw(12) << right << "LSBs skipped"
        << "|" << setw(8) << right << "Entropy"
        << "|" << endl;
-  cout << "|-----------:|-------:|" << endl;
+  out << "|-----------:|-------:|" << endl;
   std::vector<float> loc_entropy;
   for (int nskip = 1; nskip < 11; nskip++) {
     double local_entropy = 0.0;
@@ -625,18 +734,18 @@ void WorkloadCharacterisation::kernelEnd(const KernelInvocation *kernelInvocatio
       local_entropy = local_entropy - prob * std::log2(prob);
     }
     loc_entropy.push_back((float)local_entropy);
-    cout << "|" << setw(12) << right << nskip << "|" << fixed << setw(8) << setprecision(4) << right << (float)local_entropy << "|" << endl;
+    out << "|" << setw(12) << right << nskip << "|" << fixed << setw(8) << setprecision(4) << right << (float)local_entropy << "|" << endl;
   }
 
-  cout << endl
+  out << endl
        << "### Parallel Spatial Locality" << endl
        << endl;
   
 
-  cout << "|" << setw(12) << right << "LSBs skipped"
+  out << "|" << setw(12) << right << "LSBs skipped"
        << "|" << setw(25) << right << "Normed Parallel Spatial Locality"
        << "|" << endl;
-  cout << "|-----------:|------------------------:|" << endl;
+  out << "|-----------:|------------------------:|" << endl;
 
   vector<double> avg_psl = vector<double>();
   double avg_psl_sum = 0.0;
@@ -649,35 +758,35 @@ void WorkloadCharacterisation::kernelEnd(const KernelInvocation *kernelInvocatio
     avg_psl_i = (avg_psl_i / double(m_psl_per_group.size())) / std::log2(double(items_per_group + 1));
     avg_psl.push_back(avg_psl_i);
     avg_psl_sum += avg_psl_i;
-    cout << "|" << setw(12) << right << i << "|" << fixed << setw(25) << setprecision(4) << right << (float)avg_psl_i << "|" << endl;
+    out << "|" << setw(12) << right << i << "|" << fixed << setw(25) << setprecision(4) << right << (float)avg_psl_i << "|" << endl;
   }
 
-  cout << endl
+  out << endl
        << "Normed Locality Sum: " << avg_psl_sum
        << endl;
 
-  cout << endl
+  out << endl
        << "### Memory Diversity -- Usage of local and constant memory relative to global memory" << endl
        << endl;
 
-  cout << "num global memory accesses: " << m_global_memory_access << endl
+  out << "num global memory accesses: " << m_global_memory_access << endl
        << endl;
-  cout << "num local memory accesses: " << m_local_memory_access << endl
+  out << "num local memory accesses: " << m_local_memory_access << endl
        << endl;
-  cout << "num constant memory accesses: " << m_constant_memory_access << endl
+  out << "num constant memory accesses: " << m_constant_memory_access << endl
        << endl;
 
   uint32_t m_total_memory_access = m_global_memory_access + m_local_memory_access + m_constant_memory_access;
 
-  cout << "\% local memory accesses (local/total): " << setprecision(2) << (((float)m_local_memory_access / (float)m_total_memory_access) * 100) << endl
+  out << "\% local memory accesses (local/total): " << setprecision(2) << (((float)m_local_memory_access / (float)m_total_memory_access) * 100) << endl
        << endl;
-  cout << "\% constant memory accesses (constant/total): " << setprecision(2) << (((float)m_constant_memory_access / (float)m_total_memory_access) * 100) << endl
+  out << "\% constant memory accesses (constant/total): " << setprecision(2) << (((float)m_constant_memory_access / (float)m_total_memory_access) * 100) << endl
        << endl;
 
-  cout << "## Control" << endl
+  out << "## Control" << endl
        << endl;
 
-  cout << "Unique Branch Instructions -- Total number of unique branch instructions to cover 90\% of the branches" << endl
+  out << "Unique Branch Instructions -- Total number of unique branch instructions to cover 90\% of the branches" << endl
        << endl;
 
   std::vector<std::pair<size_t, uint32_t>> sorted_branch_ops(m_branchCounts.size());
@@ -685,16 +794,16 @@ void WorkloadCharacterisation::kernelEnd(const KernelInvocation *kernelInvocatio
     return (left.second > right.second);
   });
 
-  cout << "|" << setw(14) << left << "Branch At Line"
+  out << "|" << setw(14) << left << "Branch At Line"
        << "|" << setw(23) << right << "Count (hit and miss)"
        << "|" << endl;
-  cout << "|--------------|----------------------:|" << endl;
+  out << "|--------------|----------------------:|" << endl;
   size_t branch_op_count = 0;
   for (auto const &x : sorted_branch_ops) {
     branch_op_count += x.second;
-    cout << "|" << setw(14) << left << x.first << "|" << setw(23) << right << x.second << "|" << endl;
+    out << "|" << setw(14) << left << x.first << "|" << setw(23) << right << x.second << "|" << endl;
   }
-  cout << endl;
+  out << endl;
 
   size_t significant_branch_op_count = (size_t)ceil(branch_op_count * 0.9);
 
@@ -704,9 +813,9 @@ void WorkloadCharacterisation::kernelEnd(const KernelInvocation *kernelInvocatio
     branch_count += sorted_branch_ops[unique_branch_addresses].second;
     unique_branch_addresses++;
   }
-  cout << "Number of unique branches that cover 90\% of all branch instructions: " << unique_branch_addresses << endl;
+  out << "Number of unique branches that cover 90\% of all branch instructions: " << unique_branch_addresses << endl;
 
-  cout << endl
+  out << endl
        << "### Branch Entropy -- measure of the randomness of branch behaviour, representing branch predictability" << endl
        << endl;
 
@@ -748,102 +857,109 @@ void WorkloadCharacterisation::kernelEnd(const KernelInvocation *kernelInvocatio
   if (isnan(average_entropy)) {
     average_entropy = 0.0;
   }
-  cout << "Using a branch history of " << m << endl
+  out << "Using a branch history of " << m << endl
        << endl;
-  cout << "Yokota Branch Entropy: " << yokota_entropy << endl
+  out << "Yokota Branch Entropy: " << yokota_entropy << endl
        << endl;
-  cout << "Yokota Branch Entropy per Workload: " << yokota_entropy_per_workload << endl
+  out << "Yokota Branch Entropy per Workload: " << yokota_entropy_per_workload << endl
        << endl;
-  cout << "Average Linear Branch Entropy: " << average_entropy << endl
+  out << "Average Linear Branch Entropy: " << average_entropy << endl
        << endl;
 
-  std::string logfile_name;
-
-  const char *result_path = getenv("OCLGRIND_WORKLOAD_CHARACTERISATION_OUTPUT_PATH");
-  if (result_path != NULL){
-    logfile_name = std::string(result_path);
-  }else{
-    int logfile_count = 0;
-    logfile_name = "aiwc_" + kernelInvocation->getKernel()->getName() + "_" + std::to_string(logfile_count) + ".csv";
-    while (std::ifstream(logfile_name)) {
-      logfile_count++;
-      logfile_name = "aiwc_" + kernelInvocation->getKernel()->getName() + "_" + std::to_string(logfile_count) + ".csv";
-    }
-  }
-  std::ofstream logfile;
-  logfile.open(logfile_name);
-  assert(logfile);
+  // Collect metrics for the log file
+  std::ostringstream logfile;
+  auto metric = [&](const std::string &name, const char *category, auto value) {
+    logfile << name << "," << category << "," << value << "\n";
+    m_metrics.push_back({name, category, (double)value});
+  };
   logfile << "metric,category,count\n";
-  logfile << "Opcode,Compute," << major_operations << "\n";
-  logfile << "Total Instruction Count,Compute," << total_instruction_count << "\n";
-  logfile << "Freedom to Reorder,Compute," << freedom_to_reorder << "\n";
-  logfile << "Resource Pressure,Compute," << resource_pressure << "\n";
-  logfile << "Work-items,Parallelism," << m_threads_invoked << "\n";
-  logfile << "Work-groups,Parallelism," << m_group_num[0] * m_group_num[1] * m_group_num[2] << "\n";
-  logfile << "Work-items per Work-group,Parallelism," << m_local_num[0] * m_local_num[1] * m_local_num[2] << "\n";
-  logfile << "SIMD Operand Sum,Parallelism," << simd_sum << "\n";
-  logfile << "Total Barriers Hit,Parallelism," << m_barriers_hit << "\n";
-  logfile << "Min ITB,Parallelism," << itb_min << "\n";
-  logfile << "Max ITB,Parallelism," << itb_max << "\n";
-  logfile << "Median ITB,Parallelism," << itb_median << "\n";
-  logfile << "Min IPT,Parallelism," << ipt_min << "\n";
-  logfile << "Max IPT,Parallelism," << ipt_max << "\n";
-  logfile << "Median IPT,Parallelism," << ipt_median << "\n";
-  logfile << "Max SIMD Width,Parallelism," << std::max_element(m_instructionWidth.begin(), m_instructionWidth.end(), [](const pair_type &a, const pair_type &b) { return a.first < b.first; })->first << "\n";
-  logfile << "Mean SIMD Width,Parallelism," << simd_mean << "\n";
-  logfile << "SD SIMD Width,Parallelism," << simd_stdev << "\n";
-  logfile << "Granularity,Parallelism," << granularity << "\n";
-  logfile << "Barriers Per Instruction,Parallelism," << barriers_per_instruction << "\n";
-  logfile << "Instructions Per Operand,Parallelism," << instructions_per_operand << "\n";
-  logfile << "Total Memory Footprint,Memory," << local_address_count[0].size() << "\n";
-  logfile << "Unique Memory Accesses,Memory," << local_address_count[0].size() << "\n";
-  logfile << "Unique Reads,Memory," << m_storeOps.size() << "\n";
-  logfile << "Unique Writes,Memory," << m_loadOps.size()  << "\n";
-  logfile << "Unique Read/Write Ratio,Memory," 
-       << setprecision(4) << (float) (((double)m_loadOps.size()) / ((double)m_storeOps.size()))  << "\n";
-  logfile << "Total Reads,Memory," << load_count    << "\n";
-  logfile << "Total Writes,Memory," << store_count    << "\n";
-  logfile << "Rereads,Memory," << setprecision(4) << (float)((double)load_count / (double)m_loadOps.size()) << "\n";
-  logfile << "Rewrites,Memory," << setprecision(4) << (float)((double)store_count / (double)m_storeOps.size()) << "\n";
-
-  logfile << "90\% Memory Footprint,Memory," << unique_memory_addresses << "\n";
-  logfile << "Global Memory Address Entropy,Memory," << mem_entropy << "\n";
+  metric("Opcode", "Compute", major_operations);
+  metric("Total Instruction Count", "Compute", total_instruction_count);
+  metric("Freedom to Reorder", "Compute", freedom_to_reorder);
+  metric("Resource Pressure", "Compute", resource_pressure);
+  metric("Work-items", "Parallelism", m_threads_invoked);
+  metric("Work-groups", "Parallelism", m_group_num[0] * m_group_num[1] * m_group_num[2]);
+  metric("Work-items per Work-group", "Parallelism", m_local_num[0] * m_local_num[1] * m_local_num[2]);
+  if (m_sampling_factor != 1.0)
+    metric("Sampling Factor", "Parallelism", m_sampling_factor);
+  metric("SIMD Operand Sum", "Parallelism", simd_sum);
+  metric("Total Barriers Hit", "Parallelism", m_barriers_hit);
+  metric("Min ITB", "Parallelism", itb_min);
+  metric("Max ITB", "Parallelism", itb_max);
+  metric("Median ITB", "Parallelism", itb_median);
+  metric("Min IPT", "Parallelism", ipt_min);
+  metric("Max IPT", "Parallelism", ipt_max);
+  metric("Median IPT", "Parallelism", ipt_median);
+  metric("Max SIMD Width", "Parallelism", simd_max);
+  metric("Mean SIMD Width", "Parallelism", simd_mean);
+  metric("SD SIMD Width", "Parallelism", simd_stdev);
+  metric("Granularity", "Parallelism", granularity);
+  metric("Barriers Per Instruction", "Parallelism", barriers_per_instruction);
+  metric("Instructions Per Operand", "Parallelism", instructions_per_operand);
+  metric("Total Memory Footprint", "Memory", local_address_count[0].size());
+  metric("Unique Memory Accesses", "Memory", local_address_count[0].size());
+  metric("Unique Reads", "Memory", m_storeOps.size());
+  metric("Unique Writes", "Memory", m_loadOps.size());
+  logfile << setprecision(4);
+  metric("Unique Read/Write Ratio", "Memory", (float) (((double)m_loadOps.size()) / ((double)m_storeOps.size())));
+  metric("Total Reads", "Memory", load_count);
+  metric("Total Writes", "Memory", store_count);
+  metric("Rereads", "Memory", (float)((double)load_count / (double)m_loadOps.size()));
+  metric("Rewrites", "Memory", (float)((double)store_count / (double)m_storeOps.size()));
+
+  metric("90\% Memory Footprint", "Memory", unique_memory_addresses);
+  metric("Global Memory Address Entropy", "Memory", mem_entropy);
   for (int nskip = 1; nskip < 11; nskip++) {
-    logfile << "LMAE -- Skipped " << nskip << " LSBs,Memory," << loc_entropy[nskip - 1] << "\n";
+    metric("LMAE -- Skipped " + std::to_string(nskip) + " LSBs", "Memory", loc_entropy[nskip - 1]);
   }
   for (int nskip = 0; nskip < 11; nskip++) {
-    logfile << "Normed PSL -- Skipped " << nskip << " LSBs,Memory," << avg_psl[nskip] << "\n";
-  }
-  logfile << "Normed PSL Sum,Memory," << avg_psl_sum << "\n";
-  logfile << "Total Global Memory Accessed,Memory," << m_global_memory_access << "\n";
-  logfile << "Total Local Memory Accessed,Memory," << m_local_memory_access << "\n";
-  logfile << "Total Constant Memory Accessed,Memory," << m_constant_memory_access << "\n";
-  logfile << "Relative Local Memory Usage,Memory," << (((float)m_local_memory_access / (float)m_total_memory_access) * 100) << "\n";
-  logfile << "Relative Constant Memory Usage,Memory," << (((float)m_constant_memory_access / (float)m_total_memory_access) * 100) << "\n";
-  logfile << "Total Unique Branch Instructions,Control," << sorted_branch_ops.size() << "\n";
-  logfile << "90\% Branch Instructions,Control," << unique_branch_addresses << "\n";
-  logfile << "Yokota Branch Entropy,Memory," << yokota_entropy_per_workload << "\n";
-  logfile << "Average Linear Branch Entropy,Memory," << average_entropy << "\n";
-  logfile.close();
+    metric("Normed PSL -- Skipped " + std::to_string(nskip) + " LSBs", "Memory", avg_psl[nskip]);
+  }
+  metric("Normed PSL Sum", "Memory", avg_psl_sum);
+  metric("Total Global Memory Accessed", "Memory", m_global_memory_access);
+  metric("Total Local Memory Accessed", "Memory", m_local_memory_access);
+  metric("Total Constant Memory Accessed", "Memory", m_constant_memory_access);
+  metric("Relative Local Memory Usage", "Memory", (((float)m_local_memory_access / (float)m_total_memory_access) * 100));
+  metric("Relative Constant Memory Usage", "Memory", (((float)m_constant_memory_access / (float)m_total_memory_access) * 100));
+  metric("Total Unique Branch Instructions", "Control", sorted_branch_ops.size());
+  metric("90\% Branch Instructions", "Control", unique_branch_addresses);
+  metric("Yokota Branch Entropy", "Memory", yokota_entropy_per_workload);
+  metric("Average Linear Branch Entropy", "Memory", average_entropy);
+
+  if (m_binary)
+    writeBinary();
+  else {
+    std::ofstream csv(m_logfileName);
+    assert(csv);
+    csv << logfile.str();
+  }
 
-  cout << endl
-       << "The Architecture-Independent Workload Characterisation was written to file: " << logfile_name << endl;
-  // Restore locale
-  cout.imbue(previousLocale);
+  out << endl
+       << "The Architecture-Independent Workload Characterisation was written to file: " << m_logfileName << endl;
+  cout << out.str();
+}
 
-  // Reset kernel counts, ready to start anew
-  //m_memoryOps.clear();
-  m_loadOps.clear();
-  m_storeOps.clear();
-  m_computeOps.clear();
-  m_branchPatterns.clear();
-  m_branchCounts.clear();
-  m_instructionsToBarrier.clear();
-  m_instructionsPerWorkitem.clear();
-  m_threads_invoked = 0;
-  m_instructionsBetweenLoadOrStore.clear();
-  m_loadInstructionLabels.clear();
-  m_storeInstructionLabels.clear();
+void WorkloadCharacterisation::KernelReport::writeBinary() const {
+  // Layout: "AIWC", uint32 version, uint32 number of metrics, then for each
+  // metric a uint16 name length and name, a uint8 category length and
+  // category, and the value as a double (all in host byte order)
+  std::ofstream file(m_logfileName, std::ios::binary);
+  assert(file);
+
+  uint32_t version = 1;
+  uint32_t count = m_metrics.size();
+  file.write("AIWC", 4);
+  file.write((const char *)&version, sizeof(version));
+  file.write((const char *)&count, sizeof(count));
+  for (const Metric &metric : m_metrics) {
+    uint16_t name_length = metric.name.size();
+    uint8_t category_length = strlen(metric.category);
+    file.write((const char *)&name_length, sizeof(name_length));
+    file.write(metric.name.data(), name_length);
+    file.write((const char *)&category_length, sizeof(category_length));
+    file.write(metric.category, category_length);
+    file.write((const char *)&metric.value, sizeof(metric.value));
+  }
 }
 
 void WorkloadCharacterisation::workGroupBegin(const WorkGroup *workGroup) {
@@ -861,8 +977,6 @@ void WorkloadCharacterisation::workGroupBegin(const WorkGroup *workGroup) {
     m_state.instructionsBetweenLoadOrStore = new vector<uint32_t>;
     m_state.loadInstructionLabels = new unordered_map<std::string, size_t>;
     m_state.storeInstructionLabels = new unordered_map<std::string, size_t>;
-    m_state.ledger = vector<vector<WorkloadCharacterisation::ledgerElement>>
-      (m_local_num.x * m_local_num.y * m_local_num.z, vector<ledgerElement>());
     m_state.psl_per_barrier = new vector<pair<vector<double>,uint64_t>>;
   }
 
@@ -877,6 +991,7 @@ void WorkloadCharacterisation::workGroupBegin(const WorkGroup *workGroup) {
   m_state.instructionsBetweenLoadOrStore->clear();
   m_state.loadInstructionLabels->clear();
   m_state.storeInstructionLabels->clear();
+  m_state.psl_per_barrier->clear();
 
   m_state.threads_invoked = 0;
   m_state.instruction_count = 0;
@@ -893,13 +1008,39 @@ void WorkloadCharacterisation::workGroupBegin(const WorkGroup *workGroup) {
   m_state.target2 = "";
   m_state.branch_loc = 0;
 
-  for (size_t i = 0; i < (m_state.ledger).size(); i++)
-    (m_state.ledger)[i].clear();
+  resetLocality(m_state.locality, m_local_num.x * m_local_num.y * m_local_num.z);
 }
 
 void WorkloadCharacterisation::workGroupComplete(const WorkGroup *workGroup) {
+  // take this group's lists, which are combined in group order at the end
+  GroupResults results;
+  results.instructionsToBarrier.swap(*m_state.instructionsBetweenBarriers);
+  results.instructionsPerWorkitem.swap(*m_state.instructionsPerWorkitem);
+  results.instructionsBetweenLoadOrStore.swap(*m_state.instructionsBetweenLoadOrStore);
+
+  vector<double> psl = parallelSpatialLocality(m_state.locality);
+  m_state.psl_per_barrier->push_back(std::make_pair(psl, m_state.locality.maxLength));
+  resetLocality(m_state.locality, m_state.locality.accessCounts.size());
+
+  size_t maxLength = 0;
+  vector<double> weighted_avg_psl = vector<double>(11, 0.0);
+  for (const auto &elem : *m_state.psl_per_barrier) {
+    maxLength += elem.second;
+    for (size_t nskip = 0; nskip < 11; nskip++) {
+      weighted_avg_psl[nskip] += elem.first[nskip] * elem.second;
+    }
+  }
+
+  if (maxLength != 0) {
+    for (size_t nskip = 0; nskip < 11; nskip++) {
+      weighted_avg_psl[nskip] = weighted_avg_psl[nskip] / static_cast<float>(maxLength + 1);
+    }   
+  }
+  results.psl.swap(weighted_avg_psl);
 
   lock_guard<mutex> lock(m_mtx);
+  m_groupResults[workGroup->getGroupIndex()] = std::move(results);
+
   // merge operation counts back into global unordered map
   for (auto const &item : (*m_state.computeOps))
     m_computeOps[item.first] += item.second;
@@ -940,24 +1081,12 @@ void WorkloadCharacterisation::workGroupComplete(const WorkGroup *workGroup) {
   // add the current work-group item / thread counter to the global variable
   m_threads_invoked += m_state.threads_invoked;
 
-  // add the instructions between barriers back to the global setting
-  for (auto const &item : (*m_state.instructionsBetweenBarriers))
-    m_instructionsToBarrier.push_back(item);
-
   m_barriers_hit += m_state.barriers_hit;
 
   // add the SIMD scores back to the global setting
   for (auto const &item : (*m_state.instructionWidth))
     m_instructionWidth[item.first] += item.second;
 
-  // add the instructions executed per workitem scores back to the global setting
-  for (auto const &item : (*m_state.instructionsPerWorkitem))
-    m_instructionsPerWorkitem.push_back(item);
-
-  // add the instruction reordering (flexability) metrics
-  for (auto const &item : (*m_state.instructionsBetweenLoadOrStore))
-    m_instructionsBetweenLoadOrStore.push_back(item);
-
   for (auto const &item : (*m_state.loadInstructionLabels))
     m_loadInstructionLabels[item.first] += item.second;
 
@@ -968,30 +1097,5 @@ void WorkloadCharacterisation::workGroupComplete(const WorkGroup *workGroup) {
   m_constant_memory_access += m_state.constant_memory_access_count;
   m_local_memory_access += m_state.local_memory_access_count;
   m_global_memory_access += m_state.global_memory_access_count;
-
-  vector<double> psl = parallelSpatialLocality(m_state.ledger);
-  size_t maxLength = 0;
-  for (size_t i = 0; i < m_state.ledger.size(); i++) {
-    maxLength = m_state.ledger[i].size() > maxLength ? m_state.ledger[i].size() : maxLength;
-    m_state.ledger[i].clear();
-  }
-  
-  m_state.psl_per_barrier->push_back(std::make_pair(psl, maxLength));
-
-  maxLength = 0;
-  vector<double> weighted_avg_psl = vector<double>(11, 0.0);
-  for (const auto &elem : *m_state.psl_per_barrier) {
-    maxLength += elem.second;
-    for (size_t nskip = 0; nskip < 11; nskip++) {
-      weighted_avg_psl[nskip] += elem.first[nskip] * elem.second;
-    }
-  }
-
-  if (maxLength != 0) {
-    for (size_t nskip = 0; nskip < 11; nskip++) {
-      weighted_avg_psl[nskip] = weighted_avg_psl[nskip] / static_cast<float>(maxLength + 1);
-    }   
-  }
-  m_psl_per_group.push_back(weighted_avg_psl);  
 }
 
@@ -8,6 +8,7 @@
 
 #include "core/Plugin.h"
 
+#include <map>
 #include <mutex>
 #include <string>
 #include <unordered_map>
@@ -24,8 +25,9 @@ public:
   ~WorkloadCharacterisation();
 
   virtual void threadMemoryLedger(size_t address, uint32_t timestep, Size3 localID);
-  virtual void hostMemoryLoad(const Memory *memory, size_t address, size_t size) override;
-  virtual void hostMemoryStore(const Memory *memory, size_t address, size_t size, const uint8_t *storeData) override;
+  virtual uint32_t getCallbacks() const override;
+  virtual uint32_t getUnsampledCallbacks() const override;
+  virtual void hostMemoryTransfer(const HostTransfer &transfer) override;
   virtual void instructionExecuted(const WorkItem *workItem,
                                    const llvm::Instruction *instruction,
                                    const TypedValue &result) override;
@@ -42,12 +44,20 @@ public:
   virtual void workItemComplete(const WorkItem *workItem) override;
   virtual void workItemBarrier(const WorkItem *workItem) override;
   virtual void workItemClearBarrier(const WorkItem *workItem) override;
-  
-  struct ledgerElement {
-    size_t address;
-    uint32_t timestep;
-  };
+
 private:
+  // Addresses accessed at each timestep since the last barrier, sampled to
+  // keep memory bounded: only every stride-th timestep is tracked, and the
+  // stride doubles whenever too many timesteps are held
+  struct LocalitySketch {
+    std::vector<uint32_t> accessCounts;
+    std::map<uint32_t, std::unordered_map<size_t, uint32_t>> histograms;
+    uint32_t stride;
+    uint32_t maxLength;
+  };
+  static std::vector<double> parallelSpatialLocality(const LocalitySketch &sketch);
+  static void resetLocality(LocalitySketch &sketch, size_t numWorkItems);
+
   // std::unordered_map<std::pair<size_t, bool>, uint32_t> m_memoryOps;
   std::unordered_map<size_t, uint32_t> m_storeOps;
   std::unordered_map<size_t, uint32_t> m_loadOps;
@@ -59,9 +69,11 @@ private:
   std::vector<uint32_t> m_instructionsPerWorkitem;
   uint32_t m_threads_invoked;
   uint32_t m_barriers_hit;
-  int m_numberOfHostToDeviceCopiesBeforeKernelNamed;
-  std::vector<std::string> m_hostToDeviceCopy;
-  std::vector<std::string> m_deviceToHostCopy;
+  // Transfer commands counted by kernel, with copies to the device counted
+  // against the next kernel to run
+  size_t m_numberOfHostToDeviceCopiesBeforeKernelNamed;
+  std::map<std::string, size_t> m_hostToDeviceCopies;
+  std::map<std::string, size_t> m_deviceToHostCopies;
   std::string m_last_kernel_name;
   std::vector<uint32_t> m_instructionsBetweenLoadOrStore;
   std::unordered_map<std::string, size_t> m_loadInstructionLabels;
@@ -72,6 +84,58 @@ private:
   Size3 m_group_num;
   Size3 m_local_num;
   std::vector<std::vector<double>> m_psl_per_group;
+  std::unordered_map<std::string, int> m_logfileCounts;
+
+  // Lists gathered by each work-group, kept by group index until the kernel
+  // ends so that they are combined in the same order whichever worker
+  // threads ran the groups
+  struct GroupResults {
+    std::vector<uint32_t> instructionsToBarrier;
+    std::vector<uint32_t> instructionsPerWorkitem;
+    std::vector<uint32_t> instructionsBetweenLoadOrStore;
+    std::vector<double> psl;
+  };
+  std::map<size_t, GroupResults> m_groupResults;
+
+  // Counters gathered for one kernel invocation, reported in the background
+  class KernelReport {
+  public:
+    void write();
+
+    std::string m_kernelName;
+    std::string m_logfileName;
+    bool m_binary;
+    std::unordered_map<size_t, uint32_t> m_storeOps;
+    std::unordered_map<size_t, uint32_t> m_loadOps;
+    std::unordered_map<std::string, size_t> m_computeOps;
+    std::unordered_map<size_t, std::unordered_map<uint16_t, uint32_t>> m_branchPatterns;
+    std::unordered_map<size_t, uint32_t> m_branchCounts;
+    std::vector<uint32_t> m_instructionsToBarrier;
+    std::unordered_map<uint16_t, size_t> m_instructionWidth;
+    std::vector<uint32_t> m_instructionsPerWorkitem;
+    std::vector<uint32_t> m_instructionsBetweenLoadOrStore;
+    std::unordered_map<std::string, size_t> m_loadInstructionLabels;
+    std::unordered_map<std::string, size_t> m_storeInstructionLabels;
+    std::vector<std::vector<double>> m_psl_per_group;
+    uint32_t m_threads_invoked;
+    uint32_t m_barriers_hit;
+    uint32_t m_global_memory_access;
+    uint32_t m_constant_memory_access;
+    uint32_t m_local_memory_access;
+    Size3 m_group_num;
+    Size3 m_local_num;
+    double m_sampling_factor;
+
+  private:
+    struct Metric {
+      std::string name;
+      const char *category;
+      double value;
+    };
+    std::vector<Metric> m_metrics;
+
+    void writeBinary() const;
+  };
 
   struct WorkerState {
     std::unordered_map<std::string, size_t> *computeOps;
@@ -101,7 +165,7 @@ private:
     uint64_t timestep;
     // uint32_t work_item_no;
     // uint32_t work_group_no;
-    std::vector<std::vector<ledgerElement>> ledger;
+    LocalitySketch locality;
   };
   static THREAD_LOCAL WorkerState m_state;
 
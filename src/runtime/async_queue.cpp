@@ -11,7 +11,7 @@
 #include <cassert>
 #include <iostream>
 #include <list>
-#include <map>
+#include <mutex>
 
 #include "core/Kernel.h"
 #include "core/Queue.h"
@@ -19,113 +19,158 @@
 using namespace oclgrind;
 using namespace std;
 
-// Maps to keep track of retained objects
-static map<Command*, list<cl_mem>> memObjectMap;
-static map<Command*, cl_kernel> kernelMap;
-static map<Command*, cl_event> eventMap;
-static map<Command*, list<cl_event>> waitListMap;
+// Objects retained by a command are recorded in the command itself, which
+// only the enqueuing thread uses until it has been enqueued, and only the
+// queue's thread uses afterwards
 
-void asyncEnqueue(cl_command_queue queue, cl_command_type type, Command* cmd,
-                  cl_uint numEvents, const cl_event* waitList,
-                  cl_event* eventOut)
+static void asyncQueueRelease(Command* cmd);
+
+cl_int asyncEnqueue(cl_command_queue queue, cl_command_type type, Command* cmd,
+                    cl_uint numEvents, const cl_event* waitList,
+                    cl_event* eventOut, bool blocking)
 {
   // Add event wait list to command
   for (unsigned i = 0; i < numEvents; i++)
   {
     cmd->waitList.push_back(waitList[i]->event);
-    waitListMap[cmd].push_back(waitList[i]);
+    cmd->retained.waitList.push_back(waitList[i]);
     clRetainEvent(waitList[i]);
   }
 
-  // Enqueue command
-  Event* event = queue->queue->enqueue(cmd);
-
-  // Create event objects
+  // Create event object, with an extra reference held until the command has
+  // been enqueued (the queue may release the command before then)
   cl_event _event = new _cl_event;
   _event->dispatch = m_dispatchTable;
   _event->context = queue->context;
   _event->queue = queue;
   _event->type = type;
-  _event->event = event;
-  _event->refCount = 1;
+  _event->event = NULL;
+  _event->refCount = 2;
+  cmd->retained.event = _event;
 
-  // Add event to map
-  eventMap[cmd] = _event;
+  // Enqueue command
+  _event->event = queue->queue->enqueue(cmd);
 
-  // Pass event as output and retain (if required)
+  // Blocking commands only wait for their own event, rather than finishing
+  // the whole queue
+  cl_int err = CL_SUCCESS;
+  if (blocking)
+  {
+    _event->event->wait();
+    if (_event->event->state < 0)
+      err = CL_EXEC_STATUS_ERROR_FOR_EVENTS_IN_WAIT_LIST;
+  }
+
+  // Pass event as output, or drop the extra reference
   if (eventOut)
   {
-    clRetainEvent(_event);
     *eventOut = _event;
   }
+  else
+  {
+    clReleaseEvent(_event);
+  }
+
+  return err;
+}
+
+void asyncEventCallback(cl_event event, cl_int type,
+                        void(CL_CALLBACK* notify)(cl_event, cl_int, void*),
+                        void* data)
+{
+  cl_int state;
+  {
+    // Keep callback until the event reaches the requested state
+    lock_guard<mutex> lock(event->callbackLock);
+    state = event->event->state;
+    if (state > type)
+    {
+      event->callbacks.push_back({type, notify, data});
+      return;
+    }
+  }
+
+  // Event has already reached the state, so call back immediately
+  notify(event, state < 0 ? state : type, data);
+}
+
+void asyncEventNotify(cl_event event, cl_int state)
+{
+  // Take the callbacks for every state up to and including this one (an
+  // error state terminates the event, so all callbacks are made)
+  list<_cl_event::Callback> callbacks;
+  {
+    lock_guard<mutex> lock(event->callbackLock);
+    auto itr = event->callbacks.begin();
+    while (itr != event->callbacks.end())
+    {
+      if (state < 0 || itr->type >= state)
+        callbacks.splice(callbacks.end(), event->callbacks, itr++);
+      else
+        itr++;
+    }
+  }
+
+  // Perform callbacks
+  for (const _cl_event::Callback& callback : callbacks)
+  {
+    callback.notify(event, state < 0 ? state : callback.type, callback.data);
+  }
+}
+
+void asyncQueueNotify(Command* cmd, int state)
+{
+  asyncEventNotify(cmd->retained.event, state);
+
+  // Release command once it has completed or terminated
+  if (state == CL_COMPLETE || state < 0)
+  {
+    asyncQueueRelease(cmd);
+  }
 }
 
 void asyncQueueRetain(Command* cmd, cl_mem mem)
 {
-  // Retain object and add to map
+  // Retain object and add to command
   clRetainMemObject(mem);
-  memObjectMap[cmd].push_back(mem);
+  cmd->retained.memObjects.push_back(mem);
 }
 
 void asyncQueueRetain(Command* cmd, cl_kernel kernel)
 {
-  assert(kernelMap.find(cmd) == kernelMap.end());
+  assert(cmd->retained.kernel == NULL);
 
-  // Retain kernel and add to map
+  // Retain kernel and add to command
   clRetainKernel(kernel);
-  kernelMap[cmd] = kernel;
+  cmd->retained.kernel = kernel;
 
-  // Retain memory objects arguments
-  map<cl_uint, cl_mem>::const_iterator itr;
-  for (itr = kernel->memArgs.begin(); itr != kernel->memArgs.end(); itr++)
-  {
-    asyncQueueRetain(cmd, itr->second);
-  }
+  // Share memory object arguments, which hold their own references
+  cmd->retained.kernelMemArgs = kernel->memArgs;
 }
 
-void asyncQueueRelease(Command* cmd)
+static void asyncQueueRelease(Command* cmd)
 {
   // Release memory objects
-  if (memObjectMap.find(cmd) != memObjectMap.end())
+  for (cl_mem mem : cmd->retained.memObjects)
   {
-    list<cl_mem> memObjects = memObjectMap[cmd];
-    while (!memObjects.empty())
-    {
-      clReleaseMemObject(memObjects.front());
-      memObjects.pop_front();
-    }
-    memObjectMap.erase(cmd);
+    clReleaseMemObject(mem);
   }
 
   // Release kernel
-  if (cmd->type == Command::KERNEL)
+  if (cmd->retained.kernel)
   {
-    assert(kernelMap.find(cmd) != kernelMap.end());
-    clReleaseKernel(kernelMap[cmd]);
-    kernelMap.erase(cmd);
+    clReleaseKernel(cmd->retained.kernel);
     delete ((KernelCommand*)cmd)->kernel;
   }
 
-  // Remove event from map
-  cl_event event = eventMap[cmd];
-  eventMap.erase(cmd);
-
-  // Perform callbacks
-  list<pair<void(CL_CALLBACK*)(cl_event, cl_int, void*), void*>>::iterator
-    callItr;
-  for (callItr = event->callbacks.begin(); callItr != event->callbacks.end();
-       callItr++)
-  {
-    callItr->first(event, event->event->state, callItr->second);
-  }
+  cmd->retained.kernelMemArgs.reset();
 
   // Release events
-  list<cl_event>::iterator waitItr;
-  for (waitItr = waitListMap[cmd].begin(); waitItr != waitListMap[cmd].end();
-       waitItr++)
+  for (cl_event event : cmd->retained.waitList)
   {
-    clReleaseEvent(*waitItr);
+    clReleaseEvent(event);
   }
-  waitListMap.erase(cmd);
-  clReleaseEvent(event);
+  clReleaseEvent(cmd->retained.event);
+
+  delete cmd;
 }
@@ -10,9 +10,15 @@
 
 #include "core/Queue.h"
 
-extern void asyncEnqueue(cl_command_queue queue, cl_command_type type,
-                         oclgrind::Command* cmd, cl_uint numEvents,
-                         const cl_event* waitList, cl_event* eventOut);
+extern cl_int asyncEnqueue(cl_command_queue queue, cl_command_type type,
+                           oclgrind::Command* cmd, cl_uint numEvents,
+                           const cl_event* waitList, cl_event* eventOut,
+                           bool blocking = false);
+extern void asyncEventCallback(cl_event event, cl_int type,
+                               void(CL_CALLBACK* notify)(cl_event, cl_int,
+                                                         void*),
+                               void* data);
+extern void asyncEventNotify(cl_event event, cl_int state);
+extern void asyncQueueNotify(oclgrind::Command* cmd, int state);
 extern void asyncQueueRetain(oclgrind::Command* cmd, cl_mem mem);
 extern void asyncQueueRetain(oclgrind::Command* cmd, cl_kernel);
-extern void asyncQueueRelease(oclgrind::Command* cmd);
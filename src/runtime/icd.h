@@ -114,10 +114,15 @@
 #define clCreateEventFromGLsyncKHR _clCreateEventFromGLsyncKHR
 #endif // OCLGRIND_ICD
 
+#include <atomic>
+#include <condition_variable>
 #include <cstdint>
 #include <list>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <stack>
+#include <thread>
 #include <vector>
 
 #define CL_USE_DEPRECATED_OPENCL_1_0_APIS
@@ -160,18 +165,30 @@ struct _cl_device_id
   size_t constantMemSize;
   size_t localMemSize;
   size_t maxWGSize;
+
+  // Compute units, each run by a worker thread pinned to one CPU, with
+  // sub-devices taking disjoint ranges of their parent's units
+  cl_uint firstUnit;
+  cl_uint numUnits;
+  cl_device_id parent;
+  std::vector<cl_device_partition_property> partitionType;
+  std::atomic<unsigned int> refCount;
 };
 
 struct _cl_context
 {
   void* dispatch;
   oclgrind::Context* context;
+  cl_device_id device;
   void(CL_CALLBACK* notify)(const char*, const void*, size_t, void*);
   void* data;
   cl_context_properties* properties;
   size_t szProperties;
   std::stack<std::pair<void(CL_CALLBACK*)(cl_context, void*), void*>> callbacks;
-  unsigned int refCount;
+  // Buffers allocated with clSVMAlloc, by the host pointer they start at
+  std::map<const void*, cl_mem> svmBuffers;
+  std::mutex svmLock;
+  std::atomic<unsigned int> refCount;
 };
 
 struct _cl_command_queue
@@ -181,7 +198,7 @@ struct _cl_command_queue
   cl_context context;
   std::vector<cl_queue_properties> properties_array;
   oclgrind::Queue* queue;
-  unsigned int refCount;
+  std::atomic<unsigned int> refCount;
 };
 
 struct _cl_mem
@@ -197,7 +214,7 @@ struct _cl_mem
   void* hostPtr;
   std::stack<std::pair<void(CL_CALLBACK*)(cl_mem, void*), void*>> callbacks;
   std::vector<cl_mem_properties> properties;
-  unsigned int refCount;
+  std::atomic<unsigned int> refCount;
 };
 
 struct cl_image : _cl_mem
@@ -211,7 +228,24 @@ struct _cl_program
   void* dispatch;
   oclgrind::Program* program;
   cl_context context;
-  unsigned int refCount;
+  // Set while a build runs (on buildThread if a callback was given), during
+  // which the program can't be used or built again
+  std::mutex buildLock;
+  std::condition_variable buildComplete;
+  bool building;
+  std::thread buildThread;
+  std::atomic<unsigned int> refCount;
+};
+
+// Memory objects set as kernel arguments, which are retained while set so
+// that commands enqueued with the kernel can share them (the kernel copies
+// them before changing an argument while they are shared)
+struct KernelMemArgs
+{
+  std::map<cl_uint, cl_mem> args;
+  KernelMemArgs() {}
+  KernelMemArgs(const KernelMemArgs& memArgs);
+  ~KernelMemArgs();
 };
 
 struct _cl_kernel
@@ -219,9 +253,9 @@ struct _cl_kernel
   void* dispatch;
   oclgrind::Kernel* kernel;
   cl_program program;
-  std::map<cl_uint, cl_mem> memArgs;
+  std::shared_ptr<KernelMemArgs> memArgs;
   std::vector<oclgrind::Image*> imageArgs;
-  unsigned int refCount;
+  std::atomic<unsigned int> refCount;
 };
 
 struct _cl_event
@@ -231,9 +265,15 @@ struct _cl_event
   cl_command_queue queue;
   cl_command_type type;
   oclgrind::Event* event;
-  std::list<std::pair<void(CL_CALLBACK*)(cl_event, cl_int, void*), void*>>
-    callbacks;
-  unsigned int refCount;
+  struct Callback
+  {
+    cl_int type;
+    void(CL_CALLBACK* notify)(cl_event, cl_int, void*);
+    void* data;
+  };
+  std::list<Callback> callbacks;
+  std::mutex callbackLock; // Guards callbacks
+  std::atomic<unsigned int> refCount;
 };
 
 struct _cl_sampler
@@ -245,7 +285,7 @@ struct _cl_sampler
   cl_filter_mode filterMode;
   std::vector<cl_sampler_properties> properties;
   uint32_t sampler;
-  unsigned int refCount;
+  std::atomic<unsigned int> refCount;
 };
 
 extern void* m_dispatchTable[256];
@@ -196,7 +196,16 @@ static bool parseArguments(int argc, char* argv[])
 {
   for (int i = 1; i < argc; i++)
   {
-    if (!strcmp(argv[i], "--build-options"))
+    if (!strcmp(argv[i], "--build-cache"))
+    {
+      if (++i >= argc)
+      {
+        cerr << "Missing argument to --build-cache" << endl;
+        return false;
+      }
+      setEnvironment("OCLGRIND_BUILD_CACHE", argv[i]);
+    }
+    else if (!strcmp(argv[i], "--build-options"))
     {
       if (++i >= argc)
       {
@@ -209,6 +218,24 @@ static bool parseArguments(int argc, char* argv[])
     {
       setEnvironment("OCLGRIND_CHECK_API", "1");
     }
+    else if (!strcmp(argv[i], "--checkpoint"))
+    {
+      if (++i >= argc)
+      {
+        cerr << "Missing argument to --checkpoint" << endl;
+        return false;
+      }
+      setEnvironment("OCLGRIND_CHECKPOINT", argv[i]);
+    }
+    else if (!strcmp(argv[i], "--checkpoint-interval"))
+    {
+      if (++i >= argc)
+      {
+        cerr << "Missing argument to --checkpoint-interval" << endl;
+        return false;
+      }
+      setEnvironment("OCLGRIND_CHECKPOINT_INTERVAL", argv[i]);
+    }
     else if (!strcmp(argv[i], "--compute-units"))
     {
       if (++i >= argc)
@@ -227,10 +254,27 @@ static bool parseArguments(int argc, char* argv[])
       }
       setEnvironment("OCLGRIND_CONSTANT_MEM_SIZE", argv[i]);
     }
+    else if (!strcmp(argv[i], "--cost-model"))
+    {
+      if (++i >= argc)
+      {
+        cerr << "Missing argument to --cost-model" << endl;
+        return false;
+      }
+      setEnvironment("OCLGRIND_COST_MODEL", argv[i]);
+    }
     else if (!strcmp(argv[i], "--data-races"))
     {
       setEnvironment("OCLGRIND_DATA_RACES", "1");
     }
+    else if (!strcmp(argv[i], "--dedup-errors"))
+    {
+      setEnvironment("OCLGRIND_DEDUP_ERRORS", "1");
+    }
+    else if (!strcmp(argv[i], "--disable-jit"))
+    {
+      setEnvironment("OCLGRIND_DISABLE_JIT", "1");
+    }
     else if (!strcmp(argv[i], "--disable-pch"))
     {
       setEnvironment("OCLGRIND_DISABLE_PCH", "1");
@@ -287,6 +331,19 @@ static bool parseArguments(int argc, char* argv[])
       }
       setEnvironment("OCLGRIND_LOG", argv[i]);
     }
+    else if (!strcmp(argv[i], "--lockstep"))
+    {
+      setEnvironment("OCLGRIND_LOCKSTEP", "1");
+    }
+    else if (!strcmp(argv[i], "--max-commands"))
+    {
+      if (++i >= argc)
+      {
+        cerr << "Missing argument to --max-commands" << endl;
+        return false;
+      }
+      setEnvironment("OCLGRIND_MAX_COMMANDS", argv[i]);
+    }
     else if (!strcmp(argv[i], "--max-errors"))
     {
       if (++i >= argc)
@@ -305,6 +362,37 @@ static bool parseArguments(int argc, char* argv[])
       }
       setEnvironment("OCLGRIND_MAX_WGSIZE", argv[i]);
     }
+    else if (!strcmp(argv[i], "--memory-model"))
+    {
+      if (++i >= argc)
+      {
+        cerr << "Missing argument to --memory-model" << endl;
+        return false;
+      }
+      setEnvironment("OCLGRIND_MEMORY_MODEL", argv[i]);
+    }
+    else if (!strcmp(argv[i], "--memory-trace"))
+    {
+      if (++i >= argc)
+      {
+        cerr << "Missing argument to --memory-trace" << endl;
+        return false;
+      }
+      setEnvironment("OCLGRIND_MEMORY_TRACE", argv[i]);
+    }
+    else if (!strcmp(argv[i], "--memory-usage"))
+    {
+      setEnvironment("OCLGRIND_MEMORY_USAGE", "1");
+    }
+    else if (!strcmp(argv[i], "--metrics"))
+    {
+      if (++i >= argc)
+      {
+        cerr << "Missing argument to --metrics" << endl;
+        return false;
+      }
+      setEnvironment("OCLGRIND_METRICS", argv[i]);
+    }
     else if (!strcmp(argv[i], "--num-threads"))
     {
       if (++i >= argc)
@@ -314,6 +402,14 @@ static bool parseArguments(int argc, char* argv[])
       }
       setEnvironment("OCLGRIND_NUM_THREADS", argv[i]);
     }
+    else if (!strcmp(argv[i], "--optimize"))
+    {
+      setEnvironment("OCLGRIND_OPTIMIZE", "1");
+    }
+    else if (!strcmp(argv[i], "--optimize-full"))
+    {
+      setEnvironment("OCLGRIND_OPTIMIZE", "2");
+    }
     else if (!strcmp(argv[i], "--pch-dir"))
     {
       if (++i >= argc)
@@ -323,6 +419,15 @@ static bool parseArguments(int argc, char* argv[])
       }
       setEnvironment("OCLGRIND_PCH_DIR", argv[i]);
     }
+    else if (!strcmp(argv[i], "--performance-lint"))
+    {
+      if (++i >= argc)
+      {
+        cerr << "Missing argument to --performance-lint" << endl;
+        return false;
+      }
+      setEnvironment("OCLGRIND_PERFORMANCE_LINT", argv[i]);
+    }
     else if (!strcmp(argv[i], "--plugins"))
     {
       if (++i >= argc)
@@ -332,10 +437,54 @@ static bool parseArguments(int argc, char* argv[])
       }
       setEnvironment("OCLGRIND_PLUGINS", argv[i]);
     }
+    else if (!strcmp(argv[i], "--processes"))
+    {
+      if (++i >= argc)
+      {
+        cerr << "Missing argument to --processes" << endl;
+        return false;
+      }
+      setEnvironment("OCLGRIND_PROCESSES", argv[i]);
+    }
+    else if (!strcmp(argv[i], "--profile"))
+    {
+      setEnvironment("OCLGRIND_PROFILE", "1");
+    }
+    else if (!strcmp(argv[i], "--profile-trace"))
+    {
+      if (++i >= argc)
+      {
+        cerr << "Missing argument to --profile-trace" << endl;
+        return false;
+      }
+      setEnvironment("OCLGRIND_PROFILE_TRACE", argv[i]);
+    }
     else if (!strcmp(argv[i], "-q") || !strcmp(argv[i], "--quick"))
     {
       setEnvironment("OCLGRIND_QUICK", "1");
     }
+    else if (!strcmp(argv[i], "--sample"))
+    {
+      if (++i >= argc)
+      {
+        cerr << "Missing argument to --sample" << endl;
+        return false;
+      }
+      setEnvironment("OCLGRIND_SAMPLE", argv[i]);
+    }
+    else if (!strcmp(argv[i], "--sample-seed"))
+    {
+      if (++i >= argc)
+      {
+        cerr << "Missing argument to --sample-seed" << endl;
+        return false;
+      }
+      setEnvironment("OCLGRIND_SAMPLE_SEED", argv[i]);
+    }
+    else if (!strcmp(argv[i], "--sample-strided"))
+    {
+      setEnvironment("OCLGRIND_SAMPLE_STRIDED", "1");
+    }
     else if (!strcmp(argv[i], "--uniform-writes"))
     {
       setEnvironment("OCLGRIND_UNIFORM_WRITES", "1");
@@ -472,16 +621,28 @@ static void printUsage()
           "                               -> https://github.com/BeauJoh/opencl-predictions-with-aiwc " << endl <<
           "                               If you have any questions or comments" << endl <<
           "                               please contact <beau.johnston@anu.edu.au>" << endl
+    << "  --build-cache       DIR      "
+          "Reuse compiled programs cached in DIR" << endl
     << "  --build-options     OPTIONS  "
           "Additional options to pass to the OpenCL compiler" << endl
     << "  --check-api                  "
           "Report errors on API calls"  << endl
+    << "  --checkpoint        FILE     "
+          "Resume kernels from checkpoints saved to FILE" << endl
+    << "  --checkpoint-interval SECS   "
+          "Change the time between checkpoints (default 600)" << endl
     << "  --compute-units     UNITS    "
-          "Change the number of compute units reported" << endl
+          "Change the number of compute units (and worker threads)" << endl
     << "  --constant-mem-size BYTES    "
           "Change the constant memory size of the device" << endl
+    << "  --cost-model        COSTS    "
+          "Report profiling times from a cost model (1 for defaults)" << endl
     << "  --data-races                 "
           "Enable data-race detection" << endl
+    << "  --dedup-errors               "
+          "Only report the first error of each kind per instruction" << endl
+    << "  --disable-jit                "
+          "Always interpret kernels instead of compiling them" << endl
     << "  --disable-pch                "
           "Don't use precompiled headers" << endl
     << "  --dump-spir                  "
@@ -496,20 +657,50 @@ static void printUsage()
           "Enable interactive mode" << endl
     << "  --local-mem-size    BYTES    "
           "Change the local memory size of the device" << endl
+    << "  --lockstep                   "
+          "Execute work-items within a work-group in lockstep" << endl
     << "  --log               LOGFILE  "
           "Redirect log/error messages to a file" << endl
+    << "  --max-commands      NUM      "
+          "Limit the commands an out-of-order queue runs at once" << endl
     << "  --max-errors        NUM      "
           "Limit the number of error/warning messages" << endl
     << "  --max-wgsize        WGSIZE   "
           "Change the maximum work-group size of the device" << endl
+    << "  --memory-model      OPTIONS  "
+          "Model GPU memory coalescing, bank conflicts and caches" << endl
+    << "  --memory-trace      FILE     "
+          "Write a trace of kernel memory accesses to FILE" << endl
+    << "  --memory-usage               "
+          "Output current and peak memory usage after each kernel" << endl
+    << "  --metrics           FILE     "
+          "Periodically write live progress metrics to FILE" << endl
     << "  --num-threads       NUM      "
           "Set the number of worker threads to use" << endl
+    << "  --optimize                   "
+          "Optimize programs to reduce simulation time" << endl
+    << "  --optimize-full              "
+          "Also use optimizations that may hide memory errors" << endl
     << "  --pch-dir           DIR      "
           "Override directory containing precompiled headers" << endl
+    << "  --performance-lint  OPTIONS  "
+          "Report code likely to perform poorly on GPUs" << endl
     << "  --plugins           PLUGINS  "
           "Load colon separated list of plugin libraries" << endl
+    << "  --processes         NUM      "
+          "Divide the work-groups of kernels between NUM processes" << endl
+    << "  --profile                    "
+          "Report the time taken by each phase and plugin" << endl
+    << "  --profile-trace     FILE     "
+          "Also write a Chrome trace of the phases to FILE" << endl
     << "  --quick [-q]                 "
           "Only run first and last work-group" << endl
+    << "  --sample            N        "
+          "Only analyse one in N work-groups with plugins" << endl
+    << "  --sample-seed       SEED     "
+          "Seed used to select sampled work-groups" << endl
+    << "  --sample-strided             "
+          "Sample every Nth work-group instead of randomly" << endl
     << "  --uniform-writes             "
           "Don't suppress uniform write-write data-races" << endl
     << "  --uninitialized              "
@@ -12,7 +12,10 @@
 #include <cmath>
 #include <cstring>
 #include <iostream>
+#include <mutex>
+#include <set>
 #include <sstream>
+#include <thread>
 #include <dlfcn.h>
 
 #include "async_queue.h"
@@ -157,24 +160,6 @@ void notifyAPIError(cl_context context, cl_int err, const char* function,
     context->notify(error.c_str(), context->data, 0, NULL);
   }
 }
-
-void releaseCommand(oclgrind::Command* command)
-{
-  if (command)
-  {
-    asyncQueueRelease(command);
-
-    // Release dependent commands
-    while (!command->execBefore.empty())
-    {
-      oclgrind::Command* cmd = command->execBefore.front();
-      command->execBefore.pop_front();
-      releaseCommand(cmd);
-    }
-
-    delete command;
-  }
-}
 } // namespace
 
 namespace
@@ -231,6 +216,19 @@ public:
 static struct _cl_platform_id* m_platform = NULL;
 static struct _cl_device_id* m_device = NULL;
 
+// Sub-devices that have been created and not yet released
+static set<cl_device_id> m_subDevices;
+static mutex m_subDevicesLock;
+
+static bool isValidDevice(cl_device_id device)
+{
+  if (device == m_device)
+    return true;
+
+  lock_guard<mutex> lock(m_subDevicesLock);
+  return device && m_subDevices.count(device);
+}
+
 CL_API_ENTRY cl_int CL_API_CALL clIcdGetPlatformIDsKHR(
   cl_uint num_entries, cl_platform_id* platforms, cl_uint* num_platforms)
 {
@@ -241,8 +239,9 @@ CL_API_ENTRY cl_int CL_API_CALL clIcdGetPlatformIDsKHR(
     ReturnError(NULL, CL_INVALID_VALUE);
   }
 
-  if (!m_platform)
-  {
+  // Create the platform once, even when several host threads ask for it
+  static once_flag platformCreated;
+  call_once(platformCreated, [] {
     //First off, and this is more than a little bit hacky, if this is used by an application that is single threaded (doesn't use POSIX threads) but this library (or treated as an OpenCL ICD) does.
     //The first application reserves/links a version of the functions without multithreading guards, forking methods etc. So having the library perform a:
     //    dlopen("/lib/x86_64-linux-gnu/libpthread.so.0", RTLD_NOW|RTLD_GLOBAL);
@@ -265,7 +264,18 @@ CL_API_ENTRY cl_int CL_API_CALL clIcdGetPlatformIDsKHR(
                                                  DEFAULT_LOCAL_MEM_SIZE, false);
     m_device->maxWGSize =
       oclgrind::getEnvInt("OCLGRIND_MAX_WGSIZE", DEFAULT_MAX_WGSIZE, false);
-  }
+
+    // Report a compute unit for each worker thread that runs kernels
+    unsigned numCPUs = thread::hardware_concurrency();
+    m_device->firstUnit = 0;
+    m_device->numUnits = oclgrind::getEnvInt(
+      "OCLGRIND_COMPUTE_UNITS",
+      oclgrind::getEnvInt("OCLGRIND_NUM_THREADS", numCPUs ? numCPUs : 1,
+                          false),
+      false);
+    m_device->parent = NULL;
+    m_device->refCount = 1;
+  });
 
   if (platforms)
   {
@@ -438,7 +448,7 @@ CL_API_ENTRY cl_int CL_API_CALL clGetDeviceInfo(
   REGISTER_API;
 
   // Check device is valid
-  if (device != m_device)
+  if (!isValidDevice(device))
   {
     ReturnErrorArg(NULL, CL_INVALID_DEVICE, device);
   }
@@ -509,6 +519,11 @@ CL_API_ENTRY cl_int CL_API_CALL clGetDeviceInfo(
   // TODO: Populate this
   static constexpr cl_name_version opencl_c_features[] = {};
 
+  static constexpr cl_device_partition_property partition_properties[] = {
+    CL_DEVICE_PARTITION_EQUALLY,
+    CL_DEVICE_PARTITION_BY_COUNTS,
+  };
+
   switch (param_name)
   {
   case CL_DEVICE_TYPE:
@@ -521,8 +536,7 @@ CL_API_ENTRY cl_int CL_API_CALL clGetDeviceInfo(
     break;
   case CL_DEVICE_MAX_COMPUTE_UNITS:
     result_size = sizeof(cl_uint);
-    result_data.cluint =
-      oclgrind::getEnvInt("OCLGRIND_COMPUTE_UNITS", 1, false);
+    result_data.cluint = device->numUnits;
     break;
   case CL_DEVICE_MAX_WORK_ITEM_DIMENSIONS:
     result_size = sizeof(cl_uint);
@@ -797,16 +811,28 @@ CL_API_ENTRY cl_int CL_API_CALL clGetDeviceInfo(
     break;
   case CL_DEVICE_PARENT_DEVICE:
     result_size = sizeof(cl_device_id);
-    result_data.cldeviceid = NULL;
+    result_data.cldeviceid = device->parent;
     break;
   case CL_DEVICE_PARTITION_MAX_SUB_DEVICES:
     result_size = sizeof(cl_uint);
-    result_data.cluint = 0;
+    result_data.cluint = device->numUnits;
     break;
   case CL_DEVICE_PARTITION_PROPERTIES:
+    result_size = sizeof(partition_properties);
+    data = partition_properties;
+    break;
   case CL_DEVICE_PARTITION_TYPE:
-    result_size = sizeof(cl_device_partition_property);
-    result_data.cldevpartprop = 0;
+    if (device->partitionType.empty())
+    {
+      result_size = sizeof(cl_device_partition_property);
+      result_data.cldevpartprop = 0;
+    }
+    else
+    {
+      result_size =
+        device->partitionType.size() * sizeof(cl_device_partition_property);
+      data = device->partitionType.data();
+    }
     break;
   case CL_DEVICE_PARTITION_AFFINITY_DOMAIN:
     result_size = sizeof(cl_device_affinity_domain);
@@ -814,7 +840,7 @@ CL_API_ENTRY cl_int CL_API_CALL clGetDeviceInfo(
     break;
   case CL_DEVICE_REFERENCE_COUNT:
     result_size = sizeof(cl_uint);
-    result_data.cluint = 1;
+    result_data.cluint = device->refCount;
     break;
   case CL_DEVICE_PREFERRED_INTEROP_USER_SYNC:
     result_size = sizeof(cl_bool);
@@ -825,8 +851,11 @@ CL_API_ENTRY cl_int CL_API_CALL clGetDeviceInfo(
     result_data.sizet = 1024;
     break;
   case CL_DEVICE_SVM_CAPABILITIES:
+    // Global memory addresses encode a buffer index, so they can't equal the
+    // host addresses of SVM allocations and pointers stored inside SVM memory
+    // aren't translated, which fine-grained sharing would need
     result_size = sizeof(cl_device_svm_capabilities);
-    result_data.svm = 0;
+    result_data.svm = CL_DEVICE_SVM_COARSE_GRAIN_BUFFER;
     break;
   case CL_DEVICE_PREFERRED_PLATFORM_ATOMIC_ALIGNMENT:
     result_size = sizeof(cl_uint);
@@ -949,7 +978,118 @@ CL_API_ENTRY cl_int CL_API_CALL clCreateSubDevices(
 {
   REGISTER_API;
 
-  ReturnErrorInfo(NULL, CL_INVALID_VALUE, "Not yet implemented");
+  // Check parameters
+  if (!isValidDevice(in_device))
+  {
+    ReturnErrorArg(NULL, CL_INVALID_DEVICE, in_device);
+  }
+  if (!properties)
+  {
+    ReturnErrorArg(NULL, CL_INVALID_VALUE, properties);
+  }
+  if (!out_devices && num_entries)
+  {
+    ReturnErrorInfo(NULL, CL_INVALID_VALUE,
+                    "num_entries non-zero but out_devices is NULL");
+  }
+
+  // Get number of compute units in each sub-device
+  vector<cl_uint> counts;
+  const cl_device_partition_property* end = properties + 1;
+  switch (properties[0])
+  {
+  case CL_DEVICE_PARTITION_EQUALLY:
+  {
+    if (properties[1] <= 0)
+    {
+      ReturnErrorInfo(NULL, CL_INVALID_DEVICE_PARTITION_COUNT,
+                      "Invalid number of compute units: " << properties[1]);
+    }
+    if (properties[1] > in_device->numUnits)
+    {
+      ReturnErrorInfo(NULL, CL_DEVICE_PARTITION_FAILED,
+                      "Device only has " << in_device->numUnits
+                                         << " compute units");
+    }
+    counts.assign(in_device->numUnits / properties[1], properties[1]);
+    end = properties + 2;
+    break;
+  }
+  case CL_DEVICE_PARTITION_BY_COUNTS:
+  {
+    cl_uint total = 0;
+    for (end = properties + 1; *end != CL_DEVICE_PARTITION_BY_COUNTS_LIST_END;
+         end++)
+    {
+      if (*end <= 0 || *end > in_device->numUnits - total)
+      {
+        ReturnErrorInfo(NULL, CL_INVALID_DEVICE_PARTITION_COUNT,
+                        "Device only has " << in_device->numUnits
+                                           << " compute units");
+      }
+      counts.push_back(*end);
+      total += *end;
+    }
+    if (counts.empty())
+    {
+      ReturnErrorInfo(NULL, CL_INVALID_DEVICE_PARTITION_COUNT,
+                      "No compute unit counts given");
+    }
+    end++;
+    break;
+  }
+  default:
+    ReturnErrorInfo(NULL, CL_INVALID_VALUE,
+                    "Unsupported partition type: " << properties[0]);
+  }
+  if (*end)
+  {
+    ReturnErrorInfo(NULL, CL_INVALID_VALUE,
+                    "Only one partition type may be given");
+  }
+
+  if (out_devices)
+  {
+    if (num_entries < counts.size())
+    {
+      ReturnErrorInfo(NULL, CL_INVALID_VALUE,
+                      "num_entries is " << num_entries << ", but "
+                                        << counts.size()
+                                        << " sub-devices are created");
+    }
+
+    // Give each sub-device the next range of its parent's compute units
+    cl_uint firstUnit = in_device->firstUnit;
+    for (unsigned i = 0; i < counts.size(); i++)
+    {
+      cl_device_id device = new _cl_device_id;
+      device->dispatch = m_dispatchTable;
+      device->globalMemSize = in_device->globalMemSize;
+      device->constantMemSize = in_device->constantMemSize;
+      device->localMemSize = in_device->localMemSize;
+      device->maxWGSize = in_device->maxWGSize;
+      device->firstUnit = firstUnit;
+      device->numUnits = counts[i];
+      device->parent = in_device;
+      device->partitionType.assign(properties, end + 1);
+      device->refCount = 1;
+      firstUnit += counts[i];
+
+      clRetainDevice(in_device);
+      {
+        lock_guard<mutex> lock(m_subDevicesLock);
+        m_subDevices.insert(device);
+      }
+      out_devices[i] = device;
+    }
+  }
+
+  if (num_devices)
+  {
+    *num_devices = counts.size();
+  }
+
+  return CL_SUCCESS;
 }
 
 CL_API_ENTRY cl_int CL_API_CALL clRetainDevice(cl_device_id device)
@@ -957,6 +1097,17 @@ CL_API_ENTRY cl_int CL_API_CALL clRetainDevice(cl_device_id device)
 {
   REGISTER_API;
 
+  if (!isValidDevice(device))
+  {
+    ReturnErrorArg(NULL, CL_INVALID_DEVICE, device);
+  }
+
+  // Root devices are never released
+  if (device->parent)
+  {
+    device->refCount++;
+  }
+
   return CL_SUCCESS;
 }
 
@@ -965,6 +1116,21 @@ CL_API_ENTRY cl_int CL_API_CALL clReleaseDevice(cl_device_id device)
 {
   REGISTER_API;
 
+  if (!isValidDevice(device))
+  {
+    ReturnErrorArg(NULL, CL_INVALID_DEVICE, device);
+  }
+
+  if (device->parent && --device->refCount == 0)
+  {
+    {
+      lock_guard<mutex> lock(m_subDevicesLock);
+      m_subDevices.erase(device);
+    }
+    clReleaseDevice(device->parent);
+    delete device;
+  }
+
   return CL_SUCCESS;
 }
 
@@ -987,7 +1153,7 @@ CL_API_ENTRY cl_context CL_API_CALL clCreateContext(
     SetErrorArg(NULL, CL_INVALID_VALUE, devices);
     return NULL;
   }
-  if (devices[0] != m_device)
+  if (!isValidDevice(devices[0]))
   {
     SetError(NULL, CL_INVALID_DEVICE);
     return NULL;
@@ -1003,12 +1169,21 @@ CL_API_ENTRY cl_context CL_API_CALL clCreateContext(
   cl_context context = new _cl_context;
   context->dispatch = m_dispatchTable;
   context->context = new oclgrind::Context();
+  context->device = devices[0];
   context->notify = pfn_notify;
   context->data = user_data;
   context->properties = NULL;
   context->szProperties = 0;
   context->refCount = 1;
 
+  // Sub-devices run kernels on the CPUs of their own compute units
+  if (context->device->parent)
+  {
+    context->context->setWorkers(context->device->firstUnit,
+                                 context->device->numUnits);
+  }
+  clRetainDevice(context->device);
+
   if (properties)
   {
     int num = 1;
@@ -1050,6 +1225,7 @@ CL_API_ENTRY cl_context CL_API_CALL clCreateContextFromType(
   cl_context context = new _cl_context;
   context->dispatch = m_dispatchTable;
   context->context = new oclgrind::Context();
+  context->device = m_device;
   context->notify = pfn_notify;
   context->data = user_data;
   context->properties = NULL;
@@ -1114,6 +1290,7 @@ CL_API_ENTRY cl_int CL_API_CALL clReleaseContext(cl_context context)
     }
 
     delete context->context;
+    clReleaseDevice(context->device);
     delete context;
   }
 
@@ -1154,7 +1331,7 @@ CL_API_ENTRY cl_int CL_API_CALL clGetContextInfo(
     break;
   case CL_CONTEXT_DEVICES:
     result_size = sizeof(cl_device_id);
-    result_data.cldevid = m_device;
+    result_data.cldevid = context->device;
     break;
   case CL_CONTEXT_PROPERTIES:
     result_size = context->szProperties;
@@ -1196,7 +1373,7 @@ clCreateCommandQueue(cl_context context, cl_device_id device,
     SetErrorArg(NULL, CL_INVALID_CONTEXT, context);
     return NULL;
   }
-  if (device != m_device)
+  if (device != context->device)
   {
     SetErrorArg(context, CL_INVALID_DEVICE, device);
     return NULL;
@@ -1206,7 +1383,8 @@ clCreateCommandQueue(cl_context context, cl_device_id device,
   bool out_of_order = properties & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE;
   cl_command_queue queue;
   queue = new _cl_command_queue;
-  queue->queue = new oclgrind::Queue(context->context, out_of_order);
+  queue->queue = new oclgrind::Queue(context->context, out_of_order,
+                                     asyncQueueNotify);
   queue->dispatch = m_dispatchTable;
   queue->properties = properties;
   queue->context = context;
@@ -1255,9 +1433,7 @@ clReleaseCommandQueue(cl_command_queue command_queue) CL_API_SUFFIX__VERSION_1_0
 
   if (--command_queue->refCount == 0)
   {
-    // TODO: Retain/release queue from async thread
-    // TODO: Spec states that this function performs an implicit flush,
-    // so maybe we are OK to delete queue here?
+    // Let the queue's thread drain remaining commands before it is joined
     clFinish(command_queue);
     delete command_queue->queue;
     clReleaseContext(command_queue->context);
@@ -1301,7 +1477,7 @@ CL_API_ENTRY cl_int CL_API_CALL clGetCommandQueueInfo(
     break;
   case CL_QUEUE_DEVICE:
     result_size = sizeof(cl_device_id);
-    result_data.cldevid = m_device;
+    result_data.cldevid = command_queue->context->device;
     break;
   case CL_QUEUE_REFERENCE_COUNT:
     result_size = sizeof(cl_uint);
@@ -1379,7 +1555,9 @@ cl_mem createBuffer(cl_context context, cl_mem_flags flags, size_t size,
     return NULL;
   }
 
-  // Create memory object
+  // Create memory object, waiting for any command running on the device
+  lock_guard<shared_timed_mutex> lock(
+    context->context->getDeviceLock());
   oclgrind::Memory* globalMemory = context->context->getGlobalMemory();
   cl_mem mem = new _cl_mem;
   mem->dispatch = m_dispatchTable;
@@ -1417,6 +1595,29 @@ cl_mem createBuffer(cl_context context, cl_mem_flags flags, size_t size,
   SetError(context, CL_SUCCESS);
   return mem;
 }
+
+// Find the SVM allocation containing a host pointer, and the offset into it
+cl_mem getSVMBuffer(cl_context context, const void* ptr, size_t* offset = NULL)
+{
+  lock_guard<mutex> lock(context->svmLock);
+  auto itr = context->svmBuffers.upper_bound(ptr);
+  if (itr == context->svmBuffers.begin())
+  {
+    return NULL;
+  }
+  itr--;
+
+  size_t start = (size_t)itr->first;
+  if ((size_t)ptr - start >= itr->second->size)
+  {
+    return NULL;
+  }
+  if (offset)
+  {
+    *offset = (size_t)ptr - start;
+  }
+  return itr->second;
+}
 } // namespace
 
 CL_API_ENTRY cl_mem CL_API_CALL
@@ -1713,9 +1914,19 @@ cl_mem createImage(cl_context context, cl_mem_flags flags,
     }
   }
 
-  // Create image object wrapper
+  // Create image object wrapper (copying each field, as the reference count
+  // is atomic)
   cl_image* image = new cl_image;
-  *(cl_mem)image = *mem;
+  image->dispatch = mem->dispatch;
+  image->context = mem->context;
+  image->parent = mem->parent;
+  image->address = mem->address;
+  image->size = mem->size;
+  image->offset = mem->offset;
+  image->flags = mem->flags;
+  image->hostPtr = mem->hostPtr;
+  image->callbacks = mem->callbacks;
+  image->properties = mem->properties;
   image->isImage = true;
   image->format = *image_format;
   image->desc = *image_desc;
@@ -1850,8 +2061,12 @@ CL_API_ENTRY cl_int CL_API_CALL clReleaseMemObject(cl_mem memobj)
       }
       else
       {
-        memobj->context->context->getGlobalMemory()->deallocateBuffer(
-          memobj->address);
+        {
+          lock_guard<shared_timed_mutex> lock(
+            memobj->context->context->getDeviceLock());
+          memobj->context->context->getGlobalMemory()->deallocateBuffer(
+            memobj->address);
+        }
         clReleaseContext(memobj->context);
       }
 
@@ -2041,7 +2256,8 @@ CL_API_ENTRY cl_int CL_API_CALL clGetMemObjectInfo(
     break;
   case CL_MEM_USES_SVM_POINTER:
     result_size = sizeof(cl_bool);
-    result_data.clbool = CL_FALSE;
+    result_data.clbool = (memobj->flags & CL_MEM_USE_HOST_PTR) &&
+                         getSVMBuffer(memobj->context, memobj->hostPtr);
     break;
   case CL_MEM_PROPERTIES:
     result_size = memobj->properties.size() * sizeof(cl_mem_properties);
@@ -2397,6 +2613,7 @@ CL_API_ENTRY cl_program CL_API_CALL clCreateProgramWithSource(
   prog->dispatch = m_dispatchTable;
   prog->program = new oclgrind::Program(context->context, source);
   prog->context = context;
+  prog->building = false;
   prog->refCount = 1;
   if (!prog->program)
   {
@@ -2439,7 +2656,7 @@ CL_API_ENTRY cl_program CL_API_CALL clCreateProgramWithBinary(
     SetErrorArg(context, CL_INVALID_VALUE, binaries);
     return NULL;
   }
-  if (device_list[0] != m_device)
+  if (device_list[0] != context->device)
   {
     SetErrorArg(context, CL_INVALID_DEVICE, device_list);
     return NULL;
@@ -2451,6 +2668,7 @@ CL_API_ENTRY cl_program CL_API_CALL clCreateProgramWithBinary(
   prog->program = oclgrind::Program::createFromBitcode(context->context,
                                                        binaries[0], lengths[0]);
   prog->context = context;
+  prog->building = false;
   prog->refCount = 1;
   if (!prog->program)
   {
@@ -2489,6 +2707,78 @@ CL_API_ENTRY cl_program CL_API_CALL clCreateProgramWithBuiltInKernels(
   return NULL;
 }
 
+// Builds running on background threads, which the runtime waits for at
+// exit so that none outlives it
+static struct BackgroundBuilds
+{
+  mutex lock;
+  condition_variable complete;
+  unsigned active = 0;
+
+  void begin()
+  {
+    lock_guard<mutex> guard(lock);
+    active++;
+  }
+  void end()
+  {
+    {
+      lock_guard<mutex> guard(lock);
+      active--;
+    }
+    complete.notify_all();
+  }
+  ~BackgroundBuilds()
+  {
+    unique_lock<mutex> guard(lock);
+    complete.wait(guard, [this]() { return active == 0; });
+  }
+} m_backgroundBuilds;
+
+// Claim a program for a build, unless a previous build hasn't completed
+static bool beginBuild(cl_program program)
+{
+  lock_guard<mutex> lock(program->buildLock);
+  if (program->building)
+    return false;
+  program->building = true;
+  return true;
+}
+
+static void endBuild(cl_program program)
+{
+  {
+    lock_guard<mutex> lock(program->buildLock);
+    program->building = false;
+  }
+  program->buildComplete.notify_all();
+}
+
+static bool isBuilding(cl_program program)
+{
+  lock_guard<mutex> lock(program->buildLock);
+  return program->building;
+}
+
+// Wait for any build of a program to complete before reading its results
+static void waitForBuild(cl_program program)
+{
+  unique_lock<mutex> lock(program->buildLock);
+  program->buildComplete.wait(lock, [program]() { return !program->building; });
+}
+
+// Join the thread of a previous background build, detaching it instead if
+// called from that build's callback
+static void reapBuildThread(cl_program program)
+{
+  if (!program->buildThread.joinable())
+    return;
+  if (program->buildThread.get_id() == this_thread::get_id())
+    program->buildThread.detach();
+  else
+    program->buildThread.join();
+}
+
 CL_API_ENTRY cl_int CL_API_CALL clRetainProgram(cl_program program)
   CL_API_SUFFIX__VERSION_1_0
 {
@@ -2515,6 +2805,7 @@ CL_API_ENTRY cl_int CL_API_CALL clReleaseProgram(cl_program program)
 
   if (--program->refCount == 0)
   {
+    reapBuildThread(program);
     delete program->program;
     clReleaseContext(program->context);
     delete program;
@@ -2555,15 +2846,34 @@ CL_API_ENTRY cl_int CL_API_CALL clBuildProgram(
     ReturnErrorArg(program->context, CL_INVALID_DEVICE, device);
   }
 
-  // Build program
-  bool success = program->program->build(options);
+  if (!beginBuild(program))
+  {
+    ReturnErrorInfo(program->context, CL_INVALID_OPERATION,
+                    "Previous build of program has not completed");
+  }
 
-  // Fire callback
+  // Build in the background if a callback was provided, so that the build
+  // overlaps with other work on the host
   if (pfn_notify)
   {
-    pfn_notify(program, user_data);
+    clRetainProgram(program);
+    string buildOptions = options ? options : "";
+    reapBuildThread(program);
+    m_backgroundBuilds.begin();
+    program->buildThread = thread([=]() {
+      program->program->build(buildOptions.c_str());
+      endBuild(program);
+      pfn_notify(program, user_data);
+      clReleaseProgram(program);
+      m_backgroundBuilds.end();
+    });
+    return CL_SUCCESS;
   }
 
+  // Build program
+  bool success = program->program->build(options);
+  endBuild(program);
+
   if (!success)
   {
     ReturnError(program->context, CL_BUILD_PROGRAM_FAILURE);
@@ -2614,6 +2924,12 @@ CL_API_ENTRY cl_int CL_API_CALL clCompileProgram(
     ReturnErrorArg(program->context, CL_INVALID_DEVICE, device);
   }
 
+  if (!beginBuild(program))
+  {
+    ReturnErrorInfo(program->context, CL_INVALID_OPERATION,
+                    "Previous build of program has not completed");
+  }
+
   // Prepare headers
   list<oclgrind::Program::Header> headers;
   for (unsigned i = 0; i < num_input_headers; i++)
@@ -2622,8 +2938,34 @@ CL_API_ENTRY cl_int CL_API_CALL clCompileProgram(
       make_pair(header_include_names[i], input_headers[i]->program));
   }
 
+  // Build in the background if a callback was provided, keeping the headers
+  // alive until the build completes
+  if (pfn_notify)
+  {
+    clRetainProgram(program);
+    for (unsigned i = 0; i < num_input_headers; i++)
+      clRetainProgram(input_headers[i]);
+    vector<cl_program> headerPrograms(input_headers,
+                                      input_headers + num_input_headers);
+    string buildOptions = options ? options : "";
+    reapBuildThread(program);
+    m_backgroundBuilds.begin();
+    program->buildThread = thread([=]() {
+      program->program->build(buildOptions.c_str(), headers);
+      endBuild(program);
+      pfn_notify(program, user_data);
+      for (cl_program header : headerPrograms)
+        clReleaseProgram(header);
+      clReleaseProgram(program);
+      m_backgroundBuilds.end();
+    });
+    return CL_SUCCESS;
+  }
+
   // Build program
-  if (!program->program->build(options, headers))
+  bool success = program->program->build(options, headers);
+  endBuild(program);
+  if (!success)
   {
     ReturnError(program->context, CL_BUILD_PROGRAM_FAILURE);
   }
@@ -2680,6 +3022,13 @@ clLinkProgram(cl_context context, cl_uint num_devices,
   list<const oclgrind::Program*> programs;
   for (unsigned i = 0; i < num_input_programs; i++)
   {
+    if (isBuilding(input_programs[i]))
+    {
+      SetErrorInfo(context, CL_INVALID_OPERATION,
+                   "Compilation of input program " << i
+                                                   << " has not completed");
+      return NULL;
+    }
     programs.push_back(input_programs[i]->program);
   }
 
@@ -2689,6 +3038,7 @@ clLinkProgram(cl_context context, cl_uint num_devices,
   prog->program =
     oclgrind::Program::createFromPrograms(context->context, programs);
   prog->context = context;
+  prog->building = false;
   prog->refCount = 1;
   if (!prog->program)
   {
@@ -2726,6 +3076,7 @@ CL_API_ENTRY cl_int CL_API_CALL clGetProgramInfo(
   {
     ReturnErrorArg(NULL, CL_INVALID_PROGRAM, program);
   }
+  waitForBuild(program);
   if ((param_name == CL_PROGRAM_NUM_KERNELS ||
        param_name == CL_PROGRAM_KERNEL_NAMES) &&
       program->program->getBuildStatus() != CL_BUILD_SUCCESS)
@@ -2763,7 +3114,7 @@ CL_API_ENTRY cl_int CL_API_CALL clGetProgramInfo(
     break;
   case CL_PROGRAM_DEVICES:
     result_size = sizeof(cl_device_id);
-    result_data.device = m_device;
+    result_data.device = program->context->device;
     break;
   case CL_PROGRAM_SOURCE:
     str = program->program->getSource().c_str();
@@ -2854,11 +3205,17 @@ CL_API_ENTRY cl_int CL_API_CALL clGetProgramBuildInfo(
   } result_data;
   const char* str = 0;
 
+  // Only the status can be queried while a build is running
+  bool building = param_name == CL_PROGRAM_BUILD_STATUS && isBuilding(program);
+  if (!building)
+    waitForBuild(program);
+
   switch (param_name)
   {
   case CL_PROGRAM_BUILD_STATUS:
     result_size = sizeof(cl_build_status);
-    result_data.status = program->program->getBuildStatus();
+    result_data.status =
+      building ? CL_BUILD_IN_PROGRESS : program->program->getBuildStatus();
     break;
   case CL_PROGRAM_BUILD_OPTIONS:
     str = program->program->getBuildOptions().c_str();
@@ -2917,12 +3274,19 @@ clCreateKernel(cl_program program, const char* kernel_name,
     SetErrorArg(program->context, CL_INVALID_VALUE, kernel_name);
     return NULL;
   }
+  if (isBuilding(program))
+  {
+    SetErrorInfo(program->context, CL_INVALID_PROGRAM_EXECUTABLE,
+                 "Build of program has not completed");
+    return NULL;
+  }
 
   // Create kernel object
   cl_kernel kernel = new _cl_kernel;
   kernel->dispatch = m_dispatchTable;
   kernel->kernel = program->program->createKernel(kernel_name);
   kernel->program = program;
+  kernel->memArgs = make_shared<KernelMemArgs>();
   kernel->refCount = 1;
   if (!kernel->kernel)
   {
@@ -2949,6 +3313,11 @@ CL_API_ENTRY cl_int CL_API_CALL clCreateKernelsInProgram(
   {
     ReturnErrorArg(NULL, CL_INVALID_PROGRAM, program);
   }
+  if (isBuilding(program))
+  {
+    ReturnErrorInfo(program->context, CL_INVALID_PROGRAM_EXECUTABLE,
+                    "Build of program has not completed");
+  }
   if (program->program->getBuildStatus() != CL_BUILD_SUCCESS)
   {
     ReturnErrorInfo(program->context, CL_INVALID_PROGRAM_EXECUTABLE,
@@ -2973,6 +3342,7 @@ CL_API_ENTRY cl_int CL_API_CALL clCreateKernelsInProgram(
       kernel->dispatch = m_dispatchTable;
       kernel->kernel = program->program->createKernel(*itr);
       kernel->program = program;
+      kernel->memArgs = make_shared<KernelMemArgs>();
       kernel->refCount = 1;
       kernels[i++] = kernel;
 
@@ -3031,6 +3401,43 @@ CL_API_ENTRY cl_int CL_API_CALL clReleaseKernel(cl_kernel kernel)
   return CL_SUCCESS;
 }
 
+KernelMemArgs::KernelMemArgs(const KernelMemArgs& memArgs)
+    : args(memArgs.args)
+{
+  for (auto arg = args.begin(); arg != args.end(); arg++)
+  {
+    clRetainMemObject(arg->second);
+  }
+}
+
+KernelMemArgs::~KernelMemArgs()
+{
+  for (auto arg = args.begin(); arg != args.end(); arg++)
+  {
+    clReleaseMemObject(arg->second);
+  }
+}
+
+// Set the memory object argument at an index, or clear it if mem is NULL
+static void setKernelMemArg(cl_kernel kernel, cl_uint index, cl_mem mem)
+{
+  // Copy arguments that are shared with enqueued commands before changing
+  if (kernel->memArgs.use_count() > 1)
+    kernel->memArgs = make_shared<KernelMemArgs>(*kernel->memArgs);
+
+  std::map<cl_uint, cl_mem>& args = kernel->memArgs->args;
+  if (mem)
+    clRetainMemObject(mem);
+  auto arg = args.find(index);
+  if (arg != args.end())
+  {
+    clReleaseMemObject(arg->second);
+    args.erase(arg);
+  }
+  if (mem)
+    args[index] = mem;
+}
+
 CL_API_ENTRY cl_int CL_API_CALL
 clSetKernelArg(cl_kernel kernel, cl_uint arg_index, size_t arg_size,
                const void* arg_value) CL_API_SUFFIX__VERSION_1_0
@@ -3106,12 +3513,12 @@ clSetKernelArg(cl_kernel kernel, cl_uint arg_index, size_t arg_size,
         memcpy(value.data, &mem->address, arg_size);
       }
 
-      kernel->memArgs[arg_index] = mem;
+      setKernelMemArg(kernel, arg_index, mem);
     }
     else
     {
       value.setPointer(0);
-      kernel->memArgs.erase(arg_index);
+      setKernelMemArg(kernel, arg_index, NULL);
     }
     break;
   default:
@@ -3287,7 +3694,7 @@ CL_API_ENTRY cl_int CL_API_CALL clGetKernelWorkGroupInfo(
   {
     ReturnErrorArg(NULL, CL_INVALID_KERNEL, kernel);
   }
-  if (!device || device != m_device)
+  if (!device || device != kernel->program->context->device)
   {
     ReturnErrorArg(kernel->program->context, CL_INVALID_DEVICE, device);
   }
@@ -3349,15 +3756,6 @@ CL_API_ENTRY cl_int CL_API_CALL clGetKernelWorkGroupInfo(
 
 /* Event Object APIs  */
 
-namespace
-{
-// Utility to check if an event has completed (or terminated)
-inline bool isComplete(cl_event event)
-{
-  return (event->event->state == CL_COMPLETE || event->event->state < 0);
-}
-} // namespace
-
 CL_API_ENTRY cl_int CL_API_CALL clWaitForEvents(
   cl_uint num_events, const cl_event* event_list) CL_API_SUFFIX__VERSION_1_0
 {
@@ -3373,37 +3771,10 @@ CL_API_ENTRY cl_int CL_API_CALL clWaitForEvents(
     ReturnErrorInfo(NULL, CL_INVALID_VALUE, "event_list cannot be NULL");
   }
 
-  // Loop until all events complete
-  bool complete = false;
-  while (!complete)
+  // Wait for all events to complete, as their commands run on queue threads
+  for (unsigned i = 0; i < num_events; i++)
   {
-    complete = true;
-    for (unsigned i = 0; i < num_events; i++)
-    {
-      // Skip event if already complete
-      if (isComplete(event_list[i]))
-      {
-        continue;
-      }
-
-      // If it's not a user event, execute the associated command
-      if (event_list[i]->queue)
-      {
-        oclgrind::Command* cmd = event_list[i]->event->command;
-        event_list[i]->event->queue->execute(cmd, false);
-        releaseCommand(cmd);
-
-        // If it's still not complete, update flag
-        if (!isComplete(event_list[i]))
-        {
-          complete = false;
-        }
-      }
-      else
-      {
-        complete = false;
-      }
-    }
+    event_list[i]->event->wait();
   }
 
   // Check if any command terminated unsuccessfully
@@ -3577,14 +3948,9 @@ CL_API_ENTRY cl_int CL_API_CALL clSetUserEventStatus(
                     "Event status already set");
   }
 
-  event->event->state = execution_status;
-
-  // Perform callbacks
-  list<pair<void(CL_CALLBACK*)(cl_event, cl_int, void*), void*>>::iterator itr;
-  for (itr = event->callbacks.begin(); itr != event->callbacks.end(); itr++)
-  {
-    itr->first(event, execution_status, itr->second);
-  }
+  // Wake commands waiting for the event and perform callbacks
+  event->event->setState(execution_status);
+  asyncEventNotify(event, execution_status);
 
   return CL_SUCCESS;
 }
@@ -3613,7 +3979,7 @@ clSetEventCallback(cl_event event, cl_int command_exec_callback_type,
                    command_exec_callback_type);
   }
 
-  event->callbacks.push_back(make_pair(pfn_notify, user_data));
+  asyncEventCallback(event, command_exec_callback_type, pfn_notify, user_data);
 
   return CL_SUCCESS;
 }
@@ -3646,7 +4012,7 @@ CL_API_ENTRY cl_int CL_API_CALL clGetEventProfilingInfo(
     break;
   case CL_PROFILING_COMMAND_SUBMIT:
     result_size = sizeof(cl_ulong);
-    result = event->event->startTime;
+    result = event->event->submitTime;
     break;
   case CL_PROFILING_COMMAND_START:
     result_size = sizeof(cl_ulong);
@@ -3687,9 +4053,8 @@ CL_API_ENTRY cl_int CL_API_CALL clFlush(cl_command_queue command_queue)
     ReturnErrorArg(NULL, CL_INVALID_COMMAND_QUEUE, command_queue);
   }
 
-  // TODO: Implement properly?
-  clFinish(command_queue);
-
+  // Commands are submitted to the queue's thread as soon as they are
+  // enqueued, so there is nothing left to flush
   return CL_SUCCESS;
 }
 
@@ -3704,9 +4069,7 @@ CL_API_ENTRY cl_int CL_API_CALL clFinish(cl_command_queue command_queue)
     ReturnErrorArg(NULL, CL_INVALID_COMMAND_QUEUE, command_queue);
   }
 
-  // TODO: Move this finish to async thread?
-  oclgrind::Command* cmd = command_queue->queue->finish();
-  releaseCommand(cmd);
+  command_queue->queue->finish();
 
   return CL_SUCCESS;
 }
@@ -3751,12 +4114,12 @@ CL_API_ENTRY cl_int CL_API_CALL clEnqueueReadBuffer(
   cmd->address = buffer->address + offset;
   cmd->size = cb;
   asyncQueueRetain(cmd, buffer);
-  asyncEnqueue(command_queue, CL_COMMAND_READ_BUFFER, cmd,
-               num_events_in_wait_list, event_wait_list, event);
-
-  if (blocking_read)
+  cl_int err = asyncEnqueue(command_queue, CL_COMMAND_READ_BUFFER, cmd,
+                            num_events_in_wait_list, event_wait_list, event,
+                            blocking_read);
+  if (err != CL_SUCCESS)
   {
-    return clFinish(command_queue);
+    ReturnError(command_queue->context, err);
   }
 
   return CL_SUCCESS;
@@ -3837,12 +4200,12 @@ CL_API_ENTRY cl_int CL_API_CALL clEnqueueReadBufferRect(
   cmd->host_offset[2] = host_slice_pitch;
   memcpy(cmd->region, region, 3 * sizeof(size_t));
   asyncQueueRetain(cmd, buffer);
-  asyncEnqueue(command_queue, CL_COMMAND_READ_BUFFER_RECT, cmd,
-               num_events_in_wait_list, event_wait_list, event);
-
-  if (blocking_read)
+  cl_int err = asyncEnqueue(command_queue, CL_COMMAND_READ_BUFFER_RECT, cmd,
+                            num_events_in_wait_list, event_wait_list, event,
+                            blocking_read);
+  if (err != CL_SUCCESS)
   {
-    return clFinish(command_queue);
+    ReturnError(command_queue->context, err);
   }
 
   return CL_SUCCESS;
@@ -3888,12 +4251,12 @@ CL_API_ENTRY cl_int CL_API_CALL clEnqueueWriteBuffer(
   cmd->address = buffer->address + offset;
   cmd->size = cb;
   asyncQueueRetain(cmd, buffer);
-  asyncEnqueue(command_queue, CL_COMMAND_WRITE_BUFFER, cmd,
-               num_events_in_wait_list, event_wait_list, event);
-
-  if (blocking_write)
+  cl_int err = asyncEnqueue(command_queue, CL_COMMAND_WRITE_BUFFER, cmd,
+                            num_events_in_wait_list, event_wait_list, event,
+                            blocking_write);
+  if (err != CL_SUCCESS)
   {
-    return clFinish(command_queue);
+    ReturnError(command_queue->context, err);
   }
 
   return CL_SUCCESS;
@@ -3974,12 +4337,12 @@ CL_API_ENTRY cl_int CL_API_CALL clEnqueueWriteBufferRect(
   cmd->host_offset[2] = host_slice_pitch;
   memcpy(cmd->region, region, 3 * sizeof(size_t));
   asyncQueueRetain(cmd, buffer);
-  asyncEnqueue(command_queue, CL_COMMAND_WRITE_BUFFER_RECT, cmd,
-               num_events_in_wait_list, event_wait_list, event);
-
-  if (blocking_write)
+  cl_int err = asyncEnqueue(command_queue, CL_COMMAND_WRITE_BUFFER_RECT, cmd,
+                            num_events_in_wait_list, event_wait_list, event,
+                            blocking_write);
+  if (err != CL_SUCCESS)
   {
-    return clFinish(command_queue);
+    ReturnError(command_queue->context, err);
   }
 
   return CL_SUCCESS;
@@ -4683,14 +5046,10 @@ CL_API_ENTRY void* CL_API_CALL clEnqueueMapBuffer(
   cmd->size = cb;
   cmd->flags = map_flags;
   asyncQueueRetain(cmd, buffer);
-  asyncEnqueue(command_queue, CL_COMMAND_MAP_BUFFER, cmd,
-               num_events_in_wait_list, event_wait_list, event);
-
-  SetError(command_queue->context, CL_SUCCESS);
-  if (blocking_map)
-  {
-    SetError(command_queue->context, clFinish(command_queue));
-  }
+  cl_int err = asyncEnqueue(command_queue, CL_COMMAND_MAP_BUFFER, cmd,
+                            num_events_in_wait_list, event_wait_list, event,
+                            blocking_map);
+  SetError(command_queue->context, err);
 
   return ptr;
 }
@@ -4806,14 +5165,10 @@ CL_API_ENTRY void* CL_API_CALL clEnqueueMapImage(
   cmd->size = size;
   cmd->flags = map_flags;
   asyncQueueRetain(cmd, image);
-  asyncEnqueue(command_queue, CL_COMMAND_MAP_IMAGE, cmd,
-               num_events_in_wait_list, event_wait_list, event);
-
-  SetError(command_queue->context, CL_SUCCESS);
-  if (blocking_map)
-  {
-    SetError(command_queue->context, clFinish(command_queue));
-  }
+  cl_int err = asyncEnqueue(command_queue, CL_COMMAND_MAP_IMAGE, cmd,
+                            num_events_in_wait_list, event_wait_list, event,
+                            blocking_map);
+  SetError(command_queue->context, err);
 
   return ptr;
 }
@@ -4962,7 +5317,8 @@ CL_API_ENTRY cl_int CL_API_CALL clEnqueueNDRangeKernel(
   // Check that constant memory requirement is within device maximum
   size_t totalConstant = 0;
   std::map<cl_uint, cl_mem>::iterator arg;
-  for (arg = kernel->memArgs.begin(); arg != kernel->memArgs.end(); arg++)
+  for (arg = kernel->memArgs->args.begin(); arg != kernel->memArgs->args.end();
+       arg++)
   {
     if (kernel->kernel->getArgumentAddressQualifier(arg->first) ==
         CL_KERNEL_ARG_ADDRESS_CONSTANT)
@@ -5474,7 +5830,7 @@ CL_API_ENTRY cl_command_queue CL_API_CALL clCreateCommandQueueWithProperties(
     SetErrorArg(NULL, CL_INVALID_CONTEXT, context);
     return NULL;
   }
-  if (device != m_device)
+  if (device != context->device)
   {
     SetErrorArg(context, CL_INVALID_DEVICE, device);
     return NULL;
@@ -5515,7 +5871,8 @@ CL_API_ENTRY cl_command_queue CL_API_CALL clCreateCommandQueueWithProperties(
   // Create command-queue object
   cl_command_queue queue;
   queue = new _cl_command_queue;
-  queue->queue = new oclgrind::Queue(context->context, out_of_order);
+  queue->queue = new oclgrind::Queue(context->context, out_of_order,
+                                     asyncQueueNotify);
   queue->dispatch = m_dispatchTable;
   queue->properties = props;
   queue->context = context;
@@ -5551,15 +5908,112 @@ CL_API_ENTRY cl_int CL_API_CALL clGetPipeInfo(
   ReturnErrorInfo(NULL, CL_INVALID_MEM_OBJECT, "Pipes are not supported");
 }
 
+namespace
+{
+void CL_CALLBACK freeSVMStorage(cl_mem memobj, void* storage)
+{
+  free(storage);
+}
+
+struct SVMFreeArgs
+{
+  cl_command_queue queue;
+  void(CL_CALLBACK* func)(cl_command_queue, cl_uint, void*[], void*);
+  void* data;
+  cl_uint num;
+  void* pointers[1];
+};
+
+void CL_CALLBACK svmFreeCommand(void* args)
+{
+  SVMFreeArgs* svmFree = (SVMFreeArgs*)args;
+  if (svmFree->func)
+  {
+    svmFree->func(svmFree->queue, svmFree->num, svmFree->pointers,
+                  svmFree->data);
+  }
+  else
+  {
+    for (cl_uint i = 0; i < svmFree->num; i++)
+    {
+      clSVMFree(svmFree->queue->context, svmFree->pointers[i]);
+    }
+  }
+}
+} // namespace
+
 CL_API_ENTRY void* CL_API_CALL
 clSVMAlloc(cl_context context, cl_svm_mem_flags flags, size_t size,
            cl_uint alignment) CL_API_SUFFIX__VERSION_2_0
 {
   REGISTER_API;
 
-  notifyAPIError(context, CL_INVALID_OPERATION, __func__,
-                 "Unimplemented OpenCL 2.0 API");
-  return NULL;
+  // Check parameters
+  if (!context)
+  {
+    notifyAPIError(NULL, CL_INVALID_CONTEXT, __func__,
+                   "For argument 'context'");
+    return NULL;
+  }
+  if (size == 0 || size > m_device->globalMemSize)
+  {
+    notifyAPIError(context, CL_INVALID_VALUE, __func__,
+                   "For argument 'size'");
+    return NULL;
+  }
+  if (alignment & (alignment - 1))
+  {
+    notifyAPIError(context, CL_INVALID_VALUE, __func__,
+                   "alignment is not a power of two");
+    return NULL;
+  }
+  if (flags & (CL_MEM_SVM_FINE_GRAIN_BUFFER | CL_MEM_SVM_ATOMICS))
+  {
+    notifyAPIError(context, CL_INVALID_VALUE, __func__,
+                   "Fine-grained SVM buffers are not supported");
+    return NULL;
+  }
+  if (flags & ~(CL_MEM_READ_WRITE | CL_MEM_WRITE_ONLY | CL_MEM_READ_ONLY))
+  {
+    notifyAPIError(context, CL_INVALID_VALUE, __func__,
+                   "For argument 'flags'");
+    return NULL;
+  }
+
+  // Allocate the storage on the host, aligned to at least the largest
+  // OpenCL data type (long16)
+  if (alignment < 128)
+  {
+    alignment = 128;
+  }
+  unsigned char* storage = (unsigned char*)malloc(size + alignment - 1);
+  if (!storage)
+  {
+    notifyAPIError(context, CL_OUT_OF_HOST_MEMORY, __func__);
+    return NULL;
+  }
+  void* ptr =
+    (void*)(((size_t)storage + alignment - 1) & ~((size_t)alignment - 1));
+
+  // Global memory maps the buffer directly onto the host storage, so that
+  // neither the host nor kernels need to copy it
+  cl_mem_flags memFlags = CL_MEM_USE_HOST_PTR;
+  memFlags |=
+    flags & (CL_MEM_READ_WRITE | CL_MEM_WRITE_ONLY | CL_MEM_READ_ONLY);
+  cl_mem mem = createBuffer(context, memFlags, size, ptr, NULL);
+  if (!mem)
+  {
+    free(storage);
+    return NULL;
+  }
+  clSetMemObjectDestructorCallback(mem, freeSVMStorage, storage);
+
+  {
+    lock_guard<mutex> lock(context->svmLock);
+    context->svmBuffers[ptr] = mem;
+  }
+
+  return ptr;
 }
 
 CL_API_ENTRY void CL_API_CALL clSVMFree(cl_context context, void* svm_pointer)
@@ -5567,8 +6021,36 @@ CL_API_ENTRY void CL_API_CALL clSVMFree(cl_context context, void* svm_pointer)
 {
   REGISTER_API;
 
-  notifyAPIError(context, CL_INVALID_OPERATION, __func__,
-                 "Unimplemented OpenCL 2.0 API");
+  if (!context)
+  {
+    notifyAPIError(NULL, CL_INVALID_CONTEXT, __func__,
+                   "For argument 'context'");
+    return;
+  }
+  if (!svm_pointer)
+  {
+    return;
+  }
+
+  cl_mem mem = NULL;
+  {
+    lock_guard<mutex> lock(context->svmLock);
+    auto itr = context->svmBuffers.find(svm_pointer);
+    if (itr != context->svmBuffers.end())
+    {
+      mem = itr->second;
+      context->svmBuffers.erase(itr);
+    }
+  }
+  if (!mem)
+  {
+    notifyAPIError(context, CL_INVALID_VALUE, __func__,
+                   "svm_pointer was not allocated with clSVMAlloc");
+    return;
+  }
+
+  // The storage is freed once enqueued kernels have released the buffer
+  clReleaseMemObject(mem);
 }
 
 CL_API_ENTRY cl_int CL_API_CALL clEnqueueSVMFree(
@@ -5582,8 +6064,33 @@ CL_API_ENTRY cl_int CL_API_CALL clEnqueueSVMFree(
 {
   REGISTER_API;
 
-  ReturnErrorInfo(command_queue->context, CL_INVALID_OPERATION,
-                  "Unimplemented OpenCL 2.0 API");
+  // Check parameters
+  if (!command_queue)
+  {
+    ReturnErrorArg(NULL, CL_INVALID_COMMAND_QUEUE, command_queue);
+  }
+  if (num_svm_pointers == 0 || !svm_pointers)
+  {
+    ReturnErrorArg(command_queue->context, CL_INVALID_VALUE, svm_pointers);
+  }
+
+  // Free the pointers from host code run by the queue
+  size_t argsSize =
+    sizeof(SVMFreeArgs) + (num_svm_pointers - 1) * sizeof(void*);
+  SVMFreeArgs* args = (SVMFreeArgs*)malloc(argsSize);
+  args->queue = command_queue;
+  args->func = pfn_free_func;
+  args->data = user_data;
+  args->num = num_svm_pointers;
+  memcpy(args->pointers, svm_pointers, num_svm_pointers * sizeof(void*));
+
+  oclgrind::NativeKernelCommand* cmd =
+    new oclgrind::NativeKernelCommand(svmFreeCommand, args, argsSize);
+  free(args);
+  asyncEnqueue(command_queue, CL_COMMAND_SVM_FREE, cmd,
+               num_events_in_wait_list, event_wait_list, event);
+
+  return CL_SUCCESS;
 }
 
 CL_API_ENTRY cl_int CL_API_CALL clEnqueueSVMMemcpy(
@@ -5593,8 +6100,79 @@ CL_API_ENTRY cl_int CL_API_CALL clEnqueueSVMMemcpy(
 {
   REGISTER_API;
 
-  ReturnErrorInfo(command_queue->context, CL_INVALID_OPERATION,
-                  "Unimplemented OpenCL 2.0 API");
+  // Check parameters
+  if (!command_queue)
+  {
+    ReturnErrorArg(NULL, CL_INVALID_COMMAND_QUEUE, command_queue);
+  }
+  if (!dst_ptr)
+  {
+    ReturnErrorArg(command_queue->context, CL_INVALID_VALUE, dst_ptr);
+  }
+  if (!src_ptr)
+  {
+    ReturnErrorArg(command_queue->context, CL_INVALID_VALUE, src_ptr);
+  }
+  if ((size_t)src_ptr < (size_t)dst_ptr + size &&
+      (size_t)dst_ptr < (size_t)src_ptr + size)
+  {
+    ReturnErrorInfo(command_queue->context, CL_MEM_COPY_OVERLAP,
+                    "src_ptr and dst_ptr regions overlap");
+  }
+
+  size_t dstOffset, srcOffset;
+  cl_mem dst = getSVMBuffer(command_queue->context, dst_ptr, &dstOffset);
+  cl_mem src = getSVMBuffer(command_queue->context, src_ptr, &srcOffset);
+  if (dst && dstOffset + size > dst->size)
+  {
+    ReturnErrorInfo(command_queue->context, CL_INVALID_VALUE,
+                    "size (" << size << ") exceeds SVM allocation at dst_ptr");
+  }
+  if (src && srcOffset + size > src->size)
+  {
+    ReturnErrorInfo(command_queue->context, CL_INVALID_VALUE,
+                    "size (" << size << ") exceeds SVM allocation at src_ptr");
+  }
+
+  // Copies between SVM allocations run on the device, and copies to or from
+  // other host memory are transfers
+  oclgrind::Command* cmd;
+  if (dst && src)
+  {
+    oclgrind::CopyCommand* copy = new oclgrind::CopyCommand();
+    copy->dst = dst->address + dstOffset;
+    copy->src = src->address + srcOffset;
+    copy->size = size;
+    asyncQueueRetain(copy, src);
+    asyncQueueRetain(copy, dst);
+    cmd = copy;
+  }
+  else if (dst || src)
+  {
+    oclgrind::BufferCommand* transfer = new oclgrind::BufferCommand(
+      dst ? oclgrind::Command::WRITE : oclgrind::Command::READ);
+    transfer->ptr = (unsigned char*)(dst ? src_ptr : dst_ptr);
+    transfer->address =
+      dst ? dst->address + dstOffset : src->address + srcOffset;
+    transfer->size = size;
+    asyncQueueRetain(transfer, dst ? dst : src);
+    cmd = transfer;
+  }
+  else
+  {
+    ReturnErrorInfo(command_queue->context, CL_INVALID_VALUE,
+                    "Neither src_ptr nor dst_ptr is an SVM allocation");
+  }
+
+  cl_int err = asyncEnqueue(command_queue, CL_COMMAND_SVM_MEMCPY, cmd,
+                            num_events_in_wait_list, event_wait_list, event,
+                            blocking_copy);
+  if (err != CL_SUCCESS)
+  {
+    ReturnError(command_queue->context, err);
+  }
+
+  return CL_SUCCESS;
 }
 
 CL_API_ENTRY cl_int CL_API_CALL clEnqueueSVMMemFill(
@@ -5604,8 +6182,56 @@ CL_API_ENTRY cl_int CL_API_CALL clEnqueueSVMMemFill(
 {
   REGISTER_API;
 
-  ReturnErrorInfo(command_queue->context, CL_INVALID_OPERATION,
-                  "Unimplemented OpenCL 2.0 API");
+  // Check parameters
+  if (!command_queue)
+  {
+    ReturnErrorArg(NULL, CL_INVALID_COMMAND_QUEUE, command_queue);
+  }
+  size_t offset;
+  cl_mem buffer = getSVMBuffer(command_queue->context, svm_ptr, &offset);
+  if (!buffer)
+  {
+    ReturnErrorInfo(command_queue->context, CL_INVALID_VALUE,
+                    "svm_ptr is not an SVM allocation");
+  }
+  if (offset + size > buffer->size)
+  {
+    ReturnErrorInfo(command_queue->context, CL_INVALID_VALUE,
+                    "size (" << size << ") exceeds SVM allocation");
+  }
+  if (!pattern)
+  {
+    ReturnErrorArg(command_queue->context, CL_INVALID_VALUE, pattern);
+  }
+  if (pattern_size == 0 || pattern_size > 128 ||
+      (pattern_size & (pattern_size - 1)))
+  {
+    ReturnErrorArg(command_queue->context, CL_INVALID_VALUE, pattern_size);
+  }
+  if ((size_t)svm_ptr % pattern_size)
+  {
+    ReturnErrorInfo(command_queue->context, CL_INVALID_VALUE,
+                    "svm_ptr not aligned to pattern_size (" << pattern_size
+                                                            << ")");
+  }
+  if (size % pattern_size)
+  {
+    ReturnErrorInfo(command_queue->context, CL_INVALID_VALUE,
+                    "size (" << size << ")"
+                             << " not a multiple of pattern_size ("
+                             << pattern_size << ")");
+  }
+
+  // Enqueue command
+  oclgrind::FillBufferCommand* cmd = new oclgrind::FillBufferCommand(
+    (const unsigned char*)pattern, pattern_size);
+  cmd->address = buffer->address + offset;
+  cmd->size = size;
+  asyncQueueRetain(cmd, buffer);
+  asyncEnqueue(command_queue, CL_COMMAND_SVM_MEMFILL, cmd,
+               num_events_in_wait_list, event_wait_list, event);
+
+  return CL_SUCCESS;
 }
 
 CL_API_ENTRY cl_int CL_API_CALL clEnqueueSVMMap(
@@ -5615,8 +6241,35 @@ CL_API_ENTRY cl_int CL_API_CALL clEnqueueSVMMap(
 {
   REGISTER_API;
 
-  ReturnErrorInfo(command_queue->context, CL_INVALID_OPERATION,
-                  "Unimplemented OpenCL 2.0 API");
+  // Check parameters
+  if (!command_queue)
+  {
+    ReturnErrorArg(NULL, CL_INVALID_COMMAND_QUEUE, command_queue);
+  }
+  size_t offset;
+  cl_mem buffer = getSVMBuffer(command_queue->context, svm_ptr, &offset);
+  if (!buffer)
+  {
+    ReturnErrorInfo(command_queue->context, CL_INVALID_VALUE,
+                    "svm_ptr is not an SVM allocation");
+  }
+  if (size == 0 || offset + size > buffer->size)
+  {
+    ReturnErrorArg(command_queue->context, CL_INVALID_VALUE, size);
+  }
+
+  // The host already accesses the buffer's storage directly, so mapping only
+  // orders the host's accesses with the commands in the queue
+  oclgrind::Command* cmd = new oclgrind::Command();
+  cl_int err = asyncEnqueue(command_queue, CL_COMMAND_SVM_MAP, cmd,
+                            num_events_in_wait_list, event_wait_list, event,
+                            blocking_map);
+  if (err != CL_SUCCESS)
+  {
+    ReturnError(command_queue->context, err);
+  }
+
+  return CL_SUCCESS;
 }
 
 CL_API_ENTRY cl_int CL_API_CALL clEnqueueSVMUnmap(
@@ -5626,8 +6279,23 @@ CL_API_ENTRY cl_int CL_API_CALL clEnqueueSVMUnmap(
 {
   REGISTER_API;
 
-  ReturnErrorInfo(command_queue->context, CL_INVALID_OPERATION,
-                  "Unimplemented OpenCL 2.0 API");
+  // Check parameters
+  if (!command_queue)
+  {
+    ReturnErrorArg(NULL, CL_INVALID_COMMAND_QUEUE, command_queue);
+  }
+  if (!getSVMBuffer(command_queue->context, svm_ptr))
+  {
+    ReturnErrorInfo(command_queue->context, CL_INVALID_VALUE,
+                    "svm_ptr is not an SVM allocation");
+  }
+
+  // Enqueue command
+  oclgrind::Command* cmd = new oclgrind::Command();
+  asyncEnqueue(command_queue, CL_COMMAND_SVM_UNMAP, cmd,
+               num_events_in_wait_list, event_wait_list, event);
+
+  return CL_SUCCESS;
 }
 
 CL_API_ENTRY cl_sampler CL_API_CALL clCreateSamplerWithProperties(
@@ -5736,8 +6404,53 @@ clSetKernelArgSVMPointer(cl_kernel kernel, cl_uint arg_index,
 {
   REGISTER_API;
 
-  ReturnErrorInfo(kernel->program->context, CL_INVALID_OPERATION,
-                  "Unimplemented OpenCL 2.0 API");
+  // Check parameters are valid
+  if (!kernel)
+  {
+    ReturnErrorArg(NULL, CL_INVALID_KERNEL, kernel);
+  }
+  if (arg_index >= kernel->kernel->getNumArguments())
+  {
+    ReturnErrorInfo(kernel->program->context, CL_INVALID_ARG_INDEX,
+                    "arg_index is " << arg_index << ", but kernel has "
+                                    << kernel->kernel->getNumArguments()
+                                    << " arguments");
+  }
+  unsigned int addr = kernel->kernel->getArgumentAddressQualifier(arg_index);
+  if (addr != CL_KERNEL_ARG_ADDRESS_GLOBAL &&
+      addr != CL_KERNEL_ARG_ADDRESS_CONSTANT)
+  {
+    ReturnErrorInfo(kernel->program->context, CL_INVALID_ARG_INDEX,
+                    "Argument is not a global or constant pointer");
+  }
+
+  // Translate the host pointer to the address of the SVM buffer in global
+  // memory, keeping the buffer alive while the kernel uses it
+  size_t address = 0;
+  cl_mem mem = NULL;
+  if (arg_value)
+  {
+    size_t offset;
+    mem = getSVMBuffer(kernel->program->context, arg_value, &offset);
+    if (!mem)
+    {
+      ReturnErrorInfo(kernel->program->context, CL_INVALID_ARG_VALUE,
+                      "arg_value is not within an SVM allocation");
+    }
+    address = mem->address + offset;
+  }
+  setKernelMemArg(kernel, arg_index, mem);
+
+  // Set argument
+  oclgrind::TypedValue value;
+  value.size = sizeof(size_t);
+  value.num = 1;
+  value.data = new unsigned char[value.size];
+  value.setPointer(address);
+  kernel->kernel->setArgument(arg_index, value);
+  delete[] value.data;
+
+  return CL_SUCCESS;
 }
 
 CL_API_ENTRY cl_int CL_API_CALL clSetKernelExecInfo(
@@ -5746,8 +6459,44 @@ CL_API_ENTRY cl_int CL_API_CALL clSetKernelExecInfo(
 {
   REGISTER_API;
 
-  ReturnErrorInfo(kernel->program->context, CL_INVALID_OPERATION,
-                  "Unimplemented OpenCL 2.0 API");
+  // Check parameters are valid
+  if (!kernel)
+  {
+    ReturnErrorArg(NULL, CL_INVALID_KERNEL, kernel);
+  }
+  if (!param_value)
+  {
+    ReturnErrorArg(kernel->program->context, CL_INVALID_VALUE, param_value);
+  }
+
+  switch (param_name)
+  {
+  case CL_KERNEL_EXEC_INFO_SVM_PTRS:
+    // SVM buffers stay allocated until they are freed, so there is nothing
+    // to track for pointers that kernels use indirectly
+    if (param_value_size % sizeof(void*))
+    {
+      ReturnErrorArg(kernel->program->context, CL_INVALID_VALUE,
+                     param_value_size);
+    }
+    break;
+  case CL_KERNEL_EXEC_INFO_SVM_FINE_GRAIN_SYSTEM:
+    if (param_value_size != sizeof(cl_bool))
+    {
+      ReturnErrorArg(kernel->program->context, CL_INVALID_VALUE,
+                     param_value_size);
+    }
+    if (*(const cl_bool*)param_value)
+    {
+      ReturnErrorInfo(kernel->program->context, CL_INVALID_OPERATION,
+                      "Fine-grained system SVM is not supported");
+    }
+    break;
+  default:
+    ReturnErrorArg(kernel->program->context, CL_INVALID_VALUE, param_name);
+  }
+
+  return CL_SUCCESS;
 }
 
 CL_API_ENTRY cl_kernel CL_API_CALL clCloneKernel(
@@ -5766,7 +6515,7 @@ CL_API_ENTRY cl_kernel CL_API_CALL clCloneKernel(
   kernel->dispatch = m_dispatchTable;
   kernel->kernel = new oclgrind::Kernel(*source_kernel->kernel);
   kernel->program = source_kernel->program;
-  kernel->memArgs = source_kernel->memArgs;
+  kernel->memArgs = source_kernel->memArgs; // Copied when either changes
   for (auto src_img : source_kernel->imageArgs)
   {
     oclgrind::Image* image = new oclgrind::Image;
@@ -5801,8 +6550,33 @@ CL_API_ENTRY cl_int CL_API_CALL clEnqueueSVMMigrateMem(
 {
   REGISTER_API;
 
-  ReturnErrorInfo(command_queue->context, CL_INVALID_OPERATION,
-                  "Unimplemented OpenCL 2.1 API");
+  // Check parameters
+  if (!command_queue)
+  {
+    ReturnErrorArg(NULL, CL_INVALID_COMMAND_QUEUE, command_queue);
+  }
+  if (num_svm_pointers == 0 || !svm_pointers)
+  {
+    ReturnErrorArg(command_queue->context, CL_INVALID_VALUE, svm_pointers);
+  }
+  for (unsigned i = 0; i < num_svm_pointers; i++)
+  {
+    size_t offset;
+    cl_mem buffer =
+      getSVMBuffer(command_queue->context, svm_pointers[i], &offset);
+    if (!buffer || (sizes && offset + sizes[i] > buffer->size))
+    {
+      ReturnErrorInfo(command_queue->context, CL_INVALID_VALUE,
+                      "svm_pointers[" << i << "] is not an SVM allocation");
+    }
+  }
+
+  // The host and device share the storage, so there is nothing to migrate
+  oclgrind::Command* cmd = new oclgrind::Command();
+  asyncEnqueue(command_queue, CL_COMMAND_SVM_MIGRATE_MEM, cmd,
+               num_events_in_wait_list, event_wait_list, event);
+
+  return CL_SUCCESS;
 }
 
 CL_API_ENTRY cl_int CL_API_CALL
@@ -0,0 +1,98 @@
+// MemoryTraceFormat.h (Oclgrind)
+// Copyright (c) 2013-2019, James Price and Simon McIntosh-Smith,
+// University of Bristol. All rights reserved.
+//
+// This program is provided under a three-clause BSD license. For full
+// license terms please see the LICENSE file distributed with this
+// source code.
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+// Memory traces start with an 8-byte magic string and a 32-bit version,
+// followed by chunks that each have a type byte and a 32-bit payload size
+// (integers in headers are little-endian, all others are LEB128 varints).
+//
+// A kernel chunk starts each kernel launch, holding the kernel name, its
+// global and local sizes, and the instructions that records refer to by
+// ID (each as its text and source line, or 0 if unknown).
+//
+// A records chunk holds a count and that many records, each encoded
+// relative to the previous record of the chunk, so that chunks decode
+// independently:
+//   uint8  flags  (kind | space << 2 | TRACE_NEW_*)
+//   svarint address delta from the previous address of the same instruction
+//   varint  timestep delta
+//   svarint work-group index delta, work-item global index + 1 delta
+//           (if NEW_WORKER)
+//   varint  size (if NEW_SIZE)
+//   varint  instruction ID + 1 (if NEW_INSTRUCTION)
+// A work-item index of 0 marks accesses made by a whole work-group, such
+// as async copies, and an instruction ID of 0 marks an unknown instruction.
+// Basing address deltas on the instruction keeps those of strided accesses
+// small, when the work-items of a group run one after another.
+
+namespace oclgrind
+{
+#define TRACE_MAGIC "OCLGTRC"
+#define TRACE_VERSION 1
+
+enum TraceChunkType
+{
+  TraceChunkKernel = 1,
+  TraceChunkRecords = 2,
+};
+
+enum TraceRecordKind
+{
+  TraceLoad,
+  TraceStore,
+  TraceAtomicLoad,
+  TraceAtomicStore,
+};
+
+#define TRACE_NEW_WORKER 0x10
+#define TRACE_NEW_SIZE 0x20
+#define TRACE_NEW_INSTRUCTION 0x40
+
+inline void writeTraceVarint(std::string& data, uint64_t value)
+{
+  while (value >= 0x80)
+  {
+    data += (char)(value | 0x80);
+    value >>= 7;
+  }
+  data += (char)value;
+}
+
+inline void writeTraceSignedVarint(std::string& data, int64_t value)
+{
+  writeTraceVarint(data, ((uint64_t)value << 1) ^ (uint64_t)(value >> 63));
+}
+
+inline bool readTraceVarint(const std::string& data, size_t& offset,
+                            uint64_t& value)
+{
+  value = 0;
+  for (unsigned shift = 0; shift < 64 && offset < data.size(); shift += 7)
+  {
+    uint8_t byte = data[offset++];
+    value |= (uint64_t)(byte & 0x7F) << shift;
+    if (!(byte & 0x80))
+      return true;
+  }
+  return false;
+}
+
+inline bool readTraceSignedVarint(const std::string& data, size_t& offset,
+                                  int64_t& value)
+{
+  uint64_t zigzag;
+  if (!readTraceVarint(data, offset, zigzag))
+    return false;
+  value = (int64_t)(zigzag >> 1) ^ -(int64_t)(zigzag & 1);
+  return true;
+}
+} // namespace oclgrind
@@ -0,0 +1,182 @@
+// MemoryTraceReader.cpp (Oclgrind)
+// Copyright (c) 2013-2019, James Price and Simon McIntosh-Smith,
+// University of Bristol. All rights reserved.
+//
+// This program is provided under a three-clause BSD license. For full
+// license terms please see the LICENSE file distributed with this
+// source code.
+
+#include <cstring>
+#include <stdexcept>
+
+#include "MemoryTraceReader.h"
+
+using namespace oclgrind;
+using namespace std;
+
+static uint32_t readLE32(const unsigned char* bytes)
+{
+  return bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) |
+         ((uint32_t)bytes[3] << 24);
+}
+
+MemoryTraceReader::MemoryTraceReader(const char* filename)
+  : m_file(filename, ios::binary), m_filename(filename)
+{
+  if (!m_file)
+    error("cannot open file");
+
+  char magic[sizeof(TRACE_MAGIC)];
+  unsigned char version[4];
+  if (!m_file.read(magic, sizeof(magic)) ||
+      memcmp(magic, TRACE_MAGIC, sizeof(magic)) ||
+      !m_file.read((char*)version, sizeof(version)))
+  {
+    error("not a memory trace");
+  }
+  if (readLE32(version) != TRACE_VERSION)
+    error("unsupported version " + to_string(readLE32(version)));
+
+  m_newKernel = false;
+  m_offset = 0;
+  m_remaining = 0;
+}
+
+void MemoryTraceReader::error(const string& message) const
+{
+  throw runtime_error(m_filename + ": " + message);
+}
+
+const MemoryTraceReader::Kernel& MemoryTraceReader::getKernel() const
+{
+  return m_kernel;
+}
+
+bool MemoryTraceReader::nextRecord(Record& record, bool* newKernel)
+{
+  // Read chunks until one has records left
+  while (!m_remaining)
+  {
+    if (!readChunk())
+      return false;
+  }
+  m_remaining--;
+
+  uint8_t flags = m_offset < m_chunk.size() ? m_chunk[m_offset++] : 0;
+  if (flags >> 7)
+    error("invalid record flags");
+  record.kind = (TraceRecordKind)(flags & 0x3);
+  record.addressSpace = (flags >> 2) & 0x3;
+
+  int64_t delta = readSignedVarint();
+  record.timestep = m_previous.timestep + readVarint();
+
+  if (flags & TRACE_NEW_WORKER)
+  {
+    record.workGroup = m_previous.workGroup + readSignedVarint();
+    record.workItem = m_previous.workItem + readSignedVarint();
+  }
+  else
+  {
+    record.workGroup = m_previous.workGroup;
+    record.workItem = m_previous.workItem;
+  }
+  record.size = flags & TRACE_NEW_SIZE ? readVarint() : m_previous.size;
+  record.instruction = flags & TRACE_NEW_INSTRUCTION ? readVarint() - 1
+                                                     : m_previous.instruction;
+  if (record.instruction != NONE &&
+      record.instruction >= m_kernel.instructions.size())
+  {
+    error("invalid instruction ID");
+  }
+  uint64_t& address = m_addresses[record.instruction + 1];
+  address += delta;
+  record.address = address;
+  m_previous = record;
+
+  if (newKernel)
+    *newKernel = m_newKernel;
+  m_newKernel = false;
+  return true;
+}
+
+bool MemoryTraceReader::readChunk()
+{
+  unsigned char header[5];
+  if (!m_file.read((char*)header, sizeof(header)))
+  {
+    if (m_file.gcount())
+      error("truncated chunk header");
+    return false;
+  }
+
+  m_chunk.resize(readLE32(header + 1));
+  if (!m_file.read(&m_chunk[0], m_chunk.size()))
+    error("truncated chunk");
+  m_offset = 0;
+
+  switch (header[0])
+  {
+  case TraceChunkKernel:
+    readKernel();
+    break;
+  case TraceChunkRecords:
+    if (m_kernel.name.empty())
+      error("records before first kernel");
+    m_remaining = readVarint();
+    memset(&m_previous, 0, sizeof(m_previous));
+    m_previous.workItem = NONE;
+    m_previous.instruction = NONE;
+    m_addresses.assign(m_kernel.instructions.size() + 1, 0);
+    break;
+  default:
+    // Skip chunks added by later versions
+    m_remaining = 0;
+    break;
+  }
+  return true;
+}
+
+void MemoryTraceReader::readKernel()
+{
+  uint64_t length = readVarint();
+  if (length > m_chunk.size() - m_offset)
+    error("truncated kernel name");
+  m_kernel.name = m_chunk.substr(m_offset, length);
+  m_offset += length;
+
+  for (unsigned i = 0; i < 3; i++)
+    m_kernel.globalSize[i] = readVarint();
+  for (unsigned i = 0; i < 3; i++)
+    m_kernel.localSize[i] = readVarint();
+
+  m_kernel.instructions.resize(readVarint());
+  for (Instruction& instruction : m_kernel.instructions)
+  {
+    length = readVarint();
+    if (length > m_chunk.size() - m_offset)
+      error("truncated instruction");
+    instruction.text = m_chunk.substr(m_offset, length);
+    m_offset += length;
+    instruction.line = readVarint();
+  }
+
+  m_newKernel = true;
+  m_remaining = 0;
+}
+
+int64_t MemoryTraceReader::readSignedVarint()
+{
+  int64_t value;
+  if (!readTraceSignedVarint(m_chunk, m_offset, value))
+    error("truncated chunk");
+  return value;
+}
+
+uint64_t MemoryTraceReader::readVarint()
+{
+  uint64_t value;
+  if (!readTraceVarint(m_chunk, m_offset, value))
+    error("truncated chunk");
+  return value;
+}
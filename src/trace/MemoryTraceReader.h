@@ -0,0 +1,77 @@
+// MemoryTraceReader.h (Oclgrind)
+// Copyright (c) 2013-2019, James Price and Simon McIntosh-Smith,
+// University of Bristol. All rights reserved.
+//
+// This program is provided under a three-clause BSD license. For full
+// license terms please see the LICENSE file distributed with this
+// source code.
+
+#pragma once
+
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "MemoryTraceFormat.h"
+
+namespace oclgrind
+{
+// Reads memory traces written by the MemoryTrace plugin, one chunk at a
+// time, throwing std::runtime_error if a trace is malformed
+class MemoryTraceReader
+{
+public:
+  struct Instruction
+  {
+    std::string text;
+    unsigned line;
+  };
+  struct Kernel
+  {
+    std::string name;
+    size_t globalSize[3];
+    size_t localSize[3];
+    std::vector<Instruction> instructions;
+  };
+  struct Record
+  {
+    TraceRecordKind kind;
+    unsigned addressSpace;
+    uint64_t address;
+    uint64_t size;
+    uint64_t timestep;
+    uint64_t workGroup;
+    // NONE for accesses made by a whole work-group, or unknown instructions
+    uint64_t workItem;
+    uint64_t instruction;
+  };
+  static const uint64_t NONE = UINT64_MAX;
+
+  MemoryTraceReader(const char* filename);
+
+  // The kernel that the last record read belongs to
+  const Kernel& getKernel() const;
+
+  // Read the next record, returning false at the end of the trace, with
+  // newKernel set if it is the first record of a kernel launch
+  bool nextRecord(Record& record, bool* newKernel = NULL);
+
+private:
+  std::ifstream m_file;
+  std::string m_filename;
+  Kernel m_kernel;
+  bool m_newKernel;
+
+  std::string m_chunk;
+  size_t m_offset;
+  uint64_t m_remaining;
+  Record m_previous;
+  std::vector<uint64_t> m_addresses;
+
+  void error(const std::string& message) const;
+  bool readChunk();
+  void readKernel();
+  int64_t readSignedVarint();
+  uint64_t readVarint();
+};
+} // namespace oclgrind
@@ -0,0 +1,164 @@
+// oclgrind-trace.cpp (Oclgrind)
+// Copyright (c) 2013-2019, James Price and Simon McIntosh-Smith,
+// University of Bristol. All rights reserved.
+//
+// This program is provided under a three-clause BSD license. For full
+// license terms please see the LICENSE file distributed with this
+// source code.
+
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+#include "MemoryTraceReader.h"
+
+using namespace oclgrind;
+using namespace std;
+
+static const char* kindNames[] = {"load", "store", "atomic_load",
+                                  "atomic_store"};
+static const char* spaceNames[] = {"private", "global", "constant", "local"};
+
+static void printKernel(const MemoryTraceReader::Kernel& kernel,
+                        bool instructions);
+static void printSummary(const MemoryTraceReader::Kernel& kernel,
+                         const uint64_t counts[4][4],
+                         const uint64_t bytes[4][4]);
+static void printUsage();
+
+int main(int argc, char* argv[])
+{
+  const char* filename = NULL;
+  bool summary = false;
+  for (int i = 1; i < argc; i++)
+  {
+    if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help"))
+    {
+      printUsage();
+      return 0;
+    }
+    else if (!strcmp(argv[i], "--summary"))
+    {
+      summary = true;
+    }
+    else if (!filename && argv[i][0] != '-')
+    {
+      filename = argv[i];
+    }
+    else
+    {
+      cerr << "Unexpected argument '" << argv[i] << "'" << endl;
+      printUsage();
+      return 1;
+    }
+  }
+  if (!filename)
+  {
+    printUsage();
+    return 1;
+  }
+
+  try
+  {
+    MemoryTraceReader reader(filename);
+    MemoryTraceReader::Kernel kernel;
+    MemoryTraceReader::Record record;
+    bool newKernel;
+    bool first = true;
+    uint64_t counts[4][4], bytes[4][4];
+    while (reader.nextRecord(record, &newKernel))
+    {
+      if (newKernel)
+      {
+        if (summary && !first)
+          printSummary(kernel, counts, bytes);
+        kernel = reader.getKernel();
+        memset(counts, 0, sizeof(counts));
+        memset(bytes, 0, sizeof(bytes));
+        if (!summary)
+          printKernel(kernel, true);
+        first = false;
+      }
+
+      if (summary)
+      {
+        counts[record.kind][record.addressSpace]++;
+        bytes[record.kind][record.addressSpace] += record.size;
+        continue;
+      }
+
+      cout << record.timestep << "," << kindNames[record.kind] << ","
+           << spaceNames[record.addressSpace] << ",0x" << hex
+           << record.address << dec << "," << record.size << ","
+           << record.workGroup << ",";
+      if (record.workItem != MemoryTraceReader::NONE)
+        cout << record.workItem;
+      cout << ",";
+      if (record.instruction != MemoryTraceReader::NONE)
+        cout << record.instruction;
+      cout << endl;
+    }
+    if (summary && !first)
+      printSummary(kernel, counts, bytes);
+  }
+  catch (runtime_error& err)
+  {
+    cerr << "oclgrind-trace: " << err.what() << endl;
+    return 1;
+  }
+
+  return 0;
+}
+
+static void printKernel(const MemoryTraceReader::Kernel& kernel,
+                        bool instructions)
+{
+  cout << "# Kernel " << kernel.name << ", global size ("
+       << kernel.globalSize[0] << "," << kernel.globalSize[1] << ","
+       << kernel.globalSize[2] << "), local size (" << kernel.localSize[0]
+       << "," << kernel.localSize[1] << "," << kernel.localSize[2] << ")"
+       << endl;
+  if (instructions)
+  {
+    for (size_t i = 0; i < kernel.instructions.size(); i++)
+    {
+      cout << "# " << i << ": " << kernel.instructions[i].text;
+      if (kernel.instructions[i].line)
+        cout << " (line " << kernel.instructions[i].line << ")";
+      cout << endl;
+    }
+    cout << "timestep,kind,space,address,size,group,item,instruction" << endl;
+  }
+}
+
+static void printSummary(const MemoryTraceReader::Kernel& kernel,
+                         const uint64_t counts[4][4],
+                         const uint64_t bytes[4][4])
+{
+  printKernel(kernel, false);
+  for (unsigned kind = 0; kind < 4; kind++)
+  {
+    for (unsigned space = 0; space < 4; space++)
+    {
+      if (!counts[kind][space])
+        continue;
+      cout << kindNames[kind] << " " << spaceNames[space] << ": "
+           << counts[kind][space] << " accesses, " << bytes[kind][space]
+           << " bytes" << endl;
+    }
+  }
+}
+
+static void printUsage()
+{
+  cout << "Usage: oclgrind-trace [--summary] TRACEFILE" << endl
+       << endl
+       << "Print the accesses in a memory trace written by "
+          "oclgrind --memory-trace," << endl
+       << "as CSV preceded by the instructions of each kernel." << endl
+       << endl
+       << "Options:" << endl
+       << "  --help [-h]      Display usage information" << endl
+       << "  --summary        Only print the number of accesses in each "
+          "kernel" << endl;
+}
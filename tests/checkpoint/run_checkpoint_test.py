@@ -0,0 +1,85 @@
+# run_checkpoint_test.py (Oclgrind)
+# Copyright (c) 2013-2019, James Price and Simon McIntosh-Smith,
+# University of Bristol. All rights reserved.
+#
+# This program is provided under a three-clause BSD license. For full
+# license terms please see the LICENSE file distributed with this
+# source code.
+
+import os
+import re
+import subprocess
+import sys
+import time
+
+# Check arguments
+if len(sys.argv) != 3:
+  print('Usage: python run_checkpoint_test.py OCLGRIND-KERNEL TEST.sim')
+  sys.exit(1)
+
+oclgrind_kernel = sys.argv[1]
+test_full_path  = os.path.realpath(sys.argv[2])
+test_name       = os.path.splitext(os.path.basename(test_full_path))[0]
+checkpoint      = os.path.abspath(test_name + '.checkpoint')
+
+def fail(message):
+  print(message)
+  print('FAILED')
+  sys.exit(1)
+
+def start(args):
+  return subprocess.Popen([oclgrind_kernel] + args +
+                          [os.path.basename(test_full_path)],
+                          cwd=os.path.dirname(test_full_path),
+                          stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+
+def finish(process):
+  out, err = process.communicate()
+  if process.returncode != 0:
+    print(err.decode())
+    fail('Test returned non-zero value (' + str(process.returncode) + ')')
+  return out.decode(), err.decode()
+
+# Interpret work-groups one at a time, so that the kernel runs slowly enough
+# to be interrupted part of the way through
+os.environ['OCLGRIND_DISABLE_JIT'] = '1'
+os.environ['OCLGRIND_NUM_THREADS'] = '1'
+
+# Run the kernel without checkpoints, for the results to compare against
+expected, _ = finish(start([]))
+
+# Save a checkpoint after every work-group, and kill the kernel once the
+# first one has been written
+if os.path.exists(checkpoint):
+  os.remove(checkpoint)
+args = ['--checkpoint', checkpoint, '--checkpoint-interval', '0']
+process = start(args)
+while not os.path.exists(checkpoint) and process.poll() is None:
+  time.sleep(0.01)
+process.kill()
+process.communicate()
+if not os.path.exists(checkpoint):
+  fail('Kernel finished before it could be interrupted')
+
+# Resume the kernel, which should only run the remaining work-groups
+out, err = finish(start(args))
+resumed = re.search(r'\((\d+) of (\d+) work-groups complete\)', err)
+if not resumed:
+  print(err)
+  fail('Kernel was not resumed from the checkpoint')
+completed, total = int(resumed.group(1)), int(resumed.group(2))
+if completed == 0 or completed >= total:
+  fail('Checkpoint had ' + str(completed) + ' of ' + str(total) +
+       ' work-groups complete')
+print('Resumed with ' + str(completed) + ' of ' + str(total) +
+      ' work-groups complete')
+
+if out != expected:
+  print('Expected:')
+  print(expected)
+  print('Found:')
+  print(out)
+  fail('Results differ from an uninterrupted run')
+if os.path.exists(checkpoint):
+  fail('Checkpoint was not removed once the kernel finished')
+print('PASSED')
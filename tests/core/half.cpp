@@ -0,0 +1,142 @@
+// half.cpp (Oclgrind)
+// Copyright (c) 2013-2019, James Price and Simon McIntosh-Smith,
+// University of Bristol. All rights reserved.
+//
+// This program is provided under a three-clause BSD license. For full
+// license terms please see the LICENSE file distributed with this
+// source code.
+
+// Compare the lookup table, batched and hardware (F16C or __fp16) half
+// conversions against the software routines they are built from, which are
+// only visible inside the implementation
+#include "core/half.cpp"
+
+using namespace oclgrind;
+using namespace std;
+
+static const HalfRoundMode modes[] = {Half_RTN, Half_RTZ, Half_RTP, Half_RTE};
+static const char* modeNames[] = {"RTN", "RTZ", "RTP", "RTE"};
+
+// Float bit patterns at the edges of each kind of conversion, each of which
+// is also checked negated
+static const uint32_t cases[] = {
+  // Zero and float denormals, which flush to zero
+  0x00000000, 0x00000001, 0x007FFFFF,
+  // Smallest normalized float
+  0x00800000,
+  // Below, at and above half the smallest half denormal
+  0x32FFFFFF, 0x33000000, 0x33000001,
+  // Smallest half denormal, and halfway to the next one
+  0x33800000, 0x33C00000,
+  // Largest half denormal, and values either side of the smallest
+  // normalized half
+  0x387FC000, 0x387FE000, 0x387FFFFF, 0x38800000, 0x38800001,
+  // One, and ties to even either side of it
+  0x3F800000, 0x3F801000, 0x3F803000, 0x3F801001, 0x3F7FF000,
+  // Largest half, values that round to it or to infinity, and overflows
+  0x477FE000, 0x477FEFFF, 0x477FF000, 0x477FFFFF, 0x47800000, 0x7F7FFFFF,
+  // Infinity, and quiet and signalling NaNs with different payloads
+  0x7F800000, 0x7F800001, 0x7FC00000, 0x7FC00001, 0x7FFFFFFF};
+
+static unsigned errors = 0;
+
+static float bitsToFloat(uint32_t bits)
+{
+  float f;
+  memcpy(&f, &bits, sizeof(f));
+  return f;
+}
+
+static uint32_t floatToBits(float f)
+{
+  uint32_t bits;
+  memcpy(&bits, &f, sizeof(bits));
+  return bits;
+}
+
+static void checkHalf(const char* name, int mode, uint32_t sp, uint16_t result)
+{
+  uint16_t expected = convertFloatToHalf(bitsToFloat(sp), modes[mode]);
+  if (result != expected)
+  {
+    if (errors++ < 16)
+    {
+      cerr << name << " " << modeNames[mode] << " 0x" << hex << setfill('0')
+           << setw(8) << sp << ": got 0x" << setw(4) << result
+           << ", expected 0x" << setw(4) << expected << dec << endl;
+    }
+  }
+}
+
+// Check the scalar and batched conversions of a set of floats, the batched
+// one with the normalized and special values mixed in groups of four
+static void checkFloats(const vector<uint32_t>& values)
+{
+  vector<float> sp(values.size());
+  for (size_t i = 0; i < values.size(); i++)
+    sp[i] = bitsToFloat(values[i]);
+
+  vector<uint16_t> half(values.size());
+  for (int m = 0; m < 4; m++)
+  {
+    floatToHalf(sp.data(), half.data(), sp.size(), modes[m]);
+    for (size_t i = 0; i < values.size(); i++)
+    {
+      checkHalf("floatToHalf", m, values[i], floatToHalf(sp[i], modes[m]));
+      checkHalf("batched floatToHalf", m, values[i], half[i]);
+    }
+  }
+}
+
+int main()
+{
+  // Every half, through the table and the batched conversion
+  vector<uint16_t> halfs(0x10000);
+  vector<float> floats(0x10000);
+  for (uint32_t h = 0; h < 0x10000; h++)
+    halfs[h] = h;
+  halfToFloat(halfs.data(), floats.data(), halfs.size());
+  for (uint32_t h = 0; h < 0x10000; h++)
+  {
+    uint32_t expected = floatToBits(convertHalfToFloat(h));
+    uint32_t table = floatToBits(halfToFloat((uint16_t)h));
+    uint32_t batched = floatToBits(floats[h]);
+    if (table != expected || batched != expected)
+    {
+      if (errors++ < 16)
+      {
+        cerr << "halfToFloat 0x" << hex << setfill('0') << setw(4) << h
+             << ": got 0x" << setw(8) << table << " and 0x" << setw(8)
+             << batched << ", expected 0x" << setw(8) << expected << dec
+             << endl;
+      }
+    }
+  }
+
+  // The boundary, denormal and NaN cases, with their neighbours so that
+  // they are batched with values on both sides of each edge
+  vector<uint32_t> values;
+  for (uint32_t value : cases)
+  {
+    for (uint32_t sign : {0x00000000u, 0x80000000u})
+    {
+      values.push_back(sign | value);
+      values.push_back((sign | value) + 1);
+      values.push_back((sign | value) - 1);
+    }
+  }
+  checkFloats(values);
+
+  // A sweep through every exponent with a range of mantissas
+  values.clear();
+  for (uint64_t bits = 0; bits <= 0xFFFFFFFF; bits += 0x1001)
+    values.push_back((uint32_t)bits);
+  checkFloats(values);
+
+  if (errors)
+  {
+    cerr << errors << " half conversions differ" << endl;
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,18 @@
+kernel void barrier(global uint *data, global uint *result, local uint *scratch)
+{
+  uint lid = get_local_id(0);
+  uint lsz = get_local_size(0);
+
+  scratch[lid] = data[get_global_id(0)];
+  for (uint offset = lsz/2; offset > 0; offset/=2)
+  {
+    barrier(CLK_LOCAL_MEM_FENCE);
+    if (lid < offset)
+    {
+      scratch[lid] += scratch[lid + offset];
+    }
+  }
+
+  barrier(CLK_LOCAL_MEM_FENCE);
+  result[get_global_id(0)] = scratch[0] + lid;
+}
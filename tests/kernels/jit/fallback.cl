@@ -0,0 +1,7 @@
+kernel void fallback(constant int *table, global int *index, global int *out)
+{
+  // Constant memory isn't accessed by native code, so this kernel is always
+  // interpreted
+  int i = get_global_id(0);
+  out[i] = table[index[i]] * 2;
+}
@@ -0,0 +1,11 @@
+kernel void integer_division(global int *a, global int *b, global int *q,
+                             global int *r, global uint *uq, global uint *ur)
+{
+  int i = get_global_id(0);
+
+  // Results are undefined, but mustn't trap
+  q[i] = a[i] / b[i];
+  r[i] = a[i] % b[i];
+  uq[i] = (uint)a[i] / (uint)b[i];
+  ur[i] = (uint)a[i] % (uint)b[i];
+}
@@ -0,0 +1,23 @@
+typedef struct
+{
+  int x[6];
+} S;
+
+kernel void memcpy_memset(global S *in, global S *out, local S *scratch)
+{
+  size_t i = get_global_id(0);
+  size_t lid = get_local_id(0);
+
+  // Whole structures are copied and cleared with memcpy and memset
+  scratch[lid] = in[i];
+  barrier(CLK_LOCAL_MEM_FENCE);
+  if (i % 2)
+  {
+    S zero = {{0}};
+    out[i] = zero;
+  }
+  else
+  {
+    out[i] = scratch[(lid + 1) % get_local_size(0)];
+  }
+}
@@ -0,0 +1,9 @@
+kernel void out_of_bounds(global int *a, global int *b, local int *scratch)
+{
+  int i = get_global_id(0);
+  scratch[i] = a[i];
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  // The last work-item reads past the end of scratch and writes past b
+  b[i] = scratch[i+1];
+}
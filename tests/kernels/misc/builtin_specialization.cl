@@ -0,0 +1,9 @@
+kernel void builtin_specialization(global float4 *f, global char4 *c,
+                                   global uint2 *u, global float *s)
+{
+  f[0] = floor(f[0]);
+  f[1] = fmod(f[1], (float4)(2.0f));
+  c[0] = clamp(c[0], (char4)(-2), (char4)(3));
+  u[0] = max(u[0], (uint2)(5));
+  s[0] = min(s[0], s[1]);
+}
@@ -0,0 +1,15 @@
+kernel void builtin_vector_math(global float4 *f, global uint4 *u,
+                                global uchar4 *c)
+{
+  float4 x = f[0];
+  float4 y = f[1];
+  f[2] = mix(x, y, 0.5f);
+  f[3] = (float4)(dot(x, y), 0.0f, 0.0f, 0.0f);
+  f[4] = fma(x, y, x);
+
+  uint4 v = u[0];
+  u[1] = clz(v);
+  u[2] = rotate(v, (uint4)(4));
+
+  c[0] = mad_sat(c[0], c[0], c[0]);
+}
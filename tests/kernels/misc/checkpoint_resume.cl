@@ -0,0 +1,10 @@
+// Updates each value in place, so that work-groups that ran again after
+// resuming from a checkpoint would change the results
+kernel void checkpoint_resume(global uint *data, uint iterations)
+{
+  size_t i = get_global_id(0);
+  uint x = data[i];
+  for (uint n = 0; n < iterations; n++)
+    x = x * 1664525 + 1013904223;
+  data[i] = x;
+}
@@ -0,0 +1,37 @@
+// Work-items of a group that diverge and reconverge while executing in
+// lockstep, with arithmetic, comparisons, selects and conversions applied
+// to values that differ in each of them, and to constant operands
+kernel void lockstep_divergence(global int *in, global int *out,
+                                global float *fout, global int *tmp,
+                                global int *exch, global int *vout)
+{
+  int i = get_global_id(0);
+  int lid = get_local_id(0);
+
+  int x = in[i];
+  int y = x * 3 + 1;
+  float f = x * 0.5f;
+  if (x & 1)
+  {
+    y = y - x;
+    f = f + 1.0f;
+  }
+  else
+  {
+    y = y ^ 5;
+  }
+
+  // Each work-item leaves the loop after a different number of iterations
+  for (int j = 0; j < x; j++)
+    y += j << 1;
+
+  long l = (long)y * 7;
+  out[i] = l > 100 ? (int)l : -y;
+  fout[i] = f < 2.0f ? f * f : f;
+  vstore4((int4)(y) * (int4)(1, 2, 3, 4) + y, i, vout);
+
+  // Values written before a barrier are read back by a neighbour after it
+  tmp[i] = y;
+  barrier(CLK_GLOBAL_MEM_FENCE);
+  exch[i] = tmp[i - lid + ((lid + 1) & 7)] + y;
+}
@@ -0,0 +1,7 @@
+kernel void memory_model(global int *in, global int *out, local int *scratch)
+{
+  int i = get_local_id(0);
+  scratch[i*2] = in[i];
+  barrier(CLK_LOCAL_MEM_FENCE);
+  out[i*32] = scratch[i*2];
+}
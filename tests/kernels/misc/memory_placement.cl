@@ -0,0 +1,11 @@
+kernel void memory_placement(global uint *data, global ulong *sums)
+{
+  size_t i = get_global_id(0);
+  ulong sum = 0;
+  for (size_t j = i*16384; j < (i+1)*16384; j++)
+  {
+    sum += data[j];
+    data[j] = 0;
+  }
+  sums[i] = sum;
+}
@@ -0,0 +1,11 @@
+kernel void performance_lint(global int *counter, global int *out)
+{
+  int scratch[100];
+  int i = get_global_id(0);
+  if (i % 2)
+    atomic_inc(counter);
+  barrier(CLK_LOCAL_MEM_FENCE);
+  for (int j = 0; j < 100; j++)
+    scratch[j] = i + j;
+  out[i] = scratch[out[i] % 100];
+}
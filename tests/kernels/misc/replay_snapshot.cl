@@ -0,0 +1,8 @@
+kernel void replay_snapshot(global int *big, global int *small, int add,
+                            int2 scale, global int *out)
+{
+  size_t i = get_global_id(0);
+  big[i*16384] = big[i*16384] * scale.x + add;
+  small[i] = small[i] * scale.y + add;
+  out[i] = big[i*16384];
+}
@@ -0,0 +1,110 @@
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+
+#define INTEGER_OPS(T, UT, r, a, b, s)                                         \
+  r[0] = a + b;                                                                \
+  r[1] = a - b;                                                                \
+  r[2] = a * b;                                                                \
+  r[3] = a & b;                                                                \
+  r[4] = a | b;                                                                \
+  r[5] = a ^ b;                                                                \
+  r[6] = a << s;                                                               \
+  r[7] = b >> s;                                                               \
+  r[8] = as_##T(as_##UT(b) >> s)
+
+#define FLOAT_OPS(r, a, b)                                                     \
+  r[0] = a + b;                                                                \
+  r[1] = a - b;                                                                \
+  r[2] = a * b;                                                                \
+  r[3] = a / b
+
+#define INTEGER_COMPARES(UT, r, a, b)                                          \
+  r[0] = a == b;                                                               \
+  r[1] = a != b;                                                               \
+  r[2] = a > b;                                                                \
+  r[3] = a >= b;                                                               \
+  r[4] = a < b;                                                                \
+  r[5] = a <= b;                                                               \
+  r[6] = (UT)a > (UT)b;                                                        \
+  r[7] = (UT)a >= (UT)b;                                                       \
+  r[8] = (UT)a < (UT)b;                                                        \
+  r[9] = (UT)a <= (UT)b
+
+// Ordered and unordered comparisons, against a NaN for the unordered ones
+#define FLOAT_COMPARES(r, a, b, n)                                             \
+  r[0] = a == b;                                                               \
+  r[1] = a != b;                                                               \
+  r[2] = a > b;                                                                \
+  r[3] = a >= b;                                                               \
+  r[4] = a < b;                                                                \
+  r[5] = a <= b;                                                               \
+  r[6] = a < b || a > b;                                                       \
+  r[7] = a == n;                                                               \
+  r[8] = a != n;                                                               \
+  r[9] = !(a <= n);                                                            \
+  r[10] = !(a < n);                                                            \
+  r[11] = !(a >= n);                                                           \
+  r[12] = !(a > n);                                                            \
+  r[13] = !(a < n || a > n)
+
+// Each shape of specialized instruction handler: integer and floating point
+// operations on 32 and 64-bit scalars, 4-element vectors and other vector
+// widths, then comparisons, selects with a scalar condition and conversions
+kernel void specialized_handlers(global int *ia, global long *la,
+                                 global float *fa, global double *da,
+                                 global int *io, global long *lo,
+                                 global float *fo, global double *dout,
+                                 global int *co)
+{
+  int x = ia[0], y = ia[1], s = ia[2];
+  int4 x4 = vload4(0, ia + 3), y4 = vload4(0, ia + 7);
+  int2 x2 = vload2(0, ia + 3), y2 = vload2(0, ia + 7);
+  INTEGER_OPS(int, uint, io, x, y, s);
+  INTEGER_OPS(int4, uint4, ((global int4 *)(io + 12)), x4, y4, s);
+  INTEGER_OPS(int2, uint2, ((global int2 *)(io + 48)), x2, y2, s);
+
+  long l = la[0], m = la[1], t = la[2];
+  long4 l4 = vload4(0, la + 3), m4 = vload4(0, la + 7);
+  long2 l2 = vload2(0, la + 3), m2 = vload2(0, la + 7);
+  INTEGER_OPS(long, ulong, lo, l, m, t);
+  INTEGER_OPS(long4, ulong4, ((global long4 *)(lo + 12)), l4, m4, t);
+  INTEGER_OPS(long2, ulong2, ((global long2 *)(lo + 48)), l2, m2, t);
+
+  float f = fa[0], g = fa[1], fn = fa[2] / fa[2];
+  float4 f4 = vload4(0, fa + 3), g4 = vload4(0, fa + 7);
+  float2 f2 = vload2(0, fa + 3), g2 = vload2(0, fa + 7);
+  FLOAT_OPS(fo, f, g);
+  FLOAT_OPS(((global float4 *)(fo + 4)), f4, g4);
+  FLOAT_OPS(((global float2 *)(fo + 20)), f2, g2);
+
+  double d = da[0], e = da[1], dn = da[2] / da[2];
+  double4 d4 = vload4(0, da + 3), e4 = vload4(0, da + 7);
+  double2 d2 = vload2(0, da + 3), e2 = vload2(0, da + 7);
+  FLOAT_OPS(dout, d, e);
+  FLOAT_OPS(((global double4 *)(dout + 4)), d4, e4);
+  FLOAT_OPS(((global double2 *)(dout + 20)), d2, e2);
+
+  INTEGER_COMPARES(uint, co, x, y);
+  INTEGER_COMPARES(ulong, (co + 10), l, m);
+  FLOAT_COMPARES((co + 20), f, g, fn);
+  FLOAT_COMPARES((co + 34), d, e, dn);
+  vstore4(x4 < y4, 12, co);
+  vstore4(f4 < g4, 13, co);
+  vstore2(l2 > m2, 33, lo);
+  vstore2(d2 > e2, 34, lo);
+
+  int c = x > y;
+  co[56] = c ? (char)x : (char)y;
+  co[57] = c ? (short)y : (short)x;
+  co[58] = c ? y : x;
+  lo[70] = c ? m : l;
+  vstore4(c ? y4 : x4, 15, co);
+  vstore2(c ? m2 : l2, 36, lo);
+
+  co[64] = (char)(x * 37);
+  co[65] = (short)(y * 20000);
+  co[66] = (uchar)y;
+  co[67] = (ushort)y;
+  co[68] = (int)l;
+  lo[71] = y;
+  lo[74] = (uint)y;
+}
@@ -0,0 +1,18 @@
+kernel void uniform_values(global float *output, float x, local int *scratch)
+{
+  size_t i = get_global_id(0);
+  size_t lid = get_local_id(0);
+  size_t group = get_group_id(0);
+
+  // Results shared by every work-item in the work-group or kernel, which
+  // must not leak between work-groups of different sizes
+  size_t size = get_local_size(0);
+  size_t chunk = 120 / size;
+  float scale = pow(x, 2.0f);
+  local int *middle = scratch + size/2;
+
+  scratch[lid] = lid;
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  output[i] = chunk*100 + group*10 + *middle + scale;
+}
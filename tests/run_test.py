@@ -42,10 +42,11 @@ else:
   test_ref = os.path.dirname(os.path.abspath(__file__)) + os.path.sep \
     + rel_path + '.ref'
 
-# Enable race detection and uninitialized memory plugins
+# Enable race detection and uninitialized memory plugins, unless a test
+# disables them (which lets kernels run as native code)
 os.environ["OCLGRIND_CHECK_API"] = "1"
-os.environ["OCLGRIND_DATA_RACES"] = "1"
-os.environ["OCLGRIND_UNINITIALIZED"] = "1"
+os.environ.setdefault("OCLGRIND_DATA_RACES", "1")
+os.environ.setdefault("OCLGRIND_UNINITIALIZED", "1")
 
 def fail(ret=1):
   print('FAILED')
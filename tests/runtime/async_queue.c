@@ -0,0 +1,108 @@
+#include "common.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define N 4
+
+const char* KERNEL_SOURCE =
+  "kernel void square(global int *data)   \n"
+  "{                                      \n"
+  "  int i = get_global_id(0);            \n"
+  "  data[i] = data[i] * data[i];         \n"
+  "}                                      \n";
+
+static char callbacks[16];
+static int numCallbacks = 0;
+
+void CL_CALLBACK callback(cl_event event, cl_int status, void* data)
+{
+  callbacks[numCallbacks++] = *(const char*)data;
+}
+
+cl_int getStatus(cl_event event)
+{
+  cl_int status;
+  cl_int err = clGetEventInfo(event, CL_EVENT_COMMAND_EXECUTION_STATUS,
+                              sizeof(cl_int), &status, NULL);
+  checkError(err, "getting event status");
+  return status;
+}
+
+int main(int argc, char* argv[])
+{
+  cl_int err;
+  cl_kernel kernel;
+  cl_mem d_data;
+  cl_event userEvent, kernelEvent, readEvent;
+  cl_int h_data[N] = {1, 2, 3, 4};
+  static const char submitted = 'S', running = 'R', complete = 'C';
+
+  Context cl = createContext(KERNEL_SOURCE, "");
+
+  kernel = clCreateKernel(cl.program, "square", &err);
+  checkError(err, "creating kernel");
+
+  d_data = clCreateBuffer(cl.context, CL_MEM_READ_WRITE, N * sizeof(cl_int),
+                          NULL, &err);
+  checkError(err, "creating d_data");
+
+  err = clSetKernelArg(kernel, 0, sizeof(cl_mem), &d_data);
+  checkError(err, "setting kernel argument");
+
+  userEvent = clCreateUserEvent(cl.context, &err);
+  checkError(err, "creating user event");
+
+  // Hold back the commands until the user event is complete
+  err = clEnqueueWriteBuffer(cl.queue, d_data, CL_FALSE, 0, N * sizeof(cl_int),
+                             h_data, 1, &userEvent, NULL);
+  checkError(err, "enqueuing write");
+
+  size_t global[1] = {N};
+  err = clEnqueueNDRangeKernel(cl.queue, kernel, 1, NULL, global, NULL, 0, NULL,
+                               &kernelEvent);
+  checkError(err, "enqueuing kernel");
+
+  err = clEnqueueReadBuffer(cl.queue, d_data, CL_FALSE, 0, N * sizeof(cl_int),
+                            h_data, 0, NULL, &readEvent);
+  checkError(err, "enqueuing read");
+
+  err = clSetEventCallback(readEvent, CL_COMPLETE, callback, (void*)&complete);
+  checkError(err, "setting complete callback");
+  err = clSetEventCallback(readEvent, CL_RUNNING, callback, (void*)&running);
+  checkError(err, "setting running callback");
+  err =
+    clSetEventCallback(readEvent, CL_SUBMITTED, callback, (void*)&submitted);
+  checkError(err, "setting submitted callback");
+
+  cl_int status = getStatus(kernelEvent);
+  printf("kernel waiting: %d\n",
+         status == CL_QUEUED || status == CL_SUBMITTED);
+
+  err = clSetUserEventStatus(userEvent, CL_COMPLETE);
+  checkError(err, "setting user event status");
+
+  // Commands should run without the host waiting or flushing the queue
+  while (getStatus(readEvent) != CL_COMPLETE)
+    ;
+  printf("read complete: 1\n");
+
+  err = clFinish(cl.queue);
+  checkError(err, "finishing queue");
+
+  callbacks[numCallbacks] = 0;
+  printf("callbacks: %s\n", callbacks);
+
+  for (int i = 0; i < N; i++)
+  {
+    printf("data[%d] = %d\n", i, h_data[i]);
+  }
+
+  clReleaseEvent(readEvent);
+  clReleaseEvent(kernelEvent);
+  clReleaseEvent(userEvent);
+  clReleaseMemObject(d_data);
+  clReleaseKernel(kernel);
+  releaseContext(cl);
+  return 0;
+}
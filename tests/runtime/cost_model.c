@@ -0,0 +1,104 @@
+#include "common.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define N 64
+
+const char* KERNEL_SOURCE =
+  "kernel void square(global int *data)   \n"
+  "{                                      \n"
+  "  int i = get_global_id(0);            \n"
+  "  data[i] = data[i] * data[i];         \n"
+  "}                                      \n";
+
+cl_ulong getTime(cl_event event, cl_profiling_info param)
+{
+  cl_ulong time;
+  cl_int err =
+    clGetEventProfilingInfo(event, param, sizeof(cl_ulong), &time, NULL);
+  checkError(err, "getting event profiling info");
+  return time;
+}
+
+cl_ulong getDuration(cl_event event)
+{
+  return getTime(event, CL_PROFILING_COMMAND_END) -
+         getTime(event, CL_PROFILING_COMMAND_START);
+}
+
+int main(int argc, char* argv[])
+{
+  cl_int err;
+  cl_command_queue queue;
+  cl_kernel kernel;
+  cl_mem d_data;
+  cl_event writeEvent, kernelEvents[2], readEvent;
+  cl_int h_data[N];
+
+  for (int i = 0; i < N; i++)
+  {
+    h_data[i] = i;
+  }
+
+  Context cl = createContext(KERNEL_SOURCE, "");
+
+  queue = clCreateCommandQueue(cl.context, cl.device,
+                               CL_QUEUE_PROFILING_ENABLE, &err);
+  checkError(err, "creating profiling queue");
+
+  kernel = clCreateKernel(cl.program, "square", &err);
+  checkError(err, "creating kernel");
+
+  d_data = clCreateBuffer(cl.context, CL_MEM_READ_WRITE, N * sizeof(cl_int),
+                          NULL, &err);
+  checkError(err, "creating d_data");
+
+  err = clSetKernelArg(kernel, 0, sizeof(cl_mem), &d_data);
+  checkError(err, "setting kernel argument");
+
+  err = clEnqueueWriteBuffer(queue, d_data, CL_FALSE, 0, N * sizeof(cl_int),
+                             h_data, 0, NULL, &writeEvent);
+  checkError(err, "enqueuing write");
+
+  // Launch the same work with different numbers of work-groups
+  size_t global[1] = {N};
+  size_t local[2] = {4, 16};
+  for (int i = 0; i < 2; i++)
+  {
+    err = clEnqueueNDRangeKernel(queue, kernel, 1, NULL, global, local + i, 0,
+                                 NULL, kernelEvents + i);
+    checkError(err, "enqueuing kernel");
+  }
+
+  err = clEnqueueReadBuffer(queue, d_data, CL_TRUE, 0, N * sizeof(cl_int),
+                            h_data, 0, NULL, &readEvent);
+  checkError(err, "reading d_data");
+
+  // Transfers cost their bytes, and each work-group adds its own cost
+  printf("write duration: %llu\n", (unsigned long long)getDuration(writeEvent));
+  printf("read duration: %llu\n", (unsigned long long)getDuration(readEvent));
+  printf("work-group cost: %llu\n",
+         (unsigned long long)(getDuration(kernelEvents[0]) -
+                              getDuration(kernelEvents[1])));
+
+  // Commands run back-to-back on the simulated device
+  printf("back-to-back: %d\n",
+         getTime(writeEvent, CL_PROFILING_COMMAND_END) ==
+             getTime(kernelEvents[0], CL_PROFILING_COMMAND_START) &&
+           getTime(kernelEvents[0], CL_PROFILING_COMMAND_END) ==
+             getTime(kernelEvents[1], CL_PROFILING_COMMAND_START) &&
+           getTime(kernelEvents[1], CL_PROFILING_COMMAND_END) ==
+             getTime(readEvent, CL_PROFILING_COMMAND_START));
+  printf("data[3] = %d\n", h_data[3]);
+
+  clReleaseEvent(readEvent);
+  clReleaseEvent(kernelEvents[1]);
+  clReleaseEvent(kernelEvents[0]);
+  clReleaseEvent(writeEvent);
+  clReleaseMemObject(d_data);
+  clReleaseKernel(kernel);
+  clReleaseCommandQueue(queue);
+  releaseContext(cl);
+  return 0;
+}
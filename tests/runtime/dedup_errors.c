@@ -0,0 +1,55 @@
+#include "common.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define N 4
+
+const char* KERNEL_SOURCE =
+  "kernel void shift(global int *data)    \n"
+  "{                                      \n"
+  "  int i = get_global_id(0);            \n"
+  "  data[i + 4] = data[i];               \n"
+  "}                                      \n";
+
+int main(int argc, char* argv[])
+{
+  cl_int err;
+  cl_kernel kernel;
+  cl_mem buffer;
+  cl_int h_data[N] = {1, 2, 3, 4};
+
+  Context cl = createContext(KERNEL_SOURCE, "");
+
+  kernel = clCreateKernel(cl.program, "shift", &err);
+  checkError(err, "creating kernel");
+
+  buffer = clCreateBuffer(cl.context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+                          N * sizeof(cl_int), h_data, &err);
+  checkError(err, "creating buffer");
+
+  err = clSetKernelArg(kernel, 0, sizeof(cl_mem), &buffer);
+  checkError(err, "setting kernel argument");
+
+  // Every work-item writes out of bounds from the same instruction, which is
+  // only reported once per kernel
+  size_t global[1] = {N};
+  for (int i = 0; i < 2; i++)
+  {
+    err = clEnqueueNDRangeKernel(cl.queue, kernel, 1, NULL, global, NULL, 0,
+                                 NULL, NULL);
+    checkError(err, "enqueuing kernel");
+    err = clFinish(cl.queue);
+    checkError(err, "running kernel");
+  }
+
+  err = clEnqueueReadBuffer(cl.queue, buffer, CL_TRUE, 0, N * sizeof(cl_int),
+                            h_data, 0, NULL, NULL);
+  checkError(err, "reading buffer");
+  printf("data: %d %d %d %d\n", h_data[0], h_data[1], h_data[2], h_data[3]);
+
+  clReleaseMemObject(buffer);
+  clReleaseKernel(kernel);
+  releaseContext(cl);
+  return 0;
+}
@@ -0,0 +1,90 @@
+#include "common.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define N 4
+
+const char* KERNEL_SOURCE =
+  "constant sampler_t sampler = CLK_NORMALIZED_COORDS_FALSE |    \n"
+  "                             CLK_ADDRESS_CLAMP_TO_EDGE   |    \n"
+  "                             CLK_FILTER_LINEAR;               \n"
+  "kernel void test_filter(read_only image2d_t input,            \n"
+  "                        global float *output)                 \n"
+  "{                                                             \n"
+  "  int x = get_global_id(0);                                   \n"
+  "  int y = get_global_id(1);                                   \n"
+  "  float2 coord = (float2)(x + 0.75f, y + 1.0f);               \n"
+  "  float4 pixel = read_imagef(input, sampler, coord);          \n"
+  "  output[x + y*get_global_size(0)] = pixel.x + pixel.y        \n"
+  "                                   + pixel.z + pixel.w*100;   \n"
+  "}                                                             \n";
+
+int main(int argc, char* argv[])
+{
+  cl_int err;
+  cl_kernel kernel;
+  cl_mem d_input, d_output;
+
+  Context cl = createContext(KERNEL_SOURCE, "");
+
+  kernel = clCreateKernel(cl.program, "test_filter", &err);
+  checkError(err, "creating kernel");
+
+  cl_image_format format;
+  format.image_channel_order = CL_R;
+  format.image_channel_data_type = CL_FLOAT;
+
+  cl_image_desc desc = {0};
+  desc.image_type = CL_MEM_OBJECT_IMAGE2D;
+  desc.image_width = N;
+  desc.image_height = N;
+
+  // Initialise data
+  float h_input[N * N];
+  for (int i = 0; i < N * N; i++)
+  {
+    h_input[i] = i;
+  }
+
+  d_input = clCreateImage(cl.context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                          &format, &desc, h_input, &err);
+  checkError(err, "creating d_input image");
+  d_output = clCreateBuffer(cl.context, CL_MEM_WRITE_ONLY,
+                            N * N * sizeof(cl_float), NULL, &err);
+  checkError(err, "creating d_output buffer");
+
+  err = clSetKernelArg(kernel, 0, sizeof(cl_mem), &d_input);
+  err |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &d_output);
+  checkError(err, "setting kernel arguments");
+
+  size_t global[2] = {N, N};
+  err = clEnqueueNDRangeKernel(cl.queue, kernel, 2, NULL, global, NULL, 0, NULL,
+                               NULL);
+  checkError(err, "enqueuing kernel");
+
+  float* h_output =
+    clEnqueueMapBuffer(cl.queue, d_output, CL_TRUE, CL_MAP_READ, 0,
+                       N * N * sizeof(cl_float), 0, NULL, NULL, &err);
+  checkError(err, "mapping buffer for reading");
+
+  for (int y = 0; y < N; y++)
+  {
+    for (int x = 0; x < N; x++)
+    {
+      printf("out[%d,%d] = %g\n", x, y, h_output[x + y * N]);
+    }
+  }
+
+  err = clEnqueueUnmapMemObject(cl.queue, d_output, h_output, 0, NULL, NULL);
+  checkError(err, "unmapping buffer");
+
+  err = clFinish(cl.queue);
+  checkError(err, "running kernel");
+
+  clReleaseMemObject(d_input);
+  clReleaseMemObject(d_output);
+  clReleaseKernel(kernel);
+  releaseContext(cl);
+  return 0;
+}
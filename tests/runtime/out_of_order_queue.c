@@ -0,0 +1,104 @@
+#include "common.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define N 4
+
+const char* KERNEL_SOURCE =
+  "kernel void square(global int *data)   \n"
+  "{                                      \n"
+  "  int i = get_global_id(0);            \n"
+  "  data[i] = data[i] * data[i];         \n"
+  "}                                      \n";
+
+cl_int getStatus(cl_event event)
+{
+  cl_int status;
+  cl_int err = clGetEventInfo(event, CL_EVENT_COMMAND_EXECUTION_STATUS,
+                              sizeof(cl_int), &status, NULL);
+  checkError(err, "getting event status");
+  return status;
+}
+
+int main(int argc, char* argv[])
+{
+  cl_int err;
+  cl_command_queue queue;
+  cl_kernel kernel;
+  cl_mem d_a, d_b;
+  cl_event userEvent, writeEvent, kernelEvent, independentEvent;
+  cl_int h_a[N] = {1, 2, 3, 4};
+  cl_int h_b[N] = {5, 6, 7, 8};
+  cl_int h_c[N] = {0, 0, 0, 0};
+
+  Context cl = createContext(KERNEL_SOURCE, "");
+
+  queue = clCreateCommandQueue(cl.context, cl.device,
+                               CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE, &err);
+  checkError(err, "creating out-of-order queue");
+
+  kernel = clCreateKernel(cl.program, "square", &err);
+  checkError(err, "creating kernel");
+
+  d_a = clCreateBuffer(cl.context, CL_MEM_READ_WRITE, N * sizeof(cl_int), NULL,
+                       &err);
+  checkError(err, "creating d_a");
+  d_b = clCreateBuffer(cl.context, CL_MEM_READ_WRITE, N * sizeof(cl_int), NULL,
+                       &err);
+  checkError(err, "creating d_b");
+
+  err = clSetKernelArg(kernel, 0, sizeof(cl_mem), &d_a);
+  checkError(err, "setting kernel argument");
+
+  userEvent = clCreateUserEvent(cl.context, &err);
+  checkError(err, "creating user event");
+
+  // Hold back the commands that use d_a until the user event is complete
+  err = clEnqueueWriteBuffer(queue, d_a, CL_FALSE, 0, N * sizeof(cl_int), h_a,
+                             1, &userEvent, &writeEvent);
+  checkError(err, "enqueuing write to d_a");
+
+  size_t global[1] = {N};
+  err = clEnqueueNDRangeKernel(queue, kernel, 1, NULL, global, NULL, 1,
+                               &writeEvent, &kernelEvent);
+  checkError(err, "enqueuing kernel");
+
+  err = clEnqueueReadBuffer(queue, d_a, CL_FALSE, 0, N * sizeof(cl_int), h_a,
+                            1, &kernelEvent, NULL);
+  checkError(err, "enqueuing read from d_a");
+
+  // Independent commands should run while the others are still waiting
+  err = clEnqueueWriteBuffer(queue, d_b, CL_FALSE, 0, N * sizeof(cl_int), h_b,
+                             0, NULL, &independentEvent);
+  checkError(err, "enqueuing write to d_b");
+
+  err = clEnqueueReadBuffer(queue, d_b, CL_TRUE, 0, N * sizeof(cl_int), h_c, 1,
+                            &independentEvent, NULL);
+  checkError(err, "reading d_b");
+  printf("kernel waiting: %d\n",
+         getStatus(kernelEvent) == CL_QUEUED ||
+           getStatus(kernelEvent) == CL_SUBMITTED);
+
+  err = clSetUserEventStatus(userEvent, CL_COMPLETE);
+  checkError(err, "setting user event status");
+
+  err = clFinish(queue);
+  checkError(err, "finishing queue");
+
+  for (int i = 0; i < N; i++)
+  {
+    printf("a[%d] = %d, b[%d] = %d\n", i, h_a[i], i, h_c[i]);
+  }
+
+  clReleaseEvent(independentEvent);
+  clReleaseEvent(kernelEvent);
+  clReleaseEvent(writeEvent);
+  clReleaseEvent(userEvent);
+  clReleaseMemObject(d_b);
+  clReleaseMemObject(d_a);
+  clReleaseKernel(kernel);
+  clReleaseCommandQueue(queue);
+  releaseContext(cl);
+  return 0;
+}
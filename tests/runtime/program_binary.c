@@ -0,0 +1,104 @@
+#include "common.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define N 4
+
+const char* KERNEL_SOURCE =
+  "constant int table[4] = {3, 1, 4, 1};            \n"
+  "int lookup(int i)                                \n"
+  "{                                                \n"
+  "  return table[clamp(i, 0, 3)] * 10;             \n"
+  "}                                                \n"
+  "kernel void test_kernel(global int *out)         \n"
+  "{                                                \n"
+  "  int i = get_global_id(0);                      \n"
+  "  out[i] = lookup(i) + (int)sqrt((float)(i*i));  \n"
+  "}                                                \n";
+
+void run(Context cl, cl_program program)
+{
+  cl_int err;
+  cl_kernel kernel;
+  cl_mem d_out;
+
+  kernel = clCreateKernel(program, "test_kernel", &err);
+  checkError(err, "creating kernel");
+
+  d_out = clCreateBuffer(cl.context, CL_MEM_WRITE_ONLY, N * sizeof(cl_int),
+                         NULL, &err);
+  checkError(err, "creating d_out");
+
+  err = clSetKernelArg(kernel, 0, sizeof(cl_mem), &d_out);
+  checkError(err, "setting kernel argument");
+
+  size_t global[1] = {N};
+  err = clEnqueueNDRangeKernel(cl.queue, kernel, 1, NULL, global, NULL, 0, NULL,
+                               NULL);
+  checkError(err, "enqueuing kernel");
+
+  int* h_out = clEnqueueMapBuffer(cl.queue, d_out, CL_TRUE, CL_MAP_READ, 0,
+                                  N * sizeof(cl_int), 0, NULL, NULL, &err);
+  checkError(err, "mapping buffer for reading");
+
+  for (int i = 0; i < N; i++)
+  {
+    printf("out[%d] = %d\n", i, h_out[i]);
+  }
+
+  err = clEnqueueUnmapMemObject(cl.queue, d_out, h_out, 0, NULL, NULL);
+  checkError(err, "unmapping buffer");
+
+  err = clFinish(cl.queue);
+  checkError(err, "running kernel");
+
+  clReleaseMemObject(d_out);
+  clReleaseKernel(kernel);
+}
+
+cl_program createFromBinary(Context cl, cl_program source)
+{
+  cl_int err, status;
+  size_t size;
+  unsigned char* binary;
+  cl_program program;
+
+  err = clGetProgramInfo(source, CL_PROGRAM_BINARY_SIZES, sizeof(size_t),
+                         &size, NULL);
+  checkError(err, "getting binary size");
+
+  binary = malloc(size);
+  err = clGetProgramInfo(source, CL_PROGRAM_BINARIES, sizeof(unsigned char*),
+                         &binary, NULL);
+  checkError(err, "getting binary");
+
+  program = clCreateProgramWithBinary(cl.context, 1, &cl.device, &size,
+                                      (const unsigned char**)&binary, &status,
+                                      &err);
+  checkError(err, "creating program from binary");
+  checkError(status, "loading binary");
+
+  err = clBuildProgram(program, 1, &cl.device, "", NULL, NULL);
+  checkError(err, "building program from binary");
+
+  free(binary);
+  return program;
+}
+
+int main(int argc, char* argv[])
+{
+  Context cl = createContext(KERNEL_SOURCE, "");
+  run(cl, cl.program);
+
+  // Load from a binary, and again from a binary of the loaded program
+  cl_program first = createFromBinary(cl, cl.program);
+  run(cl, first);
+  cl_program second = createFromBinary(cl, first);
+  run(cl, second);
+
+  clReleaseProgram(second);
+  clReleaseProgram(first);
+  releaseContext(cl);
+  return 0;
+}
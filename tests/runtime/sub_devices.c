@@ -0,0 +1,96 @@
+#include "common.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define N 16
+
+const char* KERNEL_SOURCE =
+  "kernel void square(global int *data)   \n"
+  "{                                      \n"
+  "  int i = get_global_id(0);            \n"
+  "  data[i] = data[i] * data[i];         \n"
+  "}                                      \n";
+
+cl_uint getComputeUnits(cl_device_id device)
+{
+  cl_uint units;
+  cl_int err = clGetDeviceInfo(device, CL_DEVICE_MAX_COMPUTE_UNITS,
+                               sizeof(cl_uint), &units, NULL);
+  checkError(err, "getting compute units");
+  return units;
+}
+
+int main(int argc, char* argv[])
+{
+  cl_int err;
+  cl_uint numDevices;
+  cl_device_id subDevices[2], parent;
+  cl_context context;
+  cl_command_queue queue;
+  cl_program program;
+  cl_kernel kernel;
+  cl_mem d_data;
+  cl_int h_data[N];
+
+  for (int i = 0; i < N; i++)
+  {
+    h_data[i] = i;
+  }
+
+  Context cl = createContext(KERNEL_SOURCE, "");
+  printf("device units: %u\n", getComputeUnits(cl.device));
+
+  // Split the device's compute units between two sub-devices
+  cl_device_partition_property properties[] = {
+    CL_DEVICE_PARTITION_BY_COUNTS, 1, 3, CL_DEVICE_PARTITION_BY_COUNTS_LIST_END,
+    0};
+  err = clCreateSubDevices(cl.device, properties, 2, subDevices, &numDevices);
+  checkError(err, "creating sub-devices");
+  printf("sub-devices: %u\n", numDevices);
+  printf("sub-device units: %u %u\n", getComputeUnits(subDevices[0]),
+         getComputeUnits(subDevices[1]));
+
+  err = clGetDeviceInfo(subDevices[1], CL_DEVICE_PARENT_DEVICE,
+                        sizeof(cl_device_id), &parent, NULL);
+  checkError(err, "getting parent device");
+  printf("parent is device: %d\n", parent == cl.device);
+
+  // Run a kernel in a context for the second sub-device
+  context = clCreateContext(NULL, 1, subDevices + 1, NULL, NULL, &err);
+  checkError(err, "creating sub-device context");
+  queue = clCreateCommandQueue(context, subDevices[1], 0, &err);
+  checkError(err, "creating sub-device queue");
+  program = clCreateProgramWithSource(context, 1, &KERNEL_SOURCE, NULL, &err);
+  checkError(err, "creating program");
+  err = clBuildProgram(program, 1, subDevices + 1, "", NULL, NULL);
+  checkError(err, "building program");
+  kernel = clCreateKernel(program, "square", &err);
+  checkError(err, "creating kernel");
+
+  d_data = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+                          N * sizeof(cl_int), h_data, &err);
+  checkError(err, "creating d_data");
+  err = clSetKernelArg(kernel, 0, sizeof(cl_mem), &d_data);
+  checkError(err, "setting kernel argument");
+
+  size_t global[1] = {N};
+  size_t local[1] = {2};
+  err = clEnqueueNDRangeKernel(queue, kernel, 1, NULL, global, local, 0, NULL,
+                               NULL);
+  checkError(err, "enqueuing kernel");
+  err = clEnqueueReadBuffer(queue, d_data, CL_TRUE, 0, N * sizeof(cl_int),
+                            h_data, 0, NULL, NULL);
+  checkError(err, "reading d_data");
+  printf("data[5] = %d, data[15] = %d\n", h_data[5], h_data[15]);
+
+  clReleaseMemObject(d_data);
+  clReleaseKernel(kernel);
+  clReleaseProgram(program);
+  clReleaseCommandQueue(queue);
+  clReleaseContext(context);
+  clReleaseDevice(subDevices[1]);
+  clReleaseDevice(subDevices[0]);
+  releaseContext(cl);
+  return 0;
+}
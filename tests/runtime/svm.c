@@ -0,0 +1,113 @@
+#include "common.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define N 8
+
+const char* KERNEL_SOURCE =
+  "kernel void square(global int *data)   \n"
+  "{                                      \n"
+  "  int i = get_global_id(0);            \n"
+  "  data[i] = data[i] * data[i];         \n"
+  "}                                      \n"
+  "kernel void shift(global int *data)    \n"
+  "{                                      \n"
+  "  int i = get_global_id(0);            \n"
+  "  data[i] = data[i + 1];               \n"
+  "}                                      \n";
+
+void printData(const char* name, cl_int* data)
+{
+  printf("%s:", name);
+  for (int i = 0; i < N; i++)
+  {
+    printf(" %d", data[i]);
+  }
+  printf("\n");
+}
+
+int main(int argc, char* argv[])
+{
+  cl_int err;
+  cl_kernel square, shift;
+  cl_int* data;
+  cl_int h_data[N];
+
+  Context cl = createContext(KERNEL_SOURCE, "");
+
+  square = clCreateKernel(cl.program, "square", &err);
+  checkError(err, "creating square kernel");
+  shift = clCreateKernel(cl.program, "shift", &err);
+  checkError(err, "creating shift kernel");
+
+  // Only coarse-grained buffers are supported
+  cl_device_svm_capabilities caps;
+  err = clGetDeviceInfo(cl.device, CL_DEVICE_SVM_CAPABILITIES, sizeof(caps),
+                        &caps, NULL);
+  checkError(err, "getting SVM capabilities");
+  printf("fine-grained: %d\n", (caps & CL_DEVICE_SVM_FINE_GRAIN_BUFFER) != 0);
+
+  data = clSVMAlloc(cl.context, CL_MEM_READ_WRITE, N * sizeof(cl_int), 0);
+  if (!data)
+  {
+    fprintf(stderr, "Error allocating SVM buffer\n");
+    exit(1);
+  }
+
+  // The host and kernels share the SVM buffer without any copies
+  err = clEnqueueSVMMap(cl.queue, CL_TRUE, CL_MAP_WRITE_INVALIDATE_REGION, data,
+                        N * sizeof(cl_int), 0, NULL, NULL);
+  checkError(err, "mapping SVM buffer");
+  for (int i = 0; i < N; i++)
+  {
+    data[i] = i;
+  }
+  err = clEnqueueSVMUnmap(cl.queue, data, 0, NULL, NULL);
+  checkError(err, "unmapping SVM buffer");
+
+  // Pointers into the middle of the buffer are offset from its start
+  err = clSetKernelArgSVMPointer(square, 0, data + 2);
+  checkError(err, "setting square argument");
+  size_t global[1] = {N - 2};
+  err = clEnqueueNDRangeKernel(cl.queue, square, 1, NULL, global, NULL, 0,
+                               NULL, NULL);
+  checkError(err, "enqueuing square kernel");
+  err = clFinish(cl.queue);
+  checkError(err, "running square kernel");
+
+  // The last work-item reads past the end of the buffer
+  err = clSetKernelArgSVMPointer(shift, 0, data);
+  checkError(err, "setting shift argument");
+  global[0] = N;
+  err = clEnqueueNDRangeKernel(cl.queue, shift, 1, NULL, global, NULL, 0, NULL,
+                               NULL);
+  checkError(err, "enqueuing shift kernel");
+  err = clEnqueueSVMMap(cl.queue, CL_TRUE, CL_MAP_READ, data,
+                        N * sizeof(cl_int), 0, NULL, NULL);
+  checkError(err, "mapping SVM buffer");
+  printData("kernels", data);
+  err = clEnqueueSVMUnmap(cl.queue, data, 0, NULL, NULL);
+  checkError(err, "unmapping SVM buffer");
+
+  cl_int pattern = 7;
+  err = clEnqueueSVMMemFill(cl.queue, data, &pattern, sizeof(cl_int),
+                            2 * sizeof(cl_int), 0, NULL, NULL);
+  checkError(err, "filling SVM buffer");
+  err = clEnqueueSVMMemcpy(cl.queue, CL_TRUE, h_data, data,
+                           N * sizeof(cl_int), 0, NULL, NULL);
+  checkError(err, "copying from SVM buffer");
+  printData("copied", h_data);
+
+  // Freeing from the queue waits for the kernels that use the buffer
+  err = clEnqueueSVMFree(cl.queue, 1, (void**)&data, NULL, NULL, 0, NULL,
+                         NULL);
+  checkError(err, "freeing SVM buffer");
+  err = clFinish(cl.queue);
+  checkError(err, "finishing queue");
+
+  clReleaseKernel(shift);
+  clReleaseKernel(square);
+  releaseContext(cl);
+  return 0;
+}
@@ -0,0 +1,101 @@
+#include "common.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define N 256
+#define TRANSFERS 64
+
+const char* KERNEL_SOURCE =
+  "kernel void scale(global int *data, int factor) \n"
+  "{                                               \n"
+  "  int i = get_global_id(0);                     \n"
+  "  data[i] = i * factor;                         \n"
+  "}                                               \n";
+
+int main(int argc, char* argv[])
+{
+  cl_int err;
+  cl_kernel kernel;
+  cl_command_queue transferQueue;
+  cl_mem data, other;
+  cl_event start;
+  cl_int h_data[N], h_other[TRANSFERS][N], h_result[N];
+
+  Context cl = createContext(KERNEL_SOURCE, "");
+
+  kernel = clCreateKernel(cl.program, "scale", &err);
+  checkError(err, "creating kernel");
+  transferQueue = clCreateCommandQueue(cl.context, cl.device, 0, &err);
+  checkError(err, "creating transfer queue");
+
+  data = clCreateBuffer(cl.context, CL_MEM_READ_WRITE, N * sizeof(cl_int),
+                        NULL, &err);
+  checkError(err, "creating data buffer");
+  other = clCreateBuffer(cl.context, CL_MEM_READ_WRITE, N * sizeof(cl_int),
+                         NULL, &err);
+  checkError(err, "creating other buffer");
+
+  cl_int factor = 3;
+  err = clSetKernelArg(kernel, 0, sizeof(cl_mem), &data);
+  err |= clSetKernelArg(kernel, 1, sizeof(cl_int), &factor);
+  checkError(err, "setting kernel arguments");
+
+  // Start the kernel and a stream of host transfers on another queue
+  // together, so that the transfers overlap the worker processes
+  start = clCreateUserEvent(cl.context, &err);
+  checkError(err, "creating user event");
+
+  size_t global[1] = {N}, local[1] = {16};
+  err = clEnqueueNDRangeKernel(cl.queue, kernel, 1, NULL, global, local, 1,
+                               &start, NULL);
+  checkError(err, "enqueuing kernel");
+  for (int t = 0; t < TRANSFERS; t++)
+  {
+    for (int i = 0; i < N; i++)
+    {
+      h_other[t][i] = t * N + i;
+    }
+    err = clEnqueueWriteBuffer(transferQueue, other, CL_FALSE, 0,
+                               N * sizeof(cl_int), h_other[t],
+                               t ? 0 : 1, t ? NULL : &start, NULL);
+    checkError(err, "writing other buffer");
+  }
+
+  err = clSetUserEventStatus(start, CL_COMPLETE);
+  checkError(err, "starting commands");
+  err = clFinish(transferQueue);
+  checkError(err, "finishing transfers");
+  err = clFinish(cl.queue);
+  checkError(err, "finishing kernel");
+
+  // Every work-group's results are kept, whichever process ran it
+  err = clEnqueueReadBuffer(cl.queue, data, CL_TRUE, 0, N * sizeof(cl_int),
+                            h_result, 0, NULL, NULL);
+  checkError(err, "reading data buffer");
+  int errors = 0;
+  for (int i = 0; i < N; i++)
+  {
+    errors += h_result[i] != i * factor;
+  }
+  printf("kernel errors: %d\n", errors);
+
+  // The last transfer wins, unaffected by the kernel's processes
+  err = clEnqueueReadBuffer(cl.queue, other, CL_TRUE, 0, N * sizeof(cl_int),
+                            h_result, 0, NULL, NULL);
+  checkError(err, "reading other buffer");
+  errors = 0;
+  for (int i = 0; i < N; i++)
+  {
+    errors += h_result[i] != h_other[TRANSFERS - 1][i];
+  }
+  printf("transfer errors: %d\n", errors);
+
+  clReleaseEvent(start);
+  clReleaseMemObject(other);
+  clReleaseMemObject(data);
+  clReleaseCommandQueue(transferQueue);
+  clReleaseKernel(kernel);
+  releaseContext(cl);
+  return 0;
+}
@@ -0,0 +1,63 @@
+# run_trace_test.py (Oclgrind)
+# Copyright (c) 2013-2019, James Price and Simon McIntosh-Smith,
+# University of Bristol. All rights reserved.
+#
+# This program is provided under a three-clause BSD license. For full
+# license terms please see the LICENSE file distributed with this
+# source code.
+
+import os
+import subprocess
+import sys
+
+# Check arguments
+if len(sys.argv) != 4:
+  print('Usage: python run_trace_test.py OCLGRIND-KERNEL OCLGRIND-TRACE '
+        'TEST.sim')
+  sys.exit(1)
+
+oclgrind_kernel = sys.argv[1]
+oclgrind_trace  = sys.argv[2]
+test_full_path  = os.path.realpath(sys.argv[3])
+test_name       = os.path.splitext(os.path.basename(test_full_path))[0]
+test_ref        = os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                               test_name + '.ref')
+
+def fail():
+  print('FAILED')
+  sys.exit(1)
+
+def run(output_suffix):
+  trace = os.path.abspath(test_name + output_suffix + '.trace')
+
+  # Trace the kernel, then compare a summary of the trace to the reference
+  retval = subprocess.call([oclgrind_kernel, '--memory-trace', trace,
+                            os.path.basename(test_full_path)],
+                           cwd=os.path.dirname(test_full_path),
+                           stdout=subprocess.DEVNULL)
+  if retval != 0:
+    print('Test returned non-zero value (' + str(retval) + ')')
+    fail()
+
+  out = subprocess.check_output([oclgrind_trace, '--summary', trace])
+  out = out.decode().splitlines()
+  ref = open(test_ref).read().splitlines()
+  if out != ref:
+    print('Expected:')
+    print('\n'.join(ref))
+    print('Found:')
+    print('\n'.join(out))
+    fail()
+
+print('Running test with optimisations')
+run('')
+print('PASSED')
+
+print('')
+print('Running test without optimisations')
+os.environ["OCLGRIND_BUILD_OPTIONS"] = "-cl-opt-disable"
+run('_noopt')
+print('PASSED')
+
+# Test passed
+sys.exit(0)